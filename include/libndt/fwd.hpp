@@ -0,0 +1,23 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_FWD_HPP
+#define MEASUREMENT_KIT_LIBNDT_FWD_HPP
+
+/// \file fwd.hpp
+///
+/// \brief Forward declarations of the libndt API. Include this header, rather
+/// than libndt.hpp, in headers that only refer to these classes by pointer or
+/// reference, such that only the translation units actually using libndt pay
+/// the cost of including libndt.hpp and its dependencies.
+
+namespace measurement_kit {
+namespace libndt {
+
+class Client;
+class EventHandler;
+class Settings;
+
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_FWD_HPP
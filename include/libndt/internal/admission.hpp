@@ -0,0 +1,121 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
+
+// libndt/internal/admission.hpp - admission control for subtests
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// Admission limits the subtests that many clients run at the same time, such
+// that they do not compete for the CPU, the memory, and the bandwidth. Before
+// running a subtest, a client calls Acquire() with the memory the subtest is
+// going to use for its buffers, and then Release() with the same memory when
+// the subtest is done. Zero limits mean no limit. A subtest that needs more
+// memory than the limit is admitted when no other subtest is running, so that
+// it does not wait forever. It is safe to use an Admission from many threads.
+class Admission {
+ public:
+  Admission(Size max_subtests, Size max_memory) noexcept;
+  Admission(const Admission &) = delete;
+  Admission &operator=(const Admission &) = delete;
+  Admission(Admission &&) = delete;
+  Admission &operator=(Admission &&) = delete;
+  ~Admission() noexcept;
+
+  // Acquire waits until we can run a subtest using @p memory bytes. Returns
+  // false, without admitting the subtest, if @p cancelled becomes true
+  // while waiting, which we check periodically.
+  bool Acquire(Size memory, const std::atomic<bool> &cancelled) noexcept;
+
+  // Release tells us that a subtest using @p memory bytes is done.
+  void Release(Size memory) noexcept;
+
+  // Subtests returns the number of running subtests.
+  Size Subtests() const noexcept;
+
+  // Memory returns the memory used by the running subtests.
+  Size Memory() const noexcept;
+
+ private:
+  // Returns whether we can admit a subtest using @p memory bytes.
+  bool admissible(Size memory) const noexcept;
+
+  Size max_subtests_;
+  Size max_memory_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  Size subtests_ = 0;  // protected by mutex_
+  Size memory_ = 0;    // ditto
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+Admission::Admission(Size max_subtests, Size max_memory) noexcept
+    : max_subtests_{max_subtests}, max_memory_{max_memory} {}
+
+Admission::~Admission() noexcept {}
+
+bool Admission::Acquire(Size memory,
+                        const std::atomic<bool> &cancelled) noexcept {
+  // We don't expect Release() to notify a cancellation, thus we wake up
+  // periodically to check whether we've been cancelled.
+  constexpr auto slice = std::chrono::milliseconds(100);
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!admissible(memory)) {
+    if (cancelled) {
+      return false;
+    }
+    (void)cond_.wait_for(lock, slice);
+  }
+  subtests_ += 1;
+  memory_ += memory;
+  return true;
+}
+
+void Admission::Release(Size memory) noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    subtests_ = (subtests_ > 0) ? subtests_ - 1 : 0;
+    memory_ = (memory_ > memory) ? memory_ - memory : 0;
+  }
+  cond_.notify_all();
+}
+
+Size Admission::Subtests() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return subtests_;
+}
+
+Size Admission::Memory() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return memory_;
+}
+
+bool Admission::admissible(Size memory) const noexcept {
+  if (subtests_ <= 0) {
+    return true;
+  }
+  if (max_subtests_ > 0 && subtests_ >= max_subtests_) {
+    return false;
+  }
+  return max_memory_ <= 0 ||
+         (memory_ <= max_memory_ && memory <= max_memory_ - memory_);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
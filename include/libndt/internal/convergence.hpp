@@ -0,0 +1,101 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
+
+// libndt/internal/convergence.hpp - throughput convergence detection
+
+#include <cmath>
+#include <deque>
+#include <utility>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// Convergence tells when the throughput measured by a subtest has stabilized,
+// such that the subtest can stop early. The subtest calls Update() at regular
+// intervals with the bytes transferred so far. We consider the latest `window`
+// seconds and compare the speed in the first half of the window with the speed
+// in the second half. The throughput has converged when the subtest has run
+// for at least `min_runtime` seconds and these speeds are within `tolerance`
+// (e.g. 0.05 for 5%) of the speed over the whole window. Since the window only
+// starts when we're out of the TCP startup phase, the speed over the window
+// is a better estimate than the average since the beginning. A zero or
+// negative `tolerance` disables the detection.
+class Convergence {
+ public:
+  Convergence(double tolerance, double window, double min_runtime) noexcept;
+
+  // Enabled returns whether the detection is enabled.
+  bool Enabled() const noexcept;
+
+  // Update records that @p bytes were transferred in the first @p elapsed
+  // seconds of the subtest and returns whether the throughput has converged.
+  bool Update(double elapsed, double bytes) noexcept;
+
+  // Speed returns the speed over the latest window, in bytes per second, or
+  // zero if we've not run for a whole window yet.
+  double Speed() const noexcept;
+
+ private:
+  double tolerance_;
+  double window_;
+  double min_runtime_;
+  double speed_ = 0.0;
+  std::deque<std::pair<double, double>> points_;  // (elapsed, bytes)
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+Convergence::Convergence(double tolerance, double window,
+                         double min_runtime) noexcept
+    : tolerance_{tolerance}, window_{window}, min_runtime_{min_runtime} {
+  points_.emplace_back(0.0, 0.0);
+}
+
+bool Convergence::Enabled() const noexcept { return tolerance_ > 0.0; }
+
+bool Convergence::Update(double elapsed, double bytes) noexcept {
+  if (!Enabled() || elapsed <= points_.back().first) {
+    return false;
+  }
+  points_.emplace_back(elapsed, bytes);
+  // Keep the newest point that is not newer than the window start, such
+  // that we know when the points fully cover the window.
+  double start = elapsed - window_;
+  while (points_.size() > 1 && points_[1].first <= start) {
+    points_.pop_front();
+  }
+  if (points_.size() < 3 || points_.front().first > start) {
+    return false;
+  }
+  auto &first = points_.front();
+  auto &last = points_.back();
+  speed_ = (last.second - first.second) / (last.first - first.first);
+  if (elapsed < min_runtime_ || speed_ <= 0.0) {
+    return false;
+  }
+  // Split the window at the inner point closest to its middle.
+  double middle = (first.first + last.first) / 2.0;
+  size_t split = 1;
+  for (size_t i = 2; i < points_.size() - 1; ++i) {
+    if (std::abs(points_[i].first - middle) <
+        std::abs(points_[split].first - middle)) {
+      split = i;
+    }
+  }
+  auto &mid = points_[split];
+  double before = (mid.second - first.second) / (mid.first - first.first);
+  double after = (last.second - mid.second) / (last.first - mid.first);
+  return std::abs(before - speed_) <= tolerance_ * speed_ &&
+         std::abs(after - speed_) <= tolerance_ * speed_;
+}
+
+double Convergence::Speed() const noexcept { return speed_; }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
@@ -0,0 +1,124 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
+
+// libndt/internal/counters.hpp - counters for hot paths
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// ShardedCounters is an array of @p N counters that many threads may update
+// at the same time, e.g., the threads running ndt7 flows. Each thread updates
+// one of @p Shards shards, which we assign to threads round robin, such that
+// up to @p Shards threads never write the same cache line. A shard is padded
+// so that it never shares a cache line with another shard or with other
+// data. Add() is a relaxed atomic addition to the shard of the thread, which
+// is cheap because no other thread is usually writing that cache line. Get()
+// sums the shards and may return a slightly stale value while other threads
+// update the counters, which is fine for counters.
+template <size_t N, size_t Shards = 16>
+class ShardedCounters {
+ public:
+  ShardedCounters() noexcept;
+  ShardedCounters(const ShardedCounters &) = delete;
+  ShardedCounters &operator=(const ShardedCounters &) = delete;
+  ShardedCounters(ShardedCounters &&) = delete;
+  ShardedCounters &operator=(ShardedCounters &&) = delete;
+  ~ShardedCounters() noexcept;
+
+  // Add adds @p value to the @p index-th counter. @p index must be less
+  // than @p N.
+  void Add(size_t index, uint64_t value = 1) noexcept;
+
+  // Get returns the value of the @p index-th counter. @p index must be less
+  // than @p N.
+  uint64_t Get(size_t index) const noexcept;
+
+  // Reset sets all the counters to zero.
+  void Reset() noexcept;
+
+ private:
+  static constexpr size_t padding = 64;  // size of a cache line
+
+  class Shard {
+   public:
+    std::atomic<uint64_t> values[N];
+    char after[padding];
+  };
+
+  char before_[padding] = {};
+  Shard shards_[Shards];
+};
+
+// CounterShard returns the number of the calling thread, which we assign
+// when the thread first calls it, and which we use to select a shard.
+size_t CounterShard() noexcept;
+
+// Log2Bucket returns the bucket of @p value in a histogram with @p buckets
+// buckets, where bucket zero counts zeros, bucket i counts the values in
+// [2^(i-1), 2^i), and the last bucket also counts all the larger values.
+// @p buckets must be positive.
+size_t Log2Bucket(uint64_t value, size_t buckets) noexcept;
+
+template <size_t N, size_t Shards>
+ShardedCounters<N, Shards>::ShardedCounters() noexcept {
+  Reset();
+}
+
+template <size_t N, size_t Shards>
+ShardedCounters<N, Shards>::~ShardedCounters() noexcept {}
+
+template <size_t N, size_t Shards>
+void ShardedCounters<N, Shards>::Add(size_t index, uint64_t value) noexcept {
+  shards_[CounterShard() % Shards].values[index].fetch_add(
+      value, std::memory_order_relaxed);
+}
+
+template <size_t N, size_t Shards>
+uint64_t ShardedCounters<N, Shards>::Get(size_t index) const noexcept {
+  uint64_t sum = 0;
+  for (auto &shard : shards_) {
+    sum += shard.values[index].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+template <size_t N, size_t Shards>
+void ShardedCounters<N, Shards>::Reset() noexcept {
+  for (auto &shard : shards_) {
+    for (auto &value : shard.values) {
+      value.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+size_t CounterShard() noexcept {
+  static std::atomic<size_t> next{0};
+  static thread_local size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed);
+  return shard;
+}
+
+size_t Log2Bucket(uint64_t value, size_t buckets) noexcept {
+  size_t bucket = 0;
+  while (value > 0 && bucket < buckets - 1) {
+    value >>= 1;
+    bucket += 1;
+  }
+  return (value > 0) ? buckets - 1 : bucket;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
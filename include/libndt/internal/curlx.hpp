@@ -10,6 +10,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <sstream>
 
@@ -34,14 +35,34 @@ using UniqueCurl = std::unique_ptr<CURL, CurlDeleter>;
 // CurlWriteCb is the signature of the callback used by curl.
 using CurlWriteCb = size_t (*)(char *ptr, size_t size, size_t nmemb, void *userdata);
 
+// CurlProgressCb is the signature of the progress callback used by curl.
+using CurlProgressCb = int (*)(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                               curl_off_t ultotal, curl_off_t ulnow);
+
 // Curlx allows to emulate failures in libcurl code.
 class Curlx {
  public:
   explicit Curlx(const Logger &logger) noexcept;
 
+  // SetCancelled tells Curlx to abort the requests in progress as soon as
+  // @p cancelled returns true. Curl calls it about once per second, and
+  // more frequently while it is transferring data.
+  void SetCancelled(std::function<bool()> cancelled) noexcept;
+
+  // Cancelled returns whether the callback set using SetCancelled() tells
+  // us to abort the request in progress.
+  bool Cancelled() const noexcept;
+
   virtual bool GetMaybeSOCKS5(const std::string &proxy_port, const std::string &url,
                               long timeout, std::string *body) noexcept;
 
+  // GetMaybeSOCKS5 is like the above function except that it uses @p handle,
+  // creating it if it is empty, such that the caller can reuse the handle,
+  // and therefore its live connections and DNS cache, across requests.
+  virtual bool GetMaybeSOCKS5(UniqueCurl &handle, const std::string &proxy_port,
+                              const std::string &url, long timeout,
+                              std::string *body) noexcept;
+
   virtual bool Get(UniqueCurl &handle, const std::string &url, long timeout,
                    std::string *body) noexcept;
 
@@ -57,8 +78,15 @@ class Curlx {
 
   virtual CURLcode SetoptFailonerr(UniqueCurl &handle) noexcept;
 
+  // SetoptProgress enables the progress @p callback, which we pass the
+  // @p pointer and can abort the request by returning nonzero.
+  virtual CURLcode SetoptProgress(UniqueCurl &handle, CurlProgressCb callback,
+                                  void *pointer) noexcept;
+
   virtual CURLcode Perform(UniqueCurl &handle) noexcept;
 
+  virtual void Reset(UniqueCurl &handle) noexcept;
+
   virtual UniqueCurl NewUniqueCurl() noexcept;
 
   virtual CURLcode GetinfoResponseCode(UniqueCurl &handle, long *response_code) noexcept;
@@ -67,8 +95,10 @@ class Curlx {
 
  private:
   const Logger &logger_;
+  std::function<bool()> cancelled_;
 };
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 }  // namespace internal
 }  // namespace libndt
 }  // namespace measurement_kit
@@ -98,6 +128,12 @@ static size_t libndt_curl_callback(char *ptr, size_t size, size_t nmemb, void *u
   return nmemb;
 }
 
+static int libndt_curl_progress(void *clientp, curl_off_t, curl_off_t,
+                                curl_off_t, curl_off_t) {
+  using namespace measurement_kit::libndt::internal;
+  return static_cast<const Curlx *>(clientp)->Cancelled() ? 1 : 0;
+}
+
 }  // extern "C"
 namespace measurement_kit {
 namespace libndt {
@@ -111,9 +147,28 @@ void CurlDeleter::operator()(CURL *handle) noexcept {
 
 Curlx::Curlx(const Logger &logger) noexcept : logger_{logger} {}
 
+void Curlx::SetCancelled(std::function<bool()> cancelled) noexcept {
+  cancelled_ = std::move(cancelled);
+}
+
+bool Curlx::Cancelled() const noexcept { return cancelled_ && cancelled_(); }
+
 bool Curlx::GetMaybeSOCKS5(const std::string &proxy_port, const std::string &url,
                            long timeout, std::string *body) noexcept {
-  auto handle = this->NewUniqueCurl();
+  UniqueCurl handle;
+  return this->GetMaybeSOCKS5(handle, proxy_port, url, timeout, body);
+}
+
+bool Curlx::GetMaybeSOCKS5(UniqueCurl &handle, const std::string &proxy_port,
+                           const std::string &url, long timeout,
+                           std::string *body) noexcept {
+  if (handle) {
+    // Forget the options used by the previous request. This does not close
+    // the live connections, which is the point of reusing the handle.
+    this->Reset(handle);
+  } else {
+    handle = this->NewUniqueCurl();
+  }
   if (!handle) {
     LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot initialize cURL");
     return false;
@@ -156,6 +211,11 @@ bool Curlx::Get(UniqueCurl &handle, const std::string &url, long timeout,
     LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot set fail-on-error option");
     return false;
   }
+  if (cancelled_ &&
+      this->SetoptProgress(handle, libndt_curl_progress, this) != CURLE_OK) {
+    LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot set progress callback");
+    return false;
+  }
   LIBNDT_LOGGER_DEBUG(logger_, "curlx: performing request");
   auto rv = this->Perform(handle);
   if (rv != CURLE_OK) {
@@ -210,11 +270,29 @@ CURLcode Curlx::SetoptFailonerr(UniqueCurl &handle) noexcept {
   return ::curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
 }
 
+CURLcode Curlx::SetoptProgress(UniqueCurl &handle, CurlProgressCb callback,
+                               void *pointer) noexcept {
+  LIBNDT_ASSERT(handle);
+  CURLcode rv = ::curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, callback);
+  if (rv == CURLE_OK) {
+    rv = ::curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, pointer);
+  }
+  if (rv == CURLE_OK) {
+    rv = ::curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+  }
+  return rv;
+}
+
 CURLcode Curlx::Perform(UniqueCurl &handle) noexcept {
   LIBNDT_ASSERT(handle);
   return ::curl_easy_perform(handle.get());
 }
 
+void Curlx::Reset(UniqueCurl &handle) noexcept {
+  LIBNDT_ASSERT(handle);
+  ::curl_easy_reset(handle.get());
+}
+
 UniqueCurl Curlx::NewUniqueCurl() noexcept { return UniqueCurl{::curl_easy_init()}; }
 
 CURLcode Curlx::GetinfoResponseCode(UniqueCurl &handle, long *response_code) noexcept {
@@ -224,6 +302,7 @@ CURLcode Curlx::GetinfoResponseCode(UniqueCurl &handle, long *response_code) noe
 }
 
 Curlx::~Curlx() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -59,11 +59,13 @@ enum class Err {
   eof,       // We got an unexpected EOF
   socks5h,   // SOCKSv5 protocol error
   ws_proto,  // WebSocket protocol error
+  cancelled, // The test has been cancelled
 };
 
 std::string libndt_perror(Err err) noexcept;
 std::string ssl_format_error() noexcept;
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 std::string libndt_perror(Err err) noexcept {
   std::string rv;
   //
@@ -100,6 +102,7 @@ std::string libndt_perror(Err err) noexcept {
     LIBNDT_PERROR(ssl_want_write);
     LIBNDT_PERROR(ssl_syscall);
     LIBNDT_PERROR(ws_proto);
+    LIBNDT_PERROR(cancelled);
   }
 #undef LIBNDT_PERROR  // Tidy
   //
@@ -122,6 +125,7 @@ std::string ssl_format_error() noexcept {
   }
   return ss.str();
 }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -0,0 +1,346 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
+
+// libndt/internal/jsonscan.hpp - allocation free JSON field extraction
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// JsonScanField is an integer field that JsonScan() should extract. Set
+// name to the name of the field. On return, found tells whether the field
+// was present and was an integer that fits into value.
+struct JsonScanField {
+  const char *name = nullptr;
+  int64_t value = 0;
+  bool found = false;
+};
+
+// JsonScan scans the JSON object in @p data of size @p size, without
+// allocating memory or throwing. It looks for the integer @p fields inside
+// the @p object member of that object (e.g. the "TCPInfo" object of a ndt7
+// measurement) and tells in @p has_member whether the topmost object has a
+// member called @p member (e.g. "ConnectionInfo"). Returns false if @p data
+// is not a valid JSON object, in which case the outputs are unspecified.
+//
+// Member names are compared without processing escapes. This is fine for
+// ndt7 measurements whose names are plain ASCII identifiers.
+bool JsonScan(const char *data, size_t size, const char *object,
+              JsonScanField *fields, size_t nfields, const char *member,
+              bool *has_member) noexcept;
+
+// JsonScanner is the implementation of JsonScan().
+class JsonScanner {
+ public:
+  JsonScanner(const char *data, size_t size) noexcept;
+
+  // Scan implements JsonScan().
+  bool Scan(const char *object, JsonScanField *fields, size_t nfields,
+            const char *member, bool *has_member) noexcept;
+
+ private:
+  // Maximum nesting of the values we skip. The measurements we scan are
+  // not deeply nested, so anything deeper is most likely garbage.
+  static constexpr unsigned int max_depth = 32;
+
+  void skip_whitespace() noexcept;
+  bool expect(char c) noexcept;
+  bool scan_string(const char **base, size_t *count) noexcept;
+  bool scan_number(JsonScanField *field) noexcept;
+  bool skip_literal(const char *literal) noexcept;
+  bool skip_value(unsigned int depth) noexcept;
+  bool scan_fields(JsonScanField *fields, size_t nfields) noexcept;
+
+  const char *p_;
+  const char *end_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+bool JsonScan(const char *data, size_t size, const char *object,
+              JsonScanField *fields, size_t nfields, const char *member,
+              bool *has_member) noexcept {
+  JsonScanner scanner{data, size};
+  return scanner.Scan(object, fields, nfields, member, has_member);
+}
+
+// Returns whether the @p count bytes at @p base are equal to @p name.
+static bool json_scan_equal(const char *base, size_t count,
+                            const char *name) noexcept {
+  return name != nullptr && strlen(name) == count &&
+         memcmp(base, name, count) == 0;
+}
+
+JsonScanner::JsonScanner(const char *data, size_t size) noexcept
+    : p_{data}, end_{data + size} {}
+
+bool JsonScanner::Scan(const char *object, JsonScanField *fields,
+                       size_t nfields, const char *member,
+                       bool *has_member) noexcept {
+  for (size_t i = 0; i < nfields; ++i) {
+    fields[i].value = 0;
+    fields[i].found = false;
+  }
+  if (has_member != nullptr) {
+    *has_member = false;
+  }
+  skip_whitespace();
+  if (!expect('{')) {
+    return false;
+  }
+  skip_whitespace();
+  if (p_ < end_ && *p_ == '}') {
+    ++p_;
+  } else {
+    for (;;) {
+      const char *name = nullptr;
+      size_t count = 0;
+      skip_whitespace();
+      if (!scan_string(&name, &count)) {
+        return false;
+      }
+      skip_whitespace();
+      if (!expect(':')) {
+        return false;
+      }
+      skip_whitespace();
+      if (has_member != nullptr && json_scan_equal(name, count, member)) {
+        *has_member = true;
+      }
+      if (json_scan_equal(name, count, object) && p_ < end_ && *p_ == '{') {
+        if (!scan_fields(fields, nfields)) {
+          return false;
+        }
+      } else if (!skip_value(0)) {
+        return false;
+      }
+      skip_whitespace();
+      if (p_ < end_ && *p_ == ',') {
+        ++p_;
+        continue;
+      }
+      if (!expect('}')) {
+        return false;
+      }
+      break;
+    }
+  }
+  skip_whitespace();
+  return p_ == end_;
+}
+
+void JsonScanner::skip_whitespace() noexcept {
+  while (p_ < end_ &&
+         (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+    ++p_;
+  }
+}
+
+bool JsonScanner::expect(char c) noexcept {
+  if (p_ >= end_ || *p_ != c) {
+    return false;
+  }
+  ++p_;
+  return true;
+}
+
+bool JsonScanner::scan_string(const char **base, size_t *count) noexcept {
+  if (!expect('"')) {
+    return false;
+  }
+  const char *begin = p_;
+  while (p_ < end_) {
+    char c = *p_;
+    if (c == '"') {
+      *base = begin;
+      *count = (size_t)(p_ - begin);
+      ++p_;
+      return true;
+    }
+    if ((unsigned char)c < 0x20) {
+      return false;  // control characters must be escaped
+    }
+    if (c == '\\') {
+      ++p_;  // we do not validate escapes, just skip the escaped char
+      if (p_ >= end_) {
+        return false;
+      }
+    }
+    ++p_;
+  }
+  return false;
+}
+
+bool JsonScanner::scan_number(JsonScanField *field) noexcept {
+  bool negative = false;
+  if (p_ < end_ && *p_ == '-') {
+    negative = true;
+    ++p_;
+  }
+  if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+    return false;
+  }
+  // Accumulate as a negative number, since its range is larger.
+  int64_t value = 0;
+  bool overflow = false;
+  while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+    int64_t digit = *p_ - '0';
+    if (value < (INT64_MIN + digit) / 10) {
+      overflow = true;
+    } else {
+      value = value * 10 - digit;
+    }
+    ++p_;
+  }
+  bool integral = true;
+  if (p_ < end_ && *p_ == '.') {
+    integral = false;
+    ++p_;
+    if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+      return false;
+    }
+    while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+      ++p_;
+    }
+  }
+  if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+    integral = false;
+    ++p_;
+    if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+      ++p_;
+    }
+    if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+      return false;
+    }
+    while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+      ++p_;
+    }
+  }
+  if (field != nullptr && integral && !overflow &&
+      (negative || value != INT64_MIN)) {
+    field->value = negative ? value : -value;
+    field->found = true;
+  }
+  return true;
+}
+
+bool JsonScanner::skip_literal(const char *literal) noexcept {
+  size_t count = strlen(literal);
+  if ((size_t)(end_ - p_) < count || memcmp(p_, literal, count) != 0) {
+    return false;
+  }
+  p_ += count;
+  return true;
+}
+
+bool JsonScanner::skip_value(unsigned int depth) noexcept {
+  if (depth > max_depth || p_ >= end_) {
+    return false;
+  }
+  switch (*p_) {
+    case '"': {
+      const char *base = nullptr;
+      size_t count = 0;
+      return scan_string(&base, &count);
+    }
+    case '{':
+    case '[': {
+      bool is_object = *p_ == '{';
+      char close = is_object ? '}' : ']';
+      ++p_;
+      skip_whitespace();
+      if (p_ < end_ && *p_ == close) {
+        ++p_;
+        return true;
+      }
+      for (;;) {
+        skip_whitespace();
+        if (is_object) {
+          const char *base = nullptr;
+          size_t count = 0;
+          if (!scan_string(&base, &count)) {
+            return false;
+          }
+          skip_whitespace();
+          if (!expect(':')) {
+            return false;
+          }
+          skip_whitespace();
+        }
+        if (!skip_value(depth + 1)) {
+          return false;
+        }
+        skip_whitespace();
+        if (p_ < end_ && *p_ == ',') {
+          ++p_;
+          continue;
+        }
+        return expect(close);
+      }
+    }
+    case 't':
+      return skip_literal("true");
+    case 'f':
+      return skip_literal("false");
+    case 'n':
+      return skip_literal("null");
+    default:
+      return scan_number(nullptr);
+  }
+}
+
+bool JsonScanner::scan_fields(JsonScanField *fields, size_t nfields) noexcept {
+  if (!expect('{')) {
+    return false;
+  }
+  skip_whitespace();
+  if (p_ < end_ && *p_ == '}') {
+    ++p_;
+    return true;
+  }
+  for (;;) {
+    const char *name = nullptr;
+    size_t count = 0;
+    skip_whitespace();
+    if (!scan_string(&name, &count)) {
+      return false;
+    }
+    skip_whitespace();
+    if (!expect(':')) {
+      return false;
+    }
+    skip_whitespace();
+    JsonScanField *field = nullptr;
+    for (size_t i = 0; i < nfields; ++i) {
+      if (json_scan_equal(name, count, fields[i].name)) {
+        field = &fields[i];
+        break;
+      }
+    }
+    if (field != nullptr && p_ < end_ && (*p_ == '-' || (*p_ >= '0' && *p_ <= '9'))) {
+      if (!scan_number(field)) {
+        return false;
+      }
+    } else if (!skip_value(1)) {
+      return false;
+    }
+    skip_whitespace();
+    if (p_ < end_ && *p_ == ',') {
+      ++p_;
+      continue;
+    }
+    return expect('}');
+  }
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
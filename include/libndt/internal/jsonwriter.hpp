@@ -0,0 +1,86 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
+
+// libndt/internal/jsonwriter.hpp - allocation free JSON writer
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// JsonWriter writes JSON into a caller provided buffer, without allocating
+// memory. It is not a general purpose writer: the caller is responsible for
+// emitting the punctuation and the already quoted member names, which is
+// fine for serializing structures whose shape is known at compile time like
+// the ndt7 measurements. If the buffer is too small, the writer stops writing
+// and Good() returns false.
+class JsonWriter {
+ public:
+  JsonWriter(char *base, Size count) noexcept;
+
+  // Raw writes the @p count bytes at @p s as they are.
+  void Raw(const char *s, size_t count) noexcept;
+
+  // Raw writes the zero terminated string @p s as it is.
+  void Raw(const char *s) noexcept;
+
+  // Uint64 writes @p value as a JSON number.
+  void Uint64(uint64_t value) noexcept;
+
+  // Good returns false if the buffer was not large enough.
+  bool Good() const noexcept;
+
+  // Length returns the number of bytes written so far.
+  Size Length() const noexcept;
+
+ private:
+  char *base_;
+  Size count_;
+  Size offset_ = 0;
+  bool good_ = true;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+JsonWriter::JsonWriter(char *base, Size count) noexcept
+    : base_{base}, count_{count} {}
+
+void JsonWriter::Raw(const char *s, size_t count) noexcept {
+  if (!good_ || count > count_ - offset_) {
+    good_ = false;
+    return;
+  }
+  memcpy(base_ + offset_, s, count);
+  offset_ += count;
+}
+
+void JsonWriter::Raw(const char *s) noexcept { Raw(s, strlen(s)); }
+
+void JsonWriter::Uint64(uint64_t value) noexcept {
+  char digits[20];  // UINT64_MAX has 20 digits
+  size_t n = sizeof(digits);
+  do {
+    digits[--n] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  Raw(digits + n, sizeof(digits) - n);
+}
+
+bool JsonWriter::Good() const noexcept { return good_; }
+
+Size JsonWriter::Length() const noexcept { return offset_; }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
@@ -0,0 +1,156 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
+
+// libndt/internal/latency.hpp - round trip times measured under load
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// LatencySummary summarizes the round trip times collected by a Latency, in
+// microseconds. All the fields are zero when we have no round trip times.
+class LatencySummary {
+ public:
+  uint64_t count = 0;
+  uint64_t min = 0;
+  uint64_t p50 = 0;
+  uint64_t p90 = 0;
+  uint64_t p99 = 0;
+  uint64_t max = 0;
+};
+
+// Latency collects the round trip times measured while a subtest saturates
+// the path, by sending WebSocket PING frames whose payload is the time at
+// which we sent them, which the server echoes back in PONG frames. Since the
+// PONG frames are queued behind the data, these round trip times include the
+// queueing delay caused by the subtest itself. We tag our payloads with a
+// magic, such that we ignore unsolicited PONG frames. It is safe to add round
+// trip times from many threads.
+class Latency {
+ public:
+  static constexpr size_t payload_size = 16;
+  static constexpr uint64_t magic = 0x31474e495054444e;  // "NDTPING1"
+  static constexpr size_t max_samples = 1 << 16;
+
+  Latency() noexcept;
+  Latency(const Latency &) = delete;
+  Latency &operator=(const Latency &) = delete;
+  Latency(Latency &&) = delete;
+  Latency &operator=(Latency &&) = delete;
+  ~Latency() noexcept;
+
+  // Encode writes into @p base, which must be payload_size bytes, the payload
+  // of a PING frame sent at @p now_usec microseconds.
+  static void Encode(uint8_t *base, uint64_t now_usec) noexcept;
+
+  // OnPong records the round trip time of the PING echoed by the PONG frame
+  // with @p count bytes of payload at @p base, received at @p now_usec
+  // microseconds. Returns false if the PONG is not echoing one of our PINGs.
+  bool OnPong(const uint8_t *base, uint64_t count, uint64_t now_usec) noexcept;
+
+  // Add records a round trip time of @p rtt_usec microseconds. We keep the
+  // first max_samples round trip times and ignore the other ones.
+  void Add(uint64_t rtt_usec) noexcept;
+
+  // Reset forgets the round trip times recorded so far.
+  void Reset() noexcept;
+
+  // Summarize returns the summary of the round trip times recorded so far,
+  // using the nearest rank method for the percentiles.
+  LatencySummary Summarize() const noexcept;
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<uint64_t> samples_;  // protected by mutex_
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t Latency::payload_size;
+constexpr uint64_t Latency::magic;
+constexpr size_t Latency::max_samples;
+
+Latency::Latency() noexcept {}
+
+Latency::~Latency() noexcept {}
+
+void Latency::Encode(uint8_t *base, uint64_t now_usec) noexcept {
+  memcpy(base, &magic, sizeof(magic));
+  memcpy(base + sizeof(magic), &now_usec, sizeof(now_usec));
+}
+
+bool Latency::OnPong(const uint8_t *base, uint64_t count,
+                     uint64_t now_usec) noexcept {
+  uint64_t value = 0;
+  if (base == nullptr || count != payload_size) {
+    return false;
+  }
+  memcpy(&value, base, sizeof(value));
+  if (value != magic) {
+    return false;
+  }
+  memcpy(&value, base + sizeof(magic), sizeof(value));
+  if (value > now_usec) {
+    return false;  // the payload cannot come from the future
+  }
+  Add(now_usec - value);
+  return true;
+}
+
+void Latency::Add(uint64_t rtt_usec) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  if (samples_.size() < max_samples) {
+    samples_.push_back(rtt_usec);
+  }
+}
+
+void Latency::Reset() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  samples_.clear();
+}
+
+// Returns the @p percentile percentile of the sorted @p samples, which must
+// not be empty, using the nearest rank method.
+static uint64_t latency_percentile(const std::vector<uint64_t> &samples,
+                                   double percentile) noexcept {
+  double rank = std::ceil(percentile / 100.0 * (double)samples.size());
+  size_t index = (rank >= 1.0) ? (size_t)rank - 1 : 0;
+  return samples[std::min(index, samples.size() - 1)];
+}
+
+LatencySummary Latency::Summarize() const noexcept {
+  std::vector<uint64_t> samples;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    samples = samples_;
+  }
+  LatencySummary summary;
+  if (samples.empty()) {
+    return summary;
+  }
+  std::sort(samples.begin(), samples.end());
+  summary.count = samples.size();
+  summary.min = samples.front();
+  summary.p50 = latency_percentile(samples, 50.0);
+  summary.p90 = latency_percentile(samples, 90.0);
+  summary.p99 = latency_percentile(samples, 99.0);
+  summary.max = samples.back();
+  return summary;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
@@ -51,6 +51,7 @@ class NoLogger : public Logger {
 #define LIBNDT_LOGGER_DEBUG(logger, statements) \
   LIBNDT_LOGGER_LEVEL_(logger, debug, statements)
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 Logger::~Logger() noexcept {}
 
 bool NoLogger::is_warning_enabled() const noexcept {
@@ -72,6 +73,7 @@ void NoLogger::emit_info(const std::string &) const noexcept {}
 void NoLogger::emit_debug(const std::string &) const noexcept {}
 
 NoLogger::~NoLogger() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -0,0 +1,277 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
+
+// libndt/internal/mlabnscache.hpp - cache of mlab-ns results
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/assert.hpp"
+#include "libndt/internal/curlx.hpp"
+#include "libndt/internal/logger.hpp"
+#include "libndt/timeout.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// MlabnsCache caches the servers returned by mlab-ns, keyed by the URL of
+// the query, which identifies both the protocol and the policy. An entry is
+// valid for the TTL passed to Put(). Once three quarters of the TTL have
+// elapsed, Get() still returns the entry but tells the caller to refresh it,
+// which the caller can do in the background using Prefetch(). The cache also
+// keeps the idle cURL handles used to query mlab-ns, such that subsequent
+// queries reuse their connections. It is safe to use a MlabnsCache from many
+// threads.
+class MlabnsCache {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  MlabnsCache() noexcept;
+  MlabnsCache(const MlabnsCache &) = delete;
+  MlabnsCache &operator=(const MlabnsCache &) = delete;
+  MlabnsCache(MlabnsCache &&) = delete;
+  MlabnsCache &operator=(MlabnsCache &&) = delete;
+  virtual ~MlabnsCache() noexcept;
+
+  // Get copies into @p fqdns the servers cached for @p key and returns true,
+  // or returns false if there is no such entry or the entry has expired.
+  // On success, @p refresh tells whether the entry should be refreshed.
+  bool Get(const std::string &key, std::vector<std::string> *fqdns,
+           bool *refresh) noexcept;
+
+  // Put caches @p fqdns for @p key for @p ttl seconds.
+  void Put(const std::string &key, std::vector<std::string> fqdns,
+           Timeout ttl) noexcept;
+
+  // Load merges into the cache the valid entries saved at @p path by Save(),
+  // keeping the entries we already have. Returns false on I/O error.
+  bool Load(const std::string &path) noexcept;
+
+  // Save writes the valid entries to @p path. Returns false on I/O error.
+  bool Save(const std::string &path) noexcept;
+
+  // Fetch queries @p url using one of the idle cURL handles of the cache, or
+  // a new handle, which it keeps for later fetches. Concurrent fetches use
+  // distinct handles and run in parallel. See Curlx::GetMaybeSOCKS5() for
+  // the other arguments.
+  virtual bool Fetch(Curlx &curlx, const std::string &proxy_port,
+                     const std::string &url, long timeout,
+                     std::string *body) noexcept;
+
+  // Prefetch runs @p func in a detached background thread, unless a previous
+  // prefetch is still running, in which case it does nothing. Returns whether
+  // it started @p func. If the cache is shared, @p func should hold a
+  // reference to it, such that the cache outlives the thread. Otherwise, the
+  // destructor waits for the prefetch to complete.
+  bool Prefetch(std::function<void()> func) noexcept;
+
+  // Reuse at most these many idle cURL handles.
+  static constexpr size_t max_idle_handles = 4;
+
+  // Global returns the cache shared by all the clients in this process.
+  static std::shared_ptr<MlabnsCache> Global() noexcept;
+
+ protected:
+  // Now returns the current time. Override to control time in tests.
+  virtual Clock::time_point Now() const noexcept;
+
+ private:
+  struct Entry {
+    std::vector<std::string> fqdns;
+    int64_t refresh_after = 0;  // seconds since the epoch
+    int64_t expires = 0;        // ditto
+  };
+
+  int64_t now_seconds() const noexcept;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;  // protected by mutex_
+  bool prefetching_ = false;              // ditto
+  std::condition_variable prefetched_;    // signals !prefetching_
+  std::vector<UniqueCurl> handles_;       // idle, protected by mutex_
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t MlabnsCache::max_idle_handles;
+
+MlabnsCache::MlabnsCache() noexcept {}
+
+MlabnsCache::~MlabnsCache() noexcept {
+  // When the prefetch holds a reference to the cache, as it should with a
+  // shared cache, prefetching_ is already false here.
+  std::unique_lock<std::mutex> lock{mutex_};
+  prefetched_.wait(lock, [this]() { return !prefetching_; });
+}
+
+bool MlabnsCache::Get(const std::string &key, std::vector<std::string> *fqdns,
+                      bool *refresh) noexcept {
+  LIBNDT_ASSERT(fqdns != nullptr && refresh != nullptr);
+  auto now = now_seconds();
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  if (now >= it->second.expires) {
+    entries_.erase(it);
+    return false;
+  }
+  *fqdns = it->second.fqdns;
+  *refresh = now >= it->second.refresh_after;
+  return true;
+}
+
+void MlabnsCache::Put(const std::string &key, std::vector<std::string> fqdns,
+                      Timeout ttl) noexcept {
+  Entry entry;
+  entry.fqdns = std::move(fqdns);
+  auto now = now_seconds();
+  entry.refresh_after = now + (int64_t)ttl - (int64_t)ttl / 4;
+  entry.expires = now + (int64_t)ttl;
+  std::unique_lock<std::mutex> _{mutex_};
+  entries_[key] = std::move(entry);
+}
+
+// The file format is one entry per line, where each line contains the key,
+// the refresh and expiry times, and the servers, separated by spaces. None of
+// these fields can contain spaces, since they're URLs, numbers and FQDNs.
+
+bool MlabnsCache::Load(const std::string &path) noexcept {
+  std::ifstream file{path};
+  if (!file.good()) {
+    return false;
+  }
+  auto now = now_seconds();
+  std::string line;
+  std::unique_lock<std::mutex> _{mutex_};
+  while (std::getline(file, line)) {
+    std::stringstream ss{line};
+    std::string key;
+    Entry entry;
+    if (!(ss >> key >> entry.refresh_after >> entry.expires)) {
+      continue;  // Skip corrupt lines rather than failing altogether
+    }
+    std::string fqdn;
+    while (ss >> fqdn) {
+      entry.fqdns.push_back(std::move(fqdn));
+    }
+    if (now >= entry.expires || entry.fqdns.empty() ||
+        entries_.count(key) > 0) {
+      continue;
+    }
+    entries_[key] = std::move(entry);
+  }
+  return !file.bad();
+}
+
+bool MlabnsCache::Save(const std::string &path) noexcept {
+  std::stringstream ss;
+  {
+    auto now = now_seconds();
+    std::unique_lock<std::mutex> _{mutex_};
+    for (auto &kv : entries_) {
+      if (now >= kv.second.expires) {
+        continue;
+      }
+      ss << kv.first << " " << kv.second.refresh_after << " "
+         << kv.second.expires;
+      for (auto &fqdn : kv.second.fqdns) {
+        ss << " " << fqdn;
+      }
+      ss << "\n";
+    }
+  }
+  // Write a temporary file and rename it, such that concurrent writers and
+  // readers always see a complete file. Of course the last writer wins.
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream file{temp, std::ios::trunc};
+    file << ss.str();
+    if (!file.good()) {
+      return false;
+    }
+  }
+  return ::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool MlabnsCache::Fetch(Curlx &curlx, const std::string &proxy_port,
+                        const std::string &url, long timeout,
+                        std::string *body) noexcept {
+  UniqueCurl handle;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (!handles_.empty()) {
+      handle = std::move(handles_.back());
+      handles_.pop_back();
+    }
+  }
+  bool ok = curlx.GetMaybeSOCKS5(handle, proxy_port, url, timeout, body);
+  std::unique_lock<std::mutex> _{mutex_};
+  if (handle && handles_.size() < max_idle_handles) {
+    handles_.push_back(std::move(handle));
+  }
+  return ok;
+}
+
+bool MlabnsCache::Prefetch(std::function<void()> func) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  if (prefetching_) {
+    return false;
+  }
+  // We detach the thread, such that exiting does not wait for a prefetch,
+  // which may take up to the cURL timeout.
+  try {
+    std::thread{[this, func]() {
+      func();
+      std::unique_lock<std::mutex> lock{mutex_};
+      prefetching_ = false;
+      prefetched_.notify_all();
+    }}.detach();
+  } catch (const std::system_error &) {
+    return false;
+  }
+  prefetching_ = true;
+  return true;
+}
+
+std::shared_ptr<MlabnsCache> MlabnsCache::Global() noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static std::shared_ptr<MlabnsCache> cache{new MlabnsCache};
+  return cache;
+}
+
+MlabnsCache::Clock::time_point MlabnsCache::Now() const noexcept {
+  return Clock::now();
+}
+
+int64_t MlabnsCache::now_seconds() const noexcept {
+  return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+             Now().time_since_epoch())
+      .count();
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
@@ -0,0 +1,206 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
+
+// libndt/internal/payload.hpp - shared upload payload
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <stdint.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/random.hpp"
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// RandomPrintableFill fills @p buffer with @p length random printable
+// characters. The output is cheap rather than unpredictable.
+void RandomPrintableFill(char *buffer, size_t length) noexcept;
+
+// Payload is a read-only buffer of random printable characters that we use as
+// the body of the messages we upload. Since generating it is slow, Get()
+// creates it lazily and then shares it among all the flows and subtests of
+// this process. The buffer is aligned to a page boundary, hence also to a
+// cache line. On Unix, we map it with mmap(), optionally using huge pages, and
+// make it read-only once filled, such that we cannot modify it by mistake
+// (e.g. by masking it in place, which we must do for WebSocket frames).
+class Payload {
+ public:
+  Payload(const Payload &) = delete;
+  Payload &operator=(const Payload &) = delete;
+  Payload(Payload &&) = delete;
+  Payload &operator=(Payload &&) = delete;
+  ~Payload() noexcept;
+
+  // Get returns the payload of @p size bytes, creating it if needed. If
+  // @p huge_pages is true, we try to back the payload with huge pages and
+  // fall back to normal pages. Returns nullptr if @p size is zero or if we
+  // cannot allocate memory.
+  static std::shared_ptr<const Payload> Get(Size size, bool huge_pages) noexcept;
+
+  // Data returns the beginning of the payload.
+  const uint8_t *Data() const noexcept;
+
+  // Length returns the size of the payload.
+  Size Length() const noexcept;
+
+  // HugePages returns whether the payload is backed by huge pages.
+  bool HugePages() const noexcept;
+
+ private:
+  Payload() noexcept;
+
+  // Allocates and fills the payload. Returns false on failure.
+  bool init(Size size, bool huge_pages) noexcept;
+
+  uint8_t *base_ = nullptr;
+  Size size_ = 0;
+  Size mapped_ = 0;  // Size of the mapping, if we used mmap()
+  bool huge_pages_ = false;
+  std::unique_ptr<uint8_t[]> heap_;  // Only used if we cannot mmap()
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void RandomPrintableFill(char *buffer, size_t length) noexcept {
+  static const std::string ascii =
+      " !\"#$%&\'()*+,-./"          // before numbers
+      "0123456789"                  // numbers
+      ":;<=>?@"                     // after numbers
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"  // uppercase
+      "[\\]^_`"                     // between upper and lower
+      "abcdefghijklmnopqrstuvwxyz"  // lowercase
+      "{|}~"                        // final
+      ;
+  // The generator is seeded once per thread. We seed using OpenSSL because
+  // the random device is not actually random in a mingw environment. The
+  // output does not need to be unpredictable, it only needs to be cheap.
+  static thread_local std::mt19937 g{[]() noexcept {
+    uint32_t seed = 0;
+    if (!RandomBytes((uint8_t *)&seed, sizeof(seed))) {
+      seed = (uint32_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    return seed;
+  }()};
+  for (size_t i = 0; i < length; ++i) {
+    buffer[i] = ascii[g() % ascii.size()];
+  }
+}
+
+Payload::Payload() noexcept {}
+
+Payload::~Payload() noexcept {
+#ifndef _WIN32
+  if (mapped_ > 0) {
+    (void)munmap(base_, (size_t)mapped_);
+  }
+#endif
+}
+
+std::shared_ptr<const Payload> Payload::Get(Size size,
+                                            bool huge_pages) noexcept {
+  if (size <= 0 || size > SIZE_MAX / 2) {
+    return nullptr;
+  }
+  // We keep the payloads for the lifetime of the process, such that repeated
+  // runs do not pay the cost of generating them again. There are only a few
+  // distinct sizes in practice, so this does not use much memory.
+  static std::mutex mutex;
+  static std::map<std::pair<Size, bool>, std::shared_ptr<const Payload>> cache;
+  std::unique_lock<std::mutex> _{mutex};
+  auto &entry = cache[std::make_pair(size, huge_pages)];
+  if (!entry) {
+    std::shared_ptr<Payload> payload{new (std::nothrow) Payload};
+    if (!payload || !payload->init(size, huge_pages)) {
+      return nullptr;
+    }
+    entry = std::move(payload);
+  }
+  return entry;
+}
+
+const uint8_t *Payload::Data() const noexcept { return base_; }
+
+Size Payload::Length() const noexcept { return size_; }
+
+bool Payload::HugePages() const noexcept { return huge_pages_; }
+
+bool Payload::init(Size size, bool huge_pages) noexcept {
+  size_ = size;
+#ifndef _WIN32
+  auto pagesize = (Size)sysconf(_SC_PAGESIZE);
+  if (pagesize <= 0) {
+    pagesize = 4096;
+  }
+  void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    // Huge pages are usually 2 MiB and MAP_HUGETLB fails unless the system
+    // has reserved some of them, in which case we use normal pages.
+    constexpr Size hugepagesize = 2 << 20;
+    Size length = (size + hugepagesize - 1) / hugepagesize * hugepagesize;
+    base = mmap(nullptr, (size_t)length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+      mapped_ = length;
+      huge_pages_ = true;
+    }
+  }
+#endif
+  if (base == MAP_FAILED) {
+    Size length = (size + pagesize - 1) / pagesize * pagesize;
+    base = mmap(nullptr, (size_t)length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED) {
+      mapped_ = length;
+#ifdef MADV_HUGEPAGE
+      if (huge_pages) {
+        // Ask for transparent huge pages. It's just a hint.
+        (void)madvise(base, (size_t)length, MADV_HUGEPAGE);
+      }
+#endif
+    }
+  }
+  if (base != MAP_FAILED) {
+    base_ = (uint8_t *)base;
+    RandomPrintableFill((char *)base_, (size_t)size_);
+    (void)mprotect(base_, (size_t)mapped_, PROT_READ);
+    return true;
+  }
+#else
+  (void)huge_pages;
+#endif
+  // Fall back to the heap, aligning to a cache line.
+  constexpr Size alignment = 64;
+  heap_.reset(new (std::nothrow) uint8_t[(size_t)(size + alignment)]);
+  if (!heap_) {
+    return false;
+  }
+  auto address = (uintptr_t)heap_.get();
+  base_ = heap_.get() + (alignment - address % alignment) % alignment;
+  RandomPrintableFill((char *)base_, (size_t)size_);
+  return true;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
@@ -0,0 +1,76 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
+
+// libndt/internal/random.hpp - cheap cryptographically secure random bytes
+
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// RandomPool is a pool of random bytes generated by OpenSSL's CSPRNG. Since
+// RAND_bytes() is comparatively expensive for small outputs (it takes locks
+// and reseeding checks each time), we generate random bytes in chunks and
+// serve small requests, e.g. WebSocket masking keys, out of the chunk.
+class RandomPool {
+ public:
+  // Read fills @p buffer with @p count random bytes. Returns false if the
+  // CSPRNG fails, in which case the content of @p buffer is unspecified.
+  bool Read(uint8_t *buffer, Size count) noexcept;
+
+ private:
+  uint8_t bytes_[4096] = {};
+  Size avail_ = 0;
+};
+
+// RandomBytes fills @p buffer with @p count random bytes using a pool that
+// is private to the calling thread, so we do not need any locking. Returns
+// false if the CSPRNG fails.
+//
+// Note that the pool is not reset across fork(), hence the child and the
+// parent may share up to a pool worth of random bytes. Since libndt does
+// not fork, we don't bother with detecting this case.
+bool RandomBytes(uint8_t *buffer, Size count) noexcept;
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+bool RandomPool::Read(uint8_t *buffer, Size count) noexcept {
+  while (count > 0) {
+    if (avail_ <= 0) {
+      if (RAND_bytes(bytes_, (int)sizeof(bytes_)) != 1) {
+        return false;
+      }
+      avail_ = sizeof(bytes_);
+    }
+    Size amount = (count < avail_) ? count : avail_;
+    uint8_t *source = bytes_ + (sizeof(bytes_) - avail_);
+    memcpy(buffer, source, (size_t)amount);
+    // Do not keep around bytes that we've already handed out.
+    memset(source, 0, (size_t)amount);
+    avail_ -= amount;
+    buffer += amount;
+    count -= amount;
+  }
+  return true;
+}
+
+bool RandomBytes(uint8_t *buffer, Size count) noexcept {
+  static thread_local RandomPool pool;
+  return pool.Read(buffer, count);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
@@ -0,0 +1,360 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
+
+// libndt/internal/recordwriter.hpp - buffered writers for result records
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// RecordPiece is a piece of a record, i.e., the @p count bytes at @p base. We
+// append a record as a list of pieces, such that callers can append, e.g., a
+// header they format on the stack followed by a measurement they received,
+// without first concatenating them into a string.
+class RecordPiece {
+ public:
+  const char *base = nullptr;
+  size_t count = 0;
+};
+
+// FdRecordWriter appends records to a buffer and a background thread writes
+// the buffer to a file descriptor, such that the threads that append records,
+// i.e., the measurement threads, never perform I/O. Append() copies a record
+// into the buffer, unless the buffer is full, in which case it drops the
+// record, rather than blocking the measurement until the file descriptor is
+// writeable. Both buffers are allocated once, so appending does not allocate.
+// It is safe to append records from many threads.
+class FdRecordWriter {
+ public:
+  // Writes to @p fd, which we close when done if @p close_fd is true, using
+  // two buffers of @p capacity bytes, one we append to and one we write.
+  FdRecordWriter(int fd, bool close_fd, size_t capacity) noexcept;
+  FdRecordWriter(const FdRecordWriter &) = delete;
+  FdRecordWriter &operator=(const FdRecordWriter &) = delete;
+  FdRecordWriter(FdRecordWriter &&) = delete;
+  FdRecordWriter &operator=(FdRecordWriter &&) = delete;
+
+  // Writes the buffered records and stops the background thread.
+  ~FdRecordWriter() noexcept;
+
+  // Append appends the @p count pieces at @p pieces as a single record.
+  // Returns false if the record was dropped because the buffer is full.
+  bool Append(const RecordPiece *pieces, size_t count) noexcept;
+
+  // Flush waits until all the records appended so far have been written.
+  // Returns false if we failed to write to the file descriptor, in which
+  // case we discard all the records appended afterwards.
+  bool Flush() noexcept;
+
+  // Drop counts a record that the caller dropped without appending it,
+  // e.g., because it was malformed.
+  void Drop() noexcept;
+
+  // Dropped returns the number of records dropped so far.
+  uint64_t Dropped() const noexcept;
+
+ private:
+  void Loop() noexcept;
+  bool WriteAll(const char *base, size_t count) noexcept;
+
+  int fd_;
+  bool close_fd_;
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<char> pending_;  // records appended but not being written
+  std::vector<char> writing_;  // records the background thread is writing
+  uint64_t appended_ = 0;      // bytes appended so far
+  uint64_t written_ = 0;       // bytes written (or discarded) so far
+  uint64_t dropped_ = 0;
+  bool failed_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// RingRecordWriter appends records to a file mapped in memory, which we use
+// as a ring buffer, such that the file has a fixed size and contains the most
+// recent records. Appending is a memory copy and the kernel writes the pages
+// to disk in the background. The file starts with a header_size bytes header
+// containing, as host byte order uint64_t values, the magic (see below), the
+// size of the ring, and the number of bytes appended so far. The ring follows
+// the header and contains the latest min(appended, size) bytes, the oldest of
+// which is at offset appended % size. To read the ring while we are writing,
+// read appended, copy the ring, and read appended again, to know how many of
+// the oldest bytes were overwritten meanwhile. Not available on Windows. It
+// is safe to append records from many threads.
+class RingRecordWriter {
+ public:
+  static constexpr size_t header_size = 64;
+  static constexpr uint64_t magic = 0x31474e495254444e;  // "NDTRING1"
+
+  RingRecordWriter() noexcept;
+  RingRecordWriter(const RingRecordWriter &) = delete;
+  RingRecordWriter &operator=(const RingRecordWriter &) = delete;
+  RingRecordWriter(RingRecordWriter &&) = delete;
+  RingRecordWriter &operator=(RingRecordWriter &&) = delete;
+  ~RingRecordWriter() noexcept;
+
+  // Open creates, or truncates, the file at @p path, containing a ring of
+  // @p capacity bytes, and maps it. Returns false on failure.
+  bool Open(const std::string &path, size_t capacity) noexcept;
+
+  // Append appends the @p count pieces at @p pieces as a single record.
+  // Returns false if the record was dropped because the file is not open
+  // or the record is larger than the ring.
+  bool Append(const RecordPiece *pieces, size_t count) noexcept;
+
+  // Appended returns the number of bytes appended so far.
+  uint64_t Appended() const noexcept;
+
+  // Drop counts a record that the caller dropped without appending it,
+  // e.g., because it was malformed.
+  void Drop() noexcept;
+
+  // Dropped returns the number of records dropped so far.
+  uint64_t Dropped() const noexcept;
+
+ private:
+  void Close() noexcept;
+
+  mutable std::mutex mutex_;
+  char *base_ = nullptr;  // the mapped file
+  size_t capacity_ = 0;
+  uint64_t appended_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+FdRecordWriter::FdRecordWriter(int fd, bool close_fd, size_t capacity) noexcept
+    : fd_{fd}, close_fd_{close_fd}, capacity_{capacity} {
+  pending_.reserve(capacity_);
+  writing_.reserve(capacity_);
+  thread_ = std::thread{[this]() noexcept { Loop(); }};
+}
+
+FdRecordWriter::~FdRecordWriter() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+  if (close_fd_) {
+#ifndef _WIN32
+    (void)::close(fd_);
+#else
+    (void)::_close(fd_);
+#endif
+  }
+}
+
+bool FdRecordWriter::Append(const RecordPiece *pieces, size_t count) noexcept {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += pieces[i].count;
+  }
+  bool was_empty = false;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (total > capacity_ - pending_.size()) {
+      dropped_ += 1;
+      return false;
+    }
+    was_empty = pending_.empty();
+    for (size_t i = 0; i < count; ++i) {
+      pending_.insert(pending_.end(), pieces[i].base,
+                      pieces[i].base + pieces[i].count);
+    }
+    appended_ += total;
+  }
+  // When the buffer was not empty, the background thread has already been
+  // notified and will check for more records once it is done writing.
+  if (was_empty) {
+    cond_.notify_all();
+  }
+  return true;
+}
+
+bool FdRecordWriter::Flush() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  uint64_t target = appended_;
+  cond_.wait(lock, [this, target]() { return written_ >= target; });
+  return !failed_;
+}
+
+void FdRecordWriter::Drop() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  dropped_ += 1;
+}
+
+uint64_t FdRecordWriter::Dropped() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return dropped_;
+}
+
+void FdRecordWriter::Loop() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (;;) {
+    cond_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+    if (pending_.empty()) {
+      return;  // stop_ is true and we have written everything
+    }
+    std::swap(pending_, writing_);
+    bool failed = failed_;
+    lock.unlock();
+    if (!failed) {
+      failed = !WriteAll(writing_.data(), writing_.size());
+    }
+    lock.lock();
+    failed_ = failed;
+    written_ += writing_.size();
+    writing_.clear();  // keeps the capacity
+    cond_.notify_all();  // for Flush()
+  }
+}
+
+bool FdRecordWriter::WriteAll(const char *base, size_t count) noexcept {
+  while (count > 0) {
+#ifndef _WIN32
+    ssize_t n = ::write(fd_, base, count);
+#else
+    int n = ::_write(fd_, base, (unsigned)count);
+#endif
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    base += n;
+    count -= (size_t)n;
+  }
+  return true;
+}
+
+constexpr size_t RingRecordWriter::header_size;
+constexpr uint64_t RingRecordWriter::magic;
+
+RingRecordWriter::RingRecordWriter() noexcept {}
+
+RingRecordWriter::~RingRecordWriter() noexcept { Close(); }
+
+bool RingRecordWriter::Open(const std::string &path, size_t capacity) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  Close();
+  if (capacity <= 0) {
+    return false;
+  }
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  size_t size = header_size + capacity;
+  if (::ftruncate(fd, (off_t)size) != 0) {
+    (void)::close(fd);
+    return false;
+  }
+  void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  (void)::close(fd);  // the mapping keeps a reference to the file
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  base_ = (char *)base;
+  capacity_ = capacity;
+  appended_ = 0;
+  uint64_t ring_size = capacity;
+  memcpy(base_, &magic, sizeof(magic));
+  memcpy(base_ + 8, &ring_size, sizeof(ring_size));
+  memcpy(base_ + 16, &appended_, sizeof(appended_));
+  return true;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+bool RingRecordWriter::Append(const RecordPiece *pieces,
+                              size_t count) noexcept {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += pieces[i].count;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  if (base_ == nullptr || total > capacity_) {
+    dropped_ += 1;
+    return false;
+  }
+  char *ring = base_ + header_size;
+  size_t offset = (size_t)(appended_ % capacity_);
+  for (size_t i = 0; i < count; ++i) {
+    const char *p = pieces[i].base;
+    size_t n = pieces[i].count;
+    while (n > 0) {
+      size_t chunk = (n < capacity_ - offset) ? n : capacity_ - offset;
+      memcpy(ring + offset, p, chunk);
+      p += chunk;
+      n -= chunk;
+      offset = (offset + chunk) % capacity_;
+    }
+  }
+  appended_ += total;
+  // Update appended only after the data, for readers of the file.
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(base_ + 16, &appended_, sizeof(appended_));
+  return true;
+}
+
+uint64_t RingRecordWriter::Appended() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return appended_;
+}
+
+void RingRecordWriter::Drop() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  dropped_ += 1;
+}
+
+uint64_t RingRecordWriter::Dropped() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return dropped_;
+}
+
+void RingRecordWriter::Close() noexcept {
+#ifndef _WIN32
+  if (base_ != nullptr) {
+    (void)::munmap(base_, header_size + capacity_);
+  }
+#endif
+  base_ = nullptr;
+  capacity_ = 0;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
@@ -0,0 +1,136 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
+
+// libndt/internal/sockettable.hpp - per socket state
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// SocketTable maps sockets to the state of the connection using them. Since
+// sockets are small integers in practice, Find() is a bounds check and an
+// array access, so we can use it for every I/O operation. On Windows, sockets
+// are handles, which are multiples of four, hence we index the array using
+// the socket divided by four. We keep the state of the sockets that do not
+// fit the array in a map protected by a mutex, so that only these sockets pay
+// for locking. The array is allocated once, hence Insert() and Remove() do
+// not move the state of other sockets. So, many threads can Find() and use
+// the state of their own socket while other threads insert or remove other
+// sockets, as long as no thread inserts or removes such socket meanwhile.
+template <typename State>
+class SocketTable {
+ public:
+  // The array holds the state of the sockets below this value.
+  static constexpr size_t array_size = 1024;
+
+  SocketTable() noexcept;
+  SocketTable(const SocketTable &) = delete;
+  SocketTable &operator=(const SocketTable &) = delete;
+  SocketTable(SocketTable &&) = delete;
+  SocketTable &operator=(SocketTable &&) = delete;
+  ~SocketTable() noexcept;
+
+  // Find returns the state of @p sock or nullptr.
+  State *Find(Socket sock) const noexcept;
+
+  // Insert makes @p state the state of @p sock, replacing the previous state
+  // of @p sock, if any, and returns @p state.
+  State *Insert(Socket sock, std::unique_ptr<State> state) noexcept;
+
+  // Remove removes the state of @p sock and returns it, or nullptr.
+  std::unique_ptr<State> Remove(Socket sock) noexcept;
+
+ private:
+  // Returns the index of @p sock in the array or array_size.
+  static size_t index(Socket sock) noexcept;
+
+  std::unique_ptr<std::unique_ptr<State>[]> array_;
+  mutable std::mutex mutex_;
+  std::map<Socket, std::unique_ptr<State>> others_;  // protected by mutex_
+};
+
+template <typename State>
+constexpr size_t SocketTable<State>::array_size;
+
+template <typename State>
+SocketTable<State>::SocketTable() noexcept
+    : array_{new std::unique_ptr<State>[array_size]} {}
+
+template <typename State>
+SocketTable<State>::~SocketTable() noexcept {}
+
+template <typename State>
+State *SocketTable<State>::Find(Socket sock) const noexcept {
+  size_t i = index(sock);
+  if (i < array_size) {
+    return array_[i].get();
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = others_.find(sock);
+  return (it != others_.end()) ? it->second.get() : nullptr;
+}
+
+template <typename State>
+State *SocketTable<State>::Insert(Socket sock,
+                                  std::unique_ptr<State> state) noexcept {
+  State *result = state.get();
+  size_t i = index(sock);
+  if (i < array_size) {
+    array_[i] = std::move(state);
+  } else {
+    std::unique_lock<std::mutex> _{mutex_};
+    others_[sock] = std::move(state);
+  }
+  return result;
+}
+
+template <typename State>
+std::unique_ptr<State> SocketTable<State>::Remove(Socket sock) noexcept {
+  std::unique_ptr<State> state;
+  size_t i = index(sock);
+  if (i < array_size) {
+    state = std::move(array_[i]);
+  } else {
+    std::unique_lock<std::mutex> _{mutex_};
+    auto it = others_.find(sock);
+    if (it != others_.end()) {
+      state = std::move(it->second);
+      others_.erase(it);
+    }
+  }
+  return state;
+}
+
+template <typename State>
+size_t SocketTable<State>::index(Socket sock) noexcept {
+  if (!IsSocketValid(sock)) {
+    return array_size;
+  }
+  size_t value = (size_t)sock;
+#ifdef _WIN32
+  if ((value & 3) != 0) {
+    return array_size;  // not a handle, so it can't use the array
+  }
+  value >>= 2;
+#endif
+  return (value < array_size) ? value : array_size;
+}
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
@@ -0,0 +1,173 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
+
+// libndt/internal/sslcache.hpp - cache of SSL contexts and sessions
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <openssl/ssl.h>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// SslCache caches SSL contexts, such that we load the CA bundle only once,
+// and the TLS sessions sent to us by servers, such that new connections to
+// the same server can resume the session rather than performing a full
+// handshake. Each context has its own sessions, because a resumed handshake
+// does not verify the certificate again, hence we must not resume, e.g., a
+// session created without verifying the peer when we want to verify it. It
+// is safe to use a SslCache from many threads.
+class SslCache {
+ public:
+  SslCache() noexcept;
+  SslCache(const SslCache &) = delete;
+  SslCache &operator=(const SslCache &) = delete;
+  SslCache(SslCache &&) = delete;
+  SslCache &operator=(SslCache &&) = delete;
+  ~SslCache() noexcept;
+
+  // Context returns the context for @p ca_bundle_path and @p verify_peer,
+  // creating it the first time. The context is owned by the cache. If you
+  // create a SSL with it, the SSL will own a reference to it. Returns a null
+  // pointer on failure, e.g., when we cannot load the CA bundle.
+  SSL_CTX *Context(const std::string &ca_bundle_path, bool verify_peer) noexcept;
+
+  // Prepare configures @p ssl, created using one of our contexts, to resume
+  // the session we have for @p key and the context of @p ssl, if any, and to
+  // save for them the sessions that the server will send us over @p ssl.
+  bool Prepare(SSL *ssl, const std::string &key) noexcept;
+
+  // HasSession returns whether we have a session for @p key and @p ctx.
+  bool HasSession(SSL_CTX *ctx, const std::string &key) noexcept;
+
+  // Global returns the cache shared by all the clients in this process.
+  static std::shared_ptr<SslCache> Global() noexcept;
+
+ private:
+  static int OnNewSession(SSL *ssl, SSL_SESSION *session) noexcept;
+  static int KeyIndex() noexcept;
+  static int CacheIndex() noexcept;
+
+  std::mutex mutex_;
+  std::map<std::pair<std::string, bool>, SSL_CTX *> contexts_;
+  std::map<std::pair<SSL_CTX *, std::string>, SSL_SESSION *> sessions_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+SslCache::SslCache() noexcept {}
+
+SslCache::~SslCache() noexcept {
+  for (auto &kv : contexts_) {
+    ::SSL_CTX_free(kv.second);
+  }
+  for (auto &kv : sessions_) {
+    ::SSL_SESSION_free(kv.second);
+  }
+}
+
+SSL_CTX *SslCache::Context(const std::string &ca_bundle_path,
+                           bool verify_peer) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  auto key = std::make_pair(verify_peer ? ca_bundle_path : "", verify_peer);
+  auto it = contexts_.find(key);
+  if (it != contexts_.end()) {
+    return it->second;
+  }
+  // TODO(bassosimone): understand whether we can remove old SSL versions
+  // taking into account that the NDT server runs on very old code.
+  SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+  if (verify_peer && !::SSL_CTX_load_verify_locations(
+                         ctx, ca_bundle_path.c_str(), nullptr)) {
+    ::SSL_CTX_free(ctx);
+    return nullptr;
+  }
+  // We keep sessions ourselves because OpenSSL does not lookup sessions by
+  // itself in client mode. See SSL_CTX_set_session_cache_mode(3).
+  ::SSL_CTX_set_session_cache_mode(
+      ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  ::SSL_CTX_sess_set_new_cb(ctx, OnNewSession);
+  ::SSL_CTX_set_ex_data(ctx, CacheIndex(), this);
+  contexts_[key] = ctx;
+  return ctx;
+}
+
+bool SslCache::Prepare(SSL *ssl, const std::string &key) noexcept {
+  // The string is deleted by the free function of KeyIndex() along with ssl.
+  if (!::SSL_set_ex_data(ssl, KeyIndex(), new std::string{key})) {
+    return false;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = sessions_.find(std::make_pair(::SSL_get_SSL_CTX(ssl), key));
+  if (it == sessions_.end()) {
+    return true;
+  }
+  if (!::SSL_set_session(ssl, it->second)) {  // takes its own reference
+    return false;
+  }
+  // TLSv1.3 clients should not use a ticket more than once (RFC8446 Sect.
+  // C.4), and the server will send us fresh tickets anyway.
+  if (::SSL_SESSION_get_protocol_version(it->second) >= TLS1_3_VERSION) {
+    ::SSL_SESSION_free(it->second);
+    sessions_.erase(it);
+  }
+  return true;
+}
+
+bool SslCache::HasSession(SSL_CTX *ctx, const std::string &key) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return sessions_.count(std::make_pair(ctx, key)) > 0;
+}
+
+std::shared_ptr<SslCache> SslCache::Global() noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static std::shared_ptr<SslCache> cache{new SslCache};
+  return cache;
+}
+
+int SslCache::OnNewSession(SSL *ssl, SSL_SESSION *session) noexcept {
+  auto key = static_cast<std::string *>(::SSL_get_ex_data(ssl, KeyIndex()));
+  SSL_CTX *ctx = ::SSL_get_SSL_CTX(ssl);
+  auto cache = static_cast<SslCache *>(::SSL_CTX_get_ex_data(ctx, CacheIndex()));
+  if (key == nullptr || cache == nullptr) {
+    return 0;  // We did not take ownership of session
+  }
+  std::unique_lock<std::mutex> _{cache->mutex_};
+  auto &entry = cache->sessions_[std::make_pair(ctx, *key)];
+  if (entry != nullptr) {
+    ::SSL_SESSION_free(entry);
+  }
+  entry = session;
+  return 1;  // We took ownership of session
+}
+
+int SslCache::KeyIndex() noexcept {
+  static const int index = ::SSL_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+        delete static_cast<std::string *>(ptr);
+      });
+  return index;
+}
+
+int SslCache::CacheIndex() noexcept {
+  static const int index =
+      ::SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
@@ -88,6 +88,11 @@ class Sys {
 
   virtual int Closesocket(Socket fd) const noexcept;
 
+  // StartBulkRecv tells us that we are about to receive a lot of data from
+  // @p fd, such that we can use a more efficient way of receiving, if any.
+  // Returns whether we did. By default, we keep using recv(2).
+  virtual bool StartBulkRecv(Socket fd) const noexcept;
+
 #ifdef _WIN32
   virtual int Poll(LPWSAPOLLFD fds, ULONG nfds, INT timeout) const noexcept;
 #else
@@ -109,9 +114,14 @@ class Sys {
       Socket socket, int level, int name, void *value,
       socklen_t *len) const noexcept;
 
+  virtual int Setsockopt(
+      Socket socket, int level, int name, const void *value,
+      socklen_t len) const noexcept;
+
   virtual ~Sys() noexcept;
 };
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 // LIBNDT_HAVE_STRTONUM tells us whether we have strtonum in libc
 #ifndef LIBNDT_HAVE_STRTONUM
 // clang-format off
@@ -182,11 +192,13 @@ strtonum(const char *numstr, long long minval, long long maxval,
 #define LIBNDT_AS_OS_BUFFER_LEN(n) ((int)n)
 #define LIBNDT_OS_SSIZE_MAX INT_MAX
 #define LIBNDT_AS_OS_OPTION_VALUE(x) ((char *)x)
+#define LIBNDT_AS_OS_CONST_OPTION_VALUE(x) ((const char *)x)
 #else
 #define LIBNDT_AS_OS_BUFFER(b) ((char *)b)
 #define LIBNDT_AS_OS_BUFFER_LEN(n) ((size_t)n)
 #define LIBNDT_OS_SSIZE_MAX SSIZE_MAX
 #define LIBNDT_AS_OS_OPTION_VALUE(x) ((void *)x)
+#define LIBNDT_AS_OS_CONST_OPTION_VALUE(x) ((const void *)x)
 #endif
 
 int Sys::GetLastError() const noexcept {
@@ -266,6 +278,8 @@ int Sys::Closesocket(Socket fd) const noexcept {
 #endif
 }
 
+bool Sys::StartBulkRecv(Socket) const noexcept { return false; }
+
 #ifdef _WIN32
 int Sys::Poll(LPWSAPOLLFD fds, ULONG nfds, INT timeout) const noexcept {
   return ::WSAPoll(fds, nfds, timeout);
@@ -298,7 +312,14 @@ int Sys::Getsockopt(Socket socket, int level, int name, void *value,
       socket, level, name, LIBNDT_AS_OS_OPTION_VALUE(value), len);
 }
 
+int Sys::Setsockopt(Socket socket, int level, int name, const void *value,
+                    socklen_t len) const noexcept {
+  return ::setsockopt(
+      socket, level, name, LIBNDT_AS_OS_CONST_OPTION_VALUE(value), len);
+}
+
 Sys::~Sys() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
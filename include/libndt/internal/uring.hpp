@@ -0,0 +1,572 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
+
+// libndt/internal/uring.hpp - io_uring based Sys for bulk receive
+
+// We only compile this code if LIBNDT_HAVE_IO_URING is defined, which our
+// build does on Linux when the kernel headers are recent enough (6.0). We
+// use the system calls directly, rather than liburing, to avoid depending
+// on it, and we fall back to Sys when the running kernel is too old.
+#ifdef LIBNDT_HAVE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sockettable.hpp"
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// UringRecv receives from a socket using an io_uring multishot recv: after
+// we submit it once, the kernel keeps receiving into buffers we provide to
+// it through a buffer ring, posting a completion per buffer, until we run out
+// of buffers. Recv() copies from the buffers filled by the kernel and gives
+// them back to it once consumed, without system calls, and only needs to
+// submit the recv again when the kernel runs out of buffers. Only one thread
+// at a time may use a UringRecv.
+class UringRecv {
+ public:
+  UringRecv() noexcept;
+  UringRecv(const UringRecv &) = delete;
+  UringRecv &operator=(const UringRecv &) = delete;
+  UringRecv(UringRecv &&) = delete;
+  UringRecv &operator=(UringRecv &&) = delete;
+
+  // Cancels the recv and waits for the kernel to stop using our buffers.
+  ~UringRecv() noexcept;
+
+  // Start starts receiving from @p sock using @p nbufs buffers, which must
+  // be a power of two, of @p bufsize bytes. Returns false on failure, e.g.,
+  // when the kernel does not support multishot recv.
+  bool Start(Socket sock, unsigned nbufs, unsigned bufsize) noexcept;
+
+  // Recv is like recv(2) for a non blocking socket: it returns the number
+  // of bytes copied into @p base, zero on EOF, or -1 setting errno, which
+  // is EAGAIN when there is no data available yet.
+  Ssize Recv(void *base, Size count) noexcept;
+
+  // Readable returns whether Recv() would not fail with EAGAIN.
+  bool Readable() noexcept;
+
+  // Fd returns the io_uring file descriptor, which poll(2) reports as
+  // readable when the kernel has posted completions.
+  int Fd() const noexcept;
+
+ private:
+  static constexpr uint64_t recv_user_data = 1;
+  static constexpr uint64_t cancel_user_data = 2;
+  static constexpr uint16_t buf_group = 0;
+
+  io_uring_sqe *NextSqe() noexcept;
+  bool Enter(unsigned to_submit, unsigned min_complete) noexcept;
+  bool Arm() noexcept;
+  bool NextCqe(io_uring_cqe *cqe) noexcept;
+  bool Process() noexcept;
+  void Recycle(uint16_t bid) noexcept;
+  void Stop() noexcept;
+
+  int ring_fd_ = -1;
+  Socket sock_ = (Socket)-1;
+
+  // Submission and completion queues shared with the kernel.
+  void *rings_ = nullptr;
+  size_t rings_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_mask_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned *cq_mask_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+
+  // Buffer ring through which we provide buffers to the kernel.
+  io_uring_buf *buf_ring_ = nullptr;
+  size_t buf_ring_size_ = 0;
+  char *bufs_ = nullptr;
+  size_t bufs_size_ = 0;
+  unsigned nbufs_ = 0;
+  unsigned bufsize_ = 0;
+  uint16_t buf_tail_ = 0;
+  bool registered_ = false;
+
+  // Whether the multishot recv is active.
+  bool armed_ = false;
+
+  // The buffer we are copying from, if any.
+  bool has_current_ = false;
+  uint16_t current_bid_ = 0;
+  size_t current_off_ = 0;
+  size_t current_len_ = 0;
+
+  // Sticky EOF and error, which we return once we have copied all data.
+  bool eof_ = false;
+  int error_ = 0;
+};
+
+// UringSys is a Sys that, once told that we are going to receive a lot of
+// data from a socket using StartBulkRecv(), receives from such socket using
+// UringRecv, and otherwise behaves like Sys. Poll() waits for the io_uring of
+// such sockets rather than for the sockets themselves, since the kernel reads
+// data from the sockets as soon as it arrives. It keeps the UringRecv of each
+// socket in a SocketTable, hence many threads can use their own sockets at the
+// same time, as long as no other thread uses a socket while its bulk recv is
+// being started, or while it is being closed.
+class UringSys : public Sys {
+ public:
+  // Number and size of the buffers of each socket.
+  static constexpr unsigned nbufs = 16;
+  static constexpr unsigned bufsize = 1 << 15;
+
+  bool StartBulkRecv(Socket fd) const noexcept override;
+
+  Ssize Recv(Socket fd, void *base, Size count) const noexcept override;
+
+  int Closesocket(Socket fd) const noexcept override;
+
+  int Poll(pollfd *fds, nfds_t nfds, int timeout) const noexcept override;
+
+  ~UringSys() noexcept override;
+
+ private:
+  mutable SocketTable<UringRecv> table_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr uint64_t UringRecv::recv_user_data;
+constexpr uint64_t UringRecv::cancel_user_data;
+constexpr uint16_t UringRecv::buf_group;
+
+UringRecv::UringRecv() noexcept {}
+
+UringRecv::~UringRecv() noexcept { Stop(); }
+
+bool UringRecv::Start(Socket sock, unsigned nbufs, unsigned bufsize) noexcept {
+  if (nbufs <= 0 || (nbufs & (nbufs - 1)) != 0 || nbufs > 32768) {
+    return false;
+  }
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Each buffer needs a completion, plus the one of cancel.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 2 * nbufs;
+  long fd = ::syscall(__NR_io_uring_setup, 4, &params);
+  if (fd < 0) {
+    return false;
+  }
+  ring_fd_ = (int)fd;
+  sock_ = sock;
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    return false;
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  rings_size_ = (sq_size > cq_size) ? sq_size : cq_size;
+  void *rings = ::mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    return false;
+  }
+  rings_ = rings;
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = (io_uring_sqe *)sqes;
+  char *p = (char *)rings_;
+  sq_tail_ = (unsigned *)(p + params.sq_off.tail);
+  sq_mask_ = (unsigned *)(p + params.sq_off.ring_mask);
+  sq_array_ = (unsigned *)(p + params.sq_off.array);
+  cq_head_ = (unsigned *)(p + params.cq_off.head);
+  cq_tail_ = (unsigned *)(p + params.cq_off.tail);
+  cq_mask_ = (unsigned *)(p + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(p + params.cq_off.cqes);
+
+  // The buffer ring must be page aligned, hence we use mmap.
+  nbufs_ = nbufs;
+  bufsize_ = bufsize;
+  buf_ring_size_ = nbufs * sizeof(io_uring_buf);
+  void *buf_ring = ::mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) {
+    return false;
+  }
+  buf_ring_ = (io_uring_buf *)buf_ring;
+  bufs_size_ = (size_t)nbufs * bufsize;
+  void *bufs = ::mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return false;
+  }
+  bufs_ = (char *)bufs;
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+  reg.ring_entries = nbufs;
+  reg.bgid = buf_group;
+  if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0) {
+    return false;
+  }
+  registered_ = true;
+  for (unsigned i = 0; i < nbufs; ++i) {
+    Recycle((uint16_t)i);
+  }
+  return Arm();
+}
+
+Ssize UringRecv::Recv(void *base, Size count) noexcept {
+  Size off = 0;
+  while (off < count) {
+    if (has_current_) {
+      size_t n = current_len_ - current_off_;
+      if (n > count - off) {
+        n = (size_t)(count - off);
+      }
+      memcpy((char *)base + off,
+             bufs_ + (size_t)current_bid_ * bufsize_ + current_off_, n);
+      off += n;
+      current_off_ += n;
+      if (current_off_ >= current_len_) {
+        has_current_ = false;
+        Recycle(current_bid_);
+      }
+      continue;
+    }
+    if (!Process()) {
+      break;  // no more data for now
+    }
+  }
+  if (off > 0) {
+    return (Ssize)off;
+  }
+  if (error_ != 0) {
+    errno = error_;
+    return -1;
+  }
+  if (eof_) {
+    return 0;
+  }
+  if (!armed_ && !Arm()) {
+    errno = EIO;
+    return -1;
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+bool UringRecv::Readable() noexcept {
+  while (!has_current_ && !eof_ && error_ == 0) {
+    if (!Process()) {
+      if (!armed_ && !Arm()) {
+        error_ = EIO;
+        return true;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+int UringRecv::Fd() const noexcept { return ring_fd_; }
+
+io_uring_sqe *UringRecv::NextSqe() noexcept {
+  // We're the only producer, so we only need to order the kernel's view.
+  unsigned tail = *sq_tail_;
+  unsigned index = tail & *sq_mask_;
+  io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  return sqe;
+}
+
+bool UringRecv::Enter(unsigned to_submit, unsigned min_complete) noexcept {
+  if (to_submit > 0) {
+    __atomic_store_n(sq_tail_, *sq_tail_ + to_submit, __ATOMIC_RELEASE);
+  }
+  unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    long rv = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                        min_complete, flags, nullptr, 0);
+    if (rv >= 0) {
+      return (unsigned long)rv == to_submit;
+    }
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+bool UringRecv::Arm() noexcept {
+  if (eof_ || error_ != 0) {
+    return true;  // nothing left to receive
+  }
+  io_uring_sqe *sqe = NextSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sock_;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = buf_group;
+  sqe->user_data = recv_user_data;
+  armed_ = Enter(1, 0);
+  return armed_;
+}
+
+bool UringRecv::NextCqe(io_uring_cqe *cqe) noexcept {
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return false;
+  }
+  *cqe = cqes_[head & *cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Process processes the next completion of the recv, if any, returning
+// false when there are no completions.
+bool UringRecv::Process() noexcept {
+  io_uring_cqe cqe;
+  do {
+    if (!NextCqe(&cqe)) {
+      return false;
+    }
+  } while (cqe.user_data != recv_user_data);
+  if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+    armed_ = false;  // the kernel stopped receiving
+  }
+  if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+    has_current_ = true;
+    current_bid_ = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    current_off_ = 0;
+    current_len_ = (size_t)cqe.res;
+  } else if (cqe.res == 0) {
+    eof_ = true;
+  } else if (cqe.res == -ENOBUFS) {
+    // NOTHING: we'll submit again once we have consumed some buffers
+  } else if (cqe.res < 0) {
+    error_ = -cqe.res;
+  }
+  return true;
+}
+
+void UringRecv::Recycle(uint16_t bid) noexcept {
+  io_uring_buf *buf = &buf_ring_[buf_tail_ & (nbufs_ - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(bufs_ + (size_t)bid * bufsize_);
+  buf->len = bufsize_;
+  buf->bid = bid;
+  buf_tail_ = (uint16_t)(buf_tail_ + 1);
+  // The tail of the ring overlaps with the resv field of the first buffer.
+  __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+}
+
+void UringRecv::Stop() noexcept {
+  bool safe = true;  // whether the kernel won't write into our buffers
+  if (armed_) {
+    io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = recv_user_data;
+    sqe->user_data = cancel_user_data;
+    safe = Enter(1, 0);
+    // The recv posts a last completion without IORING_CQE_F_MORE.
+    while (safe && armed_) {
+      io_uring_cqe cqe;
+      if (!NextCqe(&cqe)) {
+        safe = Enter(0, 1);
+        continue;
+      }
+      if (cqe.user_data == recv_user_data &&
+          (cqe.flags & IORING_CQE_F_MORE) == 0) {
+        armed_ = false;
+      }
+    }
+  }
+  if (registered_ && safe) {
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buf_group;
+    (void)::syscall(__NR_io_uring_register, ring_fd_,
+                    IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  if (ring_fd_ != -1) {
+    (void)::close(ring_fd_);
+  }
+  if (sqes_ != nullptr) {
+    (void)::munmap(sqes_, sqes_size_);
+  }
+  if (rings_ != nullptr) {
+    (void)::munmap(rings_, rings_size_);
+  }
+  // If we could not make sure the kernel stopped receiving, we leak the
+  // buffers rather than having the kernel write into unmapped memory.
+  if (safe) {
+    if (bufs_ != nullptr) {
+      (void)::munmap(bufs_, bufs_size_);
+    }
+    if (buf_ring_ != nullptr) {
+      (void)::munmap(buf_ring_, buf_ring_size_);
+    }
+  }
+}
+
+constexpr unsigned UringSys::nbufs;
+constexpr unsigned UringSys::bufsize;
+
+bool UringSys::StartBulkRecv(Socket fd) const noexcept {
+  if (table_.Find(fd) != nullptr) {
+    return true;
+  }
+  std::unique_ptr<UringRecv> recv{new UringRecv};
+  if (!recv->Start(fd, nbufs, bufsize)) {
+    return false;
+  }
+  table_.Insert(fd, std::move(recv));
+  return true;
+}
+
+Ssize UringSys::Recv(Socket fd, void *base, Size count) const noexcept {
+  UringRecv *recv = table_.Find(fd);
+  if (recv == nullptr) {
+    return Sys::Recv(fd, base, count);
+  }
+  return recv->Recv(base, count);
+}
+
+int UringSys::Closesocket(Socket fd) const noexcept {
+  table_.Remove(fd);  // stops receiving before we close the socket
+  return Sys::Closesocket(fd);
+}
+
+int UringSys::Poll(pollfd *fds, nfds_t nfds, int timeout) const noexcept {
+  // We run after every EAGAIN on the bulk recv path, hence we use arrays on
+  // the stack, and only allocate when polling for many sockets.
+  constexpr nfds_t small = 8;
+  UringRecv *small_recvs[small];
+  std::vector<UringRecv *> large_recvs;
+  UringRecv **recvs = small_recvs;
+  if (nfds > small) {
+    large_recvs.resize(nfds);
+    recvs = large_recvs.data();
+  }
+  // For each bulk recv socket we poll for POLLIN, we poll its io_uring in
+  // its place, and the socket only for the other events, if any.
+  bool any = false;
+  for (nfds_t i = 0; i < nfds; ++i) {
+    recvs[i] =
+        ((fds[i].events & POLLIN) != 0) ? table_.Find(fds[i].fd) : nullptr;
+    any = any || recvs[i] != nullptr;
+  }
+  if (!any) {
+    return Sys::Poll(fds, nfds, timeout);
+  }
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  // Each entry of fds needs at most two entries of pfds.
+  pollfd small_pfds[2 * small];
+  nfds_t small_origin[2 * small];  // index in fds of each entry of pfds
+  std::vector<pollfd> large_pfds;
+  std::vector<nfds_t> large_origin;
+  pollfd *pfds = small_pfds;
+  nfds_t *origin = small_origin;
+  if (nfds > small) {
+    large_pfds.resize(2 * nfds);
+    large_origin.resize(2 * nfds);
+    pfds = large_pfds.data();
+    origin = large_origin.data();
+  }
+  for (;;) {
+    nfds_t npfds = 0;
+    int ready = 0;
+    bool uring_only = true;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      fds[i].revents = 0;
+      if (recvs[i] == nullptr) {
+        pfds[npfds] = fds[i];
+        origin[npfds++] = i;
+        uring_only = false;
+        continue;
+      }
+      if (recvs[i]->Readable()) {
+        fds[i].revents = POLLIN;
+        ready += 1;
+      }
+      pollfd pfd{};
+      pfd.fd = recvs[i]->Fd();
+      pfd.events = POLLIN;
+      pfds[npfds] = pfd;
+      origin[npfds++] = i;
+      if ((fds[i].events & ~POLLIN) != 0) {
+        pfd.fd = fds[i].fd;
+        pfd.events = (short)(fds[i].events & ~POLLIN);
+        pfds[npfds] = pfd;
+        origin[npfds++] = i;
+        uring_only = false;
+      }
+    }
+    if (ready > 0 && uring_only) {
+      return ready;  // no need to ask the kernel
+    }
+    int rv = Sys::Poll(pfds, npfds, (ready > 0) ? 0 : timeout);
+    if (rv < 0) {
+      return rv;
+    }
+    for (nfds_t j = 0; j < npfds; ++j) {
+      pollfd &pfd = fds[origin[j]];
+      if (pfds[j].fd == pfd.fd) {
+        pfd.revents = (short)(pfd.revents | pfds[j].revents);
+      } else if ((pfds[j].revents & POLLIN) != 0 &&
+                 recvs[origin[j]]->Readable()) {
+        pfd.revents = (short)(pfd.revents | POLLIN);
+      }
+    }
+    ready = 0;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      ready += (fds[i].revents != 0) ? 1 : 0;
+    }
+    if (ready > 0 || rv == 0) {
+      return ready;
+    }
+    // The io_uring only had completions without data, e.g., because the
+    // kernel run out of buffers and we submitted the recv again.
+    if (timeout > 0) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0) {
+        return 0;
+      }
+      timeout = (int)remaining.count();
+    }
+  }
+}
+
+UringSys::~UringSys() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // LIBNDT_HAVE_IO_URING
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
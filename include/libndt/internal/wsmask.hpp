@@ -0,0 +1,188 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
+
+// libndt/internal/wsmask.hpp - WebSocket masking kernels
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define LIBNDT_HAVE_WSMASK_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+// We compile the AVX2 kernel using the target attribute, such that we do not
+// need to build everything with -mavx2, and we select it at runtime.
+#define LIBNDT_HAVE_WSMASK_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LIBNDT_HAVE_WSMASK_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// WsMaskFunc is the signature of a kernel that masks (or unmasks) @p count
+// bytes starting at @p base using the four bytes long @p mask key. Since
+// masking is an involution, the same kernel also unmasks. All the kernels
+// assume that @p base is the first byte of the payload (i.e. the one that
+// must be XORed with the first byte of the key). No alignment is required.
+//
+// See <https://tools.ietf.org/html/rfc6455#section-5.3>.
+using WsMaskFunc = void (*)(uint8_t *base, Size count, const uint8_t *mask);
+
+// WsMaskImpl describes a masking kernel.
+struct WsMaskImpl {
+  const char *name;
+  WsMaskFunc func;
+};
+
+// WsMaskBytewise is the reference implementation.
+void WsMaskBytewise(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+
+// WsMaskWord64 is the portable, word-at-a-time implementation.
+void WsMaskWord64(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+// WsMaskSse2 processes sixteen bytes at a time using SSE2.
+void WsMaskSse2(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
+
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+// WsMaskAvx2 processes thirty-two bytes at a time using AVX2. Only call
+// this function if the CPU supports AVX2 (see WsMaskImpls()).
+void WsMaskAvx2(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
+
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+// WsMaskNeon processes sixteen bytes at a time using NEON.
+void WsMaskNeon(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
+
+// WsMaskImpls returns the kernels that we can use on this CPU, sorted from
+// the slowest to the fastest one. The first one is always the reference.
+std::vector<WsMaskImpl> WsMaskImpls() noexcept;
+
+// WsMask masks @p count bytes at @p base with @p mask using the fastest
+// kernel available on this CPU, which is selected once at runtime.
+void WsMask(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void WsMaskBytewise(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  for (Size i = 0; i < count; ++i) {
+    // Implementation note: judging from a GCC 8 warning, it seems that using
+    // `^=` causes -Wconversion warnings, while using `= ... ^` does not.
+    base[i] = base[i] ^ mask[i & 3];
+  }
+}
+
+// Implementation note: all the kernels below process a multiple of four
+// bytes before delegating the tail to a simpler kernel, therefore the first
+// byte of the tail is always XORed with the first byte of the key.
+
+void WsMaskWord64(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  // We use memcpy() for loading and storing since this is the portable way
+  // to perform unaligned memory accesses; the compiler turns it into plain
+  // loads and stores. Also, by building the key using memcpy(), the byte
+  // order of the key in memory matches the byte order of the payload, so we
+  // don't need to care about endianness.
+  uint64_t key = 0;
+  memcpy(&key, mask, 4);
+  memcpy(((uint8_t *)&key) + 4, mask, 4);
+  Size i = 0;
+  for (; count - i >= 8; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, base + i, sizeof(word));
+    word ^= key;
+    memcpy(base + i, &word, sizeof(word));
+  }
+  WsMaskBytewise(base + i, count - i, mask);
+}
+
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+void WsMaskSse2(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  int32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  __m128i vkey = _mm_set1_epi32(key);
+  Size i = 0;
+  for (; count - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(base + i));
+    _mm_storeu_si128((__m128i *)(base + i), _mm_xor_si128(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_SSE2
+
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+__attribute__((target("avx2"))) void WsMaskAvx2(uint8_t *base, Size count,
+                                                const uint8_t *mask) noexcept {
+  int32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  __m256i vkey = _mm256_set1_epi32(key);
+  Size i = 0;
+  for (; count - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(base + i));
+    _mm256_storeu_si256((__m256i *)(base + i), _mm256_xor_si256(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_AVX2
+
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+void WsMaskNeon(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  uint32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  uint8x16_t vkey = vreinterpretq_u8_u32(vdupq_n_u32(key));
+  Size i = 0;
+  for (; count - i >= 16; i += 16) {
+    uint8x16_t block = vld1q_u8(base + i);
+    vst1q_u8(base + i, veorq_u8(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_NEON
+
+std::vector<WsMaskImpl> WsMaskImpls() noexcept {
+  std::vector<WsMaskImpl> impls;
+  impls.push_back(WsMaskImpl{"bytewise", WsMaskBytewise});
+  impls.push_back(WsMaskImpl{"word64", WsMaskWord64});
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+  impls.push_back(WsMaskImpl{"sse2", WsMaskSse2});
+#endif
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+  impls.push_back(WsMaskImpl{"neon", WsMaskNeon});
+#endif
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    impls.push_back(WsMaskImpl{"avx2", WsMaskAvx2});
+  }
+#endif
+  return impls;
+}
+
+void WsMask(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static const WsMaskFunc func = WsMaskImpls().back().func;
+  func(base, count, mask);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
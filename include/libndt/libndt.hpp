@@ -41,12 +41,36 @@
 ///
 /// \warning Not including nlohmann/json before including libndt will cause
 /// the build to fail, because libndt uses nlohmann/json symbols.
+///
+/// This header contains the implementation, hence you can only include it
+/// in a single translation unit. To use libndt from many translation units,
+/// compile the implementation once (e.g., using the `libndt` CMake target)
+/// and define LIBNDT_DECLARATIONS_ONLY everywhere else, such that this header
+/// only declares the API. The `LIBNDT_` macros that configure libndt, e.g.,
+/// LIBNDT_TRACING, only change the implementation, not the declarations, hence
+/// what matters is how you define them when compiling the implementation.
+/// Headers that only refer to the API by pointer or reference can include
+/// `libndt/fwd.hpp` instead.
 
 #ifndef LIBNDT_SINGLE_INCLUDE
 #include "libndt/internal/err.hpp"
 #include "libndt/internal/sys.hpp"
 #include "libndt/internal/curlx.hpp"
+#include "libndt/internal/random.hpp"
+#include "libndt/internal/wsmask.hpp"
+#include "libndt/internal/jsonscan.hpp"
+#include "libndt/internal/jsonwriter.hpp"
+#include "libndt/internal/sslcache.hpp"
+#include "libndt/internal/sockettable.hpp"
+#include "libndt/internal/uring.hpp"
+#include "libndt/internal/counters.hpp"
+#include "libndt/internal/recordwriter.hpp"
+#include "libndt/internal/admission.hpp"
+#include "libndt/internal/convergence.hpp"
+#include "libndt/internal/latency.hpp"
+#include "libndt/internal/payload.hpp"
 #include "libndt/timeout.hpp"
+#include "libndt/internal/mlabnscache.hpp"
 #endif // !LIBNDT_SINGLE_INCLUDE
 
 // Check dependencies
@@ -88,9 +112,11 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -106,6 +132,11 @@
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+// kTLS needs Linux and OpenSSL >= v3.0 compiled with kTLS support.
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define LIBNDT_HAVE_KTLS
+#endif
+
 namespace measurement_kit {
 namespace libndt {
 
@@ -167,6 +198,19 @@ constexpr Verbosity verbosity_info = Verbosity{2};
 /// Emit all log messages.
 constexpr Verbosity verbosity_debug = Verbosity{3};
 
+#ifndef LIBNDT_MAX_VERBOSITY
+#define LIBNDT_MAX_VERBOSITY verbosity_debug
+#endif
+
+/// Most verbose level of the log messages compiled into the library. Less
+/// important messages are compiled out, so they cost nothing at runtime and
+/// are never emitted, whatever Settings::verbosity. By default we compile
+/// all the messages in. To compile out, e.g., the debug messages, which
+/// are emitted for every WebSocket frame, define LIBNDT_MAX_VERBOSITY to
+/// `verbosity_info` before including libndt (or pass the LIBNDT_MAX_VERBOSITY
+/// option to CMake).
+constexpr Verbosity verbosity_max = LIBNDT_MAX_VERBOSITY;
+
 // Flags for selecting what NDT protocol features to use
 // `````````````````````````````````````````````````````
 
@@ -225,6 +269,230 @@ constexpr MsgType msg_logout = MsgType{9};
 constexpr MsgType msg_waiting = MsgType{10};
 constexpr MsgType msg_extended_login = MsgType{11};
 
+// Samples
+// -------
+
+/// SampleTcpInfo is a snapshot of the TCP state of a flow. It contains a
+/// portable subset of Linux's tcp_info. On other systems, or if we cannot
+/// read the TCP state, `valid` is false and the other fields are zero.
+class SampleTcpInfo {
+ public:
+  /// Whether the other fields are valid.
+  bool valid = false;
+
+  /// Smoothed RTT in microseconds.
+  uint32_t rtt = 0;
+
+  /// RTT variance in microseconds.
+  uint32_t rttvar = 0;
+
+  /// Minimum RTT in microseconds.
+  uint32_t min_rtt = 0;
+
+  /// Congestion window in segments.
+  uint32_t snd_cwnd = 0;
+
+  /// Total number of retransmitted segments.
+  uint32_t total_retrans = 0;
+
+  /// Number of bytes acknowledged by the peer.
+  uint64_t bytes_acked = 0;
+
+  /// Number of bytes received from the peer.
+  uint64_t bytes_received = 0;
+
+  /// Number of bytes retransmitted.
+  uint64_t bytes_retrans = 0;
+
+  /// Bytes written by the application but not yet sent.
+  uint32_t notsent_bytes = 0;
+
+  /// Delivery rate estimate in bytes per second.
+  uint64_t delivery_rate = 0;
+};
+
+/// SampleFlow is the part of a Sample concerning a single flow.
+class SampleFlow {
+ public:
+  /// Bytes transferred by this flow since the beginning of the subtest.
+  uint64_t bytes = 0;
+
+  /// TCP state of this flow.
+  SampleTcpInfo tcp_info;
+};
+
+/// Sample is a fine grained measurement taken while running a subtest. See
+/// Settings::sample_interval and EventHandler::on_sample().
+class Sample {
+ public:
+  /// Subtest: either nettest_flag_download or nettest_flag_upload.
+  NettestFlags tid = NettestFlags{0};
+
+  /// Seconds elapsed since the beginning of the subtest.
+  double elapsed = 0.0;
+
+  /// Bytes transferred by all flows since the beginning of the subtest.
+  uint64_t bytes = 0;
+
+  /// Bytes transferred by all flows since the previous sample.
+  uint64_t bytes_delta = 0;
+
+  /// Per flow data.
+  std::vector<SampleFlow> flows;
+};
+
+/// SampleBuffer is a ring buffer containing the latest samples. See
+/// Settings::sample_buffer_size and Client::samples().
+class SampleBuffer {
+ public:
+  /// Constructs a buffer keeping the latest @p capacity samples.
+  explicit SampleBuffer(size_t capacity = 0) noexcept;
+
+  /// Adds a copy of @p sample, replacing the oldest sample if full.
+  void push(const Sample &sample) noexcept;
+
+  /// Returns the number of samples in the buffer.
+  size_t size() const noexcept;
+
+  /// Returns the maximum number of samples in the buffer.
+  size_t capacity() const noexcept;
+
+  /// Returns the @p index-th oldest sample. @p index must be less than size().
+  const Sample &at(size_t index) const noexcept;
+
+  /// Removes all the samples.
+  void clear() noexcept;
+
+  /// Writes the samples as CSV onto @p out, with a header and one row per
+  /// sample and flow. Returns whether writing succeeded.
+  bool write_csv(std::ostream &out) const noexcept;
+
+  /// Writes the samples onto @p out as JSON lines, i.e., one JSON object
+  /// per line per sample. Returns whether writing succeeded.
+  bool write_jsonl(std::ostream &out) const noexcept;
+
+ private:
+  std::vector<Sample> samples_;
+  size_t capacity_ = 0;
+  size_t next_ = 0;
+};
+
+// Counters
+// --------
+
+/// Counters is a snapshot of counters describing the work done by a client
+/// since it was constructed, as returned by Client::counters(). They allow
+/// to tell whether a slow test was slow because of the network, e.g., when
+/// most of the time was spent waiting for sockets, or because of the client
+/// host, e.g., when there were many system calls per frame.
+class Counters {
+ public:
+  /// Number of buckets of the frame size histograms. Bucket zero counts the
+  /// empty frames, bucket i counts the frames whose payload is in [2^(i-1),
+  /// 2^i) bytes, and the last bucket also counts larger frames.
+  static constexpr size_t frame_size_buckets = 26;
+
+  /// Number of I/O system calls, i.e., the sum of the following four.
+  uint64_t syscalls = 0;
+
+  /// Number of recv calls, including the ones made by OpenSSL. With kTLS,
+  /// OpenSSL reads from the socket directly, so we count one recv call for
+  /// each SSL_read call and we miss the ones made during the handshake.
+  uint64_t recv_calls = 0;
+
+  /// Number of send calls, including the ones made by OpenSSL. With kTLS,
+  /// we count one send call for each SSL_write call, as for recv_calls.
+  uint64_t send_calls = 0;
+
+  /// Number of poll calls.
+  uint64_t poll_calls = 0;
+
+  /// Number of connect calls.
+  uint64_t connect_calls = 0;
+
+  /// Number of poll calls that returned because a socket was ready rather
+  /// than because of a timeout.
+  uint64_t poll_wakeups = 0;
+
+  /// Number of SSL_read calls.
+  uint64_t ssl_read_calls = 0;
+
+  /// Number of SSL_write calls.
+  uint64_t ssl_write_calls = 0;
+
+  /// Number of times OpenSSL told us to retry once the socket is readable.
+  uint64_t ssl_want_read = 0;
+
+  /// Number of times OpenSSL told us to retry once the socket is writeable.
+  uint64_t ssl_want_write = 0;
+
+  /// Microseconds spent waiting for a socket to become readable.
+  uint64_t wait_readable_usec = 0;
+
+  /// Microseconds spent waiting for a socket to become writeable.
+  uint64_t wait_writeable_usec = 0;
+
+  /// Number of TCP connections established.
+  uint64_t connects = 0;
+
+  /// Microseconds spent establishing TCP connections, including the name
+  /// resolution, for the connections that we established.
+  uint64_t connect_usec = 0;
+
+  /// Number of TLS handshakes completed.
+  uint64_t tls_handshakes = 0;
+
+  /// Microseconds spent in the TLS handshakes that completed.
+  uint64_t tls_handshake_usec = 0;
+
+  /// Number of WebSocket handshakes completed.
+  uint64_t ws_handshakes = 0;
+
+  /// Microseconds spent in the WebSocket handshakes that completed.
+  uint64_t ws_handshake_usec = 0;
+
+  /// Histogram of the payload size of the WebSocket frames we received.
+  uint64_t recv_frame_sizes[frame_size_buckets] = {};
+
+  /// Histogram of the payload size of the WebSocket frames we sent.
+  uint64_t send_frame_sizes[frame_size_buckets] = {};
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t Counters::frame_size_buckets;
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+/// TraceEventType is the type of a TraceEvent.
+enum class TraceEventType {
+  recv,            ///< A recv call. `value` is its return value.
+  send,            ///< A send call. `value` is its return value.
+  ssl_read,        ///< A SSL_read call. `value` is its return value.
+  ssl_write,       ///< A SSL_write call. `value` is its return value.
+  ssl_want_read,   ///< OpenSSL needs the socket to be readable.
+  ssl_want_write,  ///< OpenSSL needs the socket to be writeable.
+  wait_readable,   ///< We waited `value` usec for the socket to be readable.
+  wait_writeable,  ///< We waited `value` usec for the socket to be writeable.
+  connect,         ///< We connected the socket in `value` usec.
+  tls_handshake,   ///< We completed the TLS handshake in `value` usec.
+  ws_handshake,    ///< We completed the WebSocket handshake in `value` usec.
+  recv_frame,      ///< We received a frame with a `value` bytes payload.
+  send_frame,      ///< We're sending a frame with a `value` bytes payload.
+};
+
+/// TraceEvent is an event passed to EventHandler::on_trace().
+class TraceEvent {
+ public:
+  /// Type of the event.
+  TraceEventType type = TraceEventType::recv;
+
+  /// Socket the event refers to, or -1 for frames that we prepare before
+  /// knowing on which socket we'll send them.
+  internal::Socket sock = (internal::Socket)-1;
+
+  /// Value whose meaning depends on the type.
+  int64_t value = 0;
+};
+
 // EventHandler
 // ------------
 
@@ -286,11 +554,341 @@ class EventHandler {
   /// method could be called from another thread context.
   virtual void on_server_busy(std::string msg) noexcept = 0;
 
+  /// Called when a test started either with Client::run() or with
+  /// Client::start() completes. The default behavior is to do nothing.
+  /// @param success is true if the test succeeded and false otherwise.
+  /// \warning This method could be called from another thread context.
+  virtual void on_complete(bool success) noexcept;
+
+  /// Called every Settings::sample_interval seconds while running a subtest,
+  /// when this setting is nonzero. The default behavior is to do nothing.
+  /// Since this method could be called very frequently, it should be fast,
+  /// e.g., it should copy the parts of @p sample it's interested into. The
+  /// @p sample is only valid until this method returns. \warning This method
+  /// could be called from another thread context.
+  virtual void on_sample(const Sample &sample) noexcept;
+
+  /// Called at every I/O operation with an @p event describing it. This
+  /// method is only called if libndt was compiled with LIBNDT_TRACING defined,
+  /// otherwise tracing is compiled out. It always exists, such that the class
+  /// layout does not depend on LIBNDT_TRACING. The default behavior is to do
+  /// nothing. Since this is called very frequently, it should be very fast.
+  /// \warning This method could be called from another thread context.
+  virtual void on_trace(const TraceEvent &event) const noexcept;
+
   /// ~EventHandler is the destructor.
   virtual ~EventHandler() noexcept;
 };
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void EventHandler::on_complete(bool) noexcept {}
+void EventHandler::on_sample(const Sample &) noexcept {}
+void EventHandler::on_trace(const TraceEvent &) const noexcept {}
 EventHandler::~EventHandler() noexcept {}
 
+SampleBuffer::SampleBuffer(size_t capacity) noexcept : capacity_{capacity} {}
+
+void SampleBuffer::push(const Sample &sample) noexcept {
+  if (capacity_ <= 0) {
+    return;
+  }
+  if (samples_.size() < capacity_) {
+    samples_.push_back(sample);
+    return;
+  }
+  // Copy assignment reuses the storage of the oldest sample's flows.
+  samples_[next_] = sample;
+  next_ = (next_ + 1) % capacity_;
+}
+
+size_t SampleBuffer::size() const noexcept { return samples_.size(); }
+
+size_t SampleBuffer::capacity() const noexcept { return capacity_; }
+
+const Sample &SampleBuffer::at(size_t index) const noexcept {
+  assert(index < samples_.size());
+  return samples_[(next_ + index) % samples_.size()];
+}
+
+void SampleBuffer::clear() noexcept {
+  samples_.clear();
+  next_ = 0;
+}
+
+bool SampleBuffer::write_csv(std::ostream &out) const noexcept {
+  // We restore the formatting of @p out, which belongs to the caller.
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << "tid,elapsed,bytes,bytes_delta,flow,flow_bytes,tcpi_valid,tcpi_rtt,"
+      << "tcpi_rttvar,tcpi_min_rtt,tcpi_snd_cwnd,tcpi_total_retrans,"
+      << "tcpi_bytes_acked,tcpi_bytes_received,tcpi_bytes_retrans,"
+      << "tcpi_notsent_bytes,tcpi_delivery_rate\n";
+  for (size_t i = 0; i < size(); ++i) {
+    const Sample &sample = at(i);
+    for (size_t j = 0; j < sample.flows.size(); ++j) {
+      const SampleFlow &flow = sample.flows[j];
+      const SampleTcpInfo &ti = flow.tcp_info;
+      out << (unsigned int)sample.tid << "," << std::fixed
+          << std::setprecision(6) << sample.elapsed << "," << sample.bytes
+          << "," << sample.bytes_delta << "," << j << "," << flow.bytes << ","
+          << (ti.valid ? 1 : 0) << "," << ti.rtt << "," << ti.rttvar << ","
+          << ti.min_rtt << "," << ti.snd_cwnd << "," << ti.total_retrans << ","
+          << ti.bytes_acked << "," << ti.bytes_received << ","
+          << ti.bytes_retrans << "," << ti.notsent_bytes << ","
+          << ti.delivery_rate << "\n";
+    }
+  }
+  out.flags(flags);
+  out.precision(precision);
+  return out.good();
+}
+
+bool SampleBuffer::write_jsonl(std::ostream &out) const noexcept {
+  // Like write_csv(), restore the formatting of @p out.
+  auto flags = out.flags();
+  auto precision = out.precision();
+  for (size_t i = 0; i < size(); ++i) {
+    const Sample &sample = at(i);
+    out << "{\"TestId\":" << (unsigned int)sample.tid << ",\"ElapsedTime\":"
+        << std::fixed << std::setprecision(6) << sample.elapsed
+        << ",\"NumBytes\":" << sample.bytes
+        << ",\"DeltaBytes\":" << sample.bytes_delta << ",\"Flows\":[";
+    for (size_t j = 0; j < sample.flows.size(); ++j) {
+      const SampleFlow &flow = sample.flows[j];
+      const SampleTcpInfo &ti = flow.tcp_info;
+      out << ((j > 0) ? "," : "") << "{\"NumBytes\":" << flow.bytes;
+      if (ti.valid) {
+        out << ",\"TCPInfo\":{\"RTT\":" << ti.rtt << ",\"RTTVar\":" << ti.rttvar
+            << ",\"MinRTT\":" << ti.min_rtt << ",\"SndCwnd\":" << ti.snd_cwnd
+            << ",\"TotalRetrans\":" << ti.total_retrans
+            << ",\"BytesAcked\":" << ti.bytes_acked
+            << ",\"BytesReceived\":" << ti.bytes_received
+            << ",\"BytesRetrans\":" << ti.bytes_retrans
+            << ",\"NotsentBytes\":" << ti.notsent_bytes
+            << ",\"DeliveryRate\":" << ti.delivery_rate << "}";
+      }
+      out << "}";
+    }
+    out << "]}\n";
+  }
+  out.flags(flags);
+  out.precision(precision);
+  return out.good();
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+// Results sinks
+// `````````````
+
+/// ResultRecord is a measurement passed to a ResultsSink. The pointers are
+/// only valid during the ResultsSink::on_record() call.
+class ResultRecord {
+ public:
+  /// Protocol that took the measurement (e.g. "ndt7"). Like name, it is a
+  /// string literal that does not need escaping.
+  const char *scope = "";
+
+  /// Subtest that took the measurement (e.g. "download").
+  const char *name = "";
+
+  /// Index of the flow that took the measurement.
+  uint8_t flow = 0;
+
+  /// Microseconds since the Unix epoch when we got the measurement.
+  uint64_t timestamp_usec = 0;
+
+  /// The measurement, serialized as JSON, and its size.
+  const char *value = nullptr;
+  size_t value_size = 0;
+};
+
+/// ResultsSink receives the measurements as the client takes them. Unlike
+/// EventHandler::on_result(), which is only called in debug mode and receives
+/// copies of the measurements, a sink receives all measurements, pointing it
+/// to the buffers where we received or serialized them. See
+/// Settings::results_sink. \warning on_record() is called by the threads
+/// running the measurement, possibly many at the same time, hence it must
+/// be thread safe and should not block.
+class ResultsSink {
+ public:
+  /// Called for each measurement.
+  virtual void on_record(const ResultRecord &record) noexcept = 0;
+
+  /// ~ResultsSink is the destructor.
+  virtual ~ResultsSink() noexcept;
+};
+
+/// JsonLinesSink writes each record onto a file descriptor as a JSON object
+/// followed by a newline, i.e., as JSON lines, like
+///
+/// ```
+/// {"Scope":"ndt7","Name":"download","Flow":0,"Time":...,"Value":{...}}
+/// ```
+///
+/// where Time is timestamp_usec and Value is the measurement. on_record()
+/// copies the record into a buffer and a background thread writes it to the
+/// file descriptor. If the buffer is full, e.g., because the file descriptor
+/// is a slow socket, we drop records rather than slowing down the test. We
+/// also drop the records whose value contains control characters, e.g., the
+/// newlines of pretty printed JSON, which would break the framing.
+class JsonLinesSink : public ResultsSink {
+ public:
+  /// Default size of the buffer.
+  static constexpr size_t default_buffer_size = 1 << 20;
+
+  /// Writes onto @p fd, which we close when destroyed if @p close_fd is
+  /// true, using a buffer of @p buffer_size bytes.
+  JsonLinesSink(int fd, bool close_fd,
+                size_t buffer_size = default_buffer_size) noexcept;
+
+  void on_record(const ResultRecord &record) noexcept override;
+
+  /// Waits until all records have been written. Returns false if we could
+  /// not write onto the file descriptor.
+  bool flush() noexcept;
+
+  /// Returns the number of records we dropped because the buffer was full
+  /// or because their value contained control characters.
+  uint64_t dropped() const noexcept;
+
+  /// ~JsonLinesSink writes the buffered records.
+  ~JsonLinesSink() noexcept override;
+
+ private:
+  internal::FdRecordWriter writer_;
+};
+
+/// RingFileSink writes the records, formatted like JsonLinesSink does, into
+/// a fixed size file mapped in memory and used as a ring buffer, such that the
+/// file always contains the latest records, and the kernel writes them to disk
+/// in the background. See internal::RingRecordWriter for the file format. Not
+/// available on Windows.
+class RingFileSink : public ResultsSink {
+ public:
+  /// Default size of the ring.
+  static constexpr size_t default_ring_size = 16 << 20;
+
+  /// RingFileSink drops all records until you open() it.
+  RingFileSink() noexcept;
+
+  /// Creates, or truncates, @p path and uses it as a ring of @p ring_size
+  /// bytes. Returns false on failure.
+  bool open(const std::string &path,
+            size_t ring_size = default_ring_size) noexcept;
+
+  void on_record(const ResultRecord &record) noexcept override;
+
+  /// Returns the number of records we dropped, because we were not open,
+  /// because they were larger than the ring, or because their value contained
+  /// control characters (see JsonLinesSink).
+  uint64_t dropped() const noexcept;
+
+  /// ~RingFileSink is the destructor.
+  ~RingFileSink() noexcept override;
+
+ private:
+  internal::RingRecordWriter writer_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+ResultsSink::~ResultsSink() noexcept {}
+
+// Formats the part of the JSON line of @p record preceding the value into
+// @p base and @p count and returns its length, or zero on failure.
+static internal::Size format_record_prefix(const ResultRecord &record,
+                                           char *base,
+                                           internal::Size count) noexcept {
+  internal::JsonWriter writer{base, count};
+  writer.Raw("{\"Scope\":\"");
+  writer.Raw(record.scope);
+  writer.Raw("\",\"Name\":\"");
+  writer.Raw(record.name);
+  writer.Raw("\",\"Flow\":");
+  writer.Uint64(record.flow);
+  writer.Raw(",\"Time\":");
+  writer.Uint64(record.timestamp_usec);
+  writer.Raw(",\"Value\":");
+  return writer.Good() ? writer.Length() : 0;
+}
+
+// Returns whether the value of @p record contains control characters, e.g.,
+// the newlines of pretty printed JSON sent by the server, which would break
+// the one record per line framing. Since JSON strings cannot contain control
+// characters, compact JSON does not contain any.
+static bool record_has_control_characters(const ResultRecord &record) noexcept {
+  for (size_t i = 0; i < record.value_size; ++i) {
+    if ((unsigned char)record.value[i] < 0x20) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Prepares in @p pieces the three pieces of the JSON line of @p record, using
+// @p prefix, of @p count bytes, for the prefix. Returns false on failure.
+static bool prepare_record_pieces(const ResultRecord &record, char *prefix,
+                                  internal::Size count,
+                                  internal::RecordPiece *pieces) noexcept {
+  internal::Size length = format_record_prefix(record, prefix, count);
+  if (length <= 0 || record.value == nullptr || record.value_size <= 0) {
+    return false;
+  }
+  pieces[0].base = prefix;
+  pieces[0].count = (size_t)length;
+  pieces[1].base = record.value;
+  pieces[1].count = record.value_size;
+  pieces[2].base = "}\n";
+  pieces[2].count = 2;
+  return true;
+}
+
+constexpr size_t JsonLinesSink::default_buffer_size;
+
+JsonLinesSink::JsonLinesSink(int fd, bool close_fd, size_t buffer_size) noexcept
+    : writer_{fd, close_fd, buffer_size} {}
+
+void JsonLinesSink::on_record(const ResultRecord &record) noexcept {
+  if (record.value != nullptr && record_has_control_characters(record)) {
+    writer_.Drop();
+    return;
+  }
+  char prefix[256];
+  internal::RecordPiece pieces[3];
+  if (prepare_record_pieces(record, prefix, sizeof(prefix), pieces)) {
+    (void)writer_.Append(pieces, 3);
+  }
+}
+
+bool JsonLinesSink::flush() noexcept { return writer_.Flush(); }
+
+uint64_t JsonLinesSink::dropped() const noexcept { return writer_.Dropped(); }
+
+JsonLinesSink::~JsonLinesSink() noexcept {}
+
+constexpr size_t RingFileSink::default_ring_size;
+
+RingFileSink::RingFileSink() noexcept {}
+
+bool RingFileSink::open(const std::string &path, size_t ring_size) noexcept {
+  return writer_.Open(path, ring_size);
+}
+
+void RingFileSink::on_record(const ResultRecord &record) noexcept {
+  if (record.value != nullptr && record_has_control_characters(record)) {
+    writer_.Drop();
+    return;
+  }
+  char prefix[256];
+  internal::RecordPiece pieces[3];
+  if (prepare_record_pieces(record, prefix, sizeof(prefix), pieces)) {
+    (void)writer_.Append(pieces, 3);
+  }
+}
+
+uint64_t RingFileSink::dropped() const noexcept { return writer_.Dropped(); }
+
+RingFileSink::~RingFileSink() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
 // Settings
 // ````````
 
@@ -309,9 +907,76 @@ class Settings {
   /// geo_options policy that is the most robust to random server failures.
   MlabnsPolicy mlabns_policy = mlabns_policy_geo_options;
 
+  /// For how many seconds to reuse the servers returned by mlab-ns for the
+  /// same protocol and policy. When three quarters of this time have elapsed,
+  /// we refresh the servers in the background. Zero, the default, disables
+  /// the cache, such that every test queries mlab-ns.
+  Timeout mlabns_cache_ttl = Timeout{0} /* seconds */;
+
+  /// Path of the file where to persist the mlab-ns cache, such that the servers
+  /// survive across processes. If empty, the default, the cache only lives in
+  /// memory. Only meaningful when mlabns_cache_ttl is nonzero.
+  std::string mlabns_cache_path;
+
   /// Timeout used for I/O operations.
   Timeout timeout = Timeout{7} /* seconds */;
 
+  /// Interval between on_performance() calls, in seconds. This is also the
+  /// interval between the ndt7 upload measurements we send to the server.
+  /// Values not greater than zero select the default.
+  double measurement_interval = 0.25 /* seconds */;
+
+  /// Interval between on_sample() calls, in seconds. Zero, the default,
+  /// disables sampling. Sampling is separate from on_performance(), so that
+  /// you can sample at a much higher rate, e.g. every 10 ms, without the
+  /// cost of formatting and emitting progress messages each time.
+  double sample_interval = 0.0 /* seconds */;
+
+  /// Number of samples to keep in the ring buffer returned by samples().
+  /// Zero, the default, disables the buffer. Only meaningful when the
+  /// sample_interval is nonzero.
+  size_t sample_buffer_size = 0;
+
+  /// Size of the buffer of random data that we upload, in bytes. It is
+  /// created once and shared by all the upload flows and subtests. The ndt5
+  /// upload sends the whole buffer with each send, while ndt7 upload messages
+  /// send a slice of it (so sizes smaller than such slice are rounded up).
+  size_t upload_payload_size = 131072;
+
+  /// Whether to try to back the upload buffer with huge pages, which may
+  /// reduce TLB misses when sending at high speed. If the system does not
+  /// have huge pages, we silently fall back to normal pages.
+  bool upload_payload_huge_pages = false;
+
+  /// Size of the messages sent by the ndt7 upload, in bytes. The default is
+  /// the initial size suggested by the ndt7 specification. Messages are slices
+  /// of the upload payload, which we enlarge if needed, and cannot be larger
+  /// than 16 MiB, the maximum size of ndt7 messages.
+  size_t ndt7_upload_message_size = 1 << 13;
+
+  /// Whether to grow the ndt7 upload messages as the upload progresses, as
+  /// suggested by the ndt7 specification: we double the size of messages
+  /// every time the bytes sent so far exceed sixteen times such size, until
+  /// the messages are as large as the upload payload. Larger messages reduce
+  /// the per message overhead, which matters on fast paths. You may want to
+  /// also increase upload_payload_size, so that messages can grow more.
+  bool ndt7_adaptive_message_size = false;
+
+  /// Size of the socket send buffer (SO_SNDBUF), in bytes. Zero, the default,
+  /// leaves the system default, which usually means autotuning.
+  int socket_send_buffer = 0;
+
+  /// Size of the socket receive buffer (SO_RCVBUF), in bytes. We set this
+  /// before connecting, since it determines the TCP window scale. Zero, the
+  /// default, leaves the system default, which usually means autotuning.
+  int socket_recv_buffer = 0;
+
+  /// Value of TCP_NOTSENT_LOWAT, in bytes, i.e., how much unsent data the
+  /// kernel should keep in the send buffer before telling us the socket is
+  /// writable. Zero, the default, leaves the system default. Not available
+  /// on all systems.
+  int tcp_notsent_lowat = 0;
+
   /// Host name of the NDT server to use. If this is left blank (the default),
   /// we will use mlab-ns to discover a nearby server.
   std::string hostname;
@@ -348,6 +1013,43 @@ class Settings {
   /// than anticipated, due to buffering and/or changing network conditions.
   Timeout max_runtime = Timeout{14} /* seconds */;
 
+  /// Tolerance for stopping the ndt7 download early, once the throughput has
+  /// converged, as a fraction of the speed (e.g. 0.05 for 5%). We consider
+  /// the latest convergence_window seconds and stop, closing the WebSocket
+  /// cleanly, when the speeds in the two halves of the window are within this
+  /// tolerance of the speed over the whole window. In such case, the download
+  /// speed is the speed over the window, which does not include the TCP
+  /// startup phase. Zero, the default, disables early termination.
+  double convergence_tolerance = 0.0;
+
+  /// Width of the window used to detect convergence, in seconds.
+  double convergence_window = 2.0 /* seconds */;
+
+  /// Minimum runtime of a download that stops early, in seconds.
+  double convergence_min_runtime = 4.0 /* seconds */;
+
+  /// Whether to speculatively connect to the next ndt7 server returned by
+  /// mlab-ns while trying the current one. When we cannot connect to the
+  /// current server, we always try the next one, and with this option the
+  /// connection is likely already established, so that a busy or dead server
+  /// does not delay the test by several seconds. When we connect to the
+  /// current server, we close the speculative connection. Disabled by
+  /// default, since it wastes a connection to a server most of the times.
+  bool ndt7_preconnect = false;
+
+  /// Interval, in seconds, between the round trip time measurements taken
+  /// during the ndt7 download and upload. We send a WebSocket PING frame
+  /// containing the current time over each connection and the server echoes
+  /// it back in a PONG frame. Since the PONG waits behind the data queued
+  /// along the path, these measurements show the latency under load, e.g.,
+  /// caused by bufferbloat. At the end of each subtest, we pass a summary of
+  /// the round trip times to on_result(). Zero, the default, disables these
+  /// measurements, which rely on the server replying to PING frames, as
+  /// required by RFC6455. While uploading, we read the PONG frames between
+  /// messages, hence, with ndt7_adaptive_message_size, the round trip times
+  /// may include up to the time needed to send a message.
+  double ndt7_latency_interval = 0.0;
+
   /// SOCKSv5h port to use for tunnelling traffic using, e.g., Tor. If non
   /// empty, all DNS and TCP traffic should be tunnelled over such port.
   std::string socks5h_port;
@@ -365,15 +1067,48 @@ class Settings {
   /// not disable this option in general, since doing that is insecure.
   bool tls_verify_peer = true;
 
+  /// Whether to offload TLS to the kernel (kTLS), when the kernel supports
+  /// it for the negotiated cipher. This saves a lot of CPU at high speed,
+  /// especially when uploading, because we then send data using plain socket
+  /// writes and the kernel encrypts it. Only available on Linux with OpenSSL
+  /// v3.0 or newer. Disabled by default. When kTLS cannot be enabled, we
+  /// silently fall back to doing TLS in userspace.
+  bool tls_ktls = false;
+
+  /// Whether to receive the data of the download subtests using io_uring,
+  /// where the kernel keeps receiving into buffers we provide, so that we
+  /// don't need a system call per receive. This saves CPU when running many
+  /// flows at high speed. Only available on Linux 6.0 or newer, if libndt
+  /// has been compiled with LIBNDT_HAVE_IO_URING. Disabled by default. When
+  /// we cannot use io_uring, we silently fall back to using recv(2), which
+  /// also happens for the connections using kTLS (see tls_ktls).
+  bool io_uring = false;
+
   /// Run in "summary only" mode. If this flag is enabled, most log messages are
   /// hidden and the only output on stdout is the test summary.
   bool summary_only = false;
+
+  /// Number of parallel connections used by the ndt7 download and upload
+  /// subtests. The default is to use a single connection, as mandated by the
+  /// ndt7 specification. More connections may be needed to saturate paths
+  /// with a large bandwidth-delay product.
+  uint8_t ndt7_nflows = 1;
+
+  /// Sink receiving the ndt7 measurements as we take them, if not null. See
+  /// ResultsSink. The sink may be shared by many clients.
+  std::shared_ptr<ResultsSink> results_sink;
 };
 
 
 // Client
 // ``````
 
+class Ndt7Flow;
+class Ndt7Preconnect;
+class Ndt7Subtest;
+class SocketVector;
+class WsReader;
+
 /// NDT client. In the typical usage, you just need to construct a Client,
 /// optionally providing settings, and to call the run() method. More advanced
 /// usage may require you to override methods in a subclass to customize the
@@ -406,6 +1141,47 @@ class Client : public EventHandler {
   /// Runs a NDT test using the configured (or default) settings.
   bool run() noexcept;
 
+  /// Starts a NDT test without running it. You then drive the test by
+  /// calling step() until it returns false, waiting for the sockets and the
+  /// deadline returned by poll_fds() in between, and you can cancel() it at
+  /// any time. Returns false if a test is already running.
+  bool start() noexcept;
+
+  /// Advances the test started by start() without blocking for long. The
+  /// ndt7 subtests run a bit at a time, using non-blocking I/O, and so do
+  /// the reads of the ndt5 control messages, once poll_fds() says that they
+  /// are readable. The phases that we cannot run a bit at a time, i.e., the
+  /// mlab-ns query, the connects, and the ndt5 subtests, run in a worker
+  /// thread, whose completion a later step() notices, hence the EventHandler
+  /// methods may also be called from such thread. Returns true if you should
+  /// call step() again and false once the test is complete, in which case
+  /// on_complete() was called.
+  bool step() noexcept;
+
+  /// Fills @p pfds with the sockets, and the events, that the next step()
+  /// waits for and returns the milliseconds after which you should call
+  /// step() anyway, e.g. to take a measurement, or -1 if there is no such
+  /// deadline. A zero return value means that you should call step() now.
+  /// While the worker thread is running and during the ndt7 subtests using
+  /// many flows, which background threads run, there is no socket to wait
+  /// for, and we return the time of the next check.
+  int poll_fds(std::vector<pollfd> *pfds) const noexcept;
+
+  /// Returns the socket that the next step() waits for to be readable, if
+  /// that is the only socket returned by poll_fds(), and -1 otherwise, e.g.
+  /// when there is no socket to wait for. Prefer poll_fds(), which also
+  /// tells you when to call step() if no socket becomes ready.
+  internal::Socket poll_fd() const noexcept;
+
+  /// Cancels the running test. This method can be called from any thread.
+  /// The running phase, including the mlab-ns query, notices within about a
+  /// second and fails. Then, the next step() completes the test with failure.
+  void cancel() noexcept;
+
+  /// Returns whether the latest test, started with run() or with start(),
+  /// has completed successfully.
+  bool succeeded() const noexcept;
+
   void on_warning(const std::string &s) const noexcept override;
 
   void on_info(const std::string &s) const noexcept override;
@@ -423,6 +1199,15 @@ class Client : public EventHandler {
 
   void on_server_busy(std::string msg) noexcept override;
 
+  void on_complete(bool success) noexcept override;
+
+  /// Returns the latest samples (see Settings::sample_buffer_size).
+  const SampleBuffer &samples() const noexcept;
+
+  /// Returns a snapshot of the counters. This method can be called from any
+  /// thread, including while a test is running.
+  Counters counters() const noexcept;
+
   /*
                _        __             _    _ _                _
    ___ _ _  __| |  ___ / _|  _ __ _  _| |__| (_)__   __ _ _ __(_)
@@ -443,6 +1228,17 @@ class Client : public EventHandler {
  private:
 #endif
 
+  // drive runs the test started by start() until it is complete, in this
+  // thread, waiting with step_wait() between steps, and returns whether the
+  // test succeeded. Unlike when the caller drives the test with step(), we
+  // don't use the worker thread, hence the phases that run in it block. This
+  // is how run() and the Runner work.
+  bool drive() noexcept;
+
+  // step_wait waits for the sockets and the deadline returned by poll_fds(),
+  // for at most step_wait_msec, so that we notice cancel() meanwhile.
+  void step_wait() noexcept;
+
   // High-level API
   virtual void summary() noexcept;
   virtual bool query_mlabns(std::vector<std::string> *) noexcept;
@@ -461,6 +1257,13 @@ class Client : public EventHandler {
   virtual bool run_meta() noexcept;
   virtual bool run_upload() noexcept;
 
+  // run_flows runs the @p tid subtest over all the sockets in @p socks using
+  // a single thread and netx_poll() to wait for the sockets to be ready. It
+  // returns in @p total_data the bytes transferred and in @p elapsed the
+  // seconds elapsed. An error in a flow stops that flow but not the others.
+  virtual void run_flows(NettestFlags tid, const SocketVector &socks,
+                         double *total_data, double *elapsed) noexcept;
+
   // ndt7 protocol API
   // `````````````````
   //
@@ -470,15 +1273,190 @@ class Client : public EventHandler {
   // Note that we cannot have ndt7 without OpenSSL.
 
   // ndt7_download performs a ndt7 download. Returns true if the download
-  // succeeds and false in case of failure.
+  // succeeds and false in case of failure. Unlike step(), which runs the
+  // download a bit at a time, this method blocks until it is complete.
   bool ndt7_download() noexcept;
 
   // ndt7_upload is like ndt7_download but performs an upload.
   bool ndt7_upload() noexcept;
 
+  // ndt7_run_subtest runs the @p tid ndt7 subtest until it is complete,
+  // waiting for the network with step_wait(), and returns whether it
+  // succeeds. This is how ndt7_download() and ndt7_upload() work.
+  bool ndt7_run_subtest(NettestFlags tid) noexcept;
+
+  // The following methods run the @p tid ndt7 subtest a bit at a time, such
+  // that step() does not block for long. ndt7_subtest_begin() prepares the
+  // state of the subtest, ndt7_subtest_dial() connects, which may block, and
+  // ndt7_subtest_start() prepares the buffers and starts the flows. Then,
+  // ndt7_subtest_resume() advances the subtest and returns
+  // Err::operation_would_block until it is complete, or the error that
+  // occurred. Meanwhile, ndt7_subtest_poll_fds() tells what to wait for.
+  // Finally, ndt7_subtest_finish() stops the flows, reports the results, and
+  // returns @p ok, which tells whether the subtest succeeded.
+  void ndt7_subtest_begin(NettestFlags tid) noexcept;
+  bool ndt7_subtest_dial() noexcept;
+  bool ndt7_subtest_start() noexcept;
+  internal::Err ndt7_subtest_resume() noexcept;
+  int ndt7_subtest_poll_fds(std::vector<pollfd> *pfds) const noexcept;
+  bool ndt7_subtest_finish(bool ok) noexcept;
+
+  // ndt7_subtest_stop tells the background threads of the ndt7 subtest that
+  // is running, if any, to stop, waits for them, and destroys the state of
+  // the subtest, without reporting its results.
+  void ndt7_subtest_stop() noexcept;
+
+  // ndt7_download_resume and ndt7_upload_resume implement
+  // ndt7_subtest_resume() for a single flow, using non-blocking I/O.
+  internal::Err ndt7_download_resume() noexcept;
+  internal::Err ndt7_upload_resume() noexcept;
+
+  // ndt7_multi_start and ndt7_multi_resume implement ndt7_subtest_start()
+  // and ndt7_subtest_resume() for ndt7_nflows parallel connections, each one
+  // handled by a background thread.
+  bool ndt7_multi_start() noexcept;
+  internal::Err ndt7_multi_resume() noexcept;
+
+  // ndt7_on_download_measurement processes the measurement of @p size bytes
+  // at @p data sent by the server over the flow with index @p flow. We only
+  // extract the fields needed by the summary from the measurement, and save
+  // a copy of it for ndt7_materialize_flows().
+  void ndt7_on_download_measurement(uint8_t flow, const char *data,
+                                    size_t size) noexcept;
+
+  // Ndt7UploadSample contains the TCPInfo counters of an upload measurement
+  // that we need for the summary, so that we don't need to parse the JSON.
+  struct Ndt7UploadSample {
+    bool has_tcpinfo = false;
+    uint64_t bytes_retrans = 0;
+    uint64_t bytes_sent = 0;
+  };
+
+  // ndt7_upload_message_size returns the size of the next ndt7 upload
+  // message, given that messages are slices of @p payload, the @p current
+  // message size (zero for the first message), and the @p total bytes
+  // sent so far (see Settings::ndt7_adaptive_message_size).
+  internal::Size ndt7_upload_message_size(const internal::Payload &payload,
+                                          internal::Size current,
+                                          internal::Size total) const noexcept;
+
+  // ndt7_upload_measurement writes into the @p count bytes at @p base the
+  // JSON measurement of the upload flow using @p sock, which has been running
+  // for @p elapsed seconds sending @p total bytes, and fills @p sample. It
+  // returns the size of the JSON, or zero if @p count is too small. This
+  // method is called by the background threads.
+  internal::Size ndt7_upload_measurement(internal::Socket sock, double elapsed,
+                                         internal::Size total, char *base,
+                                         internal::Size count,
+                                         Ndt7UploadSample *sample) const noexcept;
+
+  // ndt7_on_upload_measurement processes the measurement of @p size bytes at
+  // @p json, which we have taken (and sent to the server) for flow @p flow,
+  // along with its @p sample.
+  void ndt7_on_upload_measurement(uint8_t flow, const char *json, size_t size,
+                                  const Ndt7UploadSample &sample) noexcept;
+
+  // ndt7_emit_record passes the JSON measurement of @p size bytes at @p data,
+  // taken by the flow @p flow of the subtest @p name, to the results sink,
+  // if any, without copying it.
+  void ndt7_emit_record(const char *name, uint8_t flow, const char *data,
+                        size_t size) const noexcept;
+
+  // ndt7_send_measurement sends the measurement of @p count bytes written at
+  // offset ws_max_header_size of @p buffer, masking it in place. A zero
+  // @p count means that the measurement did not fit its buffer, in which
+  // case we skip it rather than failing the subtest.
+  internal::Err ndt7_send_measurement(internal::Socket sock, uint8_t *buffer,
+                                      internal::Size count) const noexcept;
+
+  // ndt7_maybe_ping sends a WebSocket PING frame over @p sock, to measure the
+  // round trip time, if Settings::ndt7_latency_interval seconds have elapsed
+  // between @p *latest and @p now, in which case it sets @p *latest to @p now
+  // and, unless @p pinging is null, @p *pinging to true. This method is
+  // called by the background threads.
+  internal::Err ndt7_maybe_ping(
+      internal::Socket sock, std::chrono::steady_clock::time_point now,
+      std::chrono::steady_clock::time_point *latest,
+      bool *pinging) const noexcept;
+
+  // ndt7_recv_pongs reads the WebSocket frames already received over @p sock
+  // into the @p total bytes at @p base, without waiting for more frames, if
+  // @p *pinging is true, and sets @p *pinging to false once it receives the
+  // PONG of our PING. We use it in the upload flows, to process the PONG
+  // frames without polling the socket before each message, and we ignore
+  // the measurements sent by the server. This method is called by the
+  // background threads.
+  internal::Err ndt7_recv_pongs(internal::Socket sock, uint8_t *base,
+                                internal::Size total,
+                                bool *pinging) const noexcept;
+
+  // ndt7_report_latency stores into @p summary the summary of the round trip
+  // times measured by the subtest @p name and, if any, reports it.
+  void ndt7_report_latency(const char *name,
+                           internal::LatencySummary *summary) noexcept;
+
+  // ndt7_materialize_flows parses the latest measurement of each flow of the
+  // subtest that just completed into @p flows, which is download_flows_ or
+  // upload_flows_. For the download, it also fills measurement_ and
+  // connection_info_. This way we parse the measurements' JSON just once.
+  void ndt7_materialize_flows(nlohmann::json *flows) noexcept;
+
+  // ndt7_drain_flows processes the measurements queued by the background
+  // threads running the @p tid subtest using @p flows.
+  void ndt7_drain_flows(NettestFlags tid,
+                        std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept;
+
+  // ndt7_sum_flows returns the bytes transferred so far by all @p flows.
+  static uint64_t ndt7_sum_flows(
+      const std::vector<std::unique_ptr<Ndt7Flow>> &flows) noexcept;
+
+  // ndt7_dial_flows creates @p nflows connections to @p url_path. It adds
+  // the sockets to @p socks, which owns them, and their state to @p flows.
+  bool ndt7_dial_flows(std::string url_path, uint8_t nflows,
+                       SocketVector *socks,
+                       std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept;
+
   // ndt7_connect connects to @p url_path.
   bool ndt7_connect(std::string url_path) noexcept;
 
+  // ndt7_dial creates a new connection to @p url_path in @p sock. If we have
+  // speculatively connected to @p url_path on the current host, it uses such
+  // connection. Otherwise, it dials and, on success, closes all the other
+  // speculative connections, since we won't need them.
+  bool ndt7_dial(std::string url_path, internal::Socket *sock) noexcept;
+
+  // ndt7_preconnect_next speculatively connects to @p url_path on the host
+  // we would try next, in a background thread, if Settings::ndt7_preconnect
+  // is set and we're not already doing that.
+  void ndt7_preconnect_next(std::string url_path) noexcept;
+
+  // ndt7_preconnect_take waits for the speculative connection to @p url_path
+  // on the current host and moves it into @p sock. Returns false if there is
+  // no such connection or if the speculative connect failed.
+  bool ndt7_preconnect_take(const std::string &url_path,
+                            internal::Socket *sock) noexcept;
+
+  // ndt7_preconnect_abandon abandons all the speculative connections, which
+  // are closed as soon as they are established, and cancels the clients
+  // that are still connecting.
+  void ndt7_preconnect_abandon() noexcept;
+
+  // ndt7_preconnect_stop waits for the background threads of all the
+  // speculative connections and closes the connections.
+  void ndt7_preconnect_stop() noexcept;
+
+  // ndt7_preconnect_client creates the client that speculatively connects
+  // using @p settings. We use a distinct client because its state is not
+  // shared with the background thread, which can thus connect while we
+  // are connecting, or running a subtest, in this client. Then, we make it
+  // share our caches and admission.
+  virtual std::unique_ptr<Client> ndt7_preconnect_client(
+      Settings settings) noexcept;
+
+  // ndt7_adopt moves the state of @p sock, which @p other has connected,
+  // into this client, such that @p sock belongs to this client.
+  void ndt7_adopt(Client *other, internal::Socket sock) noexcept;
+
   // NDT protocol API
   // ````````````````
   //
@@ -528,26 +1506,46 @@ class Client : public EventHandler {
 
   // Prepare and return a WebSocket frame containing @p first_byte and
   // the content of @p base and @p count as payload. If @p base is nullptr
-  // then we'll just not include a body in the prepared frame.
+  // then we'll just not include a body in the prepared frame. Returns an
+  // empty string if we cannot generate a masking key.
   virtual std::string ws_prepare_frame(uint8_t first_byte, uint8_t *base,
                                        internal::Size count) const noexcept;
 
+  // Prepare a WebSocket frame in place. @p buffer is a caller owned buffer
+  // whose first ws_max_header_size bytes are reserved for the header and
+  // are followed by @p count bytes of payload. We mask the payload in place
+  // and write the header right before it, such that the frame is contiguous
+  // and can be sent with a single write. On success, @p *frame points to the
+  // beginning of the frame and @p *framelen contains its size. Each call uses
+  // a fresh masking key, so call this method again before sending the same
+  // buffer again (masking the already masked payload is fine, since its
+  // content is random anyway).
+  virtual internal::Err ws_prepare_frame_inplace(
+      uint8_t first_byte, uint8_t *buffer, internal::Size count,
+      uint8_t **frame, internal::Size *framelen) const noexcept;
+
   // Send @p count bytes from @p base over @p sock as a frame whose first byte
-  // @p first_byte should contain the opcode and possibly the FIN flag.
+  // @p first_byte should contain the opcode and possibly the FIN flag. Note
+  // that the content of @p base is masked in place.
   virtual internal::Err ws_send_frame(internal::Socket sock, uint8_t first_byte, uint8_t *base,
                             internal::Size count) const noexcept;
 
   // Receive a frame from @p sock. Puts the opcode in @p *opcode. Puts whether
   // there is a FIN flag in @p *fin. The buffer starts at @p base and it
   // contains @p total bytes. Puts in @p *count the actual number of bytes
-  // in the message. @return The error that occurred or Err::none.
+  // in the message. If @p discard is true, the body of binary and continue
+  // frames is read and thrown away rather than stored into @p base, and it is
+  // then not required to fit into @p total bytes. @return The error that
+  // occurred or Err::none.
   internal::Err ws_recv_any_frame(internal::Socket sock, uint8_t *opcode, bool *fin, uint8_t *base,
-                        internal::Size total, internal::Size *count) const noexcept;
+                        internal::Size total, internal::Size *count,
+                        bool discard) const noexcept;
 
   // Receive a frame. Automatically and transparently responds to PING, ignores
   // PONG, and handles CLOSE frames. Arguments like ws_recv_any_frame().
   internal::Err ws_recv_frame(internal::Socket sock, uint8_t *opcode, bool *fin, uint8_t *base,
-                    internal::Size total, internal::Size *count) const noexcept;
+                    internal::Size total, internal::Size *count,
+                    bool discard) const noexcept;
 
   // Receive a message consisting of one or more frames. Transparently handles
   // PING and PONG frames. Handles CLOSE frames. @param sock is the socket to
@@ -558,6 +1556,86 @@ class Client : public EventHandler {
   internal::Err ws_recvmsg(internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
                  internal::Size *count) const noexcept;
 
+  // Like ws_recvmsg() except that the payload of binary messages is read and
+  // thrown away, so @p base and @p total only need to be large enough for
+  // text messages and control frames. The size of binary messages is still
+  // returned in @p *count. This is meant for measurement payload, which we
+  // only need to count.
+  internal::Err ws_recvmsg_discard(internal::Socket sock, uint8_t *opcode,
+                                   uint8_t *base, internal::Size total,
+                                   internal::Size *count) const noexcept;
+
+  // Implementation of ws_recvmsg() and ws_recvmsg_discard().
+  internal::Err ws_recvmsg_common(internal::Socket sock, uint8_t *opcode,
+                                  uint8_t *base, internal::Size total,
+                                  internal::Size *count,
+                                  bool discard) const noexcept;
+
+  // Starts the closing handshake by sending a CLOSE frame over @p sock and
+  // then discards the incoming frames until the peer replies with CLOSE. The
+  // buffer at @p base of size @p total is used to receive the text and
+  // control frames, while the body of binary frames is thrown away. @return
+  // Err::none once we received CLOSE, or the error that occurred.
+  internal::Err ws_close(internal::Socket sock, uint8_t *base,
+                         internal::Size total) const noexcept;
+
+  // Receive exactly @p count bytes from @p sock into @p base. If @p sock is a
+  // WebSocket created by netx_maybews_dial(), we read through its receive
+  // buffer, so that parsing several small frames only requires a single
+  // recv call (or SSL_read). Reads larger than the buffer bypass it, so
+  // large frame bodies land directly into @p base. If @p sock has no receive
+  // buffer, this is equivalent to netx_recvn().
+  internal::Err ws_recvn(internal::Socket sock, void *base, internal::Size count) const noexcept;
+
+  // Like ws_recvn() but the @p count bytes are thrown away. When @p sock has
+  // a receive buffer, we use it as scratch space, so there is no copy.
+  internal::Err ws_discardn(internal::Socket sock, internal::Size count) const noexcept;
+
+  // Receive up to @p count bytes from @p sock into @p base without blocking,
+  // putting in @p *actual the bytes received. Like ws_recvn(), we read
+  // through the receive buffer, if any. If @p base is null, the bytes are
+  // thrown away. Returns the error of netx_recv_nonblocking(), e.g.
+  // Err::operation_would_block, if there is nothing to read.
+  internal::Err ws_recv_nonblocking(internal::Socket sock, void *base,
+                                    internal::Size count,
+                                    internal::Size *actual) const noexcept;
+
+  // Like ws_recvmsg_discard() but without blocking. We keep the state of the
+  // message we are receiving in @p reader, so that we can resume from where
+  // we stopped, once @p sock is ready, when we return the error telling what
+  // to wait for, i.e. Err::operation_would_block, Err::ssl_want_read, or
+  // Err::ssl_want_write. Returns Err::eof when we receive CLOSE, which we
+  // reply to unless we have sent CLOSE (see WsReader).
+  internal::Err ws_recvmsg_nonblocking(internal::Socket sock,
+                                       WsReader *reader, uint8_t *opcode,
+                                       uint8_t *base, internal::Size total,
+                                       internal::Size *count) const noexcept;
+
+  // Validate the first two bytes of a frame header at @p buf, and put the
+  // opcode in @p *opcode, the FIN flag in @p *fin, and the 7 bit length
+  // in @p *length, where 126 and 127 mean that an extended length follows
+  // (see ws_parse_length()). @return The error that occurred or Err::none.
+  internal::Err ws_parse_header(const uint8_t *buf, uint8_t *opcode, bool *fin,
+                                internal::Size *length) const noexcept;
+
+  // Decode into @p *length the extended length of @p len_size bytes, i.e.
+  // two or eight, at @p buf. @return The error that occurred or Err::none.
+  internal::Err ws_parse_length(const uint8_t *buf, internal::Size len_size,
+                                internal::Size *length) const noexcept;
+
+  // Statistics about the receive buffer of a WebSocket.
+  struct WsRecvStats {
+    // Number of frames received.
+    uint64_t frames = 0;
+
+    // Number of calls to netx_recv(), i.e. of recv or SSL_read calls.
+    uint64_t recv_calls = 0;
+  };
+
+  // Copy the statistics of the receive buffer of @p sock into @p *stats.
+  // Returns false if @p sock has no receive buffer.
+  bool ws_recv_stats(internal::Socket sock, WsRecvStats *stats) const noexcept;
+
   // Networking layer
   // ````````````````
   //
@@ -605,10 +1683,21 @@ class Client : public EventHandler {
   // Map getaddrinfo return value into a Err value.
   internal::Err netx_map_eai(int ec) noexcept;
 
-  // Connect to @p hostname and @p port.
+  // Connect to @p hostname and @p port. When @p hostname resolves to many
+  // addresses, start staggered connect attempts as described in RFC8305.
   virtual internal::Err netx_dial(const std::string &hostname, const std::string &port,
                         internal::Socket *sock) noexcept;
 
+  // Start a non-blocking connect to @p aip. Returns none if the connect
+  // succeeded immediately and operation_in_progress if it's pending, in
+  // both cases with @p sock set. Otherwise, returns the error.
+  virtual internal::Err netx_dial_start(const addrinfo *aip,
+                                        internal::Socket *sock) noexcept;
+
+  // Applies the socket buffers and TCP_NOTSENT_LOWAT settings to @p sock. We
+  // only warn on failure, since these settings are just optimizations.
+  void netx_tune_socket(internal::Socket sock) noexcept;
+
   // Receive from the network.
   virtual internal::Err netx_recv(internal::Socket fd, void *base, internal::Size count,
                         internal::Size *actual) const noexcept;
@@ -628,6 +1717,15 @@ class Client : public EventHandler {
   virtual internal::Err netx_send_nonblocking(internal::Socket fd, const void *base, internal::Size count,
                                     internal::Size *actual) const noexcept;
 
+  // Returns whether the kernel encrypts what we send over @p fd (kTLS), in
+  // which case we send using plain socket writes.
+  virtual bool netx_ktls_send(internal::Socket fd) const noexcept;
+
+  // Returns whether OpenSSL drives @p fd using a socket BIO, because we have
+  // enabled kTLS for sending or receiving, in which case its I/O bypasses
+  // `sys` and our BIO (see netx_maybessl_dial()).
+  virtual bool netx_ktls(internal::Socket fd) const noexcept;
+
   // Send exactly N bytes to the network.
   virtual internal::Err netx_sendn(
     internal::Socket fd, const void *base, internal::Size count) const noexcept;
@@ -645,6 +1743,15 @@ class Client : public EventHandler {
   // Pauses until the socket becomes writeable.
   virtual internal::Err netx_wait_writeable(internal::Socket, Timeout timeout) const noexcept;
 
+  // Returns true if we can read from @p fd without polling because there is
+  // data in its WebSocket receive buffer or inside OpenSSL.
+  virtual bool netx_has_pending_data(internal::Socket fd) const noexcept;
+
+  // Tells sys that we are about to receive a lot of data from @p fd, so it
+  // can use io_uring, if enabled (see Settings::io_uring), unless OpenSSL
+  // reads from @p fd directly because of kTLS (see netx_ktls()).
+  void netx_start_bulk_recv(internal::Socket fd) const noexcept;
+
   // Main function for dealing with I/O patterned after poll(2).
   virtual internal::Err netx_poll(
     std::vector<pollfd> *fds, int timeout_msec) const noexcept;
@@ -658,13 +1765,120 @@ class Client : public EventHandler {
   virtual bool query_mlabns_curl(const std::string &url, long timeout,
                                  std::string *body) noexcept;
 
+  // Refreshes in the background the mlab-ns cache entry for @p url.
+  virtual void query_mlabns_prefetch(const std::string &url) noexcept;
+
+  // Parses the mlab-ns response @p body and appends the servers to @p fqdns.
+  static bool query_mlabns_parse(const internal::Logger &logger,
+                                 const std::string &body,
+                                 std::vector<std::string> *fqdns) noexcept;
+
+  // Sampling helpers
+  //
+  // A subtest calls sample_begin() when it starts. Then, when sample_due()
+  // says it's time to take a sample, it calls sample_flow() for each flow
+  // and then sample_complete(), which calls on_sample().
+
+  // Prepares for sampling the @p tid subtest using @p nflows flows.
+  void sample_begin(NettestFlags tid, size_t nflows) noexcept;
+
+  // Returns whether we should take a sample @p elapsed seconds after the
+  // beginning of the subtest. Always false if sampling is disabled.
+  bool sample_due(double elapsed) const noexcept;
+
+  // Records that @p index-th flow using @p sock transferred @p bytes so far.
+  void sample_flow(size_t index, internal::Socket sock, uint64_t bytes) noexcept;
+
+  // Completes the sample taken @p elapsed seconds after the beginning.
+  void sample_complete(double elapsed) noexcept;
+
+  // Returns the seconds until the next sample is due, given that @p elapsed
+  // seconds elapsed since the beginning of the subtest. Used by the loops to
+  // decide for how long they can sleep. Returns a large value if sampling is
+  // disabled.
+  double sample_wait(double elapsed) const noexcept;
+
+  // Returns Settings::measurement_interval or its default.
+  double get_measurement_interval() const noexcept;
+
+  // Returns the shared buffer of random data to upload, as configured in the
+  // Settings, or nullptr if we cannot allocate it.
+  std::shared_ptr<const internal::Payload> upload_payload() const noexcept;
+
   // Other helpers
 
   Verbosity get_verbosity() const noexcept;
 
+  // Returns true if cancel() has been called.
+  bool is_cancelled() const noexcept;
+
+  // subtest_memory estimates the memory used by the buffers of the @p tid
+  // subtest, including the socket buffers, if configured.
+  internal::Size subtest_memory(NettestFlags tid) const noexcept;
+
+  // subtest_acquire waits until admission allows us to run the @p tid
+  // subtest. Returns false if we've been cancelled while waiting.
+  bool subtest_acquire(NettestFlags tid) noexcept;
+
+  // subtest_release tells admission that the subtest is done.
+  void subtest_release() noexcept;
+
   // Reference to overridable system dependencies
   std::unique_ptr<internal::Sys> sys{new internal::Sys{}};
 
+  // Cache of SSL contexts and TLS sessions. By default, all the clients in
+  // this process share the same cache; override to use a private cache.
+  std::shared_ptr<internal::SslCache> ssl_cache{internal::SslCache::Global()};
+
+  // Cache of mlab-ns results and of the connection to mlab-ns. By default,
+  // all the clients in this process share it, like ssl_cache.
+  std::shared_ptr<internal::MlabnsCache> mlabns_cache{
+      internal::MlabnsCache::Global()};
+
+  // Limits on the subtests that clients sharing it run at the same time. By
+  // default, there are no limits. A Runner shares it among its clients.
+  std::shared_ptr<internal::Admission> admission;
+
+  // Indexes of the counters (see Counters). The frame size histograms take
+  // Counters::frame_size_buckets counters each.
+  enum CounterIndex : size_t {
+    counter_recv_calls,
+    counter_send_calls,
+    counter_poll_calls,
+    counter_connect_calls,
+    counter_poll_wakeups,
+    counter_ssl_read_calls,
+    counter_ssl_write_calls,
+    counter_ssl_want_read,
+    counter_ssl_want_write,
+    counter_wait_readable_usec,
+    counter_wait_writeable_usec,
+    counter_connects,
+    counter_connect_usec,
+    counter_tls_handshakes,
+    counter_tls_handshake_usec,
+    counter_ws_handshakes,
+    counter_ws_handshake_usec,
+    counter_recv_frame_sizes,
+    counter_send_frame_sizes =
+        counter_recv_frame_sizes + Counters::frame_size_buckets,
+    counter_count = counter_send_frame_sizes + Counters::frame_size_buckets,
+  };
+
+  // Counters updated by the I/O functions, which may run in many threads,
+  // each of which updates its own shard, e.g., one per ndt7 flow.
+  mutable internal::ShardedCounters<counter_count> atomic_counters;
+
+  // count_frame counts a frame with a @p size bytes payload in the histogram
+  // starting at @p base, i.e., counter_recv_frame_sizes or
+  // counter_send_frame_sizes.
+  void count_frame(CounterIndex base, internal::Size size) const noexcept;
+
+  // trace calls on_trace() with an event made of @p type, @p sock, and @p
+  // value. Use LIBNDT_TRACE(), which compiles out without LIBNDT_TRACING.
+  void trace(TraceEventType type, internal::Socket sock,
+             int64_t value) const noexcept;
+
  protected:
   // SummaryData contains the fields that are needed to generate the summary
   // at the end of the tests.
@@ -683,6 +1897,11 @@ class Client : public EventHandler {
 
       // TCPInfo's MinRTT (microseconds).
       uint32_t min_rtt;
+
+      // Round trip times measured during the ndt7 download and upload (see
+      // Settings::ndt7_latency_interval), all zero if not measured.
+      internal::LatencySummary download_latency;
+      internal::LatencySummary upload_latency;
   };
 
   SummaryData summary_;
@@ -696,6 +1915,12 @@ class Client : public EventHandler {
   // ndt7 ConnectionInfo object.
   nlohmann::json connection_info_;
 
+  // ndt7 latest measurement of each download flow.
+  nlohmann::json download_flows_;
+
+  // ndt7 latest measurement of each upload flow.
+  nlohmann::json upload_flows_;
+
  private:
   class Winsock {
    public:
@@ -711,12 +1936,235 @@ class Client : public EventHandler {
   std::vector<NettestFlags> granted_suite_;
   Settings settings_;
 
-  std::map<internal::Socket, SSL *> fd_to_ssl_;
+  // Buffers that msg_read() reuses across the messages of the control
+  // connection: the buffer for whole WebSocket messages, allocated when
+  // first needed, and the raw message, whose storage we reuse.
+  std::unique_ptr<char[]> msg_buffer_;
+  std::string msg_raw_;
+
+  // Phase is the next phase of a test driven by step().
+  enum class Phase {
+    idle,
+    query_mlabns,
+    next_host,
+    ndt7_download,
+    ndt7_download_dial,
+    ndt7_download_run,
+    ndt7_upload,
+    ndt7_upload_dial,
+    ndt7_upload_run,
+    connect,
+    send_login,
+    recv_kickoff,
+    wait_in_queue,
+    recv_version,
+    recv_tests_ids,
+    run_tests,
+    recv_results_and_logout,
+    wait_close,
+    done,
+  };
+
+  // step_complete completes the test and always returns false.
+  bool step_complete(bool success) noexcept;
+
+  // step_offload runs @p op, which may block, in the worker thread, and
+  // returns false while it is running. Once @p op is complete, it returns
+  // true with the result of @p op in @p *result. When drive() is running
+  // the test, it runs @p op in this thread and returns true.
+  bool step_offload(std::function<bool()> op, bool *result) noexcept;
+
+  // step_ndt7_complete moves to the next phase once the ndt7 subtest that
+  // is running is complete, given whether it succeeded (@p ok).
+  bool step_ndt7_complete(bool ok) noexcept;
+
+  Phase phase_ = Phase::idle;
+  std::vector<std::string> fqdns_;
+  size_t next_fqdn_ = 0;
+  bool success_ = false;
+
+  // Whether drive() is running the test, and the worker thread running the
+  // phases that may block otherwise, along with their result, which we read
+  // once the worker thread is done, and the descriptors of step_wait().
+  bool step_inline_ = false;
+  std::thread worker_;
+  bool worker_result_ = false;
+  std::atomic<bool> worker_done_{false};
+  std::vector<pollfd> step_pfds_;
+
+  // State of the ndt7 subtest that is running, if any.
+  std::unique_ptr<Ndt7Subtest> ndt7_subtest_;
+
+  // Whether ndt7_dial() failed in the ndt7 subtest that is running, in which
+  // case we try another host, and speculative ndt7 connections.
+  bool ndt7_dial_failed_ = false;
+  std::vector<std::unique_ptr<Ndt7Preconnect>> ndt7_preconnects_;
+
+  // Memory acquired from admission for the subtest that is running.
+  internal::Size subtest_memory_ = 0;
+
+  // cancelled_ is set by cancel(), which may run in another thread, and is
+  // checked by all the loops that could run for a long time.
+  std::atomic<bool> cancelled_{false};
+
+  // parent_cancelled_ is the cancelled_ of the client that created us to
+  // speculatively connect, if any, which outlives us.
+  const std::atomic<bool> *parent_cancelled_ = nullptr;
+
+  // Sample being taken, reused across samples to avoid allocations, when
+  // the next sample is due, and buffer of the latest samples.
+  Sample sample_;
+  double sample_next_ = 0.0;
+  SampleBuffer samples_;
+
+  // Ndt7Stats contains the latest measurement of a ndt7 flow, as received by
+  // the wire, and the TCPInfo fields that we need to compute the summary.
+  struct Ndt7Stats {
+    std::string latest;
+    bool has_tcpinfo = false;
+    int64_t bytes_retrans = 0;
+    int64_t bytes_sent = 0;
+    int64_t min_rtt = 0;
+  };
+
+  // ndt7_stats returns the stats of @p flow, creating them if needed.
+  Ndt7Stats &ndt7_stats(uint8_t flow) noexcept;
+
+  // Stats of each flow of the ndt7 subtest that is running.
+  std::vector<Ndt7Stats> ndt7_stats_;
+
+  // Latest download measurement that contained the ConnectionInfo, which the
+  // server only sends in the first measurement, and flow that received the
+  // latest download measurement.
+  std::string ndt7_connection_info_;
+  uint8_t ndt7_latest_flow_ = 0;
+
+  // Round trip times measured by the ndt7 subtest that is running, which we
+  // update when receiving PONG frames (see ndt7_maybe_ping()).
+  mutable internal::Latency ndt7_latency_;
+
+  // WsRecvBuffer is the receive buffer of a WebSocket (see ws_recvn()).
+  struct WsRecvBuffer {
+    std::unique_ptr<uint8_t[]> data;
+    internal::Size capacity = 0;
+    internal::Size begin = 0;
+    internal::Size end = 0;
+    WsRecvStats stats;
+  };
+
+  // Connection is the state of a socket we have dialed: the SSL, if we use
+  // TLS, and the receive buffer, if we use WebSocket, which has no data
+  // otherwise. The I/O functions find it at every call. The table is only
+  // modified when dialing and closing sockets; the measurement threads only
+  // find their own socket (see SocketTable).
+  struct Connection {
+    SSL *ssl = nullptr;
+    WsRecvBuffer ws;
+  };
+
+  // connection returns the state of @p sock or nullptr.
+  Connection *connection(internal::Socket sock) const noexcept;
+
+  // connection_create returns the state of @p sock, creating it if needed.
+  Connection *connection_create(internal::Socket sock) noexcept;
+
+  // ws_recv_buffer returns the receive buffer of @p sock or nullptr.
+  WsRecvBuffer *ws_recv_buffer(internal::Socket sock) const noexcept;
+
+  internal::SocketTable<Connection> connections_;
 #ifdef _WIN32
   Winsock winsock_;
 #endif
 };
 
+// Runner
+// ``````
+
+/// Runner settings. The defaults are listed below.
+class RunnerSettings {
+ public:
+  /// Maximum number of clients running at the same time. Each running
+  /// client uses a thread of the Runner.
+  size_t max_parallel_clients = 4;
+
+  /// Maximum number of subtests running at the same time, across all the
+  /// clients. Zero, the default, means no limit other than the number of
+  /// clients running at the same time.
+  size_t max_parallel_subtests = 0;
+
+  /// Maximum memory used by the buffers of the subtests running at the same
+  /// time, in bytes. We estimate the memory used by a subtest from its
+  /// Settings, including the socket buffers, if configured. Zero, the
+  /// default, means no limit.
+  uint64_t max_buffer_memory = 0;
+};
+
+/// Runs many clients in parallel, e.g. to measure many servers, with bounded
+/// resources. The clients share the cache of SSL contexts and TLS sessions,
+/// the cache of mlab-ns results, and the limits on the subtests. Each client
+/// reports its results using its own EventHandler methods, which may thus be
+/// called from the Runner threads. In particular, a Runner thread runs each
+/// client by calling start() and then stepping it until the test is complete,
+/// hence EventHandler::on_complete() tells you when each client is done.
+class Runner {
+ public:
+  /// Constructs a Runner with default settings.
+  Runner() noexcept;
+
+  /// Explicitly deleted copy constructor.
+  Runner(const Runner &) noexcept = delete;
+
+  /// Explicitly deleted copy assignment.
+  Runner &operator=(const Runner &) noexcept = delete;
+
+  /// Explicitly deleted move constructor.
+  Runner(Runner &&) noexcept = delete;
+
+  /// Explicitly deleted move assignment.
+  Runner &operator=(Runner &&) noexcept = delete;
+
+  /// Constructs a Runner with the specified @p settings.
+  explicit Runner(RunnerSettings settings) noexcept;
+
+  /// Destroys a Runner, and the clients it owns.
+  virtual ~Runner() noexcept;
+
+  /// Adds @p client to the clients to run, replacing its caches and limits
+  /// with the ones shared by the Runner.
+  void add(std::unique_ptr<Client> client) noexcept;
+
+  /// Runs all the clients added so far, at most max_parallel_clients at a
+  /// time, and returns when all of them are done. Returns true if all of
+  /// them succeeded and false otherwise.
+  bool run() noexcept;
+
+  /// Cancels the running clients and prevents the other ones from running.
+  /// You may call this method from another thread.
+  void cancel() noexcept;
+
+  /// Returns the clients, e.g. to inspect their results after run().
+  const std::vector<std::unique_ptr<Client>> &clients() const noexcept;
+
+ protected:
+  RunnerSettings settings_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::shared_ptr<internal::SslCache> ssl_cache_{internal::SslCache::Global()};
+  std::shared_ptr<internal::MlabnsCache> mlabns_cache_{
+      internal::MlabnsCache::Global()};
+  std::shared_ptr<internal::Admission> admission_;
+
+  // Index of the next client to run, which the Runner threads increment,
+  // and flag set by cancel(), which may run in another thread.
+  std::atomic<size_t> next_client_{0};
+  std::atomic<bool> cancelled_{false};
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+
+#if !defined(_WIN32) && !defined(__linux__)
+#include <netinet/tcp.h>  // For TCP_NOTSENT_LOWAT
+#endif
+
 #ifdef __linux__
 #include <linux/tcp.h>
 #define NDT7_ENUM_TCP_INFO \
@@ -773,12 +2221,35 @@ class Client : public EventHandler {
   XX(tcpi_bytes_retrans, TcpiBytesRetrans) \
   XX(tcpi_dsack_dups, TcpiDsackDups) \
   XX(tcpi_reord_seen, TcpiReordSeen)
-#endif // __linux__
 
-// WebSocket constants
-// ```````````````````
+// Ndt7TcpInfoField is a tcp_info field that we include into the ndt7 upload
+// measurements. The name is already quoted and followed by a colon, so that
+// we can write it as is. We use accessors rather than offsets, because some
+// fields of tcp_info are bitfields.
+struct Ndt7TcpInfoField {
+  const char *name;
+  uint64_t (*get)(const tcp_info &);
+};
 
-// Opcodes. See <https://tools.ietf.org/html/rfc6455#section-11.8>.
+#define XX(lower_, upper_)                                              \
+  static uint64_t ndt7_tcp_info_get_##lower_(const tcp_info &tcpinfo) { \
+    return (uint64_t)tcpinfo.lower_;                                    \
+  }
+NDT7_ENUM_TCP_INFO
+#undef XX
+
+// ndt7_tcp_info_fields is the table of the tcp_info fields that we write.
+constexpr Ndt7TcpInfoField ndt7_tcp_info_fields[] = {
+#define XX(lower_, upper_) {"\"" #upper_ "\":", ndt7_tcp_info_get_##lower_},
+    NDT7_ENUM_TCP_INFO
+#undef XX
+};
+#endif // __linux__
+
+// WebSocket constants
+// ```````````````````
+
+// Opcodes. See <https://tools.ietf.org/html/rfc6455#section-11.8>.
 constexpr uint8_t ws_opcode_continue = 0;
 constexpr uint8_t ws_opcode_text = 1;
 constexpr uint8_t ws_opcode_binary = 2;
@@ -797,6 +2268,16 @@ constexpr uint8_t ws_opcode_mask = 0x0f;
 constexpr uint8_t ws_mask_flag = 0x80;
 constexpr uint8_t ws_len_mask = 0x7f;
 
+// Size of the masking key and maximum size of the header of a masked frame,
+// i.e. two bytes, plus eight bytes of extended length, plus the masking key.
+// See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+constexpr internal::Size ws_mask_size = 4;
+constexpr internal::Size ws_max_header_size = 2 + 8 + ws_mask_size;
+
+// Maximum payload size of control frames. "All control frames MUST have a
+// payload length of 125 bytes or less" [RFC6455 Sect. 5.5].
+constexpr internal::Size ws_max_control_size = 125;
+
 // Flags used to specify what HTTP headers are required and present into the
 // websocket handshake where we upgrade from HTTP/1.1 to websocket.
 constexpr uint64_t ws_f_connection = 1 << 0;
@@ -810,6 +2291,47 @@ constexpr const char *ws_proto_c2s = "c2s";
 constexpr const char *ws_proto_s2c = "s2c";
 constexpr const char *ws_proto_ndt7 = "net.measurementlab.ndt.v7";
 
+// WsReader is the state of the WebSocket message that we are receiving using
+// Client::ws_recvmsg_nonblocking(), which we resume, once the socket is ready
+// again, from where we stopped.
+class WsReader {
+ public:
+  // Header of the frame we are receiving, of which we have received
+  // header_size bytes out of header_need. Since servers MUST NOT mask
+  // frames, the header is at most two bytes plus eight of extended length.
+  uint8_t header[2 + 8] = {};
+  internal::Size header_size = 0;
+  internal::Size header_need = 2;
+
+  // Whether we are receiving the body of the frame, its opcode and FIN
+  // flag, and the bytes of the body we still need to receive.
+  bool in_body = false;
+  uint8_t opcode = 0;
+  bool fin = false;
+  internal::Size remaining = 0;
+
+  // Body of the control frame we are receiving. We don't store it into the
+  // caller's buffer, since control frames may be injected in the middle of
+  // a fragmented message (RFC6455 Sect. 5.4).
+  uint8_t control[ws_max_control_size] = {};
+  internal::Size control_size = 0;
+
+  // Opcode of the message we are receiving, or zero between messages, and
+  // its size so far.
+  uint8_t message = 0;
+  internal::Size count = 0;
+
+  // Whether we have sent CLOSE, in which case we MUST NOT reply to PING and
+  // to CLOSE (see Client::ws_close()), and whether we received CLOSE.
+  bool closing = false;
+  bool closed = false;
+
+  // Number of bytes received, including headers, and of PONG frames that
+  // carried the payload of one of our PINGs (see Client::ndt7_maybe_ping()).
+  uint64_t received = 0;
+  uint64_t pongs = 0;
+};
+
 // Private constants
 // `````````````````
 
@@ -820,10 +2342,13 @@ constexpr size_t msg_kickoff_size = sizeof(msg_kickoff) - 1;
 // Private utils
 // `````````````
 
-// Generic macro for emitting logs.
+// Generic macro for emitting logs. The compiler removes the messages that
+// are more verbose than verbosity_max. Otherwise, we only format messages
+// when the runtime verbosity tells us that they're going to be emitted.
 #define LIBNDT_EMIT_LOG_EX(client, level, statements)      \
   do {                                                     \
-    if (client->get_verbosity() >= verbosity_##level) {    \
+    if (verbosity_##level <= verbosity_max &&              \
+        client->get_verbosity() >= verbosity_##level) {    \
       std::stringstream ss_log_lines;                      \
       ss_log_lines << statements;                          \
       std::string log_line;                                \
@@ -843,36 +2368,36 @@ constexpr size_t msg_kickoff_size = sizeof(msg_kickoff) - 1;
 #define LIBNDT_EMIT_INFO(statements) LIBNDT_EMIT_INFO_EX(this, statements)
 #define LIBNDT_EMIT_DEBUG(statements) LIBNDT_EMIT_DEBUG_EX(this, statements)
 
+// Macros for emitting trace events, which compile out unless LIBNDT_TRACING
+// is defined, in which case the arguments are evaluated.
+#ifdef LIBNDT_TRACING
+#define LIBNDT_TRACE_EX(client, type, sock, value) \
+  client->trace(TraceEventType::type, (sock), (int64_t)(value))
+#else
+#define LIBNDT_TRACE_EX(client, type, sock, value) \
+  do {                                             \
+  } while (0)
+#endif  // LIBNDT_TRACING
+
+#define LIBNDT_TRACE(type, sock, value) LIBNDT_TRACE_EX(this, type, sock, value)
+
 #ifdef _WIN32
 #define LIBNDT_OS_SHUT_RDWR SD_BOTH
 #else
 #define LIBNDT_OS_SHUT_RDWR SHUT_RDWR
 #endif
 
-static void random_printable_fill(char *buffer, size_t length) noexcept {
-  static const std::string ascii =
-      " !\"#$%&\'()*+,-./"          // before numbers
-      "0123456789"                  // numbers
-      ":;<=>?@"                     // after numbers
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"  // uppercase
-      "[\\]^_`"                     // between upper and lower
-      "abcdefghijklmnopqrstuvwxyz"  // lowercase
-      "{|}~"                        // final
-      ;
-  // TODO(bassosimone): the random device is not actually random in a
-  // mingw environment. Here we should perhaps take advantage of the
-  // OpenSSL dependency, when available, and use OpenSSL.
-  std::random_device rd;
-  std::mt19937 g(rd());
-  for (size_t i = 0; i < length; ++i) {
-    buffer[i] = ascii[g() % ascii.size()];
-  }
-}
-
 static double compute_speed_kbits(double data, double elapsed) noexcept {
   return (elapsed > 0.0) ? ((data * 8.0) / 1000.0 / elapsed) : 0.0;
 }
 
+// usec_since returns the microseconds elapsed since @p begin.
+static uint64_t usec_since(std::chrono::steady_clock::time_point begin) noexcept {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
 // format_speed_from_kbits format the input speed, which must be in kbit/s, to
 // a string describing the speed with a measurement unit.
 static std::string format_speed_from_kbits(double speed) noexcept {
@@ -895,6 +2420,17 @@ static std::string format_speed_from_kbits(double data, double elapsed) noexcept
   return format_speed_from_kbits(compute_speed_kbits(data, elapsed));
 }
 
+// format_latency formats the percentiles of the round trip times in
+// @p summary, which are in microseconds, as milliseconds.
+static std::string format_latency(const internal::LatencySummary &summary) noexcept {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << "p50 " << (double)summary.p50 / 1000.0 << " ms, "
+     << "p90 " << (double)summary.p90 / 1000.0 << " ms, "
+     << "p99 " << (double)summary.p99 / 1000.0 << " ms";
+  return ss.str();
+}
+
 static std::string represent(std::string message) noexcept {
   bool printable = true;
   for (auto &c : message) {
@@ -920,42 +2456,50 @@ static std::string represent(std::string message) noexcept {
   return ss.str();
 }
 
-static std::string trim(std::string s) noexcept {
-  auto pos = s.find_first_not_of(" \t");
-  if (pos != std::string::npos) {
-    s = s.substr(pos);
+// Removes leading and trailing spaces and tabs from [*begin, *end), unless
+// the range only contains spaces and tabs, in which case we leave it alone.
+static void trim(const char **begin, const char **end) noexcept {
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+  const char *b = *begin, *e = *end;
+  while (b < e && is_space(*b)) {
+    ++b;
   }
-  pos = s.find_last_not_of(" \t");
-  if (pos != std::string::npos) {
-    s = s.substr(0, pos + 1);
+  if (b == e) {
+    return;
   }
-  return s;
+  while (is_space(*(e - 1))) {
+    --e;
+  }
+  *begin = b, *end = e;
 }
 
+// Parses the "key: value" lines of the web100 message in @p base and @p
+// count into @p json. We scan the message in place, rather than splitting
+// it into lines and tokens, so we only allocate for the keys and values.
 static bool jsonify_web100(Client *client, nlohmann::json &json,
-                        std::string message) noexcept {
-  std::stringstream ss_line{message};
-  std::string line;
-
-  while ((std::getline(ss_line, line, '\n'))) {
-    std::vector<std::string> keyval;
-
-    // Split for ":" and use the first part as key and the rest of the string
-    // as value.
-    size_t pos = 0;
-    std::string token;
-
-    pos = line.find(":");
-    // Fail if there isn't any ":" or the delimiter is at the end of the str.
-    if (pos == std::string::npos || pos == line.length() - 1) {
-      LIBNDT_EMIT_WARNING_EX(client, "incorrectly formatted message: " << message);
-      continue;
+                           const char *base, internal::Size count) noexcept {
+  const char *end = base + count;
+  for (const char *line = base; line < end;) {
+    const char *eol = (const char *)::memchr(line, '\n', (size_t)(end - line));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    // Split for ":" and use the first part as key and the rest of the line
+    // as value. Fail if there isn't any ":" or the delimiter is at the end
+    // of the line.
+    const char *colon =
+        (const char *)::memchr(line, ':', (size_t)(eol - line));
+    if (colon == nullptr || colon == eol - 1) {
+      LIBNDT_EMIT_WARNING_EX(client, "incorrectly formatted message: "
+                                         << std::string(base, (size_t)count));
+    } else {
+      const char *key = line, *key_end = colon;
+      const char *value = colon + 1, *value_end = eol;
+      trim(&key, &key_end);
+      trim(&value, &value_end);
+      json[std::string{key, key_end}] = std::string{value, value_end};
     }
-
-    keyval.push_back(line.substr(0, pos));
-    keyval.push_back(line.substr(pos + 1));
-
-    json[trim(keyval[0])] = trim(keyval[1]);
+    line = eol + 1;
   }
   return true;
 }
@@ -1002,6 +2546,145 @@ SocketVector::~SocketVector() noexcept {
   }
 }
 
+// We assume this cache line size, which is correct for most CPUs we care
+// about, when we want to avoid false sharing between threads.
+constexpr size_t cache_line_size = 64;
+
+// FlowCounter counts the bytes transferred by a flow. Only the thread running
+// the flow writes it, hence we don't need atomic read-modify-write, and the
+// thread running the test only reads it. It is padded on both sides so that
+// it never shares a cache line with other data, whatever its alignment.
+class FlowCounter {
+ public:
+  void add(uint64_t n) noexcept {
+    bytes_.store(bytes_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t get() const noexcept {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  char before_[cache_line_size] = {};
+  std::atomic<uint64_t> bytes_{0};
+  char after_[cache_line_size - sizeof(std::atomic<uint64_t>)] = {};
+};
+
+// Ndt7Flow is the state of a ndt7 flow shared by the background thread that
+// runs the flow and the thread running the test.
+class Ndt7Flow {
+ public:
+  internal::Socket sock = (internal::Socket)-1;
+  std::mutex mutex;
+  std::vector<std::string> messages;  // protected by mutex
+  std::vector<Client::Ndt7UploadSample> samples;  // ditto, only for upload
+  bool failed = false;                // read after the flow thread exits
+  FlowCounter counter;
+};
+
+// Ndt7Preconnect is a speculative ndt7 connection, which a background thread
+// establishes using its own client, shared with the thread running the test.
+class Ndt7Preconnect {
+ public:
+  std::string hostname;
+  std::string url_path;
+  std::unique_ptr<Client> client;
+  std::thread thread;
+  std::mutex mutex;
+  internal::Socket sock = (internal::Socket)-1;  // protected by mutex
+  bool done = false;                             // ditto
+  bool abandoned = false;                        // ditto
+};
+
+// Ndt7Subtest is the state of the ndt7 subtest that is running, which we run
+// a bit at a time (see Client::ndt7_subtest_resume()). With many flows, it is
+// shared with the background threads running the flows, which it outlives.
+class Ndt7Subtest {
+ public:
+  explicit Ndt7Subtest(Client *client) noexcept : socks{client} {}
+  NettestFlags tid = 0;
+  std::chrono::steady_clock::time_point begin;
+  std::chrono::steady_clock::time_point latest;       // latest on_performance()
+  std::chrono::steady_clock::time_point latest_ping;  // latest PING
+  std::chrono::steady_clock::time_point latest_io;    // latest I/O progress
+  double measurement_interval = 0.0;
+  std::unique_ptr<internal::Convergence> convergence;  // only for download
+  std::shared_ptr<const internal::Payload> payload;    // only for upload
+
+  // State of a single flow, which uses Client::sock_. We wait for sock_ to
+  // be ready for events, unless again is true, in which case the subtest
+  // stopped to let the caller run and there is more to do right away.
+  internal::Size total = 0;
+  short events = POLLIN;
+  bool again = false;
+  WsReader reader;
+  std::unique_ptr<uint8_t[]> rbuff;  // to receive text and control frames
+  internal::Size rbufsiz = 0;
+  bool pinging = false;
+  uint64_t pongs = 0;                // reader.pongs when we sent PING
+
+  // For the upload, the buffer of the messages, the size of the next one,
+  // and buffers for measurements and PINGs. We send a frame at a time, and
+  // pending points to the bytes of it that we still need to send. Binary
+  // frames carry pending_data bytes of payload, which we count once sent.
+  std::unique_ptr<uint8_t[]> buff;
+  internal::Size size = 0;
+  std::unique_ptr<uint8_t[]> mbuff;
+  uint8_t ping[ws_max_header_size + internal::Latency::payload_size] = {};
+  const uint8_t *pending = nullptr;
+  internal::Size pending_size = 0;
+  internal::Size pending_sent = 0;
+  internal::Size pending_data = 0;
+
+  // State of many flows, which background threads run.
+  SocketVector socks;
+  std::vector<std::unique_ptr<Ndt7Flow>> flows;
+  std::atomic<size_t> active{0};
+  std::atomic<bool> converged{false};
+  std::atomic<bool> stopped{false};
+};
+
+// Threads running flows read the clock to check the deadline only once every
+// this number of iterations, because they iterate very frequently.
+constexpr unsigned int flow_clock_interval = 16;
+
+// Size of the buffer into which we receive ndt7 text messages. We discard the
+// payload of binary messages, so we only need a buffer for measurements sent
+// by the server as text messages, which are much smaller than the 1<<24 bytes
+// maximum message size. (The buffer must also fit control frames, which are
+// at most 125 bytes.)
+constexpr internal::Size ndt7_recv_bufsiz = (1 << 16);
+
+// Maximum time for which ndt7_subtest_resume() runs before returning, such
+// that the caller of step() can run even when the network is always ready.
+constexpr double ndt7_resume_slice = 0.05;
+
+// Size of the ndt7 upload messages when Settings::ndt7_upload_message_size
+// is zero. This is the initial size suggested by the ndt7 specification.
+constexpr internal::Size ndt7_upload_bufsiz = (1 << 13);
+
+// Maximum size of a ndt7 message.
+constexpr internal::Size ndt7_max_message_size = (1 << 24);
+
+// Size of the buffer into which we write the ndt7 upload measurements. This
+// is larger than the largest possible measurement (see the tests).
+constexpr internal::Size ndt7_measurement_bufsiz = 4096;
+
+// The following is the expected ndt7 transfer time for an upload subtest.
+constexpr double ndt7_max_upload_time = 10.0;
+
+// Delay between connect attempts to the addresses of a host. This is the
+// connection attempt delay recommended by RFC8305 Sect. 8.
+constexpr int netx_dial_attempt_delay_msec = 250;
+
+// Maximum time for which step_wait() waits. We wait in slices, like
+// netx_wait(), so that we notice if the test has been cancelled.
+constexpr int step_wait_msec = 250;
+
+// Time after which poll_fds() tells to call step() again while the worker
+// thread is running, since we have no socket to wait for.
+constexpr int step_worker_poll_msec = 10;
+
 // Client constructor and destructor
 // `````````````````````````````````
 
@@ -1009,9 +2692,25 @@ Client::Client() noexcept {}
 
 Client::Client(Settings settings) noexcept : Client::Client() {
   std::swap(settings_, settings);
+#ifdef LIBNDT_HAVE_IO_URING
+  if (settings_.io_uring) {
+    sys.reset(new internal::UringSys{});
+  }
+#endif
 }
 
 Client::~Client() noexcept {
+  // Make sure the worker thread and the flows of a subtest that is still
+  // running, e.g. if we're destroyed in the middle of the test, stop soon.
+  cancelled_ = true;
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  if (ndt7_subtest_) {
+    ndt7_subtest_stop();
+    subtest_release();
+  }
+  ndt7_preconnect_stop();
   if (sock_ != -1) {
     netx_closesocket(sock_);
   }
@@ -1021,86 +2720,365 @@ Client::~Client() noexcept {
 // `````````````
 
 bool Client::run() noexcept {
-  std::vector<std::string> fqdns;
-  if (!query_mlabns(&fqdns)) {
+  if (!start()) {
     return false;
   }
-  for (auto &fqdn : fqdns) {
-    LIBNDT_EMIT_DEBUG("trying to connect to " << fqdn);
-    settings_.hostname = fqdn;
-    // TODO(bassosimone): we will eventually want to refactor the code to
-    // make ndt7 the default and ndt5 the optional case.
-    if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
-      LIBNDT_EMIT_DEBUG("using the ndt7 protocol");
-      if ((settings_.nettest_flags & nettest_flag_download) != 0) {
-        // TODO(bassosimone): for now we do not try with more than one host
-        // when using ndt7 and there's a failure. We may want to do that.
-        if (!ndt7_download()) {
-          LIBNDT_EMIT_WARNING("ndt7: download failed");
-          // FALLTHROUGH
-        }
+  return drive();
+}
+
+bool Client::start() noexcept {
+  if (phase_ != Phase::idle && phase_ != Phase::done) {
+    LIBNDT_EMIT_WARNING("start: a test is already running");
+    return false;
+  }
+  cancelled_ = false;
+  fqdns_.clear();
+  next_fqdn_ = 0;
+  success_ = false;
+  phase_ = Phase::query_mlabns;
+  return true;
+}
+
+bool Client::step() noexcept {
+  if (phase_ == Phase::idle || phase_ == Phase::done) {
+    return false;
+  }
+  if (worker_.joinable() && !worker_done_) {
+    return true;  // the worker thread is still running this phase
+  }
+  if (cancelled_) {
+    LIBNDT_EMIT_WARNING("the test has been cancelled");
+    return step_complete(false);
+  }
+  bool ok = false;
+  switch (phase_) {
+    case Phase::query_mlabns:
+      if (!step_offload([this]() { return query_mlabns(&fqdns_); }, &ok)) {
+        break;
       }
-      if ((settings_.nettest_flags & nettest_flag_upload) != 0) {
-        // TODO(bassosimone): same as above.
-        if (!ndt7_upload()) {
-          LIBNDT_EMIT_WARNING("ndt7: upload failed");
-          // FALLTHROUGH
-        }
+      if (!ok) {
+        return step_complete(false);
       }
-      LIBNDT_EMIT_INFO("ndt7: test complete");
-      // TODO(bassosimone): here we may want to warn if the user selects
-      // subtests that we actually do not implement.
-      return true;
-    }
-    if (!connect()) {
-      LIBNDT_EMIT_WARNING("cannot connect to remote host; trying another one");
-      continue;
-    }
-    LIBNDT_EMIT_DEBUG("connected to remote host");
-    if (!send_login()) {
-      LIBNDT_EMIT_WARNING("cannot send login; trying another host");
-      continue;
-    }
-    LIBNDT_EMIT_DEBUG("sent login message");
-    if (!recv_kickoff()) {
-      LIBNDT_EMIT_WARNING("failed to receive kickoff; trying another host");
-      continue;
-    }
-    if (!wait_in_queue()) {
-      LIBNDT_EMIT_WARNING("failed to wait in queue; trying another host");
-      continue;
+      phase_ = Phase::next_host;
+      break;
+    case Phase::next_host:
+      if (next_fqdn_ >= fqdns_.size()) {
+        LIBNDT_EMIT_WARNING("no more hosts to try; failing the test");
+        return step_complete(false);
+      }
+      settings_.hostname = fqdns_[next_fqdn_++];
+      LIBNDT_EMIT_DEBUG("trying to connect to " << settings_.hostname);
+      // TODO(bassosimone): we will eventually want to refactor the code to
+      // make ndt7 the default and ndt5 the optional case.
+      if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
+        LIBNDT_EMIT_DEBUG("using the ndt7 protocol");
+        phase_ = Phase::ndt7_download;
+      } else {
+        phase_ = Phase::connect;
+      }
+      break;
+    // With ndt7, we try another host if we cannot connect for the first
+    // subtest. Once a subtest has run, we stick with the host, because we
+    // would otherwise run that subtest again with another host.
+    case Phase::ndt7_download:
+      if ((settings_.nettest_flags & nettest_flag_download) == 0) {
+        phase_ = Phase::ndt7_upload;
+        break;
+      }
+      // Waiting for admission may block, unless there are no limits.
+      ok = true;
+      if (admission &&
+          !step_offload(
+              [this]() { return subtest_acquire(nettest_flag_download); },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      ndt7_preconnect_next("/ndt/v7/download");
+      ndt7_subtest_begin(nettest_flag_download);
+      phase_ = Phase::ndt7_download_dial;
+      break;
+    case Phase::ndt7_upload:
+      if ((settings_.nettest_flags & nettest_flag_upload) == 0) {
+        LIBNDT_EMIT_INFO("ndt7: test complete");
+        return step_complete(true);
+      }
+      // Waiting for admission may block, unless there are no limits.
+      ok = true;
+      if (admission &&
+          !step_offload(
+              [this]() { return subtest_acquire(nettest_flag_upload); },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      if ((settings_.nettest_flags & nettest_flag_download) == 0) {
+        ndt7_preconnect_next("/ndt/v7/upload");
+      }
+      ndt7_subtest_begin(nettest_flag_upload);
+      phase_ = Phase::ndt7_upload_dial;
+      break;
+    case Phase::ndt7_download_dial:
+    case Phase::ndt7_upload_dial:
+      if (!step_offload([this]() { return ndt7_subtest_dial(); }, &ok)) {
+        break;
+      }
+      if (!ok || !ndt7_subtest_start()) {
+        return step_ndt7_complete(false);
+      }
+      phase_ = (phase_ == Phase::ndt7_download_dial) ? Phase::ndt7_download_run
+                                                     : Phase::ndt7_upload_run;
+      break;
+    case Phase::ndt7_download_run:
+    case Phase::ndt7_upload_run: {
+      internal::Err err = ndt7_subtest_resume();
+      if (err == internal::Err::operation_would_block) {
+        break;
+      }
+      return step_ndt7_complete(err == internal::Err::none);
     }
-    LIBNDT_EMIT_DEBUG("authorized to run test");
+    case Phase::connect:
+      if (!step_offload([this]() { return connect(); }, &ok)) {
+        break;
+      }
+      if (!ok) {
+        LIBNDT_EMIT_WARNING("cannot connect to remote host; trying another one");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("connected to remote host");
+      phase_ = Phase::send_login;
+      break;
+    case Phase::send_login:
+      if (!send_login()) {
+        LIBNDT_EMIT_WARNING("cannot send login; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("sent login message");
+      phase_ = Phase::recv_kickoff;
+      break;
+    case Phase::recv_kickoff:
+      if (!recv_kickoff()) {
+        LIBNDT_EMIT_WARNING("failed to receive kickoff; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      phase_ = Phase::wait_in_queue;
+      break;
+    case Phase::wait_in_queue:
+      if (!wait_in_queue()) {
+        LIBNDT_EMIT_WARNING("failed to wait in queue; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("authorized to run test");
+      phase_ = Phase::recv_version;
+      break;
     // From this point on we fail the test in case of error rather than
     // trying with another host. The rationale of trying with another host
     // above is that sometimes NDT servers are busy and we would like to
     // use another one rather than creating queue at the busy one.
-    if (!recv_version()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received server version");
-    if (!recv_tests_ids()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received tests ids");
-    if (!run_tests()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("finished running tests; now reading summary data:");
-    if (!recv_results_and_logout()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received logout message");
-    if (!wait_close()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("connection closed");
+    case Phase::recv_version:
+      if (!recv_version()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received server version");
+      phase_ = Phase::recv_tests_ids;
+      break;
+    case Phase::recv_tests_ids:
+      if (!recv_tests_ids()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received tests ids");
+      phase_ = Phase::run_tests;
+      break;
+    case Phase::run_tests:
+      // We admit all the ndt5 subtests at once, because the server decides
+      // when to run them, and the server may be waiting for us meanwhile.
+      // For the same reason, we cannot run them a bit at a time.
+      if (!step_offload(
+              [this]() {
+                if (!subtest_acquire(settings_.nettest_flags)) {
+                  return false;
+                }
+                bool success = run_tests();
+                subtest_release();
+                return success;
+              },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("finished running tests; now reading summary data:");
+      phase_ = Phase::recv_results_and_logout;
+      break;
+    case Phase::recv_results_and_logout:
+      if (!recv_results_and_logout()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received logout message");
+      phase_ = Phase::wait_close;
+      break;
+    case Phase::wait_close:
+      if (!wait_close()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("connection closed");
+      return step_complete(true);
+    case Phase::idle:
+    case Phase::done:
+      assert(false);  // handled above
+      break;
+  }
+  return true;
+}
+
+bool Client::step_complete(bool success) noexcept {
+  if (worker_.joinable()) {
+    worker_.join();  // we only get here once it's done (see step())
+  }
+  if (ndt7_subtest_) {
+    (void)ndt7_subtest_finish(false);
+    subtest_release();
+  }
+  ndt7_preconnect_stop();
+  phase_ = Phase::done;
+  success_ = success;
+  on_complete(success);
+  return false;
+}
+
+bool Client::step_offload(std::function<bool()> op, bool *result) noexcept {
+  assert(result != nullptr);
+  if (worker_.joinable()) {
+    worker_.join();  // we only get here once it's done (see step())
+    *result = worker_result_;
+    return true;
+  }
+  if (step_inline_) {
+    *result = op();
     return true;
   }
-  LIBNDT_EMIT_WARNING("no more hosts to try; failing the test");
+  worker_done_ = false;
+  worker_ = std::thread{[this, op]() noexcept {
+    worker_result_ = op();
+    worker_done_ = true;  // atomic, hence step() then sees worker_result_
+  }};
   return false;
 }
 
+bool Client::step_ndt7_complete(bool ok) noexcept {
+  bool download = ndt7_subtest_->tid == nettest_flag_download;
+  bool first = download || (settings_.nettest_flags & nettest_flag_download) == 0;
+  ok = ndt7_subtest_finish(ok);
+  subtest_release();
+  if (!ok) {
+    if (first && ndt7_dial_failed_) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot connect; trying another host");
+      phase_ = Phase::next_host;
+      return true;
+    }
+    LIBNDT_EMIT_WARNING("ndt7: " << (download ? "download" : "upload")
+                                 << " failed");
+  }
+  if (download) {
+    phase_ = Phase::ndt7_upload;
+    return true;
+  }
+  LIBNDT_EMIT_INFO("ndt7: test complete");
+  // TODO(bassosimone): here we may want to warn if the user selects
+  // subtests that we actually do not implement.
+  return step_complete(true);
+}
+
+bool Client::drive() noexcept {
+  step_inline_ = true;
+  while (step()) {
+    step_wait();
+  }
+  step_inline_ = false;
+  return success_;
+}
+
+void Client::step_wait() noexcept {
+  int timeout = poll_fds(&step_pfds_);
+  if (timeout == 0) {
+    return;
+  }
+  if (timeout < 0 || timeout > step_wait_msec) {
+    timeout = step_wait_msec;
+  }
+  if (step_pfds_.empty()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+    return;
+  }
+  auto begin = std::chrono::steady_clock::now();
+  (void)netx_poll(&step_pfds_, timeout);
+  auto usec = usec_since(begin);
+  bool writeable = std::any_of(step_pfds_.begin(), step_pfds_.end(),
+                               [](const pollfd &pfd) {
+                                 return (pfd.events & POLLOUT) != 0;
+                               });
+  atomic_counters.Add(writeable ? counter_wait_writeable_usec
+                                : counter_wait_readable_usec,
+                      usec);
+}
+
+int Client::poll_fds(std::vector<pollfd> *pfds) const noexcept {
+  assert(pfds != nullptr);
+  pfds->clear();
+  if (worker_.joinable()) {
+    return worker_done_ ? 0 : step_worker_poll_msec;
+  }
+  // In the dial phases, the subtest has not started yet, so the next step
+  // can run right away.
+  if (ndt7_subtest_ && phase_ != Phase::ndt7_download_dial &&
+      phase_ != Phase::ndt7_upload_dial) {
+    return ndt7_subtest_poll_fds(pfds);
+  }
+  switch (phase_) {
+    case Phase::recv_kickoff:
+    case Phase::wait_in_queue:
+    case Phase::recv_version:
+    case Phase::recv_tests_ids:
+    case Phase::recv_results_and_logout:
+    case Phase::wait_close:
+      if (internal::IsSocketValid(sock_) && !netx_has_pending_data(sock_)) {
+        pollfd pfd{};
+        pfd.fd = sock_;
+        pfd.events = POLLIN;
+        pfds->push_back(pfd);
+        return -1;
+      }
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+internal::Socket Client::poll_fd() const noexcept {
+  std::vector<pollfd> pfds;
+  (void)poll_fds(&pfds);
+  if (pfds.size() == 1 && pfds[0].events == POLLIN) {
+    return pfds[0].fd;
+  }
+  return (internal::Socket)-1;
+}
+
+void Client::cancel() noexcept { cancelled_ = true; }
+
+bool Client::succeeded() const noexcept {
+  return phase_ == Phase::done && success_;
+}
+
 void Client::on_warning(const std::string &msg) const noexcept {
   std::clog << "[!] " << msg << std::endl;
 }
@@ -1140,6 +3118,10 @@ void Client::on_server_busy(std::string msg) noexcept {
   LIBNDT_EMIT_WARNING("server is busy: " << msg);
 }
 
+void Client::on_complete(bool success) noexcept {
+  LIBNDT_EMIT_DEBUG("test complete; success: " << std::boolalpha << success);
+}
+
 // High-level API
 // ``````````````
 
@@ -1157,6 +3139,14 @@ void Client::summary() noexcept {
     LIBNDT_EMIT_INFO("Latency: " << std::fixed << std::setprecision(2)
       << (summary_.min_rtt / 1000.0) << " ms");
   }
+  if (summary_.download_latency.count != 0) {
+    LIBNDT_EMIT_INFO("Download latency under load: "
+      << format_latency(summary_.download_latency));
+  }
+  if (summary_.upload_latency.count != 0) {
+    LIBNDT_EMIT_INFO("Upload latency under load: "
+      << format_latency(summary_.upload_latency));
+  }
   if (summary_.download_retrans != 0.0) {
       LIBNDT_EMIT_INFO("Download retransmission: "
         << std::fixed << std::setprecision(2)
@@ -1172,6 +3162,41 @@ void Client::summary() noexcept {
   }
 }
 
+// CurlxLoggerAdapter routes the messages of internal code to a Client.
+class CurlxLoggerAdapter : public internal::Logger {
+ public:
+  explicit CurlxLoggerAdapter(Client *client) noexcept : client_{client} {}
+
+  bool is_warning_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_warning;
+  }
+
+  bool is_info_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_info;
+  }
+
+  bool is_debug_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_debug;
+  }
+
+  void emit_warning(const std::string &s) const noexcept override {
+		client_->on_warning(s);
+  }
+
+  void emit_info(const std::string &s) const noexcept override {
+		client_->on_info(s);
+  }
+
+  void emit_debug(const std::string &s) const noexcept override {
+		client_->on_debug(s);
+  }
+
+  ~CurlxLoggerAdapter() noexcept override {}
+
+ private:
+  Client *client_;
+};
+
 bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
   assert(fqdns != nullptr);
   if (!settings_.hostname.empty()) {
@@ -1204,16 +3229,85 @@ bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
   } else if (settings_.mlabns_policy == mlabns_policy_geo_options) {
     mlabns_url += "?policy=geo_options";
   }
+  std::vector<std::string> discovered;
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache) {
+    bool refresh = false;
+    bool found = mlabns_cache->Get(mlabns_url, &discovered, &refresh);
+    if (!found && !settings_.mlabns_cache_path.empty() &&
+        mlabns_cache->Load(settings_.mlabns_cache_path)) {
+      found = mlabns_cache->Get(mlabns_url, &discovered, &refresh);
+    }
+    if (found) {
+      LIBNDT_EMIT_DEBUG("using cached mlab-ns reply for: " << mlabns_url);
+      if (refresh) {
+        query_mlabns_prefetch(mlabns_url);
+      }
+      for (auto &fqdn : discovered) {
+        LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
+        fqdns->push_back(std::move(fqdn));
+      }
+      return true;
+    }
+  }
   std::string body;
   if (!query_mlabns_curl(mlabns_url, settings_.timeout, &body)) {
     return false;
   }
   LIBNDT_EMIT_DEBUG("mlabns reply: " << body);
+  CurlxLoggerAdapter adapter{this};
+  if (!query_mlabns_parse(adapter, body, &discovered)) {
+    return false;
+  }
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache && !discovered.empty()) {
+    mlabns_cache->Put(mlabns_url, discovered, settings_.mlabns_cache_ttl);
+    if (!settings_.mlabns_cache_path.empty() &&
+        !mlabns_cache->Save(settings_.mlabns_cache_path)) {
+      LIBNDT_EMIT_WARNING("cannot save mlab-ns cache: "
+                          << settings_.mlabns_cache_path);
+    }
+  }
+  for (auto &fqdn : discovered) {
+    LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
+    fqdns->push_back(std::move(fqdn));
+  }
+  return true;
+}
+
+void Client::query_mlabns_prefetch(const std::string &url) noexcept {
+  LIBNDT_EMIT_DEBUG("refreshing mlab-ns cache in the background: " << url);
+  // The background thread must not reference this client, which may be gone
+  // by the time it runs. It holds a reference to the cache, which therefore
+  // outlives it, also when the process exits while it's running.
+  std::shared_ptr<internal::MlabnsCache> cache = mlabns_cache;
+  std::string proxy_port = settings_.socks5h_port;
+  long timeout = settings_.timeout;
+  Timeout ttl = settings_.mlabns_cache_ttl;
+  std::string path = settings_.mlabns_cache_path;
+  (void)cache->Prefetch([cache, proxy_port, url, timeout, ttl, path]() {
+    internal::NoLogger logger;
+    internal::Curlx curlx{logger};
+    std::string body;
+    std::vector<std::string> fqdns;
+    if (!cache->Fetch(curlx, proxy_port, url, timeout, &body) ||
+        !query_mlabns_parse(logger, body, &fqdns) || fqdns.empty()) {
+      return;  // Keep using the entry we have until it expires
+    }
+    cache->Put(url, std::move(fqdns), ttl);
+    if (!path.empty()) {
+      (void)cache->Save(path);
+    }
+  });
+}
+
+bool Client::query_mlabns_parse(const internal::Logger &logger,
+                                const std::string &body,
+                                std::vector<std::string> *fqdns) noexcept {
+  assert(fqdns != nullptr);
   nlohmann::json json;
   try {
     json = nlohmann::json::parse(body);
   } catch (const nlohmann::json::exception &exc) {
-    LIBNDT_EMIT_WARNING("cannot parse JSON: " << exc.what());
+    LIBNDT_LOGGER_WARNING(logger, "cannot parse JSON: " << exc.what());
     return false;
   }
   // In some cases mlab-ns returns a single object but in other cases (e.g.
@@ -1229,10 +3323,9 @@ bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
     try {
       fqdn = entry.at("fqdn").get<std::string>();
     } catch (const nlohmann::json::exception &exc) {
-      LIBNDT_EMIT_WARNING("cannot access FQDN field: " << exc.what());
+      LIBNDT_LOGGER_WARNING(logger, "cannot access FQDN field: " << exc.what());
       return false;
     }
-    LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
     fqdns->push_back(std::move(fqdn));
   }
   return true;
@@ -1361,8 +3454,9 @@ bool Client::recv_results_and_logout() noexcept {
   // Read summary from the server and put it into a JSON object.
   nlohmann::json summary;
 
+  // We reuse the same string for all messages to reuse its storage.
+  std::string message;
   for (auto i = 0; i < max_loops; ++i) {  // don't loop forever
-    std::string message;
     MsgType code = MsgType{0};
     if (!msg_read(&code, &message)) {
       return false;
@@ -1430,6 +3524,9 @@ bool Client::run_download() noexcept {
     LIBNDT_EMIT_WARNING("run_download: not all connect succeeded");
     return false;
   }
+  for (auto sock : dload_socks.sockets) {
+    netx_start_bulk_recv(sock);
+  }
 
   if (!msg_expect_empty(msg_test_start)) {
     return false;
@@ -1440,83 +3537,10 @@ bool Client::run_download() noexcept {
   summary_.download_retrans = 0.0;
   summary_.min_rtt = 0;
   {
-    std::atomic<uint8_t> active{0};
-    auto begin = std::chrono::steady_clock::now();
-    std::atomic<uint64_t> total_data{0};
-    auto max_runtime = settings_.max_runtime;
-    auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
-    const Client *const_this = this;
-    for (internal::Socket fd : dload_socks.sockets) {
-      // TODO(bassosimone): increment active inside the thread main function
-      // as this is more consistent with the fact that thread decrements it
-      active += 1;  // atomic
-      auto main = [
-        &active,       // reference to atomic
-        begin,         // copy for safety
-        fd,            // copy for safety
-        max_runtime,   // copy for safety
-        const_this,    // const pointer
-        &total_data,   // reference to atomic
-        ws             // copy for safety
-      ]() noexcept {
-        constexpr size_t ndt_bufsize = 131072;
-        std::unique_ptr<char[]> buf(new char[ndt_bufsize]);
-        for (;;) {
-          auto err = internal::Err::none;
-          internal::Size n = 0;
-          if (ws) {
-            uint8_t op = 0;
-            err = const_this->ws_recvmsg(
-                    fd, &op, (uint8_t *)buf.get(), ndt_bufsize, &n);
-            if (err == internal::Err::none && op != ws_opcode_binary) {
-              LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_download: unexpected opcode: " << (unsigned int)op);
-              break;
-            }
-          } else {
-            err = const_this->netx_recv(fd, buf.get(), ndt_bufsize, &n);
-          }
-          if (err != internal::Err::none) {
-            if (err != internal::Err::eof) {
-              LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_download: receiving: " << internal::libndt_perror(err));
-            }
-            break;
-          }
-          total_data += (uint64_t)n;   // atomic
-          auto now = std::chrono::steady_clock::now();
-          std::chrono::duration<double> elapsed = now - begin;
-          if (elapsed.count() > max_runtime) {
-            break;
-          }
-        }
-        active -= 1;  // atomic
-      };
-      std::thread thread{std::move(main)};
-      thread.detach();
-    }
-    auto prev = begin;
-    for (;;) {
-      constexpr int timeout_msec = 250;
-      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_msec));
-      if (active <= 0) {
-        break;
-      }
-      auto now = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = now - begin;
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_download,           //
-                     active,                            // atomic
-                     static_cast<double>(total_data),   // atomic
-                     elapsed.count(),                   //
-                     settings_.max_runtime);
-      }
-      prev = now;
-    }
-    auto now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = now - begin;
-    summary_.download_speed = compute_speed_kbits(
-        static_cast<double>(total_data), elapsed.count());
+    double total_data = 0.0;
+    double elapsed = 0.0;
+    run_flows(nettest_flag_download, dload_socks, &total_data, &elapsed);
+    summary_.download_speed = compute_speed_kbits(total_data, elapsed);
   }
 
   {
@@ -1538,8 +3562,9 @@ bool Client::run_download() noexcept {
   }
 
   LIBNDT_EMIT_DEBUG("reading summary web100 variables");
+  // We reuse the same string for all messages to reuse its storage.
+  std::string message;
   for (auto i = 0; i < max_loops; ++i) {  // don't loop forever
-    std::string message;
     MsgType code = MsgType{0};
     if (!msg_read(&code, &message)) {
       return false;
@@ -1572,7 +3597,7 @@ bool Client::run_download() noexcept {
 
       return true;
     }
-    if (!jsonify_web100(this, web100, std::move(message))) {
+    if (!jsonify_web100(this, web100, message.data(), message.size())) {
       // NOTHING - jsonify_web100 warns the user already if it cannot parse
       // the message.
     }
@@ -1643,89 +3668,10 @@ bool Client::run_upload() noexcept {
 
   double client_side_speed = 0.0;
   {
-    std::atomic<uint8_t> active{0};
-    auto begin = std::chrono::steady_clock::now();
-    std::atomic<uint64_t> total_data{0};
-    auto max_runtime = settings_.max_runtime;
-    auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
-    const Client *const_this = this;
-    for (internal::Socket fd : upload_socks.sockets) {
-      // TODO(bassosimone): increment active inside the thread main function
-      // as this is more consistent with the fact that thread decrements it
-      active += 1;  // atomic
-      auto main = [
-        &active,       // reference to atomic
-        begin,         // copy for safety
-        fd,            // copy for safety
-        max_runtime,   // copy for safety
-        const_this,    // const pointer
-        &total_data,   // reference to atomic
-        ws             // copy for safety
-      ]() noexcept {
-        constexpr size_t ndt_bufsize = 131072;
-        std::unique_ptr<char[]> buf(new char[ndt_bufsize]);
-        {
-          auto start = std::chrono::steady_clock::now();
-          random_printable_fill(buf.get(), ndt_bufsize);
-          auto now = std::chrono::steady_clock::now();
-          std::chrono::duration<double> elapsed = now - start;
-          LIBNDT_EMIT_DEBUG_EX(const_this,
-            "run_upload: time to fill random buffer: " << elapsed.count());
-        }
-        std::string frame = const_this->ws_prepare_frame(
-            ws_opcode_binary | ws_fin_flag, (uint8_t *)buf.get(), ndt_bufsize);
-        for (;;) {
-					internal::Size n = 0;
-          auto err = internal::Err::none;
-          if (ws) {
-            err = const_this->netx_sendn(fd, frame.data(), frame.size());
-            if (err == internal::Err::none) {
-              n = frame.size();
-            }
-          } else {
-            err = const_this->netx_send(fd, buf.get(), ndt_bufsize, &n);
-          }
-          if (err != internal::Err::none) {
-            if (err != internal::Err::broken_pipe) {
-              LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_upload: sending: " << internal::libndt_perror(err));
-            }
-            break;
-          }
-          total_data += (uint64_t)n;   // atomic
-          auto now = std::chrono::steady_clock::now();
-          std::chrono::duration<double> elapsed = now - begin;
-          if (elapsed.count() > max_runtime) {
-            break;
-          }
-        }
-        active -= 1;  // atomic
-      };
-      std::thread thread{std::move(main)};
-      thread.detach();
-    }
-    auto prev = begin;
-    for (;;) {
-      constexpr int timeout_msec = 250;
-      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_msec));
-      if (active <= 0) {
-        break;
-      }
-      auto now = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = now - begin;
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_upload,             //
-                     active,                            // atomic
-                     static_cast<double>(total_data),   // atomic
-                     elapsed.count(),                   //
-                     settings_.max_runtime);
-      }
-      prev = now;
-    }
-    auto now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = now - begin;
-    client_side_speed = compute_speed_kbits(  //
-        static_cast<double>(total_data), elapsed.count());
+    double total_data = 0.0;
+    double elapsed = 0.0;
+    run_flows(nettest_flag_upload, upload_socks, &total_data, &elapsed);
+    client_side_speed = compute_speed_kbits(total_data, elapsed);
     LIBNDT_EMIT_DEBUG("run_upload: client computed speed: " << client_side_speed);
   }
 
@@ -1750,51 +3696,529 @@ bool Client::run_upload() noexcept {
   return true;
 }
 
+void Client::run_flows(NettestFlags tid, const SocketVector &socks,
+                       double *total_data, double *elapsed) noexcept {
+  assert(total_data != nullptr && elapsed != nullptr);
+  // Flow is the state of a flow. When a flow is not ready, we're waiting for
+  // netx_poll() to tell us that `events` occurred on its socket.
+  struct Flow {
+    internal::Socket sock = (internal::Socket)-1;
+    bool done = false;
+    bool ready = true;
+    short events = 0;
+    std::unique_ptr<uint8_t[]> buf;  // WebSocket upload only
+    uint8_t *frame = nullptr;        // WebSocket upload only
+    internal::Size framelen = 0;     // ditto
+    internal::Size frameoff = 0;     // ditto
+    uint64_t bytes = 0;
+  };
+  constexpr internal::Size ndt_bufsize = 131072;
+  auto upload = (tid == nettest_flag_upload);
+  auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
+  std::shared_ptr<const internal::Payload> payload;
+  if (upload) {
+    payload = upload_payload();
+    if (!payload) {
+      LIBNDT_EMIT_WARNING("run_flows: cannot allocate the upload payload");
+      *total_data = 0.0;
+      *elapsed = 0.0;
+      return;
+    }
+  }
+  internal::Size bufsize = upload ? payload->Length() : ndt_bufsize;
+  // We report the number of active flows to on_performance() as uint8_t.
+  if (socks.sockets.size() > UINT8_MAX) {
+    LIBNDT_EMIT_WARNING("run_flows: too many flows: " << socks.sockets.size());
+    *total_data = 0.0;
+    *elapsed = 0.0;
+    return;
+  }
+  std::vector<Flow> flows(socks.sockets.size());
+  for (size_t i = 0; i < flows.size(); ++i) {
+    flows[i].sock = socks.sockets[i];
+    if (upload && ws) {
+      // WebSocket frames are masked in place, so each flow needs its own
+      // copy of the payload. We reserve room for the WebSocket header before
+      // the payload, so that we can prepare the frame in place (see below).
+      flows[i].buf.reset(new uint8_t[ws_max_header_size + bufsize]);
+      memcpy(flows[i].buf.get() + ws_max_header_size, payload->Data(),
+             (size_t)bufsize);
+    } else if (upload) {
+      // Nothing to do, since all the flows send the shared payload.
+    } else if (ws) {
+      // We read whole WebSocket messages (see below), so we don't want to
+      // start reading until we know that there is something to read.
+      flows[i].ready = netx_has_pending_data(flows[i].sock);
+      flows[i].events = POLLIN;
+    }
+  }
+  // Since everything runs in this thread, all the download flows can share
+  // the same buffer. With WebSocket we discard the payload and only need
+  // room for control frames; otherwise we read into a heap buffer.
+  uint8_t ctrl[ws_max_control_size] = {};
+  std::unique_ptr<uint8_t[]> rbuf(
+      (upload || ws) ? nullptr : new uint8_t[ndt_bufsize]);
+  size_t active = flows.size();
+  uint64_t total = 0;
+  auto measurement_interval = get_measurement_interval();
+  sample_begin(tid, flows.size());
+  auto begin = std::chrono::steady_clock::now();
+  auto latest = begin;
+  auto progress = begin;
+  std::vector<pollfd> pfds;
+  std::vector<Flow *> polled;
+  auto progressed = false;
+  for (unsigned int iteration = 1;; ++iteration) {
+    auto anyready = false;
+    for (auto &flow : flows) {
+      if (flow.done || !flow.ready) {
+        continue;
+      }
+      auto err = internal::Err::none;
+      internal::Size n = 0;
+      if (upload && ws) {
+        // Each frame needs a fresh masking key, so we (cheaply) prepare the
+        // frame again, reusing the same buffer, once the previous frame has
+        // been fully sent. Until then, we retry with the same arguments, as
+        // required by SSL_write() after a SSL_ERROR_WANT_{READ,WRITE}.
+        if (flow.frameoff >= flow.framelen) {
+          flow.frameoff = 0;
+          err = ws_prepare_frame_inplace(
+              ws_opcode_binary | ws_fin_flag, flow.buf.get(), bufsize,
+              &flow.frame, &flow.framelen);
+        }
+        if (err == internal::Err::none) {
+          err = netx_send_nonblocking(flow.sock, flow.frame + flow.frameoff,
+                                      flow.framelen - flow.frameoff, &n);
+        }
+        if (err == internal::Err::none) {
+          flow.frameoff += n;
+        }
+      } else if (upload) {
+        err = netx_send_nonblocking(flow.sock, payload->Data(), bufsize, &n);
+      } else if (ws) {
+        // Implementation note: we only start reading a message when we know
+        // that there is data to read; however, we read the whole message,
+        // hence we may block for some time if only part of it has arrived.
+        uint8_t op = 0;
+        err = ws_recvmsg_discard(flow.sock, &op, ctrl, sizeof(ctrl), &n);
+        if (err == internal::Err::none && op != ws_opcode_binary) {
+          LIBNDT_EMIT_WARNING(
+              "run_flows: unexpected opcode: " << (unsigned int)op);
+          flow.done = true;
+          active -= 1;
+          continue;
+        }
+        if (err == internal::Err::none &&
+            !netx_has_pending_data(flow.sock)) {
+          flow.ready = false;
+          flow.events = POLLIN;
+        }
+      } else {
+        err = netx_recv_nonblocking(flow.sock, rbuf.get(), ndt_bufsize, &n);
+      }
+      switch (err) {
+        case internal::Err::none:
+          total += (uint64_t)n;
+          flow.bytes += (uint64_t)n;
+          progressed = true;
+          break;
+        case internal::Err::operation_would_block:
+          flow.ready = false;
+          flow.events = upload ? POLLOUT : POLLIN;
+          break;
+        case internal::Err::ssl_want_read:
+          flow.ready = false;
+          flow.events = POLLIN;
+          break;
+        case internal::Err::ssl_want_write:
+          flow.ready = false;
+          flow.events = POLLOUT;
+          break;
+        default:
+          if (err != (upload ? internal::Err::broken_pipe : internal::Err::eof)) {
+            LIBNDT_EMIT_WARNING("run_flows: " << (upload ? "sending" : "receiving")
+                                << ": " << internal::libndt_perror(err));
+          }
+          flow.done = true;
+          active -= 1;
+          break;
+      }
+      anyready = anyready || (!flow.done && flow.ready);
+    }
+    if (active <= 0) {
+      break;
+    }
+    // When flows are busy we loop very frequently, so we don't read the clock
+    // at every iteration. We always read it before polling though.
+    if (anyready && iteration % flow_clock_interval != 0) {
+      continue;
+    }
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("run_flows: the test has been cancelled");
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (progressed) {
+      progress = now;
+      progressed = false;
+    }
+    std::chrono::duration<double> current = now - begin;
+    if (current.count() > settings_.max_runtime) {
+      break;
+    }
+    if (sample_due(current.count())) {
+      for (size_t i = 0; i < flows.size(); ++i) {
+        sample_flow(i, flows[i].sock, flows[i].bytes);
+      }
+      sample_complete(current.count());
+    }
+    std::chrono::duration<double> interval = now - latest;
+    if (interval.count() >= measurement_interval) {
+      if (!settings_.summary_only) {
+        on_performance(tid, static_cast<uint8_t>(active),
+                       static_cast<double>(total),
+                       current.count(), settings_.max_runtime);
+      }
+      latest = now;
+      interval = std::chrono::duration<double>::zero();
+    }
+    if (anyready) {
+      continue;
+    }
+    pfds.clear();
+    polled.clear();
+    for (auto &flow : flows) {
+      if (!flow.done) {
+        pollfd pfd{};
+        pfd.fd = flow.sock;
+        pfd.events = flow.events;
+        pfds.push_back(pfd);
+        polled.push_back(&flow);
+      }
+    }
+    // Wake up in time for the next sample or on_performance() call.
+    double wait = std::min(measurement_interval - interval.count(),
+                           sample_wait(current.count()));
+    auto timeout_msec = (int)(std::max(wait, 0.0) * 1000.0) + 1;
+    auto err = netx_poll(&pfds, timeout_msec);
+    if (err == internal::Err::timed_out) {
+      std::chrono::duration<double> idle = now - progress;
+      if (idle.count() > settings_.timeout) {
+        LIBNDT_EMIT_WARNING("run_flows: no flow made progress for too long");
+        break;
+      }
+      continue;
+    }
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING(
+          "run_flows: netx_poll() failed: " << internal::libndt_perror(err));
+      break;
+    }
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      if (pfds[i].revents != 0) {
+        polled[i]->ready = true;
+      }
+    }
+  }
+  std::chrono::duration<double> runtime =
+      std::chrono::steady_clock::now() - begin;
+  *total_data = static_cast<double>(total);
+  *elapsed = runtime.count();
+}
+
 // ndt7 protocol API
 // `````````````````
 
 bool Client::ndt7_download() noexcept {
-  LIBNDT_EMIT_INFO("starting ndt7 download test");
-  if (!ndt7_connect("/ndt/v7/download")) {
-    return false;
+  return ndt7_run_subtest(nettest_flag_download);
+}
+
+bool Client::ndt7_upload() noexcept {
+  return ndt7_run_subtest(nettest_flag_upload);
+}
+
+bool Client::ndt7_run_subtest(NettestFlags tid) noexcept {
+  // We wait for the network in this thread, like drive() does.
+  bool step_inline = step_inline_;
+  step_inline_ = true;
+  ndt7_subtest_begin(tid);
+  bool ok = ndt7_subtest_dial() && ndt7_subtest_start();
+  if (ok) {
+    internal::Err err = internal::Err::none;
+    while ((err = ndt7_subtest_resume()) ==
+           internal::Err::operation_would_block) {
+      step_wait();
+    }
+    ok = (err == internal::Err::none);
+  }
+  step_inline_ = step_inline;
+  return ndt7_subtest_finish(ok);
+}
+
+void Client::ndt7_subtest_begin(NettestFlags tid) noexcept {
+  ndt7_subtest_stop();  // in case the previous subtest did not finish
+  if (tid == nettest_flag_download) {
+    LIBNDT_EMIT_INFO("starting ndt7 download test");
+    summary_.download_speed = 0.0;
+    summary_.download_retrans = 0.0;
+    summary_.min_rtt = 0;
+    ndt7_connection_info_.clear();
+  } else {
+    LIBNDT_EMIT_INFO("starting ndt7 upload test");
+    summary_.upload_speed = 0.0;
+    summary_.upload_retrans = 0.0;
+  }
+  ndt7_stats_.assign(settings_.ndt7_nflows, Ndt7Stats{});
+  ndt7_latency_.Reset();
+  ndt7_dial_failed_ = false;
+  ndt7_subtest_.reset(new Ndt7Subtest{this});
+  ndt7_subtest_->tid = tid;
+}
+
+bool Client::ndt7_subtest_dial() noexcept {
+  assert(ndt7_subtest_);
+  std::string url_path = (ndt7_subtest_->tid == nettest_flag_download)
+                             ? "/ndt/v7/download"
+                             : "/ndt/v7/upload";
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_dial_flows(url_path, settings_.ndt7_nflows,
+                           &ndt7_subtest_->socks, &ndt7_subtest_->flows);
   }
-  // The following value is the maximum amount of bytes that an implementation
-  // SHOULD be prepared to handle when receiving ndt7 messages.
-  constexpr internal::Size ndt7_bufsiz = (1 << 24);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
-  auto begin = std::chrono::steady_clock::now();
-  auto latest = begin;
-	internal::Size total = 0;
+  return ndt7_connect(url_path);
+}
+
+bool Client::ndt7_subtest_start() noexcept {
+  assert(ndt7_subtest_);
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  st->begin = st->latest = st->latest_ping = st->latest_io =
+      std::chrono::steady_clock::now();
+  st->measurement_interval = get_measurement_interval();
+  if (st->tid == nettest_flag_download) {
+    st->convergence.reset(new internal::Convergence{
+        settings_.convergence_tolerance, settings_.convergence_window,
+        settings_.convergence_min_runtime});
+  } else {
+    st->payload = upload_payload();
+    if (!st->payload) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot allocate the upload payload");
+      return false;
+    }
+  }
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_multi_start();
+  }
+  if (st->tid == nettest_flag_download) {
+    // When the caller waits for sock_ using poll_fds(), it would not see
+    // the data that io_uring receives, so we only use it with drive().
+    if (step_inline_) {
+      netx_start_bulk_recv(sock_);
+    }
+  } else {
+    // We mask frames in place, so we need a private copy of the payload.
+    // When messages grow, we copy as much payload as the largest message.
+    st->size = ndt7_upload_message_size(*st->payload, 0, 0);
+    internal::Size bufsiz =
+        settings_.ndt7_adaptive_message_size
+            ? std::min(st->payload->Length(), ndt7_max_message_size)
+            : st->size;
+    st->buff.reset(new uint8_t[ws_max_header_size + bufsiz]);
+    memcpy(st->buff.get() + ws_max_header_size, st->payload->Data(),
+           (size_t)bufsiz);
+    st->mbuff.reset(new uint8_t[ws_max_header_size + ndt7_measurement_bufsiz]);
+  }
+  // While uploading, we only read when waiting for the PONG of our PING.
+  if (st->tid == nettest_flag_download ||
+      settings_.ndt7_latency_interval > 0.0) {
+    st->rbufsiz = ndt7_recv_bufsiz;
+    st->rbuff.reset(new uint8_t[ndt7_recv_bufsiz]);
+  }
+  sample_begin(st->tid, 1);
+  return true;
+}
+
+internal::Err Client::ndt7_subtest_resume() noexcept {
+  if (!ndt7_subtest_) {
+    LIBNDT_EMIT_WARNING("ndt7_subtest_resume: no subtest is running");
+    return internal::Err::invalid_argument;
+  }
+  ndt7_subtest_->again = false;
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_multi_resume();
+  }
+  return (ndt7_subtest_->tid == nettest_flag_download) ? ndt7_download_resume()
+                                                       : ndt7_upload_resume();
+}
+
+// Returns the milliseconds until @p deadline seconds after @p begin, which
+// can be negative, rounding up so that we don't wake up too early.
+static int64_t ndt7_msec_until(std::chrono::steady_clock::time_point now,
+                               std::chrono::steady_clock::time_point begin,
+                               double deadline) noexcept {
+  std::chrono::duration<double> elapsed = now - begin;
+  return (int64_t)std::ceil((deadline - elapsed.count()) * 1000.0);
+}
+
+int Client::ndt7_subtest_poll_fds(std::vector<pollfd> *pfds) const noexcept {
+  assert(ndt7_subtest_ && pfds != nullptr);
+  const Ndt7Subtest *st = ndt7_subtest_.get();
+  if (st->again) {
+    return 0;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - st->begin;
+  // With many flows, we check when it's time to take a sample or to call
+  // on_performance(), like ndt7_multi_resume() used to sleep until then.
+  int64_t msec = ndt7_msec_until(now, st->latest, st->measurement_interval);
+  msec = std::min(msec, (int64_t)std::ceil(sample_wait(elapsed.count()) * 1000.0));
+  if (settings_.ndt7_nflows <= 1) {
+    if (!st->reader.closing) {
+      // Also wake up in time to PING, to check the deadline, and to notice
+      // that the network made no progress for too long.
+      if (settings_.ndt7_latency_interval > 0.0) {
+        msec = std::min(msec, ndt7_msec_until(now, st->latest_ping,
+                                              settings_.ndt7_latency_interval));
+      }
+      msec = std::min(msec, ndt7_msec_until(now, st->begin,
+                                            (st->tid == nettest_flag_download)
+                                                ? (double)settings_.max_runtime
+                                                : ndt7_max_upload_time));
+    }
+    msec = std::min(msec, ndt7_msec_until(now, st->latest_io,
+                                          (double)settings_.timeout));
+    if ((st->events & POLLIN) != 0 && netx_has_pending_data(sock_)) {
+      return 0;
+    }
+    pollfd pfd{};
+    pfd.fd = sock_;
+    pfd.events = st->events;
+    pfds->push_back(pfd);
+  }
+  // We add one millisecond because we check whether the deadlines have
+  // passed, so waking up exactly on time would mean waking up twice.
+  msec += 1;
+  return (int)std::max(std::min(msec, (int64_t)INT_MAX), (int64_t)0);
+}
+
+bool Client::ndt7_subtest_finish(bool ok) noexcept {
+  bool download = ndt7_subtest_ && ndt7_subtest_->tid == nettest_flag_download;
+  ndt7_subtest_stop();
+  if (download) {
+    ndt7_materialize_flows(&download_flows_);
+    ndt7_report_latency("download_latency", &summary_.download_latency);
+  } else {
+    ndt7_materialize_flows(&upload_flows_);
+    ndt7_report_latency("upload_latency", &summary_.upload_latency);
+  }
+  return ok;
+}
+
+void Client::ndt7_subtest_stop() noexcept {
+  if (!ndt7_subtest_) {
+    return;
+  }
+  // The flow threads notice that we are stopping like they notice cancel(),
+  // after which they stop within the time of a recv or send.
+  ndt7_subtest_->stopped = true;
+  while (ndt7_subtest_->active > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ndt7_subtest_.reset();
+}
+
+internal::Err Client::ndt7_download_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto slice_begin = std::chrono::steady_clock::now();
   std::chrono::duration<double> elapsed;
-  summary_.download_speed = 0.0;
-  summary_.download_retrans = 0.0;
-  summary_.min_rtt = 0;
   for (;;) {
     auto now = std::chrono::steady_clock::now();
-    elapsed = now - begin;
-    if (elapsed.count() > settings_.max_runtime) {
+    elapsed = now - st->begin;
+    // After sending CLOSE, like ws_close(), we only wait for the server's
+    // CLOSE, as long as the network makes progress.
+    if (!st->reader.closing && elapsed.count() > settings_.max_runtime) {
       LIBNDT_EMIT_WARNING("ndt7: download running for too much time");
-      return false;
+      return internal::Err::timed_out;
     }
-    constexpr auto measurement_interval = 0.25;
-    std::chrono::duration<double> interval = now - latest;
-    if (interval.count() > measurement_interval) {
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("ndt7: the test has been cancelled");
+      return internal::Err::cancelled;
+    }
+    std::chrono::duration<double> idle = now - st->latest_io;
+    if (idle.count() > settings_.timeout) {
+      LIBNDT_EMIT_WARNING("ndt7: no data received for too long");
+      return internal::Err::timed_out;
+    }
+    if (sample_due(elapsed.count())) {
+      sample_flow(0, sock_, st->total);
+      sample_complete(elapsed.count());
+    }
+    std::chrono::duration<double> interval = now - st->latest;
+    if (!st->reader.closing && interval.count() > st->measurement_interval) {
       if (!settings_.summary_only) {
-        on_performance(nettest_flag_download, 1, static_cast<double>(total),
-                     elapsed.count(), settings_.max_runtime);
+        on_performance(nettest_flag_download, 1, static_cast<double>(st->total),
+                       elapsed.count(), settings_.max_runtime);
       }
-      latest = now;
+      st->latest = now;
+      if (st->convergence->Update(elapsed.count(),
+                                  static_cast<double>(st->total))) {
+        LIBNDT_EMIT_INFO("ndt7: download speed has converged; stopping");
+        summary_.download_speed =
+            compute_speed_kbits(st->convergence->Speed(), 1.0);
+        // Setting the FIN flag because control messages MUST NOT be
+        // fragmented as specified in Section 5.5 of RFC6455.
+        auto err = ws_send_frame(sock_, ws_opcode_close | ws_fin_flag,
+                                 nullptr, 0);
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING("ndt7: cannot send CLOSE frame");
+          return err;
+        }
+        st->reader.closing = true;
+      }
+    }
+    if (!st->reader.closing &&
+        ndt7_maybe_ping(sock_, now, &st->latest_ping, nullptr) !=
+            internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send ping");
+      return internal::Err::io_error;
+    }
+    std::chrono::duration<double> slice = now - slice_begin;
+    if (slice.count() > ndt7_resume_slice) {
+      st->again = true;
+      return internal::Err::operation_would_block;
     }
     uint8_t opcode = 0;
-		internal::Size count = 0;
-		internal::Err err = ws_recvmsg(sock_, &opcode, buff.get(), ndt7_bufsiz, &count);
-    if (err != internal::Err::none) {
-      if (err == internal::Err::eof) {
-        break;
+    internal::Size count = 0;
+    uint64_t received = st->reader.received;
+    auto err = ws_recvmsg_nonblocking(sock_, &st->reader, &opcode,
+                                      st->rbuff.get(), st->rbufsiz, &count);
+    if (st->reader.received != received) {
+      st->latest_io = now;
+    }
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_read) {
+      st->events = POLLIN;
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::ssl_want_write) {
+      st->events = POLLOUT;
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::eof) {
+      if (st->reader.closing) {
+        if (!st->reader.closed) {
+          LIBNDT_EMIT_WARNING("ndt7: EOF before the server's CLOSE frame");
+          return internal::Err::eof;
+        }
+        LIBNDT_EMIT_DEBUG("ndt7: received the server's CLOSE frame");
+        return internal::Err::none;  // we have computed the speed above
       }
-      return false;
+      break;
+    }
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ndt7: receiving: " << internal::libndt_perror(err));
+      return err;
     }
-    if (opcode == ws_opcode_text) {
+    if (opcode == ws_opcode_text && !st->reader.closing) {
       // The following is an issue both on armv7 and on Windows 32 bit: the
       // definition of size we have chose is such that later conversion to
       // string is problematic because our size is 64 bit while size_t is 32
@@ -1802,154 +4226,867 @@ bool Client::ndt7_download() noexcept {
       // measurement that big, so the check to make sure the casting is okay
       // is not going to be a real problem, it's just a theoric issue.
       if (count <= SIZE_MAX) {
-        std::string sinfo{(const char *)buff.get(), (size_t)count};
-        // Try parsing the received message as JSON.
-        try {
-          measurement_ = nlohmann::json::parse(sinfo);
-          if (measurement_.contains("ConnectionInfo")) {
-            connection_info_ = measurement_["ConnectionInfo"];
-          }
-
-          // Calculate retransmission rate (BytesRetrans / BytesSent).
-          try {
-            nlohmann::json tcpinfo_json = measurement_["TCPInfo"];
-            double bytes_retrans = (double) tcpinfo_json["BytesRetrans"].get<int64_t>();
-            double bytes_sent = (double) tcpinfo_json["BytesSent"].get<int64_t>();
-            summary_.download_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-            summary_.min_rtt = tcpinfo_json["MinRTT"].get<uint32_t>();
-          } catch(const std::exception& e) {
-            LIBNDT_EMIT_WARNING("TCPInfo not available, cannot get \
-              retransmission rate and latency: " << e.what());
-          }
-        } catch (nlohmann::json::parse_error& e) {
-          LIBNDT_EMIT_WARNING("Unable to parse message as JSON: " << sinfo);
-        }
-
-        if (get_verbosity() == verbosity_debug) {
-          on_result("ndt7", "download", std::move(sinfo));
-        }
+        ndt7_on_download_measurement(0, (const char *)st->rbuff.get(),
+                                     (size_t)count);
       }
     }
-    total += count;  // Assume we won't overflow
+    st->total += count;  // Assume we won't overflow
   }
-  summary_.download_speed = compute_speed_kbits(static_cast<double>(total), elapsed.count());
-  return true;
+  summary_.download_speed =
+      compute_speed_kbits(static_cast<double>(st->total), elapsed.count());
+  return internal::Err::none;
 }
 
-bool Client::ndt7_upload() noexcept {
-  LIBNDT_EMIT_INFO("starting ndt7 upload test");
-  if (!ndt7_connect("/ndt/v7/upload")) {
-    return false;
-  }
-  // Implementation note: we send messages smaller than the maximum message
-  // size accepted by the protocol. We have chosen this value because it
-  // currently seems to be a reasonable size for outgoing messages.
-  constexpr internal::Size ndt7_bufsiz = (1 << 13);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
-  random_printable_fill((char *)buff.get(), ndt7_bufsiz);
-  // The following is the expected ndt7 transfer time for a subtest.
-  constexpr double max_upload_time = 10.0;
-  auto begin = std::chrono::steady_clock::now();
-  auto latest = begin;
+internal::Err Client::ndt7_upload_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto slice_begin = std::chrono::steady_clock::now();
   std::chrono::duration<double> elapsed;
-	internal::Size total = 0;
-  summary_.upload_speed = 0.0;
-  std::string frame = ws_prepare_frame(ws_opcode_binary | ws_fin_flag,
-                                       buff.get(), ndt7_bufsiz);
   for (;;) {
     auto now = std::chrono::steady_clock::now();
-    elapsed = now - begin;
-    std::chrono::duration<double, std::micro> elapsed_usec =
-      std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
-    if (elapsed.count() > max_upload_time) {
+    elapsed = now - st->begin;
+    if (elapsed.count() > ndt7_max_upload_time) {
       LIBNDT_EMIT_DEBUG("ndt7: upload has run for enough time");
       break;
     }
-    constexpr auto measurement_interval = 0.25;
-    std::chrono::duration<double> interval = now - latest;
-    if (interval.count() > measurement_interval) {
-      nlohmann::json measurement;
-      measurement["AppInfo"] = nlohmann::json();
-      measurement["AppInfo"]["ElapsedTime"] = (std::uint64_t) elapsed_usec.count();
-      measurement["AppInfo"]["NumBytes"] = total;
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("ndt7: the test has been cancelled");
+      return internal::Err::cancelled;
+    }
+    std::chrono::duration<double> idle = now - st->latest_io;
+    if (idle.count() > settings_.timeout) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send data for too long");
+      return internal::Err::timed_out;
+    }
+    if (sample_due(elapsed.count())) {
+      sample_flow(0, sock_, st->total);
+      sample_complete(elapsed.count());
+    }
+    // We can only send measurements and PINGs between binary frames, so we
+    // choose the next frame once we have sent the previous one.
+    if (st->pending == nullptr) {
+      uint8_t *frame = nullptr;
+      internal::Size framelen = 0;
+      internal::Err err = internal::Err::none;
+      std::chrono::duration<double> interval = now - st->latest;
+      std::chrono::duration<double> ping_interval = now - st->latest_ping;
+      if (interval.count() > st->measurement_interval) {
+        if (!settings_.summary_only) {
+          on_performance(nettest_flag_upload, 1, static_cast<double>(st->total),
+                         elapsed.count(), ndt7_max_upload_time);
+        }
+        Ndt7UploadSample sample;
+        char *json = (char *)st->mbuff.get() + ws_max_header_size;
+        internal::Size length = ndt7_upload_measurement(
+            sock_, elapsed.count(), st->total, json, ndt7_measurement_bufsiz,
+            &sample);
+        ndt7_on_upload_measurement(0, json, (size_t)length, sample);
+        st->latest = now;
+        if (length <= 0) {
+          continue;  // skip what did not fit, which we have logged
+        }
+        err = ws_prepare_frame_inplace(ws_opcode_text | ws_fin_flag,
+                                       st->mbuff.get(), length, &frame,
+                                       &framelen);
+      } else if (settings_.ndt7_latency_interval > 0.0 &&
+                 ping_interval.count() >= settings_.ndt7_latency_interval) {
+        // See ndt7_maybe_ping(), which we cannot use since it blocks.
+        st->latest_ping = now;
+        st->pinging = true;
+        st->pongs = st->reader.pongs;
+        internal::Latency::Encode(
+            st->ping + ws_max_header_size,
+            usec_since(std::chrono::steady_clock::time_point{}));
+        err = ws_prepare_frame_inplace(ws_opcode_ping | ws_fin_flag, st->ping,
+                                       internal::Latency::payload_size,
+                                       &frame, &framelen);
+      } else {
+        // Each frame needs a fresh masking key, so we (cheaply) prepare the
+        // frame again every time, reusing the same buffer.
+        err = ws_prepare_frame_inplace(ws_opcode_binary | ws_fin_flag,
+                                       st->buff.get(), st->size, &frame,
+                                       &framelen);
+        st->pending_data = st->size;
+      }
+      if (err != internal::Err::none) {
+        LIBNDT_EMIT_WARNING("ndt7: cannot prepare frame");
+        return err;
+      }
+      st->pending = frame;
+      st->pending_size = framelen;
+      st->pending_sent = 0;
+    }
+    std::chrono::duration<double> slice = now - slice_begin;
+    if (slice.count() > ndt7_resume_slice) {
+      st->again = true;
+      return internal::Err::operation_would_block;
+    }
+    // Like ndt7_recv_pongs(), we process the frames sent by the server only
+    // while waiting for our PONG, and we ignore its measurements. Since we
+    // may reply to PING, we only read between frames.
+    bool reading = st->pinging && st->pending_sent == 0;
+    if (reading) {
+      uint8_t opcode = 0;
+      internal::Size count = 0;
+      auto err = ws_recvmsg_nonblocking(sock_, &st->reader, &opcode,
+                                        st->rbuff.get(), st->rbufsiz, &count);
+      if (st->reader.pongs != st->pongs) {
+        st->pinging = false;
+      }
+      if (err == internal::Err::none) {
+        continue;
+      }
+      if (err != internal::Err::operation_would_block &&
+          err != internal::Err::ssl_want_read &&
+          err != internal::Err::ssl_want_write) {
+        LIBNDT_EMIT_WARNING("ndt7: cannot measure the round trip time");
+        return err;
+      }
+    }
+    internal::Size n = 0;
+    auto err = netx_send_nonblocking(sock_, st->pending + st->pending_sent,
+                                     st->pending_size - st->pending_sent, &n);
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_write) {
+      st->events = (short)(POLLOUT | (reading ? POLLIN : 0));
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::ssl_want_read) {
+      st->events = POLLIN;
+      return internal::Err::operation_would_block;
+    }
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send frame");
+      return err;
+    }
+    st->latest_io = now;
+    st->pending_sent += n;
+    if (st->pending_sent < st->pending_size) {
+      continue;
+    }
+    st->pending = nullptr;
+    if (st->pending_data > 0) {
+      st->total += st->pending_data;  // Assume we won't overflow
+      st->size = ndt7_upload_message_size(*st->payload, st->size, st->total);
+      st->pending_data = 0;
+    }
+  }
+  summary_.upload_speed =
+      compute_speed_kbits(static_cast<double>(st->total), elapsed.count());
+  return internal::Err::none;
+}
+
+bool Client::ndt7_multi_start() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto begin = st->begin;
+  auto measurement_interval = st->measurement_interval;
+  double max_runtime = settings_.max_runtime;
+  auto payload = st->payload;
+  const Client *const_this = this;
+  for (auto &flow : st->flows) {
+    st->active += 1;  // atomic
+    Ndt7Flow *flowp = flow.get();
+    if (st->tid == nettest_flag_download) {
+      netx_start_bulk_recv(flowp->sock);
+      auto main = [
+        st,            // owned by the test, which waits for us
+        begin,         // copy for safety
+        flowp,         // owned by the test, which outlives us
+        max_runtime,   // copy for safety
+        const_this     // const pointer
+      ]() noexcept {
+        std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_recv_bufsiz]};
+        auto latest_ping = begin;
+        for (unsigned int iteration = 1;; ++iteration) {
+          uint8_t opcode = 0;
+          internal::Size count = 0;
+          auto err = const_this->ws_recvmsg_discard(
+              flowp->sock, &opcode, buff.get(), ndt7_recv_bufsiz, &count);
+          if (err != internal::Err::none) {
+            if (err != internal::Err::eof) {
+              LIBNDT_EMIT_WARNING_EX(const_this,
+                "ndt7: receiving: " << internal::libndt_perror(err));
+              flowp->failed = true;
+            }
+            break;
+          }
+          if (opcode == ws_opcode_text && count <= SIZE_MAX) {
+            std::lock_guard<std::mutex> lock{flowp->mutex};
+            flowp->messages.emplace_back((const char *)buff.get(),
+                                         (size_t)count);
+          }
+          flowp->counter.add((uint64_t)count);
+          if (st->converged) {
+            if (const_this->ws_close(flowp->sock, buff.get(),
+                                     ndt7_recv_bufsiz) != internal::Err::none) {
+              flowp->failed = true;
+            }
+            break;
+          }
+          if (iteration % flow_clock_interval != 0) {
+            continue;
+          }
+          auto now = std::chrono::steady_clock::now();
+          std::chrono::duration<double> elapsed = now - begin;
+          if (elapsed.count() > max_runtime) {
+            LIBNDT_EMIT_WARNING_EX(const_this,
+              "ndt7: download running for too much time");
+            flowp->failed = true;
+            break;
+          }
+          if (const_this->is_cancelled() || st->stopped) {
+            flowp->failed = true;
+            break;
+          }
+          if (const_this->ndt7_maybe_ping(flowp->sock, now, &latest_ping,
+                                          nullptr) != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send ping");
+            flowp->failed = true;
+            break;
+          }
+        }
+        st->active -= 1;  // atomic
+      };
+      std::thread thread{std::move(main)};
+      thread.detach();
+      continue;
+    }
+    auto main = [
+      st,                   // owned by the test, which waits for us
+      begin,                // copy for safety
+      flowp,                // owned by the test, which outlives us
+      measurement_interval, // copy for safety
+      payload,              // shared pointer copy
+      const_this            // const pointer
+    ]() noexcept {
+      // See ndt7_subtest_start() for how we size the buffer.
+      internal::Size size = const_this->ndt7_upload_message_size(*payload, 0, 0);
+      internal::Size bufsiz =
+          const_this->settings_.ndt7_adaptive_message_size
+              ? std::min(payload->Length(), ndt7_max_message_size)
+              : size;
+      std::unique_ptr<uint8_t[]> buff{
+          new uint8_t[ws_max_header_size + bufsiz]};
+      memcpy(buff.get() + ws_max_header_size, payload->Data(),
+             (size_t)bufsiz);
+      std::unique_ptr<uint8_t[]> mbuff{
+          new uint8_t[ws_max_header_size + ndt7_measurement_bufsiz]};
+      auto latest = begin;
+      auto latest_ping = begin;
+      bool pinging = false;
+      internal::Size total = 0;
+      for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - begin;
+        if (elapsed.count() > ndt7_max_upload_time) {
+          break;
+        }
+        if (const_this->is_cancelled() || st->stopped) {
+          flowp->failed = true;
+          break;
+        }
+        std::chrono::duration<double> interval = now - latest;
+        if (interval.count() > measurement_interval) {
+          Ndt7UploadSample sample;
+          char *json = (char *)mbuff.get() + ws_max_header_size;
+          internal::Size length = const_this->ndt7_upload_measurement(
+              flowp->sock, elapsed.count(), total, json,
+              ndt7_measurement_bufsiz, &sample);
+          if (length > 0) {
+            std::lock_guard<std::mutex> lock{flowp->mutex};
+            flowp->messages.emplace_back(json, (size_t)length);
+            flowp->samples.push_back(sample);
+          }
+          // Note that this masks json in place.
+          auto err = const_this->ndt7_send_measurement(flowp->sock,
+                                                       mbuff.get(), length);
+          if (err != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send measurement");
+            flowp->failed = true;
+            break;
+          }
+          latest = now;
+        }
+        if (const_this->settings_.ndt7_latency_interval > 0.0) {
+          if (const_this->ndt7_maybe_ping(flowp->sock, now, &latest_ping,
+                                          &pinging) != internal::Err::none ||
+              const_this->ndt7_recv_pongs(
+                  flowp->sock, mbuff.get(),
+                  ws_max_header_size + ndt7_measurement_bufsiz,
+                  &pinging) != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this,
+              "ndt7: cannot measure the round trip time");
+            flowp->failed = true;
+            break;
+          }
+        }
+        uint8_t *frame = nullptr;
+        internal::Size framelen = 0;
+        auto err = const_this->ws_prepare_frame_inplace(
+            ws_opcode_binary | ws_fin_flag, buff.get(), size,
+            &frame, &framelen);
+        if (err == internal::Err::none) {
+          err = const_this->netx_sendn(flowp->sock, frame, framelen);
+        }
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send frame");
+          flowp->failed = true;
+          break;
+        }
+        total += size;  // Assume we won't overflow
+        flowp->counter.add(size);
+        size = const_this->ndt7_upload_message_size(*payload, size, total);
+      }
+      st->active -= 1;  // atomic
+    };
+    std::thread thread{std::move(main)};
+    thread.detach();
+  }
+  sample_begin(st->tid, st->flows.size());
+  return true;
+}
+
+internal::Err Client::ndt7_multi_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  bool download = st->tid == nettest_flag_download;
+  // The flows queue their messages before exiting, so we check whether they
+  // are done before draining, not to miss their last messages.
+  bool done = st->active <= 0;  // atomic
+  ndt7_drain_flows(st->tid, &st->flows);
+  if (done) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - st->begin;
+    double speed = compute_speed_kbits(
+        static_cast<double>(ndt7_sum_flows(st->flows)), elapsed.count());
+    if (download) {
+      summary_.download_speed =
+          st->converged ? compute_speed_kbits(st->convergence->Speed(), 1.0)
+                        : speed;
+    } else {
+      summary_.upload_speed = speed;
+    }
+    for (auto &flow : st->flows) {
+      if (flow->failed) {
+        return internal::Err::io_error;
+      }
+    }
+    return internal::Err::none;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - st->begin;
+  if (sample_due(elapsed.count())) {
+    for (size_t i = 0; i < st->flows.size(); ++i) {
+      sample_flow(i, st->flows[i]->sock, st->flows[i]->counter.get());
+    }
+    sample_complete(elapsed.count());
+  }
+  std::chrono::duration<double> interval = now - st->latest;
+  if (interval.count() >= st->measurement_interval) {
+    if (!settings_.summary_only) {
+      on_performance(st->tid,                                     //
+                     static_cast<uint8_t>(st->active.load()),     // atomic
+                     static_cast<double>(ndt7_sum_flows(st->flows)),
+                     elapsed.count(),                             //
+                     download ? (double)settings_.max_runtime
+                              : ndt7_max_upload_time);
+    }
+    st->latest = now;
+    if (download && !st->converged &&
+        st->convergence->Update(
+            elapsed.count(),
+            static_cast<double>(ndt7_sum_flows(st->flows)))) {
+      LIBNDT_EMIT_INFO("ndt7: download speed has converged; stopping");
+      st->converged = true;  // atomic; the flows close their WebSocket
+    }
+  }
+  return internal::Err::operation_would_block;
+}
+
+void Client::ndt7_on_download_measurement(uint8_t flow, const char *data,
+                                          size_t size) noexcept {
+  internal::JsonScanField fields[3];
+  fields[0].name = "BytesRetrans";
+  fields[1].name = "BytesSent";
+  fields[2].name = "MinRTT";
+  bool has_connection_info = false;
+  if (!internal::JsonScan(data, size, "TCPInfo", fields, 3, "ConnectionInfo",
+                          &has_connection_info)) {
+    LIBNDT_EMIT_WARNING("Unable to parse message as JSON: "
+                        << std::string(data, size));
+  } else {
+    Ndt7Stats &stats = ndt7_stats(flow);
+    stats.latest.assign(data, size);  // reuses the string's storage
+    stats.has_tcpinfo = fields[0].found && fields[1].found && fields[2].found;
+    stats.bytes_retrans = fields[0].value;
+    stats.bytes_sent = fields[1].value;
+    stats.min_rtt = fields[2].value;
+    if (has_connection_info) {
+      ndt7_connection_info_.assign(data, size);
+    }
+    ndt7_latest_flow_ = flow;
+    ndt7_emit_record("download", flow, data, size);
+
+    // Calculate retransmission rate (BytesRetrans / BytesSent) and latency
+    // using the latest measurement of each flow.
+    double bytes_retrans = 0.0;
+    double bytes_sent = 0.0;
+    int64_t min_rtt = 0;
+    bool complete = true;
+    for (auto &s : ndt7_stats_) {
+      if (s.latest.empty()) {
+        continue;  // we did not receive measurements for this flow yet
+      }
+      if (!s.has_tcpinfo) {
+        complete = false;
+        break;
+      }
+      bytes_retrans += (double)s.bytes_retrans;
+      bytes_sent += (double)s.bytes_sent;
+      min_rtt = (min_rtt == 0 || s.min_rtt < min_rtt) ? s.min_rtt : min_rtt;
+    }
+    if (complete && min_rtt >= 0 && min_rtt <= UINT32_MAX) {
+      summary_.download_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
+      summary_.min_rtt = (uint32_t)min_rtt;
+    } else {
+      LIBNDT_EMIT_WARNING("TCPInfo not available, cannot get "
+                          "retransmission rate and latency");
+    }
+  }
+
+  if (get_verbosity() == verbosity_debug) {
+    on_result("ndt7", "download", std::string{data, size});
+  }
+}
+
+internal::Size Client::ndt7_upload_measurement(
+    internal::Socket sock, double elapsed, internal::Size total, char *base,
+    internal::Size count, Ndt7UploadSample *sample) const noexcept {
+  assert(base != nullptr && sample != nullptr);
+  auto elapsed_usec = (std::uint64_t)(elapsed * 1e06);
+  *sample = Ndt7UploadSample{};
+  internal::JsonWriter writer{base, count};
+  writer.Raw("{\"AppInfo\":{\"ElapsedTime\":");
+  writer.Uint64(elapsed_usec);
+  writer.Raw(",\"NumBytes\":");
+  writer.Uint64(total);
+  writer.Raw("}");
 #ifdef __linux__
-      // Read tcp_info data for the socket and print it as JSON.
-      struct tcp_info tcpinfo{};
-      socklen_t tcpinfolen = sizeof(tcpinfo);
-      if (sys->Getsockopt(sock_, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
-                          &tcpinfolen) == 0) {
-        measurement["TCPInfo"] = nlohmann::json();
-        measurement["TCPInfo"]["ElapsedTime"] = (std::uint64_t) elapsed_usec.count();
-#define XX(lower_, upper_) measurement["TCPInfo"][#upper_] = (uint64_t)tcpinfo.lower_;
-        NDT7_ENUM_TCP_INFO
-#undef XX
+  // Read tcp_info data for the socket and write it as JSON.
+  struct tcp_info tcpinfo{};
+  socklen_t tcpinfolen = sizeof(tcpinfo);
+  if (sys->Getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
+                      &tcpinfolen) == 0) {
+    writer.Raw(",\"TCPInfo\":{\"ElapsedTime\":");
+    writer.Uint64(elapsed_usec);
+    for (auto &field : ndt7_tcp_info_fields) {
+      writer.Raw(",");
+      writer.Raw(field.name);
+      writer.Uint64(field.get(tcpinfo));
+    }
+    writer.Raw("}");
+    sample->has_tcpinfo = true;
+    sample->bytes_retrans = (uint64_t)tcpinfo.tcpi_bytes_retrans;
+    sample->bytes_sent = (uint64_t)tcpinfo.tcpi_bytes_sent;
+  }
+#else
+  (void)sock;
+#endif  // __linux__
+  writer.Raw("}");
+  if (!writer.Good()) {
+    LIBNDT_EMIT_WARNING("ndt7: measurement buffer too small; skipping it");
+    return 0;
+  }
+  return writer.Length();
+}
+
+void Client::ndt7_on_upload_measurement(
+    uint8_t flow, const char *json, size_t size,
+    const Ndt7UploadSample &sample) noexcept {
+  if (size <= 0) {
+    return;  // ndt7_upload_measurement() failed, which we have logged
+  }
+  ndt7_emit_record("upload", flow, json, size);
+  Ndt7Stats &stats = ndt7_stats(flow);
+  stats.latest.assign(json, size);  // reuses the string's storage
+  stats.has_tcpinfo = sample.has_tcpinfo;
+  stats.bytes_retrans = (int64_t)sample.bytes_retrans;
+  stats.bytes_sent = (int64_t)sample.bytes_sent;
+#ifdef __linux__
+  // Calculate retransmission rate using the latest measurement of each flow.
+  double bytes_retrans = 0.0;
+  double bytes_sent = 0.0;
+  bool complete = true;
+  for (auto &s : ndt7_stats_) {
+    if (s.latest.empty()) {
+      continue;  // we did not take measurements for this flow yet
+    }
+    if (!s.has_tcpinfo) {
+      complete = false;
+      break;
+    }
+    bytes_retrans += (double)s.bytes_retrans;
+    bytes_sent += (double)s.bytes_sent;
+  }
+  if (complete) {
+    summary_.upload_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
+  } else {
+    LIBNDT_EMIT_WARNING("Cannot calculate retransmission rate: TCPInfo not available");
+  }
+#endif  // __linux__
+  if (get_verbosity() == verbosity_debug) {
+    on_result("ndt7", "upload", std::string{json, size});
+  }
+}
+
+void Client::ndt7_emit_record(const char *name, uint8_t flow, const char *data,
+                              size_t size) const noexcept {
+  if (!settings_.results_sink) {
+    return;
+  }
+  ResultRecord record;
+  record.scope = "ndt7";
+  record.name = name;
+  record.flow = flow;
+  record.timestamp_usec =
+      (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  record.value = data;
+  record.value_size = size;
+  settings_.results_sink->on_record(record);
+}
+
+internal::Err Client::ndt7_send_measurement(internal::Socket sock,
+                                            uint8_t *buffer,
+                                            internal::Size count) const noexcept {
+  if (count <= 0) {
+    return internal::Err::none;  // skip what did not fit, which we have logged
+  }
+  uint8_t *frame = nullptr;
+  internal::Size framelen = 0;
+  internal::Err err = ws_prepare_frame_inplace(
+      ws_opcode_text | ws_fin_flag, buffer, count, &frame, &framelen);
+  if (err != internal::Err::none) {
+    return err;
+  }
+  return netx_sendn(sock, frame, framelen);
+}
+
+internal::Err Client::ndt7_maybe_ping(
+    internal::Socket sock, std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point *latest,
+    bool *pinging) const noexcept {
+  if (settings_.ndt7_latency_interval <= 0.0) {
+    return internal::Err::none;
+  }
+  std::chrono::duration<double> interval = now - *latest;
+  if (interval.count() < settings_.ndt7_latency_interval) {
+    return internal::Err::none;
+  }
+  *latest = now;
+  if (pinging != nullptr) {
+    *pinging = true;
+  }
+  // The PONG echoes the time at which we send the PING, which we measure
+  // using the same clock we use when receiving the PONG.
+  uint8_t payload[internal::Latency::payload_size];
+  internal::Latency::Encode(
+      payload, usec_since(std::chrono::steady_clock::time_point{}));
+  return ws_send_frame(sock, ws_opcode_ping | ws_fin_flag, payload,
+                       sizeof(payload));
+}
+
+internal::Err Client::ndt7_recv_pongs(internal::Socket sock, uint8_t *base,
+                                      internal::Size total,
+                                      bool *pinging) const noexcept {
+  assert(pinging != nullptr);
+  if (!*pinging) {
+    return internal::Err::none;  // no PONG to wait for, so don't poll
+  }
+  // Once the beginning of a frame is readable, the rest of it follows soon,
+  // hence we only wait for the frames that the server is already sending.
+  while (netx_has_pending_data(sock) ||
+         netx_wait_readable(sock, Timeout{0}) == internal::Err::none) {
+    uint8_t opcode = 0;
+    bool fin = false;
+    internal::Size count = 0;
+    auto err = ws_recv_any_frame(sock, &opcode, &fin, base, total, &count,
+                                 true);
+    if (err != internal::Err::none) {
+      return err;
+    }
+    if (opcode == ws_opcode_pong) {
+      if (ndt7_latency_.OnPong(
+              base, count,
+              usec_since(std::chrono::steady_clock::time_point{}))) {
+        *pinging = false;
+        break;
+      }
+    } else if (opcode == ws_opcode_ping) {
+      err = ws_send_frame(sock, ws_opcode_pong | ws_fin_flag, base, count);
+      if (err != internal::Err::none) {
+        return err;
       }
+    } else if (opcode == ws_opcode_close) {
+      // See ws_recv_frame() for why we must reply with CLOSE.
+      (void)ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+      return internal::Err::eof;
+    }
+  }
+  return internal::Err::none;
+}
+
+void Client::ndt7_report_latency(const char *name,
+                                 internal::LatencySummary *summary) noexcept {
+  *summary = ndt7_latency_.Summarize();
+  if (summary->count <= 0) {
+    return;
+  }
+  nlohmann::json latency;
+  latency["Count"] = summary->count;
+  latency["Min"] = summary->min;
+  latency["P50"] = summary->p50;
+  latency["P90"] = summary->p90;
+  latency["P99"] = summary->p99;
+  latency["Max"] = summary->max;
+  std::string value = latency.dump();
+  ndt7_emit_record(name, 0, value.data(), value.size());
+  on_result("ndt7", name, std::move(value));
+}
+
+void Client::ndt7_materialize_flows(nlohmann::json *flows) noexcept {
+  assert(flows != nullptr);
+  *flows = nlohmann::json::array();
+  bool is_download = (flows == &download_flows_);
+  for (size_t i = 0; i < ndt7_stats_.size(); ++i) {
+    nlohmann::json measurement;  // null for flows without measurements
+    if (!ndt7_stats_[i].latest.empty()) {
+      try {
+        measurement = nlohmann::json::parse(ndt7_stats_[i].latest);
+      } catch (const nlohmann::json::exception &exc) {
+        // JsonScan() is more lenient than nlohmann/json, e.g. it does not
+        // validate escapes, so this may happen with a broken server.
+        LIBNDT_EMIT_WARNING("ndt7: cannot parse measurement: " << exc.what());
+      }
+    }
+    if (is_download && i == ndt7_latest_flow_ && !measurement.is_null()) {
+      measurement_ = measurement;
+    }
+    flows->push_back(std::move(measurement));
+  }
+  if (is_download && !ndt7_connection_info_.empty()) {
+    try {
+      connection_info_ =
+          nlohmann::json::parse(ndt7_connection_info_).at("ConnectionInfo");
+    } catch (const nlohmann::json::exception &exc) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot parse ConnectionInfo: " << exc.what());
+    }
+  }
+  ndt7_stats_.clear();
+}
 
-      // Calculate retransmission rate.
-      try {
-        nlohmann::json tcpinfo_json = measurement["TCPInfo"];
-        double bytes_retrans = (double) tcpinfo_json["TcpiBytesRetrans"].get<int64_t>();
-        double bytes_sent = (double) tcpinfo_json["TcpiBytesSent"].get<int64_t>();
-        summary_.upload_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-      } catch (const std::exception& e) {
-        LIBNDT_EMIT_WARNING("Cannot calculate retransmission rate: " << e.what());
-      }
-#endif  // __linux__
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_upload, 1, static_cast<double>(total),
-                     elapsed.count(), max_upload_time);
-      }
-      // This could fail if there are non-utf8 characters. This structure just
-      // contains integers and ASCII strings, so we should be good.
-      std::string json = measurement.dump();
-      if (get_verbosity() == verbosity_debug) {
-        on_result("ndt7", "upload", json);
-      }
-      // Send measurement to the server.
-			internal::Err err = ws_send_frame(sock_, ws_opcode_text | ws_fin_flag,
-                              (uint8_t *)json.data(), json.size());
-      if (err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING("ndt7: cannot send measurement");
-        return false;
+Client::Ndt7Stats &Client::ndt7_stats(uint8_t flow) noexcept {
+  if (flow >= ndt7_stats_.size()) {
+    ndt7_stats_.resize((size_t)flow + 1);
+  }
+  return ndt7_stats_[flow];
+}
+
+uint64_t Client::ndt7_sum_flows(
+    const std::vector<std::unique_ptr<Ndt7Flow>> &flows) noexcept {
+  uint64_t total = 0;
+  for (auto &flow : flows) {
+    total += flow->counter.get();
+  }
+  return total;
+}
+
+void Client::ndt7_drain_flows(
+    NettestFlags tid, std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept {
+  for (size_t i = 0; i < flows->size(); ++i) {
+    std::vector<std::string> messages;
+    std::vector<Ndt7UploadSample> samples;
+    {
+      std::lock_guard<std::mutex> lock{(*flows)[i]->mutex};
+      std::swap(messages, (*flows)[i]->messages);
+      std::swap(samples, (*flows)[i]->samples);
+    }
+    for (size_t j = 0; j < messages.size(); ++j) {
+      if (tid == nettest_flag_download) {
+        ndt7_on_download_measurement((uint8_t)i, messages[j].data(),
+                                     messages[j].size());
+      } else if (j < samples.size()) {
+        ndt7_on_upload_measurement((uint8_t)i, messages[j].data(),
+                                   messages[j].size(), samples[j]);
       }
-      latest = now;
     }
-		internal::Err err = netx_sendn(sock_, frame.data(), frame.size());
-    if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ndt7: cannot send frame");
+  }
+}
+
+bool Client::ndt7_dial_flows(std::string url_path, uint8_t nflows,
+                             SocketVector *socks,
+                             std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept {
+  for (uint8_t i = 0; i < nflows; ++i) {
+    internal::Socket sock = (internal::Socket)-1;
+    if (!ndt7_dial(url_path, &sock)) {
+      LIBNDT_EMIT_WARNING("ndt7: not all connect succeeded");
       return false;
     }
-    total += ndt7_bufsiz;  // Assume we won't overflow
+    socks->sockets.push_back(sock);
+    std::unique_ptr<Ndt7Flow> flow{new Ndt7Flow{}};
+    flow->sock = sock;
+    flows->push_back(std::move(flow));
   }
-  summary_.upload_speed = compute_speed_kbits(static_cast<double>(total), elapsed.count());
+  LIBNDT_EMIT_DEBUG("ndt7: established " << (unsigned int)nflows
+                    << " WebSocket connections");
   return true;
 }
 
 bool Client::ndt7_connect(std::string url_path) noexcept {
-  std::string port = "443";
-  if (!settings_.port.empty()) {
-    port = settings_.port;
-  }
   // Don't leak resources if the socket is already open.
   if (internal::IsSocketValid(sock_)) {
     LIBNDT_EMIT_DEBUG("ndt7: closing socket openned in previous attempt");
     (void)netx_closesocket(sock_);
     sock_ = (internal::Socket)-1;
   }
+  if (!ndt7_dial(url_path, &sock_)) {
+    return false;
+  }
+  LIBNDT_EMIT_DEBUG("ndt7: WebSocket connection established");
+  return true;
+}
+
+bool Client::ndt7_dial(std::string url_path, internal::Socket *sock) noexcept {
+  if (ndt7_preconnect_take(url_path, sock)) {
+    LIBNDT_EMIT_DEBUG("ndt7: using the speculative connection");
+    ndt7_preconnect_abandon();
+    return true;
+  }
+  std::string port = "443";
+  if (!settings_.port.empty()) {
+    port = settings_.port;
+  }
   // Note: ndt7 implies WebSocket and TLS
   settings_.protocol_flags |= protocol_flag_websocket | protocol_flag_tls;
 	internal::Err err = netx_maybews_dial(
       settings_.hostname, port,
       ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept |
           ws_f_sec_ws_protocol,
-      ws_proto_ndt7, url_path, &sock_);
+      ws_proto_ndt7, url_path, sock);
   if (err != internal::Err::none) {
+    ndt7_dial_failed_ = true;
     return false;
   }
-  LIBNDT_EMIT_DEBUG("ndt7: WebSocket connection established");
+  ndt7_preconnect_abandon();
   return true;
 }
 
+void Client::ndt7_preconnect_next(std::string url_path) noexcept {
+  if (!settings_.ndt7_preconnect || next_fqdn_ >= fqdns_.size()) {
+    return;
+  }
+  const std::string &hostname = fqdns_[next_fqdn_];
+  for (auto &pc : ndt7_preconnects_) {
+    if (pc->hostname == hostname && pc->url_path == url_path) {
+      return;
+    }
+  }
+  Settings settings = settings_;
+  settings.hostname = hostname;
+  // The other client must be quiet because it runs in the background and
+  // we don't want to call our event handlers from another thread.
+  settings.verbosity = verbosity_quiet;
+  std::unique_ptr<Ndt7Preconnect> pc{new Ndt7Preconnect{}};
+  pc->hostname = hostname;
+  pc->url_path = url_path;
+  pc->client = ndt7_preconnect_client(std::move(settings));
+  if (!pc->client) {
+    return;
+  }
+  // The other client shares our state, e.g., such that we can resume the
+  // TLS sessions it establishes, and such that we can cancel it (see below).
+  pc->client->ssl_cache = ssl_cache;
+  pc->client->mlabns_cache = mlabns_cache;
+  pc->client->admission = admission;
+  pc->client->parent_cancelled_ = &cancelled_;
+  LIBNDT_EMIT_DEBUG("ndt7: speculatively connecting to " << hostname);
+  Ndt7Preconnect *pcp = pc.get();
+  pc->thread = std::thread{[pcp]() noexcept {
+    internal::Socket sock = (internal::Socket)-1;
+    bool ok = pcp->client->ndt7_dial(pcp->url_path, &sock);
+    std::lock_guard<std::mutex> lock{pcp->mutex};
+    if (ok && pcp->abandoned) {
+      (void)pcp->client->netx_closesocket(sock);
+      ok = false;
+    }
+    pcp->sock = ok ? sock : (internal::Socket)-1;
+    pcp->done = true;
+  }};
+  ndt7_preconnects_.push_back(std::move(pc));
+}
+
+bool Client::ndt7_preconnect_take(const std::string &url_path,
+                                  internal::Socket *sock) noexcept {
+  for (auto it = ndt7_preconnects_.begin(); it != ndt7_preconnects_.end();
+       ++it) {
+    auto &pc = *it;
+    if (pc->hostname != settings_.hostname || pc->url_path != url_path) {
+      continue;
+    }
+    pc->thread.join();
+    bool ok = internal::IsSocketValid(pc->sock);
+    if (ok) {
+      ndt7_adopt(pc->client.get(), pc->sock);
+      *sock = pc->sock;
+    } else {
+      LIBNDT_EMIT_DEBUG("ndt7: the speculative connect failed");
+    }
+    ndt7_preconnects_.erase(it);
+    return ok;
+  }
+  return false;
+}
+
+void Client::ndt7_preconnect_abandon() noexcept {
+  for (auto &pc : ndt7_preconnects_) {
+    std::lock_guard<std::mutex> lock{pc->mutex};
+    pc->abandoned = true;
+    // Interrupt the connect, which otherwise may take a whole timeout.
+    pc->client->cancel();
+    if (pc->done && internal::IsSocketValid(pc->sock)) {
+      (void)pc->client->netx_closesocket(pc->sock);
+      pc->sock = (internal::Socket)-1;
+    }
+  }
+}
+
+void Client::ndt7_preconnect_stop() noexcept {
+  ndt7_preconnect_abandon();
+  for (auto &pc : ndt7_preconnects_) {
+    pc->thread.join();
+  }
+  ndt7_preconnects_.clear();
+}
+
+std::unique_ptr<Client> Client::ndt7_preconnect_client(
+    Settings settings) noexcept {
+  return std::unique_ptr<Client>{new Client{std::move(settings)}};
+}
+
+void Client::ndt7_adopt(Client *other, internal::Socket sock) noexcept {
+  auto conn = other->connections_.Remove(sock);
+  if (!conn) {
+    return;
+  }
+  if (conn->ssl != nullptr) {
+    // Our BIO uses its data to find the client, which must now be us.
+    BIO *bio = ::SSL_get_rbio(conn->ssl);
+    if (bio != nullptr && ::BIO_get_data(bio) == other) {
+      ::BIO_set_data(bio, this);
+    }
+  }
+  (void)connections_.Insert(sock, std::move(conn));
+}
+
 // NDT protocol API
 // ````````````````
 
@@ -2153,22 +5290,23 @@ bool Client::msg_expect(MsgType expected_code, std::string *s) noexcept {
 
 bool Client::msg_read(MsgType *code, std::string *msg) noexcept {
   assert(code != nullptr && msg != nullptr);
-  std::string s;
-  if (!msg_read_legacy(code, &s)) {
+  // We read into msg_raw_, whose storage we reuse across messages.
+  msg_raw_.clear();
+  if (!msg_read_legacy(code, &msg_raw_)) {
     return false;
   }
   if ((settings_.protocol_flags & protocol_flag_json) == 0) {
-    std::swap(s, *msg);
+    msg->swap(msg_raw_);
   } else {
     nlohmann::json json;
     try {
-      json = nlohmann::json::parse(s);
+      json = nlohmann::json::parse(msg_raw_);
     } catch (const nlohmann::json::exception &) {
       LIBNDT_EMIT_WARNING("msg_read: cannot parse JSON");
       return false;
     }
     try {
-      *msg = json.at("msg").get<std::string>();
+      msg->assign(json.at("msg").get_ref<const std::string &>());
     } catch (const nlohmann::json::exception &) {
       LIBNDT_EMIT_WARNING("msg_read: cannot find 'msg' field");
       return false;
@@ -2183,15 +5321,24 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
   constexpr internal::Size header_size = 3;
   constexpr internal::Size max_body_size = UINT16_MAX;
   constexpr internal::Size max_msg_size = header_size + max_body_size;
-  char buffer[max_msg_size];
+  // With WebSocket we read whole messages, hence we need room for the largest
+  // message, which we allocate once, rather than on the stack, since it's
+  // too large for threads with small stacks. Otherwise, we read the header
+  // and then the body directly into @p msg.
+  char header[header_size];
+  char *buffer = header;
   uint16_t len = 0;
-  *msg = "";
+  msg->clear();
   {
 		internal::Size ws_msg_len = 0;
     if ((settings_.protocol_flags & protocol_flag_websocket) != 0) {
+      if (!msg_buffer_) {
+        msg_buffer_.reset(new char[max_msg_size]);
+      }
+      buffer = msg_buffer_.get();
       uint8_t opcode = 0;
       auto err = ws_recvmsg(  //
-          sock_, &opcode, (uint8_t *)buffer, sizeof(buffer), &ws_msg_len);
+          sock_, &opcode, (uint8_t *)buffer, max_msg_size, &ws_msg_len);
       if (err != internal::Err::none) {
         LIBNDT_EMIT_WARNING(
             "msg_read_legacy: cannot read NDT message using websocket");
@@ -2206,19 +5353,16 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
                      << (unsigned int)opcode);
         return false;
       }
-      assert(ws_msg_len <= sizeof(buffer));
+      assert(ws_msg_len <= max_msg_size);
     } else {
-      static_assert(sizeof(buffer) >= header_size,
-                    "Not enough room in buffer to read the NDT header");
       auto err = netx_recvn(sock_, buffer, header_size);
       if (err != internal::Err::none) {
         LIBNDT_EMIT_WARNING("msg_read_legacy: cannot read NDT message header");
         return false;
       }
     }
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[0] (type): " << (int)buffer[0]);
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[1] (len-high): " << (int)buffer[1]);
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[2] (len-low): " << (int)buffer[2]);
+    LIBNDT_EMIT_DEBUG("msg_read_legacy: header: " << (int)buffer[0] << " "
+                      << (int)buffer[1] << " " << (int)buffer[2]);
     static_assert(sizeof(MsgType) == sizeof(unsigned char),
                   "Unexpected MsgType size");
     *code = MsgType{(unsigned char)buffer[0]};
@@ -2238,18 +5382,16 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
     return true;
   }
   if ((settings_.protocol_flags & protocol_flag_websocket) == 0) {
-    assert(sizeof(buffer) >= header_size &&
-           sizeof(buffer) - header_size >= len);
-    auto err = netx_recvn(sock_, &buffer[header_size], len);
+    msg->resize(len);
+    auto err = netx_recvn(sock_, &(*msg)[0], len);
     if (err != internal::Err::none) {
       LIBNDT_EMIT_WARNING("msg_read_legacy: cannot read NDT message body");
+      msg->clear();
       return false;
     }
+  } else {
+    msg->assign(&buffer[header_size], len);
   }
-  // This is a stringy copy but we do not care much because the part that needs
-  // to be efficient is the one running measurements not the one where we deal
-  // with incoming and outgoing NDT control messages.
-  *msg = std::string{&buffer[header_size], len};
   LIBNDT_EMIT_DEBUG("msg_read_legacy: raw message: " << represent(*msg));
   return true;
 }
@@ -2277,7 +5419,7 @@ internal::Err Client::ws_recvln(internal::Socket fd, std::string *line, size_t m
   line->clear();
   while (line->size() < maxlen) {
     char ch = {};
-    auto err = netx_recvn(fd, &ch, sizeof(ch));
+    auto err = ws_recvn(fd, &ch, sizeof(ch));
     if (err != internal::Err::none) {
       return err;
     }
@@ -2392,93 +5534,144 @@ internal::Err Client::ws_handshake(internal::Socket fd, std::string port, uint64
   return internal::Err::value_too_large;
 }
 
-std::string Client::ws_prepare_frame(uint8_t first_byte, uint8_t *base,
-                                     internal::Size count) const noexcept {
-  // TODO(bassosimone): perhaps move the RNG into Client?
-  constexpr internal::Size mask_size = 4;
-  uint8_t mask[mask_size] = {};
-  // "When preparing a masked frame, the client MUST pick a fresh masking
-  //  key from the set of allowed 32-bit values." [RFC6455 Sect. 5.3]. Hence
-  // we're not compliant (TODO(bassosimone)).
-  random_printable_fill((char *)mask, sizeof(mask));
-  std::stringstream ss;
-  // Message header
-  {
-    // First byte
-    {
-      // TODO(bassosimone): add sanity checks for first byte
-      ss << first_byte;
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: FIN: " << std::boolalpha
-                                        << ((first_byte & ws_fin_flag) != 0));
-      LIBNDT_EMIT_DEBUG(
-          "ws_prepare_frame: reserved: " << (first_byte & ws_reserved_mask));
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: opcode: " << (first_byte & ws_opcode_mask));
-    }
-    // Length
-    {
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: mask flag: " << std::boolalpha << true);
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: length: " << count);
-      // Since this is a client implementation, we always include the MASK flag
-      // as part of the second byte that we send on the wire. Also, the spec
-      // says that we must emit the length in network byte order, which means
-      // in practice that we should use big endian.
-      //
-      // See <https://tools.ietf.org/html/rfc6455#section-5.1>, and
-      //     <https://tools.ietf.org/html/rfc6455#section-5.2>.
-#define LB(value)                                                        \
-  do {                                                                   \
-    LIBNDT_EMIT_DEBUG("ws_prepare_frame: length byte: " << (unsigned int)(value)); \
-    ss << (value);                                                       \
-  } while (0)
-      if (count < 126) {
-        LB((uint8_t)((count & ws_len_mask) | ws_mask_flag));
-      } else if (count < (1 << 16)) {
-        LB((uint8_t)((126 & ws_len_mask) | ws_mask_flag));
-        LB((uint8_t)((count >> 8) & 0xff));
-        LB((uint8_t)(count & 0xff));
-      } else {
-        LB((uint8_t)((127 & ws_len_mask) | ws_mask_flag));
-        LB((uint8_t)((count >> 56) & 0xff));
-        LB((uint8_t)((count >> 48) & 0xff));
-        LB((uint8_t)((count >> 40) & 0xff));
-        LB((uint8_t)((count >> 32) & 0xff));
-        LB((uint8_t)((count >> 24) & 0xff));
-        LB((uint8_t)((count >> 16) & 0xff));
-        LB((uint8_t)((count >> 8) & 0xff));
-        LB((uint8_t)(count & 0xff));
-      }
-#undef LB  // Tidy
-    }
-    // Mask
-    {
-      for (internal::Size i = 0; i < mask_size; ++i) {
-        LIBNDT_EMIT_DEBUG("ws_prepare_frame: mask byte: " << (unsigned int)mask[i]
-                                                << " ('" << mask[i] << "')");
-        ss << (uint8_t)mask[i];
-      }
+// ws_random_mask fills @p mask with a fresh masking key. "When preparing a
+// masked frame, the client MUST pick a fresh masking key from the set of
+// allowed 32-bit values." [RFC6455 Sect. 5.3]. "The masking key needs to be
+// unpredictable; thus, the masking key MUST be derived from a strong source
+// of entropy" [Ibid.]. Returns false if we cannot generate the key.
+static bool ws_random_mask(uint8_t *mask) noexcept {
+  return internal::RandomBytes(mask, ws_mask_size);
+}
+
+// ws_format_header writes into @p header, which must be at least
+// ws_max_header_size bytes, the header of a masked frame with @p first_byte
+// as first byte, @p count bytes of payload and @p mask as masking key. Returns
+// the number of bytes actually written.
+static internal::Size ws_format_header(uint8_t first_byte, const uint8_t *mask,
+                                       internal::Size count,
+                                       uint8_t *header) noexcept {
+  internal::Size off = 0;
+  // TODO(bassosimone): add sanity checks for first byte
+  header[off++] = first_byte;
+  // Since this is a client implementation, we always include the MASK flag
+  // as part of the second byte that we send on the wire. Also, the spec
+  // says that we must emit the length in network byte order, which means
+  // in practice that we should use big endian.
+  //
+  // See <https://tools.ietf.org/html/rfc6455#section-5.1>, and
+  //     <https://tools.ietf.org/html/rfc6455#section-5.2>.
+  if (count < 126) {
+    header[off++] = (uint8_t)((count & ws_len_mask) | ws_mask_flag);
+  } else if (count < (1 << 16)) {
+    header[off++] = (uint8_t)((126 & ws_len_mask) | ws_mask_flag);
+    header[off++] = (uint8_t)((count >> 8) & 0xff);
+    header[off++] = (uint8_t)(count & 0xff);
+  } else {
+    header[off++] = (uint8_t)((127 & ws_len_mask) | ws_mask_flag);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      header[off++] = (uint8_t)((count >> shift) & 0xff);
     }
   }
+  memcpy(&header[off], mask, ws_mask_size);
+  off += ws_mask_size;
+  assert(off <= ws_max_header_size);
+  return off;
+}
+
+std::string Client::ws_prepare_frame(uint8_t first_byte, uint8_t *base,
+                                     internal::Size count) const noexcept {
   // As mentioned in the docs of this method, we will not include any
   // body in the frame if base is a null pointer.
-  {
-    for (internal::Size i = 0; i < count && base != nullptr; ++i) {
-      // Implementation note: judging from a GCC 8 warning, it seems that using
-      // `^=` causes -Wconversion warnings, while using `= ... ^` does not.
-      base[i] = base[i] ^ mask[i % mask_size];
-      ss << base[i];
-    }
+  if (base == nullptr) {
+    count = 0;
+  }
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame: cannot generate masking key");
+    return "";
+  }
+  uint8_t header[ws_max_header_size];
+  internal::Size header_size = ws_format_header(first_byte, mask, count, header);
+  LIBNDT_EMIT_DEBUG("ws_prepare_frame: FIN: " << std::boolalpha
+                    << ((first_byte & ws_fin_flag) != 0) << "; reserved: "
+                    << (first_byte & ws_reserved_mask) << "; opcode: "
+                    << (first_byte & ws_opcode_mask) << "; length: " << count);
+  internal::WsMask(base, count, mask);
+  std::string frame;
+  frame.reserve((size_t)(header_size + count));
+  frame.append((const char *)header, (size_t)header_size);
+  if (count > 0) {
+    frame.append((const char *)base, (size_t)count);
+  }
+  return frame;
+}
+
+internal::Err Client::ws_prepare_frame_inplace(
+    uint8_t first_byte, uint8_t *buffer, internal::Size count, uint8_t **frame,
+    internal::Size *framelen) const noexcept {
+  if (buffer == nullptr || frame == nullptr || framelen == nullptr) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: passed invalid arguments");
+    return internal::Err::invalid_argument;
   }
-  return ss.str();
+  if (count > internal::SizeMax - ws_max_header_size) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: avoiding integer overflow");
+    return internal::Err::value_too_large;
+  }
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: cannot generate masking key");
+    return internal::Err::ssl_generic;
+  }
+  uint8_t header[ws_max_header_size];
+  internal::Size header_size = ws_format_header(first_byte, mask, count, header);
+  uint8_t *payload = buffer + ws_max_header_size;
+  internal::WsMask(payload, count, mask);
+  *frame = payload - header_size;
+  memcpy(*frame, header, (size_t)header_size);
+  *framelen = header_size + count;
+  count_frame(counter_send_frame_sizes, count);
+  LIBNDT_TRACE(send_frame, (internal::Socket)-1, count);
+  return internal::Err::none;
 }
 
 internal::Err Client::ws_send_frame(internal::Socket sock, uint8_t first_byte, uint8_t *base,
                           internal::Size count) const noexcept {
-  std::string prep = ws_prepare_frame(first_byte, base, count);
-  return netx_sendn(sock, prep.c_str(), prep.size());
+  if (base == nullptr) {
+    count = 0;
+  }
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_send_frame: cannot generate masking key");
+    return internal::Err::ssl_generic;
+  }
+  // Small frames (i.e. control frames, NDT messages, and ndt7 measurements)
+  // are assembled on the stack and sent using a single write. Larger frames
+  // are written as header followed by payload, to avoid copying the payload.
+  // The hot measurement paths do not get here; they use a prebuilt frame
+  // prepared using ws_prepare_frame_inplace() instead.
+  constexpr internal::Size max_small_frame = 2048;
+  uint8_t small_frame[max_small_frame];
+  static_assert(max_small_frame > ws_max_header_size, "Small frame too small");
+  internal::Size header_size = ws_format_header(first_byte, mask, count, small_frame);
+  internal::WsMask(base, count, mask);
+  count_frame(counter_send_frame_sizes, count);
+  LIBNDT_TRACE(send_frame, sock, count);
+  if (count <= max_small_frame - header_size) {
+    if (count > 0) {
+      memcpy(&small_frame[header_size], base, (size_t)count);
+    }
+    return netx_sendn(sock, small_frame, header_size + count);
+  }
+  auto err = netx_sendn(sock, small_frame, header_size);
+  if (err != internal::Err::none) {
+    return err;
+  }
+  return netx_sendn(sock, base, count);
 }
 
 internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode, bool *fin,
-      uint8_t *base, internal::Size total, internal::Size *count) const noexcept {
+      uint8_t *base, internal::Size total, internal::Size *count,
+      bool discard) const noexcept {
   // TODO(bassosimone): in this function we should consider an EOF as an
   // error, because with WebSocket we have explicit FIN mechanism.
   if (opcode == nullptr || fin == nullptr || count == nullptr) {
@@ -2502,122 +5695,63 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
   static_assert(sizeof(internal::Size) == sizeof(uint64_t), "Size is not 64 bit wide");
   {
     uint8_t buf[2];
-    auto err = netx_recvn(sock, buf, sizeof(buf));
+    auto err = ws_recvn(sock, buf, sizeof(buf));
     if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for header");
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for header");
       return err;
     }
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: ws header: "
-               << represent(std::string{(char *)buf, sizeof(buf)}));
-    *fin = (buf[0] & ws_fin_flag) != 0;
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: FIN: " << std::boolalpha << *fin);
-    uint8_t reserved = (uint8_t)(buf[0] & ws_reserved_mask);
-    if (reserved != 0) {
-      // They only make sense for extensions, which we don't use. So we return
-      // error. See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: invalid reserved bits: " << reserved);
-      return internal::Err::ws_proto;
-    }
-    *opcode = (uint8_t)(buf[0] & ws_opcode_mask);
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: opcode: " << (unsigned int)*opcode);
-    switch (*opcode) {
-      // clang-format off
-      case ws_opcode_continue:
-      case ws_opcode_text:
-      case ws_opcode_binary:
-      case ws_opcode_close:
-      case ws_opcode_ping:
-      case ws_opcode_pong: break;
-      // clang-format off
-      default:
-        // See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-        LIBNDT_EMIT_WARNING("ws_recv_any_frame: invalid opcode");
-        return internal::Err::ws_proto;
-    }
-    auto hasmask = (buf[1] & ws_mask_flag) != 0;
-    // We do not expect to receive a masked frame. This is client code and
-    // the RFC says that a server MUST NOT mask its frames.
-    //
-    // See <https://tools.ietf.org/html/rfc6455#section-5.1>.
-    if (hasmask) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: received masked frame");
-      return internal::Err::invalid_argument;
+    {
+      auto rbuf = ws_recv_buffer(sock);
+      if (rbuf != nullptr) {
+        rbuf->stats.frames += 1;
+      }
     }
-    length = (buf[1] & ws_len_mask);
-    switch (*opcode) {
-      case ws_opcode_close:
-      case ws_opcode_ping:
-      case ws_opcode_pong:
-        if (length > 125 || *fin == false) {
-          LIBNDT_EMIT_WARNING("ws_recv_any_frame: control messages MUST have a "
-                       "payload length of 125 bytes or less and MUST NOT "
-                       "be fragmented (see RFC6455 Sect 5.5.)");
-          return internal::Err::ws_proto;
-        }
-        break;
+    auto parse_err = ws_parse_header(buf, opcode, fin, &length);
+    if (parse_err != internal::Err::none) {
+      return parse_err;
     }
-    // As mentioned above, length is transmitted using big endian encoding.
-#define AL(value)                                                            \
-  do {                                                                       \
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: length byte: " << (unsigned int)(value)); \
-    length += (value);                                                       \
-  } while (0)
-    // The following should not happen because the lenght is over 7 bits but
-    // it's nice to enforce assertions to make assumptions explicit.
-    assert(length <= 127);
-    if (length == 126) {
-      uint8_t len_buf[2];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
-      if (recvn_err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 16 bit length");
-        return recvn_err;
-      }
-      LIBNDT_EMIT_DEBUG("ws_recv_any_frame: 16 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
-      length = 0;  // Need to reset the length as AL() does +=
-      AL(((internal::Size)len_buf[0]) << 8);
-      AL((internal::Size)len_buf[1]);
-    } else if (length == 127) {
+    if (length == 126 || length == 127) {
       uint8_t len_buf[8];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
+      internal::Size len_size = (length == 126) ? 2 : 8;
+      auto recvn_err = ws_recvn(sock, len_buf, len_size);
       if (recvn_err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 64 bit length");
+        LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for "
+                            << len_size * 8 << " bit length");
         return recvn_err;
       }
-      LIBNDT_EMIT_DEBUG("ws_recv_any_frame: 64 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
-      length = 0;  // Need to reset the length as AL() does +=
-      AL(((internal::Size)len_buf[0]) << 56);
-      if ((len_buf[0] & 0x80) != 0) {
-        // See <https://tools.ietf.org/html/rfc6455#section-5.2>: "[...] the
-        // most significant bit MUST be 0."
-        LIBNDT_EMIT_WARNING("ws_recv_any_frame: 64 bit length: invalid first bit");
-        return internal::Err::ws_proto;
+      parse_err = ws_parse_length(len_buf, len_size, &length);
+      if (parse_err != internal::Err::none) {
+        return parse_err;
       }
-      AL(((internal::Size)len_buf[1]) << 48);
-      AL(((internal::Size)len_buf[2]) << 40);
-      AL(((internal::Size)len_buf[3]) << 32);
-      AL(((internal::Size)len_buf[4]) << 24);
-      AL(((internal::Size)len_buf[5]) << 16);
-      AL(((internal::Size)len_buf[6]) << 8);
-      AL(((internal::Size)len_buf[7]));
-    }
-#undef AL  // Tidy
-    if (length > total) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: buffer too small");
-      return internal::Err::message_size;
     }
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: length: " << length);
+    // We run this code for every frame, so we only emit a single message,
+    // which costs nothing when we compile out debug messages.
+    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: FIN: " << std::boolalpha << *fin
+                      << "; opcode: " << (unsigned int)*opcode
+                      << "; length: " << length);
   }
-  LIBNDT_EMIT_DEBUG("ws_recv_any_frame: received header");
+  count_frame(counter_recv_frame_sizes, length);
+  LIBNDT_TRACE(recv_frame, sock, length);
   // Message body
+  if (length > 0 && discard &&
+      (*opcode == ws_opcode_binary || *opcode == ws_opcode_continue)) {
+    auto err = ws_discardn(sock, length);
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_discardn() failed for body");
+      return err;
+    }
+    *count = length;
+    return internal::Err::none;
+  }
+  if (length > total) {
+    LIBNDT_EMIT_WARNING("ws_recv_any_frame: buffer too small");
+    return internal::Err::message_size;
+  }
   if (length > 0) {
     assert(length <= total);
-    auto err = netx_recvn(sock, base, length);
+    auto err = ws_recvn(sock, base, length);
     if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for body");
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for body");
       return err;
     }
     // This makes the code too noisy when using -verbose. It may still be
@@ -2628,14 +5762,89 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
     */
     *count = length;
   } else {
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: no body in this message");
     assert(*count == 0);
   }
   return internal::Err::none;
 }
 
+internal::Err Client::ws_parse_header(const uint8_t *buf, uint8_t *opcode,
+                                     bool *fin,
+                                     internal::Size *length) const noexcept {
+  assert(buf != nullptr && opcode != nullptr && fin != nullptr &&
+         length != nullptr);
+  *fin = (buf[0] & ws_fin_flag) != 0;
+  uint8_t reserved = (uint8_t)(buf[0] & ws_reserved_mask);
+  if (reserved != 0) {
+    // They only make sense for extensions, which we don't use. So we return
+    // error. See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+    LIBNDT_EMIT_WARNING("ws_parse_header: invalid reserved bits: " << reserved);
+    return internal::Err::ws_proto;
+  }
+  *opcode = (uint8_t)(buf[0] & ws_opcode_mask);
+  switch (*opcode) {
+    // clang-format off
+    case ws_opcode_continue:
+    case ws_opcode_text:
+    case ws_opcode_binary:
+    case ws_opcode_close:
+    case ws_opcode_ping:
+    case ws_opcode_pong: break;
+    // clang-format off
+    default:
+      // See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+      LIBNDT_EMIT_WARNING("ws_parse_header: invalid opcode");
+      return internal::Err::ws_proto;
+  }
+  auto hasmask = (buf[1] & ws_mask_flag) != 0;
+  // We do not expect to receive a masked frame. This is client code and
+  // the RFC says that a server MUST NOT mask its frames.
+  //
+  // See <https://tools.ietf.org/html/rfc6455#section-5.1>.
+  if (hasmask) {
+    LIBNDT_EMIT_WARNING("ws_parse_header: received masked frame");
+    return internal::Err::invalid_argument;
+  }
+  *length = (buf[1] & ws_len_mask);
+  switch (*opcode) {
+    case ws_opcode_close:
+    case ws_opcode_ping:
+    case ws_opcode_pong:
+      if (*length > ws_max_control_size || *fin == false) {
+        LIBNDT_EMIT_WARNING("ws_parse_header: control messages MUST have a "
+                     "payload length of 125 bytes or less and MUST NOT "
+                     "be fragmented (see RFC6455 Sect 5.5.)");
+        return internal::Err::ws_proto;
+      }
+      break;
+  }
+  // As mentioned above, length is transmitted using big endian encoding.
+  // The following should not happen because the lenght is over 7 bits but
+  // it's nice to enforce assertions to make assumptions explicit.
+  assert(*length <= 127);
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_parse_length(const uint8_t *buf,
+                                     internal::Size len_size,
+                                     internal::Size *length) const noexcept {
+  assert(buf != nullptr && length != nullptr);
+  assert(len_size == 2 || len_size == 8);
+  if (len_size == 8 && (buf[0] & 0x80) != 0) {
+    // See <https://tools.ietf.org/html/rfc6455#section-5.2>: "[...] the
+    // most significant bit MUST be 0."
+    LIBNDT_EMIT_WARNING("ws_parse_length: 64 bit length: invalid first bit");
+    return internal::Err::ws_proto;
+  }
+  *length = 0;
+  for (internal::Size i = 0; i < len_size; ++i) {
+    *length = (*length << 8) | buf[i];
+  }
+  return internal::Err::none;
+}
+
 internal::Err Client::ws_recv_frame(internal::Socket sock, uint8_t *opcode, bool *fin,
-      uint8_t *base, internal::Size total, internal::Size *count) const noexcept {
+      uint8_t *base, internal::Size total, internal::Size *count,
+      bool discard) const noexcept {
   // "Control frames (see Section 5.5) MAY be injected in the middle of
   // a fragmented message.  Control frames themselves MUST NOT be fragmented."
   //    -- RFC6455 Section 5.4.
@@ -2652,7 +5861,7 @@ again:
   *opcode = 0;
   *fin = false;
   *count = 0;
-  err = ws_recv_any_frame(sock, opcode, fin, base, total, count);
+  err = ws_recv_any_frame(sock, opcode, fin, base, total, count, discard);
   if (err != internal::Err::none) {
     LIBNDT_EMIT_WARNING("ws_recv_frame: ws_recv_any_frame() failed");
     return err;
@@ -2672,8 +5881,11 @@ again:
     return internal::Err::eof;
   }
   if (*opcode == ws_opcode_pong) {
-    // RFC6455 Sect. 5.5.3 says that we must ignore a PONG.
+    // RFC6455 Sect. 5.5.3 says that we must ignore a PONG, unless it is the
+    // reply to one of our own PINGs (see ndt7_maybe_ping()).
     LIBNDT_EMIT_DEBUG("ws_recv_frame: received PONG frame; continuing to read");
+    (void)ndt7_latency_.OnPong(
+        base, *count, usec_since(std::chrono::steady_clock::time_point{}));
     goto again;
   }
   if (*opcode == ws_opcode_ping) {
@@ -2695,6 +5907,18 @@ again:
 internal::Err Client::ws_recvmsg(  //
     internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
     internal::Size *count) const noexcept {
+  return ws_recvmsg_common(sock, opcode, base, total, count, false);
+}
+
+internal::Err Client::ws_recvmsg_discard(  //
+    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count) const noexcept {
+  return ws_recvmsg_common(sock, opcode, base, total, count, true);
+}
+
+internal::Err Client::ws_recvmsg_common(  //
+    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count, bool discard) const noexcept {
   // General remark from RFC6455 Sect. 5.4: "[I]n absence of extensions, senders
   // and receivers must not depend on [...] specific frame boundaries."
   //
@@ -2714,7 +5938,7 @@ internal::Err Client::ws_recvmsg(  //
   bool fin = false;
   *opcode = 0;
   *count = 0;
-  auto err = ws_recv_frame(sock, opcode, &fin, base, total, count);
+  auto err = ws_recv_frame(sock, opcode, &fin, base, total, count, discard);
   if (err != internal::Err::none) {
     // We don't want to scary the user in case of clean EOF
     if (err != internal::Err::eof) {
@@ -2730,14 +5954,23 @@ internal::Err Client::ws_recvmsg(  //
     LIBNDT_EMIT_DEBUG("ws_recv: the first frame is also the last frame");
     return internal::Err::none;
   }
-  while (*count < total) {
-    if ((uintptr_t)base > UINTPTR_MAX - *count) {
-      LIBNDT_EMIT_WARNING("ws_recv: avoiding pointer overflow");
-      return internal::Err::value_too_large;
+  // When discarding a binary message, we do not store its continuation frames
+  // hence the message size is not bounded by the size of the buffer.
+  bool discarding = discard && *opcode == ws_opcode_binary;
+  while (discarding || *count < total) {
+    uint8_t *where = base;
+    internal::Size avail = total;
+    if (!discarding) {
+      if ((uintptr_t)base > UINTPTR_MAX - *count) {
+        LIBNDT_EMIT_WARNING("ws_recv: avoiding pointer overflow");
+        return internal::Err::value_too_large;
+      }
+      where = base + *count;
+      avail = total - *count;
     }
     uint8_t op = 0;
 		internal::Size n = 0;
-    err = ws_recv_frame(sock, &op, &fin, base + *count, total - *count, &n);
+    err = ws_recv_frame(sock, &op, &fin, where, avail, &n, discarding);
     if (err != internal::Err::none) {
       LIBNDT_EMIT_WARNING("ws_recv: ws_recv_frame() failed for continuation frame");
       return err;
@@ -2757,8 +5990,342 @@ internal::Err Client::ws_recvmsg(  //
     }
     LIBNDT_EMIT_DEBUG("ws_recv: this is not the last frame");
   }
-  LIBNDT_EMIT_WARNING("ws_recv: buffer smaller than incoming message");
-  return internal::Err::message_size;
+  LIBNDT_EMIT_WARNING("ws_recv: buffer smaller than incoming message");
+  return internal::Err::message_size;
+}
+
+internal::Err Client::ws_close(internal::Socket sock, uint8_t *base,
+                               internal::Size total) const noexcept {
+  // Setting the FIN flag because control messages MUST NOT be fragmented
+  // as specified in Section 5.5 of RFC6455.
+  auto err = ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+  if (err != internal::Err::none) {
+    LIBNDT_EMIT_WARNING("ws_close: cannot send CLOSE frame");
+    return err;
+  }
+  // The peer may have sent more frames before receiving our CLOSE. We use
+  // ws_recv_any_frame() rather than ws_recv_frame(), since the latter would
+  // reply to the peer's CLOSE with another CLOSE. (We MUST NOT send any other
+  // frame after CLOSE, hence we also don't reply to PING.)
+  for (;;) {
+    uint8_t opcode = 0;
+    bool fin = false;
+    internal::Size count = 0;
+    err = ws_recv_any_frame(sock, &opcode, &fin, base, total, &count, true);
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ws_close: ws_recv_any_frame() failed");
+      return err;
+    }
+    if (opcode == ws_opcode_close) {
+      LIBNDT_EMIT_DEBUG("ws_close: received CLOSE frame");
+      return internal::Err::none;
+    }
+  }
+}
+
+internal::Err Client::ws_recvn(internal::Socket sock, void *base,
+                               internal::Size count) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    return netx_recvn(sock, base, count);
+  }
+  uint8_t *dest = (uint8_t *)base;
+  while (count > 0) {
+    if (rbuf->begin >= rbuf->end) {
+      internal::Size n = 0;
+      if (count >= rbuf->capacity) {
+        // Bypass the buffer, since it would not save us any recv call.
+        auto err = netx_recv(sock, dest, count, &n);
+        rbuf->stats.recv_calls += 1;
+        if (err != internal::Err::none) {
+          return err;
+        }
+        assert(n <= count);
+        dest += n;
+        count -= n;
+        continue;
+      }
+      rbuf->begin = rbuf->end = 0;
+      auto err = netx_recv(sock, rbuf->data.get(), rbuf->capacity, &n);
+      rbuf->stats.recv_calls += 1;
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= rbuf->capacity);
+      rbuf->end = n;
+    }
+    internal::Size avail = rbuf->end - rbuf->begin;
+    internal::Size amount = (count < avail) ? count : avail;
+    memcpy(dest, rbuf->data.get() + rbuf->begin, (size_t)amount);
+    rbuf->begin += amount;
+    dest += amount;
+    count -= amount;
+  }
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_discardn(internal::Socket sock,
+                                  internal::Size count) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    uint8_t scratch[8192];
+    while (count > 0) {
+      internal::Size amount = (count < sizeof(scratch)) ? count : sizeof(scratch);
+      auto err = netx_recvn(sock, scratch, amount);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      count -= amount;
+    }
+    return internal::Err::none;
+  }
+  while (count > 0) {
+    if (rbuf->begin >= rbuf->end) {
+      internal::Size n = 0;
+      rbuf->begin = rbuf->end = 0;
+      auto err = netx_recv(sock, rbuf->data.get(), rbuf->capacity, &n);
+      rbuf->stats.recv_calls += 1;
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= rbuf->capacity);
+      rbuf->end = n;
+    }
+    internal::Size avail = rbuf->end - rbuf->begin;
+    internal::Size amount = (count < avail) ? count : avail;
+    rbuf->begin += amount;
+    count -= amount;
+  }
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_recv_nonblocking(
+    internal::Socket sock, void *base, internal::Size count,
+    internal::Size *actual) const noexcept {
+  assert(actual != nullptr && count > 0);
+  *actual = 0;
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    if (base != nullptr) {
+      return netx_recv_nonblocking(sock, base, count, actual);
+    }
+    uint8_t scratch[8192];
+    internal::Size amount = (count < sizeof(scratch)) ? count : sizeof(scratch);
+    return netx_recv_nonblocking(sock, scratch, amount, actual);
+  }
+  if (rbuf->begin >= rbuf->end) {
+    if (base != nullptr && count >= rbuf->capacity) {
+      // Bypass the buffer, since it would not save us any recv call.
+      auto err = netx_recv_nonblocking(sock, base, count, actual);
+      rbuf->stats.recv_calls += 1;
+      return err;
+    }
+    internal::Size n = 0;
+    rbuf->begin = rbuf->end = 0;
+    auto err = netx_recv_nonblocking(sock, rbuf->data.get(), rbuf->capacity, &n);
+    rbuf->stats.recv_calls += 1;
+    if (err != internal::Err::none) {
+      return err;
+    }
+    assert(n <= rbuf->capacity);
+    rbuf->end = n;
+  }
+  internal::Size avail = rbuf->end - rbuf->begin;
+  internal::Size amount = (count < avail) ? count : avail;
+  if (base != nullptr) {
+    memcpy(base, rbuf->data.get() + rbuf->begin, (size_t)amount);
+  }
+  rbuf->begin += amount;
+  *actual = amount;
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_recvmsg_nonblocking(
+    internal::Socket sock, WsReader *reader, uint8_t *opcode, uint8_t *base,
+    internal::Size total, internal::Size *count) const noexcept {
+  if (reader == nullptr || opcode == nullptr || count == nullptr) {
+    LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: passed invalid return arguments");
+    return internal::Err::invalid_argument;
+  }
+  if (base == nullptr || total <= 0) {
+    LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: passed invalid buffer arguments");
+    return internal::Err::invalid_argument;
+  }
+  *opcode = 0;
+  *count = 0;
+  for (;;) {
+    // Frame header, including the extended length, if any.
+    while (!reader->in_body) {
+      internal::Size n = 0;
+      auto err = ws_recv_nonblocking(sock, reader->header + reader->header_size,
+                                     reader->header_need - reader->header_size,
+                                     &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      reader->received += n;
+      reader->header_size += n;
+      if (reader->header_size < reader->header_need) {
+        continue;
+      }
+      internal::Size length = 0;
+      err = ws_parse_header(reader->header, &reader->opcode, &reader->fin,
+                            &length);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      if (length == 126 || length == 127) {
+        internal::Size len_size = (length == 126) ? 2 : 8;
+        if (reader->header_need < 2 + len_size) {
+          reader->header_need = 2 + len_size;
+          continue;
+        }
+        err = ws_parse_length(reader->header + 2, len_size, &length);
+        if (err != internal::Err::none) {
+          return err;
+        }
+      }
+      LIBNDT_EMIT_DEBUG("ws_recvmsg_nonblocking: FIN: " << std::boolalpha
+                        << reader->fin << "; opcode: "
+                        << (unsigned int)reader->opcode
+                        << "; length: " << length);
+      {
+        auto rbuf = ws_recv_buffer(sock);
+        if (rbuf != nullptr) {
+          rbuf->stats.frames += 1;
+        }
+      }
+      count_frame(counter_recv_frame_sizes, length);
+      LIBNDT_TRACE(recv_frame, sock, length);
+      switch (reader->opcode) {
+        case ws_opcode_text:
+        case ws_opcode_binary:
+          if (reader->message != 0) {
+            LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: expected continuation");
+            return internal::Err::ws_proto;
+          }
+          reader->message = reader->opcode;
+          reader->count = 0;
+          break;
+        case ws_opcode_continue:
+          if (reader->message == 0) {
+            LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: unexpected continuation");
+            return internal::Err::ws_proto;
+          }
+          break;
+      }
+      bool data = (reader->opcode == ws_opcode_text ||
+                   reader->opcode == ws_opcode_binary ||
+                   reader->opcode == ws_opcode_continue);
+      // Like ws_recvmsg_discard(), we only store text messages.
+      if (data && reader->message != ws_opcode_binary &&
+          length > total - reader->count) {
+        LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: buffer smaller than "
+                            "incoming message");
+        return internal::Err::message_size;
+      }
+      if (data && reader->count > internal::SizeMax - length) {
+        LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: avoiding integer overflow");
+        return internal::Err::value_too_large;
+      }
+      reader->in_body = true;
+      reader->remaining = length;
+      reader->control_size = 0;
+    }
+    // Frame body.
+    bool control = (reader->opcode == ws_opcode_close ||
+                    reader->opcode == ws_opcode_ping ||
+                    reader->opcode == ws_opcode_pong);
+    while (reader->remaining > 0) {
+      uint8_t *where = nullptr;  // discard
+      if (control) {
+        where = reader->control + reader->control_size;
+      } else if (reader->message != ws_opcode_binary) {
+        where = base + reader->count;
+      }
+      internal::Size n = 0;
+      auto err = ws_recv_nonblocking(sock, where, reader->remaining, &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= reader->remaining);
+      reader->received += n;
+      reader->remaining -= n;
+      if (control) {
+        reader->control_size += n;
+      } else {
+        reader->count += n;
+      }
+    }
+    reader->in_body = false;
+    reader->header_size = 0;
+    reader->header_need = 2;
+    // See ws_recv_frame() and ws_close() for how we handle control frames.
+    if (reader->opcode == ws_opcode_close) {
+      reader->closed = true;
+      if (!reader->closing) {
+        LIBNDT_EMIT_DEBUG("ws_recvmsg_nonblocking: received CLOSE frame; "
+                          "sending CLOSE back");
+        (void)ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+      }
+      return internal::Err::eof;
+    }
+    if (reader->opcode == ws_opcode_pong) {
+      if (ndt7_latency_.OnPong(
+              reader->control, reader->control_size,
+              usec_since(std::chrono::steady_clock::time_point{}))) {
+        reader->pongs += 1;
+      }
+      continue;
+    }
+    if (reader->opcode == ws_opcode_ping) {
+      if (!reader->closing) {
+        auto err = ws_send_frame(sock, ws_opcode_pong | ws_fin_flag,
+                                 reader->control, reader->control_size);
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: ws_send_frame() failed "
+                              "for PONG frame");
+          return err;
+        }
+      }
+      continue;
+    }
+    if (reader->fin) {
+      *opcode = reader->message;
+      *count = reader->count;
+      reader->message = 0;
+      reader->count = 0;
+      return internal::Err::none;
+    }
+  }
+}
+
+bool Client::ws_recv_stats(internal::Socket sock,
+                           WsRecvStats *stats) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr || stats == nullptr) {
+    return false;
+  }
+  *stats = rbuf->stats;
+  return true;
+}
+
+Client::WsRecvBuffer *Client::ws_recv_buffer(
+    internal::Socket sock) const noexcept {
+  auto conn = connection(sock);
+  return (conn != nullptr && conn->ws.data) ? &conn->ws : nullptr;
+}
+
+Client::Connection *Client::connection(internal::Socket sock) const noexcept {
+  return connections_.Find(sock);
+}
+
+Client::Connection *Client::connection_create(internal::Socket sock) noexcept {
+  auto conn = connections_.Find(sock);
+  if (conn == nullptr) {
+    conn = connections_.Insert(sock, std::unique_ptr<Connection>{new Connection{}});
+  }
+  return conn;
 }
 
 // } - - - END WEBSOCKET IMPLEMENTATION - - -
@@ -2861,7 +6428,10 @@ static int libndt_bio_write(BIO *bio, const char *base, int count) noexcept {
   return libndt_bio_operation(
       bio, (char *)base, count,
       [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Send(sock, (const char *)base, count);
+        clnt->atomic_counters.Add(Client::counter_send_calls);
+        auto rv = clnt->sys->Send(sock, (const char *)base, count);
+        LIBNDT_TRACE_EX(clnt, send, sock, rv);
+        return rv;
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_write(bio); });
   // clang-format on
@@ -2873,7 +6443,10 @@ static int libndt_bio_read(BIO *bio, char *base, int count) noexcept {
   return libndt_bio_operation(
       bio, base, count,
       [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Recv(sock, base, count);
+        clnt->atomic_counters.Add(Client::counter_recv_calls);
+        auto rv = clnt->sys->Recv(sock, base, count);
+        LIBNDT_TRACE_EX(clnt, recv, sock, rv);
+        return rv;
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_read(bio); });
   // clang-format on
@@ -2930,8 +6503,12 @@ static internal::Err map_ssl_error(const Client *client, SSL *ssl, int ret) noex
       // TODO(bassosimone): consider the issue of dirty shutdown.
       return internal::Err::eof;
     case SSL_ERROR_WANT_READ:
+      client->atomic_counters.Add(Client::counter_ssl_want_read);
+      LIBNDT_TRACE_EX(client, ssl_want_read, (internal::Socket)::SSL_get_fd(ssl), 0);
       return internal::Err::ssl_want_read;
     case SSL_ERROR_WANT_WRITE:
+      client->atomic_counters.Add(Client::counter_ssl_want_write);
+      LIBNDT_TRACE_EX(client, ssl_want_write, (internal::Socket)::SSL_get_fd(ssl), 0);
       return internal::Err::ssl_want_write;
     case SSL_ERROR_SYSCALL:
       auto ecode = client->sys->GetLastError();
@@ -2986,12 +6563,27 @@ internal::Err Client::netx_maybews_dial(const std::string &hostname,
     return internal::Err::none;
   }
   LIBNDT_EMIT_DEBUG("netx_maybews_dial: about to start websocket handhsake");
+  {
+    // Note that we setup the receive buffer before the handshake, because
+    // the server may send frames right after the handshake response and we
+    // may thus read them along with the response.
+    constexpr internal::Size ws_recv_buffer_size = 1 << 16;
+    auto &rbuf = connection_create(*sock)->ws;
+    rbuf.data.reset(new uint8_t[ws_recv_buffer_size]);
+    rbuf.capacity = ws_recv_buffer_size;
+    rbuf.begin = rbuf.end = 0;
+  }
+  auto begin = std::chrono::steady_clock::now();
   err = ws_handshake(*sock, port, ws_flags, ws_protocol, url_path);
   if (err != internal::Err::none) {
     (void)netx_closesocket(*sock);
     *sock = (internal::Socket)-1;
     return err;
   }
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_ws_handshakes);
+  atomic_counters.Add(counter_ws_handshake_usec, usec);
+  LIBNDT_TRACE(ws_handshake, *sock, usec);
   LIBNDT_EMIT_DEBUG("netx_maybews_dial: established websocket channel");
   return internal::Err::none;
 }
@@ -3042,49 +6634,59 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
   }
   SSL *ssl = nullptr;
   {
-    // TODO(bassosimone): understand whether we can remove old SSL versions
-    // taking into account that the NDT server runs on very old code.
-    SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+    // The cache creates the context and loads the CA bundle only once.
+    SSL_CTX *ctx = ssl_cache->Context(settings_.ca_bundle_path,
+                                      settings_.tls_verify_peer);
     if (ctx == nullptr) {
-      LIBNDT_EMIT_WARNING("SSL_CTX_new() failed");
+      LIBNDT_EMIT_WARNING("Cannot create SSL_CTX or load the CA bundle path");
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
-    LIBNDT_EMIT_DEBUG("SSL_CTX created");
-    if (settings_.tls_verify_peer) {
-      if (!::SSL_CTX_load_verify_locations(  //
-              ctx, settings_.ca_bundle_path.c_str(), nullptr)) {
-        LIBNDT_EMIT_WARNING("Cannot load the CA bundle path from the file system");
-        ::SSL_CTX_free(ctx);
-        netx_closesocket(*sock);
-        return internal::Err::ssl_generic;
-      }
-      LIBNDT_EMIT_DEBUG("Loaded the CA bundle path");
-    }
+    LIBNDT_EMIT_DEBUG("SSL_CTX ready");
     ssl = ::SSL_new(ctx);
     if (ssl == nullptr) {
       LIBNDT_EMIT_WARNING("SSL_new() failed");
-      ::SSL_CTX_free(ctx);
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
     LIBNDT_EMIT_DEBUG("SSL created");
-    ::SSL_CTX_free(ctx);  // Referenced by `ssl` so safe to free here
-    assert(fd_to_ssl_.count(*sock) == 0);
+    auto conn = connection_create(*sock);
+    assert(conn->ssl == nullptr);
     // Implementation note: after this point `netx_closesocket(*sock)` will
     // imply that `::SSL_free(ssl)` is also called.
-    fd_to_ssl_[*sock] = ssl;
+    conn->ssl = ssl;
+  }
+  // We key sessions by hostname and port, such that, e.g., the ndt7 upload
+  // resumes the session of the download, and an ndt5 data connection resumes
+  // the session of a previous data connection to the same port, but not the
+  // session of the control connection, which uses another port. The cache
+  // also keys sessions by context, i.e., by CA bundle path and by whether we
+  // verify the peer.
+  if (!ssl_cache->Prepare(ssl, hostname + ":" + port)) {
+    LIBNDT_EMIT_WARNING("Cannot prepare SSL for session resumption");
+    netx_closesocket(*sock);
+    return internal::Err::ssl_generic;
+  }
+  // With kTLS, OpenSSL must drive the socket directly, because it uses
+  // socket options and control messages our BIO knows nothing about. So, we
+  // use a socket BIO, which bypasses `sys`, and we use our BIO otherwise.
+  bool ktls = false;
+#ifdef LIBNDT_HAVE_KTLS
+  ktls = settings_.tls_ktls;
+  if (ktls) {
+    ::SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
   }
-  BIO *bio = ::BIO_new(libndt_bio_method());
+#endif
+  BIO *bio = ::BIO_new(ktls ? ::BIO_s_socket() : libndt_bio_method());
   if (bio == nullptr) {
     LIBNDT_EMIT_WARNING("BIO_new() failed");
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because of connections_
     return internal::Err::ssl_generic;
   }
-  LIBNDT_EMIT_DEBUG("libndt BIO created");
+  LIBNDT_EMIT_DEBUG("BIO created");
   // We use BIO_NOCLOSE because it's the socket that owns the BIO and the SSL
-  // via fd_to_ssl rather than the other way around. Note that sockets are
+  // via connections_ rather than the other way around. Note that sockets are
   // always `int` in OpenSSL notwithstanding their definition on Windows, so
   // here we're casting unconditionally to silence compiler warnings.
   //
@@ -3095,7 +6697,9 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
   // For historical reasons, if the two BIOs are equal, the SSL object will
   // increase the refcount of bio just once rather than twice.
   ::SSL_set_bio(ssl, bio, bio);
-  ::BIO_set_data(bio, this);
+  if (!ktls) {
+    ::BIO_set_data(bio, this);  // The socket BIO uses its data with kTLS
+  }
   ::SSL_set_connect_state(ssl);
   LIBNDT_EMIT_DEBUG("Socket added to SSL context");
   if (settings_.tls_verify_peer) {
@@ -3108,12 +6712,13 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
     if (!::X509_VERIFY_PARAM_set1_host(p, hostname.data(), hostname.size())) {
       LIBNDT_EMIT_WARNING("Cannot set the hostname for hostname validation");
       netx_closesocket(*sock);
-      //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+      //::SSL_free(ssl); // MUST NOT be called because of connections_
       return internal::Err::ssl_generic;
     }
     SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
     LIBNDT_EMIT_DEBUG("SSL_VERIFY_PEER configured");
   }
+  auto begin = std::chrono::steady_clock::now();
   err = ssl_retry_unary_op("SSL_do_handshake", this, ssl, *sock,
                            settings_.timeout, [](SSL *ssl) -> int {
                              ERR_clear_error();
@@ -3121,10 +6726,36 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
                            });
   if (err != internal::Err::none) {
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because of connections_
     return internal::Err::ssl_generic;
   }
-  LIBNDT_EMIT_DEBUG("SSL handshake complete");
+  {
+    auto usec = usec_since(begin);
+    atomic_counters.Add(counter_tls_handshakes);
+    atomic_counters.Add(counter_tls_handshake_usec, usec);
+    LIBNDT_TRACE(tls_handshake, *sock, usec);
+  }
+  LIBNDT_EMIT_DEBUG("SSL handshake complete; session reused: "
+                    << std::boolalpha << (::SSL_session_reused(ssl) != 0));
+#ifdef LIBNDT_HAVE_KTLS
+  if (ktls) {
+    bool ktls_send = BIO_get_ktls_send(::SSL_get_wbio(ssl)) != 0;
+    bool ktls_recv = BIO_get_ktls_recv(::SSL_get_rbio(ssl)) != 0;
+    LIBNDT_EMIT_DEBUG("kTLS enabled for sending: " << std::boolalpha
+                      << ktls_send << "; for receiving: " << ktls_recv);
+    if (!ktls_send && !ktls_recv) {
+      // Switch back to our BIO, such that I/O goes through `sys` like when
+      // kTLS is disabled. This is safe because the socket BIO does not
+      // buffer and SSL_set_bio() frees the socket BIO.
+      BIO *ours = ::BIO_new(libndt_bio_method());
+      if (ours != nullptr) {
+        ::BIO_set_fd(ours, (int)*sock, BIO_NOCLOSE);
+        ::SSL_set_bio(ssl, ours, ours);
+        ::BIO_set_data(ours, this);
+      }
+    }
+  }
+#endif
   return internal::Err::none;
 }
 
@@ -3417,6 +7048,7 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
     LIBNDT_EMIT_WARNING("netx_dial: socket already connected");
     return internal::Err::invalid_argument;
   }
+  auto begin = std::chrono::steady_clock::now();
   // Implementation note: we could perform getaddrinfo() in one pass but having
   // a virtual API that resolves a hostname to a vector of IP addresses makes
   // life easier when you want to override hostname resolution, because you have
@@ -3426,6 +7058,14 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
   if ((err = netx_resolve(hostname, &addresses)) != internal::Err::none) {
     return err;
   }
+  // Collect the addresses to try, keeping track of the address string they
+  // come from for logging purposes. We free them before returning.
+  struct Candidate {
+    const addrinfo *aip;
+    const std::string *addr;
+  };
+  std::vector<addrinfo *> results;
+  std::vector<Candidate> candidates;
   for (auto &addr : addresses) {
     addrinfo hints{};
     hints.ai_socktype = SOCK_STREAM;
@@ -3434,81 +7074,245 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
     int rv = sys->Getaddrinfo(addr.data(), port.data(), &hints, &rp);
     if (rv != 0) {
       LIBNDT_EMIT_WARNING("netx_dial: unexpected getaddrinfo() failure");
+      for (auto result : results) {
+        sys->Freeaddrinfo(result);
+      }
       return netx_map_eai(rv);
     }
     assert(rp);
+    results.push_back(rp);
     for (auto aip = rp; (aip); aip = aip->ai_next) {
-      sys->SetLastError(0);
-      *sock = sys->NewSocket(aip->ai_family, aip->ai_socktype, 0);
-      if (!internal::IsSocketValid(*sock)) {
-        LIBNDT_EMIT_WARNING("netx_dial: socket() failed");
-        continue;
+      candidates.push_back(Candidate{aip, &addr});
+    }
+  }
+  // As recommended by RFC8305 Sect. 4, we interleave the address families
+  // starting with the family of the first address, so that, e.g., a broken
+  // IPv6 path doesn't prevent us from quickly trying IPv4 addresses.
+  {
+    std::vector<Candidate> first, second;
+    for (auto &c : candidates) {
+      auto &v = (c.aip->ai_family == candidates[0].aip->ai_family) ? first : second;
+      v.push_back(c);
+    }
+    candidates.clear();
+    for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+      if (i < first.size()) {
+        candidates.push_back(first[i]);
       }
-#ifdef SO_NOSIGPIPE
-      // Implementation note: SO_NOSIGPIPE is the nonportable BSD solution to
-      // avoid SIGPIPE when writing on a connection closed by the peer.
-      {
-        auto on = 1;
-        if (::setsockopt(  //
-                *sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
-          LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_NOSIGPIPE) failed");
-          sys->Closesocket(*sock);
-          *sock = -1;
-          continue;
-        }
+      if (i < second.size()) {
+        candidates.push_back(second[i]);
       }
-#endif  // SO_NOSIGPIPE
-      if (netx_setnonblocking(*sock, true) != internal::Err::none) {
-        LIBNDT_EMIT_WARNING("netx_dial: netx_setnonblocking() failed");
-        sys->Closesocket(*sock);
-        *sock = (libndt::internal::Socket)-1;
-        continue;
+    }
+  }
+  // We start a new connect attempt every netx_dial_attempt_delay_msec or as
+  // soon as an attempt fails, without waiting for the pending ones, and we
+  // use the first attempt that succeeds (RFC8305 Sect. 5).
+  struct Attempt {
+    internal::Socket sock;
+    Candidate candidate;
+    std::chrono::steady_clock::time_point begin;
+  };
+  auto since = [](const Attempt &attempt) -> double {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - attempt.begin;
+    return elapsed.count();
+  };
+  std::vector<Attempt> attempts;
+  size_t next = 0;
+  auto start_next = true;
+  std::chrono::steady_clock::time_point deadline;
+  std::vector<pollfd> pfds;
+  err = internal::Err::io_error;
+  while (!internal::IsSocketValid(*sock)) {
+    if (is_cancelled()) {
+      err = internal::Err::cancelled;
+      break;
+    }
+    while (start_next && next < candidates.size()) {
+      Attempt attempt{(internal::Socket)-1, candidates[next++],
+                      std::chrono::steady_clock::now()};
+      auto start_err = netx_dial_start(attempt.candidate.aip, &attempt.sock);
+      if (start_err == internal::Err::none) {
+        LIBNDT_EMIT_DEBUG("netx_dial: connect() to " << *attempt.candidate.addr
+                          << ": okay immediately after " << since(attempt)
+                          << " ms");
+        *sock = attempt.sock;
+        break;
       }
-      // While on Unix ai_addrlen is socklen_t, it's size_t on Windows. Just
-      // for the sake of correctness, add a check that ensures that the size has
-      // a reasonable value before casting to socklen_t. My understanding is
-      // that size_t is `ULONG_PTR` while socklen_t is most likely `int`.
-#ifdef _WIN32
-      if (aip->ai_addrlen > sizeof(sockaddr_in6)) {
-        LIBNDT_EMIT_WARNING("netx_dial: unexpected size of aip->ai_addrlen");
-        sys->Closesocket(*sock);
-        *sock = (libndt::internal::Socket)-1;
-        continue;
+      if (start_err == internal::Err::operation_in_progress) {
+        attempts.push_back(attempt);
+        deadline = attempt.begin + std::chrono::seconds(settings_.timeout);
+        start_next = false;
+        break;
       }
-#endif
-      if (sys->Connect(*sock, aip->ai_addr, (socklen_t)aip->ai_addrlen) == 0) {
-        LIBNDT_EMIT_DEBUG("netx_dial: connect(): okay immediately");
+      LIBNDT_EMIT_WARNING("netx_dial: connect() to " << *attempt.candidate.addr
+                          << " failed: " << internal::libndt_perror(start_err));
+    }
+    start_next = false;
+    if (internal::IsSocketValid(*sock) || attempts.empty()) {
+      break;
+    }
+    pfds.clear();
+    for (auto &attempt : attempts) {
+      pollfd pfd{};
+      pfd.fd = attempt.sock;
+      pfd.events = POLLOUT;
+      pfds.push_back(pfd);
+    }
+    // When there are no more addresses to try, we wait until the deadline
+    // of the most recent attempt, which is the latest deadline.
+    auto more = next < candidates.size();
+    int timeout_msec = netx_dial_attempt_delay_msec;
+    if (!more) {
+      std::chrono::duration<double, std::milli> remaining =
+          deadline - std::chrono::steady_clock::now();
+      timeout_msec = (remaining.count() > 0.0) ? (int)remaining.count() : 0;
+    }
+    auto poll_err = netx_poll(&pfds, timeout_msec);
+    if (poll_err == internal::Err::timed_out) {
+      if (!more) {
+        LIBNDT_EMIT_WARNING("netx_dial: connect() timed out");
         break;
       }
-      auto connect_err = netx_map_errno(sys->GetLastError());
-      if (CONNECT_IN_PROGRESS(connect_err)) {
-        connect_err = netx_wait_writeable(*sock, settings_.timeout);
-        if (connect_err == internal::Err::none) {
-          int soerr = 0;
-          socklen_t soerrlen = sizeof(soerr);
-          if (sys->Getsockopt(*sock, SOL_SOCKET, SO_ERROR, (void *)&soerr,
-                             &soerrlen) == 0) {
-            assert(soerrlen == sizeof(soerr));
-            if (soerr == 0) {
-              LIBNDT_EMIT_DEBUG("netx_dial: connect(): okay");
-              break;
-            }
-            sys->SetLastError(soerr);
-          }
+      start_next = true;
+      continue;
+    }
+    if (poll_err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING(
+          "netx_dial: netx_poll() failed: " << internal::libndt_perror(poll_err));
+      err = poll_err;
+      break;
+    }
+    for (size_t i = pfds.size(); i > 0; --i) {
+      if (pfds[i - 1].revents == 0) {
+        continue;
+      }
+      auto attempt = attempts[i - 1];
+      attempts.erase(attempts.begin() + (ptrdiff_t)(i - 1));
+      int soerr = 0;
+      socklen_t soerrlen = sizeof(soerr);
+      if (sys->Getsockopt(attempt.sock, SOL_SOCKET, SO_ERROR, (void *)&soerr,
+                          &soerrlen) == 0) {
+        assert(soerrlen == sizeof(soerr));
+        if (soerr == 0) {
+          LIBNDT_EMIT_DEBUG("netx_dial: connect() to " << *attempt.candidate.addr
+                            << ": okay after " << since(attempt) << " ms");
+          *sock = attempt.sock;
+          break;  // the other attempts are abandoned below
         }
+        sys->SetLastError(soerr);
       }
-      LIBNDT_EMIT_WARNING("netx_dial: connect() failed: "
-                   << internal::libndt_perror(netx_map_errno(sys->GetLastError())));
+      LIBNDT_EMIT_WARNING("netx_dial: connect() to " << *attempt.candidate.addr
+                          << " failed after " << since(attempt) << " ms: "
+                          << internal::libndt_perror(
+                                 netx_map_errno(sys->GetLastError())));
+      sys->Closesocket(attempt.sock);
+      start_next = true;
+    }
+  }
+  for (auto &attempt : attempts) {
+    LIBNDT_EMIT_DEBUG("netx_dial: abandoning connect() to "
+                      << *attempt.candidate.addr << " after " << since(attempt)
+                      << " ms");
+    sys->Closesocket(attempt.sock);
+  }
+  for (auto result : results) {
+    sys->Freeaddrinfo(result);
+  }
+  if (!internal::IsSocketValid(*sock)) {
+    return err;
+  }
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_connects);
+  atomic_counters.Add(counter_connect_usec, usec);
+  LIBNDT_TRACE(connect, *sock, usec);
+  return internal::Err::none;
+}
+
+internal::Err Client::netx_dial_start(const addrinfo *aip,
+                                      internal::Socket *sock) noexcept {
+  assert(aip != nullptr && sock != nullptr);
+  sys->SetLastError(0);
+  *sock = sys->NewSocket(aip->ai_family, aip->ai_socktype, 0);
+  if (!internal::IsSocketValid(*sock)) {
+    LIBNDT_EMIT_WARNING("netx_dial: socket() failed");
+    return netx_map_errno(sys->GetLastError());
+  }
+  auto err = internal::Err::none;
+#ifdef SO_NOSIGPIPE
+  // Implementation note: SO_NOSIGPIPE is the nonportable BSD solution to
+  // avoid SIGPIPE when writing on a connection closed by the peer.
+  {
+    auto on = 1;
+    if (::setsockopt(  //
+            *sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_NOSIGPIPE) failed");
+      err = netx_map_errno(sys->GetLastError());
       sys->Closesocket(*sock);
-      *sock = (libndt::internal::Socket)-1;
+      *sock = (internal::Socket)-1;
+      return err;
+    }
+  }
+#endif  // SO_NOSIGPIPE
+  if ((err = netx_setnonblocking(*sock, true)) != internal::Err::none) {
+    LIBNDT_EMIT_WARNING("netx_dial: netx_setnonblocking() failed");
+    sys->Closesocket(*sock);
+    *sock = (internal::Socket)-1;
+    return err;
+  }
+  netx_tune_socket(*sock);
+  // While on Unix ai_addrlen is socklen_t, it's size_t on Windows. Just
+  // for the sake of correctness, add a check that ensures that the size has
+  // a reasonable value before casting to socklen_t. My understanding is
+  // that size_t is `ULONG_PTR` while socklen_t is most likely `int`.
+#ifdef _WIN32
+  if (aip->ai_addrlen > sizeof(sockaddr_in6)) {
+    LIBNDT_EMIT_WARNING("netx_dial: unexpected size of aip->ai_addrlen");
+    sys->Closesocket(*sock);
+    *sock = (internal::Socket)-1;
+    return internal::Err::invalid_argument;
+  }
+#endif
+  atomic_counters.Add(counter_connect_calls);
+  if (sys->Connect(*sock, aip->ai_addr, (socklen_t)aip->ai_addrlen) == 0) {
+    return internal::Err::none;
+  }
+  err = netx_map_errno(sys->GetLastError());
+  if (CONNECT_IN_PROGRESS(err)) {
+    return internal::Err::operation_in_progress;
+  }
+  sys->Closesocket(*sock);
+  *sock = (internal::Socket)-1;
+  return (err != internal::Err::none) ? err : internal::Err::io_error;
+}
+
+void Client::netx_tune_socket(internal::Socket sock) noexcept {
+  if (settings_.socket_send_buffer > 0) {
+    int value = settings_.socket_send_buffer;
+    if (sys->Setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_SNDBUF) failed");
     }
-    sys->Freeaddrinfo(rp);
-    if (*sock != -1) {
-      break;  // we have a connection!
+  }
+  if (settings_.socket_recv_buffer > 0) {
+    int value = settings_.socket_recv_buffer;
+    if (sys->Setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_RCVBUF) failed");
+    }
+  }
+  if (settings_.tcp_notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+    int value = settings_.tcp_notsent_lowat;
+    if (sys->Setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING(
+          "netx_dial: setsockopt(..., TCP_NOTSENT_LOWAT) failed");
     }
+#else
+    LIBNDT_EMIT_WARNING("netx_dial: TCP_NOTSENT_LOWAT is not available");
+#endif
   }
-  // TODO(bassosimone): it's possible to write a better algorithm here
-  return *sock != -1 ? internal::Err::none : internal::Err::io_error;
 }
 
 #undef CONNECT_IN_PROGRESS  // Tidy
@@ -3549,20 +7353,28 @@ internal::Err Client::netx_recv_nonblocking(internal::Socket fd, void *base, int
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
     ERR_clear_error();
     int ret = ::SSL_read(ssl, base, (int)count);
+    atomic_counters.Add(counter_ssl_read_calls);
+    if (settings_.tls_ktls && netx_ktls(fd)) {
+      atomic_counters.Add(counter_recv_calls);  // our BIO cannot count it
+    }
+    LIBNDT_TRACE(ssl_read, fd, ret);
     if (ret <= 0) {
       return map_ssl_error(this, ssl, ret);
     }
     *actual = (internal::Size)ret;
     return internal::Err::none;
   }
+  atomic_counters.Add(counter_recv_calls);
   auto rv = sys->Recv(fd, base, count);
+  LIBNDT_TRACE(recv, fd, rv);
   if (rv < 0) {
     assert(rv == -1);
     return netx_map_errno(sys->GetLastError());
@@ -3626,24 +7438,36 @@ internal::Err Client::netx_send_nonblocking(internal::Socket fd, const void *bas
     return internal::Err::invalid_argument;
   }
   sys->SetLastError(0);
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+  // With kTLS the kernel encrypts what we write, so we skip OpenSSL. We never
+  // mix the two approaches on a socket: once kTLS is enabled we only use
+  // SSL_write() indirectly, e.g., when SSL_shutdown() sends close_notify.
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0 &&
+      !(settings_.tls_ktls && netx_ktls_send(fd))) {
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     ERR_clear_error();
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
     int ret = ::SSL_write(ssl, base, (int)count);
+    atomic_counters.Add(counter_ssl_write_calls);
+    if (settings_.tls_ktls && netx_ktls(fd)) {
+      atomic_counters.Add(counter_send_calls);  // our BIO cannot count it
+    }
+    LIBNDT_TRACE(ssl_write, fd, ret);
     if (ret <= 0) {
       return map_ssl_error(this, ssl, ret);
     }
     *actual = (internal::Size)ret;
     return internal::Err::none;
   }
+  atomic_counters.Add(counter_send_calls);
   auto rv = sys->Send(fd, base, count);
+  LIBNDT_TRACE(send, fd, rv);
   if (rv < 0) {
     assert(rv == -1);
     return netx_map_errno(sys->GetLastError());
@@ -3658,6 +7482,31 @@ internal::Err Client::netx_send_nonblocking(internal::Socket fd, const void *bas
   return internal::Err::none;
 }
 
+bool Client::netx_ktls_send(internal::Socket fd) const noexcept {
+#ifdef LIBNDT_HAVE_KTLS
+  auto conn = connection(fd);
+  return conn != nullptr && conn->ssl != nullptr &&
+         BIO_get_ktls_send(::SSL_get_wbio(conn->ssl)) != 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
+bool Client::netx_ktls(internal::Socket fd) const noexcept {
+#ifdef LIBNDT_HAVE_KTLS
+  // We switch back to our BIO when kTLS is enabled neither for sending nor
+  // for receiving, so in all other cases we are using the socket BIO.
+  auto conn = connection(fd);
+  return conn != nullptr && conn->ssl != nullptr &&
+         (BIO_get_ktls_send(::SSL_get_wbio(conn->ssl)) != 0 ||
+          BIO_get_ktls_recv(::SSL_get_rbio(conn->ssl)) != 0);
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
 internal::Err Client::netx_sendn(internal::Socket fd, const void *base, internal::Size count) const noexcept {
 	internal::Size off = 0;
   while (off < count) {
@@ -3770,7 +7619,19 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd, Timeou
   if (timeout > INT_MAX / 1000) {
     timeout = INT_MAX / 1000;
   }
-  auto err = client->netx_poll(&pfds, (int)timeout * 1000);
+  // We poll in slices, so that we notice within a slice if the test has been
+  // cancelled by another thread (see Client::cancel()).
+  constexpr int slice_msec = 250;
+  auto err = internal::Err::none;
+  for (int remaining = (int)timeout * 1000;; remaining -= slice_msec) {
+    if (client->is_cancelled()) {
+      return internal::Err::cancelled;
+    }
+    err = client->netx_poll(&pfds, (remaining < slice_msec) ? remaining : slice_msec);
+    if (err != internal::Err::timed_out || remaining <= slice_msec) {
+      break;
+    }
+  }
   // Either it's success and something happened or we failed and nothing
   // must have happened on the socket. We previously checked whether we had
   // `expected_events` set however the flags actually set by poll are
@@ -3787,11 +7648,51 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd, Timeou
 }
 
 internal::Err Client::netx_wait_readable(internal::Socket fd, Timeout timeout) const noexcept {
-  return netx_wait(this, fd, timeout, POLLIN);
+  auto begin = std::chrono::steady_clock::now();
+  auto err = netx_wait(this, fd, timeout, POLLIN);
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_wait_readable_usec, usec);
+  LIBNDT_TRACE(wait_readable, fd, usec);
+  return err;
 }
 
 internal::Err Client::netx_wait_writeable(internal::Socket fd, Timeout timeout) const noexcept {
-  return netx_wait(this, fd, timeout, POLLOUT);
+  auto begin = std::chrono::steady_clock::now();
+  auto err = netx_wait(this, fd, timeout, POLLOUT);
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_wait_writeable_usec, usec);
+  LIBNDT_TRACE(wait_writeable, fd, usec);
+  return err;
+}
+
+bool Client::netx_has_pending_data(internal::Socket fd) const noexcept {
+  auto conn = connection(fd);
+  if (conn == nullptr) {
+    return false;
+  }
+  if (conn->ws.begin < conn->ws.end) {
+    return true;
+  }
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0 &&
+      conn->ssl != nullptr) {
+    return ::SSL_pending(conn->ssl) > 0;
+  }
+  return false;
+}
+
+void Client::netx_start_bulk_recv(internal::Socket fd) const noexcept {
+  if (!settings_.io_uring) {
+    return;
+  }
+  // With kTLS, OpenSSL reads from the socket directly, so the data received
+  // by io_uring would never reach it and the download would stall.
+  if (settings_.tls_ktls && netx_ktls(fd)) {
+    LIBNDT_EMIT_DEBUG("netx_start_bulk_recv: cannot use io_uring with kTLS");
+    return;
+  }
+  if (!sys->StartBulkRecv(fd)) {
+    LIBNDT_EMIT_DEBUG("netx_start_bulk_recv: cannot use io_uring; using recv");
+  }
 }
 
 internal::Err Client::netx_poll(
@@ -3808,14 +7709,18 @@ internal::Err Client::netx_poll(
 again:
 #endif
   // Different operating systems have different representations of size_t
-  // and of nfds_t. Overcome these differences by choosing a smaller
-  // representation of the fdset size and letting the compiler promote
-  // it to the correct integer. We don't need many fds in any case.
-  if (pfds->size() > UINT8_MAX) {
+  // and of the fdset size, hence make sure that the conversion is safe.
+#ifdef _WIN32
+  using Nfds = ULONG;
+#else
+  using Nfds = nfds_t;
+#endif
+  if (pfds->size() > (std::numeric_limits<Nfds>::max)()) {
     LIBNDT_EMIT_WARNING("netx_poll: avoiding overflow");
     return internal::Err::value_too_large;
   }
-  rv = sys->Poll(pfds->data(), (uint8_t)pfds->size(), timeout_msec);
+  atomic_counters.Add(counter_poll_calls);
+  rv = sys->Poll(pfds->data(), (Nfds)pfds->size(), timeout_msec);
   // TODO(bassosimone): handle the case where POLLNVAL is returned.
 #ifdef _WIN32
   if (rv == SOCKET_ERROR) {
@@ -3831,15 +7736,20 @@ again:
     return err;
   }
 #endif
-  return (rv == 0) ? internal::Err::timed_out : internal::Err::none;
+  if (rv == 0) {
+    return internal::Err::timed_out;
+  }
+  atomic_counters.Add(counter_poll_wakeups);
+  return internal::Err::none;
 }
 
 internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
   if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     auto err = ssl_retry_unary_op(  //
         "SSL_shutdown", this, ssl, fd, settings_.timeout,
         [](SSL *ssl) -> int {
@@ -3857,12 +7767,28 @@ internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
 }
 
 internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
+  auto conn = connections_.Remove(fd);
+  if (conn && conn->ws.data) {
+    auto &stats = conn->ws.stats;
+    LIBNDT_EMIT_DEBUG("netx_closesocket: ws: received " << stats.frames
+                      << " frames using " << stats.recv_calls
+                      << " recv calls");
+  }
   if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
+    if (!conn || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    ::SSL_free(fd_to_ssl_.at(fd));
-    fd_to_ssl_.erase(fd);
+    auto ssl = conn->ssl;
+    // We send close_notify without waiting for the peer's one. Besides being
+    // polite, this is what tells OpenSSL that the session is still good for
+    // resumption: SSL_free() marks sessions of connections that haven't been
+    // shut down as not resumable (see SSL_shutdown(3) and SslCache).
+    if (::SSL_is_init_finished(ssl)) {
+      ERR_clear_error();
+      (void)::SSL_shutdown(ssl);
+      ERR_clear_error();
+    }
+    ::SSL_free(ssl);
   }
   if (sys->Closesocket(fd) != 0) {
     return netx_map_errno(sys->GetLastError());
@@ -3873,45 +7799,178 @@ internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
 // Curl helpers
 // ````````````
 
-class CurlxLoggerAdapter : public internal::Logger {
- public:
-  explicit CurlxLoggerAdapter(Client *client) noexcept : client_{client} {}
-
-  bool is_warning_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_warning;
+bool Client::query_mlabns_curl(const std::string &url, long timeout,
+                               std::string *body) noexcept {
+  CurlxLoggerAdapter adapter{this};
+  internal::Curlx curlx{adapter};
+  curlx.SetCancelled([this]() { return is_cancelled(); });
+  // Only use the handles of the cache when caching, such that lookups with
+  // the cache disabled are independent of the other clients.
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache) {
+    return mlabns_cache->Fetch(curlx, settings_.socks5h_port, url, timeout, body);
   }
+  return curlx.GetMaybeSOCKS5(settings_.socks5h_port, url, timeout, body);
+}
 
-  bool is_info_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_info;
-  }
+// Counters helpers
+// ````````````````
 
-  bool is_debug_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_debug;
-  }
+Counters Client::counters() const noexcept {
+  Counters counters;
+  counters.recv_calls = atomic_counters.Get(counter_recv_calls);
+  counters.send_calls = atomic_counters.Get(counter_send_calls);
+  counters.poll_calls = atomic_counters.Get(counter_poll_calls);
+  counters.connect_calls = atomic_counters.Get(counter_connect_calls);
+  counters.syscalls = counters.recv_calls + counters.send_calls +
+                      counters.poll_calls + counters.connect_calls;
+  counters.poll_wakeups = atomic_counters.Get(counter_poll_wakeups);
+  counters.ssl_read_calls = atomic_counters.Get(counter_ssl_read_calls);
+  counters.ssl_write_calls = atomic_counters.Get(counter_ssl_write_calls);
+  counters.ssl_want_read = atomic_counters.Get(counter_ssl_want_read);
+  counters.ssl_want_write = atomic_counters.Get(counter_ssl_want_write);
+  counters.wait_readable_usec = atomic_counters.Get(counter_wait_readable_usec);
+  counters.wait_writeable_usec =
+      atomic_counters.Get(counter_wait_writeable_usec);
+  counters.connects = atomic_counters.Get(counter_connects);
+  counters.connect_usec = atomic_counters.Get(counter_connect_usec);
+  counters.tls_handshakes = atomic_counters.Get(counter_tls_handshakes);
+  counters.tls_handshake_usec = atomic_counters.Get(counter_tls_handshake_usec);
+  counters.ws_handshakes = atomic_counters.Get(counter_ws_handshakes);
+  counters.ws_handshake_usec = atomic_counters.Get(counter_ws_handshake_usec);
+  for (size_t i = 0; i < Counters::frame_size_buckets; ++i) {
+    counters.recv_frame_sizes[i] =
+        atomic_counters.Get(counter_recv_frame_sizes + i);
+    counters.send_frame_sizes[i] =
+        atomic_counters.Get(counter_send_frame_sizes + i);
+  }
+  return counters;
+}
 
-  void emit_warning(const std::string &s) const noexcept override {
-		client_->on_warning(s);
+void Client::count_frame(CounterIndex base,
+                         internal::Size size) const noexcept {
+  atomic_counters.Add(
+      base + internal::Log2Bucket(size, Counters::frame_size_buckets));
+}
+
+void Client::trace(TraceEventType type, internal::Socket sock,
+                   int64_t value) const noexcept {
+  TraceEvent event;
+  event.type = type;
+  event.sock = sock;
+  event.value = value;
+  on_trace(event);
+}
+
+// Sampling helpers
+// ````````````````
+
+const SampleBuffer &Client::samples() const noexcept { return samples_; }
+
+void Client::sample_begin(NettestFlags tid, size_t nflows) noexcept {
+  sample_.tid = tid;
+  sample_.elapsed = 0.0;
+  sample_.bytes = 0;
+  sample_.bytes_delta = 0;
+  sample_.flows.assign(nflows, SampleFlow{});
+  sample_next_ = settings_.sample_interval;
+  if (samples_.capacity() != settings_.sample_buffer_size) {
+    samples_ = SampleBuffer{settings_.sample_buffer_size};
   }
+}
 
-  void emit_info(const std::string &s) const noexcept override {
-		client_->on_info(s);
+bool Client::sample_due(double elapsed) const noexcept {
+  return settings_.sample_interval > 0.0 && elapsed >= sample_next_;
+}
+
+void Client::sample_flow(size_t index, internal::Socket sock,
+                         uint64_t bytes) noexcept {
+  if (index >= sample_.flows.size()) {
+    return;
+  }
+  SampleFlow &flow = sample_.flows[index];
+  flow.bytes = bytes;
+  flow.tcp_info = SampleTcpInfo{};
+#ifdef __linux__
+  struct tcp_info tcpinfo{};
+  socklen_t tcpinfolen = sizeof(tcpinfo);
+  if (sys->Getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
+                      &tcpinfolen) == 0) {
+    flow.tcp_info.valid = true;
+    flow.tcp_info.rtt = tcpinfo.tcpi_rtt;
+    flow.tcp_info.rttvar = tcpinfo.tcpi_rttvar;
+    flow.tcp_info.min_rtt = tcpinfo.tcpi_min_rtt;
+    flow.tcp_info.snd_cwnd = tcpinfo.tcpi_snd_cwnd;
+    flow.tcp_info.total_retrans = tcpinfo.tcpi_total_retrans;
+    flow.tcp_info.bytes_acked = tcpinfo.tcpi_bytes_acked;
+    flow.tcp_info.bytes_received = tcpinfo.tcpi_bytes_received;
+    flow.tcp_info.bytes_retrans = tcpinfo.tcpi_bytes_retrans;
+    flow.tcp_info.notsent_bytes = tcpinfo.tcpi_notsent_bytes;
+    flow.tcp_info.delivery_rate = tcpinfo.tcpi_delivery_rate;
   }
+#else
+  (void)sock;
+#endif  // __linux__
+}
 
-  void emit_debug(const std::string &s) const noexcept override {
-		client_->on_debug(s);
+void Client::sample_complete(double elapsed) noexcept {
+  uint64_t total = 0;
+  for (auto &flow : sample_.flows) {
+    total += flow.bytes;
+  }
+  sample_.bytes_delta = (total >= sample_.bytes) ? total - sample_.bytes : 0;
+  sample_.bytes = total;
+  sample_.elapsed = elapsed;
+  // If we're late, e.g. because we were blocked reading a message, skip the
+  // samples we've missed rather than taking them all at once.
+  sample_next_ += settings_.sample_interval;
+  if (sample_next_ <= elapsed) {
+    sample_next_ = elapsed + settings_.sample_interval;
+  }
+  samples_.push(sample_);
+  on_sample(sample_);
+}
+
+double Client::sample_wait(double elapsed) const noexcept {
+  if (settings_.sample_interval <= 0.0) {
+    return std::numeric_limits<double>::max();
   }
+  return std::max(sample_next_ - elapsed, 0.0);
+}
 
-  ~CurlxLoggerAdapter() noexcept override {}
+double Client::get_measurement_interval() const noexcept {
+  constexpr double default_measurement_interval = 0.25;
+  return (settings_.measurement_interval > 0.0) ? settings_.measurement_interval
+                                                : default_measurement_interval;
+}
 
- private:
-  Client *client_;
-};
+std::shared_ptr<const internal::Payload> Client::upload_payload() const noexcept {
+  internal::Size size = settings_.upload_payload_size;
+  if (size < ndt7_upload_bufsiz) {
+    size = ndt7_upload_bufsiz;
+  }
+  if (size < settings_.ndt7_upload_message_size) {
+    size = settings_.ndt7_upload_message_size;
+  }
+  return internal::Payload::Get(size, settings_.upload_payload_huge_pages);
+}
 
-bool Client::query_mlabns_curl(const std::string &url, long timeout,
-                               std::string *body) noexcept {
-  CurlxLoggerAdapter adapter{this};
-  internal::Curlx curlx{adapter};
-  return curlx.GetMaybeSOCKS5(settings_.socks5h_port, url, timeout, body);
+internal::Size Client::ndt7_upload_message_size(
+    const internal::Payload &payload, internal::Size current,
+    internal::Size total) const noexcept {
+  internal::Size max = payload.Length();
+  if (max > ndt7_max_message_size) {
+    max = ndt7_max_message_size;
+  }
+  if (current <= 0) {
+    current = settings_.ndt7_upload_message_size;
+    if (current <= 0) {
+      current = ndt7_upload_bufsiz;
+    }
+  } else if (settings_.ndt7_adaptive_message_size && current < max &&
+             total / 16 >= current) {
+    current *= 2;
+  }
+  return (current < max) ? current : max;
 }
 
 // Other helpers
@@ -3921,6 +7980,139 @@ Verbosity Client::get_verbosity() const noexcept {
   return settings_.verbosity;
 }
 
+bool Client::is_cancelled() const noexcept {
+  return cancelled_ || (parent_cancelled_ != nullptr && *parent_cancelled_);
+}
+
+internal::Size Client::subtest_memory(NettestFlags tid) const noexcept {
+  // For each flow we have a WebSocket receive buffer, a receive buffer or a
+  // send buffer, into which we copy the message we upload, and the socket
+  // buffers. Instead, the upload payload is shared (see upload_payload()).
+  internal::Size flows = 1;
+  if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
+    flows = (settings_.ndt7_nflows > 1) ? settings_.ndt7_nflows : 1;
+  } else if ((tid & nettest_flag_download_ext) != 0) {
+    flows = 3;
+  }
+  internal::Size per_flow = (1 << 16) + (1 << 17);
+  if ((tid & nettest_flag_upload) != 0) {
+    internal::Size message_size = settings_.ndt7_upload_message_size;
+    if (settings_.ndt7_adaptive_message_size) {
+      message_size = settings_.upload_payload_size;
+      if (message_size > ndt7_max_message_size) {
+        message_size = ndt7_max_message_size;
+      }
+    }
+    per_flow += ws_max_header_size + message_size;
+  }
+  if (settings_.socket_send_buffer > 0) {
+    per_flow += (internal::Size)settings_.socket_send_buffer;
+  }
+  if (settings_.socket_recv_buffer > 0) {
+    per_flow += (internal::Size)settings_.socket_recv_buffer;
+  }
+  return flows * per_flow;
+}
+
+bool Client::subtest_acquire(NettestFlags tid) noexcept {
+  if (!admission) {
+    return true;
+  }
+  auto memory = subtest_memory(tid);
+  LIBNDT_EMIT_DEBUG("waiting to run a subtest using " << memory << " bytes");
+  if (!admission->Acquire(memory, cancelled_)) {
+    LIBNDT_EMIT_WARNING("cancelled while waiting to run a subtest");
+    return false;
+  }
+  subtest_memory_ = memory;
+  return true;
+}
+
+void Client::subtest_release() noexcept {
+  if (admission) {
+    admission->Release(subtest_memory_);
+  }
+  subtest_memory_ = 0;
+}
+
+// Runner
+// ``````
+
+Runner::Runner() noexcept : Runner{RunnerSettings{}} {}
+
+Runner::Runner(RunnerSettings settings) noexcept : settings_{settings} {
+  admission_.reset(new internal::Admission{settings_.max_parallel_subtests,
+                                           settings_.max_buffer_memory});
+}
+
+Runner::~Runner() noexcept {}
+
+void Runner::add(std::unique_ptr<Client> client) noexcept {
+  if (!client) {
+    return;
+  }
+  client->ssl_cache = ssl_cache_;
+  client->mlabns_cache = mlabns_cache_;
+  client->admission = admission_;
+  clients_.push_back(std::move(client));
+}
+
+bool Runner::run() noexcept {
+  cancelled_ = false;
+  next_client_ = 0;
+  // We use char rather than bool because each thread writes its own
+  // element and std::vector<bool> packs elements together.
+  std::vector<char> results(clients_.size(), 0);
+  auto main = [this, &results]() noexcept {
+    for (;;) {
+      size_t i = next_client_++;
+      if (i >= clients_.size() || cancelled_) {
+        return;
+      }
+      Client *client = clients_[i].get();
+      if (!client->start()) {
+        continue;
+      }
+      // start() clears the cancellation, so check again: either we see
+      // cancelled_ here or cancel() cancels the client after start().
+      if (cancelled_) {
+        client->cancel();
+      }
+      (void)client->drive();
+      results[i] = client->succeeded();
+    }
+  };
+  size_t nthreads = settings_.max_parallel_clients;
+  if (nthreads <= 0) {
+    nthreads = 1;
+  }
+  if (nthreads > clients_.size()) {
+    nthreads = clients_.size();
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < nthreads; ++i) {
+    threads.emplace_back(main);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return std::all_of(results.begin(), results.end(),
+                     [](char result) { return result != 0; });
+}
+
+void Runner::cancel() noexcept {
+  cancelled_ = true;
+  for (auto &client : clients_) {
+    client->cancel();
+  }
+}
+
+const std::vector<std::unique_ptr<Client>> &Runner::clients() const noexcept {
+  return clients_;
+}
+
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
 }  // namespace libndt
 }  // namespace measurement_kit
 #endif
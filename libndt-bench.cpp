@@ -0,0 +1,786 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "third_party/github.com/nlohmann/json/json.hpp"
+
+#ifdef __linux__
+// Include this before libndt, which includes kernel headers in its namespace.
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libndt/libndt.hpp"  // not standalone
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "third_party/github.com/adishavit/argh/argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+using namespace measurement_kit::libndt;
+
+static void usage() {
+  // clang-format off
+  std::clog << R"(Usage: libndt-bench [options]
+
+Options can start either with a single dash (i.e. -option) or with
+a double dash (i.e. --option).
+
+The `-mask` flag benchmarks the WebSocket masking kernels available
+on this CPU and prints the throughput of each of them in GB/s. The
+`-size <bytes>` flag selects the size of the buffer that is masked
+at every iteration; the default is the ndt7 upload message size. The
+`-duration <seconds>` flag selects for how long to run each kernel;
+the default is one second.
+
+The `-ndt7` and `-ndt5` flags benchmark the client against a server
+running in this process on the loopback interface, using the selected
+protocol. The `-download` and `-upload` flags select the subtests; the
+default is to run both. Since ndt7 uses WebSocket and TLS, these flags
+only apply to ndt5: `-websocket` wraps the data into WebSocket frames
+and `-tls` uses TLS. The `-size <bytes>` flag selects the size of the
+messages the server sends and, with ndt7, of the messages the client
+uploads; the default is 65536. The `-duration <seconds>` flag selects
+for how long to run each subtest. For each subtest, we print the speed
+in MB/s, the CPU cost for the client, the client I/O system calls for
+each WebSocket frame, and the client allocations per second.
+The CPU cost is in cycles per byte when we can read the CPU cycles
+counter and in CPU nanoseconds per byte otherwise. The client runs in
+the main thread, which is the only one whose allocations we count.)" << std::endl;
+  // clang-format on
+}
+
+// bench_mask runs each masking kernel over a @p size bytes buffer for
+// @p duration seconds and prints the throughput of each kernel.
+static void bench_mask(internal::Size size, double duration) {
+  // Misalign the buffer by one byte, since that's what we have in practice
+  // when masking a payload right after the frame header.
+  std::vector<uint8_t> buffer(size + 1, 0x55);
+  uint8_t *base = buffer.data() + 1;
+  const uint8_t mask[] = {0x12, 0x34, 0x56, 0x78};
+  std::cout << std::setw(12) << std::left << "kernel" << std::setw(12)
+            << std::right << "GB/s" << std::endl;
+  for (auto &impl : internal::WsMaskImpls()) {
+    auto begin = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    uint64_t total = 0;
+    do {
+      for (int i = 0; i < 64; ++i) {
+        impl.func(base, size, mask);
+      }
+      total += 64 * size;
+      elapsed = std::chrono::steady_clock::now() - begin;
+    } while (elapsed.count() < duration);
+    // Make sure the compiler cannot optimize the loop away.
+    volatile uint8_t sink = base[size / 2];
+    (void)sink;
+    std::cout << std::setw(12) << std::left << impl.name << std::setw(12)
+              << std::right << std::fixed << std::setprecision(3)
+              << (double)total / elapsed.count() / 1e09 << std::endl;
+  }
+}
+
+// Allocations
+// ```````````
+//
+// We count the allocations made by the thread running the client, both with
+// operator new and by OpenSSL, while count_allocations is true.
+
+static std::atomic<uint64_t> allocations{0};
+static thread_local bool count_allocations = false;
+
+void *operator new(size_t size) {
+  if (count_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void *p = malloc(size > 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+static void *counting_malloc(size_t size, const char *, int) {
+  if (count_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return malloc(size);
+}
+
+static void *counting_realloc(void *p, size_t size, const char *, int) {
+  if (count_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return realloc(p, size);
+}
+
+static void counting_free(void *p, const char *, int) { free(p); }
+
+#ifndef _WIN32
+
+// CPU usage
+// `````````
+
+// CpuCounter measures the CPU used by the calling thread, in cycles if the
+// kernel allows us to read the cycles counter and in nanoseconds otherwise.
+class CpuCounter {
+ public:
+  CpuCounter() noexcept;
+  ~CpuCounter() noexcept;
+  bool Cycles() const noexcept;
+  uint64_t Read() const noexcept;
+
+ private:
+  int fd_ = -1;
+};
+
+CpuCounter::CpuCounter() noexcept {
+#ifdef __linux__
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  // Try first to include the kernel, where we spend most of the time when
+  // doing I/O, and then settle for userspace only.
+  for (int exclude_kernel = 0; exclude_kernel <= 1 && fd_ < 0; ++exclude_kernel) {
+    attr.exclude_kernel = (uint64_t)exclude_kernel & 1;
+    fd_ = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+}
+
+CpuCounter::~CpuCounter() noexcept {
+  if (fd_ >= 0) {
+    (void)close(fd_);
+  }
+}
+
+bool CpuCounter::Cycles() const noexcept { return fd_ >= 0; }
+
+uint64_t CpuCounter::Read() const noexcept {
+  if (fd_ >= 0) {
+    uint64_t value = 0;
+    if (read(fd_, &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+      return value;
+    }
+  }
+  timespec ts{};
+  (void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Loopback server
+// ```````````````
+
+// ServerConfig tells the loopback server what to do with the connections
+// it accepts: whether to use TLS and WebSocket, and whether to send messages
+// of `message_size` bytes for `duration` seconds or to receive.
+struct ServerConfig {
+  bool tls = false;
+  bool websocket = false;
+  bool download = true;
+  size_t message_size = 65536;
+  double duration = 1.0;
+};
+
+// FrameCounter counts the masked WebSocket frames that the client sends.
+class FrameCounter {
+ public:
+  void Feed(const uint8_t *p, size_t n) noexcept;
+  uint64_t frames = 0;
+
+ private:
+  uint8_t header_[14] = {};
+  size_t header_length_ = 0;
+  uint64_t remaining_ = 0;
+};
+
+void FrameCounter::Feed(const uint8_t *p, size_t n) noexcept {
+  while (n > 0) {
+    if (remaining_ > 0) {
+      size_t amount = (size_t)std::min<uint64_t>(remaining_, n);
+      remaining_ -= amount;
+      p += amount;
+      n -= amount;
+      continue;
+    }
+    header_[header_length_++] = *p++;
+    n -= 1;
+    if (header_length_ < 2) {
+      continue;
+    }
+    uint8_t length = header_[1] & 0x7f;
+    size_t length_size = (length == 126) ? 2 : (length == 127) ? 8 : 0;
+    size_t needed = 2 + length_size + (((header_[1] & 0x80) != 0) ? 4 : 0);
+    if (header_length_ < needed) {
+      continue;
+    }
+    remaining_ = length;
+    if (length_size > 0) {
+      remaining_ = 0;
+      for (size_t i = 0; i < length_size; ++i) {
+        remaining_ = (remaining_ << 8) | header_[2 + i];
+      }
+    }
+    header_length_ = 0;
+    frames += 1;
+  }
+}
+
+// LoopbackServer is a minimal server for the ndt7 and ndt5 data connections,
+// listening on an ephemeral port of 127.0.0.1. It handles each connection in
+// a thread and counts the bytes and the frames it transfers.
+class LoopbackServer {
+ public:
+  explicit LoopbackServer(ServerConfig config) noexcept;
+  ~LoopbackServer() noexcept;
+  bool Start() noexcept;
+  std::string Port() const noexcept;
+  void Stop() noexcept;
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> frames{0};
+
+ private:
+  bool setup_tls() noexcept;
+  void serve(int fd) noexcept;
+  ssize_t xrecv(SSL *ssl, int fd, void *base, size_t count) noexcept;
+  bool xsendn(SSL *ssl, int fd, const void *base, size_t count) noexcept;
+
+  ServerConfig config_;
+  int listener_ = -1;
+  uint16_t port_ = 0;
+  SSL_CTX *ctx_ = nullptr;
+  std::atomic<bool> stopping_{false};
+  std::thread acceptor_;
+  std::mutex mutex_;
+  std::vector<std::thread> connections_;  // protected by mutex_
+};
+
+LoopbackServer::LoopbackServer(ServerConfig config) noexcept
+    : config_{config} {}
+
+LoopbackServer::~LoopbackServer() noexcept {
+  Stop();
+  if (ctx_ != nullptr) {
+    SSL_CTX_free(ctx_);
+  }
+}
+
+bool LoopbackServer::Start() noexcept {
+  if (config_.tls && !setup_tls()) {
+    std::clog << "fatal: cannot setup the TLS server" << std::endl;
+    return false;
+  }
+  listener_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener_ < 0) {
+    return false;
+  }
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (bind(listener_, (sockaddr *)&sin, sizeof(sin)) != 0 ||
+      listen(listener_, 16) != 0 ||
+      getsockname(listener_, (sockaddr *)&sin, &len) != 0) {
+    return false;
+  }
+  port_ = ntohs(sin.sin_port);
+  acceptor_ = std::thread{[this]() noexcept {
+    for (;;) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0 || stopping_) {
+        if (fd >= 0) {
+          (void)close(fd);
+        }
+        return;
+      }
+      std::unique_lock<std::mutex> _{mutex_};
+      connections_.emplace_back([this, fd]() noexcept { serve(fd); });
+    }
+  }};
+  return true;
+}
+
+std::string LoopbackServer::Port() const noexcept {
+  return std::to_string((unsigned)port_);
+}
+
+void LoopbackServer::Stop() noexcept {
+  if (listener_ < 0) {
+    return;
+  }
+  stopping_ = true;
+  // Shutting down the listening socket wakes up accept() on Linux, while
+  // on other systems we need to connect to wake it up.
+  (void)shutdown(listener_, SHUT_RDWR);
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port_);
+    (void)connect(fd, (sockaddr *)&sin, sizeof(sin));
+    (void)close(fd);
+  }
+  acceptor_.join();
+  (void)close(listener_);
+  listener_ = -1;
+  std::unique_lock<std::mutex> _{mutex_};
+  for (auto &thread : connections_) {
+    thread.join();
+  }
+  connections_.clear();
+}
+
+bool LoopbackServer::setup_tls() noexcept {
+  // We generate a self signed certificate, which the client doesn't verify.
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  if (pctx == nullptr || EVP_PKEY_keygen_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(pctx, &pkey) <= 0) {
+    EVP_PKEY_CTX_free(pctx);
+    return false;
+  }
+  EVP_PKEY_CTX_free(pctx);
+  X509 *cert = X509_new();
+  bool ok = cert != nullptr &&
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) == 1 &&
+            X509_gmtime_adj(X509_getm_notBefore(cert), 0) != nullptr &&
+            X509_gmtime_adj(X509_getm_notAfter(cert), 86400) != nullptr &&
+            X509_set_pubkey(cert, pkey) == 1;
+  if (ok) {
+    X509_NAME *name = X509_get_subject_name(cert);
+    ok = X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                    (const unsigned char *)"127.0.0.1", -1,
+                                    -1, 0) == 1 &&
+         X509_set_issuer_name(cert, name) == 1 &&
+         X509_sign(cert, pkey, EVP_sha256()) > 0;
+  }
+  if (ok) {
+    ctx_ = SSL_CTX_new(TLS_server_method());
+    ok = ctx_ != nullptr && SSL_CTX_use_certificate(ctx_, cert) == 1 &&
+         SSL_CTX_use_PrivateKey(ctx_, pkey) == 1;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return ok;
+}
+
+ssize_t LoopbackServer::xrecv(SSL *ssl, int fd, void *base,
+                              size_t count) noexcept {
+  if (ssl != nullptr) {
+    return SSL_read(ssl, base, (int)std::min<size_t>(count, INT_MAX));
+  }
+  return recv(fd, base, count, 0);
+}
+
+bool LoopbackServer::xsendn(SSL *ssl, int fd, const void *base,
+                            size_t count) noexcept {
+  const uint8_t *p = (const uint8_t *)base;
+  while (count > 0) {
+    ssize_t n = 0;
+    if (ssl != nullptr) {
+      n = SSL_write(ssl, p, (int)std::min<size_t>(count, INT_MAX));
+    } else {
+      n = send(fd, p, count, MSG_NOSIGNAL);
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    count -= (size_t)n;
+  }
+  return true;
+}
+
+void LoopbackServer::serve(int fd) noexcept {
+  SSL *ssl = nullptr;
+  if (config_.tls) {
+    ssl = SSL_new(ctx_);
+    if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+      SSL_free(ssl);
+      (void)close(fd);
+      return;
+    }
+  }
+  std::vector<uint8_t> buffer(1 << 17);
+  bool ok = true;
+  if (config_.websocket) {
+    // Read the upgrade request, which the client sends at once, and reply
+    // with the headers the client expects, echoing the subprotocol.
+    std::string request;
+    while (ok && request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t n = xrecv(ssl, fd, buffer.data(), buffer.size());
+      ok = n > 0;
+      if (ok) {
+        request.append((const char *)buffer.data(), (size_t)n);
+      }
+    }
+    std::string proto;
+    const std::string key = "\r\nSec-WebSocket-Protocol: ";
+    auto pos = request.find(key);
+    if (pos != std::string::npos) {
+      pos += key.size();
+      proto = request.substr(pos, request.find("\r\n", pos) - pos);
+    }
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+                           "Sec-WebSocket-Protocol: " + proto + "\r\n\r\n";
+    ok = ok && xsendn(ssl, fd, response.data(), response.size());
+  }
+  if (ok && config_.download) {
+    // Prepare once a message, which we wrap into a binary frame if needed,
+    // and send it over and over until the duration has elapsed.
+    std::vector<uint8_t> message;
+    if (config_.websocket) {
+      uint64_t length = config_.message_size;
+      message.push_back(0x82);  // FIN + binary
+      message.push_back(127);
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        message.push_back((uint8_t)(length >> shift));
+      }
+    }
+    message.resize(message.size() + config_.message_size, 'x');
+    auto begin = std::chrono::steady_clock::now();
+    for (;;) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      if (elapsed.count() > config_.duration || stopping_) {
+        break;
+      }
+      if (!xsendn(ssl, fd, message.data(), message.size())) {
+        ok = false;
+        break;
+      }
+      bytes.fetch_add(config_.message_size, std::memory_order_relaxed);
+      if (config_.websocket) {
+        frames.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    if (ok && config_.websocket) {
+      const uint8_t close_frame[] = {0x88, 0x00};  // FIN + CLOSE
+      (void)xsendn(ssl, fd, close_frame, sizeof(close_frame));
+    }
+  } else if (ok) {
+    FrameCounter counter;
+    for (;;) {
+      ssize_t n = xrecv(ssl, fd, buffer.data(), buffer.size());
+      if (n <= 0) {
+        break;
+      }
+      bytes.fetch_add((uint64_t)n, std::memory_order_relaxed);
+      if (config_.websocket) {
+        counter.Feed(buffer.data(), (size_t)n);
+      }
+    }
+    frames.fetch_add(counter.frames, std::memory_order_relaxed);
+  }
+  if (ssl != nullptr) {
+    (void)SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+  (void)shutdown(fd, SHUT_RDWR);
+  (void)close(fd);
+}
+
+// Benchmarks
+// ``````````
+
+// BenchClient is a quiet client.
+class BenchClient : public Client {
+ public:
+  using Client::Client;
+  void on_performance(NettestFlags, uint8_t, double, double,
+                      double) noexcept override {}
+  void on_result(std::string, std::string, std::string) noexcept override {}
+};
+
+// bench_run_client runs a subtest of @p client, as selected by @p protocol
+// and @p download, against @p server. The server ends downloads after the
+// duration, while we cancel the client to end uploads after @p duration
+// seconds, and downloads if they take much longer than that.
+static bool bench_run_client(BenchClient &client, const std::string &protocol,
+                             bool download, const LoopbackServer &server,
+                             double duration) {
+  double deadline = download ? duration + 2.0 : duration;
+  std::thread timer{[&client, deadline]() {
+    // Sleep in small slices so that we notice when the client is done.
+    auto begin = std::chrono::steady_clock::now();
+    for (;;) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      if (elapsed.count() >= deadline || client.is_cancelled()) {
+        client.cancel();
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }};
+  bool ok = false;
+  if (protocol == "ndt7") {
+    // The ndt7 upload fails when cancelled, which is how we stop it.
+    ok = download ? client.ndt7_download()
+                  : (client.ndt7_upload() || client.is_cancelled());
+  } else {
+    SocketVector socks{&client};
+    internal::Socket sock = (internal::Socket)-1;
+    auto err = client.netx_maybews_dial(
+        "127.0.0.1", server.Port(),
+        ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept |
+            ws_f_sec_ws_protocol,
+        download ? ws_proto_s2c : ws_proto_c2s, "/ndt_protocol", &sock);
+    if (err == internal::Err::none) {
+      socks.sockets.push_back(sock);
+      double total = 0.0;
+      double elapsed = 0.0;
+      client.run_flows(download ? nettest_flag_download : nettest_flag_upload,
+                       socks, &total, &elapsed);
+      ok = total > 0.0;
+    }
+  }
+  client.cancel();  // also tells the timer we're done
+  timer.join();
+  return ok;
+}
+
+// bench_subtest benchmarks a subtest and prints the results.
+static bool bench_subtest(const std::string &protocol, bool download,
+                          bool websocket, bool tls, size_t message_size,
+                          double duration) {
+  ServerConfig config;
+  config.tls = tls;
+  config.websocket = websocket;
+  config.download = download;
+  config.message_size = message_size;
+  config.duration = duration;
+  LoopbackServer server{config};
+  if (!server.Start()) {
+    std::clog << "fatal: cannot start the loopback server" << std::endl;
+    return false;
+  }
+  Settings settings;
+  settings.hostname = "127.0.0.1";
+  settings.port = server.Port();
+  settings.tls_verify_peer = false;
+  settings.summary_only = true;
+  settings.verbosity = verbosity_quiet;
+  settings.max_runtime = (Timeout)duration + 2;
+  if (protocol == "ndt7") {
+    settings.protocol_flags = protocol_flag_ndt7;
+    settings.ndt7_upload_message_size = message_size;
+  } else {
+    if (websocket) {
+      settings.protocol_flags |= protocol_flag_websocket;
+    }
+    if (tls) {
+      settings.protocol_flags |= protocol_flag_tls;
+    }
+  }
+  CpuCounter cpu;
+  bool ok = false;
+  uint64_t cpu_used = 0;
+  uint64_t allocs = 0;
+  uint64_t syscalls = 0;
+  std::chrono::duration<double> elapsed{};
+  {
+    BenchClient client{settings};
+    // Make sure the payload exists before we start measuring.
+    (void)client.upload_payload();
+    allocations = 0;
+    auto cpu_begin = cpu.Read();
+    auto begin = std::chrono::steady_clock::now();
+    count_allocations = true;
+    ok = bench_run_client(client, protocol, download, server, duration);
+    count_allocations = false;
+    elapsed = std::chrono::steady_clock::now() - begin;
+    cpu_used = cpu.Read() - cpu_begin;
+    allocs = allocations;
+    syscalls = client.counters().syscalls;
+  }  // The client closes its sockets, so the server can stop
+  server.Stop();
+  std::string name = protocol + (download ? "-download" : "-upload");
+  if (protocol == "ndt5") {
+    name += websocket ? "-ws" : "";
+    name += tls ? "-tls" : "";
+  }
+  uint64_t bytes = server.bytes;
+  uint64_t frames = server.frames;
+  std::cout << std::setw(22) << std::left << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << (double)bytes / elapsed.count() / 1e06 << std::setprecision(3)
+            << std::setw(12)
+            << ((bytes > 0) ? (double)cpu_used / (double)bytes : 0.0);
+  if (frames > 0) {
+    std::cout << std::setw(16) << (double)syscalls / (double)frames;
+  } else {
+    std::cout << std::setw(16) << "-";
+  }
+  std::cout << std::setprecision(1) << std::setw(12)
+            << (double)allocs / elapsed.count() << std::endl;
+  if (!ok) {
+    std::clog << "warning: " << name << ": the client failed" << std::endl;
+  }
+  return bytes > 0;
+}
+
+// bench_loopback runs the selected benchmarks against the loopback server.
+static bool bench_loopback(bool ndt7, bool ndt5, bool download, bool upload,
+                           bool websocket, bool tls, size_t message_size,
+                           double duration) {
+  // A closed connection must not kill the server that writes into it.
+  (void)signal(SIGPIPE, SIG_IGN);
+  CpuCounter cpu;
+  std::cout << std::setw(22) << std::left << "subtest" << std::right
+            << std::setw(12) << "MB/s" << std::setw(12)
+            << (cpu.Cycles() ? "cycles/B" : "cpu-ns/B") << std::setw(16)
+            << "syscalls/frame" << std::setw(12) << "allocs/s" << std::endl;
+  bool ok = true;
+  for (auto &protocol : {"ndt7", "ndt5"}) {
+    if ((std::string{protocol} == "ndt7") ? !ndt7 : !ndt5) {
+      continue;
+    }
+    bool ws = ndt7 && std::string{protocol} == "ndt7" ? true : websocket;
+    bool secure = std::string{protocol} == "ndt7" ? true : tls;
+    if (download) {
+      ok = bench_subtest(protocol, true, ws, secure, message_size, duration) && ok;
+    }
+    if (upload) {
+      ok = bench_subtest(protocol, false, ws, secure, message_size, duration) && ok;
+    }
+  }
+  return ok;
+}
+
+#endif  // !_WIN32
+
+int main(int, char **argv) {
+  // This must happen before OpenSSL allocates memory.
+  (void)CRYPTO_set_mem_functions(counting_malloc, counting_realloc,
+                                 counting_free);
+  internal::Size size = 1 << 13;
+  bool size_set = false;
+  double duration = 1.0;
+  bool mask = false;
+  bool ndt7 = false;
+  bool ndt5 = false;
+  bool download = false;
+  bool upload = false;
+  bool websocket = false;
+  bool tls = false;
+
+  {
+    argh::parser cmdline;
+    cmdline.add_param("duration");
+    cmdline.add_param("size");
+    cmdline.parse(argv);
+    for (auto &flag : cmdline.flags()) {
+      if (flag == "download") {
+        download = true;
+      } else if (flag == "help") {
+        usage();
+        exit(EXIT_SUCCESS);
+      } else if (flag == "mask") {
+        mask = true;
+      } else if (flag == "ndt5") {
+        ndt5 = true;
+      } else if (flag == "ndt7") {
+        ndt7 = true;
+      } else if (flag == "tls") {
+        tls = true;
+      } else if (flag == "upload") {
+        upload = true;
+      } else if (flag == "websocket") {
+        websocket = true;
+      } else {
+        std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (auto &param : cmdline.params()) {
+      if (param.first == "duration") {
+        duration = atof(param.second.c_str());
+        if (duration <= 0.0) {
+          std::clog << "fatal: invalid duration: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      } else if (param.first == "size") {
+        long long value = atoll(param.second.c_str());
+        if (value <= 0) {
+          std::clog << "fatal: invalid size: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        size = (internal::Size)value;
+        size_set = true;
+      } else {
+        std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (!mask && !ndt7 && !ndt5) {
+    std::clog << "fatal: you must select at least one benchmark" << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  if (mask) {
+    bench_mask(size, duration);
+  }
+  if (ndt7 || ndt5) {
+#ifndef _WIN32
+    if (!download && !upload) {
+      download = upload = true;
+    }
+    size_t message_size = size_set ? (size_t)size : 65536;
+    if (!bench_loopback(ndt7, ndt5, download, upload, websocket, tls,
+                        message_size, duration)) {
+      exit(EXIT_FAILURE);
+    }
+#else
+    std::clog << "fatal: the loopback benchmarks need a Unix system"
+              << std::endl;
+    exit(EXIT_FAILURE);
+#endif
+  }
+  return EXIT_SUCCESS;
+}
@@ -6,6 +6,7 @@
 
 #include "libndt/libndt.hpp"  // not standalone
 
+#include <fcntl.h>
 #include <stdlib.h>
 
 #include <iostream>
@@ -50,6 +51,17 @@ void BatchClient::on_performance(libndt::NettestFlags tid, uint8_t nflows,
   std::cout << performance.dump() << std::endl;
 }
 
+// Converts the round trip times in @p latency to JSON.
+static nlohmann::json latency_json(
+    const libndt::internal::LatencySummary &latency) {
+  nlohmann::json json;
+  json["Count"] = latency.count;
+  json["P50"] = latency.p50;
+  json["P90"] = latency.p90;
+  json["P99"] = latency.p99;
+  return json;
+}
+
 // summary is overridden to print a JSON summary.
 void BatchClient::summary() noexcept {
   nlohmann::json summary;
@@ -68,6 +80,13 @@ void BatchClient::summary() noexcept {
       download["LastMeasurement"] = measurement_;
     }
 
+    if (download_flows_.size() > 1) {
+      download["Flows"] = download_flows_;
+    }
+
+    if (summary_.download_latency.count != 0) {
+      download["LoadedLatency"] = latency_json(summary_.download_latency);
+    }
     summary["Download"] = download;
     summary["Latency"] = summary_.min_rtt;
   }
@@ -76,6 +95,12 @@ void BatchClient::summary() noexcept {
     nlohmann::json upload;
     upload["Speed"] = summary_.upload_speed;
     upload["Retransmission"] = summary_.upload_retrans;
+    if (upload_flows_.size() > 1) {
+      upload["Flows"] = upload_flows_;
+    }
+    if (summary_.upload_latency.count != 0) {
+      upload["LoadedLatency"] = latency_json(summary_.upload_latency);
+    }
     summary["Upload"] = upload;
   }
 
@@ -114,7 +139,8 @@ the `-tls` flag causes NDT to use a TLS connection rather than a TCP
 connection. When using `-tls`, you may also want to use `-insecure` to
 allow connecting to servers with self-signed or otherwise invalid TLS
 certificate. With `-tls`, you can also use the `-ca-bundle-path <path>`
-to use a specific CA bundle path. Adding the `-websocket` flag will
+to use a specific CA bundle path. On Linux, `-ktls` asks the kernel to
+do the TLS encryption, if possible. Adding the `-websocket` flag will
 cause NDT to wrap its messages (possibly already wrapped by JSON) into
 WebSocket messages. Finally, adding the `-ndt7` flag turns on version
 7 of the NDT protocol, which is not backwards compatible. Since `-ndt7`
@@ -123,7 +149,26 @@ in combination with the `-ndt7` flag. When using `-ndt7`, `-batch` can be
 specified so that the only output on STDOUT will be the JSON test results.
 To further reduce the amount of output, you can use the `-summary` flag,
 which only prints a summary at the end of the tests. If used with `-batch`,
-the generated summary will be JSON.
+the generated summary will be JSON. With `-ndt7`, the `-ndt7-flows <n>`
+flag runs the download and upload subtests using `n` parallel connections
+rather than a single one; this is not mandated by the ndt7 specification
+but may be needed to saturate paths with a large bandwidth-delay product.
+Also with `-ndt7`, the `-convergence <percent>` flag stops the download
+as soon as the measured speed has stabilized within `percent` percent,
+rather than running the download for its whole duration. When a
+host returned by mlab-ns fails, we try the next one, and `-preconnect`
+connects to the next one in advance, such that a failure costs less.
+Still with `-ndt7`, the `-latency-interval <msec>` flag measures the
+round trip time every `msec` milliseconds during the download and upload
+subtests, using WebSocket PING frames, and reports the percentiles of
+these round trip times, which show the latency under load.
+
+With `-ndt7`, the `-results-file <path>` flag appends all the measurements
+to `path` as JSON lines, i.e., one JSON object per line, which a background
+thread writes, such that writing does not slow down the test. Use `-` as
+`path` to write onto the standard output. The `-results-ring <path>` flag
+instead writes the measurements into a memory mapped file of fixed size
+used as a ring buffer, which always contains the latest measurements.
 
 In practice, these are the flags you want to use:
 
@@ -153,12 +198,19 @@ int main(int, char **argv) {
   settings.nettest_flags = libndt::NettestFlags{0};
   bool batch_mode = false;
   bool summary = false;
+  std::shared_ptr<libndt::JsonLinesSink> results_file;
+  std::shared_ptr<libndt::RingFileSink> results_ring;
 
   {
     argh::parser cmdline;
     cmdline.add_param("ca-bundle-path");
+    cmdline.add_param("convergence");
+    cmdline.add_param("latency-interval");
     cmdline.add_param("lookup-policy");
+    cmdline.add_param("ndt7-flows");
     cmdline.add_param("port");
+    cmdline.add_param("results-file");
+    cmdline.add_param("results-ring");
     cmdline.add_param("socks5h");
     cmdline.parse(argv);
     for (auto &flag : cmdline.flags()) {
@@ -177,9 +229,16 @@ int main(int, char **argv) {
       } else if (flag == "json") {
         settings.protocol_flags |= libndt::protocol_flag_json;
         std::clog << "will use the JSON-based NDT protocol" << std::endl;
+      } else if (flag == "ktls") {
+        settings.tls_ktls = true;
+        std::clog << "will use kernel TLS, if possible" << std::endl;
       } else if (flag == "ndt7") {
         settings.protocol_flags |= libndt::protocol_flag_ndt7;
         std::clog << "will use the ndt7 protocol" << std::endl;
+      } else if (flag == "preconnect") {
+        settings.ndt7_preconnect = true;
+        std::clog << "will connect to the next ndt7 server in advance"
+                  << std::endl;
       } else if (flag == "random") {
         std::clog << "WARNING: the `-random` flag is deprecated" << std::endl;
         std::clog << "HINT: replace with `-lookup-policy random`" << std::endl;
@@ -230,9 +289,72 @@ int main(int, char **argv) {
           usage();
           exit(EXIT_FAILURE);
         }
+      } else if (param.first == "convergence") {
+        const char *errstr = nullptr;
+        libndt::internal::Sys sys;
+        auto percent = sys.Strtonum(param.second.c_str(), 1, 100, &errstr);
+        if (errstr != nullptr) {
+          std::clog << "fatal: invalid -convergence: " << param.second
+                    << std::endl << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        settings.convergence_tolerance = (double)percent / 100.0;
+        std::clog << "will stop the download when the speed converges within "
+                  << param.second << "%" << std::endl;
+      } else if (param.first == "latency-interval") {
+        const char *errstr = nullptr;
+        libndt::internal::Sys sys;
+        auto msec = sys.Strtonum(param.second.c_str(), 1, 60000, &errstr);
+        if (errstr != nullptr) {
+          std::clog << "fatal: invalid -latency-interval: " << param.second
+                    << std::endl << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        settings.ndt7_latency_interval = (double)msec / 1000.0;
+        std::clog << "will measure the round trip time every " << param.second
+                  << " ms" << std::endl;
+      } else if (param.first == "ndt7-flows") {
+        const char *errstr = nullptr;
+        libndt::internal::Sys sys;
+        settings.ndt7_nflows = (uint8_t)sys.Strtonum(param.second.c_str(), 1,
+                                                     UINT8_MAX, &errstr);
+        if (errstr != nullptr) {
+          std::clog << "fatal: invalid -ndt7-flows: " << param.second
+                    << std::endl << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        std::clog << "will use " << param.second << " ndt7 flows" << std::endl;
       } else if (param.first == "port") {
         settings.port = param.second;
         std::clog << "will use this port: " << param.second << std::endl;
+      } else if (param.first == "results-file") {
+        int fd = 1;  // stdout
+        if (param.second != "-") {
+          fd = ::open(param.second.c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                      0644);
+          if (fd == -1) {
+            std::clog << "fatal: cannot open -results-file: " << param.second
+                      << std::endl;
+            exit(EXIT_FAILURE);
+          }
+        }
+        results_file.reset(new libndt::JsonLinesSink{fd, fd != 1});
+        settings.results_sink = results_file;
+        std::clog << "will write the results to: " << param.second
+                  << std::endl;
+      } else if (param.first == "results-ring") {
+        results_ring.reset(new libndt::RingFileSink);
+        if (!results_ring->open(param.second)) {
+          std::clog << "fatal: cannot open -results-ring: " << param.second
+                    << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.results_sink = results_ring;
+        std::clog << "will write the results to the ring file: "
+                  << param.second << std::endl;
       } else if (param.first == "socks5h") {
         settings.socks5h_port = param.second;
         std::clog << "will use the socks5h proxy at: 127.0.0.1:" << param.second << std::endl;
@@ -272,5 +394,14 @@ int main(int, char **argv) {
   if (rv ) {
     client->summary();
   }
+  if (results_file != nullptr) {
+    if (!results_file->flush()) {
+      std::clog << "warning: cannot write the results" << std::endl;
+    }
+    if (results_file->dropped() > 0) {
+      std::clog << "warning: dropped " << results_file->dropped()
+                << " results" << std::endl;
+    }
+  }
   return (rv) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
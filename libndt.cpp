@@ -0,0 +1,15 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// libndt.cpp - compiles the implementation of libndt once, such that the
+// code linking with the libndt library only includes the declarations (see
+// LIBNDT_DECLARATIONS_ONLY in libndt/libndt.hpp).
+
+#ifdef LIBNDT_DECLARATIONS_ONLY
+#error "LIBNDT_DECLARATIONS_ONLY must not be defined when compiling libndt"
+#endif
+
+#include "third_party/github.com/nlohmann/json/json.hpp"
+
+#include "libndt/libndt.hpp"  // not standalone
@@ -20955,6 +20955,11 @@ class Sys {
 
   virtual int Closesocket(Socket fd) const noexcept;
 
+  // StartBulkRecv tells us that we are about to receive a lot of data from
+  // @p fd, such that we can use a more efficient way of receiving, if any.
+  // Returns whether we did. By default, we keep using recv(2).
+  virtual bool StartBulkRecv(Socket fd) const noexcept;
+
 #ifdef _WIN32
   virtual int Poll(LPWSAPOLLFD fds, ULONG nfds, INT timeout) const noexcept;
 #else
@@ -20976,9 +20981,14 @@ class Sys {
       Socket socket, int level, int name, void *value,
       socklen_t *len) const noexcept;
 
+  virtual int Setsockopt(
+      Socket socket, int level, int name, const void *value,
+      socklen_t len) const noexcept;
+
   virtual ~Sys() noexcept;
 };
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 // LIBNDT_HAVE_STRTONUM tells us whether we have strtonum in libc
 #ifndef LIBNDT_HAVE_STRTONUM
 // clang-format off
@@ -21049,11 +21059,13 @@ strtonum(const char *numstr, long long minval, long long maxval,
 #define LIBNDT_AS_OS_BUFFER_LEN(n) ((int)n)
 #define LIBNDT_OS_SSIZE_MAX INT_MAX
 #define LIBNDT_AS_OS_OPTION_VALUE(x) ((char *)x)
+#define LIBNDT_AS_OS_CONST_OPTION_VALUE(x) ((const char *)x)
 #else
 #define LIBNDT_AS_OS_BUFFER(b) ((char *)b)
 #define LIBNDT_AS_OS_BUFFER_LEN(n) ((size_t)n)
 #define LIBNDT_OS_SSIZE_MAX SSIZE_MAX
 #define LIBNDT_AS_OS_OPTION_VALUE(x) ((void *)x)
+#define LIBNDT_AS_OS_CONST_OPTION_VALUE(x) ((const void *)x)
 #endif
 
 int Sys::GetLastError() const noexcept {
@@ -21133,6 +21145,8 @@ int Sys::Closesocket(Socket fd) const noexcept {
 #endif
 }
 
+bool Sys::StartBulkRecv(Socket) const noexcept { return false; }
+
 #ifdef _WIN32
 int Sys::Poll(LPWSAPOLLFD fds, ULONG nfds, INT timeout) const noexcept {
   return ::WSAPoll(fds, nfds, timeout);
@@ -21165,7 +21179,14 @@ int Sys::Getsockopt(Socket socket, int level, int name, void *value,
       socket, level, name, LIBNDT_AS_OS_OPTION_VALUE(value), len);
 }
 
+int Sys::Setsockopt(Socket socket, int level, int name, const void *value,
+                    socklen_t len) const noexcept {
+  return ::setsockopt(
+      socket, level, name, LIBNDT_AS_OS_CONST_OPTION_VALUE(value), len);
+}
+
 Sys::~Sys() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -21224,6 +21245,7 @@ class NoLogger : public Logger {
 #define LIBNDT_LOGGER_DEBUG(logger, statements) \
   LIBNDT_LOGGER_LEVEL_(logger, debug, statements)
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 Logger::~Logger() noexcept {}
 
 bool NoLogger::is_warning_enabled() const noexcept {
@@ -21245,6 +21267,7 @@ void NoLogger::emit_info(const std::string &) const noexcept {}
 void NoLogger::emit_debug(const std::string &) const noexcept {}
 
 NoLogger::~NoLogger() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -21262,6 +21285,7 @@ NoLogger::~NoLogger() noexcept {}
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <sstream>
 
@@ -21286,14 +21310,34 @@ using UniqueCurl = std::unique_ptr<CURL, CurlDeleter>;
 // CurlWriteCb is the signature of the callback used by curl.
 using CurlWriteCb = size_t (*)(char *ptr, size_t size, size_t nmemb, void *userdata);
 
+// CurlProgressCb is the signature of the progress callback used by curl.
+using CurlProgressCb = int (*)(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                               curl_off_t ultotal, curl_off_t ulnow);
+
 // Curlx allows to emulate failures in libcurl code.
 class Curlx {
  public:
   explicit Curlx(const Logger &logger) noexcept;
 
+  // SetCancelled tells Curlx to abort the requests in progress as soon as
+  // @p cancelled returns true. Curl calls it about once per second, and
+  // more frequently while it is transferring data.
+  void SetCancelled(std::function<bool()> cancelled) noexcept;
+
+  // Cancelled returns whether the callback set using SetCancelled() tells
+  // us to abort the request in progress.
+  bool Cancelled() const noexcept;
+
   virtual bool GetMaybeSOCKS5(const std::string &proxy_port, const std::string &url,
                               long timeout, std::string *body) noexcept;
 
+  // GetMaybeSOCKS5 is like the above function except that it uses @p handle,
+  // creating it if it is empty, such that the caller can reuse the handle,
+  // and therefore its live connections and DNS cache, across requests.
+  virtual bool GetMaybeSOCKS5(UniqueCurl &handle, const std::string &proxy_port,
+                              const std::string &url, long timeout,
+                              std::string *body) noexcept;
+
   virtual bool Get(UniqueCurl &handle, const std::string &url, long timeout,
                    std::string *body) noexcept;
 
@@ -21309,8 +21353,15 @@ class Curlx {
 
   virtual CURLcode SetoptFailonerr(UniqueCurl &handle) noexcept;
 
+  // SetoptProgress enables the progress @p callback, which we pass the
+  // @p pointer and can abort the request by returning nonzero.
+  virtual CURLcode SetoptProgress(UniqueCurl &handle, CurlProgressCb callback,
+                                  void *pointer) noexcept;
+
   virtual CURLcode Perform(UniqueCurl &handle) noexcept;
 
+  virtual void Reset(UniqueCurl &handle) noexcept;
+
   virtual UniqueCurl NewUniqueCurl() noexcept;
 
   virtual CURLcode GetinfoResponseCode(UniqueCurl &handle, long *response_code) noexcept;
@@ -21319,8 +21370,10 @@ class Curlx {
 
  private:
   const Logger &logger_;
+  std::function<bool()> cancelled_;
 };
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 }  // namespace internal
 }  // namespace libndt
 }  // namespace measurement_kit
@@ -21350,6 +21403,12 @@ static size_t libndt_curl_callback(char *ptr, size_t size, size_t nmemb, void *u
   return nmemb;
 }
 
+static int libndt_curl_progress(void *clientp, curl_off_t, curl_off_t,
+                                curl_off_t, curl_off_t) {
+  using namespace measurement_kit::libndt::internal;
+  return static_cast<const Curlx *>(clientp)->Cancelled() ? 1 : 0;
+}
+
 }  // extern "C"
 namespace measurement_kit {
 namespace libndt {
@@ -21363,9 +21422,28 @@ void CurlDeleter::operator()(CURL *handle) noexcept {
 
 Curlx::Curlx(const Logger &logger) noexcept : logger_{logger} {}
 
+void Curlx::SetCancelled(std::function<bool()> cancelled) noexcept {
+  cancelled_ = std::move(cancelled);
+}
+
+bool Curlx::Cancelled() const noexcept { return cancelled_ && cancelled_(); }
+
 bool Curlx::GetMaybeSOCKS5(const std::string &proxy_port, const std::string &url,
                            long timeout, std::string *body) noexcept {
-  auto handle = this->NewUniqueCurl();
+  UniqueCurl handle;
+  return this->GetMaybeSOCKS5(handle, proxy_port, url, timeout, body);
+}
+
+bool Curlx::GetMaybeSOCKS5(UniqueCurl &handle, const std::string &proxy_port,
+                           const std::string &url, long timeout,
+                           std::string *body) noexcept {
+  if (handle) {
+    // Forget the options used by the previous request. This does not close
+    // the live connections, which is the point of reusing the handle.
+    this->Reset(handle);
+  } else {
+    handle = this->NewUniqueCurl();
+  }
   if (!handle) {
     LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot initialize cURL");
     return false;
@@ -21408,6 +21486,11 @@ bool Curlx::Get(UniqueCurl &handle, const std::string &url, long timeout,
     LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot set fail-on-error option");
     return false;
   }
+  if (cancelled_ &&
+      this->SetoptProgress(handle, libndt_curl_progress, this) != CURLE_OK) {
+    LIBNDT_LOGGER_WARNING(logger_, "curlx: cannot set progress callback");
+    return false;
+  }
   LIBNDT_LOGGER_DEBUG(logger_, "curlx: performing request");
   auto rv = this->Perform(handle);
   if (rv != CURLE_OK) {
@@ -21462,11 +21545,29 @@ CURLcode Curlx::SetoptFailonerr(UniqueCurl &handle) noexcept {
   return ::curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
 }
 
+CURLcode Curlx::SetoptProgress(UniqueCurl &handle, CurlProgressCb callback,
+                               void *pointer) noexcept {
+  LIBNDT_ASSERT(handle);
+  CURLcode rv = ::curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, callback);
+  if (rv == CURLE_OK) {
+    rv = ::curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, pointer);
+  }
+  if (rv == CURLE_OK) {
+    rv = ::curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+  }
+  return rv;
+}
+
 CURLcode Curlx::Perform(UniqueCurl &handle) noexcept {
   LIBNDT_ASSERT(handle);
   return ::curl_easy_perform(handle.get());
 }
 
+void Curlx::Reset(UniqueCurl &handle) noexcept {
+  LIBNDT_ASSERT(handle);
+  ::curl_easy_reset(handle.get());
+}
+
 UniqueCurl Curlx::NewUniqueCurl() noexcept { return UniqueCurl{::curl_easy_init()}; }
 
 CURLcode Curlx::GetinfoResponseCode(UniqueCurl &handle, long *response_code) noexcept {
@@ -21476,6 +21577,7 @@ CURLcode Curlx::GetinfoResponseCode(UniqueCurl &handle, long *response_code) noe
 }
 
 Curlx::~Curlx() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -21542,11 +21644,13 @@ enum class Err {
   eof,       // We got an unexpected EOF
   socks5h,   // SOCKSv5 protocol error
   ws_proto,  // WebSocket protocol error
+  cancelled, // The test has been cancelled
 };
 
 std::string libndt_perror(Err err) noexcept;
 std::string ssl_format_error() noexcept;
 
+#ifndef LIBNDT_DECLARATIONS_ONLY
 std::string libndt_perror(Err err) noexcept {
   std::string rv;
   //
@@ -21583,6 +21687,7 @@ std::string libndt_perror(Err err) noexcept {
     LIBNDT_PERROR(ssl_want_write);
     LIBNDT_PERROR(ssl_syscall);
     LIBNDT_PERROR(ws_proto);
+    LIBNDT_PERROR(cancelled);
   }
 #undef LIBNDT_PERROR  // Tidy
   //
@@ -21605,6 +21710,7 @@ std::string ssl_format_error() noexcept {
   }
   return ss.str();
 }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
 }  // namespace internal
 }  // namespace libndt
@@ -21613,209 +21719,3175 @@ std::string ssl_format_error() noexcept {
 // Part of Measurement Kit <https://measurement-kit.github.io/>.
 // Measurement Kit is free software under the BSD license. See AUTHORS
 // and LICENSE for more information on the copying conditions.
-#ifndef MEASUREMENT_KIT_LIBNDT_TIMEOUT_HPP
-#define MEASUREMENT_KIT_LIBNDT_TIMEOUT_HPP
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
 
-// libndt/timeout.hpp - definition of timeout
+// libndt/internal/random.hpp - cheap cryptographically secure random bytes
+
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
 
 namespace measurement_kit {
 namespace libndt {
+namespace internal {
 
-/// Timeout expressed in seconds.
-using Timeout = unsigned int;
+// RandomPool is a pool of random bytes generated by OpenSSL's CSPRNG. Since
+// RAND_bytes() is comparatively expensive for small outputs (it takes locks
+// and reseeding checks each time), we generate random bytes in chunks and
+// serve small requests, e.g. WebSocket masking keys, out of the chunk.
+class RandomPool {
+ public:
+  // Read fills @p buffer with @p count random bytes. Returns false if the
+  // CSPRNG fails, in which case the content of @p buffer is unspecified.
+  bool Read(uint8_t *buffer, Size count) noexcept;
+
+ private:
+  uint8_t bytes_[4096] = {};
+  Size avail_ = 0;
+};
+
+// RandomBytes fills @p buffer with @p count random bytes using a pool that
+// is private to the calling thread, so we do not need any locking. Returns
+// false if the CSPRNG fails.
+//
+// Note that the pool is not reset across fork(), hence the child and the
+// parent may share up to a pool worth of random bytes. Since libndt does
+// not fork, we don't bother with detecting this case.
+bool RandomBytes(uint8_t *buffer, Size count) noexcept;
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+bool RandomPool::Read(uint8_t *buffer, Size count) noexcept {
+  while (count > 0) {
+    if (avail_ <= 0) {
+      if (RAND_bytes(bytes_, (int)sizeof(bytes_)) != 1) {
+        return false;
+      }
+      avail_ = sizeof(bytes_);
+    }
+    Size amount = (count < avail_) ? count : avail_;
+    uint8_t *source = bytes_ + (sizeof(bytes_) - avail_);
+    memcpy(buffer, source, (size_t)amount);
+    // Do not keep around bytes that we've already handed out.
+    memset(source, 0, (size_t)amount);
+    avail_ -= amount;
+    buffer += amount;
+    count -= amount;
+  }
+  return true;
+}
+
+bool RandomBytes(uint8_t *buffer, Size count) noexcept {
+  static thread_local RandomPool pool;
+  return pool.Read(buffer, count);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
+}  // namespace internal
 }  // namespace libndt
 }  // namespace measurement_kit
-#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_TIMEOUT_HPP
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_RANDOM_HPP
 // Part of Measurement Kit <https://measurement-kit.github.io/>.
 // Measurement Kit is free software under the BSD license. See AUTHORS
 // and LICENSE for more information on the copying conditions.
-#ifndef MEASUREMENT_KIT_LIBNDT_API_HPP
-#define MEASUREMENT_KIT_LIBNDT_API_HPP
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
 
-// TODO(bassosimone): run through cppcheck and attempt to minimize warnings.
+// libndt/internal/wsmask.hpp - WebSocket masking kernels
 
-/// \file libndt.hpp
-///
-/// \brief Public header of measurement-kit/libndt. The basic usage is a simple
-/// as creating a `libndt::Client c` instance and then calling `c.run()`. More
-/// advanced usage may require you to create a subclass of `libndt::Client` and
-/// override specific virtual methods to customize the behaviour.
-///
-/// This implementation provides the C2S and S2C NDT subtests. We implement
-/// NDT over TLS and NDT over websocket. For more information on the NDT
-/// protocol, \see https://github.com/ndt-project/ndt/wiki/NDTProtocol.
-///
-/// The NDT protocol described above is version 5 (aka ndt5). The code in this
-/// library also implements the ndt7 specification, which is described at
-/// \see https://github.com/m-lab/ndt-server/blob/master/spec/ndt7-protocol.md.
-///
-/// Throughout this file, we'll use NDT to indicate ndt5 and ndt7 explicitly
-/// to indicate version 7 of the protocol. Please, use ndt7 in newer code and
-/// stick to ndt5 only if backwards compatibility is necessary.
-///
-/// \remark As a general rule, what is not documented using Doxygen comments
-/// inside of this file is considered either internal or experimental. We
-/// recommend you to only use documented interfaces.
-///
-/// Usage example follows. We assume that you have downloaded the single include
-/// headers of nlohmann/json >= 3.0.0 and of libndt.
-///
-/// ```
-/// #include "json.hpp"
-/// #include "libndt.hpp"
-/// measurement_kit::libndt::Client client;
-/// client.run();
-/// ```
-///
-/// \warning Not including nlohmann/json before including libndt will cause
-/// the build to fail, because libndt uses nlohmann/json symbols.
+#include <stdint.h>
+#include <string.h>
 
-#ifndef LIBNDT_SINGLE_INCLUDE
-#include "libndt/internal/err.hpp"
-#include "libndt/internal/sys.hpp"
-#include "libndt/internal/curlx.hpp"
-#include "libndt/timeout.hpp"
-#endif // !LIBNDT_SINGLE_INCLUDE
+#include <vector>
 
-// Check dependencies
-// ``````````````````
-#ifndef NLOHMANN_JSON_VERSION_MAJOR
-#error "Libndt depends on nlohmann/json. Include nlohmann/json before including libndt."
-#endif  // !NLOHMANN_JSON_VERSION_MAJOR
-#if NLOHMANN_JSON_VERSION_MAJOR < 3
-#error "Libndt requires nlohmann/json >= 3"
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define LIBNDT_HAVE_WSMASK_SSE2 1
+#include <emmintrin.h>
 #endif
 
-// TODO(bassosimone): these headers should be in impl.hpp and here we
-// need to include the bare minimum required by the API
-
-#ifndef _WIN32
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#else
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+// We compile the AVX2 kernel using the target attribute, such that we do not
+// need to build everything with -mavx2, and we select it at runtime.
+#define LIBNDT_HAVE_WSMASK_AVX2 1
+#include <immintrin.h>
 #endif
 
-#include <assert.h>
-#ifndef _WIN32
-#include <errno.h>
-#include <fcntl.h>
-#include <limits.h>
-#include <netdb.h>
-#include <poll.h>
-#endif
-#include <stddef.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#ifndef _WIN32
-#include <unistd.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LIBNDT_HAVE_WSMASK_NEON 1
+#include <arm_neon.h>
 #endif
 
-#include <algorithm>
-#include <atomic>
-#include <chrono>
-#include <functional>
-#include <iomanip>
-#include <iostream>
-#include <map>
-#include <memory>
-#include <mutex>
-#include <random>
-#include <sstream>
-#include <string>
-#include <thread>
-#include <utility>
-#include <vector>
-
-#include <openssl/bio.h>
-#include <openssl/err.h>
-#include <openssl/ssl.h>
-#include <openssl/x509v3.h>
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
 
 namespace measurement_kit {
 namespace libndt {
+namespace internal {
 
-// Versioning
-// ``````````
-
-/// Type containing a version number.
-using Version = unsigned int;
-
-/// Major API version number of measurement-kit/libndt.
-constexpr Version version_major = Version{0};
+// WsMaskFunc is the signature of a kernel that masks (or unmasks) @p count
+// bytes starting at @p base using the four bytes long @p mask key. Since
+// masking is an involution, the same kernel also unmasks. All the kernels
+// assume that @p base is the first byte of the payload (i.e. the one that
+// must be XORed with the first byte of the key). No alignment is required.
+//
+// See <https://tools.ietf.org/html/rfc6455#section-5.3>.
+using WsMaskFunc = void (*)(uint8_t *base, Size count, const uint8_t *mask);
 
-/// Minor API version number of measurement-kit/libndt.
-constexpr Version version_minor = Version{27};
+// WsMaskImpl describes a masking kernel.
+struct WsMaskImpl {
+  const char *name;
+  WsMaskFunc func;
+};
 
-/// Patch API version number of measurement-kit/libndt.
-constexpr Version version_patch = Version{0};
+// WsMaskBytewise is the reference implementation.
+void WsMaskBytewise(uint8_t *base, Size count, const uint8_t *mask) noexcept;
 
-// Flags for selecting subtests
-// ````````````````````````````
+// WsMaskWord64 is the portable, word-at-a-time implementation.
+void WsMaskWord64(uint8_t *base, Size count, const uint8_t *mask) noexcept;
 
-/// Flags that indicate what subtests to run.
-using NettestFlags = unsigned char;
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+// WsMaskSse2 processes sixteen bytes at a time using SSE2.
+void WsMaskSse2(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
 
-constexpr NettestFlags nettest_flag_middlebox = NettestFlags{1U << 0};
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+// WsMaskAvx2 processes thirty-two bytes at a time using AVX2. Only call
+// this function if the CPU supports AVX2 (see WsMaskImpls()).
+void WsMaskAvx2(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
 
-/// Run the upload subtest.
-constexpr NettestFlags nettest_flag_upload = NettestFlags{1U << 1};
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+// WsMaskNeon processes sixteen bytes at a time using NEON.
+void WsMaskNeon(uint8_t *base, Size count, const uint8_t *mask) noexcept;
+#endif
 
-/// Run the download subtest.
-constexpr NettestFlags nettest_flag_download = NettestFlags{1U << 2};
+// WsMaskImpls returns the kernels that we can use on this CPU, sorted from
+// the slowest to the fastest one. The first one is always the reference.
+std::vector<WsMaskImpl> WsMaskImpls() noexcept;
 
-constexpr NettestFlags nettest_flag_simple_firewall = NettestFlags{1U << 3};
+// WsMask masks @p count bytes at @p base with @p mask using the fastest
+// kernel available on this CPU, which is selected once at runtime.
+void WsMask(uint8_t *base, Size count, const uint8_t *mask) noexcept;
 
-constexpr NettestFlags nettest_flag_status = NettestFlags{1U << 4};
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void WsMaskBytewise(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  for (Size i = 0; i < count; ++i) {
+    // Implementation note: judging from a GCC 8 warning, it seems that using
+    // `^=` causes -Wconversion warnings, while using `= ... ^` does not.
+    base[i] = base[i] ^ mask[i & 3];
+  }
+}
 
-constexpr NettestFlags nettest_flag_meta = NettestFlags{1U << 5};
+// Implementation note: all the kernels below process a multiple of four
+// bytes before delegating the tail to a simpler kernel, therefore the first
+// byte of the tail is always XORed with the first byte of the key.
+
+void WsMaskWord64(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  // We use memcpy() for loading and storing since this is the portable way
+  // to perform unaligned memory accesses; the compiler turns it into plain
+  // loads and stores. Also, by building the key using memcpy(), the byte
+  // order of the key in memory matches the byte order of the payload, so we
+  // don't need to care about endianness.
+  uint64_t key = 0;
+  memcpy(&key, mask, 4);
+  memcpy(((uint8_t *)&key) + 4, mask, 4);
+  Size i = 0;
+  for (; count - i >= 8; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, base + i, sizeof(word));
+    word ^= key;
+    memcpy(base + i, &word, sizeof(word));
+  }
+  WsMaskBytewise(base + i, count - i, mask);
+}
 
-constexpr NettestFlags nettest_flag_upload_ext = NettestFlags{1U << 6};
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+void WsMaskSse2(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  int32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  __m128i vkey = _mm_set1_epi32(key);
+  Size i = 0;
+  for (; count - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(base + i));
+    _mm_storeu_si128((__m128i *)(base + i), _mm_xor_si128(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_SSE2
+
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+__attribute__((target("avx2"))) void WsMaskAvx2(uint8_t *base, Size count,
+                                                const uint8_t *mask) noexcept {
+  int32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  __m256i vkey = _mm256_set1_epi32(key);
+  Size i = 0;
+  for (; count - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(base + i));
+    _mm256_storeu_si256((__m256i *)(base + i), _mm256_xor_si256(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_AVX2
+
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+void WsMaskNeon(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  uint32_t key = 0;
+  memcpy(&key, mask, sizeof(key));
+  uint8x16_t vkey = vreinterpretq_u8_u32(vdupq_n_u32(key));
+  Size i = 0;
+  for (; count - i >= 16; i += 16) {
+    uint8x16_t block = vld1q_u8(base + i);
+    vst1q_u8(base + i, veorq_u8(block, vkey));
+  }
+  WsMaskWord64(base + i, count - i, mask);
+}
+#endif  // LIBNDT_HAVE_WSMASK_NEON
+
+std::vector<WsMaskImpl> WsMaskImpls() noexcept {
+  std::vector<WsMaskImpl> impls;
+  impls.push_back(WsMaskImpl{"bytewise", WsMaskBytewise});
+  impls.push_back(WsMaskImpl{"word64", WsMaskWord64});
+#ifdef LIBNDT_HAVE_WSMASK_SSE2
+  impls.push_back(WsMaskImpl{"sse2", WsMaskSse2});
+#endif
+#ifdef LIBNDT_HAVE_WSMASK_NEON
+  impls.push_back(WsMaskImpl{"neon", WsMaskNeon});
+#endif
+#ifdef LIBNDT_HAVE_WSMASK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    impls.push_back(WsMaskImpl{"avx2", WsMaskAvx2});
+  }
+#endif
+  return impls;
+}
 
-/// Run the multi-stream download subtest.
-constexpr NettestFlags nettest_flag_download_ext = NettestFlags{1U << 7};
+void WsMask(uint8_t *base, Size count, const uint8_t *mask) noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static const WsMaskFunc func = WsMaskImpls().back().func;
+  func(base, count, mask);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
 
-// Verbosity levels
-// ````````````````
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_WSMASK_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
 
-/// Library's logging verbosity.
-using Verbosity = unsigned int;
+// libndt/internal/jsonscan.hpp - allocation free JSON field extraction
 
-/// Do not emit any log message.
-constexpr Verbosity verbosity_quiet = Verbosity{0};
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-/// Emit only warning messages.
-constexpr Verbosity verbosity_warning = Verbosity{1};
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
 
-/// Emit warning and informational messages.
-constexpr Verbosity verbosity_info = Verbosity{2};
+// JsonScanField is an integer field that JsonScan() should extract. Set
+// name to the name of the field. On return, found tells whether the field
+// was present and was an integer that fits into value.
+struct JsonScanField {
+  const char *name = nullptr;
+  int64_t value = 0;
+  bool found = false;
+};
 
-/// Emit all log messages.
-constexpr Verbosity verbosity_debug = Verbosity{3};
+// JsonScan scans the JSON object in @p data of size @p size, without
+// allocating memory or throwing. It looks for the integer @p fields inside
+// the @p object member of that object (e.g. the "TCPInfo" object of a ndt7
+// measurement) and tells in @p has_member whether the topmost object has a
+// member called @p member (e.g. "ConnectionInfo"). Returns false if @p data
+// is not a valid JSON object, in which case the outputs are unspecified.
+//
+// Member names are compared without processing escapes. This is fine for
+// ndt7 measurements whose names are plain ASCII identifiers.
+bool JsonScan(const char *data, size_t size, const char *object,
+              JsonScanField *fields, size_t nfields, const char *member,
+              bool *has_member) noexcept;
+
+// JsonScanner is the implementation of JsonScan().
+class JsonScanner {
+ public:
+  JsonScanner(const char *data, size_t size) noexcept;
 
-// Flags for selecting what NDT protocol features to use
-// `````````````````````````````````````````````````````
+  // Scan implements JsonScan().
+  bool Scan(const char *object, JsonScanField *fields, size_t nfields,
+            const char *member, bool *has_member) noexcept;
 
-/// Flags to select what protocol should be used.
-using ProtocolFlags = unsigned int;
+ private:
+  // Maximum nesting of the values we skip. The measurements we scan are
+  // not deeply nested, so anything deeper is most likely garbage.
+  static constexpr unsigned int max_depth = 32;
+
+  void skip_whitespace() noexcept;
+  bool expect(char c) noexcept;
+  bool scan_string(const char **base, size_t *count) noexcept;
+  bool scan_number(JsonScanField *field) noexcept;
+  bool skip_literal(const char *literal) noexcept;
+  bool skip_value(unsigned int depth) noexcept;
+  bool scan_fields(JsonScanField *fields, size_t nfields) noexcept;
+
+  const char *p_;
+  const char *end_;
+};
 
-/// When this flag is set we use JSON messages. This specifically means that
-/// we send and receive JSON messages (as opposed to raw strings).
-constexpr ProtocolFlags protocol_flag_json = ProtocolFlags{1 << 0};
+#ifndef LIBNDT_DECLARATIONS_ONLY
+bool JsonScan(const char *data, size_t size, const char *object,
+              JsonScanField *fields, size_t nfields, const char *member,
+              bool *has_member) noexcept {
+  JsonScanner scanner{data, size};
+  return scanner.Scan(object, fields, nfields, member, has_member);
+}
 
-/// When this flag is set we use TLS. This specifically means that we will
-/// use TLS channels for the control and the measurement connections.
-constexpr ProtocolFlags protocol_flag_tls = ProtocolFlags{1 << 1};
+// Returns whether the @p count bytes at @p base are equal to @p name.
+static bool json_scan_equal(const char *base, size_t count,
+                            const char *name) noexcept {
+  return name != nullptr && strlen(name) == count &&
+         memcmp(base, name, count) == 0;
+}
 
-/// When this flag is set we use WebSocket. This specifically means that
-/// we use the WebSocket framing to encapsulate NDT messages.
-constexpr ProtocolFlags protocol_flag_websocket = ProtocolFlags{1 << 2};
+JsonScanner::JsonScanner(const char *data, size_t size) noexcept
+    : p_{data}, end_{data + size} {}
 
-/// When this flag is set, we use ndt7 rather than ndt5. This specifically
-/// means that a totally different protocol is used. You can read more on ndt7
+bool JsonScanner::Scan(const char *object, JsonScanField *fields,
+                       size_t nfields, const char *member,
+                       bool *has_member) noexcept {
+  for (size_t i = 0; i < nfields; ++i) {
+    fields[i].value = 0;
+    fields[i].found = false;
+  }
+  if (has_member != nullptr) {
+    *has_member = false;
+  }
+  skip_whitespace();
+  if (!expect('{')) {
+    return false;
+  }
+  skip_whitespace();
+  if (p_ < end_ && *p_ == '}') {
+    ++p_;
+  } else {
+    for (;;) {
+      const char *name = nullptr;
+      size_t count = 0;
+      skip_whitespace();
+      if (!scan_string(&name, &count)) {
+        return false;
+      }
+      skip_whitespace();
+      if (!expect(':')) {
+        return false;
+      }
+      skip_whitespace();
+      if (has_member != nullptr && json_scan_equal(name, count, member)) {
+        *has_member = true;
+      }
+      if (json_scan_equal(name, count, object) && p_ < end_ && *p_ == '{') {
+        if (!scan_fields(fields, nfields)) {
+          return false;
+        }
+      } else if (!skip_value(0)) {
+        return false;
+      }
+      skip_whitespace();
+      if (p_ < end_ && *p_ == ',') {
+        ++p_;
+        continue;
+      }
+      if (!expect('}')) {
+        return false;
+      }
+      break;
+    }
+  }
+  skip_whitespace();
+  return p_ == end_;
+}
+
+void JsonScanner::skip_whitespace() noexcept {
+  while (p_ < end_ &&
+         (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+    ++p_;
+  }
+}
+
+bool JsonScanner::expect(char c) noexcept {
+  if (p_ >= end_ || *p_ != c) {
+    return false;
+  }
+  ++p_;
+  return true;
+}
+
+bool JsonScanner::scan_string(const char **base, size_t *count) noexcept {
+  if (!expect('"')) {
+    return false;
+  }
+  const char *begin = p_;
+  while (p_ < end_) {
+    char c = *p_;
+    if (c == '"') {
+      *base = begin;
+      *count = (size_t)(p_ - begin);
+      ++p_;
+      return true;
+    }
+    if ((unsigned char)c < 0x20) {
+      return false;  // control characters must be escaped
+    }
+    if (c == '\\') {
+      ++p_;  // we do not validate escapes, just skip the escaped char
+      if (p_ >= end_) {
+        return false;
+      }
+    }
+    ++p_;
+  }
+  return false;
+}
+
+bool JsonScanner::scan_number(JsonScanField *field) noexcept {
+  bool negative = false;
+  if (p_ < end_ && *p_ == '-') {
+    negative = true;
+    ++p_;
+  }
+  if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+    return false;
+  }
+  // Accumulate as a negative number, since its range is larger.
+  int64_t value = 0;
+  bool overflow = false;
+  while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+    int64_t digit = *p_ - '0';
+    if (value < (INT64_MIN + digit) / 10) {
+      overflow = true;
+    } else {
+      value = value * 10 - digit;
+    }
+    ++p_;
+  }
+  bool integral = true;
+  if (p_ < end_ && *p_ == '.') {
+    integral = false;
+    ++p_;
+    if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+      return false;
+    }
+    while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+      ++p_;
+    }
+  }
+  if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+    integral = false;
+    ++p_;
+    if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+      ++p_;
+    }
+    if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+      return false;
+    }
+    while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+      ++p_;
+    }
+  }
+  if (field != nullptr && integral && !overflow &&
+      (negative || value != INT64_MIN)) {
+    field->value = negative ? value : -value;
+    field->found = true;
+  }
+  return true;
+}
+
+bool JsonScanner::skip_literal(const char *literal) noexcept {
+  size_t count = strlen(literal);
+  if ((size_t)(end_ - p_) < count || memcmp(p_, literal, count) != 0) {
+    return false;
+  }
+  p_ += count;
+  return true;
+}
+
+bool JsonScanner::skip_value(unsigned int depth) noexcept {
+  if (depth > max_depth || p_ >= end_) {
+    return false;
+  }
+  switch (*p_) {
+    case '"': {
+      const char *base = nullptr;
+      size_t count = 0;
+      return scan_string(&base, &count);
+    }
+    case '{':
+    case '[': {
+      bool is_object = *p_ == '{';
+      char close = is_object ? '}' : ']';
+      ++p_;
+      skip_whitespace();
+      if (p_ < end_ && *p_ == close) {
+        ++p_;
+        return true;
+      }
+      for (;;) {
+        skip_whitespace();
+        if (is_object) {
+          const char *base = nullptr;
+          size_t count = 0;
+          if (!scan_string(&base, &count)) {
+            return false;
+          }
+          skip_whitespace();
+          if (!expect(':')) {
+            return false;
+          }
+          skip_whitespace();
+        }
+        if (!skip_value(depth + 1)) {
+          return false;
+        }
+        skip_whitespace();
+        if (p_ < end_ && *p_ == ',') {
+          ++p_;
+          continue;
+        }
+        return expect(close);
+      }
+    }
+    case 't':
+      return skip_literal("true");
+    case 'f':
+      return skip_literal("false");
+    case 'n':
+      return skip_literal("null");
+    default:
+      return scan_number(nullptr);
+  }
+}
+
+bool JsonScanner::scan_fields(JsonScanField *fields, size_t nfields) noexcept {
+  if (!expect('{')) {
+    return false;
+  }
+  skip_whitespace();
+  if (p_ < end_ && *p_ == '}') {
+    ++p_;
+    return true;
+  }
+  for (;;) {
+    const char *name = nullptr;
+    size_t count = 0;
+    skip_whitespace();
+    if (!scan_string(&name, &count)) {
+      return false;
+    }
+    skip_whitespace();
+    if (!expect(':')) {
+      return false;
+    }
+    skip_whitespace();
+    JsonScanField *field = nullptr;
+    for (size_t i = 0; i < nfields; ++i) {
+      if (json_scan_equal(name, count, fields[i].name)) {
+        field = &fields[i];
+        break;
+      }
+    }
+    if (field != nullptr && p_ < end_ && (*p_ == '-' || (*p_ >= '0' && *p_ <= '9'))) {
+      if (!scan_number(field)) {
+        return false;
+      }
+    } else if (!skip_value(1)) {
+      return false;
+    }
+    skip_whitespace();
+    if (p_ < end_ && *p_ == ',') {
+      ++p_;
+      continue;
+    }
+    return expect('}');
+  }
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONSCAN_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
+
+// libndt/internal/jsonwriter.hpp - allocation free JSON writer
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// JsonWriter writes JSON into a caller provided buffer, without allocating
+// memory. It is not a general purpose writer: the caller is responsible for
+// emitting the punctuation and the already quoted member names, which is
+// fine for serializing structures whose shape is known at compile time like
+// the ndt7 measurements. If the buffer is too small, the writer stops writing
+// and Good() returns false.
+class JsonWriter {
+ public:
+  JsonWriter(char *base, Size count) noexcept;
+
+  // Raw writes the @p count bytes at @p s as they are.
+  void Raw(const char *s, size_t count) noexcept;
+
+  // Raw writes the zero terminated string @p s as it is.
+  void Raw(const char *s) noexcept;
+
+  // Uint64 writes @p value as a JSON number.
+  void Uint64(uint64_t value) noexcept;
+
+  // Good returns false if the buffer was not large enough.
+  bool Good() const noexcept;
+
+  // Length returns the number of bytes written so far.
+  Size Length() const noexcept;
+
+ private:
+  char *base_;
+  Size count_;
+  Size offset_ = 0;
+  bool good_ = true;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+JsonWriter::JsonWriter(char *base, Size count) noexcept
+    : base_{base}, count_{count} {}
+
+void JsonWriter::Raw(const char *s, size_t count) noexcept {
+  if (!good_ || count > count_ - offset_) {
+    good_ = false;
+    return;
+  }
+  memcpy(base_ + offset_, s, count);
+  offset_ += count;
+}
+
+void JsonWriter::Raw(const char *s) noexcept { Raw(s, strlen(s)); }
+
+void JsonWriter::Uint64(uint64_t value) noexcept {
+  char digits[20];  // UINT64_MAX has 20 digits
+  size_t n = sizeof(digits);
+  do {
+    digits[--n] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  Raw(digits + n, sizeof(digits) - n);
+}
+
+bool JsonWriter::Good() const noexcept { return good_; }
+
+Size JsonWriter::Length() const noexcept { return offset_; }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_JSONWRITER_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
+
+// libndt/internal/sslcache.hpp - cache of SSL contexts and sessions
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <openssl/ssl.h>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// SslCache caches SSL contexts, such that we load the CA bundle only once,
+// and the TLS sessions sent to us by servers, such that new connections to
+// the same server can resume the session rather than performing a full
+// handshake. Each context has its own sessions, because a resumed handshake
+// does not verify the certificate again, hence we must not resume, e.g., a
+// session created without verifying the peer when we want to verify it. It
+// is safe to use a SslCache from many threads.
+class SslCache {
+ public:
+  SslCache() noexcept;
+  SslCache(const SslCache &) = delete;
+  SslCache &operator=(const SslCache &) = delete;
+  SslCache(SslCache &&) = delete;
+  SslCache &operator=(SslCache &&) = delete;
+  ~SslCache() noexcept;
+
+  // Context returns the context for @p ca_bundle_path and @p verify_peer,
+  // creating it the first time. The context is owned by the cache. If you
+  // create a SSL with it, the SSL will own a reference to it. Returns a null
+  // pointer on failure, e.g., when we cannot load the CA bundle.
+  SSL_CTX *Context(const std::string &ca_bundle_path, bool verify_peer) noexcept;
+
+  // Prepare configures @p ssl, created using one of our contexts, to resume
+  // the session we have for @p key and the context of @p ssl, if any, and to
+  // save for them the sessions that the server will send us over @p ssl.
+  bool Prepare(SSL *ssl, const std::string &key) noexcept;
+
+  // HasSession returns whether we have a session for @p key and @p ctx.
+  bool HasSession(SSL_CTX *ctx, const std::string &key) noexcept;
+
+  // Global returns the cache shared by all the clients in this process.
+  static std::shared_ptr<SslCache> Global() noexcept;
+
+ private:
+  static int OnNewSession(SSL *ssl, SSL_SESSION *session) noexcept;
+  static int KeyIndex() noexcept;
+  static int CacheIndex() noexcept;
+
+  std::mutex mutex_;
+  std::map<std::pair<std::string, bool>, SSL_CTX *> contexts_;
+  std::map<std::pair<SSL_CTX *, std::string>, SSL_SESSION *> sessions_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+SslCache::SslCache() noexcept {}
+
+SslCache::~SslCache() noexcept {
+  for (auto &kv : contexts_) {
+    ::SSL_CTX_free(kv.second);
+  }
+  for (auto &kv : sessions_) {
+    ::SSL_SESSION_free(kv.second);
+  }
+}
+
+SSL_CTX *SslCache::Context(const std::string &ca_bundle_path,
+                           bool verify_peer) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  auto key = std::make_pair(verify_peer ? ca_bundle_path : "", verify_peer);
+  auto it = contexts_.find(key);
+  if (it != contexts_.end()) {
+    return it->second;
+  }
+  // TODO(bassosimone): understand whether we can remove old SSL versions
+  // taking into account that the NDT server runs on very old code.
+  SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+  if (verify_peer && !::SSL_CTX_load_verify_locations(
+                         ctx, ca_bundle_path.c_str(), nullptr)) {
+    ::SSL_CTX_free(ctx);
+    return nullptr;
+  }
+  // We keep sessions ourselves because OpenSSL does not lookup sessions by
+  // itself in client mode. See SSL_CTX_set_session_cache_mode(3).
+  ::SSL_CTX_set_session_cache_mode(
+      ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  ::SSL_CTX_sess_set_new_cb(ctx, OnNewSession);
+  ::SSL_CTX_set_ex_data(ctx, CacheIndex(), this);
+  contexts_[key] = ctx;
+  return ctx;
+}
+
+bool SslCache::Prepare(SSL *ssl, const std::string &key) noexcept {
+  // The string is deleted by the free function of KeyIndex() along with ssl.
+  if (!::SSL_set_ex_data(ssl, KeyIndex(), new std::string{key})) {
+    return false;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = sessions_.find(std::make_pair(::SSL_get_SSL_CTX(ssl), key));
+  if (it == sessions_.end()) {
+    return true;
+  }
+  if (!::SSL_set_session(ssl, it->second)) {  // takes its own reference
+    return false;
+  }
+  // TLSv1.3 clients should not use a ticket more than once (RFC8446 Sect.
+  // C.4), and the server will send us fresh tickets anyway.
+  if (::SSL_SESSION_get_protocol_version(it->second) >= TLS1_3_VERSION) {
+    ::SSL_SESSION_free(it->second);
+    sessions_.erase(it);
+  }
+  return true;
+}
+
+bool SslCache::HasSession(SSL_CTX *ctx, const std::string &key) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return sessions_.count(std::make_pair(ctx, key)) > 0;
+}
+
+std::shared_ptr<SslCache> SslCache::Global() noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static std::shared_ptr<SslCache> cache{new SslCache};
+  return cache;
+}
+
+int SslCache::OnNewSession(SSL *ssl, SSL_SESSION *session) noexcept {
+  auto key = static_cast<std::string *>(::SSL_get_ex_data(ssl, KeyIndex()));
+  SSL_CTX *ctx = ::SSL_get_SSL_CTX(ssl);
+  auto cache = static_cast<SslCache *>(::SSL_CTX_get_ex_data(ctx, CacheIndex()));
+  if (key == nullptr || cache == nullptr) {
+    return 0;  // We did not take ownership of session
+  }
+  std::unique_lock<std::mutex> _{cache->mutex_};
+  auto &entry = cache->sessions_[std::make_pair(ctx, *key)];
+  if (entry != nullptr) {
+    ::SSL_SESSION_free(entry);
+  }
+  entry = session;
+  return 1;  // We took ownership of session
+}
+
+int SslCache::KeyIndex() noexcept {
+  static const int index = ::SSL_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+        delete static_cast<std::string *>(ptr);
+      });
+  return index;
+}
+
+int SslCache::CacheIndex() noexcept {
+  static const int index =
+      ::SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_SSLCACHE_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
+
+// libndt/internal/sockettable.hpp - per socket state
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// SocketTable maps sockets to the state of the connection using them. Since
+// sockets are small integers in practice, Find() is a bounds check and an
+// array access, so we can use it for every I/O operation. On Windows, sockets
+// are handles, which are multiples of four, hence we index the array using
+// the socket divided by four. We keep the state of the sockets that do not
+// fit the array in a map protected by a mutex, so that only these sockets pay
+// for locking. The array is allocated once, hence Insert() and Remove() do
+// not move the state of other sockets. So, many threads can Find() and use
+// the state of their own socket while other threads insert or remove other
+// sockets, as long as no thread inserts or removes such socket meanwhile.
+template <typename State>
+class SocketTable {
+ public:
+  // The array holds the state of the sockets below this value.
+  static constexpr size_t array_size = 1024;
+
+  SocketTable() noexcept;
+  SocketTable(const SocketTable &) = delete;
+  SocketTable &operator=(const SocketTable &) = delete;
+  SocketTable(SocketTable &&) = delete;
+  SocketTable &operator=(SocketTable &&) = delete;
+  ~SocketTable() noexcept;
+
+  // Find returns the state of @p sock or nullptr.
+  State *Find(Socket sock) const noexcept;
+
+  // Insert makes @p state the state of @p sock, replacing the previous state
+  // of @p sock, if any, and returns @p state.
+  State *Insert(Socket sock, std::unique_ptr<State> state) noexcept;
+
+  // Remove removes the state of @p sock and returns it, or nullptr.
+  std::unique_ptr<State> Remove(Socket sock) noexcept;
+
+ private:
+  // Returns the index of @p sock in the array or array_size.
+  static size_t index(Socket sock) noexcept;
+
+  std::unique_ptr<std::unique_ptr<State>[]> array_;
+  mutable std::mutex mutex_;
+  std::map<Socket, std::unique_ptr<State>> others_;  // protected by mutex_
+};
+
+template <typename State>
+constexpr size_t SocketTable<State>::array_size;
+
+template <typename State>
+SocketTable<State>::SocketTable() noexcept
+    : array_{new std::unique_ptr<State>[array_size]} {}
+
+template <typename State>
+SocketTable<State>::~SocketTable() noexcept {}
+
+template <typename State>
+State *SocketTable<State>::Find(Socket sock) const noexcept {
+  size_t i = index(sock);
+  if (i < array_size) {
+    return array_[i].get();
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = others_.find(sock);
+  return (it != others_.end()) ? it->second.get() : nullptr;
+}
+
+template <typename State>
+State *SocketTable<State>::Insert(Socket sock,
+                                  std::unique_ptr<State> state) noexcept {
+  State *result = state.get();
+  size_t i = index(sock);
+  if (i < array_size) {
+    array_[i] = std::move(state);
+  } else {
+    std::unique_lock<std::mutex> _{mutex_};
+    others_[sock] = std::move(state);
+  }
+  return result;
+}
+
+template <typename State>
+std::unique_ptr<State> SocketTable<State>::Remove(Socket sock) noexcept {
+  std::unique_ptr<State> state;
+  size_t i = index(sock);
+  if (i < array_size) {
+    state = std::move(array_[i]);
+  } else {
+    std::unique_lock<std::mutex> _{mutex_};
+    auto it = others_.find(sock);
+    if (it != others_.end()) {
+      state = std::move(it->second);
+      others_.erase(it);
+    }
+  }
+  return state;
+}
+
+template <typename State>
+size_t SocketTable<State>::index(Socket sock) noexcept {
+  if (!IsSocketValid(sock)) {
+    return array_size;
+  }
+  size_t value = (size_t)sock;
+#ifdef _WIN32
+  if ((value & 3) != 0) {
+    return array_size;  // not a handle, so it can't use the array
+  }
+  value >>= 2;
+#endif
+  return (value < array_size) ? value : array_size;
+}
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_SOCKETTABLE_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
+
+// libndt/internal/uring.hpp - io_uring based Sys for bulk receive
+
+// We only compile this code if LIBNDT_HAVE_IO_URING is defined, which our
+// build does on Linux when the kernel headers are recent enough (6.0). We
+// use the system calls directly, rather than liburing, to avoid depending
+// on it, and we fall back to Sys when the running kernel is too old.
+#ifdef LIBNDT_HAVE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sockettable.hpp"
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// UringRecv receives from a socket using an io_uring multishot recv: after
+// we submit it once, the kernel keeps receiving into buffers we provide to
+// it through a buffer ring, posting a completion per buffer, until we run out
+// of buffers. Recv() copies from the buffers filled by the kernel and gives
+// them back to it once consumed, without system calls, and only needs to
+// submit the recv again when the kernel runs out of buffers. Only one thread
+// at a time may use a UringRecv.
+class UringRecv {
+ public:
+  UringRecv() noexcept;
+  UringRecv(const UringRecv &) = delete;
+  UringRecv &operator=(const UringRecv &) = delete;
+  UringRecv(UringRecv &&) = delete;
+  UringRecv &operator=(UringRecv &&) = delete;
+
+  // Cancels the recv and waits for the kernel to stop using our buffers.
+  ~UringRecv() noexcept;
+
+  // Start starts receiving from @p sock using @p nbufs buffers, which must
+  // be a power of two, of @p bufsize bytes. Returns false on failure, e.g.,
+  // when the kernel does not support multishot recv.
+  bool Start(Socket sock, unsigned nbufs, unsigned bufsize) noexcept;
+
+  // Recv is like recv(2) for a non blocking socket: it returns the number
+  // of bytes copied into @p base, zero on EOF, or -1 setting errno, which
+  // is EAGAIN when there is no data available yet.
+  Ssize Recv(void *base, Size count) noexcept;
+
+  // Readable returns whether Recv() would not fail with EAGAIN.
+  bool Readable() noexcept;
+
+  // Fd returns the io_uring file descriptor, which poll(2) reports as
+  // readable when the kernel has posted completions.
+  int Fd() const noexcept;
+
+ private:
+  static constexpr uint64_t recv_user_data = 1;
+  static constexpr uint64_t cancel_user_data = 2;
+  static constexpr uint16_t buf_group = 0;
+
+  io_uring_sqe *NextSqe() noexcept;
+  bool Enter(unsigned to_submit, unsigned min_complete) noexcept;
+  bool Arm() noexcept;
+  bool NextCqe(io_uring_cqe *cqe) noexcept;
+  bool Process() noexcept;
+  void Recycle(uint16_t bid) noexcept;
+  void Stop() noexcept;
+
+  int ring_fd_ = -1;
+  Socket sock_ = (Socket)-1;
+
+  // Submission and completion queues shared with the kernel.
+  void *rings_ = nullptr;
+  size_t rings_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_mask_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned *cq_mask_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+
+  // Buffer ring through which we provide buffers to the kernel.
+  io_uring_buf *buf_ring_ = nullptr;
+  size_t buf_ring_size_ = 0;
+  char *bufs_ = nullptr;
+  size_t bufs_size_ = 0;
+  unsigned nbufs_ = 0;
+  unsigned bufsize_ = 0;
+  uint16_t buf_tail_ = 0;
+  bool registered_ = false;
+
+  // Whether the multishot recv is active.
+  bool armed_ = false;
+
+  // The buffer we are copying from, if any.
+  bool has_current_ = false;
+  uint16_t current_bid_ = 0;
+  size_t current_off_ = 0;
+  size_t current_len_ = 0;
+
+  // Sticky EOF and error, which we return once we have copied all data.
+  bool eof_ = false;
+  int error_ = 0;
+};
+
+// UringSys is a Sys that, once told that we are going to receive a lot of
+// data from a socket using StartBulkRecv(), receives from such socket using
+// UringRecv, and otherwise behaves like Sys. Poll() waits for the io_uring of
+// such sockets rather than for the sockets themselves, since the kernel reads
+// data from the sockets as soon as it arrives. It keeps the UringRecv of each
+// socket in a SocketTable, hence many threads can use their own sockets at the
+// same time, as long as no other thread uses a socket while its bulk recv is
+// being started, or while it is being closed.
+class UringSys : public Sys {
+ public:
+  // Number and size of the buffers of each socket.
+  static constexpr unsigned nbufs = 16;
+  static constexpr unsigned bufsize = 1 << 15;
+
+  bool StartBulkRecv(Socket fd) const noexcept override;
+
+  Ssize Recv(Socket fd, void *base, Size count) const noexcept override;
+
+  int Closesocket(Socket fd) const noexcept override;
+
+  int Poll(pollfd *fds, nfds_t nfds, int timeout) const noexcept override;
+
+  ~UringSys() noexcept override;
+
+ private:
+  mutable SocketTable<UringRecv> table_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr uint64_t UringRecv::recv_user_data;
+constexpr uint64_t UringRecv::cancel_user_data;
+constexpr uint16_t UringRecv::buf_group;
+
+UringRecv::UringRecv() noexcept {}
+
+UringRecv::~UringRecv() noexcept { Stop(); }
+
+bool UringRecv::Start(Socket sock, unsigned nbufs, unsigned bufsize) noexcept {
+  if (nbufs <= 0 || (nbufs & (nbufs - 1)) != 0 || nbufs > 32768) {
+    return false;
+  }
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Each buffer needs a completion, plus the one of cancel.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 2 * nbufs;
+  long fd = ::syscall(__NR_io_uring_setup, 4, &params);
+  if (fd < 0) {
+    return false;
+  }
+  ring_fd_ = (int)fd;
+  sock_ = sock;
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    return false;
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  rings_size_ = (sq_size > cq_size) ? sq_size : cq_size;
+  void *rings = ::mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    return false;
+  }
+  rings_ = rings;
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = (io_uring_sqe *)sqes;
+  char *p = (char *)rings_;
+  sq_tail_ = (unsigned *)(p + params.sq_off.tail);
+  sq_mask_ = (unsigned *)(p + params.sq_off.ring_mask);
+  sq_array_ = (unsigned *)(p + params.sq_off.array);
+  cq_head_ = (unsigned *)(p + params.cq_off.head);
+  cq_tail_ = (unsigned *)(p + params.cq_off.tail);
+  cq_mask_ = (unsigned *)(p + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(p + params.cq_off.cqes);
+
+  // The buffer ring must be page aligned, hence we use mmap.
+  nbufs_ = nbufs;
+  bufsize_ = bufsize;
+  buf_ring_size_ = nbufs * sizeof(io_uring_buf);
+  void *buf_ring = ::mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) {
+    return false;
+  }
+  buf_ring_ = (io_uring_buf *)buf_ring;
+  bufs_size_ = (size_t)nbufs * bufsize;
+  void *bufs = ::mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return false;
+  }
+  bufs_ = (char *)bufs;
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+  reg.ring_entries = nbufs;
+  reg.bgid = buf_group;
+  if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0) {
+    return false;
+  }
+  registered_ = true;
+  for (unsigned i = 0; i < nbufs; ++i) {
+    Recycle((uint16_t)i);
+  }
+  return Arm();
+}
+
+Ssize UringRecv::Recv(void *base, Size count) noexcept {
+  Size off = 0;
+  while (off < count) {
+    if (has_current_) {
+      size_t n = current_len_ - current_off_;
+      if (n > count - off) {
+        n = (size_t)(count - off);
+      }
+      memcpy((char *)base + off,
+             bufs_ + (size_t)current_bid_ * bufsize_ + current_off_, n);
+      off += n;
+      current_off_ += n;
+      if (current_off_ >= current_len_) {
+        has_current_ = false;
+        Recycle(current_bid_);
+      }
+      continue;
+    }
+    if (!Process()) {
+      break;  // no more data for now
+    }
+  }
+  if (off > 0) {
+    return (Ssize)off;
+  }
+  if (error_ != 0) {
+    errno = error_;
+    return -1;
+  }
+  if (eof_) {
+    return 0;
+  }
+  if (!armed_ && !Arm()) {
+    errno = EIO;
+    return -1;
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+bool UringRecv::Readable() noexcept {
+  while (!has_current_ && !eof_ && error_ == 0) {
+    if (!Process()) {
+      if (!armed_ && !Arm()) {
+        error_ = EIO;
+        return true;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+int UringRecv::Fd() const noexcept { return ring_fd_; }
+
+io_uring_sqe *UringRecv::NextSqe() noexcept {
+  // We're the only producer, so we only need to order the kernel's view.
+  unsigned tail = *sq_tail_;
+  unsigned index = tail & *sq_mask_;
+  io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  return sqe;
+}
+
+bool UringRecv::Enter(unsigned to_submit, unsigned min_complete) noexcept {
+  if (to_submit > 0) {
+    __atomic_store_n(sq_tail_, *sq_tail_ + to_submit, __ATOMIC_RELEASE);
+  }
+  unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    long rv = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                        min_complete, flags, nullptr, 0);
+    if (rv >= 0) {
+      return (unsigned long)rv == to_submit;
+    }
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+bool UringRecv::Arm() noexcept {
+  if (eof_ || error_ != 0) {
+    return true;  // nothing left to receive
+  }
+  io_uring_sqe *sqe = NextSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sock_;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = buf_group;
+  sqe->user_data = recv_user_data;
+  armed_ = Enter(1, 0);
+  return armed_;
+}
+
+bool UringRecv::NextCqe(io_uring_cqe *cqe) noexcept {
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return false;
+  }
+  *cqe = cqes_[head & *cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Process processes the next completion of the recv, if any, returning
+// false when there are no completions.
+bool UringRecv::Process() noexcept {
+  io_uring_cqe cqe;
+  do {
+    if (!NextCqe(&cqe)) {
+      return false;
+    }
+  } while (cqe.user_data != recv_user_data);
+  if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+    armed_ = false;  // the kernel stopped receiving
+  }
+  if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+    has_current_ = true;
+    current_bid_ = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    current_off_ = 0;
+    current_len_ = (size_t)cqe.res;
+  } else if (cqe.res == 0) {
+    eof_ = true;
+  } else if (cqe.res == -ENOBUFS) {
+    // NOTHING: we'll submit again once we have consumed some buffers
+  } else if (cqe.res < 0) {
+    error_ = -cqe.res;
+  }
+  return true;
+}
+
+void UringRecv::Recycle(uint16_t bid) noexcept {
+  io_uring_buf *buf = &buf_ring_[buf_tail_ & (nbufs_ - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(bufs_ + (size_t)bid * bufsize_);
+  buf->len = bufsize_;
+  buf->bid = bid;
+  buf_tail_ = (uint16_t)(buf_tail_ + 1);
+  // The tail of the ring overlaps with the resv field of the first buffer.
+  __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+}
+
+void UringRecv::Stop() noexcept {
+  bool safe = true;  // whether the kernel won't write into our buffers
+  if (armed_) {
+    io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = recv_user_data;
+    sqe->user_data = cancel_user_data;
+    safe = Enter(1, 0);
+    // The recv posts a last completion without IORING_CQE_F_MORE.
+    while (safe && armed_) {
+      io_uring_cqe cqe;
+      if (!NextCqe(&cqe)) {
+        safe = Enter(0, 1);
+        continue;
+      }
+      if (cqe.user_data == recv_user_data &&
+          (cqe.flags & IORING_CQE_F_MORE) == 0) {
+        armed_ = false;
+      }
+    }
+  }
+  if (registered_ && safe) {
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buf_group;
+    (void)::syscall(__NR_io_uring_register, ring_fd_,
+                    IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  if (ring_fd_ != -1) {
+    (void)::close(ring_fd_);
+  }
+  if (sqes_ != nullptr) {
+    (void)::munmap(sqes_, sqes_size_);
+  }
+  if (rings_ != nullptr) {
+    (void)::munmap(rings_, rings_size_);
+  }
+  // If we could not make sure the kernel stopped receiving, we leak the
+  // buffers rather than having the kernel write into unmapped memory.
+  if (safe) {
+    if (bufs_ != nullptr) {
+      (void)::munmap(bufs_, bufs_size_);
+    }
+    if (buf_ring_ != nullptr) {
+      (void)::munmap(buf_ring_, buf_ring_size_);
+    }
+  }
+}
+
+constexpr unsigned UringSys::nbufs;
+constexpr unsigned UringSys::bufsize;
+
+bool UringSys::StartBulkRecv(Socket fd) const noexcept {
+  if (table_.Find(fd) != nullptr) {
+    return true;
+  }
+  std::unique_ptr<UringRecv> recv{new UringRecv};
+  if (!recv->Start(fd, nbufs, bufsize)) {
+    return false;
+  }
+  table_.Insert(fd, std::move(recv));
+  return true;
+}
+
+Ssize UringSys::Recv(Socket fd, void *base, Size count) const noexcept {
+  UringRecv *recv = table_.Find(fd);
+  if (recv == nullptr) {
+    return Sys::Recv(fd, base, count);
+  }
+  return recv->Recv(base, count);
+}
+
+int UringSys::Closesocket(Socket fd) const noexcept {
+  table_.Remove(fd);  // stops receiving before we close the socket
+  return Sys::Closesocket(fd);
+}
+
+int UringSys::Poll(pollfd *fds, nfds_t nfds, int timeout) const noexcept {
+  // We run after every EAGAIN on the bulk recv path, hence we use arrays on
+  // the stack, and only allocate when polling for many sockets.
+  constexpr nfds_t small = 8;
+  UringRecv *small_recvs[small];
+  std::vector<UringRecv *> large_recvs;
+  UringRecv **recvs = small_recvs;
+  if (nfds > small) {
+    large_recvs.resize(nfds);
+    recvs = large_recvs.data();
+  }
+  // For each bulk recv socket we poll for POLLIN, we poll its io_uring in
+  // its place, and the socket only for the other events, if any.
+  bool any = false;
+  for (nfds_t i = 0; i < nfds; ++i) {
+    recvs[i] =
+        ((fds[i].events & POLLIN) != 0) ? table_.Find(fds[i].fd) : nullptr;
+    any = any || recvs[i] != nullptr;
+  }
+  if (!any) {
+    return Sys::Poll(fds, nfds, timeout);
+  }
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  // Each entry of fds needs at most two entries of pfds.
+  pollfd small_pfds[2 * small];
+  nfds_t small_origin[2 * small];  // index in fds of each entry of pfds
+  std::vector<pollfd> large_pfds;
+  std::vector<nfds_t> large_origin;
+  pollfd *pfds = small_pfds;
+  nfds_t *origin = small_origin;
+  if (nfds > small) {
+    large_pfds.resize(2 * nfds);
+    large_origin.resize(2 * nfds);
+    pfds = large_pfds.data();
+    origin = large_origin.data();
+  }
+  for (;;) {
+    nfds_t npfds = 0;
+    int ready = 0;
+    bool uring_only = true;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      fds[i].revents = 0;
+      if (recvs[i] == nullptr) {
+        pfds[npfds] = fds[i];
+        origin[npfds++] = i;
+        uring_only = false;
+        continue;
+      }
+      if (recvs[i]->Readable()) {
+        fds[i].revents = POLLIN;
+        ready += 1;
+      }
+      pollfd pfd{};
+      pfd.fd = recvs[i]->Fd();
+      pfd.events = POLLIN;
+      pfds[npfds] = pfd;
+      origin[npfds++] = i;
+      if ((fds[i].events & ~POLLIN) != 0) {
+        pfd.fd = fds[i].fd;
+        pfd.events = (short)(fds[i].events & ~POLLIN);
+        pfds[npfds] = pfd;
+        origin[npfds++] = i;
+        uring_only = false;
+      }
+    }
+    if (ready > 0 && uring_only) {
+      return ready;  // no need to ask the kernel
+    }
+    int rv = Sys::Poll(pfds, npfds, (ready > 0) ? 0 : timeout);
+    if (rv < 0) {
+      return rv;
+    }
+    for (nfds_t j = 0; j < npfds; ++j) {
+      pollfd &pfd = fds[origin[j]];
+      if (pfds[j].fd == pfd.fd) {
+        pfd.revents = (short)(pfd.revents | pfds[j].revents);
+      } else if ((pfds[j].revents & POLLIN) != 0 &&
+                 recvs[origin[j]]->Readable()) {
+        pfd.revents = (short)(pfd.revents | POLLIN);
+      }
+    }
+    ready = 0;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      ready += (fds[i].revents != 0) ? 1 : 0;
+    }
+    if (ready > 0 || rv == 0) {
+      return ready;
+    }
+    // The io_uring only had completions without data, e.g., because the
+    // kernel run out of buffers and we submitted the recv again.
+    if (timeout > 0) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0) {
+        return 0;
+      }
+      timeout = (int)remaining.count();
+    }
+  }
+}
+
+UringSys::~UringSys() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // LIBNDT_HAVE_IO_URING
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_URING_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
+
+// libndt/internal/counters.hpp - counters for hot paths
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// ShardedCounters is an array of @p N counters that many threads may update
+// at the same time, e.g., the threads running ndt7 flows. Each thread updates
+// one of @p Shards shards, which we assign to threads round robin, such that
+// up to @p Shards threads never write the same cache line. A shard is padded
+// so that it never shares a cache line with another shard or with other
+// data. Add() is a relaxed atomic addition to the shard of the thread, which
+// is cheap because no other thread is usually writing that cache line. Get()
+// sums the shards and may return a slightly stale value while other threads
+// update the counters, which is fine for counters.
+template <size_t N, size_t Shards = 16>
+class ShardedCounters {
+ public:
+  ShardedCounters() noexcept;
+  ShardedCounters(const ShardedCounters &) = delete;
+  ShardedCounters &operator=(const ShardedCounters &) = delete;
+  ShardedCounters(ShardedCounters &&) = delete;
+  ShardedCounters &operator=(ShardedCounters &&) = delete;
+  ~ShardedCounters() noexcept;
+
+  // Add adds @p value to the @p index-th counter. @p index must be less
+  // than @p N.
+  void Add(size_t index, uint64_t value = 1) noexcept;
+
+  // Get returns the value of the @p index-th counter. @p index must be less
+  // than @p N.
+  uint64_t Get(size_t index) const noexcept;
+
+  // Reset sets all the counters to zero.
+  void Reset() noexcept;
+
+ private:
+  static constexpr size_t padding = 64;  // size of a cache line
+
+  class Shard {
+   public:
+    std::atomic<uint64_t> values[N];
+    char after[padding];
+  };
+
+  char before_[padding] = {};
+  Shard shards_[Shards];
+};
+
+// CounterShard returns the number of the calling thread, which we assign
+// when the thread first calls it, and which we use to select a shard.
+size_t CounterShard() noexcept;
+
+// Log2Bucket returns the bucket of @p value in a histogram with @p buckets
+// buckets, where bucket zero counts zeros, bucket i counts the values in
+// [2^(i-1), 2^i), and the last bucket also counts all the larger values.
+// @p buckets must be positive.
+size_t Log2Bucket(uint64_t value, size_t buckets) noexcept;
+
+template <size_t N, size_t Shards>
+ShardedCounters<N, Shards>::ShardedCounters() noexcept {
+  Reset();
+}
+
+template <size_t N, size_t Shards>
+ShardedCounters<N, Shards>::~ShardedCounters() noexcept {}
+
+template <size_t N, size_t Shards>
+void ShardedCounters<N, Shards>::Add(size_t index, uint64_t value) noexcept {
+  shards_[CounterShard() % Shards].values[index].fetch_add(
+      value, std::memory_order_relaxed);
+}
+
+template <size_t N, size_t Shards>
+uint64_t ShardedCounters<N, Shards>::Get(size_t index) const noexcept {
+  uint64_t sum = 0;
+  for (auto &shard : shards_) {
+    sum += shard.values[index].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+template <size_t N, size_t Shards>
+void ShardedCounters<N, Shards>::Reset() noexcept {
+  for (auto &shard : shards_) {
+    for (auto &value : shard.values) {
+      value.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+size_t CounterShard() noexcept {
+  static std::atomic<size_t> next{0};
+  static thread_local size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed);
+  return shard;
+}
+
+size_t Log2Bucket(uint64_t value, size_t buckets) noexcept {
+  size_t bucket = 0;
+  while (value > 0 && bucket < buckets - 1) {
+    value >>= 1;
+    bucket += 1;
+  }
+  return (value > 0) ? buckets - 1 : bucket;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_COUNTERS_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
+
+// libndt/internal/recordwriter.hpp - buffered writers for result records
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// RecordPiece is a piece of a record, i.e., the @p count bytes at @p base. We
+// append a record as a list of pieces, such that callers can append, e.g., a
+// header they format on the stack followed by a measurement they received,
+// without first concatenating them into a string.
+class RecordPiece {
+ public:
+  const char *base = nullptr;
+  size_t count = 0;
+};
+
+// FdRecordWriter appends records to a buffer and a background thread writes
+// the buffer to a file descriptor, such that the threads that append records,
+// i.e., the measurement threads, never perform I/O. Append() copies a record
+// into the buffer, unless the buffer is full, in which case it drops the
+// record, rather than blocking the measurement until the file descriptor is
+// writeable. Both buffers are allocated once, so appending does not allocate.
+// It is safe to append records from many threads.
+class FdRecordWriter {
+ public:
+  // Writes to @p fd, which we close when done if @p close_fd is true, using
+  // two buffers of @p capacity bytes, one we append to and one we write.
+  FdRecordWriter(int fd, bool close_fd, size_t capacity) noexcept;
+  FdRecordWriter(const FdRecordWriter &) = delete;
+  FdRecordWriter &operator=(const FdRecordWriter &) = delete;
+  FdRecordWriter(FdRecordWriter &&) = delete;
+  FdRecordWriter &operator=(FdRecordWriter &&) = delete;
+
+  // Writes the buffered records and stops the background thread.
+  ~FdRecordWriter() noexcept;
+
+  // Append appends the @p count pieces at @p pieces as a single record.
+  // Returns false if the record was dropped because the buffer is full.
+  bool Append(const RecordPiece *pieces, size_t count) noexcept;
+
+  // Flush waits until all the records appended so far have been written.
+  // Returns false if we failed to write to the file descriptor, in which
+  // case we discard all the records appended afterwards.
+  bool Flush() noexcept;
+
+  // Drop counts a record that the caller dropped without appending it,
+  // e.g., because it was malformed.
+  void Drop() noexcept;
+
+  // Dropped returns the number of records dropped so far.
+  uint64_t Dropped() const noexcept;
+
+ private:
+  void Loop() noexcept;
+  bool WriteAll(const char *base, size_t count) noexcept;
+
+  int fd_;
+  bool close_fd_;
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<char> pending_;  // records appended but not being written
+  std::vector<char> writing_;  // records the background thread is writing
+  uint64_t appended_ = 0;      // bytes appended so far
+  uint64_t written_ = 0;       // bytes written (or discarded) so far
+  uint64_t dropped_ = 0;
+  bool failed_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// RingRecordWriter appends records to a file mapped in memory, which we use
+// as a ring buffer, such that the file has a fixed size and contains the most
+// recent records. Appending is a memory copy and the kernel writes the pages
+// to disk in the background. The file starts with a header_size bytes header
+// containing, as host byte order uint64_t values, the magic (see below), the
+// size of the ring, and the number of bytes appended so far. The ring follows
+// the header and contains the latest min(appended, size) bytes, the oldest of
+// which is at offset appended % size. To read the ring while we are writing,
+// read appended, copy the ring, and read appended again, to know how many of
+// the oldest bytes were overwritten meanwhile. Not available on Windows. It
+// is safe to append records from many threads.
+class RingRecordWriter {
+ public:
+  static constexpr size_t header_size = 64;
+  static constexpr uint64_t magic = 0x31474e495254444e;  // "NDTRING1"
+
+  RingRecordWriter() noexcept;
+  RingRecordWriter(const RingRecordWriter &) = delete;
+  RingRecordWriter &operator=(const RingRecordWriter &) = delete;
+  RingRecordWriter(RingRecordWriter &&) = delete;
+  RingRecordWriter &operator=(RingRecordWriter &&) = delete;
+  ~RingRecordWriter() noexcept;
+
+  // Open creates, or truncates, the file at @p path, containing a ring of
+  // @p capacity bytes, and maps it. Returns false on failure.
+  bool Open(const std::string &path, size_t capacity) noexcept;
+
+  // Append appends the @p count pieces at @p pieces as a single record.
+  // Returns false if the record was dropped because the file is not open
+  // or the record is larger than the ring.
+  bool Append(const RecordPiece *pieces, size_t count) noexcept;
+
+  // Appended returns the number of bytes appended so far.
+  uint64_t Appended() const noexcept;
+
+  // Drop counts a record that the caller dropped without appending it,
+  // e.g., because it was malformed.
+  void Drop() noexcept;
+
+  // Dropped returns the number of records dropped so far.
+  uint64_t Dropped() const noexcept;
+
+ private:
+  void Close() noexcept;
+
+  mutable std::mutex mutex_;
+  char *base_ = nullptr;  // the mapped file
+  size_t capacity_ = 0;
+  uint64_t appended_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+FdRecordWriter::FdRecordWriter(int fd, bool close_fd, size_t capacity) noexcept
+    : fd_{fd}, close_fd_{close_fd}, capacity_{capacity} {
+  pending_.reserve(capacity_);
+  writing_.reserve(capacity_);
+  thread_ = std::thread{[this]() noexcept { Loop(); }};
+}
+
+FdRecordWriter::~FdRecordWriter() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+  if (close_fd_) {
+#ifndef _WIN32
+    (void)::close(fd_);
+#else
+    (void)::_close(fd_);
+#endif
+  }
+}
+
+bool FdRecordWriter::Append(const RecordPiece *pieces, size_t count) noexcept {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += pieces[i].count;
+  }
+  bool was_empty = false;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (total > capacity_ - pending_.size()) {
+      dropped_ += 1;
+      return false;
+    }
+    was_empty = pending_.empty();
+    for (size_t i = 0; i < count; ++i) {
+      pending_.insert(pending_.end(), pieces[i].base,
+                      pieces[i].base + pieces[i].count);
+    }
+    appended_ += total;
+  }
+  // When the buffer was not empty, the background thread has already been
+  // notified and will check for more records once it is done writing.
+  if (was_empty) {
+    cond_.notify_all();
+  }
+  return true;
+}
+
+bool FdRecordWriter::Flush() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  uint64_t target = appended_;
+  cond_.wait(lock, [this, target]() { return written_ >= target; });
+  return !failed_;
+}
+
+void FdRecordWriter::Drop() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  dropped_ += 1;
+}
+
+uint64_t FdRecordWriter::Dropped() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return dropped_;
+}
+
+void FdRecordWriter::Loop() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (;;) {
+    cond_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+    if (pending_.empty()) {
+      return;  // stop_ is true and we have written everything
+    }
+    std::swap(pending_, writing_);
+    bool failed = failed_;
+    lock.unlock();
+    if (!failed) {
+      failed = !WriteAll(writing_.data(), writing_.size());
+    }
+    lock.lock();
+    failed_ = failed;
+    written_ += writing_.size();
+    writing_.clear();  // keeps the capacity
+    cond_.notify_all();  // for Flush()
+  }
+}
+
+bool FdRecordWriter::WriteAll(const char *base, size_t count) noexcept {
+  while (count > 0) {
+#ifndef _WIN32
+    ssize_t n = ::write(fd_, base, count);
+#else
+    int n = ::_write(fd_, base, (unsigned)count);
+#endif
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    base += n;
+    count -= (size_t)n;
+  }
+  return true;
+}
+
+constexpr size_t RingRecordWriter::header_size;
+constexpr uint64_t RingRecordWriter::magic;
+
+RingRecordWriter::RingRecordWriter() noexcept {}
+
+RingRecordWriter::~RingRecordWriter() noexcept { Close(); }
+
+bool RingRecordWriter::Open(const std::string &path, size_t capacity) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  Close();
+  if (capacity <= 0) {
+    return false;
+  }
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  size_t size = header_size + capacity;
+  if (::ftruncate(fd, (off_t)size) != 0) {
+    (void)::close(fd);
+    return false;
+  }
+  void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  (void)::close(fd);  // the mapping keeps a reference to the file
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  base_ = (char *)base;
+  capacity_ = capacity;
+  appended_ = 0;
+  uint64_t ring_size = capacity;
+  memcpy(base_, &magic, sizeof(magic));
+  memcpy(base_ + 8, &ring_size, sizeof(ring_size));
+  memcpy(base_ + 16, &appended_, sizeof(appended_));
+  return true;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+bool RingRecordWriter::Append(const RecordPiece *pieces,
+                              size_t count) noexcept {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += pieces[i].count;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  if (base_ == nullptr || total > capacity_) {
+    dropped_ += 1;
+    return false;
+  }
+  char *ring = base_ + header_size;
+  size_t offset = (size_t)(appended_ % capacity_);
+  for (size_t i = 0; i < count; ++i) {
+    const char *p = pieces[i].base;
+    size_t n = pieces[i].count;
+    while (n > 0) {
+      size_t chunk = (n < capacity_ - offset) ? n : capacity_ - offset;
+      memcpy(ring + offset, p, chunk);
+      p += chunk;
+      n -= chunk;
+      offset = (offset + chunk) % capacity_;
+    }
+  }
+  appended_ += total;
+  // Update appended only after the data, for readers of the file.
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(base_ + 16, &appended_, sizeof(appended_));
+  return true;
+}
+
+uint64_t RingRecordWriter::Appended() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return appended_;
+}
+
+void RingRecordWriter::Drop() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  dropped_ += 1;
+}
+
+uint64_t RingRecordWriter::Dropped() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return dropped_;
+}
+
+void RingRecordWriter::Close() noexcept {
+#ifndef _WIN32
+  if (base_ != nullptr) {
+    (void)::munmap(base_, header_size + capacity_);
+  }
+#endif
+  base_ = nullptr;
+  capacity_ = 0;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_RECORDWRITER_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
+
+// libndt/internal/admission.hpp - admission control for subtests
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// Admission limits the subtests that many clients run at the same time, such
+// that they do not compete for the CPU, the memory, and the bandwidth. Before
+// running a subtest, a client calls Acquire() with the memory the subtest is
+// going to use for its buffers, and then Release() with the same memory when
+// the subtest is done. Zero limits mean no limit. A subtest that needs more
+// memory than the limit is admitted when no other subtest is running, so that
+// it does not wait forever. It is safe to use an Admission from many threads.
+class Admission {
+ public:
+  Admission(Size max_subtests, Size max_memory) noexcept;
+  Admission(const Admission &) = delete;
+  Admission &operator=(const Admission &) = delete;
+  Admission(Admission &&) = delete;
+  Admission &operator=(Admission &&) = delete;
+  ~Admission() noexcept;
+
+  // Acquire waits until we can run a subtest using @p memory bytes. Returns
+  // false, without admitting the subtest, if @p cancelled becomes true
+  // while waiting, which we check periodically.
+  bool Acquire(Size memory, const std::atomic<bool> &cancelled) noexcept;
+
+  // Release tells us that a subtest using @p memory bytes is done.
+  void Release(Size memory) noexcept;
+
+  // Subtests returns the number of running subtests.
+  Size Subtests() const noexcept;
+
+  // Memory returns the memory used by the running subtests.
+  Size Memory() const noexcept;
+
+ private:
+  // Returns whether we can admit a subtest using @p memory bytes.
+  bool admissible(Size memory) const noexcept;
+
+  Size max_subtests_;
+  Size max_memory_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  Size subtests_ = 0;  // protected by mutex_
+  Size memory_ = 0;    // ditto
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+Admission::Admission(Size max_subtests, Size max_memory) noexcept
+    : max_subtests_{max_subtests}, max_memory_{max_memory} {}
+
+Admission::~Admission() noexcept {}
+
+bool Admission::Acquire(Size memory,
+                        const std::atomic<bool> &cancelled) noexcept {
+  // We don't expect Release() to notify a cancellation, thus we wake up
+  // periodically to check whether we've been cancelled.
+  constexpr auto slice = std::chrono::milliseconds(100);
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!admissible(memory)) {
+    if (cancelled) {
+      return false;
+    }
+    (void)cond_.wait_for(lock, slice);
+  }
+  subtests_ += 1;
+  memory_ += memory;
+  return true;
+}
+
+void Admission::Release(Size memory) noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    subtests_ = (subtests_ > 0) ? subtests_ - 1 : 0;
+    memory_ = (memory_ > memory) ? memory_ - memory : 0;
+  }
+  cond_.notify_all();
+}
+
+Size Admission::Subtests() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return subtests_;
+}
+
+Size Admission::Memory() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return memory_;
+}
+
+bool Admission::admissible(Size memory) const noexcept {
+  if (subtests_ <= 0) {
+    return true;
+  }
+  if (max_subtests_ > 0 && subtests_ >= max_subtests_) {
+    return false;
+  }
+  return max_memory_ <= 0 ||
+         (memory_ <= max_memory_ && memory <= max_memory_ - memory_);
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_ADMISSION_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
+
+// libndt/internal/convergence.hpp - throughput convergence detection
+
+#include <cmath>
+#include <deque>
+#include <utility>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// Convergence tells when the throughput measured by a subtest has stabilized,
+// such that the subtest can stop early. The subtest calls Update() at regular
+// intervals with the bytes transferred so far. We consider the latest `window`
+// seconds and compare the speed in the first half of the window with the speed
+// in the second half. The throughput has converged when the subtest has run
+// for at least `min_runtime` seconds and these speeds are within `tolerance`
+// (e.g. 0.05 for 5%) of the speed over the whole window. Since the window only
+// starts when we're out of the TCP startup phase, the speed over the window
+// is a better estimate than the average since the beginning. A zero or
+// negative `tolerance` disables the detection.
+class Convergence {
+ public:
+  Convergence(double tolerance, double window, double min_runtime) noexcept;
+
+  // Enabled returns whether the detection is enabled.
+  bool Enabled() const noexcept;
+
+  // Update records that @p bytes were transferred in the first @p elapsed
+  // seconds of the subtest and returns whether the throughput has converged.
+  bool Update(double elapsed, double bytes) noexcept;
+
+  // Speed returns the speed over the latest window, in bytes per second, or
+  // zero if we've not run for a whole window yet.
+  double Speed() const noexcept;
+
+ private:
+  double tolerance_;
+  double window_;
+  double min_runtime_;
+  double speed_ = 0.0;
+  std::deque<std::pair<double, double>> points_;  // (elapsed, bytes)
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+Convergence::Convergence(double tolerance, double window,
+                         double min_runtime) noexcept
+    : tolerance_{tolerance}, window_{window}, min_runtime_{min_runtime} {
+  points_.emplace_back(0.0, 0.0);
+}
+
+bool Convergence::Enabled() const noexcept { return tolerance_ > 0.0; }
+
+bool Convergence::Update(double elapsed, double bytes) noexcept {
+  if (!Enabled() || elapsed <= points_.back().first) {
+    return false;
+  }
+  points_.emplace_back(elapsed, bytes);
+  // Keep the newest point that is not newer than the window start, such
+  // that we know when the points fully cover the window.
+  double start = elapsed - window_;
+  while (points_.size() > 1 && points_[1].first <= start) {
+    points_.pop_front();
+  }
+  if (points_.size() < 3 || points_.front().first > start) {
+    return false;
+  }
+  auto &first = points_.front();
+  auto &last = points_.back();
+  speed_ = (last.second - first.second) / (last.first - first.first);
+  if (elapsed < min_runtime_ || speed_ <= 0.0) {
+    return false;
+  }
+  // Split the window at the inner point closest to its middle.
+  double middle = (first.first + last.first) / 2.0;
+  size_t split = 1;
+  for (size_t i = 2; i < points_.size() - 1; ++i) {
+    if (std::abs(points_[i].first - middle) <
+        std::abs(points_[split].first - middle)) {
+      split = i;
+    }
+  }
+  auto &mid = points_[split];
+  double before = (mid.second - first.second) / (mid.first - first.first);
+  double after = (last.second - mid.second) / (last.first - mid.first);
+  return std::abs(before - speed_) <= tolerance_ * speed_ &&
+         std::abs(after - speed_) <= tolerance_ * speed_;
+}
+
+double Convergence::Speed() const noexcept { return speed_; }
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_CONVERGENCE_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
+
+// libndt/internal/latency.hpp - round trip times measured under load
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// LatencySummary summarizes the round trip times collected by a Latency, in
+// microseconds. All the fields are zero when we have no round trip times.
+class LatencySummary {
+ public:
+  uint64_t count = 0;
+  uint64_t min = 0;
+  uint64_t p50 = 0;
+  uint64_t p90 = 0;
+  uint64_t p99 = 0;
+  uint64_t max = 0;
+};
+
+// Latency collects the round trip times measured while a subtest saturates
+// the path, by sending WebSocket PING frames whose payload is the time at
+// which we sent them, which the server echoes back in PONG frames. Since the
+// PONG frames are queued behind the data, these round trip times include the
+// queueing delay caused by the subtest itself. We tag our payloads with a
+// magic, such that we ignore unsolicited PONG frames. It is safe to add round
+// trip times from many threads.
+class Latency {
+ public:
+  static constexpr size_t payload_size = 16;
+  static constexpr uint64_t magic = 0x31474e495054444e;  // "NDTPING1"
+  static constexpr size_t max_samples = 1 << 16;
+
+  Latency() noexcept;
+  Latency(const Latency &) = delete;
+  Latency &operator=(const Latency &) = delete;
+  Latency(Latency &&) = delete;
+  Latency &operator=(Latency &&) = delete;
+  ~Latency() noexcept;
+
+  // Encode writes into @p base, which must be payload_size bytes, the payload
+  // of a PING frame sent at @p now_usec microseconds.
+  static void Encode(uint8_t *base, uint64_t now_usec) noexcept;
+
+  // OnPong records the round trip time of the PING echoed by the PONG frame
+  // with @p count bytes of payload at @p base, received at @p now_usec
+  // microseconds. Returns false if the PONG is not echoing one of our PINGs.
+  bool OnPong(const uint8_t *base, uint64_t count, uint64_t now_usec) noexcept;
+
+  // Add records a round trip time of @p rtt_usec microseconds. We keep the
+  // first max_samples round trip times and ignore the other ones.
+  void Add(uint64_t rtt_usec) noexcept;
+
+  // Reset forgets the round trip times recorded so far.
+  void Reset() noexcept;
+
+  // Summarize returns the summary of the round trip times recorded so far,
+  // using the nearest rank method for the percentiles.
+  LatencySummary Summarize() const noexcept;
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<uint64_t> samples_;  // protected by mutex_
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t Latency::payload_size;
+constexpr uint64_t Latency::magic;
+constexpr size_t Latency::max_samples;
+
+Latency::Latency() noexcept {}
+
+Latency::~Latency() noexcept {}
+
+void Latency::Encode(uint8_t *base, uint64_t now_usec) noexcept {
+  memcpy(base, &magic, sizeof(magic));
+  memcpy(base + sizeof(magic), &now_usec, sizeof(now_usec));
+}
+
+bool Latency::OnPong(const uint8_t *base, uint64_t count,
+                     uint64_t now_usec) noexcept {
+  uint64_t value = 0;
+  if (base == nullptr || count != payload_size) {
+    return false;
+  }
+  memcpy(&value, base, sizeof(value));
+  if (value != magic) {
+    return false;
+  }
+  memcpy(&value, base + sizeof(magic), sizeof(value));
+  if (value > now_usec) {
+    return false;  // the payload cannot come from the future
+  }
+  Add(now_usec - value);
+  return true;
+}
+
+void Latency::Add(uint64_t rtt_usec) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  if (samples_.size() < max_samples) {
+    samples_.push_back(rtt_usec);
+  }
+}
+
+void Latency::Reset() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  samples_.clear();
+}
+
+// Returns the @p percentile percentile of the sorted @p samples, which must
+// not be empty, using the nearest rank method.
+static uint64_t latency_percentile(const std::vector<uint64_t> &samples,
+                                   double percentile) noexcept {
+  double rank = std::ceil(percentile / 100.0 * (double)samples.size());
+  size_t index = (rank >= 1.0) ? (size_t)rank - 1 : 0;
+  return samples[std::min(index, samples.size() - 1)];
+}
+
+LatencySummary Latency::Summarize() const noexcept {
+  std::vector<uint64_t> samples;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    samples = samples_;
+  }
+  LatencySummary summary;
+  if (samples.empty()) {
+    return summary;
+  }
+  std::sort(samples.begin(), samples.end());
+  summary.count = samples.size();
+  summary.min = samples.front();
+  summary.p50 = latency_percentile(samples, 50.0);
+  summary.p90 = latency_percentile(samples, 90.0);
+  summary.p99 = latency_percentile(samples, 99.0);
+  summary.max = samples.back();
+  return summary;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_LATENCY_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
+
+// libndt/internal/payload.hpp - shared upload payload
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <stdint.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/random.hpp"
+#include "libndt/internal/sys.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// RandomPrintableFill fills @p buffer with @p length random printable
+// characters. The output is cheap rather than unpredictable.
+void RandomPrintableFill(char *buffer, size_t length) noexcept;
+
+// Payload is a read-only buffer of random printable characters that we use as
+// the body of the messages we upload. Since generating it is slow, Get()
+// creates it lazily and then shares it among all the flows and subtests of
+// this process. The buffer is aligned to a page boundary, hence also to a
+// cache line. On Unix, we map it with mmap(), optionally using huge pages, and
+// make it read-only once filled, such that we cannot modify it by mistake
+// (e.g. by masking it in place, which we must do for WebSocket frames).
+class Payload {
+ public:
+  Payload(const Payload &) = delete;
+  Payload &operator=(const Payload &) = delete;
+  Payload(Payload &&) = delete;
+  Payload &operator=(Payload &&) = delete;
+  ~Payload() noexcept;
+
+  // Get returns the payload of @p size bytes, creating it if needed. If
+  // @p huge_pages is true, we try to back the payload with huge pages and
+  // fall back to normal pages. Returns nullptr if @p size is zero or if we
+  // cannot allocate memory.
+  static std::shared_ptr<const Payload> Get(Size size, bool huge_pages) noexcept;
+
+  // Data returns the beginning of the payload.
+  const uint8_t *Data() const noexcept;
+
+  // Length returns the size of the payload.
+  Size Length() const noexcept;
+
+  // HugePages returns whether the payload is backed by huge pages.
+  bool HugePages() const noexcept;
+
+ private:
+  Payload() noexcept;
+
+  // Allocates and fills the payload. Returns false on failure.
+  bool init(Size size, bool huge_pages) noexcept;
+
+  uint8_t *base_ = nullptr;
+  Size size_ = 0;
+  Size mapped_ = 0;  // Size of the mapping, if we used mmap()
+  bool huge_pages_ = false;
+  std::unique_ptr<uint8_t[]> heap_;  // Only used if we cannot mmap()
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void RandomPrintableFill(char *buffer, size_t length) noexcept {
+  static const std::string ascii =
+      " !\"#$%&\'()*+,-./"          // before numbers
+      "0123456789"                  // numbers
+      ":;<=>?@"                     // after numbers
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"  // uppercase
+      "[\\]^_`"                     // between upper and lower
+      "abcdefghijklmnopqrstuvwxyz"  // lowercase
+      "{|}~"                        // final
+      ;
+  // The generator is seeded once per thread. We seed using OpenSSL because
+  // the random device is not actually random in a mingw environment. The
+  // output does not need to be unpredictable, it only needs to be cheap.
+  static thread_local std::mt19937 g{[]() noexcept {
+    uint32_t seed = 0;
+    if (!RandomBytes((uint8_t *)&seed, sizeof(seed))) {
+      seed = (uint32_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    return seed;
+  }()};
+  for (size_t i = 0; i < length; ++i) {
+    buffer[i] = ascii[g() % ascii.size()];
+  }
+}
+
+Payload::Payload() noexcept {}
+
+Payload::~Payload() noexcept {
+#ifndef _WIN32
+  if (mapped_ > 0) {
+    (void)munmap(base_, (size_t)mapped_);
+  }
+#endif
+}
+
+std::shared_ptr<const Payload> Payload::Get(Size size,
+                                            bool huge_pages) noexcept {
+  if (size <= 0 || size > SIZE_MAX / 2) {
+    return nullptr;
+  }
+  // We keep the payloads for the lifetime of the process, such that repeated
+  // runs do not pay the cost of generating them again. There are only a few
+  // distinct sizes in practice, so this does not use much memory.
+  static std::mutex mutex;
+  static std::map<std::pair<Size, bool>, std::shared_ptr<const Payload>> cache;
+  std::unique_lock<std::mutex> _{mutex};
+  auto &entry = cache[std::make_pair(size, huge_pages)];
+  if (!entry) {
+    std::shared_ptr<Payload> payload{new (std::nothrow) Payload};
+    if (!payload || !payload->init(size, huge_pages)) {
+      return nullptr;
+    }
+    entry = std::move(payload);
+  }
+  return entry;
+}
+
+const uint8_t *Payload::Data() const noexcept { return base_; }
+
+Size Payload::Length() const noexcept { return size_; }
+
+bool Payload::HugePages() const noexcept { return huge_pages_; }
+
+bool Payload::init(Size size, bool huge_pages) noexcept {
+  size_ = size;
+#ifndef _WIN32
+  auto pagesize = (Size)sysconf(_SC_PAGESIZE);
+  if (pagesize <= 0) {
+    pagesize = 4096;
+  }
+  void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    // Huge pages are usually 2 MiB and MAP_HUGETLB fails unless the system
+    // has reserved some of them, in which case we use normal pages.
+    constexpr Size hugepagesize = 2 << 20;
+    Size length = (size + hugepagesize - 1) / hugepagesize * hugepagesize;
+    base = mmap(nullptr, (size_t)length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+      mapped_ = length;
+      huge_pages_ = true;
+    }
+  }
+#endif
+  if (base == MAP_FAILED) {
+    Size length = (size + pagesize - 1) / pagesize * pagesize;
+    base = mmap(nullptr, (size_t)length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED) {
+      mapped_ = length;
+#ifdef MADV_HUGEPAGE
+      if (huge_pages) {
+        // Ask for transparent huge pages. It's just a hint.
+        (void)madvise(base, (size_t)length, MADV_HUGEPAGE);
+      }
+#endif
+    }
+  }
+  if (base != MAP_FAILED) {
+    base_ = (uint8_t *)base;
+    RandomPrintableFill((char *)base_, (size_t)size_);
+    (void)mprotect(base_, (size_t)mapped_, PROT_READ);
+    return true;
+  }
+#else
+  (void)huge_pages;
+#endif
+  // Fall back to the heap, aligning to a cache line.
+  constexpr Size alignment = 64;
+  heap_.reset(new (std::nothrow) uint8_t[(size_t)(size + alignment)]);
+  if (!heap_) {
+    return false;
+  }
+  auto address = (uintptr_t)heap_.get();
+  base_ = heap_.get() + (alignment - address % alignment) % alignment;
+  RandomPrintableFill((char *)base_, (size_t)size_);
+  return true;
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_PAYLOAD_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_TIMEOUT_HPP
+#define MEASUREMENT_KIT_LIBNDT_TIMEOUT_HPP
+
+// libndt/timeout.hpp - definition of timeout
+
+namespace measurement_kit {
+namespace libndt {
+
+/// Timeout expressed in seconds.
+using Timeout = unsigned int;
+
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_TIMEOUT_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
+#define MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
+
+// libndt/internal/mlabnscache.hpp - cache of mlab-ns results
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/assert.hpp"
+#include "libndt/internal/curlx.hpp"
+#include "libndt/internal/logger.hpp"
+#include "libndt/timeout.hpp"
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+namespace internal {
+
+// MlabnsCache caches the servers returned by mlab-ns, keyed by the URL of
+// the query, which identifies both the protocol and the policy. An entry is
+// valid for the TTL passed to Put(). Once three quarters of the TTL have
+// elapsed, Get() still returns the entry but tells the caller to refresh it,
+// which the caller can do in the background using Prefetch(). The cache also
+// keeps the idle cURL handles used to query mlab-ns, such that subsequent
+// queries reuse their connections. It is safe to use a MlabnsCache from many
+// threads.
+class MlabnsCache {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  MlabnsCache() noexcept;
+  MlabnsCache(const MlabnsCache &) = delete;
+  MlabnsCache &operator=(const MlabnsCache &) = delete;
+  MlabnsCache(MlabnsCache &&) = delete;
+  MlabnsCache &operator=(MlabnsCache &&) = delete;
+  virtual ~MlabnsCache() noexcept;
+
+  // Get copies into @p fqdns the servers cached for @p key and returns true,
+  // or returns false if there is no such entry or the entry has expired.
+  // On success, @p refresh tells whether the entry should be refreshed.
+  bool Get(const std::string &key, std::vector<std::string> *fqdns,
+           bool *refresh) noexcept;
+
+  // Put caches @p fqdns for @p key for @p ttl seconds.
+  void Put(const std::string &key, std::vector<std::string> fqdns,
+           Timeout ttl) noexcept;
+
+  // Load merges into the cache the valid entries saved at @p path by Save(),
+  // keeping the entries we already have. Returns false on I/O error.
+  bool Load(const std::string &path) noexcept;
+
+  // Save writes the valid entries to @p path. Returns false on I/O error.
+  bool Save(const std::string &path) noexcept;
+
+  // Fetch queries @p url using one of the idle cURL handles of the cache, or
+  // a new handle, which it keeps for later fetches. Concurrent fetches use
+  // distinct handles and run in parallel. See Curlx::GetMaybeSOCKS5() for
+  // the other arguments.
+  virtual bool Fetch(Curlx &curlx, const std::string &proxy_port,
+                     const std::string &url, long timeout,
+                     std::string *body) noexcept;
+
+  // Prefetch runs @p func in a detached background thread, unless a previous
+  // prefetch is still running, in which case it does nothing. Returns whether
+  // it started @p func. If the cache is shared, @p func should hold a
+  // reference to it, such that the cache outlives the thread. Otherwise, the
+  // destructor waits for the prefetch to complete.
+  bool Prefetch(std::function<void()> func) noexcept;
+
+  // Reuse at most these many idle cURL handles.
+  static constexpr size_t max_idle_handles = 4;
+
+  // Global returns the cache shared by all the clients in this process.
+  static std::shared_ptr<MlabnsCache> Global() noexcept;
+
+ protected:
+  // Now returns the current time. Override to control time in tests.
+  virtual Clock::time_point Now() const noexcept;
+
+ private:
+  struct Entry {
+    std::vector<std::string> fqdns;
+    int64_t refresh_after = 0;  // seconds since the epoch
+    int64_t expires = 0;        // ditto
+  };
+
+  int64_t now_seconds() const noexcept;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;  // protected by mutex_
+  bool prefetching_ = false;              // ditto
+  std::condition_variable prefetched_;    // signals !prefetching_
+  std::vector<UniqueCurl> handles_;       // idle, protected by mutex_
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t MlabnsCache::max_idle_handles;
+
+MlabnsCache::MlabnsCache() noexcept {}
+
+MlabnsCache::~MlabnsCache() noexcept {
+  // When the prefetch holds a reference to the cache, as it should with a
+  // shared cache, prefetching_ is already false here.
+  std::unique_lock<std::mutex> lock{mutex_};
+  prefetched_.wait(lock, [this]() { return !prefetching_; });
+}
+
+bool MlabnsCache::Get(const std::string &key, std::vector<std::string> *fqdns,
+                      bool *refresh) noexcept {
+  LIBNDT_ASSERT(fqdns != nullptr && refresh != nullptr);
+  auto now = now_seconds();
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  if (now >= it->second.expires) {
+    entries_.erase(it);
+    return false;
+  }
+  *fqdns = it->second.fqdns;
+  *refresh = now >= it->second.refresh_after;
+  return true;
+}
+
+void MlabnsCache::Put(const std::string &key, std::vector<std::string> fqdns,
+                      Timeout ttl) noexcept {
+  Entry entry;
+  entry.fqdns = std::move(fqdns);
+  auto now = now_seconds();
+  entry.refresh_after = now + (int64_t)ttl - (int64_t)ttl / 4;
+  entry.expires = now + (int64_t)ttl;
+  std::unique_lock<std::mutex> _{mutex_};
+  entries_[key] = std::move(entry);
+}
+
+// The file format is one entry per line, where each line contains the key,
+// the refresh and expiry times, and the servers, separated by spaces. None of
+// these fields can contain spaces, since they're URLs, numbers and FQDNs.
+
+bool MlabnsCache::Load(const std::string &path) noexcept {
+  std::ifstream file{path};
+  if (!file.good()) {
+    return false;
+  }
+  auto now = now_seconds();
+  std::string line;
+  std::unique_lock<std::mutex> _{mutex_};
+  while (std::getline(file, line)) {
+    std::stringstream ss{line};
+    std::string key;
+    Entry entry;
+    if (!(ss >> key >> entry.refresh_after >> entry.expires)) {
+      continue;  // Skip corrupt lines rather than failing altogether
+    }
+    std::string fqdn;
+    while (ss >> fqdn) {
+      entry.fqdns.push_back(std::move(fqdn));
+    }
+    if (now >= entry.expires || entry.fqdns.empty() ||
+        entries_.count(key) > 0) {
+      continue;
+    }
+    entries_[key] = std::move(entry);
+  }
+  return !file.bad();
+}
+
+bool MlabnsCache::Save(const std::string &path) noexcept {
+  std::stringstream ss;
+  {
+    auto now = now_seconds();
+    std::unique_lock<std::mutex> _{mutex_};
+    for (auto &kv : entries_) {
+      if (now >= kv.second.expires) {
+        continue;
+      }
+      ss << kv.first << " " << kv.second.refresh_after << " "
+         << kv.second.expires;
+      for (auto &fqdn : kv.second.fqdns) {
+        ss << " " << fqdn;
+      }
+      ss << "\n";
+    }
+  }
+  // Write a temporary file and rename it, such that concurrent writers and
+  // readers always see a complete file. Of course the last writer wins.
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream file{temp, std::ios::trunc};
+    file << ss.str();
+    if (!file.good()) {
+      return false;
+    }
+  }
+  return ::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool MlabnsCache::Fetch(Curlx &curlx, const std::string &proxy_port,
+                        const std::string &url, long timeout,
+                        std::string *body) noexcept {
+  UniqueCurl handle;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (!handles_.empty()) {
+      handle = std::move(handles_.back());
+      handles_.pop_back();
+    }
+  }
+  bool ok = curlx.GetMaybeSOCKS5(handle, proxy_port, url, timeout, body);
+  std::unique_lock<std::mutex> _{mutex_};
+  if (handle && handles_.size() < max_idle_handles) {
+    handles_.push_back(std::move(handle));
+  }
+  return ok;
+}
+
+bool MlabnsCache::Prefetch(std::function<void()> func) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  if (prefetching_) {
+    return false;
+  }
+  // We detach the thread, such that exiting does not wait for a prefetch,
+  // which may take up to the cURL timeout.
+  try {
+    std::thread{[this, func]() {
+      func();
+      std::unique_lock<std::mutex> lock{mutex_};
+      prefetching_ = false;
+      prefetched_.notify_all();
+    }}.detach();
+  } catch (const std::system_error &) {
+    return false;
+  }
+  prefetching_ = true;
+  return true;
+}
+
+std::shared_ptr<MlabnsCache> MlabnsCache::Global() noexcept {
+  // Initialization of function scope statics is thread safe in C++11.
+  static std::shared_ptr<MlabnsCache> cache{new MlabnsCache};
+  return cache;
+}
+
+MlabnsCache::Clock::time_point MlabnsCache::Now() const noexcept {
+  return Clock::now();
+}
+
+int64_t MlabnsCache::now_seconds() const noexcept {
+  return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+             Now().time_since_epoch())
+      .count();
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+}  // namespace internal
+}  // namespace libndt
+}  // namespace measurement_kit
+#endif  // MEASUREMENT_KIT_LIBNDT_INTERNAL_MLABNSCACHE_HPP
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LIBNDT_API_HPP
+#define MEASUREMENT_KIT_LIBNDT_API_HPP
+
+// TODO(bassosimone): run through cppcheck and attempt to minimize warnings.
+
+/// \file libndt.hpp
+///
+/// \brief Public header of measurement-kit/libndt. The basic usage is a simple
+/// as creating a `libndt::Client c` instance and then calling `c.run()`. More
+/// advanced usage may require you to create a subclass of `libndt::Client` and
+/// override specific virtual methods to customize the behaviour.
+///
+/// This implementation provides the C2S and S2C NDT subtests. We implement
+/// NDT over TLS and NDT over websocket. For more information on the NDT
+/// protocol, \see https://github.com/ndt-project/ndt/wiki/NDTProtocol.
+///
+/// The NDT protocol described above is version 5 (aka ndt5). The code in this
+/// library also implements the ndt7 specification, which is described at
+/// \see https://github.com/m-lab/ndt-server/blob/master/spec/ndt7-protocol.md.
+///
+/// Throughout this file, we'll use NDT to indicate ndt5 and ndt7 explicitly
+/// to indicate version 7 of the protocol. Please, use ndt7 in newer code and
+/// stick to ndt5 only if backwards compatibility is necessary.
+///
+/// \remark As a general rule, what is not documented using Doxygen comments
+/// inside of this file is considered either internal or experimental. We
+/// recommend you to only use documented interfaces.
+///
+/// Usage example follows. We assume that you have downloaded the single include
+/// headers of nlohmann/json >= 3.0.0 and of libndt.
+///
+/// ```
+/// #include "json.hpp"
+/// #include "libndt.hpp"
+/// measurement_kit::libndt::Client client;
+/// client.run();
+/// ```
+///
+/// \warning Not including nlohmann/json before including libndt will cause
+/// the build to fail, because libndt uses nlohmann/json symbols.
+///
+/// This header contains the implementation, hence you can only include it
+/// in a single translation unit. To use libndt from many translation units,
+/// compile the implementation once (e.g., using the `libndt` CMake target)
+/// and define LIBNDT_DECLARATIONS_ONLY everywhere else, such that this header
+/// only declares the API. The `LIBNDT_` macros that configure libndt, e.g.,
+/// LIBNDT_TRACING, only change the implementation, not the declarations, hence
+/// what matters is how you define them when compiling the implementation.
+/// Headers that only refer to the API by pointer or reference can include
+/// `libndt/fwd.hpp` instead.
+
+#ifndef LIBNDT_SINGLE_INCLUDE
+#include "libndt/internal/err.hpp"
+#include "libndt/internal/sys.hpp"
+#include "libndt/internal/curlx.hpp"
+#include "libndt/internal/random.hpp"
+#include "libndt/internal/wsmask.hpp"
+#include "libndt/internal/jsonscan.hpp"
+#include "libndt/internal/jsonwriter.hpp"
+#include "libndt/internal/sslcache.hpp"
+#include "libndt/internal/sockettable.hpp"
+#include "libndt/internal/uring.hpp"
+#include "libndt/internal/counters.hpp"
+#include "libndt/internal/recordwriter.hpp"
+#include "libndt/internal/admission.hpp"
+#include "libndt/internal/convergence.hpp"
+#include "libndt/internal/latency.hpp"
+#include "libndt/internal/payload.hpp"
+#include "libndt/timeout.hpp"
+#include "libndt/internal/mlabnscache.hpp"
+#endif // !LIBNDT_SINGLE_INCLUDE
+
+// Check dependencies
+// ``````````````````
+#ifndef NLOHMANN_JSON_VERSION_MAJOR
+#error "Libndt depends on nlohmann/json. Include nlohmann/json before including libndt."
+#endif  // !NLOHMANN_JSON_VERSION_MAJOR
+#if NLOHMANN_JSON_VERSION_MAJOR < 3
+#error "Libndt requires nlohmann/json >= 3"
+#endif
+
+// TODO(bassosimone): these headers should be in impl.hpp and here we
+// need to include the bare minimum required by the API
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <assert.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// kTLS needs Linux and OpenSSL >= v3.0 compiled with kTLS support.
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define LIBNDT_HAVE_KTLS
+#endif
+
+namespace measurement_kit {
+namespace libndt {
+
+// Versioning
+// ``````````
+
+/// Type containing a version number.
+using Version = unsigned int;
+
+/// Major API version number of measurement-kit/libndt.
+constexpr Version version_major = Version{0};
+
+/// Minor API version number of measurement-kit/libndt.
+constexpr Version version_minor = Version{27};
+
+/// Patch API version number of measurement-kit/libndt.
+constexpr Version version_patch = Version{0};
+
+// Flags for selecting subtests
+// ````````````````````````````
+
+/// Flags that indicate what subtests to run.
+using NettestFlags = unsigned char;
+
+constexpr NettestFlags nettest_flag_middlebox = NettestFlags{1U << 0};
+
+/// Run the upload subtest.
+constexpr NettestFlags nettest_flag_upload = NettestFlags{1U << 1};
+
+/// Run the download subtest.
+constexpr NettestFlags nettest_flag_download = NettestFlags{1U << 2};
+
+constexpr NettestFlags nettest_flag_simple_firewall = NettestFlags{1U << 3};
+
+constexpr NettestFlags nettest_flag_status = NettestFlags{1U << 4};
+
+constexpr NettestFlags nettest_flag_meta = NettestFlags{1U << 5};
+
+constexpr NettestFlags nettest_flag_upload_ext = NettestFlags{1U << 6};
+
+/// Run the multi-stream download subtest.
+constexpr NettestFlags nettest_flag_download_ext = NettestFlags{1U << 7};
+
+// Verbosity levels
+// ````````````````
+
+/// Library's logging verbosity.
+using Verbosity = unsigned int;
+
+/// Do not emit any log message.
+constexpr Verbosity verbosity_quiet = Verbosity{0};
+
+/// Emit only warning messages.
+constexpr Verbosity verbosity_warning = Verbosity{1};
+
+/// Emit warning and informational messages.
+constexpr Verbosity verbosity_info = Verbosity{2};
+
+/// Emit all log messages.
+constexpr Verbosity verbosity_debug = Verbosity{3};
+
+#ifndef LIBNDT_MAX_VERBOSITY
+#define LIBNDT_MAX_VERBOSITY verbosity_debug
+#endif
+
+/// Most verbose level of the log messages compiled into the library. Less
+/// important messages are compiled out, so they cost nothing at runtime and
+/// are never emitted, whatever Settings::verbosity. By default we compile
+/// all the messages in. To compile out, e.g., the debug messages, which
+/// are emitted for every WebSocket frame, define LIBNDT_MAX_VERBOSITY to
+/// `verbosity_info` before including libndt (or pass the LIBNDT_MAX_VERBOSITY
+/// option to CMake).
+constexpr Verbosity verbosity_max = LIBNDT_MAX_VERBOSITY;
+
+// Flags for selecting what NDT protocol features to use
+// `````````````````````````````````````````````````````
+
+/// Flags to select what protocol should be used.
+using ProtocolFlags = unsigned int;
+
+/// When this flag is set we use JSON messages. This specifically means that
+/// we send and receive JSON messages (as opposed to raw strings).
+constexpr ProtocolFlags protocol_flag_json = ProtocolFlags{1 << 0};
+
+/// When this flag is set we use TLS. This specifically means that we will
+/// use TLS channels for the control and the measurement connections.
+constexpr ProtocolFlags protocol_flag_tls = ProtocolFlags{1 << 1};
+
+/// When this flag is set we use WebSocket. This specifically means that
+/// we use the WebSocket framing to encapsulate NDT messages.
+constexpr ProtocolFlags protocol_flag_websocket = ProtocolFlags{1 << 2};
+
+/// When this flag is set, we use ndt7 rather than ndt5. This specifically
+/// means that a totally different protocol is used. You can read more on ndt7
 /// at https://github.com/m-lab/ndt-server/blob/master/spec/ndt7-protocol.md
 constexpr ProtocolFlags protocol_flag_ndt7 = ProtocolFlags{1 << 3};
 
@@ -21854,6 +24926,230 @@ constexpr MsgType msg_logout = MsgType{9};
 constexpr MsgType msg_waiting = MsgType{10};
 constexpr MsgType msg_extended_login = MsgType{11};
 
+// Samples
+// -------
+
+/// SampleTcpInfo is a snapshot of the TCP state of a flow. It contains a
+/// portable subset of Linux's tcp_info. On other systems, or if we cannot
+/// read the TCP state, `valid` is false and the other fields are zero.
+class SampleTcpInfo {
+ public:
+  /// Whether the other fields are valid.
+  bool valid = false;
+
+  /// Smoothed RTT in microseconds.
+  uint32_t rtt = 0;
+
+  /// RTT variance in microseconds.
+  uint32_t rttvar = 0;
+
+  /// Minimum RTT in microseconds.
+  uint32_t min_rtt = 0;
+
+  /// Congestion window in segments.
+  uint32_t snd_cwnd = 0;
+
+  /// Total number of retransmitted segments.
+  uint32_t total_retrans = 0;
+
+  /// Number of bytes acknowledged by the peer.
+  uint64_t bytes_acked = 0;
+
+  /// Number of bytes received from the peer.
+  uint64_t bytes_received = 0;
+
+  /// Number of bytes retransmitted.
+  uint64_t bytes_retrans = 0;
+
+  /// Bytes written by the application but not yet sent.
+  uint32_t notsent_bytes = 0;
+
+  /// Delivery rate estimate in bytes per second.
+  uint64_t delivery_rate = 0;
+};
+
+/// SampleFlow is the part of a Sample concerning a single flow.
+class SampleFlow {
+ public:
+  /// Bytes transferred by this flow since the beginning of the subtest.
+  uint64_t bytes = 0;
+
+  /// TCP state of this flow.
+  SampleTcpInfo tcp_info;
+};
+
+/// Sample is a fine grained measurement taken while running a subtest. See
+/// Settings::sample_interval and EventHandler::on_sample().
+class Sample {
+ public:
+  /// Subtest: either nettest_flag_download or nettest_flag_upload.
+  NettestFlags tid = NettestFlags{0};
+
+  /// Seconds elapsed since the beginning of the subtest.
+  double elapsed = 0.0;
+
+  /// Bytes transferred by all flows since the beginning of the subtest.
+  uint64_t bytes = 0;
+
+  /// Bytes transferred by all flows since the previous sample.
+  uint64_t bytes_delta = 0;
+
+  /// Per flow data.
+  std::vector<SampleFlow> flows;
+};
+
+/// SampleBuffer is a ring buffer containing the latest samples. See
+/// Settings::sample_buffer_size and Client::samples().
+class SampleBuffer {
+ public:
+  /// Constructs a buffer keeping the latest @p capacity samples.
+  explicit SampleBuffer(size_t capacity = 0) noexcept;
+
+  /// Adds a copy of @p sample, replacing the oldest sample if full.
+  void push(const Sample &sample) noexcept;
+
+  /// Returns the number of samples in the buffer.
+  size_t size() const noexcept;
+
+  /// Returns the maximum number of samples in the buffer.
+  size_t capacity() const noexcept;
+
+  /// Returns the @p index-th oldest sample. @p index must be less than size().
+  const Sample &at(size_t index) const noexcept;
+
+  /// Removes all the samples.
+  void clear() noexcept;
+
+  /// Writes the samples as CSV onto @p out, with a header and one row per
+  /// sample and flow. Returns whether writing succeeded.
+  bool write_csv(std::ostream &out) const noexcept;
+
+  /// Writes the samples onto @p out as JSON lines, i.e., one JSON object
+  /// per line per sample. Returns whether writing succeeded.
+  bool write_jsonl(std::ostream &out) const noexcept;
+
+ private:
+  std::vector<Sample> samples_;
+  size_t capacity_ = 0;
+  size_t next_ = 0;
+};
+
+// Counters
+// --------
+
+/// Counters is a snapshot of counters describing the work done by a client
+/// since it was constructed, as returned by Client::counters(). They allow
+/// to tell whether a slow test was slow because of the network, e.g., when
+/// most of the time was spent waiting for sockets, or because of the client
+/// host, e.g., when there were many system calls per frame.
+class Counters {
+ public:
+  /// Number of buckets of the frame size histograms. Bucket zero counts the
+  /// empty frames, bucket i counts the frames whose payload is in [2^(i-1),
+  /// 2^i) bytes, and the last bucket also counts larger frames.
+  static constexpr size_t frame_size_buckets = 26;
+
+  /// Number of I/O system calls, i.e., the sum of the following four.
+  uint64_t syscalls = 0;
+
+  /// Number of recv calls, including the ones made by OpenSSL. With kTLS,
+  /// OpenSSL reads from the socket directly, so we count one recv call for
+  /// each SSL_read call and we miss the ones made during the handshake.
+  uint64_t recv_calls = 0;
+
+  /// Number of send calls, including the ones made by OpenSSL. With kTLS,
+  /// we count one send call for each SSL_write call, as for recv_calls.
+  uint64_t send_calls = 0;
+
+  /// Number of poll calls.
+  uint64_t poll_calls = 0;
+
+  /// Number of connect calls.
+  uint64_t connect_calls = 0;
+
+  /// Number of poll calls that returned because a socket was ready rather
+  /// than because of a timeout.
+  uint64_t poll_wakeups = 0;
+
+  /// Number of SSL_read calls.
+  uint64_t ssl_read_calls = 0;
+
+  /// Number of SSL_write calls.
+  uint64_t ssl_write_calls = 0;
+
+  /// Number of times OpenSSL told us to retry once the socket is readable.
+  uint64_t ssl_want_read = 0;
+
+  /// Number of times OpenSSL told us to retry once the socket is writeable.
+  uint64_t ssl_want_write = 0;
+
+  /// Microseconds spent waiting for a socket to become readable.
+  uint64_t wait_readable_usec = 0;
+
+  /// Microseconds spent waiting for a socket to become writeable.
+  uint64_t wait_writeable_usec = 0;
+
+  /// Number of TCP connections established.
+  uint64_t connects = 0;
+
+  /// Microseconds spent establishing TCP connections, including the name
+  /// resolution, for the connections that we established.
+  uint64_t connect_usec = 0;
+
+  /// Number of TLS handshakes completed.
+  uint64_t tls_handshakes = 0;
+
+  /// Microseconds spent in the TLS handshakes that completed.
+  uint64_t tls_handshake_usec = 0;
+
+  /// Number of WebSocket handshakes completed.
+  uint64_t ws_handshakes = 0;
+
+  /// Microseconds spent in the WebSocket handshakes that completed.
+  uint64_t ws_handshake_usec = 0;
+
+  /// Histogram of the payload size of the WebSocket frames we received.
+  uint64_t recv_frame_sizes[frame_size_buckets] = {};
+
+  /// Histogram of the payload size of the WebSocket frames we sent.
+  uint64_t send_frame_sizes[frame_size_buckets] = {};
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+constexpr size_t Counters::frame_size_buckets;
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+/// TraceEventType is the type of a TraceEvent.
+enum class TraceEventType {
+  recv,            ///< A recv call. `value` is its return value.
+  send,            ///< A send call. `value` is its return value.
+  ssl_read,        ///< A SSL_read call. `value` is its return value.
+  ssl_write,       ///< A SSL_write call. `value` is its return value.
+  ssl_want_read,   ///< OpenSSL needs the socket to be readable.
+  ssl_want_write,  ///< OpenSSL needs the socket to be writeable.
+  wait_readable,   ///< We waited `value` usec for the socket to be readable.
+  wait_writeable,  ///< We waited `value` usec for the socket to be writeable.
+  connect,         ///< We connected the socket in `value` usec.
+  tls_handshake,   ///< We completed the TLS handshake in `value` usec.
+  ws_handshake,    ///< We completed the WebSocket handshake in `value` usec.
+  recv_frame,      ///< We received a frame with a `value` bytes payload.
+  send_frame,      ///< We're sending a frame with a `value` bytes payload.
+};
+
+/// TraceEvent is an event passed to EventHandler::on_trace().
+class TraceEvent {
+ public:
+  /// Type of the event.
+  TraceEventType type = TraceEventType::recv;
+
+  /// Socket the event refers to, or -1 for frames that we prepare before
+  /// knowing on which socket we'll send them.
+  internal::Socket sock = (internal::Socket)-1;
+
+  /// Value whose meaning depends on the type.
+  int64_t value = 0;
+};
+
 // EventHandler
 // ------------
 
@@ -21915,11 +25211,341 @@ class EventHandler {
   /// method could be called from another thread context.
   virtual void on_server_busy(std::string msg) noexcept = 0;
 
+  /// Called when a test started either with Client::run() or with
+  /// Client::start() completes. The default behavior is to do nothing.
+  /// @param success is true if the test succeeded and false otherwise.
+  /// \warning This method could be called from another thread context.
+  virtual void on_complete(bool success) noexcept;
+
+  /// Called every Settings::sample_interval seconds while running a subtest,
+  /// when this setting is nonzero. The default behavior is to do nothing.
+  /// Since this method could be called very frequently, it should be fast,
+  /// e.g., it should copy the parts of @p sample it's interested into. The
+  /// @p sample is only valid until this method returns. \warning This method
+  /// could be called from another thread context.
+  virtual void on_sample(const Sample &sample) noexcept;
+
+  /// Called at every I/O operation with an @p event describing it. This
+  /// method is only called if libndt was compiled with LIBNDT_TRACING defined,
+  /// otherwise tracing is compiled out. It always exists, such that the class
+  /// layout does not depend on LIBNDT_TRACING. The default behavior is to do
+  /// nothing. Since this is called very frequently, it should be very fast.
+  /// \warning This method could be called from another thread context.
+  virtual void on_trace(const TraceEvent &event) const noexcept;
+
   /// ~EventHandler is the destructor.
   virtual ~EventHandler() noexcept;
 };
+#ifndef LIBNDT_DECLARATIONS_ONLY
+void EventHandler::on_complete(bool) noexcept {}
+void EventHandler::on_sample(const Sample &) noexcept {}
+void EventHandler::on_trace(const TraceEvent &) const noexcept {}
 EventHandler::~EventHandler() noexcept {}
 
+SampleBuffer::SampleBuffer(size_t capacity) noexcept : capacity_{capacity} {}
+
+void SampleBuffer::push(const Sample &sample) noexcept {
+  if (capacity_ <= 0) {
+    return;
+  }
+  if (samples_.size() < capacity_) {
+    samples_.push_back(sample);
+    return;
+  }
+  // Copy assignment reuses the storage of the oldest sample's flows.
+  samples_[next_] = sample;
+  next_ = (next_ + 1) % capacity_;
+}
+
+size_t SampleBuffer::size() const noexcept { return samples_.size(); }
+
+size_t SampleBuffer::capacity() const noexcept { return capacity_; }
+
+const Sample &SampleBuffer::at(size_t index) const noexcept {
+  assert(index < samples_.size());
+  return samples_[(next_ + index) % samples_.size()];
+}
+
+void SampleBuffer::clear() noexcept {
+  samples_.clear();
+  next_ = 0;
+}
+
+bool SampleBuffer::write_csv(std::ostream &out) const noexcept {
+  // We restore the formatting of @p out, which belongs to the caller.
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << "tid,elapsed,bytes,bytes_delta,flow,flow_bytes,tcpi_valid,tcpi_rtt,"
+      << "tcpi_rttvar,tcpi_min_rtt,tcpi_snd_cwnd,tcpi_total_retrans,"
+      << "tcpi_bytes_acked,tcpi_bytes_received,tcpi_bytes_retrans,"
+      << "tcpi_notsent_bytes,tcpi_delivery_rate\n";
+  for (size_t i = 0; i < size(); ++i) {
+    const Sample &sample = at(i);
+    for (size_t j = 0; j < sample.flows.size(); ++j) {
+      const SampleFlow &flow = sample.flows[j];
+      const SampleTcpInfo &ti = flow.tcp_info;
+      out << (unsigned int)sample.tid << "," << std::fixed
+          << std::setprecision(6) << sample.elapsed << "," << sample.bytes
+          << "," << sample.bytes_delta << "," << j << "," << flow.bytes << ","
+          << (ti.valid ? 1 : 0) << "," << ti.rtt << "," << ti.rttvar << ","
+          << ti.min_rtt << "," << ti.snd_cwnd << "," << ti.total_retrans << ","
+          << ti.bytes_acked << "," << ti.bytes_received << ","
+          << ti.bytes_retrans << "," << ti.notsent_bytes << ","
+          << ti.delivery_rate << "\n";
+    }
+  }
+  out.flags(flags);
+  out.precision(precision);
+  return out.good();
+}
+
+bool SampleBuffer::write_jsonl(std::ostream &out) const noexcept {
+  // Like write_csv(), restore the formatting of @p out.
+  auto flags = out.flags();
+  auto precision = out.precision();
+  for (size_t i = 0; i < size(); ++i) {
+    const Sample &sample = at(i);
+    out << "{\"TestId\":" << (unsigned int)sample.tid << ",\"ElapsedTime\":"
+        << std::fixed << std::setprecision(6) << sample.elapsed
+        << ",\"NumBytes\":" << sample.bytes
+        << ",\"DeltaBytes\":" << sample.bytes_delta << ",\"Flows\":[";
+    for (size_t j = 0; j < sample.flows.size(); ++j) {
+      const SampleFlow &flow = sample.flows[j];
+      const SampleTcpInfo &ti = flow.tcp_info;
+      out << ((j > 0) ? "," : "") << "{\"NumBytes\":" << flow.bytes;
+      if (ti.valid) {
+        out << ",\"TCPInfo\":{\"RTT\":" << ti.rtt << ",\"RTTVar\":" << ti.rttvar
+            << ",\"MinRTT\":" << ti.min_rtt << ",\"SndCwnd\":" << ti.snd_cwnd
+            << ",\"TotalRetrans\":" << ti.total_retrans
+            << ",\"BytesAcked\":" << ti.bytes_acked
+            << ",\"BytesReceived\":" << ti.bytes_received
+            << ",\"BytesRetrans\":" << ti.bytes_retrans
+            << ",\"NotsentBytes\":" << ti.notsent_bytes
+            << ",\"DeliveryRate\":" << ti.delivery_rate << "}";
+      }
+      out << "}";
+    }
+    out << "]}\n";
+  }
+  out.flags(flags);
+  out.precision(precision);
+  return out.good();
+}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
+// Results sinks
+// `````````````
+
+/// ResultRecord is a measurement passed to a ResultsSink. The pointers are
+/// only valid during the ResultsSink::on_record() call.
+class ResultRecord {
+ public:
+  /// Protocol that took the measurement (e.g. "ndt7"). Like name, it is a
+  /// string literal that does not need escaping.
+  const char *scope = "";
+
+  /// Subtest that took the measurement (e.g. "download").
+  const char *name = "";
+
+  /// Index of the flow that took the measurement.
+  uint8_t flow = 0;
+
+  /// Microseconds since the Unix epoch when we got the measurement.
+  uint64_t timestamp_usec = 0;
+
+  /// The measurement, serialized as JSON, and its size.
+  const char *value = nullptr;
+  size_t value_size = 0;
+};
+
+/// ResultsSink receives the measurements as the client takes them. Unlike
+/// EventHandler::on_result(), which is only called in debug mode and receives
+/// copies of the measurements, a sink receives all measurements, pointing it
+/// to the buffers where we received or serialized them. See
+/// Settings::results_sink. \warning on_record() is called by the threads
+/// running the measurement, possibly many at the same time, hence it must
+/// be thread safe and should not block.
+class ResultsSink {
+ public:
+  /// Called for each measurement.
+  virtual void on_record(const ResultRecord &record) noexcept = 0;
+
+  /// ~ResultsSink is the destructor.
+  virtual ~ResultsSink() noexcept;
+};
+
+/// JsonLinesSink writes each record onto a file descriptor as a JSON object
+/// followed by a newline, i.e., as JSON lines, like
+///
+/// ```
+/// {"Scope":"ndt7","Name":"download","Flow":0,"Time":...,"Value":{...}}
+/// ```
+///
+/// where Time is timestamp_usec and Value is the measurement. on_record()
+/// copies the record into a buffer and a background thread writes it to the
+/// file descriptor. If the buffer is full, e.g., because the file descriptor
+/// is a slow socket, we drop records rather than slowing down the test. We
+/// also drop the records whose value contains control characters, e.g., the
+/// newlines of pretty printed JSON, which would break the framing.
+class JsonLinesSink : public ResultsSink {
+ public:
+  /// Default size of the buffer.
+  static constexpr size_t default_buffer_size = 1 << 20;
+
+  /// Writes onto @p fd, which we close when destroyed if @p close_fd is
+  /// true, using a buffer of @p buffer_size bytes.
+  JsonLinesSink(int fd, bool close_fd,
+                size_t buffer_size = default_buffer_size) noexcept;
+
+  void on_record(const ResultRecord &record) noexcept override;
+
+  /// Waits until all records have been written. Returns false if we could
+  /// not write onto the file descriptor.
+  bool flush() noexcept;
+
+  /// Returns the number of records we dropped because the buffer was full
+  /// or because their value contained control characters.
+  uint64_t dropped() const noexcept;
+
+  /// ~JsonLinesSink writes the buffered records.
+  ~JsonLinesSink() noexcept override;
+
+ private:
+  internal::FdRecordWriter writer_;
+};
+
+/// RingFileSink writes the records, formatted like JsonLinesSink does, into
+/// a fixed size file mapped in memory and used as a ring buffer, such that the
+/// file always contains the latest records, and the kernel writes them to disk
+/// in the background. See internal::RingRecordWriter for the file format. Not
+/// available on Windows.
+class RingFileSink : public ResultsSink {
+ public:
+  /// Default size of the ring.
+  static constexpr size_t default_ring_size = 16 << 20;
+
+  /// RingFileSink drops all records until you open() it.
+  RingFileSink() noexcept;
+
+  /// Creates, or truncates, @p path and uses it as a ring of @p ring_size
+  /// bytes. Returns false on failure.
+  bool open(const std::string &path,
+            size_t ring_size = default_ring_size) noexcept;
+
+  void on_record(const ResultRecord &record) noexcept override;
+
+  /// Returns the number of records we dropped, because we were not open,
+  /// because they were larger than the ring, or because their value contained
+  /// control characters (see JsonLinesSink).
+  uint64_t dropped() const noexcept;
+
+  /// ~RingFileSink is the destructor.
+  ~RingFileSink() noexcept override;
+
+ private:
+  internal::RingRecordWriter writer_;
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+ResultsSink::~ResultsSink() noexcept {}
+
+// Formats the part of the JSON line of @p record preceding the value into
+// @p base and @p count and returns its length, or zero on failure.
+static internal::Size format_record_prefix(const ResultRecord &record,
+                                           char *base,
+                                           internal::Size count) noexcept {
+  internal::JsonWriter writer{base, count};
+  writer.Raw("{\"Scope\":\"");
+  writer.Raw(record.scope);
+  writer.Raw("\",\"Name\":\"");
+  writer.Raw(record.name);
+  writer.Raw("\",\"Flow\":");
+  writer.Uint64(record.flow);
+  writer.Raw(",\"Time\":");
+  writer.Uint64(record.timestamp_usec);
+  writer.Raw(",\"Value\":");
+  return writer.Good() ? writer.Length() : 0;
+}
+
+// Returns whether the value of @p record contains control characters, e.g.,
+// the newlines of pretty printed JSON sent by the server, which would break
+// the one record per line framing. Since JSON strings cannot contain control
+// characters, compact JSON does not contain any.
+static bool record_has_control_characters(const ResultRecord &record) noexcept {
+  for (size_t i = 0; i < record.value_size; ++i) {
+    if ((unsigned char)record.value[i] < 0x20) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Prepares in @p pieces the three pieces of the JSON line of @p record, using
+// @p prefix, of @p count bytes, for the prefix. Returns false on failure.
+static bool prepare_record_pieces(const ResultRecord &record, char *prefix,
+                                  internal::Size count,
+                                  internal::RecordPiece *pieces) noexcept {
+  internal::Size length = format_record_prefix(record, prefix, count);
+  if (length <= 0 || record.value == nullptr || record.value_size <= 0) {
+    return false;
+  }
+  pieces[0].base = prefix;
+  pieces[0].count = (size_t)length;
+  pieces[1].base = record.value;
+  pieces[1].count = record.value_size;
+  pieces[2].base = "}\n";
+  pieces[2].count = 2;
+  return true;
+}
+
+constexpr size_t JsonLinesSink::default_buffer_size;
+
+JsonLinesSink::JsonLinesSink(int fd, bool close_fd, size_t buffer_size) noexcept
+    : writer_{fd, close_fd, buffer_size} {}
+
+void JsonLinesSink::on_record(const ResultRecord &record) noexcept {
+  if (record.value != nullptr && record_has_control_characters(record)) {
+    writer_.Drop();
+    return;
+  }
+  char prefix[256];
+  internal::RecordPiece pieces[3];
+  if (prepare_record_pieces(record, prefix, sizeof(prefix), pieces)) {
+    (void)writer_.Append(pieces, 3);
+  }
+}
+
+bool JsonLinesSink::flush() noexcept { return writer_.Flush(); }
+
+uint64_t JsonLinesSink::dropped() const noexcept { return writer_.Dropped(); }
+
+JsonLinesSink::~JsonLinesSink() noexcept {}
+
+constexpr size_t RingFileSink::default_ring_size;
+
+RingFileSink::RingFileSink() noexcept {}
+
+bool RingFileSink::open(const std::string &path, size_t ring_size) noexcept {
+  return writer_.Open(path, ring_size);
+}
+
+void RingFileSink::on_record(const ResultRecord &record) noexcept {
+  if (record.value != nullptr && record_has_control_characters(record)) {
+    writer_.Drop();
+    return;
+  }
+  char prefix[256];
+  internal::RecordPiece pieces[3];
+  if (prepare_record_pieces(record, prefix, sizeof(prefix), pieces)) {
+    (void)writer_.Append(pieces, 3);
+  }
+}
+
+uint64_t RingFileSink::dropped() const noexcept { return writer_.Dropped(); }
+
+RingFileSink::~RingFileSink() noexcept {}
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
 // Settings
 // ````````
 
@@ -21938,9 +25564,76 @@ class Settings {
   /// geo_options policy that is the most robust to random server failures.
   MlabnsPolicy mlabns_policy = mlabns_policy_geo_options;
 
+  /// For how many seconds to reuse the servers returned by mlab-ns for the
+  /// same protocol and policy. When three quarters of this time have elapsed,
+  /// we refresh the servers in the background. Zero, the default, disables
+  /// the cache, such that every test queries mlab-ns.
+  Timeout mlabns_cache_ttl = Timeout{0} /* seconds */;
+
+  /// Path of the file where to persist the mlab-ns cache, such that the servers
+  /// survive across processes. If empty, the default, the cache only lives in
+  /// memory. Only meaningful when mlabns_cache_ttl is nonzero.
+  std::string mlabns_cache_path;
+
   /// Timeout used for I/O operations.
   Timeout timeout = Timeout{7} /* seconds */;
 
+  /// Interval between on_performance() calls, in seconds. This is also the
+  /// interval between the ndt7 upload measurements we send to the server.
+  /// Values not greater than zero select the default.
+  double measurement_interval = 0.25 /* seconds */;
+
+  /// Interval between on_sample() calls, in seconds. Zero, the default,
+  /// disables sampling. Sampling is separate from on_performance(), so that
+  /// you can sample at a much higher rate, e.g. every 10 ms, without the
+  /// cost of formatting and emitting progress messages each time.
+  double sample_interval = 0.0 /* seconds */;
+
+  /// Number of samples to keep in the ring buffer returned by samples().
+  /// Zero, the default, disables the buffer. Only meaningful when the
+  /// sample_interval is nonzero.
+  size_t sample_buffer_size = 0;
+
+  /// Size of the buffer of random data that we upload, in bytes. It is
+  /// created once and shared by all the upload flows and subtests. The ndt5
+  /// upload sends the whole buffer with each send, while ndt7 upload messages
+  /// send a slice of it (so sizes smaller than such slice are rounded up).
+  size_t upload_payload_size = 131072;
+
+  /// Whether to try to back the upload buffer with huge pages, which may
+  /// reduce TLB misses when sending at high speed. If the system does not
+  /// have huge pages, we silently fall back to normal pages.
+  bool upload_payload_huge_pages = false;
+
+  /// Size of the messages sent by the ndt7 upload, in bytes. The default is
+  /// the initial size suggested by the ndt7 specification. Messages are slices
+  /// of the upload payload, which we enlarge if needed, and cannot be larger
+  /// than 16 MiB, the maximum size of ndt7 messages.
+  size_t ndt7_upload_message_size = 1 << 13;
+
+  /// Whether to grow the ndt7 upload messages as the upload progresses, as
+  /// suggested by the ndt7 specification: we double the size of messages
+  /// every time the bytes sent so far exceed sixteen times such size, until
+  /// the messages are as large as the upload payload. Larger messages reduce
+  /// the per message overhead, which matters on fast paths. You may want to
+  /// also increase upload_payload_size, so that messages can grow more.
+  bool ndt7_adaptive_message_size = false;
+
+  /// Size of the socket send buffer (SO_SNDBUF), in bytes. Zero, the default,
+  /// leaves the system default, which usually means autotuning.
+  int socket_send_buffer = 0;
+
+  /// Size of the socket receive buffer (SO_RCVBUF), in bytes. We set this
+  /// before connecting, since it determines the TCP window scale. Zero, the
+  /// default, leaves the system default, which usually means autotuning.
+  int socket_recv_buffer = 0;
+
+  /// Value of TCP_NOTSENT_LOWAT, in bytes, i.e., how much unsent data the
+  /// kernel should keep in the send buffer before telling us the socket is
+  /// writable. Zero, the default, leaves the system default. Not available
+  /// on all systems.
+  int tcp_notsent_lowat = 0;
+
   /// Host name of the NDT server to use. If this is left blank (the default),
   /// we will use mlab-ns to discover a nearby server.
   std::string hostname;
@@ -21977,6 +25670,43 @@ class Settings {
   /// than anticipated, due to buffering and/or changing network conditions.
   Timeout max_runtime = Timeout{14} /* seconds */;
 
+  /// Tolerance for stopping the ndt7 download early, once the throughput has
+  /// converged, as a fraction of the speed (e.g. 0.05 for 5%). We consider
+  /// the latest convergence_window seconds and stop, closing the WebSocket
+  /// cleanly, when the speeds in the two halves of the window are within this
+  /// tolerance of the speed over the whole window. In such case, the download
+  /// speed is the speed over the window, which does not include the TCP
+  /// startup phase. Zero, the default, disables early termination.
+  double convergence_tolerance = 0.0;
+
+  /// Width of the window used to detect convergence, in seconds.
+  double convergence_window = 2.0 /* seconds */;
+
+  /// Minimum runtime of a download that stops early, in seconds.
+  double convergence_min_runtime = 4.0 /* seconds */;
+
+  /// Whether to speculatively connect to the next ndt7 server returned by
+  /// mlab-ns while trying the current one. When we cannot connect to the
+  /// current server, we always try the next one, and with this option the
+  /// connection is likely already established, so that a busy or dead server
+  /// does not delay the test by several seconds. When we connect to the
+  /// current server, we close the speculative connection. Disabled by
+  /// default, since it wastes a connection to a server most of the times.
+  bool ndt7_preconnect = false;
+
+  /// Interval, in seconds, between the round trip time measurements taken
+  /// during the ndt7 download and upload. We send a WebSocket PING frame
+  /// containing the current time over each connection and the server echoes
+  /// it back in a PONG frame. Since the PONG waits behind the data queued
+  /// along the path, these measurements show the latency under load, e.g.,
+  /// caused by bufferbloat. At the end of each subtest, we pass a summary of
+  /// the round trip times to on_result(). Zero, the default, disables these
+  /// measurements, which rely on the server replying to PING frames, as
+  /// required by RFC6455. While uploading, we read the PONG frames between
+  /// messages, hence, with ndt7_adaptive_message_size, the round trip times
+  /// may include up to the time needed to send a message.
+  double ndt7_latency_interval = 0.0;
+
   /// SOCKSv5h port to use for tunnelling traffic using, e.g., Tor. If non
   /// empty, all DNS and TCP traffic should be tunnelled over such port.
   std::string socks5h_port;
@@ -21994,15 +25724,48 @@ class Settings {
   /// not disable this option in general, since doing that is insecure.
   bool tls_verify_peer = true;
 
+  /// Whether to offload TLS to the kernel (kTLS), when the kernel supports
+  /// it for the negotiated cipher. This saves a lot of CPU at high speed,
+  /// especially when uploading, because we then send data using plain socket
+  /// writes and the kernel encrypts it. Only available on Linux with OpenSSL
+  /// v3.0 or newer. Disabled by default. When kTLS cannot be enabled, we
+  /// silently fall back to doing TLS in userspace.
+  bool tls_ktls = false;
+
+  /// Whether to receive the data of the download subtests using io_uring,
+  /// where the kernel keeps receiving into buffers we provide, so that we
+  /// don't need a system call per receive. This saves CPU when running many
+  /// flows at high speed. Only available on Linux 6.0 or newer, if libndt
+  /// has been compiled with LIBNDT_HAVE_IO_URING. Disabled by default. When
+  /// we cannot use io_uring, we silently fall back to using recv(2), which
+  /// also happens for the connections using kTLS (see tls_ktls).
+  bool io_uring = false;
+
   /// Run in "summary only" mode. If this flag is enabled, most log messages are
   /// hidden and the only output on stdout is the test summary.
   bool summary_only = false;
+
+  /// Number of parallel connections used by the ndt7 download and upload
+  /// subtests. The default is to use a single connection, as mandated by the
+  /// ndt7 specification. More connections may be needed to saturate paths
+  /// with a large bandwidth-delay product.
+  uint8_t ndt7_nflows = 1;
+
+  /// Sink receiving the ndt7 measurements as we take them, if not null. See
+  /// ResultsSink. The sink may be shared by many clients.
+  std::shared_ptr<ResultsSink> results_sink;
 };
 
 
 // Client
 // ``````
 
+class Ndt7Flow;
+class Ndt7Preconnect;
+class Ndt7Subtest;
+class SocketVector;
+class WsReader;
+
 /// NDT client. In the typical usage, you just need to construct a Client,
 /// optionally providing settings, and to call the run() method. More advanced
 /// usage may require you to override methods in a subclass to customize the
@@ -22035,6 +25798,47 @@ class Client : public EventHandler {
   /// Runs a NDT test using the configured (or default) settings.
   bool run() noexcept;
 
+  /// Starts a NDT test without running it. You then drive the test by
+  /// calling step() until it returns false, waiting for the sockets and the
+  /// deadline returned by poll_fds() in between, and you can cancel() it at
+  /// any time. Returns false if a test is already running.
+  bool start() noexcept;
+
+  /// Advances the test started by start() without blocking for long. The
+  /// ndt7 subtests run a bit at a time, using non-blocking I/O, and so do
+  /// the reads of the ndt5 control messages, once poll_fds() says that they
+  /// are readable. The phases that we cannot run a bit at a time, i.e., the
+  /// mlab-ns query, the connects, and the ndt5 subtests, run in a worker
+  /// thread, whose completion a later step() notices, hence the EventHandler
+  /// methods may also be called from such thread. Returns true if you should
+  /// call step() again and false once the test is complete, in which case
+  /// on_complete() was called.
+  bool step() noexcept;
+
+  /// Fills @p pfds with the sockets, and the events, that the next step()
+  /// waits for and returns the milliseconds after which you should call
+  /// step() anyway, e.g. to take a measurement, or -1 if there is no such
+  /// deadline. A zero return value means that you should call step() now.
+  /// While the worker thread is running and during the ndt7 subtests using
+  /// many flows, which background threads run, there is no socket to wait
+  /// for, and we return the time of the next check.
+  int poll_fds(std::vector<pollfd> *pfds) const noexcept;
+
+  /// Returns the socket that the next step() waits for to be readable, if
+  /// that is the only socket returned by poll_fds(), and -1 otherwise, e.g.
+  /// when there is no socket to wait for. Prefer poll_fds(), which also
+  /// tells you when to call step() if no socket becomes ready.
+  internal::Socket poll_fd() const noexcept;
+
+  /// Cancels the running test. This method can be called from any thread.
+  /// The running phase, including the mlab-ns query, notices within about a
+  /// second and fails. Then, the next step() completes the test with failure.
+  void cancel() noexcept;
+
+  /// Returns whether the latest test, started with run() or with start(),
+  /// has completed successfully.
+  bool succeeded() const noexcept;
+
   void on_warning(const std::string &s) const noexcept override;
 
   void on_info(const std::string &s) const noexcept override;
@@ -22052,6 +25856,15 @@ class Client : public EventHandler {
 
   void on_server_busy(std::string msg) noexcept override;
 
+  void on_complete(bool success) noexcept override;
+
+  /// Returns the latest samples (see Settings::sample_buffer_size).
+  const SampleBuffer &samples() const noexcept;
+
+  /// Returns a snapshot of the counters. This method can be called from any
+  /// thread, including while a test is running.
+  Counters counters() const noexcept;
+
   /*
                _        __             _    _ _                _
    ___ _ _  __| |  ___ / _|  _ __ _  _| |__| (_)__   __ _ _ __(_)
@@ -22072,6 +25885,17 @@ class Client : public EventHandler {
  private:
 #endif
 
+  // drive runs the test started by start() until it is complete, in this
+  // thread, waiting with step_wait() between steps, and returns whether the
+  // test succeeded. Unlike when the caller drives the test with step(), we
+  // don't use the worker thread, hence the phases that run in it block. This
+  // is how run() and the Runner work.
+  bool drive() noexcept;
+
+  // step_wait waits for the sockets and the deadline returned by poll_fds(),
+  // for at most step_wait_msec, so that we notice cancel() meanwhile.
+  void step_wait() noexcept;
+
   // High-level API
   virtual void summary() noexcept;
   virtual bool query_mlabns(std::vector<std::string> *) noexcept;
@@ -22090,6 +25914,13 @@ class Client : public EventHandler {
   virtual bool run_meta() noexcept;
   virtual bool run_upload() noexcept;
 
+  // run_flows runs the @p tid subtest over all the sockets in @p socks using
+  // a single thread and netx_poll() to wait for the sockets to be ready. It
+  // returns in @p total_data the bytes transferred and in @p elapsed the
+  // seconds elapsed. An error in a flow stops that flow but not the others.
+  virtual void run_flows(NettestFlags tid, const SocketVector &socks,
+                         double *total_data, double *elapsed) noexcept;
+
   // ndt7 protocol API
   // `````````````````
   //
@@ -22099,15 +25930,190 @@ class Client : public EventHandler {
   // Note that we cannot have ndt7 without OpenSSL.
 
   // ndt7_download performs a ndt7 download. Returns true if the download
-  // succeeds and false in case of failure.
+  // succeeds and false in case of failure. Unlike step(), which runs the
+  // download a bit at a time, this method blocks until it is complete.
   bool ndt7_download() noexcept;
 
   // ndt7_upload is like ndt7_download but performs an upload.
   bool ndt7_upload() noexcept;
 
+  // ndt7_run_subtest runs the @p tid ndt7 subtest until it is complete,
+  // waiting for the network with step_wait(), and returns whether it
+  // succeeds. This is how ndt7_download() and ndt7_upload() work.
+  bool ndt7_run_subtest(NettestFlags tid) noexcept;
+
+  // The following methods run the @p tid ndt7 subtest a bit at a time, such
+  // that step() does not block for long. ndt7_subtest_begin() prepares the
+  // state of the subtest, ndt7_subtest_dial() connects, which may block, and
+  // ndt7_subtest_start() prepares the buffers and starts the flows. Then,
+  // ndt7_subtest_resume() advances the subtest and returns
+  // Err::operation_would_block until it is complete, or the error that
+  // occurred. Meanwhile, ndt7_subtest_poll_fds() tells what to wait for.
+  // Finally, ndt7_subtest_finish() stops the flows, reports the results, and
+  // returns @p ok, which tells whether the subtest succeeded.
+  void ndt7_subtest_begin(NettestFlags tid) noexcept;
+  bool ndt7_subtest_dial() noexcept;
+  bool ndt7_subtest_start() noexcept;
+  internal::Err ndt7_subtest_resume() noexcept;
+  int ndt7_subtest_poll_fds(std::vector<pollfd> *pfds) const noexcept;
+  bool ndt7_subtest_finish(bool ok) noexcept;
+
+  // ndt7_subtest_stop tells the background threads of the ndt7 subtest that
+  // is running, if any, to stop, waits for them, and destroys the state of
+  // the subtest, without reporting its results.
+  void ndt7_subtest_stop() noexcept;
+
+  // ndt7_download_resume and ndt7_upload_resume implement
+  // ndt7_subtest_resume() for a single flow, using non-blocking I/O.
+  internal::Err ndt7_download_resume() noexcept;
+  internal::Err ndt7_upload_resume() noexcept;
+
+  // ndt7_multi_start and ndt7_multi_resume implement ndt7_subtest_start()
+  // and ndt7_subtest_resume() for ndt7_nflows parallel connections, each one
+  // handled by a background thread.
+  bool ndt7_multi_start() noexcept;
+  internal::Err ndt7_multi_resume() noexcept;
+
+  // ndt7_on_download_measurement processes the measurement of @p size bytes
+  // at @p data sent by the server over the flow with index @p flow. We only
+  // extract the fields needed by the summary from the measurement, and save
+  // a copy of it for ndt7_materialize_flows().
+  void ndt7_on_download_measurement(uint8_t flow, const char *data,
+                                    size_t size) noexcept;
+
+  // Ndt7UploadSample contains the TCPInfo counters of an upload measurement
+  // that we need for the summary, so that we don't need to parse the JSON.
+  struct Ndt7UploadSample {
+    bool has_tcpinfo = false;
+    uint64_t bytes_retrans = 0;
+    uint64_t bytes_sent = 0;
+  };
+
+  // ndt7_upload_message_size returns the size of the next ndt7 upload
+  // message, given that messages are slices of @p payload, the @p current
+  // message size (zero for the first message), and the @p total bytes
+  // sent so far (see Settings::ndt7_adaptive_message_size).
+  internal::Size ndt7_upload_message_size(const internal::Payload &payload,
+                                          internal::Size current,
+                                          internal::Size total) const noexcept;
+
+  // ndt7_upload_measurement writes into the @p count bytes at @p base the
+  // JSON measurement of the upload flow using @p sock, which has been running
+  // for @p elapsed seconds sending @p total bytes, and fills @p sample. It
+  // returns the size of the JSON, or zero if @p count is too small. This
+  // method is called by the background threads.
+  internal::Size ndt7_upload_measurement(internal::Socket sock, double elapsed,
+                                         internal::Size total, char *base,
+                                         internal::Size count,
+                                         Ndt7UploadSample *sample) const noexcept;
+
+  // ndt7_on_upload_measurement processes the measurement of @p size bytes at
+  // @p json, which we have taken (and sent to the server) for flow @p flow,
+  // along with its @p sample.
+  void ndt7_on_upload_measurement(uint8_t flow, const char *json, size_t size,
+                                  const Ndt7UploadSample &sample) noexcept;
+
+  // ndt7_emit_record passes the JSON measurement of @p size bytes at @p data,
+  // taken by the flow @p flow of the subtest @p name, to the results sink,
+  // if any, without copying it.
+  void ndt7_emit_record(const char *name, uint8_t flow, const char *data,
+                        size_t size) const noexcept;
+
+  // ndt7_send_measurement sends the measurement of @p count bytes written at
+  // offset ws_max_header_size of @p buffer, masking it in place. A zero
+  // @p count means that the measurement did not fit its buffer, in which
+  // case we skip it rather than failing the subtest.
+  internal::Err ndt7_send_measurement(internal::Socket sock, uint8_t *buffer,
+                                      internal::Size count) const noexcept;
+
+  // ndt7_maybe_ping sends a WebSocket PING frame over @p sock, to measure the
+  // round trip time, if Settings::ndt7_latency_interval seconds have elapsed
+  // between @p *latest and @p now, in which case it sets @p *latest to @p now
+  // and, unless @p pinging is null, @p *pinging to true. This method is
+  // called by the background threads.
+  internal::Err ndt7_maybe_ping(
+      internal::Socket sock, std::chrono::steady_clock::time_point now,
+      std::chrono::steady_clock::time_point *latest,
+      bool *pinging) const noexcept;
+
+  // ndt7_recv_pongs reads the WebSocket frames already received over @p sock
+  // into the @p total bytes at @p base, without waiting for more frames, if
+  // @p *pinging is true, and sets @p *pinging to false once it receives the
+  // PONG of our PING. We use it in the upload flows, to process the PONG
+  // frames without polling the socket before each message, and we ignore
+  // the measurements sent by the server. This method is called by the
+  // background threads.
+  internal::Err ndt7_recv_pongs(internal::Socket sock, uint8_t *base,
+                                internal::Size total,
+                                bool *pinging) const noexcept;
+
+  // ndt7_report_latency stores into @p summary the summary of the round trip
+  // times measured by the subtest @p name and, if any, reports it.
+  void ndt7_report_latency(const char *name,
+                           internal::LatencySummary *summary) noexcept;
+
+  // ndt7_materialize_flows parses the latest measurement of each flow of the
+  // subtest that just completed into @p flows, which is download_flows_ or
+  // upload_flows_. For the download, it also fills measurement_ and
+  // connection_info_. This way we parse the measurements' JSON just once.
+  void ndt7_materialize_flows(nlohmann::json *flows) noexcept;
+
+  // ndt7_drain_flows processes the measurements queued by the background
+  // threads running the @p tid subtest using @p flows.
+  void ndt7_drain_flows(NettestFlags tid,
+                        std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept;
+
+  // ndt7_sum_flows returns the bytes transferred so far by all @p flows.
+  static uint64_t ndt7_sum_flows(
+      const std::vector<std::unique_ptr<Ndt7Flow>> &flows) noexcept;
+
+  // ndt7_dial_flows creates @p nflows connections to @p url_path. It adds
+  // the sockets to @p socks, which owns them, and their state to @p flows.
+  bool ndt7_dial_flows(std::string url_path, uint8_t nflows,
+                       SocketVector *socks,
+                       std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept;
+
   // ndt7_connect connects to @p url_path.
   bool ndt7_connect(std::string url_path) noexcept;
 
+  // ndt7_dial creates a new connection to @p url_path in @p sock. If we have
+  // speculatively connected to @p url_path on the current host, it uses such
+  // connection. Otherwise, it dials and, on success, closes all the other
+  // speculative connections, since we won't need them.
+  bool ndt7_dial(std::string url_path, internal::Socket *sock) noexcept;
+
+  // ndt7_preconnect_next speculatively connects to @p url_path on the host
+  // we would try next, in a background thread, if Settings::ndt7_preconnect
+  // is set and we're not already doing that.
+  void ndt7_preconnect_next(std::string url_path) noexcept;
+
+  // ndt7_preconnect_take waits for the speculative connection to @p url_path
+  // on the current host and moves it into @p sock. Returns false if there is
+  // no such connection or if the speculative connect failed.
+  bool ndt7_preconnect_take(const std::string &url_path,
+                            internal::Socket *sock) noexcept;
+
+  // ndt7_preconnect_abandon abandons all the speculative connections, which
+  // are closed as soon as they are established, and cancels the clients
+  // that are still connecting.
+  void ndt7_preconnect_abandon() noexcept;
+
+  // ndt7_preconnect_stop waits for the background threads of all the
+  // speculative connections and closes the connections.
+  void ndt7_preconnect_stop() noexcept;
+
+  // ndt7_preconnect_client creates the client that speculatively connects
+  // using @p settings. We use a distinct client because its state is not
+  // shared with the background thread, which can thus connect while we
+  // are connecting, or running a subtest, in this client. Then, we make it
+  // share our caches and admission.
+  virtual std::unique_ptr<Client> ndt7_preconnect_client(
+      Settings settings) noexcept;
+
+  // ndt7_adopt moves the state of @p sock, which @p other has connected,
+  // into this client, such that @p sock belongs to this client.
+  void ndt7_adopt(Client *other, internal::Socket sock) noexcept;
+
   // NDT protocol API
   // ````````````````
   //
@@ -22157,26 +26163,46 @@ class Client : public EventHandler {
 
   // Prepare and return a WebSocket frame containing @p first_byte and
   // the content of @p base and @p count as payload. If @p base is nullptr
-  // then we'll just not include a body in the prepared frame.
+  // then we'll just not include a body in the prepared frame. Returns an
+  // empty string if we cannot generate a masking key.
   virtual std::string ws_prepare_frame(uint8_t first_byte, uint8_t *base,
                                        internal::Size count) const noexcept;
 
+  // Prepare a WebSocket frame in place. @p buffer is a caller owned buffer
+  // whose first ws_max_header_size bytes are reserved for the header and
+  // are followed by @p count bytes of payload. We mask the payload in place
+  // and write the header right before it, such that the frame is contiguous
+  // and can be sent with a single write. On success, @p *frame points to the
+  // beginning of the frame and @p *framelen contains its size. Each call uses
+  // a fresh masking key, so call this method again before sending the same
+  // buffer again (masking the already masked payload is fine, since its
+  // content is random anyway).
+  virtual internal::Err ws_prepare_frame_inplace(
+      uint8_t first_byte, uint8_t *buffer, internal::Size count,
+      uint8_t **frame, internal::Size *framelen) const noexcept;
+
   // Send @p count bytes from @p base over @p sock as a frame whose first byte
-  // @p first_byte should contain the opcode and possibly the FIN flag.
+  // @p first_byte should contain the opcode and possibly the FIN flag. Note
+  // that the content of @p base is masked in place.
   virtual internal::Err ws_send_frame(internal::Socket sock, uint8_t first_byte, uint8_t *base,
                             internal::Size count) const noexcept;
 
   // Receive a frame from @p sock. Puts the opcode in @p *opcode. Puts whether
   // there is a FIN flag in @p *fin. The buffer starts at @p base and it
   // contains @p total bytes. Puts in @p *count the actual number of bytes
-  // in the message. @return The error that occurred or Err::none.
+  // in the message. If @p discard is true, the body of binary and continue
+  // frames is read and thrown away rather than stored into @p base, and it is
+  // then not required to fit into @p total bytes. @return The error that
+  // occurred or Err::none.
   internal::Err ws_recv_any_frame(internal::Socket sock, uint8_t *opcode, bool *fin, uint8_t *base,
-                        internal::Size total, internal::Size *count) const noexcept;
+                        internal::Size total, internal::Size *count,
+                        bool discard) const noexcept;
 
   // Receive a frame. Automatically and transparently responds to PING, ignores
   // PONG, and handles CLOSE frames. Arguments like ws_recv_any_frame().
   internal::Err ws_recv_frame(internal::Socket sock, uint8_t *opcode, bool *fin, uint8_t *base,
-                    internal::Size total, internal::Size *count) const noexcept;
+                    internal::Size total, internal::Size *count,
+                    bool discard) const noexcept;
 
   // Receive a message consisting of one or more frames. Transparently handles
   // PING and PONG frames. Handles CLOSE frames. @param sock is the socket to
@@ -22187,6 +26213,86 @@ class Client : public EventHandler {
   internal::Err ws_recvmsg(internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
                  internal::Size *count) const noexcept;
 
+  // Like ws_recvmsg() except that the payload of binary messages is read and
+  // thrown away, so @p base and @p total only need to be large enough for
+  // text messages and control frames. The size of binary messages is still
+  // returned in @p *count. This is meant for measurement payload, which we
+  // only need to count.
+  internal::Err ws_recvmsg_discard(internal::Socket sock, uint8_t *opcode,
+                                   uint8_t *base, internal::Size total,
+                                   internal::Size *count) const noexcept;
+
+  // Implementation of ws_recvmsg() and ws_recvmsg_discard().
+  internal::Err ws_recvmsg_common(internal::Socket sock, uint8_t *opcode,
+                                  uint8_t *base, internal::Size total,
+                                  internal::Size *count,
+                                  bool discard) const noexcept;
+
+  // Starts the closing handshake by sending a CLOSE frame over @p sock and
+  // then discards the incoming frames until the peer replies with CLOSE. The
+  // buffer at @p base of size @p total is used to receive the text and
+  // control frames, while the body of binary frames is thrown away. @return
+  // Err::none once we received CLOSE, or the error that occurred.
+  internal::Err ws_close(internal::Socket sock, uint8_t *base,
+                         internal::Size total) const noexcept;
+
+  // Receive exactly @p count bytes from @p sock into @p base. If @p sock is a
+  // WebSocket created by netx_maybews_dial(), we read through its receive
+  // buffer, so that parsing several small frames only requires a single
+  // recv call (or SSL_read). Reads larger than the buffer bypass it, so
+  // large frame bodies land directly into @p base. If @p sock has no receive
+  // buffer, this is equivalent to netx_recvn().
+  internal::Err ws_recvn(internal::Socket sock, void *base, internal::Size count) const noexcept;
+
+  // Like ws_recvn() but the @p count bytes are thrown away. When @p sock has
+  // a receive buffer, we use it as scratch space, so there is no copy.
+  internal::Err ws_discardn(internal::Socket sock, internal::Size count) const noexcept;
+
+  // Receive up to @p count bytes from @p sock into @p base without blocking,
+  // putting in @p *actual the bytes received. Like ws_recvn(), we read
+  // through the receive buffer, if any. If @p base is null, the bytes are
+  // thrown away. Returns the error of netx_recv_nonblocking(), e.g.
+  // Err::operation_would_block, if there is nothing to read.
+  internal::Err ws_recv_nonblocking(internal::Socket sock, void *base,
+                                    internal::Size count,
+                                    internal::Size *actual) const noexcept;
+
+  // Like ws_recvmsg_discard() but without blocking. We keep the state of the
+  // message we are receiving in @p reader, so that we can resume from where
+  // we stopped, once @p sock is ready, when we return the error telling what
+  // to wait for, i.e. Err::operation_would_block, Err::ssl_want_read, or
+  // Err::ssl_want_write. Returns Err::eof when we receive CLOSE, which we
+  // reply to unless we have sent CLOSE (see WsReader).
+  internal::Err ws_recvmsg_nonblocking(internal::Socket sock,
+                                       WsReader *reader, uint8_t *opcode,
+                                       uint8_t *base, internal::Size total,
+                                       internal::Size *count) const noexcept;
+
+  // Validate the first two bytes of a frame header at @p buf, and put the
+  // opcode in @p *opcode, the FIN flag in @p *fin, and the 7 bit length
+  // in @p *length, where 126 and 127 mean that an extended length follows
+  // (see ws_parse_length()). @return The error that occurred or Err::none.
+  internal::Err ws_parse_header(const uint8_t *buf, uint8_t *opcode, bool *fin,
+                                internal::Size *length) const noexcept;
+
+  // Decode into @p *length the extended length of @p len_size bytes, i.e.
+  // two or eight, at @p buf. @return The error that occurred or Err::none.
+  internal::Err ws_parse_length(const uint8_t *buf, internal::Size len_size,
+                                internal::Size *length) const noexcept;
+
+  // Statistics about the receive buffer of a WebSocket.
+  struct WsRecvStats {
+    // Number of frames received.
+    uint64_t frames = 0;
+
+    // Number of calls to netx_recv(), i.e. of recv or SSL_read calls.
+    uint64_t recv_calls = 0;
+  };
+
+  // Copy the statistics of the receive buffer of @p sock into @p *stats.
+  // Returns false if @p sock has no receive buffer.
+  bool ws_recv_stats(internal::Socket sock, WsRecvStats *stats) const noexcept;
+
   // Networking layer
   // ````````````````
   //
@@ -22234,10 +26340,21 @@ class Client : public EventHandler {
   // Map getaddrinfo return value into a Err value.
   internal::Err netx_map_eai(int ec) noexcept;
 
-  // Connect to @p hostname and @p port.
+  // Connect to @p hostname and @p port. When @p hostname resolves to many
+  // addresses, start staggered connect attempts as described in RFC8305.
   virtual internal::Err netx_dial(const std::string &hostname, const std::string &port,
                         internal::Socket *sock) noexcept;
 
+  // Start a non-blocking connect to @p aip. Returns none if the connect
+  // succeeded immediately and operation_in_progress if it's pending, in
+  // both cases with @p sock set. Otherwise, returns the error.
+  virtual internal::Err netx_dial_start(const addrinfo *aip,
+                                        internal::Socket *sock) noexcept;
+
+  // Applies the socket buffers and TCP_NOTSENT_LOWAT settings to @p sock. We
+  // only warn on failure, since these settings are just optimizations.
+  void netx_tune_socket(internal::Socket sock) noexcept;
+
   // Receive from the network.
   virtual internal::Err netx_recv(internal::Socket fd, void *base, internal::Size count,
                         internal::Size *actual) const noexcept;
@@ -22257,6 +26374,15 @@ class Client : public EventHandler {
   virtual internal::Err netx_send_nonblocking(internal::Socket fd, const void *base, internal::Size count,
                                     internal::Size *actual) const noexcept;
 
+  // Returns whether the kernel encrypts what we send over @p fd (kTLS), in
+  // which case we send using plain socket writes.
+  virtual bool netx_ktls_send(internal::Socket fd) const noexcept;
+
+  // Returns whether OpenSSL drives @p fd using a socket BIO, because we have
+  // enabled kTLS for sending or receiving, in which case its I/O bypasses
+  // `sys` and our BIO (see netx_maybessl_dial()).
+  virtual bool netx_ktls(internal::Socket fd) const noexcept;
+
   // Send exactly N bytes to the network.
   virtual internal::Err netx_sendn(
     internal::Socket fd, const void *base, internal::Size count) const noexcept;
@@ -22274,6 +26400,15 @@ class Client : public EventHandler {
   // Pauses until the socket becomes writeable.
   virtual internal::Err netx_wait_writeable(internal::Socket, Timeout timeout) const noexcept;
 
+  // Returns true if we can read from @p fd without polling because there is
+  // data in its WebSocket receive buffer or inside OpenSSL.
+  virtual bool netx_has_pending_data(internal::Socket fd) const noexcept;
+
+  // Tells sys that we are about to receive a lot of data from @p fd, so it
+  // can use io_uring, if enabled (see Settings::io_uring), unless OpenSSL
+  // reads from @p fd directly because of kTLS (see netx_ktls()).
+  void netx_start_bulk_recv(internal::Socket fd) const noexcept;
+
   // Main function for dealing with I/O patterned after poll(2).
   virtual internal::Err netx_poll(
     std::vector<pollfd> *fds, int timeout_msec) const noexcept;
@@ -22284,16 +26419,123 @@ class Client : public EventHandler {
   // Close a socket.
   virtual internal::Err netx_closesocket(internal::Socket fd) noexcept;
 
-  virtual bool query_mlabns_curl(const std::string &url, long timeout,
-                                 std::string *body) noexcept;
+  virtual bool query_mlabns_curl(const std::string &url, long timeout,
+                                 std::string *body) noexcept;
+
+  // Refreshes in the background the mlab-ns cache entry for @p url.
+  virtual void query_mlabns_prefetch(const std::string &url) noexcept;
+
+  // Parses the mlab-ns response @p body and appends the servers to @p fqdns.
+  static bool query_mlabns_parse(const internal::Logger &logger,
+                                 const std::string &body,
+                                 std::vector<std::string> *fqdns) noexcept;
+
+  // Sampling helpers
+  //
+  // A subtest calls sample_begin() when it starts. Then, when sample_due()
+  // says it's time to take a sample, it calls sample_flow() for each flow
+  // and then sample_complete(), which calls on_sample().
+
+  // Prepares for sampling the @p tid subtest using @p nflows flows.
+  void sample_begin(NettestFlags tid, size_t nflows) noexcept;
+
+  // Returns whether we should take a sample @p elapsed seconds after the
+  // beginning of the subtest. Always false if sampling is disabled.
+  bool sample_due(double elapsed) const noexcept;
+
+  // Records that @p index-th flow using @p sock transferred @p bytes so far.
+  void sample_flow(size_t index, internal::Socket sock, uint64_t bytes) noexcept;
+
+  // Completes the sample taken @p elapsed seconds after the beginning.
+  void sample_complete(double elapsed) noexcept;
+
+  // Returns the seconds until the next sample is due, given that @p elapsed
+  // seconds elapsed since the beginning of the subtest. Used by the loops to
+  // decide for how long they can sleep. Returns a large value if sampling is
+  // disabled.
+  double sample_wait(double elapsed) const noexcept;
+
+  // Returns Settings::measurement_interval or its default.
+  double get_measurement_interval() const noexcept;
+
+  // Returns the shared buffer of random data to upload, as configured in the
+  // Settings, or nullptr if we cannot allocate it.
+  std::shared_ptr<const internal::Payload> upload_payload() const noexcept;
 
   // Other helpers
 
   Verbosity get_verbosity() const noexcept;
 
+  // Returns true if cancel() has been called.
+  bool is_cancelled() const noexcept;
+
+  // subtest_memory estimates the memory used by the buffers of the @p tid
+  // subtest, including the socket buffers, if configured.
+  internal::Size subtest_memory(NettestFlags tid) const noexcept;
+
+  // subtest_acquire waits until admission allows us to run the @p tid
+  // subtest. Returns false if we've been cancelled while waiting.
+  bool subtest_acquire(NettestFlags tid) noexcept;
+
+  // subtest_release tells admission that the subtest is done.
+  void subtest_release() noexcept;
+
   // Reference to overridable system dependencies
   std::unique_ptr<internal::Sys> sys{new internal::Sys{}};
 
+  // Cache of SSL contexts and TLS sessions. By default, all the clients in
+  // this process share the same cache; override to use a private cache.
+  std::shared_ptr<internal::SslCache> ssl_cache{internal::SslCache::Global()};
+
+  // Cache of mlab-ns results and of the connection to mlab-ns. By default,
+  // all the clients in this process share it, like ssl_cache.
+  std::shared_ptr<internal::MlabnsCache> mlabns_cache{
+      internal::MlabnsCache::Global()};
+
+  // Limits on the subtests that clients sharing it run at the same time. By
+  // default, there are no limits. A Runner shares it among its clients.
+  std::shared_ptr<internal::Admission> admission;
+
+  // Indexes of the counters (see Counters). The frame size histograms take
+  // Counters::frame_size_buckets counters each.
+  enum CounterIndex : size_t {
+    counter_recv_calls,
+    counter_send_calls,
+    counter_poll_calls,
+    counter_connect_calls,
+    counter_poll_wakeups,
+    counter_ssl_read_calls,
+    counter_ssl_write_calls,
+    counter_ssl_want_read,
+    counter_ssl_want_write,
+    counter_wait_readable_usec,
+    counter_wait_writeable_usec,
+    counter_connects,
+    counter_connect_usec,
+    counter_tls_handshakes,
+    counter_tls_handshake_usec,
+    counter_ws_handshakes,
+    counter_ws_handshake_usec,
+    counter_recv_frame_sizes,
+    counter_send_frame_sizes =
+        counter_recv_frame_sizes + Counters::frame_size_buckets,
+    counter_count = counter_send_frame_sizes + Counters::frame_size_buckets,
+  };
+
+  // Counters updated by the I/O functions, which may run in many threads,
+  // each of which updates its own shard, e.g., one per ndt7 flow.
+  mutable internal::ShardedCounters<counter_count> atomic_counters;
+
+  // count_frame counts a frame with a @p size bytes payload in the histogram
+  // starting at @p base, i.e., counter_recv_frame_sizes or
+  // counter_send_frame_sizes.
+  void count_frame(CounterIndex base, internal::Size size) const noexcept;
+
+  // trace calls on_trace() with an event made of @p type, @p sock, and @p
+  // value. Use LIBNDT_TRACE(), which compiles out without LIBNDT_TRACING.
+  void trace(TraceEventType type, internal::Socket sock,
+             int64_t value) const noexcept;
+
  protected:
   // SummaryData contains the fields that are needed to generate the summary
   // at the end of the tests.
@@ -22312,6 +26554,11 @@ class Client : public EventHandler {
 
       // TCPInfo's MinRTT (microseconds).
       uint32_t min_rtt;
+
+      // Round trip times measured during the ndt7 download and upload (see
+      // Settings::ndt7_latency_interval), all zero if not measured.
+      internal::LatencySummary download_latency;
+      internal::LatencySummary upload_latency;
   };
 
   SummaryData summary_;
@@ -22325,6 +26572,12 @@ class Client : public EventHandler {
   // ndt7 ConnectionInfo object.
   nlohmann::json connection_info_;
 
+  // ndt7 latest measurement of each download flow.
+  nlohmann::json download_flows_;
+
+  // ndt7 latest measurement of each upload flow.
+  nlohmann::json upload_flows_;
+
  private:
   class Winsock {
    public:
@@ -22340,12 +26593,235 @@ class Client : public EventHandler {
   std::vector<NettestFlags> granted_suite_;
   Settings settings_;
 
-  std::map<internal::Socket, SSL *> fd_to_ssl_;
+  // Buffers that msg_read() reuses across the messages of the control
+  // connection: the buffer for whole WebSocket messages, allocated when
+  // first needed, and the raw message, whose storage we reuse.
+  std::unique_ptr<char[]> msg_buffer_;
+  std::string msg_raw_;
+
+  // Phase is the next phase of a test driven by step().
+  enum class Phase {
+    idle,
+    query_mlabns,
+    next_host,
+    ndt7_download,
+    ndt7_download_dial,
+    ndt7_download_run,
+    ndt7_upload,
+    ndt7_upload_dial,
+    ndt7_upload_run,
+    connect,
+    send_login,
+    recv_kickoff,
+    wait_in_queue,
+    recv_version,
+    recv_tests_ids,
+    run_tests,
+    recv_results_and_logout,
+    wait_close,
+    done,
+  };
+
+  // step_complete completes the test and always returns false.
+  bool step_complete(bool success) noexcept;
+
+  // step_offload runs @p op, which may block, in the worker thread, and
+  // returns false while it is running. Once @p op is complete, it returns
+  // true with the result of @p op in @p *result. When drive() is running
+  // the test, it runs @p op in this thread and returns true.
+  bool step_offload(std::function<bool()> op, bool *result) noexcept;
+
+  // step_ndt7_complete moves to the next phase once the ndt7 subtest that
+  // is running is complete, given whether it succeeded (@p ok).
+  bool step_ndt7_complete(bool ok) noexcept;
+
+  Phase phase_ = Phase::idle;
+  std::vector<std::string> fqdns_;
+  size_t next_fqdn_ = 0;
+  bool success_ = false;
+
+  // Whether drive() is running the test, and the worker thread running the
+  // phases that may block otherwise, along with their result, which we read
+  // once the worker thread is done, and the descriptors of step_wait().
+  bool step_inline_ = false;
+  std::thread worker_;
+  bool worker_result_ = false;
+  std::atomic<bool> worker_done_{false};
+  std::vector<pollfd> step_pfds_;
+
+  // State of the ndt7 subtest that is running, if any.
+  std::unique_ptr<Ndt7Subtest> ndt7_subtest_;
+
+  // Whether ndt7_dial() failed in the ndt7 subtest that is running, in which
+  // case we try another host, and speculative ndt7 connections.
+  bool ndt7_dial_failed_ = false;
+  std::vector<std::unique_ptr<Ndt7Preconnect>> ndt7_preconnects_;
+
+  // Memory acquired from admission for the subtest that is running.
+  internal::Size subtest_memory_ = 0;
+
+  // cancelled_ is set by cancel(), which may run in another thread, and is
+  // checked by all the loops that could run for a long time.
+  std::atomic<bool> cancelled_{false};
+
+  // parent_cancelled_ is the cancelled_ of the client that created us to
+  // speculatively connect, if any, which outlives us.
+  const std::atomic<bool> *parent_cancelled_ = nullptr;
+
+  // Sample being taken, reused across samples to avoid allocations, when
+  // the next sample is due, and buffer of the latest samples.
+  Sample sample_;
+  double sample_next_ = 0.0;
+  SampleBuffer samples_;
+
+  // Ndt7Stats contains the latest measurement of a ndt7 flow, as received by
+  // the wire, and the TCPInfo fields that we need to compute the summary.
+  struct Ndt7Stats {
+    std::string latest;
+    bool has_tcpinfo = false;
+    int64_t bytes_retrans = 0;
+    int64_t bytes_sent = 0;
+    int64_t min_rtt = 0;
+  };
+
+  // ndt7_stats returns the stats of @p flow, creating them if needed.
+  Ndt7Stats &ndt7_stats(uint8_t flow) noexcept;
+
+  // Stats of each flow of the ndt7 subtest that is running.
+  std::vector<Ndt7Stats> ndt7_stats_;
+
+  // Latest download measurement that contained the ConnectionInfo, which the
+  // server only sends in the first measurement, and flow that received the
+  // latest download measurement.
+  std::string ndt7_connection_info_;
+  uint8_t ndt7_latest_flow_ = 0;
+
+  // Round trip times measured by the ndt7 subtest that is running, which we
+  // update when receiving PONG frames (see ndt7_maybe_ping()).
+  mutable internal::Latency ndt7_latency_;
+
+  // WsRecvBuffer is the receive buffer of a WebSocket (see ws_recvn()).
+  struct WsRecvBuffer {
+    std::unique_ptr<uint8_t[]> data;
+    internal::Size capacity = 0;
+    internal::Size begin = 0;
+    internal::Size end = 0;
+    WsRecvStats stats;
+  };
+
+  // Connection is the state of a socket we have dialed: the SSL, if we use
+  // TLS, and the receive buffer, if we use WebSocket, which has no data
+  // otherwise. The I/O functions find it at every call. The table is only
+  // modified when dialing and closing sockets; the measurement threads only
+  // find their own socket (see SocketTable).
+  struct Connection {
+    SSL *ssl = nullptr;
+    WsRecvBuffer ws;
+  };
+
+  // connection returns the state of @p sock or nullptr.
+  Connection *connection(internal::Socket sock) const noexcept;
+
+  // connection_create returns the state of @p sock, creating it if needed.
+  Connection *connection_create(internal::Socket sock) noexcept;
+
+  // ws_recv_buffer returns the receive buffer of @p sock or nullptr.
+  WsRecvBuffer *ws_recv_buffer(internal::Socket sock) const noexcept;
+
+  internal::SocketTable<Connection> connections_;
 #ifdef _WIN32
   Winsock winsock_;
 #endif
 };
 
+// Runner
+// ``````
+
+/// Runner settings. The defaults are listed below.
+class RunnerSettings {
+ public:
+  /// Maximum number of clients running at the same time. Each running
+  /// client uses a thread of the Runner.
+  size_t max_parallel_clients = 4;
+
+  /// Maximum number of subtests running at the same time, across all the
+  /// clients. Zero, the default, means no limit other than the number of
+  /// clients running at the same time.
+  size_t max_parallel_subtests = 0;
+
+  /// Maximum memory used by the buffers of the subtests running at the same
+  /// time, in bytes. We estimate the memory used by a subtest from its
+  /// Settings, including the socket buffers, if configured. Zero, the
+  /// default, means no limit.
+  uint64_t max_buffer_memory = 0;
+};
+
+/// Runs many clients in parallel, e.g. to measure many servers, with bounded
+/// resources. The clients share the cache of SSL contexts and TLS sessions,
+/// the cache of mlab-ns results, and the limits on the subtests. Each client
+/// reports its results using its own EventHandler methods, which may thus be
+/// called from the Runner threads. In particular, a Runner thread runs each
+/// client by calling start() and then stepping it until the test is complete,
+/// hence EventHandler::on_complete() tells you when each client is done.
+class Runner {
+ public:
+  /// Constructs a Runner with default settings.
+  Runner() noexcept;
+
+  /// Explicitly deleted copy constructor.
+  Runner(const Runner &) noexcept = delete;
+
+  /// Explicitly deleted copy assignment.
+  Runner &operator=(const Runner &) noexcept = delete;
+
+  /// Explicitly deleted move constructor.
+  Runner(Runner &&) noexcept = delete;
+
+  /// Explicitly deleted move assignment.
+  Runner &operator=(Runner &&) noexcept = delete;
+
+  /// Constructs a Runner with the specified @p settings.
+  explicit Runner(RunnerSettings settings) noexcept;
+
+  /// Destroys a Runner, and the clients it owns.
+  virtual ~Runner() noexcept;
+
+  /// Adds @p client to the clients to run, replacing its caches and limits
+  /// with the ones shared by the Runner.
+  void add(std::unique_ptr<Client> client) noexcept;
+
+  /// Runs all the clients added so far, at most max_parallel_clients at a
+  /// time, and returns when all of them are done. Returns true if all of
+  /// them succeeded and false otherwise.
+  bool run() noexcept;
+
+  /// Cancels the running clients and prevents the other ones from running.
+  /// You may call this method from another thread.
+  void cancel() noexcept;
+
+  /// Returns the clients, e.g. to inspect their results after run().
+  const std::vector<std::unique_ptr<Client>> &clients() const noexcept;
+
+ protected:
+  RunnerSettings settings_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::shared_ptr<internal::SslCache> ssl_cache_{internal::SslCache::Global()};
+  std::shared_ptr<internal::MlabnsCache> mlabns_cache_{
+      internal::MlabnsCache::Global()};
+  std::shared_ptr<internal::Admission> admission_;
+
+  // Index of the next client to run, which the Runner threads increment,
+  // and flag set by cancel(), which may run in another thread.
+  std::atomic<size_t> next_client_{0};
+  std::atomic<bool> cancelled_{false};
+};
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+
+#if !defined(_WIN32) && !defined(__linux__)
+#include <netinet/tcp.h>  // For TCP_NOTSENT_LOWAT
+#endif
+
 #ifdef __linux__
 #include <linux/tcp.h>
 #define NDT7_ENUM_TCP_INFO \
@@ -22402,6 +26878,29 @@ class Client : public EventHandler {
   XX(tcpi_bytes_retrans, TcpiBytesRetrans) \
   XX(tcpi_dsack_dups, TcpiDsackDups) \
   XX(tcpi_reord_seen, TcpiReordSeen)
+
+// Ndt7TcpInfoField is a tcp_info field that we include into the ndt7 upload
+// measurements. The name is already quoted and followed by a colon, so that
+// we can write it as is. We use accessors rather than offsets, because some
+// fields of tcp_info are bitfields.
+struct Ndt7TcpInfoField {
+  const char *name;
+  uint64_t (*get)(const tcp_info &);
+};
+
+#define XX(lower_, upper_)                                              \
+  static uint64_t ndt7_tcp_info_get_##lower_(const tcp_info &tcpinfo) { \
+    return (uint64_t)tcpinfo.lower_;                                    \
+  }
+NDT7_ENUM_TCP_INFO
+#undef XX
+
+// ndt7_tcp_info_fields is the table of the tcp_info fields that we write.
+constexpr Ndt7TcpInfoField ndt7_tcp_info_fields[] = {
+#define XX(lower_, upper_) {"\"" #upper_ "\":", ndt7_tcp_info_get_##lower_},
+    NDT7_ENUM_TCP_INFO
+#undef XX
+};
 #endif // __linux__
 
 // WebSocket constants
@@ -22426,6 +26925,16 @@ constexpr uint8_t ws_opcode_mask = 0x0f;
 constexpr uint8_t ws_mask_flag = 0x80;
 constexpr uint8_t ws_len_mask = 0x7f;
 
+// Size of the masking key and maximum size of the header of a masked frame,
+// i.e. two bytes, plus eight bytes of extended length, plus the masking key.
+// See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+constexpr internal::Size ws_mask_size = 4;
+constexpr internal::Size ws_max_header_size = 2 + 8 + ws_mask_size;
+
+// Maximum payload size of control frames. "All control frames MUST have a
+// payload length of 125 bytes or less" [RFC6455 Sect. 5.5].
+constexpr internal::Size ws_max_control_size = 125;
+
 // Flags used to specify what HTTP headers are required and present into the
 // websocket handshake where we upgrade from HTTP/1.1 to websocket.
 constexpr uint64_t ws_f_connection = 1 << 0;
@@ -22439,6 +26948,47 @@ constexpr const char *ws_proto_c2s = "c2s";
 constexpr const char *ws_proto_s2c = "s2c";
 constexpr const char *ws_proto_ndt7 = "net.measurementlab.ndt.v7";
 
+// WsReader is the state of the WebSocket message that we are receiving using
+// Client::ws_recvmsg_nonblocking(), which we resume, once the socket is ready
+// again, from where we stopped.
+class WsReader {
+ public:
+  // Header of the frame we are receiving, of which we have received
+  // header_size bytes out of header_need. Since servers MUST NOT mask
+  // frames, the header is at most two bytes plus eight of extended length.
+  uint8_t header[2 + 8] = {};
+  internal::Size header_size = 0;
+  internal::Size header_need = 2;
+
+  // Whether we are receiving the body of the frame, its opcode and FIN
+  // flag, and the bytes of the body we still need to receive.
+  bool in_body = false;
+  uint8_t opcode = 0;
+  bool fin = false;
+  internal::Size remaining = 0;
+
+  // Body of the control frame we are receiving. We don't store it into the
+  // caller's buffer, since control frames may be injected in the middle of
+  // a fragmented message (RFC6455 Sect. 5.4).
+  uint8_t control[ws_max_control_size] = {};
+  internal::Size control_size = 0;
+
+  // Opcode of the message we are receiving, or zero between messages, and
+  // its size so far.
+  uint8_t message = 0;
+  internal::Size count = 0;
+
+  // Whether we have sent CLOSE, in which case we MUST NOT reply to PING and
+  // to CLOSE (see Client::ws_close()), and whether we received CLOSE.
+  bool closing = false;
+  bool closed = false;
+
+  // Number of bytes received, including headers, and of PONG frames that
+  // carried the payload of one of our PINGs (see Client::ndt7_maybe_ping()).
+  uint64_t received = 0;
+  uint64_t pongs = 0;
+};
+
 // Private constants
 // `````````````````
 
@@ -22449,10 +26999,13 @@ constexpr size_t msg_kickoff_size = sizeof(msg_kickoff) - 1;
 // Private utils
 // `````````````
 
-// Generic macro for emitting logs.
+// Generic macro for emitting logs. The compiler removes the messages that
+// are more verbose than verbosity_max. Otherwise, we only format messages
+// when the runtime verbosity tells us that they're going to be emitted.
 #define LIBNDT_EMIT_LOG_EX(client, level, statements)      \
   do {                                                     \
-    if (client->get_verbosity() >= verbosity_##level) {    \
+    if (verbosity_##level <= verbosity_max &&              \
+        client->get_verbosity() >= verbosity_##level) {    \
       std::stringstream ss_log_lines;                      \
       ss_log_lines << statements;                          \
       std::string log_line;                                \
@@ -22472,36 +27025,36 @@ constexpr size_t msg_kickoff_size = sizeof(msg_kickoff) - 1;
 #define LIBNDT_EMIT_INFO(statements) LIBNDT_EMIT_INFO_EX(this, statements)
 #define LIBNDT_EMIT_DEBUG(statements) LIBNDT_EMIT_DEBUG_EX(this, statements)
 
+// Macros for emitting trace events, which compile out unless LIBNDT_TRACING
+// is defined, in which case the arguments are evaluated.
+#ifdef LIBNDT_TRACING
+#define LIBNDT_TRACE_EX(client, type, sock, value) \
+  client->trace(TraceEventType::type, (sock), (int64_t)(value))
+#else
+#define LIBNDT_TRACE_EX(client, type, sock, value) \
+  do {                                             \
+  } while (0)
+#endif  // LIBNDT_TRACING
+
+#define LIBNDT_TRACE(type, sock, value) LIBNDT_TRACE_EX(this, type, sock, value)
+
 #ifdef _WIN32
 #define LIBNDT_OS_SHUT_RDWR SD_BOTH
 #else
 #define LIBNDT_OS_SHUT_RDWR SHUT_RDWR
 #endif
 
-static void random_printable_fill(char *buffer, size_t length) noexcept {
-  static const std::string ascii =
-      " !\"#$%&\'()*+,-./"          // before numbers
-      "0123456789"                  // numbers
-      ":;<=>?@"                     // after numbers
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"  // uppercase
-      "[\\]^_`"                     // between upper and lower
-      "abcdefghijklmnopqrstuvwxyz"  // lowercase
-      "{|}~"                        // final
-      ;
-  // TODO(bassosimone): the random device is not actually random in a
-  // mingw environment. Here we should perhaps take advantage of the
-  // OpenSSL dependency, when available, and use OpenSSL.
-  std::random_device rd;
-  std::mt19937 g(rd());
-  for (size_t i = 0; i < length; ++i) {
-    buffer[i] = ascii[g() % ascii.size()];
-  }
-}
-
 static double compute_speed_kbits(double data, double elapsed) noexcept {
   return (elapsed > 0.0) ? ((data * 8.0) / 1000.0 / elapsed) : 0.0;
 }
 
+// usec_since returns the microseconds elapsed since @p begin.
+static uint64_t usec_since(std::chrono::steady_clock::time_point begin) noexcept {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
 // format_speed_from_kbits format the input speed, which must be in kbit/s, to
 // a string describing the speed with a measurement unit.
 static std::string format_speed_from_kbits(double speed) noexcept {
@@ -22524,6 +27077,17 @@ static std::string format_speed_from_kbits(double data, double elapsed) noexcept
   return format_speed_from_kbits(compute_speed_kbits(data, elapsed));
 }
 
+// format_latency formats the percentiles of the round trip times in
+// @p summary, which are in microseconds, as milliseconds.
+static std::string format_latency(const internal::LatencySummary &summary) noexcept {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << "p50 " << (double)summary.p50 / 1000.0 << " ms, "
+     << "p90 " << (double)summary.p90 / 1000.0 << " ms, "
+     << "p99 " << (double)summary.p99 / 1000.0 << " ms";
+  return ss.str();
+}
+
 static std::string represent(std::string message) noexcept {
   bool printable = true;
   for (auto &c : message) {
@@ -22549,42 +27113,50 @@ static std::string represent(std::string message) noexcept {
   return ss.str();
 }
 
-static std::string trim(std::string s) noexcept {
-  auto pos = s.find_first_not_of(" \t");
-  if (pos != std::string::npos) {
-    s = s.substr(pos);
+// Removes leading and trailing spaces and tabs from [*begin, *end), unless
+// the range only contains spaces and tabs, in which case we leave it alone.
+static void trim(const char **begin, const char **end) noexcept {
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+  const char *b = *begin, *e = *end;
+  while (b < e && is_space(*b)) {
+    ++b;
   }
-  pos = s.find_last_not_of(" \t");
-  if (pos != std::string::npos) {
-    s = s.substr(0, pos + 1);
+  if (b == e) {
+    return;
   }
-  return s;
+  while (is_space(*(e - 1))) {
+    --e;
+  }
+  *begin = b, *end = e;
 }
 
+// Parses the "key: value" lines of the web100 message in @p base and @p
+// count into @p json. We scan the message in place, rather than splitting
+// it into lines and tokens, so we only allocate for the keys and values.
 static bool jsonify_web100(Client *client, nlohmann::json &json,
-                        std::string message) noexcept {
-  std::stringstream ss_line{message};
-  std::string line;
-
-  while ((std::getline(ss_line, line, '\n'))) {
-    std::vector<std::string> keyval;
-
-    // Split for ":" and use the first part as key and the rest of the string
-    // as value.
-    size_t pos = 0;
-    std::string token;
-
-    pos = line.find(":");
-    // Fail if there isn't any ":" or the delimiter is at the end of the str.
-    if (pos == std::string::npos || pos == line.length() - 1) {
-      LIBNDT_EMIT_WARNING_EX(client, "incorrectly formatted message: " << message);
-      continue;
+                           const char *base, internal::Size count) noexcept {
+  const char *end = base + count;
+  for (const char *line = base; line < end;) {
+    const char *eol = (const char *)::memchr(line, '\n', (size_t)(end - line));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    // Split for ":" and use the first part as key and the rest of the line
+    // as value. Fail if there isn't any ":" or the delimiter is at the end
+    // of the line.
+    const char *colon =
+        (const char *)::memchr(line, ':', (size_t)(eol - line));
+    if (colon == nullptr || colon == eol - 1) {
+      LIBNDT_EMIT_WARNING_EX(client, "incorrectly formatted message: "
+                                         << std::string(base, (size_t)count));
+    } else {
+      const char *key = line, *key_end = colon;
+      const char *value = colon + 1, *value_end = eol;
+      trim(&key, &key_end);
+      trim(&value, &value_end);
+      json[std::string{key, key_end}] = std::string{value, value_end};
     }
-
-    keyval.push_back(line.substr(0, pos));
-    keyval.push_back(line.substr(pos + 1));
-
-    json[trim(keyval[0])] = trim(keyval[1]);
+    line = eol + 1;
   }
   return true;
 }
@@ -22631,6 +27203,145 @@ SocketVector::~SocketVector() noexcept {
   }
 }
 
+// We assume this cache line size, which is correct for most CPUs we care
+// about, when we want to avoid false sharing between threads.
+constexpr size_t cache_line_size = 64;
+
+// FlowCounter counts the bytes transferred by a flow. Only the thread running
+// the flow writes it, hence we don't need atomic read-modify-write, and the
+// thread running the test only reads it. It is padded on both sides so that
+// it never shares a cache line with other data, whatever its alignment.
+class FlowCounter {
+ public:
+  void add(uint64_t n) noexcept {
+    bytes_.store(bytes_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t get() const noexcept {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  char before_[cache_line_size] = {};
+  std::atomic<uint64_t> bytes_{0};
+  char after_[cache_line_size - sizeof(std::atomic<uint64_t>)] = {};
+};
+
+// Ndt7Flow is the state of a ndt7 flow shared by the background thread that
+// runs the flow and the thread running the test.
+class Ndt7Flow {
+ public:
+  internal::Socket sock = (internal::Socket)-1;
+  std::mutex mutex;
+  std::vector<std::string> messages;  // protected by mutex
+  std::vector<Client::Ndt7UploadSample> samples;  // ditto, only for upload
+  bool failed = false;                // read after the flow thread exits
+  FlowCounter counter;
+};
+
+// Ndt7Preconnect is a speculative ndt7 connection, which a background thread
+// establishes using its own client, shared with the thread running the test.
+class Ndt7Preconnect {
+ public:
+  std::string hostname;
+  std::string url_path;
+  std::unique_ptr<Client> client;
+  std::thread thread;
+  std::mutex mutex;
+  internal::Socket sock = (internal::Socket)-1;  // protected by mutex
+  bool done = false;                             // ditto
+  bool abandoned = false;                        // ditto
+};
+
+// Ndt7Subtest is the state of the ndt7 subtest that is running, which we run
+// a bit at a time (see Client::ndt7_subtest_resume()). With many flows, it is
+// shared with the background threads running the flows, which it outlives.
+class Ndt7Subtest {
+ public:
+  explicit Ndt7Subtest(Client *client) noexcept : socks{client} {}
+  NettestFlags tid = 0;
+  std::chrono::steady_clock::time_point begin;
+  std::chrono::steady_clock::time_point latest;       // latest on_performance()
+  std::chrono::steady_clock::time_point latest_ping;  // latest PING
+  std::chrono::steady_clock::time_point latest_io;    // latest I/O progress
+  double measurement_interval = 0.0;
+  std::unique_ptr<internal::Convergence> convergence;  // only for download
+  std::shared_ptr<const internal::Payload> payload;    // only for upload
+
+  // State of a single flow, which uses Client::sock_. We wait for sock_ to
+  // be ready for events, unless again is true, in which case the subtest
+  // stopped to let the caller run and there is more to do right away.
+  internal::Size total = 0;
+  short events = POLLIN;
+  bool again = false;
+  WsReader reader;
+  std::unique_ptr<uint8_t[]> rbuff;  // to receive text and control frames
+  internal::Size rbufsiz = 0;
+  bool pinging = false;
+  uint64_t pongs = 0;                // reader.pongs when we sent PING
+
+  // For the upload, the buffer of the messages, the size of the next one,
+  // and buffers for measurements and PINGs. We send a frame at a time, and
+  // pending points to the bytes of it that we still need to send. Binary
+  // frames carry pending_data bytes of payload, which we count once sent.
+  std::unique_ptr<uint8_t[]> buff;
+  internal::Size size = 0;
+  std::unique_ptr<uint8_t[]> mbuff;
+  uint8_t ping[ws_max_header_size + internal::Latency::payload_size] = {};
+  const uint8_t *pending = nullptr;
+  internal::Size pending_size = 0;
+  internal::Size pending_sent = 0;
+  internal::Size pending_data = 0;
+
+  // State of many flows, which background threads run.
+  SocketVector socks;
+  std::vector<std::unique_ptr<Ndt7Flow>> flows;
+  std::atomic<size_t> active{0};
+  std::atomic<bool> converged{false};
+  std::atomic<bool> stopped{false};
+};
+
+// Threads running flows read the clock to check the deadline only once every
+// this number of iterations, because they iterate very frequently.
+constexpr unsigned int flow_clock_interval = 16;
+
+// Size of the buffer into which we receive ndt7 text messages. We discard the
+// payload of binary messages, so we only need a buffer for measurements sent
+// by the server as text messages, which are much smaller than the 1<<24 bytes
+// maximum message size. (The buffer must also fit control frames, which are
+// at most 125 bytes.)
+constexpr internal::Size ndt7_recv_bufsiz = (1 << 16);
+
+// Maximum time for which ndt7_subtest_resume() runs before returning, such
+// that the caller of step() can run even when the network is always ready.
+constexpr double ndt7_resume_slice = 0.05;
+
+// Size of the ndt7 upload messages when Settings::ndt7_upload_message_size
+// is zero. This is the initial size suggested by the ndt7 specification.
+constexpr internal::Size ndt7_upload_bufsiz = (1 << 13);
+
+// Maximum size of a ndt7 message.
+constexpr internal::Size ndt7_max_message_size = (1 << 24);
+
+// Size of the buffer into which we write the ndt7 upload measurements. This
+// is larger than the largest possible measurement (see the tests).
+constexpr internal::Size ndt7_measurement_bufsiz = 4096;
+
+// The following is the expected ndt7 transfer time for an upload subtest.
+constexpr double ndt7_max_upload_time = 10.0;
+
+// Delay between connect attempts to the addresses of a host. This is the
+// connection attempt delay recommended by RFC8305 Sect. 8.
+constexpr int netx_dial_attempt_delay_msec = 250;
+
+// Maximum time for which step_wait() waits. We wait in slices, like
+// netx_wait(), so that we notice if the test has been cancelled.
+constexpr int step_wait_msec = 250;
+
+// Time after which poll_fds() tells to call step() again while the worker
+// thread is running, since we have no socket to wait for.
+constexpr int step_worker_poll_msec = 10;
+
 // Client constructor and destructor
 // `````````````````````````````````
 
@@ -22638,9 +27349,25 @@ Client::Client() noexcept {}
 
 Client::Client(Settings settings) noexcept : Client::Client() {
   std::swap(settings_, settings);
+#ifdef LIBNDT_HAVE_IO_URING
+  if (settings_.io_uring) {
+    sys.reset(new internal::UringSys{});
+  }
+#endif
 }
 
 Client::~Client() noexcept {
+  // Make sure the worker thread and the flows of a subtest that is still
+  // running, e.g. if we're destroyed in the middle of the test, stop soon.
+  cancelled_ = true;
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  if (ndt7_subtest_) {
+    ndt7_subtest_stop();
+    subtest_release();
+  }
+  ndt7_preconnect_stop();
   if (sock_ != -1) {
     netx_closesocket(sock_);
   }
@@ -22650,86 +27377,365 @@ Client::~Client() noexcept {
 // `````````````
 
 bool Client::run() noexcept {
-  std::vector<std::string> fqdns;
-  if (!query_mlabns(&fqdns)) {
+  if (!start()) {
     return false;
   }
-  for (auto &fqdn : fqdns) {
-    LIBNDT_EMIT_DEBUG("trying to connect to " << fqdn);
-    settings_.hostname = fqdn;
-    // TODO(bassosimone): we will eventually want to refactor the code to
-    // make ndt7 the default and ndt5 the optional case.
-    if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
-      LIBNDT_EMIT_DEBUG("using the ndt7 protocol");
-      if ((settings_.nettest_flags & nettest_flag_download) != 0) {
-        // TODO(bassosimone): for now we do not try with more than one host
-        // when using ndt7 and there's a failure. We may want to do that.
-        if (!ndt7_download()) {
-          LIBNDT_EMIT_WARNING("ndt7: download failed");
-          // FALLTHROUGH
-        }
+  return drive();
+}
+
+bool Client::start() noexcept {
+  if (phase_ != Phase::idle && phase_ != Phase::done) {
+    LIBNDT_EMIT_WARNING("start: a test is already running");
+    return false;
+  }
+  cancelled_ = false;
+  fqdns_.clear();
+  next_fqdn_ = 0;
+  success_ = false;
+  phase_ = Phase::query_mlabns;
+  return true;
+}
+
+bool Client::step() noexcept {
+  if (phase_ == Phase::idle || phase_ == Phase::done) {
+    return false;
+  }
+  if (worker_.joinable() && !worker_done_) {
+    return true;  // the worker thread is still running this phase
+  }
+  if (cancelled_) {
+    LIBNDT_EMIT_WARNING("the test has been cancelled");
+    return step_complete(false);
+  }
+  bool ok = false;
+  switch (phase_) {
+    case Phase::query_mlabns:
+      if (!step_offload([this]() { return query_mlabns(&fqdns_); }, &ok)) {
+        break;
       }
-      if ((settings_.nettest_flags & nettest_flag_upload) != 0) {
-        // TODO(bassosimone): same as above.
-        if (!ndt7_upload()) {
-          LIBNDT_EMIT_WARNING("ndt7: upload failed");
-          // FALLTHROUGH
-        }
+      if (!ok) {
+        return step_complete(false);
       }
-      LIBNDT_EMIT_INFO("ndt7: test complete");
-      // TODO(bassosimone): here we may want to warn if the user selects
-      // subtests that we actually do not implement.
-      return true;
-    }
-    if (!connect()) {
-      LIBNDT_EMIT_WARNING("cannot connect to remote host; trying another one");
-      continue;
-    }
-    LIBNDT_EMIT_DEBUG("connected to remote host");
-    if (!send_login()) {
-      LIBNDT_EMIT_WARNING("cannot send login; trying another host");
-      continue;
-    }
-    LIBNDT_EMIT_DEBUG("sent login message");
-    if (!recv_kickoff()) {
-      LIBNDT_EMIT_WARNING("failed to receive kickoff; trying another host");
-      continue;
-    }
-    if (!wait_in_queue()) {
-      LIBNDT_EMIT_WARNING("failed to wait in queue; trying another host");
-      continue;
+      phase_ = Phase::next_host;
+      break;
+    case Phase::next_host:
+      if (next_fqdn_ >= fqdns_.size()) {
+        LIBNDT_EMIT_WARNING("no more hosts to try; failing the test");
+        return step_complete(false);
+      }
+      settings_.hostname = fqdns_[next_fqdn_++];
+      LIBNDT_EMIT_DEBUG("trying to connect to " << settings_.hostname);
+      // TODO(bassosimone): we will eventually want to refactor the code to
+      // make ndt7 the default and ndt5 the optional case.
+      if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
+        LIBNDT_EMIT_DEBUG("using the ndt7 protocol");
+        phase_ = Phase::ndt7_download;
+      } else {
+        phase_ = Phase::connect;
+      }
+      break;
+    // With ndt7, we try another host if we cannot connect for the first
+    // subtest. Once a subtest has run, we stick with the host, because we
+    // would otherwise run that subtest again with another host.
+    case Phase::ndt7_download:
+      if ((settings_.nettest_flags & nettest_flag_download) == 0) {
+        phase_ = Phase::ndt7_upload;
+        break;
+      }
+      // Waiting for admission may block, unless there are no limits.
+      ok = true;
+      if (admission &&
+          !step_offload(
+              [this]() { return subtest_acquire(nettest_flag_download); },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      ndt7_preconnect_next("/ndt/v7/download");
+      ndt7_subtest_begin(nettest_flag_download);
+      phase_ = Phase::ndt7_download_dial;
+      break;
+    case Phase::ndt7_upload:
+      if ((settings_.nettest_flags & nettest_flag_upload) == 0) {
+        LIBNDT_EMIT_INFO("ndt7: test complete");
+        return step_complete(true);
+      }
+      // Waiting for admission may block, unless there are no limits.
+      ok = true;
+      if (admission &&
+          !step_offload(
+              [this]() { return subtest_acquire(nettest_flag_upload); },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      if ((settings_.nettest_flags & nettest_flag_download) == 0) {
+        ndt7_preconnect_next("/ndt/v7/upload");
+      }
+      ndt7_subtest_begin(nettest_flag_upload);
+      phase_ = Phase::ndt7_upload_dial;
+      break;
+    case Phase::ndt7_download_dial:
+    case Phase::ndt7_upload_dial:
+      if (!step_offload([this]() { return ndt7_subtest_dial(); }, &ok)) {
+        break;
+      }
+      if (!ok || !ndt7_subtest_start()) {
+        return step_ndt7_complete(false);
+      }
+      phase_ = (phase_ == Phase::ndt7_download_dial) ? Phase::ndt7_download_run
+                                                     : Phase::ndt7_upload_run;
+      break;
+    case Phase::ndt7_download_run:
+    case Phase::ndt7_upload_run: {
+      internal::Err err = ndt7_subtest_resume();
+      if (err == internal::Err::operation_would_block) {
+        break;
+      }
+      return step_ndt7_complete(err == internal::Err::none);
     }
-    LIBNDT_EMIT_DEBUG("authorized to run test");
+    case Phase::connect:
+      if (!step_offload([this]() { return connect(); }, &ok)) {
+        break;
+      }
+      if (!ok) {
+        LIBNDT_EMIT_WARNING("cannot connect to remote host; trying another one");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("connected to remote host");
+      phase_ = Phase::send_login;
+      break;
+    case Phase::send_login:
+      if (!send_login()) {
+        LIBNDT_EMIT_WARNING("cannot send login; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("sent login message");
+      phase_ = Phase::recv_kickoff;
+      break;
+    case Phase::recv_kickoff:
+      if (!recv_kickoff()) {
+        LIBNDT_EMIT_WARNING("failed to receive kickoff; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      phase_ = Phase::wait_in_queue;
+      break;
+    case Phase::wait_in_queue:
+      if (!wait_in_queue()) {
+        LIBNDT_EMIT_WARNING("failed to wait in queue; trying another host");
+        phase_ = Phase::next_host;
+        break;
+      }
+      LIBNDT_EMIT_DEBUG("authorized to run test");
+      phase_ = Phase::recv_version;
+      break;
     // From this point on we fail the test in case of error rather than
     // trying with another host. The rationale of trying with another host
     // above is that sometimes NDT servers are busy and we would like to
     // use another one rather than creating queue at the busy one.
-    if (!recv_version()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received server version");
-    if (!recv_tests_ids()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received tests ids");
-    if (!run_tests()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("finished running tests; now reading summary data:");
-    if (!recv_results_and_logout()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("received logout message");
-    if (!wait_close()) {
-      return false;
-    }
-    LIBNDT_EMIT_DEBUG("connection closed");
+    case Phase::recv_version:
+      if (!recv_version()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received server version");
+      phase_ = Phase::recv_tests_ids;
+      break;
+    case Phase::recv_tests_ids:
+      if (!recv_tests_ids()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received tests ids");
+      phase_ = Phase::run_tests;
+      break;
+    case Phase::run_tests:
+      // We admit all the ndt5 subtests at once, because the server decides
+      // when to run them, and the server may be waiting for us meanwhile.
+      // For the same reason, we cannot run them a bit at a time.
+      if (!step_offload(
+              [this]() {
+                if (!subtest_acquire(settings_.nettest_flags)) {
+                  return false;
+                }
+                bool success = run_tests();
+                subtest_release();
+                return success;
+              },
+              &ok)) {
+        break;
+      }
+      if (!ok) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("finished running tests; now reading summary data:");
+      phase_ = Phase::recv_results_and_logout;
+      break;
+    case Phase::recv_results_and_logout:
+      if (!recv_results_and_logout()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("received logout message");
+      phase_ = Phase::wait_close;
+      break;
+    case Phase::wait_close:
+      if (!wait_close()) {
+        return step_complete(false);
+      }
+      LIBNDT_EMIT_DEBUG("connection closed");
+      return step_complete(true);
+    case Phase::idle:
+    case Phase::done:
+      assert(false);  // handled above
+      break;
+  }
+  return true;
+}
+
+bool Client::step_complete(bool success) noexcept {
+  if (worker_.joinable()) {
+    worker_.join();  // we only get here once it's done (see step())
+  }
+  if (ndt7_subtest_) {
+    (void)ndt7_subtest_finish(false);
+    subtest_release();
+  }
+  ndt7_preconnect_stop();
+  phase_ = Phase::done;
+  success_ = success;
+  on_complete(success);
+  return false;
+}
+
+bool Client::step_offload(std::function<bool()> op, bool *result) noexcept {
+  assert(result != nullptr);
+  if (worker_.joinable()) {
+    worker_.join();  // we only get here once it's done (see step())
+    *result = worker_result_;
+    return true;
+  }
+  if (step_inline_) {
+    *result = op();
     return true;
   }
-  LIBNDT_EMIT_WARNING("no more hosts to try; failing the test");
+  worker_done_ = false;
+  worker_ = std::thread{[this, op]() noexcept {
+    worker_result_ = op();
+    worker_done_ = true;  // atomic, hence step() then sees worker_result_
+  }};
   return false;
 }
 
+bool Client::step_ndt7_complete(bool ok) noexcept {
+  bool download = ndt7_subtest_->tid == nettest_flag_download;
+  bool first = download || (settings_.nettest_flags & nettest_flag_download) == 0;
+  ok = ndt7_subtest_finish(ok);
+  subtest_release();
+  if (!ok) {
+    if (first && ndt7_dial_failed_) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot connect; trying another host");
+      phase_ = Phase::next_host;
+      return true;
+    }
+    LIBNDT_EMIT_WARNING("ndt7: " << (download ? "download" : "upload")
+                                 << " failed");
+  }
+  if (download) {
+    phase_ = Phase::ndt7_upload;
+    return true;
+  }
+  LIBNDT_EMIT_INFO("ndt7: test complete");
+  // TODO(bassosimone): here we may want to warn if the user selects
+  // subtests that we actually do not implement.
+  return step_complete(true);
+}
+
+bool Client::drive() noexcept {
+  step_inline_ = true;
+  while (step()) {
+    step_wait();
+  }
+  step_inline_ = false;
+  return success_;
+}
+
+void Client::step_wait() noexcept {
+  int timeout = poll_fds(&step_pfds_);
+  if (timeout == 0) {
+    return;
+  }
+  if (timeout < 0 || timeout > step_wait_msec) {
+    timeout = step_wait_msec;
+  }
+  if (step_pfds_.empty()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+    return;
+  }
+  auto begin = std::chrono::steady_clock::now();
+  (void)netx_poll(&step_pfds_, timeout);
+  auto usec = usec_since(begin);
+  bool writeable = std::any_of(step_pfds_.begin(), step_pfds_.end(),
+                               [](const pollfd &pfd) {
+                                 return (pfd.events & POLLOUT) != 0;
+                               });
+  atomic_counters.Add(writeable ? counter_wait_writeable_usec
+                                : counter_wait_readable_usec,
+                      usec);
+}
+
+int Client::poll_fds(std::vector<pollfd> *pfds) const noexcept {
+  assert(pfds != nullptr);
+  pfds->clear();
+  if (worker_.joinable()) {
+    return worker_done_ ? 0 : step_worker_poll_msec;
+  }
+  // In the dial phases, the subtest has not started yet, so the next step
+  // can run right away.
+  if (ndt7_subtest_ && phase_ != Phase::ndt7_download_dial &&
+      phase_ != Phase::ndt7_upload_dial) {
+    return ndt7_subtest_poll_fds(pfds);
+  }
+  switch (phase_) {
+    case Phase::recv_kickoff:
+    case Phase::wait_in_queue:
+    case Phase::recv_version:
+    case Phase::recv_tests_ids:
+    case Phase::recv_results_and_logout:
+    case Phase::wait_close:
+      if (internal::IsSocketValid(sock_) && !netx_has_pending_data(sock_)) {
+        pollfd pfd{};
+        pfd.fd = sock_;
+        pfd.events = POLLIN;
+        pfds->push_back(pfd);
+        return -1;
+      }
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+internal::Socket Client::poll_fd() const noexcept {
+  std::vector<pollfd> pfds;
+  (void)poll_fds(&pfds);
+  if (pfds.size() == 1 && pfds[0].events == POLLIN) {
+    return pfds[0].fd;
+  }
+  return (internal::Socket)-1;
+}
+
+void Client::cancel() noexcept { cancelled_ = true; }
+
+bool Client::succeeded() const noexcept {
+  return phase_ == Phase::done && success_;
+}
+
 void Client::on_warning(const std::string &msg) const noexcept {
   std::clog << "[!] " << msg << std::endl;
 }
@@ -22769,6 +27775,10 @@ void Client::on_server_busy(std::string msg) noexcept {
   LIBNDT_EMIT_WARNING("server is busy: " << msg);
 }
 
+void Client::on_complete(bool success) noexcept {
+  LIBNDT_EMIT_DEBUG("test complete; success: " << std::boolalpha << success);
+}
+
 // High-level API
 // ``````````````
 
@@ -22786,6 +27796,14 @@ void Client::summary() noexcept {
     LIBNDT_EMIT_INFO("Latency: " << std::fixed << std::setprecision(2)
       << (summary_.min_rtt / 1000.0) << " ms");
   }
+  if (summary_.download_latency.count != 0) {
+    LIBNDT_EMIT_INFO("Download latency under load: "
+      << format_latency(summary_.download_latency));
+  }
+  if (summary_.upload_latency.count != 0) {
+    LIBNDT_EMIT_INFO("Upload latency under load: "
+      << format_latency(summary_.upload_latency));
+  }
   if (summary_.download_retrans != 0.0) {
       LIBNDT_EMIT_INFO("Download retransmission: "
         << std::fixed << std::setprecision(2)
@@ -22801,6 +27819,41 @@ void Client::summary() noexcept {
   }
 }
 
+// CurlxLoggerAdapter routes the messages of internal code to a Client.
+class CurlxLoggerAdapter : public internal::Logger {
+ public:
+  explicit CurlxLoggerAdapter(Client *client) noexcept : client_{client} {}
+
+  bool is_warning_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_warning;
+  }
+
+  bool is_info_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_info;
+  }
+
+  bool is_debug_enabled() const noexcept override {
+		return client_->get_verbosity() >= verbosity_debug;
+  }
+
+  void emit_warning(const std::string &s) const noexcept override {
+		client_->on_warning(s);
+  }
+
+  void emit_info(const std::string &s) const noexcept override {
+		client_->on_info(s);
+  }
+
+  void emit_debug(const std::string &s) const noexcept override {
+		client_->on_debug(s);
+  }
+
+  ~CurlxLoggerAdapter() noexcept override {}
+
+ private:
+  Client *client_;
+};
+
 bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
   assert(fqdns != nullptr);
   if (!settings_.hostname.empty()) {
@@ -22833,16 +27886,85 @@ bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
   } else if (settings_.mlabns_policy == mlabns_policy_geo_options) {
     mlabns_url += "?policy=geo_options";
   }
+  std::vector<std::string> discovered;
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache) {
+    bool refresh = false;
+    bool found = mlabns_cache->Get(mlabns_url, &discovered, &refresh);
+    if (!found && !settings_.mlabns_cache_path.empty() &&
+        mlabns_cache->Load(settings_.mlabns_cache_path)) {
+      found = mlabns_cache->Get(mlabns_url, &discovered, &refresh);
+    }
+    if (found) {
+      LIBNDT_EMIT_DEBUG("using cached mlab-ns reply for: " << mlabns_url);
+      if (refresh) {
+        query_mlabns_prefetch(mlabns_url);
+      }
+      for (auto &fqdn : discovered) {
+        LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
+        fqdns->push_back(std::move(fqdn));
+      }
+      return true;
+    }
+  }
   std::string body;
   if (!query_mlabns_curl(mlabns_url, settings_.timeout, &body)) {
     return false;
   }
   LIBNDT_EMIT_DEBUG("mlabns reply: " << body);
+  CurlxLoggerAdapter adapter{this};
+  if (!query_mlabns_parse(adapter, body, &discovered)) {
+    return false;
+  }
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache && !discovered.empty()) {
+    mlabns_cache->Put(mlabns_url, discovered, settings_.mlabns_cache_ttl);
+    if (!settings_.mlabns_cache_path.empty() &&
+        !mlabns_cache->Save(settings_.mlabns_cache_path)) {
+      LIBNDT_EMIT_WARNING("cannot save mlab-ns cache: "
+                          << settings_.mlabns_cache_path);
+    }
+  }
+  for (auto &fqdn : discovered) {
+    LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
+    fqdns->push_back(std::move(fqdn));
+  }
+  return true;
+}
+
+void Client::query_mlabns_prefetch(const std::string &url) noexcept {
+  LIBNDT_EMIT_DEBUG("refreshing mlab-ns cache in the background: " << url);
+  // The background thread must not reference this client, which may be gone
+  // by the time it runs. It holds a reference to the cache, which therefore
+  // outlives it, also when the process exits while it's running.
+  std::shared_ptr<internal::MlabnsCache> cache = mlabns_cache;
+  std::string proxy_port = settings_.socks5h_port;
+  long timeout = settings_.timeout;
+  Timeout ttl = settings_.mlabns_cache_ttl;
+  std::string path = settings_.mlabns_cache_path;
+  (void)cache->Prefetch([cache, proxy_port, url, timeout, ttl, path]() {
+    internal::NoLogger logger;
+    internal::Curlx curlx{logger};
+    std::string body;
+    std::vector<std::string> fqdns;
+    if (!cache->Fetch(curlx, proxy_port, url, timeout, &body) ||
+        !query_mlabns_parse(logger, body, &fqdns) || fqdns.empty()) {
+      return;  // Keep using the entry we have until it expires
+    }
+    cache->Put(url, std::move(fqdns), ttl);
+    if (!path.empty()) {
+      (void)cache->Save(path);
+    }
+  });
+}
+
+bool Client::query_mlabns_parse(const internal::Logger &logger,
+                                const std::string &body,
+                                std::vector<std::string> *fqdns) noexcept {
+  assert(fqdns != nullptr);
   nlohmann::json json;
   try {
     json = nlohmann::json::parse(body);
   } catch (const nlohmann::json::exception &exc) {
-    LIBNDT_EMIT_WARNING("cannot parse JSON: " << exc.what());
+    LIBNDT_LOGGER_WARNING(logger, "cannot parse JSON: " << exc.what());
     return false;
   }
   // In some cases mlab-ns returns a single object but in other cases (e.g.
@@ -22858,10 +27980,9 @@ bool Client::query_mlabns(std::vector<std::string> *fqdns) noexcept {
     try {
       fqdn = entry.at("fqdn").get<std::string>();
     } catch (const nlohmann::json::exception &exc) {
-      LIBNDT_EMIT_WARNING("cannot access FQDN field: " << exc.what());
+      LIBNDT_LOGGER_WARNING(logger, "cannot access FQDN field: " << exc.what());
       return false;
     }
-    LIBNDT_EMIT_DEBUG("discovered host: " << fqdn);
     fqdns->push_back(std::move(fqdn));
   }
   return true;
@@ -22990,8 +28111,9 @@ bool Client::recv_results_and_logout() noexcept {
   // Read summary from the server and put it into a JSON object.
   nlohmann::json summary;
 
+  // We reuse the same string for all messages to reuse its storage.
+  std::string message;
   for (auto i = 0; i < max_loops; ++i) {  // don't loop forever
-    std::string message;
     MsgType code = MsgType{0};
     if (!msg_read(&code, &message)) {
       return false;
@@ -23059,6 +28181,9 @@ bool Client::run_download() noexcept {
     LIBNDT_EMIT_WARNING("run_download: not all connect succeeded");
     return false;
   }
+  for (auto sock : dload_socks.sockets) {
+    netx_start_bulk_recv(sock);
+  }
 
   if (!msg_expect_empty(msg_test_start)) {
     return false;
@@ -23069,83 +28194,10 @@ bool Client::run_download() noexcept {
   summary_.download_retrans = 0.0;
   summary_.min_rtt = 0;
   {
-    std::atomic<uint8_t> active{0};
-    auto begin = std::chrono::steady_clock::now();
-    std::atomic<uint64_t> total_data{0};
-    auto max_runtime = settings_.max_runtime;
-    auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
-    const Client *const_this = this;
-    for (internal::Socket fd : dload_socks.sockets) {
-      // TODO(bassosimone): increment active inside the thread main function
-      // as this is more consistent with the fact that thread decrements it
-      active += 1;  // atomic
-      auto main = [
-        &active,       // reference to atomic
-        begin,         // copy for safety
-        fd,            // copy for safety
-        max_runtime,   // copy for safety
-        const_this,    // const pointer
-        &total_data,   // reference to atomic
-        ws             // copy for safety
-      ]() noexcept {
-        constexpr size_t ndt_bufsize = 131072;
-        std::unique_ptr<char[]> buf(new char[ndt_bufsize]);
-        for (;;) {
-          auto err = internal::Err::none;
-          internal::Size n = 0;
-          if (ws) {
-            uint8_t op = 0;
-            err = const_this->ws_recvmsg(
-                    fd, &op, (uint8_t *)buf.get(), ndt_bufsize, &n);
-            if (err == internal::Err::none && op != ws_opcode_binary) {
-              LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_download: unexpected opcode: " << (unsigned int)op);
-              break;
-            }
-          } else {
-            err = const_this->netx_recv(fd, buf.get(), ndt_bufsize, &n);
-          }
-          if (err != internal::Err::none) {
-            if (err != internal::Err::eof) {
-              LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_download: receiving: " << internal::libndt_perror(err));
-            }
-            break;
-          }
-          total_data += (uint64_t)n;   // atomic
-          auto now = std::chrono::steady_clock::now();
-          std::chrono::duration<double> elapsed = now - begin;
-          if (elapsed.count() > max_runtime) {
-            break;
-          }
-        }
-        active -= 1;  // atomic
-      };
-      std::thread thread{std::move(main)};
-      thread.detach();
-    }
-    auto prev = begin;
-    for (;;) {
-      constexpr int timeout_msec = 250;
-      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_msec));
-      if (active <= 0) {
-        break;
-      }
-      auto now = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = now - begin;
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_download,           //
-                     active,                            // atomic
-                     static_cast<double>(total_data),   // atomic
-                     elapsed.count(),                   //
-                     settings_.max_runtime);
-      }
-      prev = now;
-    }
-    auto now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = now - begin;
-    summary_.download_speed = compute_speed_kbits(
-        static_cast<double>(total_data), elapsed.count());
+    double total_data = 0.0;
+    double elapsed = 0.0;
+    run_flows(nettest_flag_download, dload_socks, &total_data, &elapsed);
+    summary_.download_speed = compute_speed_kbits(total_data, elapsed);
   }
 
   {
@@ -23167,8 +28219,9 @@ bool Client::run_download() noexcept {
   }
 
   LIBNDT_EMIT_DEBUG("reading summary web100 variables");
+  // We reuse the same string for all messages to reuse its storage.
+  std::string message;
   for (auto i = 0; i < max_loops; ++i) {  // don't loop forever
-    std::string message;
     MsgType code = MsgType{0};
     if (!msg_read(&code, &message)) {
       return false;
@@ -23201,7 +28254,7 @@ bool Client::run_download() noexcept {
 
       return true;
     }
-    if (!jsonify_web100(this, web100, std::move(message))) {
+    if (!jsonify_web100(this, web100, message.data(), message.size())) {
       // NOTHING - jsonify_web100 warns the user already if it cannot parse
       // the message.
     }
@@ -23230,355 +28283,1467 @@ bool Client::run_meta() noexcept {
     return false;
   }
 
-  if (!msg_expect_empty(msg_test_finalize)) {
-    return false;
+  if (!msg_expect_empty(msg_test_finalize)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool Client::run_upload() noexcept {
+  SocketVector upload_socks{this};
+
+  std::string port;
+  uint8_t nflows = 1;
+  if (!msg_expect_test_prepare(&port, &nflows)) {
+    return false;
+  }
+  // TODO(bassosimone): implement C2S_EXT
+  if (nflows != 1) {
+    LIBNDT_EMIT_WARNING("run_upload: unexpected number of flows");
+    return false;
+  }
+
+  {
+    internal::Socket sock = (internal::Socket)-1;
+    // Remark: in case we'll ever implement multi-stream here, remember that
+    // WebSocket requires connections to be serialized. See above.
+		internal::Err err = netx_maybews_dial(  //
+        settings_.hostname, port,
+        ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept
+          | ws_f_sec_ws_protocol, ws_proto_c2s, "/ndt_protocol",
+        &sock);
+    if (err != internal::Err::none) {
+      return false;
+    }
+    upload_socks.sockets.push_back(sock);
+  }
+
+  if (!msg_expect_empty(msg_test_start)) {
+    return false;
+  }
+
+  double client_side_speed = 0.0;
+  {
+    double total_data = 0.0;
+    double elapsed = 0.0;
+    run_flows(nettest_flag_upload, upload_socks, &total_data, &elapsed);
+    client_side_speed = compute_speed_kbits(total_data, elapsed);
+    LIBNDT_EMIT_DEBUG("run_upload: client computed speed: " << client_side_speed);
+  }
+
+  summary_.upload_speed = 0.0;
+  {
+    std::string message;
+    if (!msg_expect(msg_test_msg, &message)) {
+      return false;
+    }
+    try {
+      summary_.upload_speed = std::stod(message);
+      LIBNDT_EMIT_DEBUG("run_upload: server computed speed: " << summary_.upload_speed);
+    } catch(const std::exception& e) {
+      LIBNDT_EMIT_WARNING("run_upload: cannot convert server-computed speed:" << e.what());
+    }
+  }
+
+  if (!msg_expect_empty(msg_test_finalize)) {
+    return false;
+  }
+
+  return true;
+}
+
+void Client::run_flows(NettestFlags tid, const SocketVector &socks,
+                       double *total_data, double *elapsed) noexcept {
+  assert(total_data != nullptr && elapsed != nullptr);
+  // Flow is the state of a flow. When a flow is not ready, we're waiting for
+  // netx_poll() to tell us that `events` occurred on its socket.
+  struct Flow {
+    internal::Socket sock = (internal::Socket)-1;
+    bool done = false;
+    bool ready = true;
+    short events = 0;
+    std::unique_ptr<uint8_t[]> buf;  // WebSocket upload only
+    uint8_t *frame = nullptr;        // WebSocket upload only
+    internal::Size framelen = 0;     // ditto
+    internal::Size frameoff = 0;     // ditto
+    uint64_t bytes = 0;
+  };
+  constexpr internal::Size ndt_bufsize = 131072;
+  auto upload = (tid == nettest_flag_upload);
+  auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
+  std::shared_ptr<const internal::Payload> payload;
+  if (upload) {
+    payload = upload_payload();
+    if (!payload) {
+      LIBNDT_EMIT_WARNING("run_flows: cannot allocate the upload payload");
+      *total_data = 0.0;
+      *elapsed = 0.0;
+      return;
+    }
+  }
+  internal::Size bufsize = upload ? payload->Length() : ndt_bufsize;
+  // We report the number of active flows to on_performance() as uint8_t.
+  if (socks.sockets.size() > UINT8_MAX) {
+    LIBNDT_EMIT_WARNING("run_flows: too many flows: " << socks.sockets.size());
+    *total_data = 0.0;
+    *elapsed = 0.0;
+    return;
+  }
+  std::vector<Flow> flows(socks.sockets.size());
+  for (size_t i = 0; i < flows.size(); ++i) {
+    flows[i].sock = socks.sockets[i];
+    if (upload && ws) {
+      // WebSocket frames are masked in place, so each flow needs its own
+      // copy of the payload. We reserve room for the WebSocket header before
+      // the payload, so that we can prepare the frame in place (see below).
+      flows[i].buf.reset(new uint8_t[ws_max_header_size + bufsize]);
+      memcpy(flows[i].buf.get() + ws_max_header_size, payload->Data(),
+             (size_t)bufsize);
+    } else if (upload) {
+      // Nothing to do, since all the flows send the shared payload.
+    } else if (ws) {
+      // We read whole WebSocket messages (see below), so we don't want to
+      // start reading until we know that there is something to read.
+      flows[i].ready = netx_has_pending_data(flows[i].sock);
+      flows[i].events = POLLIN;
+    }
+  }
+  // Since everything runs in this thread, all the download flows can share
+  // the same buffer. With WebSocket we discard the payload and only need
+  // room for control frames; otherwise we read into a heap buffer.
+  uint8_t ctrl[ws_max_control_size] = {};
+  std::unique_ptr<uint8_t[]> rbuf(
+      (upload || ws) ? nullptr : new uint8_t[ndt_bufsize]);
+  size_t active = flows.size();
+  uint64_t total = 0;
+  auto measurement_interval = get_measurement_interval();
+  sample_begin(tid, flows.size());
+  auto begin = std::chrono::steady_clock::now();
+  auto latest = begin;
+  auto progress = begin;
+  std::vector<pollfd> pfds;
+  std::vector<Flow *> polled;
+  auto progressed = false;
+  for (unsigned int iteration = 1;; ++iteration) {
+    auto anyready = false;
+    for (auto &flow : flows) {
+      if (flow.done || !flow.ready) {
+        continue;
+      }
+      auto err = internal::Err::none;
+      internal::Size n = 0;
+      if (upload && ws) {
+        // Each frame needs a fresh masking key, so we (cheaply) prepare the
+        // frame again, reusing the same buffer, once the previous frame has
+        // been fully sent. Until then, we retry with the same arguments, as
+        // required by SSL_write() after a SSL_ERROR_WANT_{READ,WRITE}.
+        if (flow.frameoff >= flow.framelen) {
+          flow.frameoff = 0;
+          err = ws_prepare_frame_inplace(
+              ws_opcode_binary | ws_fin_flag, flow.buf.get(), bufsize,
+              &flow.frame, &flow.framelen);
+        }
+        if (err == internal::Err::none) {
+          err = netx_send_nonblocking(flow.sock, flow.frame + flow.frameoff,
+                                      flow.framelen - flow.frameoff, &n);
+        }
+        if (err == internal::Err::none) {
+          flow.frameoff += n;
+        }
+      } else if (upload) {
+        err = netx_send_nonblocking(flow.sock, payload->Data(), bufsize, &n);
+      } else if (ws) {
+        // Implementation note: we only start reading a message when we know
+        // that there is data to read; however, we read the whole message,
+        // hence we may block for some time if only part of it has arrived.
+        uint8_t op = 0;
+        err = ws_recvmsg_discard(flow.sock, &op, ctrl, sizeof(ctrl), &n);
+        if (err == internal::Err::none && op != ws_opcode_binary) {
+          LIBNDT_EMIT_WARNING(
+              "run_flows: unexpected opcode: " << (unsigned int)op);
+          flow.done = true;
+          active -= 1;
+          continue;
+        }
+        if (err == internal::Err::none &&
+            !netx_has_pending_data(flow.sock)) {
+          flow.ready = false;
+          flow.events = POLLIN;
+        }
+      } else {
+        err = netx_recv_nonblocking(flow.sock, rbuf.get(), ndt_bufsize, &n);
+      }
+      switch (err) {
+        case internal::Err::none:
+          total += (uint64_t)n;
+          flow.bytes += (uint64_t)n;
+          progressed = true;
+          break;
+        case internal::Err::operation_would_block:
+          flow.ready = false;
+          flow.events = upload ? POLLOUT : POLLIN;
+          break;
+        case internal::Err::ssl_want_read:
+          flow.ready = false;
+          flow.events = POLLIN;
+          break;
+        case internal::Err::ssl_want_write:
+          flow.ready = false;
+          flow.events = POLLOUT;
+          break;
+        default:
+          if (err != (upload ? internal::Err::broken_pipe : internal::Err::eof)) {
+            LIBNDT_EMIT_WARNING("run_flows: " << (upload ? "sending" : "receiving")
+                                << ": " << internal::libndt_perror(err));
+          }
+          flow.done = true;
+          active -= 1;
+          break;
+      }
+      anyready = anyready || (!flow.done && flow.ready);
+    }
+    if (active <= 0) {
+      break;
+    }
+    // When flows are busy we loop very frequently, so we don't read the clock
+    // at every iteration. We always read it before polling though.
+    if (anyready && iteration % flow_clock_interval != 0) {
+      continue;
+    }
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("run_flows: the test has been cancelled");
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (progressed) {
+      progress = now;
+      progressed = false;
+    }
+    std::chrono::duration<double> current = now - begin;
+    if (current.count() > settings_.max_runtime) {
+      break;
+    }
+    if (sample_due(current.count())) {
+      for (size_t i = 0; i < flows.size(); ++i) {
+        sample_flow(i, flows[i].sock, flows[i].bytes);
+      }
+      sample_complete(current.count());
+    }
+    std::chrono::duration<double> interval = now - latest;
+    if (interval.count() >= measurement_interval) {
+      if (!settings_.summary_only) {
+        on_performance(tid, static_cast<uint8_t>(active),
+                       static_cast<double>(total),
+                       current.count(), settings_.max_runtime);
+      }
+      latest = now;
+      interval = std::chrono::duration<double>::zero();
+    }
+    if (anyready) {
+      continue;
+    }
+    pfds.clear();
+    polled.clear();
+    for (auto &flow : flows) {
+      if (!flow.done) {
+        pollfd pfd{};
+        pfd.fd = flow.sock;
+        pfd.events = flow.events;
+        pfds.push_back(pfd);
+        polled.push_back(&flow);
+      }
+    }
+    // Wake up in time for the next sample or on_performance() call.
+    double wait = std::min(measurement_interval - interval.count(),
+                           sample_wait(current.count()));
+    auto timeout_msec = (int)(std::max(wait, 0.0) * 1000.0) + 1;
+    auto err = netx_poll(&pfds, timeout_msec);
+    if (err == internal::Err::timed_out) {
+      std::chrono::duration<double> idle = now - progress;
+      if (idle.count() > settings_.timeout) {
+        LIBNDT_EMIT_WARNING("run_flows: no flow made progress for too long");
+        break;
+      }
+      continue;
+    }
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING(
+          "run_flows: netx_poll() failed: " << internal::libndt_perror(err));
+      break;
+    }
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      if (pfds[i].revents != 0) {
+        polled[i]->ready = true;
+      }
+    }
+  }
+  std::chrono::duration<double> runtime =
+      std::chrono::steady_clock::now() - begin;
+  *total_data = static_cast<double>(total);
+  *elapsed = runtime.count();
+}
+
+// ndt7 protocol API
+// `````````````````
+
+bool Client::ndt7_download() noexcept {
+  return ndt7_run_subtest(nettest_flag_download);
+}
+
+bool Client::ndt7_upload() noexcept {
+  return ndt7_run_subtest(nettest_flag_upload);
+}
+
+bool Client::ndt7_run_subtest(NettestFlags tid) noexcept {
+  // We wait for the network in this thread, like drive() does.
+  bool step_inline = step_inline_;
+  step_inline_ = true;
+  ndt7_subtest_begin(tid);
+  bool ok = ndt7_subtest_dial() && ndt7_subtest_start();
+  if (ok) {
+    internal::Err err = internal::Err::none;
+    while ((err = ndt7_subtest_resume()) ==
+           internal::Err::operation_would_block) {
+      step_wait();
+    }
+    ok = (err == internal::Err::none);
+  }
+  step_inline_ = step_inline;
+  return ndt7_subtest_finish(ok);
+}
+
+void Client::ndt7_subtest_begin(NettestFlags tid) noexcept {
+  ndt7_subtest_stop();  // in case the previous subtest did not finish
+  if (tid == nettest_flag_download) {
+    LIBNDT_EMIT_INFO("starting ndt7 download test");
+    summary_.download_speed = 0.0;
+    summary_.download_retrans = 0.0;
+    summary_.min_rtt = 0;
+    ndt7_connection_info_.clear();
+  } else {
+    LIBNDT_EMIT_INFO("starting ndt7 upload test");
+    summary_.upload_speed = 0.0;
+    summary_.upload_retrans = 0.0;
+  }
+  ndt7_stats_.assign(settings_.ndt7_nflows, Ndt7Stats{});
+  ndt7_latency_.Reset();
+  ndt7_dial_failed_ = false;
+  ndt7_subtest_.reset(new Ndt7Subtest{this});
+  ndt7_subtest_->tid = tid;
+}
+
+bool Client::ndt7_subtest_dial() noexcept {
+  assert(ndt7_subtest_);
+  std::string url_path = (ndt7_subtest_->tid == nettest_flag_download)
+                             ? "/ndt/v7/download"
+                             : "/ndt/v7/upload";
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_dial_flows(url_path, settings_.ndt7_nflows,
+                           &ndt7_subtest_->socks, &ndt7_subtest_->flows);
+  }
+  return ndt7_connect(url_path);
+}
+
+bool Client::ndt7_subtest_start() noexcept {
+  assert(ndt7_subtest_);
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  st->begin = st->latest = st->latest_ping = st->latest_io =
+      std::chrono::steady_clock::now();
+  st->measurement_interval = get_measurement_interval();
+  if (st->tid == nettest_flag_download) {
+    st->convergence.reset(new internal::Convergence{
+        settings_.convergence_tolerance, settings_.convergence_window,
+        settings_.convergence_min_runtime});
+  } else {
+    st->payload = upload_payload();
+    if (!st->payload) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot allocate the upload payload");
+      return false;
+    }
+  }
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_multi_start();
+  }
+  if (st->tid == nettest_flag_download) {
+    // When the caller waits for sock_ using poll_fds(), it would not see
+    // the data that io_uring receives, so we only use it with drive().
+    if (step_inline_) {
+      netx_start_bulk_recv(sock_);
+    }
+  } else {
+    // We mask frames in place, so we need a private copy of the payload.
+    // When messages grow, we copy as much payload as the largest message.
+    st->size = ndt7_upload_message_size(*st->payload, 0, 0);
+    internal::Size bufsiz =
+        settings_.ndt7_adaptive_message_size
+            ? std::min(st->payload->Length(), ndt7_max_message_size)
+            : st->size;
+    st->buff.reset(new uint8_t[ws_max_header_size + bufsiz]);
+    memcpy(st->buff.get() + ws_max_header_size, st->payload->Data(),
+           (size_t)bufsiz);
+    st->mbuff.reset(new uint8_t[ws_max_header_size + ndt7_measurement_bufsiz]);
+  }
+  // While uploading, we only read when waiting for the PONG of our PING.
+  if (st->tid == nettest_flag_download ||
+      settings_.ndt7_latency_interval > 0.0) {
+    st->rbufsiz = ndt7_recv_bufsiz;
+    st->rbuff.reset(new uint8_t[ndt7_recv_bufsiz]);
+  }
+  sample_begin(st->tid, 1);
+  return true;
+}
+
+internal::Err Client::ndt7_subtest_resume() noexcept {
+  if (!ndt7_subtest_) {
+    LIBNDT_EMIT_WARNING("ndt7_subtest_resume: no subtest is running");
+    return internal::Err::invalid_argument;
+  }
+  ndt7_subtest_->again = false;
+  if (settings_.ndt7_nflows > 1) {
+    return ndt7_multi_resume();
+  }
+  return (ndt7_subtest_->tid == nettest_flag_download) ? ndt7_download_resume()
+                                                       : ndt7_upload_resume();
+}
+
+// Returns the milliseconds until @p deadline seconds after @p begin, which
+// can be negative, rounding up so that we don't wake up too early.
+static int64_t ndt7_msec_until(std::chrono::steady_clock::time_point now,
+                               std::chrono::steady_clock::time_point begin,
+                               double deadline) noexcept {
+  std::chrono::duration<double> elapsed = now - begin;
+  return (int64_t)std::ceil((deadline - elapsed.count()) * 1000.0);
+}
+
+int Client::ndt7_subtest_poll_fds(std::vector<pollfd> *pfds) const noexcept {
+  assert(ndt7_subtest_ && pfds != nullptr);
+  const Ndt7Subtest *st = ndt7_subtest_.get();
+  if (st->again) {
+    return 0;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - st->begin;
+  // With many flows, we check when it's time to take a sample or to call
+  // on_performance(), like ndt7_multi_resume() used to sleep until then.
+  int64_t msec = ndt7_msec_until(now, st->latest, st->measurement_interval);
+  msec = std::min(msec, (int64_t)std::ceil(sample_wait(elapsed.count()) * 1000.0));
+  if (settings_.ndt7_nflows <= 1) {
+    if (!st->reader.closing) {
+      // Also wake up in time to PING, to check the deadline, and to notice
+      // that the network made no progress for too long.
+      if (settings_.ndt7_latency_interval > 0.0) {
+        msec = std::min(msec, ndt7_msec_until(now, st->latest_ping,
+                                              settings_.ndt7_latency_interval));
+      }
+      msec = std::min(msec, ndt7_msec_until(now, st->begin,
+                                            (st->tid == nettest_flag_download)
+                                                ? (double)settings_.max_runtime
+                                                : ndt7_max_upload_time));
+    }
+    msec = std::min(msec, ndt7_msec_until(now, st->latest_io,
+                                          (double)settings_.timeout));
+    if ((st->events & POLLIN) != 0 && netx_has_pending_data(sock_)) {
+      return 0;
+    }
+    pollfd pfd{};
+    pfd.fd = sock_;
+    pfd.events = st->events;
+    pfds->push_back(pfd);
+  }
+  // We add one millisecond because we check whether the deadlines have
+  // passed, so waking up exactly on time would mean waking up twice.
+  msec += 1;
+  return (int)std::max(std::min(msec, (int64_t)INT_MAX), (int64_t)0);
+}
+
+bool Client::ndt7_subtest_finish(bool ok) noexcept {
+  bool download = ndt7_subtest_ && ndt7_subtest_->tid == nettest_flag_download;
+  ndt7_subtest_stop();
+  if (download) {
+    ndt7_materialize_flows(&download_flows_);
+    ndt7_report_latency("download_latency", &summary_.download_latency);
+  } else {
+    ndt7_materialize_flows(&upload_flows_);
+    ndt7_report_latency("upload_latency", &summary_.upload_latency);
   }
-
-  return true;
+  return ok;
 }
 
-bool Client::run_upload() noexcept {
-  SocketVector upload_socks{this};
-
-  std::string port;
-  uint8_t nflows = 1;
-  if (!msg_expect_test_prepare(&port, &nflows)) {
-    return false;
+void Client::ndt7_subtest_stop() noexcept {
+  if (!ndt7_subtest_) {
+    return;
   }
-  // TODO(bassosimone): implement C2S_EXT
-  if (nflows != 1) {
-    LIBNDT_EMIT_WARNING("run_upload: unexpected number of flows");
-    return false;
+  // The flow threads notice that we are stopping like they notice cancel(),
+  // after which they stop within the time of a recv or send.
+  ndt7_subtest_->stopped = true;
+  while (ndt7_subtest_->active > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
+  ndt7_subtest_.reset();
+}
 
-  {
-    internal::Socket sock = (internal::Socket)-1;
-    // Remark: in case we'll ever implement multi-stream here, remember that
-    // WebSocket requires connections to be serialized. See above.
-		internal::Err err = netx_maybews_dial(  //
-        settings_.hostname, port,
-        ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept
-          | ws_f_sec_ws_protocol, ws_proto_c2s, "/ndt_protocol",
-        &sock);
+internal::Err Client::ndt7_download_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto slice_begin = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    elapsed = now - st->begin;
+    // After sending CLOSE, like ws_close(), we only wait for the server's
+    // CLOSE, as long as the network makes progress.
+    if (!st->reader.closing && elapsed.count() > settings_.max_runtime) {
+      LIBNDT_EMIT_WARNING("ndt7: download running for too much time");
+      return internal::Err::timed_out;
+    }
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("ndt7: the test has been cancelled");
+      return internal::Err::cancelled;
+    }
+    std::chrono::duration<double> idle = now - st->latest_io;
+    if (idle.count() > settings_.timeout) {
+      LIBNDT_EMIT_WARNING("ndt7: no data received for too long");
+      return internal::Err::timed_out;
+    }
+    if (sample_due(elapsed.count())) {
+      sample_flow(0, sock_, st->total);
+      sample_complete(elapsed.count());
+    }
+    std::chrono::duration<double> interval = now - st->latest;
+    if (!st->reader.closing && interval.count() > st->measurement_interval) {
+      if (!settings_.summary_only) {
+        on_performance(nettest_flag_download, 1, static_cast<double>(st->total),
+                       elapsed.count(), settings_.max_runtime);
+      }
+      st->latest = now;
+      if (st->convergence->Update(elapsed.count(),
+                                  static_cast<double>(st->total))) {
+        LIBNDT_EMIT_INFO("ndt7: download speed has converged; stopping");
+        summary_.download_speed =
+            compute_speed_kbits(st->convergence->Speed(), 1.0);
+        // Setting the FIN flag because control messages MUST NOT be
+        // fragmented as specified in Section 5.5 of RFC6455.
+        auto err = ws_send_frame(sock_, ws_opcode_close | ws_fin_flag,
+                                 nullptr, 0);
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING("ndt7: cannot send CLOSE frame");
+          return err;
+        }
+        st->reader.closing = true;
+      }
+    }
+    if (!st->reader.closing &&
+        ndt7_maybe_ping(sock_, now, &st->latest_ping, nullptr) !=
+            internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send ping");
+      return internal::Err::io_error;
+    }
+    std::chrono::duration<double> slice = now - slice_begin;
+    if (slice.count() > ndt7_resume_slice) {
+      st->again = true;
+      return internal::Err::operation_would_block;
+    }
+    uint8_t opcode = 0;
+    internal::Size count = 0;
+    uint64_t received = st->reader.received;
+    auto err = ws_recvmsg_nonblocking(sock_, &st->reader, &opcode,
+                                      st->rbuff.get(), st->rbufsiz, &count);
+    if (st->reader.received != received) {
+      st->latest_io = now;
+    }
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_read) {
+      st->events = POLLIN;
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::ssl_want_write) {
+      st->events = POLLOUT;
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::eof) {
+      if (st->reader.closing) {
+        if (!st->reader.closed) {
+          LIBNDT_EMIT_WARNING("ndt7: EOF before the server's CLOSE frame");
+          return internal::Err::eof;
+        }
+        LIBNDT_EMIT_DEBUG("ndt7: received the server's CLOSE frame");
+        return internal::Err::none;  // we have computed the speed above
+      }
+      break;
+    }
     if (err != internal::Err::none) {
-      return false;
+      LIBNDT_EMIT_WARNING("ndt7: receiving: " << internal::libndt_perror(err));
+      return err;
     }
-    upload_socks.sockets.push_back(sock);
+    if (opcode == ws_opcode_text && !st->reader.closing) {
+      // The following is an issue both on armv7 and on Windows 32 bit: the
+      // definition of size we have chose is such that later conversion to
+      // string is problematic because our size is 64 bit while size_t is 32
+      // bit on the platfrom. That said, it's unlikely that the we'll get a
+      // measurement that big, so the check to make sure the casting is okay
+      // is not going to be a real problem, it's just a theoric issue.
+      if (count <= SIZE_MAX) {
+        ndt7_on_download_measurement(0, (const char *)st->rbuff.get(),
+                                     (size_t)count);
+      }
+    }
+    st->total += count;  // Assume we won't overflow
   }
+  summary_.download_speed =
+      compute_speed_kbits(static_cast<double>(st->total), elapsed.count());
+  return internal::Err::none;
+}
 
-  if (!msg_expect_empty(msg_test_start)) {
-    return false;
+internal::Err Client::ndt7_upload_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto slice_begin = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    elapsed = now - st->begin;
+    if (elapsed.count() > ndt7_max_upload_time) {
+      LIBNDT_EMIT_DEBUG("ndt7: upload has run for enough time");
+      break;
+    }
+    if (is_cancelled()) {
+      LIBNDT_EMIT_WARNING("ndt7: the test has been cancelled");
+      return internal::Err::cancelled;
+    }
+    std::chrono::duration<double> idle = now - st->latest_io;
+    if (idle.count() > settings_.timeout) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send data for too long");
+      return internal::Err::timed_out;
+    }
+    if (sample_due(elapsed.count())) {
+      sample_flow(0, sock_, st->total);
+      sample_complete(elapsed.count());
+    }
+    // We can only send measurements and PINGs between binary frames, so we
+    // choose the next frame once we have sent the previous one.
+    if (st->pending == nullptr) {
+      uint8_t *frame = nullptr;
+      internal::Size framelen = 0;
+      internal::Err err = internal::Err::none;
+      std::chrono::duration<double> interval = now - st->latest;
+      std::chrono::duration<double> ping_interval = now - st->latest_ping;
+      if (interval.count() > st->measurement_interval) {
+        if (!settings_.summary_only) {
+          on_performance(nettest_flag_upload, 1, static_cast<double>(st->total),
+                         elapsed.count(), ndt7_max_upload_time);
+        }
+        Ndt7UploadSample sample;
+        char *json = (char *)st->mbuff.get() + ws_max_header_size;
+        internal::Size length = ndt7_upload_measurement(
+            sock_, elapsed.count(), st->total, json, ndt7_measurement_bufsiz,
+            &sample);
+        ndt7_on_upload_measurement(0, json, (size_t)length, sample);
+        st->latest = now;
+        if (length <= 0) {
+          continue;  // skip what did not fit, which we have logged
+        }
+        err = ws_prepare_frame_inplace(ws_opcode_text | ws_fin_flag,
+                                       st->mbuff.get(), length, &frame,
+                                       &framelen);
+      } else if (settings_.ndt7_latency_interval > 0.0 &&
+                 ping_interval.count() >= settings_.ndt7_latency_interval) {
+        // See ndt7_maybe_ping(), which we cannot use since it blocks.
+        st->latest_ping = now;
+        st->pinging = true;
+        st->pongs = st->reader.pongs;
+        internal::Latency::Encode(
+            st->ping + ws_max_header_size,
+            usec_since(std::chrono::steady_clock::time_point{}));
+        err = ws_prepare_frame_inplace(ws_opcode_ping | ws_fin_flag, st->ping,
+                                       internal::Latency::payload_size,
+                                       &frame, &framelen);
+      } else {
+        // Each frame needs a fresh masking key, so we (cheaply) prepare the
+        // frame again every time, reusing the same buffer.
+        err = ws_prepare_frame_inplace(ws_opcode_binary | ws_fin_flag,
+                                       st->buff.get(), st->size, &frame,
+                                       &framelen);
+        st->pending_data = st->size;
+      }
+      if (err != internal::Err::none) {
+        LIBNDT_EMIT_WARNING("ndt7: cannot prepare frame");
+        return err;
+      }
+      st->pending = frame;
+      st->pending_size = framelen;
+      st->pending_sent = 0;
+    }
+    std::chrono::duration<double> slice = now - slice_begin;
+    if (slice.count() > ndt7_resume_slice) {
+      st->again = true;
+      return internal::Err::operation_would_block;
+    }
+    // Like ndt7_recv_pongs(), we process the frames sent by the server only
+    // while waiting for our PONG, and we ignore its measurements. Since we
+    // may reply to PING, we only read between frames.
+    bool reading = st->pinging && st->pending_sent == 0;
+    if (reading) {
+      uint8_t opcode = 0;
+      internal::Size count = 0;
+      auto err = ws_recvmsg_nonblocking(sock_, &st->reader, &opcode,
+                                        st->rbuff.get(), st->rbufsiz, &count);
+      if (st->reader.pongs != st->pongs) {
+        st->pinging = false;
+      }
+      if (err == internal::Err::none) {
+        continue;
+      }
+      if (err != internal::Err::operation_would_block &&
+          err != internal::Err::ssl_want_read &&
+          err != internal::Err::ssl_want_write) {
+        LIBNDT_EMIT_WARNING("ndt7: cannot measure the round trip time");
+        return err;
+      }
+    }
+    internal::Size n = 0;
+    auto err = netx_send_nonblocking(sock_, st->pending + st->pending_sent,
+                                     st->pending_size - st->pending_sent, &n);
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_write) {
+      st->events = (short)(POLLOUT | (reading ? POLLIN : 0));
+      return internal::Err::operation_would_block;
+    }
+    if (err == internal::Err::ssl_want_read) {
+      st->events = POLLIN;
+      return internal::Err::operation_would_block;
+    }
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot send frame");
+      return err;
+    }
+    st->latest_io = now;
+    st->pending_sent += n;
+    if (st->pending_sent < st->pending_size) {
+      continue;
+    }
+    st->pending = nullptr;
+    if (st->pending_data > 0) {
+      st->total += st->pending_data;  // Assume we won't overflow
+      st->size = ndt7_upload_message_size(*st->payload, st->size, st->total);
+      st->pending_data = 0;
+    }
   }
+  summary_.upload_speed =
+      compute_speed_kbits(static_cast<double>(st->total), elapsed.count());
+  return internal::Err::none;
+}
 
-  double client_side_speed = 0.0;
-  {
-    std::atomic<uint8_t> active{0};
-    auto begin = std::chrono::steady_clock::now();
-    std::atomic<uint64_t> total_data{0};
-    auto max_runtime = settings_.max_runtime;
-    auto ws = (settings_.protocol_flags & protocol_flag_websocket) != 0;
-    const Client *const_this = this;
-    for (internal::Socket fd : upload_socks.sockets) {
-      // TODO(bassosimone): increment active inside the thread main function
-      // as this is more consistent with the fact that thread decrements it
-      active += 1;  // atomic
+bool Client::ndt7_multi_start() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  auto begin = st->begin;
+  auto measurement_interval = st->measurement_interval;
+  double max_runtime = settings_.max_runtime;
+  auto payload = st->payload;
+  const Client *const_this = this;
+  for (auto &flow : st->flows) {
+    st->active += 1;  // atomic
+    Ndt7Flow *flowp = flow.get();
+    if (st->tid == nettest_flag_download) {
+      netx_start_bulk_recv(flowp->sock);
       auto main = [
-        &active,       // reference to atomic
+        st,            // owned by the test, which waits for us
         begin,         // copy for safety
-        fd,            // copy for safety
+        flowp,         // owned by the test, which outlives us
         max_runtime,   // copy for safety
-        const_this,    // const pointer
-        &total_data,   // reference to atomic
-        ws             // copy for safety
+        const_this     // const pointer
       ]() noexcept {
-        constexpr size_t ndt_bufsize = 131072;
-        std::unique_ptr<char[]> buf(new char[ndt_bufsize]);
-        {
-          auto start = std::chrono::steady_clock::now();
-          random_printable_fill(buf.get(), ndt_bufsize);
-          auto now = std::chrono::steady_clock::now();
-          std::chrono::duration<double> elapsed = now - start;
-          LIBNDT_EMIT_DEBUG_EX(const_this,
-            "run_upload: time to fill random buffer: " << elapsed.count());
-        }
-        std::string frame = const_this->ws_prepare_frame(
-            ws_opcode_binary | ws_fin_flag, (uint8_t *)buf.get(), ndt_bufsize);
-        for (;;) {
-					internal::Size n = 0;
-          auto err = internal::Err::none;
-          if (ws) {
-            err = const_this->netx_sendn(fd, frame.data(), frame.size());
-            if (err == internal::Err::none) {
-              n = frame.size();
-            }
-          } else {
-            err = const_this->netx_send(fd, buf.get(), ndt_bufsize, &n);
-          }
+        std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_recv_bufsiz]};
+        auto latest_ping = begin;
+        for (unsigned int iteration = 1;; ++iteration) {
+          uint8_t opcode = 0;
+          internal::Size count = 0;
+          auto err = const_this->ws_recvmsg_discard(
+              flowp->sock, &opcode, buff.get(), ndt7_recv_bufsiz, &count);
           if (err != internal::Err::none) {
-            if (err != internal::Err::broken_pipe) {
+            if (err != internal::Err::eof) {
               LIBNDT_EMIT_WARNING_EX(const_this,
-                "run_upload: sending: " << internal::libndt_perror(err));
+                "ndt7: receiving: " << internal::libndt_perror(err));
+              flowp->failed = true;
             }
             break;
           }
-          total_data += (uint64_t)n;   // atomic
+          if (opcode == ws_opcode_text && count <= SIZE_MAX) {
+            std::lock_guard<std::mutex> lock{flowp->mutex};
+            flowp->messages.emplace_back((const char *)buff.get(),
+                                         (size_t)count);
+          }
+          flowp->counter.add((uint64_t)count);
+          if (st->converged) {
+            if (const_this->ws_close(flowp->sock, buff.get(),
+                                     ndt7_recv_bufsiz) != internal::Err::none) {
+              flowp->failed = true;
+            }
+            break;
+          }
+          if (iteration % flow_clock_interval != 0) {
+            continue;
+          }
           auto now = std::chrono::steady_clock::now();
           std::chrono::duration<double> elapsed = now - begin;
           if (elapsed.count() > max_runtime) {
+            LIBNDT_EMIT_WARNING_EX(const_this,
+              "ndt7: download running for too much time");
+            flowp->failed = true;
+            break;
+          }
+          if (const_this->is_cancelled() || st->stopped) {
+            flowp->failed = true;
+            break;
+          }
+          if (const_this->ndt7_maybe_ping(flowp->sock, now, &latest_ping,
+                                          nullptr) != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send ping");
+            flowp->failed = true;
             break;
           }
         }
-        active -= 1;  // atomic
+        st->active -= 1;  // atomic
       };
       std::thread thread{std::move(main)};
       thread.detach();
+      continue;
     }
-    auto prev = begin;
-    for (;;) {
-      constexpr int timeout_msec = 250;
-      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_msec));
-      if (active <= 0) {
-        break;
+    auto main = [
+      st,                   // owned by the test, which waits for us
+      begin,                // copy for safety
+      flowp,                // owned by the test, which outlives us
+      measurement_interval, // copy for safety
+      payload,              // shared pointer copy
+      const_this            // const pointer
+    ]() noexcept {
+      // See ndt7_subtest_start() for how we size the buffer.
+      internal::Size size = const_this->ndt7_upload_message_size(*payload, 0, 0);
+      internal::Size bufsiz =
+          const_this->settings_.ndt7_adaptive_message_size
+              ? std::min(payload->Length(), ndt7_max_message_size)
+              : size;
+      std::unique_ptr<uint8_t[]> buff{
+          new uint8_t[ws_max_header_size + bufsiz]};
+      memcpy(buff.get() + ws_max_header_size, payload->Data(),
+             (size_t)bufsiz);
+      std::unique_ptr<uint8_t[]> mbuff{
+          new uint8_t[ws_max_header_size + ndt7_measurement_bufsiz]};
+      auto latest = begin;
+      auto latest_ping = begin;
+      bool pinging = false;
+      internal::Size total = 0;
+      for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - begin;
+        if (elapsed.count() > ndt7_max_upload_time) {
+          break;
+        }
+        if (const_this->is_cancelled() || st->stopped) {
+          flowp->failed = true;
+          break;
+        }
+        std::chrono::duration<double> interval = now - latest;
+        if (interval.count() > measurement_interval) {
+          Ndt7UploadSample sample;
+          char *json = (char *)mbuff.get() + ws_max_header_size;
+          internal::Size length = const_this->ndt7_upload_measurement(
+              flowp->sock, elapsed.count(), total, json,
+              ndt7_measurement_bufsiz, &sample);
+          if (length > 0) {
+            std::lock_guard<std::mutex> lock{flowp->mutex};
+            flowp->messages.emplace_back(json, (size_t)length);
+            flowp->samples.push_back(sample);
+          }
+          // Note that this masks json in place.
+          auto err = const_this->ndt7_send_measurement(flowp->sock,
+                                                       mbuff.get(), length);
+          if (err != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send measurement");
+            flowp->failed = true;
+            break;
+          }
+          latest = now;
+        }
+        if (const_this->settings_.ndt7_latency_interval > 0.0) {
+          if (const_this->ndt7_maybe_ping(flowp->sock, now, &latest_ping,
+                                          &pinging) != internal::Err::none ||
+              const_this->ndt7_recv_pongs(
+                  flowp->sock, mbuff.get(),
+                  ws_max_header_size + ndt7_measurement_bufsiz,
+                  &pinging) != internal::Err::none) {
+            LIBNDT_EMIT_WARNING_EX(const_this,
+              "ndt7: cannot measure the round trip time");
+            flowp->failed = true;
+            break;
+          }
+        }
+        uint8_t *frame = nullptr;
+        internal::Size framelen = 0;
+        auto err = const_this->ws_prepare_frame_inplace(
+            ws_opcode_binary | ws_fin_flag, buff.get(), size,
+            &frame, &framelen);
+        if (err == internal::Err::none) {
+          err = const_this->netx_sendn(flowp->sock, frame, framelen);
+        }
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING_EX(const_this, "ndt7: cannot send frame");
+          flowp->failed = true;
+          break;
+        }
+        total += size;  // Assume we won't overflow
+        flowp->counter.add(size);
+        size = const_this->ndt7_upload_message_size(*payload, size, total);
       }
-      auto now = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = now - begin;
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_upload,             //
-                     active,                            // atomic
-                     static_cast<double>(total_data),   // atomic
-                     elapsed.count(),                   //
-                     settings_.max_runtime);
+      st->active -= 1;  // atomic
+    };
+    std::thread thread{std::move(main)};
+    thread.detach();
+  }
+  sample_begin(st->tid, st->flows.size());
+  return true;
+}
+
+internal::Err Client::ndt7_multi_resume() noexcept {
+  Ndt7Subtest *st = ndt7_subtest_.get();
+  bool download = st->tid == nettest_flag_download;
+  // The flows queue their messages before exiting, so we check whether they
+  // are done before draining, not to miss their last messages.
+  bool done = st->active <= 0;  // atomic
+  ndt7_drain_flows(st->tid, &st->flows);
+  if (done) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - st->begin;
+    double speed = compute_speed_kbits(
+        static_cast<double>(ndt7_sum_flows(st->flows)), elapsed.count());
+    if (download) {
+      summary_.download_speed =
+          st->converged ? compute_speed_kbits(st->convergence->Speed(), 1.0)
+                        : speed;
+    } else {
+      summary_.upload_speed = speed;
+    }
+    for (auto &flow : st->flows) {
+      if (flow->failed) {
+        return internal::Err::io_error;
       }
-      prev = now;
     }
-    auto now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = now - begin;
-    client_side_speed = compute_speed_kbits(  //
-        static_cast<double>(total_data), elapsed.count());
-    LIBNDT_EMIT_DEBUG("run_upload: client computed speed: " << client_side_speed);
+    return internal::Err::none;
   }
-
-  summary_.upload_speed = 0.0;
-  {
-    std::string message;
-    if (!msg_expect(msg_test_msg, &message)) {
-      return false;
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - st->begin;
+  if (sample_due(elapsed.count())) {
+    for (size_t i = 0; i < st->flows.size(); ++i) {
+      sample_flow(i, st->flows[i]->sock, st->flows[i]->counter.get());
     }
-    try {
-      summary_.upload_speed = std::stod(message);
-      LIBNDT_EMIT_DEBUG("run_upload: server computed speed: " << summary_.upload_speed);
-    } catch(const std::exception& e) {
-      LIBNDT_EMIT_WARNING("run_upload: cannot convert server-computed speed:" << e.what());
+    sample_complete(elapsed.count());
+  }
+  std::chrono::duration<double> interval = now - st->latest;
+  if (interval.count() >= st->measurement_interval) {
+    if (!settings_.summary_only) {
+      on_performance(st->tid,                                     //
+                     static_cast<uint8_t>(st->active.load()),     // atomic
+                     static_cast<double>(ndt7_sum_flows(st->flows)),
+                     elapsed.count(),                             //
+                     download ? (double)settings_.max_runtime
+                              : ndt7_max_upload_time);
+    }
+    st->latest = now;
+    if (download && !st->converged &&
+        st->convergence->Update(
+            elapsed.count(),
+            static_cast<double>(ndt7_sum_flows(st->flows)))) {
+      LIBNDT_EMIT_INFO("ndt7: download speed has converged; stopping");
+      st->converged = true;  // atomic; the flows close their WebSocket
     }
   }
+  return internal::Err::operation_would_block;
+}
 
-  if (!msg_expect_empty(msg_test_finalize)) {
-    return false;
+void Client::ndt7_on_download_measurement(uint8_t flow, const char *data,
+                                          size_t size) noexcept {
+  internal::JsonScanField fields[3];
+  fields[0].name = "BytesRetrans";
+  fields[1].name = "BytesSent";
+  fields[2].name = "MinRTT";
+  bool has_connection_info = false;
+  if (!internal::JsonScan(data, size, "TCPInfo", fields, 3, "ConnectionInfo",
+                          &has_connection_info)) {
+    LIBNDT_EMIT_WARNING("Unable to parse message as JSON: "
+                        << std::string(data, size));
+  } else {
+    Ndt7Stats &stats = ndt7_stats(flow);
+    stats.latest.assign(data, size);  // reuses the string's storage
+    stats.has_tcpinfo = fields[0].found && fields[1].found && fields[2].found;
+    stats.bytes_retrans = fields[0].value;
+    stats.bytes_sent = fields[1].value;
+    stats.min_rtt = fields[2].value;
+    if (has_connection_info) {
+      ndt7_connection_info_.assign(data, size);
+    }
+    ndt7_latest_flow_ = flow;
+    ndt7_emit_record("download", flow, data, size);
+
+    // Calculate retransmission rate (BytesRetrans / BytesSent) and latency
+    // using the latest measurement of each flow.
+    double bytes_retrans = 0.0;
+    double bytes_sent = 0.0;
+    int64_t min_rtt = 0;
+    bool complete = true;
+    for (auto &s : ndt7_stats_) {
+      if (s.latest.empty()) {
+        continue;  // we did not receive measurements for this flow yet
+      }
+      if (!s.has_tcpinfo) {
+        complete = false;
+        break;
+      }
+      bytes_retrans += (double)s.bytes_retrans;
+      bytes_sent += (double)s.bytes_sent;
+      min_rtt = (min_rtt == 0 || s.min_rtt < min_rtt) ? s.min_rtt : min_rtt;
+    }
+    if (complete && min_rtt >= 0 && min_rtt <= UINT32_MAX) {
+      summary_.download_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
+      summary_.min_rtt = (uint32_t)min_rtt;
+    } else {
+      LIBNDT_EMIT_WARNING("TCPInfo not available, cannot get "
+                          "retransmission rate and latency");
+    }
   }
 
-  return true;
+  if (get_verbosity() == verbosity_debug) {
+    on_result("ndt7", "download", std::string{data, size});
+  }
 }
 
-// ndt7 protocol API
-// `````````````````
+internal::Size Client::ndt7_upload_measurement(
+    internal::Socket sock, double elapsed, internal::Size total, char *base,
+    internal::Size count, Ndt7UploadSample *sample) const noexcept {
+  assert(base != nullptr && sample != nullptr);
+  auto elapsed_usec = (std::uint64_t)(elapsed * 1e06);
+  *sample = Ndt7UploadSample{};
+  internal::JsonWriter writer{base, count};
+  writer.Raw("{\"AppInfo\":{\"ElapsedTime\":");
+  writer.Uint64(elapsed_usec);
+  writer.Raw(",\"NumBytes\":");
+  writer.Uint64(total);
+  writer.Raw("}");
+#ifdef __linux__
+  // Read tcp_info data for the socket and write it as JSON.
+  struct tcp_info tcpinfo{};
+  socklen_t tcpinfolen = sizeof(tcpinfo);
+  if (sys->Getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
+                      &tcpinfolen) == 0) {
+    writer.Raw(",\"TCPInfo\":{\"ElapsedTime\":");
+    writer.Uint64(elapsed_usec);
+    for (auto &field : ndt7_tcp_info_fields) {
+      writer.Raw(",");
+      writer.Raw(field.name);
+      writer.Uint64(field.get(tcpinfo));
+    }
+    writer.Raw("}");
+    sample->has_tcpinfo = true;
+    sample->bytes_retrans = (uint64_t)tcpinfo.tcpi_bytes_retrans;
+    sample->bytes_sent = (uint64_t)tcpinfo.tcpi_bytes_sent;
+  }
+#else
+  (void)sock;
+#endif  // __linux__
+  writer.Raw("}");
+  if (!writer.Good()) {
+    LIBNDT_EMIT_WARNING("ndt7: measurement buffer too small; skipping it");
+    return 0;
+  }
+  return writer.Length();
+}
 
-bool Client::ndt7_download() noexcept {
-  LIBNDT_EMIT_INFO("starting ndt7 download test");
-  if (!ndt7_connect("/ndt/v7/download")) {
-    return false;
+void Client::ndt7_on_upload_measurement(
+    uint8_t flow, const char *json, size_t size,
+    const Ndt7UploadSample &sample) noexcept {
+  if (size <= 0) {
+    return;  // ndt7_upload_measurement() failed, which we have logged
   }
-  // The following value is the maximum amount of bytes that an implementation
-  // SHOULD be prepared to handle when receiving ndt7 messages.
-  constexpr internal::Size ndt7_bufsiz = (1 << 24);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
-  auto begin = std::chrono::steady_clock::now();
-  auto latest = begin;
-	internal::Size total = 0;
-  std::chrono::duration<double> elapsed;
-  summary_.download_speed = 0.0;
-  summary_.download_retrans = 0.0;
-  summary_.min_rtt = 0;
-  for (;;) {
-    auto now = std::chrono::steady_clock::now();
-    elapsed = now - begin;
-    if (elapsed.count() > settings_.max_runtime) {
-      LIBNDT_EMIT_WARNING("ndt7: download running for too much time");
-      return false;
-    }
-    constexpr auto measurement_interval = 0.25;
-    std::chrono::duration<double> interval = now - latest;
-    if (interval.count() > measurement_interval) {
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_download, 1, static_cast<double>(total),
-                     elapsed.count(), settings_.max_runtime);
-      }
-      latest = now;
+  ndt7_emit_record("upload", flow, json, size);
+  Ndt7Stats &stats = ndt7_stats(flow);
+  stats.latest.assign(json, size);  // reuses the string's storage
+  stats.has_tcpinfo = sample.has_tcpinfo;
+  stats.bytes_retrans = (int64_t)sample.bytes_retrans;
+  stats.bytes_sent = (int64_t)sample.bytes_sent;
+#ifdef __linux__
+  // Calculate retransmission rate using the latest measurement of each flow.
+  double bytes_retrans = 0.0;
+  double bytes_sent = 0.0;
+  bool complete = true;
+  for (auto &s : ndt7_stats_) {
+    if (s.latest.empty()) {
+      continue;  // we did not take measurements for this flow yet
+    }
+    if (!s.has_tcpinfo) {
+      complete = false;
+      break;
     }
+    bytes_retrans += (double)s.bytes_retrans;
+    bytes_sent += (double)s.bytes_sent;
+  }
+  if (complete) {
+    summary_.upload_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
+  } else {
+    LIBNDT_EMIT_WARNING("Cannot calculate retransmission rate: TCPInfo not available");
+  }
+#endif  // __linux__
+  if (get_verbosity() == verbosity_debug) {
+    on_result("ndt7", "upload", std::string{json, size});
+  }
+}
+
+void Client::ndt7_emit_record(const char *name, uint8_t flow, const char *data,
+                              size_t size) const noexcept {
+  if (!settings_.results_sink) {
+    return;
+  }
+  ResultRecord record;
+  record.scope = "ndt7";
+  record.name = name;
+  record.flow = flow;
+  record.timestamp_usec =
+      (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  record.value = data;
+  record.value_size = size;
+  settings_.results_sink->on_record(record);
+}
+
+internal::Err Client::ndt7_send_measurement(internal::Socket sock,
+                                            uint8_t *buffer,
+                                            internal::Size count) const noexcept {
+  if (count <= 0) {
+    return internal::Err::none;  // skip what did not fit, which we have logged
+  }
+  uint8_t *frame = nullptr;
+  internal::Size framelen = 0;
+  internal::Err err = ws_prepare_frame_inplace(
+      ws_opcode_text | ws_fin_flag, buffer, count, &frame, &framelen);
+  if (err != internal::Err::none) {
+    return err;
+  }
+  return netx_sendn(sock, frame, framelen);
+}
+
+internal::Err Client::ndt7_maybe_ping(
+    internal::Socket sock, std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point *latest,
+    bool *pinging) const noexcept {
+  if (settings_.ndt7_latency_interval <= 0.0) {
+    return internal::Err::none;
+  }
+  std::chrono::duration<double> interval = now - *latest;
+  if (interval.count() < settings_.ndt7_latency_interval) {
+    return internal::Err::none;
+  }
+  *latest = now;
+  if (pinging != nullptr) {
+    *pinging = true;
+  }
+  // The PONG echoes the time at which we send the PING, which we measure
+  // using the same clock we use when receiving the PONG.
+  uint8_t payload[internal::Latency::payload_size];
+  internal::Latency::Encode(
+      payload, usec_since(std::chrono::steady_clock::time_point{}));
+  return ws_send_frame(sock, ws_opcode_ping | ws_fin_flag, payload,
+                       sizeof(payload));
+}
+
+internal::Err Client::ndt7_recv_pongs(internal::Socket sock, uint8_t *base,
+                                      internal::Size total,
+                                      bool *pinging) const noexcept {
+  assert(pinging != nullptr);
+  if (!*pinging) {
+    return internal::Err::none;  // no PONG to wait for, so don't poll
+  }
+  // Once the beginning of a frame is readable, the rest of it follows soon,
+  // hence we only wait for the frames that the server is already sending.
+  while (netx_has_pending_data(sock) ||
+         netx_wait_readable(sock, Timeout{0}) == internal::Err::none) {
     uint8_t opcode = 0;
-		internal::Size count = 0;
-		internal::Err err = ws_recvmsg(sock_, &opcode, buff.get(), ndt7_bufsiz, &count);
+    bool fin = false;
+    internal::Size count = 0;
+    auto err = ws_recv_any_frame(sock, &opcode, &fin, base, total, &count,
+                                 true);
     if (err != internal::Err::none) {
-      if (err == internal::Err::eof) {
+      return err;
+    }
+    if (opcode == ws_opcode_pong) {
+      if (ndt7_latency_.OnPong(
+              base, count,
+              usec_since(std::chrono::steady_clock::time_point{}))) {
+        *pinging = false;
         break;
       }
-      return false;
-    }
-    if (opcode == ws_opcode_text) {
-      // The following is an issue both on armv7 and on Windows 32 bit: the
-      // definition of size we have chose is such that later conversion to
-      // string is problematic because our size is 64 bit while size_t is 32
-      // bit on the platfrom. That said, it's unlikely that the we'll get a
-      // measurement that big, so the check to make sure the casting is okay
-      // is not going to be a real problem, it's just a theoric issue.
-      if (count <= SIZE_MAX) {
-        std::string sinfo{(const char *)buff.get(), (size_t)count};
-        // Try parsing the received message as JSON.
-        try {
-          measurement_ = nlohmann::json::parse(sinfo);
-          if (measurement_.contains("ConnectionInfo")) {
-            connection_info_ = measurement_["ConnectionInfo"];
-          }
-
-          // Calculate retransmission rate (BytesRetrans / BytesSent).
-          try {
-            nlohmann::json tcpinfo_json = measurement_["TCPInfo"];
-            double bytes_retrans = (double) tcpinfo_json["BytesRetrans"].get<int64_t>();
-            double bytes_sent = (double) tcpinfo_json["BytesSent"].get<int64_t>();
-            summary_.download_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-            summary_.min_rtt = tcpinfo_json["MinRTT"].get<uint32_t>();
-          } catch(const std::exception& e) {
-            LIBNDT_EMIT_WARNING("TCPInfo not available, cannot get \
-              retransmission rate and latency: " << e.what());
-          }
-        } catch (nlohmann::json::parse_error& e) {
-          LIBNDT_EMIT_WARNING("Unable to parse message as JSON: " << sinfo);
-        }
-
-        if (get_verbosity() == verbosity_debug) {
-          on_result("ndt7", "download", std::move(sinfo));
-        }
+    } else if (opcode == ws_opcode_ping) {
+      err = ws_send_frame(sock, ws_opcode_pong | ws_fin_flag, base, count);
+      if (err != internal::Err::none) {
+        return err;
       }
+    } else if (opcode == ws_opcode_close) {
+      // See ws_recv_frame() for why we must reply with CLOSE.
+      (void)ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+      return internal::Err::eof;
     }
-    total += count;  // Assume we won't overflow
   }
-  summary_.download_speed = compute_speed_kbits(static_cast<double>(total), elapsed.count());
-  return true;
+  return internal::Err::none;
 }
 
-bool Client::ndt7_upload() noexcept {
-  LIBNDT_EMIT_INFO("starting ndt7 upload test");
-  if (!ndt7_connect("/ndt/v7/upload")) {
-    return false;
+void Client::ndt7_report_latency(const char *name,
+                                 internal::LatencySummary *summary) noexcept {
+  *summary = ndt7_latency_.Summarize();
+  if (summary->count <= 0) {
+    return;
   }
-  // Implementation note: we send messages smaller than the maximum message
-  // size accepted by the protocol. We have chosen this value because it
-  // currently seems to be a reasonable size for outgoing messages.
-  constexpr internal::Size ndt7_bufsiz = (1 << 13);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
-  random_printable_fill((char *)buff.get(), ndt7_bufsiz);
-  // The following is the expected ndt7 transfer time for a subtest.
-  constexpr double max_upload_time = 10.0;
-  auto begin = std::chrono::steady_clock::now();
-  auto latest = begin;
-  std::chrono::duration<double> elapsed;
-	internal::Size total = 0;
-  summary_.upload_speed = 0.0;
-  std::string frame = ws_prepare_frame(ws_opcode_binary | ws_fin_flag,
-                                       buff.get(), ndt7_bufsiz);
-  for (;;) {
-    auto now = std::chrono::steady_clock::now();
-    elapsed = now - begin;
-    std::chrono::duration<double, std::micro> elapsed_usec =
-      std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
-    if (elapsed.count() > max_upload_time) {
-      LIBNDT_EMIT_DEBUG("ndt7: upload has run for enough time");
-      break;
-    }
-    constexpr auto measurement_interval = 0.25;
-    std::chrono::duration<double> interval = now - latest;
-    if (interval.count() > measurement_interval) {
-      nlohmann::json measurement;
-      measurement["AppInfo"] = nlohmann::json();
-      measurement["AppInfo"]["ElapsedTime"] = (std::uint64_t) elapsed_usec.count();
-      measurement["AppInfo"]["NumBytes"] = total;
-#ifdef __linux__
-      // Read tcp_info data for the socket and print it as JSON.
-      struct tcp_info tcpinfo{};
-      socklen_t tcpinfolen = sizeof(tcpinfo);
-      if (sys->Getsockopt(sock_, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
-                          &tcpinfolen) == 0) {
-        measurement["TCPInfo"] = nlohmann::json();
-        measurement["TCPInfo"]["ElapsedTime"] = (std::uint64_t) elapsed_usec.count();
-#define XX(lower_, upper_) measurement["TCPInfo"][#upper_] = (uint64_t)tcpinfo.lower_;
-        NDT7_ENUM_TCP_INFO
-#undef XX
-      }
+  nlohmann::json latency;
+  latency["Count"] = summary->count;
+  latency["Min"] = summary->min;
+  latency["P50"] = summary->p50;
+  latency["P90"] = summary->p90;
+  latency["P99"] = summary->p99;
+  latency["Max"] = summary->max;
+  std::string value = latency.dump();
+  ndt7_emit_record(name, 0, value.data(), value.size());
+  on_result("ndt7", name, std::move(value));
+}
 
-      // Calculate retransmission rate.
+void Client::ndt7_materialize_flows(nlohmann::json *flows) noexcept {
+  assert(flows != nullptr);
+  *flows = nlohmann::json::array();
+  bool is_download = (flows == &download_flows_);
+  for (size_t i = 0; i < ndt7_stats_.size(); ++i) {
+    nlohmann::json measurement;  // null for flows without measurements
+    if (!ndt7_stats_[i].latest.empty()) {
       try {
-        nlohmann::json tcpinfo_json = measurement["TCPInfo"];
-        double bytes_retrans = (double) tcpinfo_json["TcpiBytesRetrans"].get<int64_t>();
-        double bytes_sent = (double) tcpinfo_json["TcpiBytesSent"].get<int64_t>();
-        summary_.upload_retrans = (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-      } catch (const std::exception& e) {
-        LIBNDT_EMIT_WARNING("Cannot calculate retransmission rate: " << e.what());
+        measurement = nlohmann::json::parse(ndt7_stats_[i].latest);
+      } catch (const nlohmann::json::exception &exc) {
+        // JsonScan() is more lenient than nlohmann/json, e.g. it does not
+        // validate escapes, so this may happen with a broken server.
+        LIBNDT_EMIT_WARNING("ndt7: cannot parse measurement: " << exc.what());
       }
-#endif  // __linux__
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_upload, 1, static_cast<double>(total),
-                     elapsed.count(), max_upload_time);
-      }
-      // This could fail if there are non-utf8 characters. This structure just
-      // contains integers and ASCII strings, so we should be good.
-      std::string json = measurement.dump();
-      if (get_verbosity() == verbosity_debug) {
-        on_result("ndt7", "upload", json);
-      }
-      // Send measurement to the server.
-			internal::Err err = ws_send_frame(sock_, ws_opcode_text | ws_fin_flag,
-                              (uint8_t *)json.data(), json.size());
-      if (err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING("ndt7: cannot send measurement");
-        return false;
+    }
+    if (is_download && i == ndt7_latest_flow_ && !measurement.is_null()) {
+      measurement_ = measurement;
+    }
+    flows->push_back(std::move(measurement));
+  }
+  if (is_download && !ndt7_connection_info_.empty()) {
+    try {
+      connection_info_ =
+          nlohmann::json::parse(ndt7_connection_info_).at("ConnectionInfo");
+    } catch (const nlohmann::json::exception &exc) {
+      LIBNDT_EMIT_WARNING("ndt7: cannot parse ConnectionInfo: " << exc.what());
+    }
+  }
+  ndt7_stats_.clear();
+}
+
+Client::Ndt7Stats &Client::ndt7_stats(uint8_t flow) noexcept {
+  if (flow >= ndt7_stats_.size()) {
+    ndt7_stats_.resize((size_t)flow + 1);
+  }
+  return ndt7_stats_[flow];
+}
+
+uint64_t Client::ndt7_sum_flows(
+    const std::vector<std::unique_ptr<Ndt7Flow>> &flows) noexcept {
+  uint64_t total = 0;
+  for (auto &flow : flows) {
+    total += flow->counter.get();
+  }
+  return total;
+}
+
+void Client::ndt7_drain_flows(
+    NettestFlags tid, std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept {
+  for (size_t i = 0; i < flows->size(); ++i) {
+    std::vector<std::string> messages;
+    std::vector<Ndt7UploadSample> samples;
+    {
+      std::lock_guard<std::mutex> lock{(*flows)[i]->mutex};
+      std::swap(messages, (*flows)[i]->messages);
+      std::swap(samples, (*flows)[i]->samples);
+    }
+    for (size_t j = 0; j < messages.size(); ++j) {
+      if (tid == nettest_flag_download) {
+        ndt7_on_download_measurement((uint8_t)i, messages[j].data(),
+                                     messages[j].size());
+      } else if (j < samples.size()) {
+        ndt7_on_upload_measurement((uint8_t)i, messages[j].data(),
+                                   messages[j].size(), samples[j]);
       }
-      latest = now;
     }
-		internal::Err err = netx_sendn(sock_, frame.data(), frame.size());
-    if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ndt7: cannot send frame");
+  }
+}
+
+bool Client::ndt7_dial_flows(std::string url_path, uint8_t nflows,
+                             SocketVector *socks,
+                             std::vector<std::unique_ptr<Ndt7Flow>> *flows) noexcept {
+  for (uint8_t i = 0; i < nflows; ++i) {
+    internal::Socket sock = (internal::Socket)-1;
+    if (!ndt7_dial(url_path, &sock)) {
+      LIBNDT_EMIT_WARNING("ndt7: not all connect succeeded");
       return false;
     }
-    total += ndt7_bufsiz;  // Assume we won't overflow
+    socks->sockets.push_back(sock);
+    std::unique_ptr<Ndt7Flow> flow{new Ndt7Flow{}};
+    flow->sock = sock;
+    flows->push_back(std::move(flow));
   }
-  summary_.upload_speed = compute_speed_kbits(static_cast<double>(total), elapsed.count());
+  LIBNDT_EMIT_DEBUG("ndt7: established " << (unsigned int)nflows
+                    << " WebSocket connections");
   return true;
 }
 
 bool Client::ndt7_connect(std::string url_path) noexcept {
-  std::string port = "443";
-  if (!settings_.port.empty()) {
-    port = settings_.port;
-  }
   // Don't leak resources if the socket is already open.
   if (internal::IsSocketValid(sock_)) {
     LIBNDT_EMIT_DEBUG("ndt7: closing socket openned in previous attempt");
     (void)netx_closesocket(sock_);
     sock_ = (internal::Socket)-1;
   }
+  if (!ndt7_dial(url_path, &sock_)) {
+    return false;
+  }
+  LIBNDT_EMIT_DEBUG("ndt7: WebSocket connection established");
+  return true;
+}
+
+bool Client::ndt7_dial(std::string url_path, internal::Socket *sock) noexcept {
+  if (ndt7_preconnect_take(url_path, sock)) {
+    LIBNDT_EMIT_DEBUG("ndt7: using the speculative connection");
+    ndt7_preconnect_abandon();
+    return true;
+  }
+  std::string port = "443";
+  if (!settings_.port.empty()) {
+    port = settings_.port;
+  }
   // Note: ndt7 implies WebSocket and TLS
   settings_.protocol_flags |= protocol_flag_websocket | protocol_flag_tls;
 	internal::Err err = netx_maybews_dial(
       settings_.hostname, port,
       ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept |
           ws_f_sec_ws_protocol,
-      ws_proto_ndt7, url_path, &sock_);
+      ws_proto_ndt7, url_path, sock);
   if (err != internal::Err::none) {
+    ndt7_dial_failed_ = true;
     return false;
   }
-  LIBNDT_EMIT_DEBUG("ndt7: WebSocket connection established");
+  ndt7_preconnect_abandon();
   return true;
 }
 
+void Client::ndt7_preconnect_next(std::string url_path) noexcept {
+  if (!settings_.ndt7_preconnect || next_fqdn_ >= fqdns_.size()) {
+    return;
+  }
+  const std::string &hostname = fqdns_[next_fqdn_];
+  for (auto &pc : ndt7_preconnects_) {
+    if (pc->hostname == hostname && pc->url_path == url_path) {
+      return;
+    }
+  }
+  Settings settings = settings_;
+  settings.hostname = hostname;
+  // The other client must be quiet because it runs in the background and
+  // we don't want to call our event handlers from another thread.
+  settings.verbosity = verbosity_quiet;
+  std::unique_ptr<Ndt7Preconnect> pc{new Ndt7Preconnect{}};
+  pc->hostname = hostname;
+  pc->url_path = url_path;
+  pc->client = ndt7_preconnect_client(std::move(settings));
+  if (!pc->client) {
+    return;
+  }
+  // The other client shares our state, e.g., such that we can resume the
+  // TLS sessions it establishes, and such that we can cancel it (see below).
+  pc->client->ssl_cache = ssl_cache;
+  pc->client->mlabns_cache = mlabns_cache;
+  pc->client->admission = admission;
+  pc->client->parent_cancelled_ = &cancelled_;
+  LIBNDT_EMIT_DEBUG("ndt7: speculatively connecting to " << hostname);
+  Ndt7Preconnect *pcp = pc.get();
+  pc->thread = std::thread{[pcp]() noexcept {
+    internal::Socket sock = (internal::Socket)-1;
+    bool ok = pcp->client->ndt7_dial(pcp->url_path, &sock);
+    std::lock_guard<std::mutex> lock{pcp->mutex};
+    if (ok && pcp->abandoned) {
+      (void)pcp->client->netx_closesocket(sock);
+      ok = false;
+    }
+    pcp->sock = ok ? sock : (internal::Socket)-1;
+    pcp->done = true;
+  }};
+  ndt7_preconnects_.push_back(std::move(pc));
+}
+
+bool Client::ndt7_preconnect_take(const std::string &url_path,
+                                  internal::Socket *sock) noexcept {
+  for (auto it = ndt7_preconnects_.begin(); it != ndt7_preconnects_.end();
+       ++it) {
+    auto &pc = *it;
+    if (pc->hostname != settings_.hostname || pc->url_path != url_path) {
+      continue;
+    }
+    pc->thread.join();
+    bool ok = internal::IsSocketValid(pc->sock);
+    if (ok) {
+      ndt7_adopt(pc->client.get(), pc->sock);
+      *sock = pc->sock;
+    } else {
+      LIBNDT_EMIT_DEBUG("ndt7: the speculative connect failed");
+    }
+    ndt7_preconnects_.erase(it);
+    return ok;
+  }
+  return false;
+}
+
+void Client::ndt7_preconnect_abandon() noexcept {
+  for (auto &pc : ndt7_preconnects_) {
+    std::lock_guard<std::mutex> lock{pc->mutex};
+    pc->abandoned = true;
+    // Interrupt the connect, which otherwise may take a whole timeout.
+    pc->client->cancel();
+    if (pc->done && internal::IsSocketValid(pc->sock)) {
+      (void)pc->client->netx_closesocket(pc->sock);
+      pc->sock = (internal::Socket)-1;
+    }
+  }
+}
+
+void Client::ndt7_preconnect_stop() noexcept {
+  ndt7_preconnect_abandon();
+  for (auto &pc : ndt7_preconnects_) {
+    pc->thread.join();
+  }
+  ndt7_preconnects_.clear();
+}
+
+std::unique_ptr<Client> Client::ndt7_preconnect_client(
+    Settings settings) noexcept {
+  return std::unique_ptr<Client>{new Client{std::move(settings)}};
+}
+
+void Client::ndt7_adopt(Client *other, internal::Socket sock) noexcept {
+  auto conn = other->connections_.Remove(sock);
+  if (!conn) {
+    return;
+  }
+  if (conn->ssl != nullptr) {
+    // Our BIO uses its data to find the client, which must now be us.
+    BIO *bio = ::SSL_get_rbio(conn->ssl);
+    if (bio != nullptr && ::BIO_get_data(bio) == other) {
+      ::BIO_set_data(bio, this);
+    }
+  }
+  (void)connections_.Insert(sock, std::move(conn));
+}
+
 // NDT protocol API
 // ````````````````
 
@@ -23782,22 +29947,23 @@ bool Client::msg_expect(MsgType expected_code, std::string *s) noexcept {
 
 bool Client::msg_read(MsgType *code, std::string *msg) noexcept {
   assert(code != nullptr && msg != nullptr);
-  std::string s;
-  if (!msg_read_legacy(code, &s)) {
+  // We read into msg_raw_, whose storage we reuse across messages.
+  msg_raw_.clear();
+  if (!msg_read_legacy(code, &msg_raw_)) {
     return false;
   }
   if ((settings_.protocol_flags & protocol_flag_json) == 0) {
-    std::swap(s, *msg);
+    msg->swap(msg_raw_);
   } else {
     nlohmann::json json;
     try {
-      json = nlohmann::json::parse(s);
+      json = nlohmann::json::parse(msg_raw_);
     } catch (const nlohmann::json::exception &) {
       LIBNDT_EMIT_WARNING("msg_read: cannot parse JSON");
       return false;
     }
     try {
-      *msg = json.at("msg").get<std::string>();
+      msg->assign(json.at("msg").get_ref<const std::string &>());
     } catch (const nlohmann::json::exception &) {
       LIBNDT_EMIT_WARNING("msg_read: cannot find 'msg' field");
       return false;
@@ -23812,15 +29978,24 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
   constexpr internal::Size header_size = 3;
   constexpr internal::Size max_body_size = UINT16_MAX;
   constexpr internal::Size max_msg_size = header_size + max_body_size;
-  char buffer[max_msg_size];
+  // With WebSocket we read whole messages, hence we need room for the largest
+  // message, which we allocate once, rather than on the stack, since it's
+  // too large for threads with small stacks. Otherwise, we read the header
+  // and then the body directly into @p msg.
+  char header[header_size];
+  char *buffer = header;
   uint16_t len = 0;
-  *msg = "";
+  msg->clear();
   {
 		internal::Size ws_msg_len = 0;
     if ((settings_.protocol_flags & protocol_flag_websocket) != 0) {
+      if (!msg_buffer_) {
+        msg_buffer_.reset(new char[max_msg_size]);
+      }
+      buffer = msg_buffer_.get();
       uint8_t opcode = 0;
       auto err = ws_recvmsg(  //
-          sock_, &opcode, (uint8_t *)buffer, sizeof(buffer), &ws_msg_len);
+          sock_, &opcode, (uint8_t *)buffer, max_msg_size, &ws_msg_len);
       if (err != internal::Err::none) {
         LIBNDT_EMIT_WARNING(
             "msg_read_legacy: cannot read NDT message using websocket");
@@ -23835,19 +30010,16 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
                      << (unsigned int)opcode);
         return false;
       }
-      assert(ws_msg_len <= sizeof(buffer));
+      assert(ws_msg_len <= max_msg_size);
     } else {
-      static_assert(sizeof(buffer) >= header_size,
-                    "Not enough room in buffer to read the NDT header");
       auto err = netx_recvn(sock_, buffer, header_size);
       if (err != internal::Err::none) {
         LIBNDT_EMIT_WARNING("msg_read_legacy: cannot read NDT message header");
         return false;
       }
     }
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[0] (type): " << (int)buffer[0]);
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[1] (len-high): " << (int)buffer[1]);
-    LIBNDT_EMIT_DEBUG("msg_read_legacy: header[2] (len-low): " << (int)buffer[2]);
+    LIBNDT_EMIT_DEBUG("msg_read_legacy: header: " << (int)buffer[0] << " "
+                      << (int)buffer[1] << " " << (int)buffer[2]);
     static_assert(sizeof(MsgType) == sizeof(unsigned char),
                   "Unexpected MsgType size");
     *code = MsgType{(unsigned char)buffer[0]};
@@ -23867,18 +30039,16 @@ bool Client::msg_read_legacy(MsgType *code, std::string *msg) noexcept {
     return true;
   }
   if ((settings_.protocol_flags & protocol_flag_websocket) == 0) {
-    assert(sizeof(buffer) >= header_size &&
-           sizeof(buffer) - header_size >= len);
-    auto err = netx_recvn(sock_, &buffer[header_size], len);
+    msg->resize(len);
+    auto err = netx_recvn(sock_, &(*msg)[0], len);
     if (err != internal::Err::none) {
       LIBNDT_EMIT_WARNING("msg_read_legacy: cannot read NDT message body");
+      msg->clear();
       return false;
     }
+  } else {
+    msg->assign(&buffer[header_size], len);
   }
-  // This is a stringy copy but we do not care much because the part that needs
-  // to be efficient is the one running measurements not the one where we deal
-  // with incoming and outgoing NDT control messages.
-  *msg = std::string{&buffer[header_size], len};
   LIBNDT_EMIT_DEBUG("msg_read_legacy: raw message: " << represent(*msg));
   return true;
 }
@@ -23906,7 +30076,7 @@ internal::Err Client::ws_recvln(internal::Socket fd, std::string *line, size_t m
   line->clear();
   while (line->size() < maxlen) {
     char ch = {};
-    auto err = netx_recvn(fd, &ch, sizeof(ch));
+    auto err = ws_recvn(fd, &ch, sizeof(ch));
     if (err != internal::Err::none) {
       return err;
     }
@@ -24021,93 +30191,144 @@ internal::Err Client::ws_handshake(internal::Socket fd, std::string port, uint64
   return internal::Err::value_too_large;
 }
 
-std::string Client::ws_prepare_frame(uint8_t first_byte, uint8_t *base,
-                                     internal::Size count) const noexcept {
-  // TODO(bassosimone): perhaps move the RNG into Client?
-  constexpr internal::Size mask_size = 4;
-  uint8_t mask[mask_size] = {};
-  // "When preparing a masked frame, the client MUST pick a fresh masking
-  //  key from the set of allowed 32-bit values." [RFC6455 Sect. 5.3]. Hence
-  // we're not compliant (TODO(bassosimone)).
-  random_printable_fill((char *)mask, sizeof(mask));
-  std::stringstream ss;
-  // Message header
-  {
-    // First byte
-    {
-      // TODO(bassosimone): add sanity checks for first byte
-      ss << first_byte;
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: FIN: " << std::boolalpha
-                                        << ((first_byte & ws_fin_flag) != 0));
-      LIBNDT_EMIT_DEBUG(
-          "ws_prepare_frame: reserved: " << (first_byte & ws_reserved_mask));
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: opcode: " << (first_byte & ws_opcode_mask));
-    }
-    // Length
-    {
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: mask flag: " << std::boolalpha << true);
-      LIBNDT_EMIT_DEBUG("ws_prepare_frame: length: " << count);
-      // Since this is a client implementation, we always include the MASK flag
-      // as part of the second byte that we send on the wire. Also, the spec
-      // says that we must emit the length in network byte order, which means
-      // in practice that we should use big endian.
-      //
-      // See <https://tools.ietf.org/html/rfc6455#section-5.1>, and
-      //     <https://tools.ietf.org/html/rfc6455#section-5.2>.
-#define LB(value)                                                        \
-  do {                                                                   \
-    LIBNDT_EMIT_DEBUG("ws_prepare_frame: length byte: " << (unsigned int)(value)); \
-    ss << (value);                                                       \
-  } while (0)
-      if (count < 126) {
-        LB((uint8_t)((count & ws_len_mask) | ws_mask_flag));
-      } else if (count < (1 << 16)) {
-        LB((uint8_t)((126 & ws_len_mask) | ws_mask_flag));
-        LB((uint8_t)((count >> 8) & 0xff));
-        LB((uint8_t)(count & 0xff));
-      } else {
-        LB((uint8_t)((127 & ws_len_mask) | ws_mask_flag));
-        LB((uint8_t)((count >> 56) & 0xff));
-        LB((uint8_t)((count >> 48) & 0xff));
-        LB((uint8_t)((count >> 40) & 0xff));
-        LB((uint8_t)((count >> 32) & 0xff));
-        LB((uint8_t)((count >> 24) & 0xff));
-        LB((uint8_t)((count >> 16) & 0xff));
-        LB((uint8_t)((count >> 8) & 0xff));
-        LB((uint8_t)(count & 0xff));
-      }
-#undef LB  // Tidy
-    }
-    // Mask
-    {
-      for (internal::Size i = 0; i < mask_size; ++i) {
-        LIBNDT_EMIT_DEBUG("ws_prepare_frame: mask byte: " << (unsigned int)mask[i]
-                                                << " ('" << mask[i] << "')");
-        ss << (uint8_t)mask[i];
-      }
+// ws_random_mask fills @p mask with a fresh masking key. "When preparing a
+// masked frame, the client MUST pick a fresh masking key from the set of
+// allowed 32-bit values." [RFC6455 Sect. 5.3]. "The masking key needs to be
+// unpredictable; thus, the masking key MUST be derived from a strong source
+// of entropy" [Ibid.]. Returns false if we cannot generate the key.
+static bool ws_random_mask(uint8_t *mask) noexcept {
+  return internal::RandomBytes(mask, ws_mask_size);
+}
+
+// ws_format_header writes into @p header, which must be at least
+// ws_max_header_size bytes, the header of a masked frame with @p first_byte
+// as first byte, @p count bytes of payload and @p mask as masking key. Returns
+// the number of bytes actually written.
+static internal::Size ws_format_header(uint8_t first_byte, const uint8_t *mask,
+                                       internal::Size count,
+                                       uint8_t *header) noexcept {
+  internal::Size off = 0;
+  // TODO(bassosimone): add sanity checks for first byte
+  header[off++] = first_byte;
+  // Since this is a client implementation, we always include the MASK flag
+  // as part of the second byte that we send on the wire. Also, the spec
+  // says that we must emit the length in network byte order, which means
+  // in practice that we should use big endian.
+  //
+  // See <https://tools.ietf.org/html/rfc6455#section-5.1>, and
+  //     <https://tools.ietf.org/html/rfc6455#section-5.2>.
+  if (count < 126) {
+    header[off++] = (uint8_t)((count & ws_len_mask) | ws_mask_flag);
+  } else if (count < (1 << 16)) {
+    header[off++] = (uint8_t)((126 & ws_len_mask) | ws_mask_flag);
+    header[off++] = (uint8_t)((count >> 8) & 0xff);
+    header[off++] = (uint8_t)(count & 0xff);
+  } else {
+    header[off++] = (uint8_t)((127 & ws_len_mask) | ws_mask_flag);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      header[off++] = (uint8_t)((count >> shift) & 0xff);
     }
   }
+  memcpy(&header[off], mask, ws_mask_size);
+  off += ws_mask_size;
+  assert(off <= ws_max_header_size);
+  return off;
+}
+
+std::string Client::ws_prepare_frame(uint8_t first_byte, uint8_t *base,
+                                     internal::Size count) const noexcept {
   // As mentioned in the docs of this method, we will not include any
   // body in the frame if base is a null pointer.
-  {
-    for (internal::Size i = 0; i < count && base != nullptr; ++i) {
-      // Implementation note: judging from a GCC 8 warning, it seems that using
-      // `^=` causes -Wconversion warnings, while using `= ... ^` does not.
-      base[i] = base[i] ^ mask[i % mask_size];
-      ss << base[i];
-    }
+  if (base == nullptr) {
+    count = 0;
   }
-  return ss.str();
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame: cannot generate masking key");
+    return "";
+  }
+  uint8_t header[ws_max_header_size];
+  internal::Size header_size = ws_format_header(first_byte, mask, count, header);
+  LIBNDT_EMIT_DEBUG("ws_prepare_frame: FIN: " << std::boolalpha
+                    << ((first_byte & ws_fin_flag) != 0) << "; reserved: "
+                    << (first_byte & ws_reserved_mask) << "; opcode: "
+                    << (first_byte & ws_opcode_mask) << "; length: " << count);
+  internal::WsMask(base, count, mask);
+  std::string frame;
+  frame.reserve((size_t)(header_size + count));
+  frame.append((const char *)header, (size_t)header_size);
+  if (count > 0) {
+    frame.append((const char *)base, (size_t)count);
+  }
+  return frame;
+}
+
+internal::Err Client::ws_prepare_frame_inplace(
+    uint8_t first_byte, uint8_t *buffer, internal::Size count, uint8_t **frame,
+    internal::Size *framelen) const noexcept {
+  if (buffer == nullptr || frame == nullptr || framelen == nullptr) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: passed invalid arguments");
+    return internal::Err::invalid_argument;
+  }
+  if (count > internal::SizeMax - ws_max_header_size) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: avoiding integer overflow");
+    return internal::Err::value_too_large;
+  }
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_prepare_frame_inplace: cannot generate masking key");
+    return internal::Err::ssl_generic;
+  }
+  uint8_t header[ws_max_header_size];
+  internal::Size header_size = ws_format_header(first_byte, mask, count, header);
+  uint8_t *payload = buffer + ws_max_header_size;
+  internal::WsMask(payload, count, mask);
+  *frame = payload - header_size;
+  memcpy(*frame, header, (size_t)header_size);
+  *framelen = header_size + count;
+  count_frame(counter_send_frame_sizes, count);
+  LIBNDT_TRACE(send_frame, (internal::Socket)-1, count);
+  return internal::Err::none;
 }
 
 internal::Err Client::ws_send_frame(internal::Socket sock, uint8_t first_byte, uint8_t *base,
                           internal::Size count) const noexcept {
-  std::string prep = ws_prepare_frame(first_byte, base, count);
-  return netx_sendn(sock, prep.c_str(), prep.size());
+  if (base == nullptr) {
+    count = 0;
+  }
+  uint8_t mask[ws_mask_size] = {};
+  if (!ws_random_mask(mask)) {
+    LIBNDT_EMIT_WARNING("ws_send_frame: cannot generate masking key");
+    return internal::Err::ssl_generic;
+  }
+  // Small frames (i.e. control frames, NDT messages, and ndt7 measurements)
+  // are assembled on the stack and sent using a single write. Larger frames
+  // are written as header followed by payload, to avoid copying the payload.
+  // The hot measurement paths do not get here; they use a prebuilt frame
+  // prepared using ws_prepare_frame_inplace() instead.
+  constexpr internal::Size max_small_frame = 2048;
+  uint8_t small_frame[max_small_frame];
+  static_assert(max_small_frame > ws_max_header_size, "Small frame too small");
+  internal::Size header_size = ws_format_header(first_byte, mask, count, small_frame);
+  internal::WsMask(base, count, mask);
+  count_frame(counter_send_frame_sizes, count);
+  LIBNDT_TRACE(send_frame, sock, count);
+  if (count <= max_small_frame - header_size) {
+    if (count > 0) {
+      memcpy(&small_frame[header_size], base, (size_t)count);
+    }
+    return netx_sendn(sock, small_frame, header_size + count);
+  }
+  auto err = netx_sendn(sock, small_frame, header_size);
+  if (err != internal::Err::none) {
+    return err;
+  }
+  return netx_sendn(sock, base, count);
 }
 
 internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode, bool *fin,
-      uint8_t *base, internal::Size total, internal::Size *count) const noexcept {
+      uint8_t *base, internal::Size total, internal::Size *count,
+      bool discard) const noexcept {
   // TODO(bassosimone): in this function we should consider an EOF as an
   // error, because with WebSocket we have explicit FIN mechanism.
   if (opcode == nullptr || fin == nullptr || count == nullptr) {
@@ -24131,122 +30352,63 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
   static_assert(sizeof(internal::Size) == sizeof(uint64_t), "Size is not 64 bit wide");
   {
     uint8_t buf[2];
-    auto err = netx_recvn(sock, buf, sizeof(buf));
+    auto err = ws_recvn(sock, buf, sizeof(buf));
     if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for header");
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for header");
       return err;
     }
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: ws header: "
-               << represent(std::string{(char *)buf, sizeof(buf)}));
-    *fin = (buf[0] & ws_fin_flag) != 0;
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: FIN: " << std::boolalpha << *fin);
-    uint8_t reserved = (uint8_t)(buf[0] & ws_reserved_mask);
-    if (reserved != 0) {
-      // They only make sense for extensions, which we don't use. So we return
-      // error. See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: invalid reserved bits: " << reserved);
-      return internal::Err::ws_proto;
-    }
-    *opcode = (uint8_t)(buf[0] & ws_opcode_mask);
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: opcode: " << (unsigned int)*opcode);
-    switch (*opcode) {
-      // clang-format off
-      case ws_opcode_continue:
-      case ws_opcode_text:
-      case ws_opcode_binary:
-      case ws_opcode_close:
-      case ws_opcode_ping:
-      case ws_opcode_pong: break;
-      // clang-format off
-      default:
-        // See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-        LIBNDT_EMIT_WARNING("ws_recv_any_frame: invalid opcode");
-        return internal::Err::ws_proto;
-    }
-    auto hasmask = (buf[1] & ws_mask_flag) != 0;
-    // We do not expect to receive a masked frame. This is client code and
-    // the RFC says that a server MUST NOT mask its frames.
-    //
-    // See <https://tools.ietf.org/html/rfc6455#section-5.1>.
-    if (hasmask) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: received masked frame");
-      return internal::Err::invalid_argument;
+    {
+      auto rbuf = ws_recv_buffer(sock);
+      if (rbuf != nullptr) {
+        rbuf->stats.frames += 1;
+      }
     }
-    length = (buf[1] & ws_len_mask);
-    switch (*opcode) {
-      case ws_opcode_close:
-      case ws_opcode_ping:
-      case ws_opcode_pong:
-        if (length > 125 || *fin == false) {
-          LIBNDT_EMIT_WARNING("ws_recv_any_frame: control messages MUST have a "
-                       "payload length of 125 bytes or less and MUST NOT "
-                       "be fragmented (see RFC6455 Sect 5.5.)");
-          return internal::Err::ws_proto;
-        }
-        break;
+    auto parse_err = ws_parse_header(buf, opcode, fin, &length);
+    if (parse_err != internal::Err::none) {
+      return parse_err;
     }
-    // As mentioned above, length is transmitted using big endian encoding.
-#define AL(value)                                                            \
-  do {                                                                       \
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: length byte: " << (unsigned int)(value)); \
-    length += (value);                                                       \
-  } while (0)
-    // The following should not happen because the lenght is over 7 bits but
-    // it's nice to enforce assertions to make assumptions explicit.
-    assert(length <= 127);
-    if (length == 126) {
-      uint8_t len_buf[2];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
-      if (recvn_err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 16 bit length");
-        return recvn_err;
-      }
-      LIBNDT_EMIT_DEBUG("ws_recv_any_frame: 16 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
-      length = 0;  // Need to reset the length as AL() does +=
-      AL(((internal::Size)len_buf[0]) << 8);
-      AL((internal::Size)len_buf[1]);
-    } else if (length == 127) {
+    if (length == 126 || length == 127) {
       uint8_t len_buf[8];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
+      internal::Size len_size = (length == 126) ? 2 : 8;
+      auto recvn_err = ws_recvn(sock, len_buf, len_size);
       if (recvn_err != internal::Err::none) {
-        LIBNDT_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 64 bit length");
+        LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for "
+                            << len_size * 8 << " bit length");
         return recvn_err;
       }
-      LIBNDT_EMIT_DEBUG("ws_recv_any_frame: 64 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
-      length = 0;  // Need to reset the length as AL() does +=
-      AL(((internal::Size)len_buf[0]) << 56);
-      if ((len_buf[0] & 0x80) != 0) {
-        // See <https://tools.ietf.org/html/rfc6455#section-5.2>: "[...] the
-        // most significant bit MUST be 0."
-        LIBNDT_EMIT_WARNING("ws_recv_any_frame: 64 bit length: invalid first bit");
-        return internal::Err::ws_proto;
+      parse_err = ws_parse_length(len_buf, len_size, &length);
+      if (parse_err != internal::Err::none) {
+        return parse_err;
       }
-      AL(((internal::Size)len_buf[1]) << 48);
-      AL(((internal::Size)len_buf[2]) << 40);
-      AL(((internal::Size)len_buf[3]) << 32);
-      AL(((internal::Size)len_buf[4]) << 24);
-      AL(((internal::Size)len_buf[5]) << 16);
-      AL(((internal::Size)len_buf[6]) << 8);
-      AL(((internal::Size)len_buf[7]));
-    }
-#undef AL  // Tidy
-    if (length > total) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: buffer too small");
-      return internal::Err::message_size;
-    }
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: length: " << length);
-  }
-  LIBNDT_EMIT_DEBUG("ws_recv_any_frame: received header");
+    }
+    // We run this code for every frame, so we only emit a single message,
+    // which costs nothing when we compile out debug messages.
+    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: FIN: " << std::boolalpha << *fin
+                      << "; opcode: " << (unsigned int)*opcode
+                      << "; length: " << length);
+  }
+  count_frame(counter_recv_frame_sizes, length);
+  LIBNDT_TRACE(recv_frame, sock, length);
   // Message body
+  if (length > 0 && discard &&
+      (*opcode == ws_opcode_binary || *opcode == ws_opcode_continue)) {
+    auto err = ws_discardn(sock, length);
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_discardn() failed for body");
+      return err;
+    }
+    *count = length;
+    return internal::Err::none;
+  }
+  if (length > total) {
+    LIBNDT_EMIT_WARNING("ws_recv_any_frame: buffer too small");
+    return internal::Err::message_size;
+  }
   if (length > 0) {
     assert(length <= total);
-    auto err = netx_recvn(sock, base, length);
+    auto err = ws_recvn(sock, base, length);
     if (err != internal::Err::none) {
-      LIBNDT_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for body");
+      LIBNDT_EMIT_WARNING("ws_recv_any_frame: ws_recvn() failed for body");
       return err;
     }
     // This makes the code too noisy when using -verbose. It may still be
@@ -24257,14 +30419,89 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
     */
     *count = length;
   } else {
-    LIBNDT_EMIT_DEBUG("ws_recv_any_frame: no body in this message");
     assert(*count == 0);
   }
   return internal::Err::none;
 }
 
+internal::Err Client::ws_parse_header(const uint8_t *buf, uint8_t *opcode,
+                                     bool *fin,
+                                     internal::Size *length) const noexcept {
+  assert(buf != nullptr && opcode != nullptr && fin != nullptr &&
+         length != nullptr);
+  *fin = (buf[0] & ws_fin_flag) != 0;
+  uint8_t reserved = (uint8_t)(buf[0] & ws_reserved_mask);
+  if (reserved != 0) {
+    // They only make sense for extensions, which we don't use. So we return
+    // error. See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+    LIBNDT_EMIT_WARNING("ws_parse_header: invalid reserved bits: " << reserved);
+    return internal::Err::ws_proto;
+  }
+  *opcode = (uint8_t)(buf[0] & ws_opcode_mask);
+  switch (*opcode) {
+    // clang-format off
+    case ws_opcode_continue:
+    case ws_opcode_text:
+    case ws_opcode_binary:
+    case ws_opcode_close:
+    case ws_opcode_ping:
+    case ws_opcode_pong: break;
+    // clang-format off
+    default:
+      // See <https://tools.ietf.org/html/rfc6455#section-5.2>.
+      LIBNDT_EMIT_WARNING("ws_parse_header: invalid opcode");
+      return internal::Err::ws_proto;
+  }
+  auto hasmask = (buf[1] & ws_mask_flag) != 0;
+  // We do not expect to receive a masked frame. This is client code and
+  // the RFC says that a server MUST NOT mask its frames.
+  //
+  // See <https://tools.ietf.org/html/rfc6455#section-5.1>.
+  if (hasmask) {
+    LIBNDT_EMIT_WARNING("ws_parse_header: received masked frame");
+    return internal::Err::invalid_argument;
+  }
+  *length = (buf[1] & ws_len_mask);
+  switch (*opcode) {
+    case ws_opcode_close:
+    case ws_opcode_ping:
+    case ws_opcode_pong:
+      if (*length > ws_max_control_size || *fin == false) {
+        LIBNDT_EMIT_WARNING("ws_parse_header: control messages MUST have a "
+                     "payload length of 125 bytes or less and MUST NOT "
+                     "be fragmented (see RFC6455 Sect 5.5.)");
+        return internal::Err::ws_proto;
+      }
+      break;
+  }
+  // As mentioned above, length is transmitted using big endian encoding.
+  // The following should not happen because the lenght is over 7 bits but
+  // it's nice to enforce assertions to make assumptions explicit.
+  assert(*length <= 127);
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_parse_length(const uint8_t *buf,
+                                     internal::Size len_size,
+                                     internal::Size *length) const noexcept {
+  assert(buf != nullptr && length != nullptr);
+  assert(len_size == 2 || len_size == 8);
+  if (len_size == 8 && (buf[0] & 0x80) != 0) {
+    // See <https://tools.ietf.org/html/rfc6455#section-5.2>: "[...] the
+    // most significant bit MUST be 0."
+    LIBNDT_EMIT_WARNING("ws_parse_length: 64 bit length: invalid first bit");
+    return internal::Err::ws_proto;
+  }
+  *length = 0;
+  for (internal::Size i = 0; i < len_size; ++i) {
+    *length = (*length << 8) | buf[i];
+  }
+  return internal::Err::none;
+}
+
 internal::Err Client::ws_recv_frame(internal::Socket sock, uint8_t *opcode, bool *fin,
-      uint8_t *base, internal::Size total, internal::Size *count) const noexcept {
+      uint8_t *base, internal::Size total, internal::Size *count,
+      bool discard) const noexcept {
   // "Control frames (see Section 5.5) MAY be injected in the middle of
   // a fragmented message.  Control frames themselves MUST NOT be fragmented."
   //    -- RFC6455 Section 5.4.
@@ -24281,7 +30518,7 @@ again:
   *opcode = 0;
   *fin = false;
   *count = 0;
-  err = ws_recv_any_frame(sock, opcode, fin, base, total, count);
+  err = ws_recv_any_frame(sock, opcode, fin, base, total, count, discard);
   if (err != internal::Err::none) {
     LIBNDT_EMIT_WARNING("ws_recv_frame: ws_recv_any_frame() failed");
     return err;
@@ -24301,8 +30538,11 @@ again:
     return internal::Err::eof;
   }
   if (*opcode == ws_opcode_pong) {
-    // RFC6455 Sect. 5.5.3 says that we must ignore a PONG.
+    // RFC6455 Sect. 5.5.3 says that we must ignore a PONG, unless it is the
+    // reply to one of our own PINGs (see ndt7_maybe_ping()).
     LIBNDT_EMIT_DEBUG("ws_recv_frame: received PONG frame; continuing to read");
+    (void)ndt7_latency_.OnPong(
+        base, *count, usec_since(std::chrono::steady_clock::time_point{}));
     goto again;
   }
   if (*opcode == ws_opcode_ping) {
@@ -24324,6 +30564,18 @@ again:
 internal::Err Client::ws_recvmsg(  //
     internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
     internal::Size *count) const noexcept {
+  return ws_recvmsg_common(sock, opcode, base, total, count, false);
+}
+
+internal::Err Client::ws_recvmsg_discard(  //
+    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count) const noexcept {
+  return ws_recvmsg_common(sock, opcode, base, total, count, true);
+}
+
+internal::Err Client::ws_recvmsg_common(  //
+    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count, bool discard) const noexcept {
   // General remark from RFC6455 Sect. 5.4: "[I]n absence of extensions, senders
   // and receivers must not depend on [...] specific frame boundaries."
   //
@@ -24343,7 +30595,7 @@ internal::Err Client::ws_recvmsg(  //
   bool fin = false;
   *opcode = 0;
   *count = 0;
-  auto err = ws_recv_frame(sock, opcode, &fin, base, total, count);
+  auto err = ws_recv_frame(sock, opcode, &fin, base, total, count, discard);
   if (err != internal::Err::none) {
     // We don't want to scary the user in case of clean EOF
     if (err != internal::Err::eof) {
@@ -24359,14 +30611,23 @@ internal::Err Client::ws_recvmsg(  //
     LIBNDT_EMIT_DEBUG("ws_recv: the first frame is also the last frame");
     return internal::Err::none;
   }
-  while (*count < total) {
-    if ((uintptr_t)base > UINTPTR_MAX - *count) {
-      LIBNDT_EMIT_WARNING("ws_recv: avoiding pointer overflow");
-      return internal::Err::value_too_large;
+  // When discarding a binary message, we do not store its continuation frames
+  // hence the message size is not bounded by the size of the buffer.
+  bool discarding = discard && *opcode == ws_opcode_binary;
+  while (discarding || *count < total) {
+    uint8_t *where = base;
+    internal::Size avail = total;
+    if (!discarding) {
+      if ((uintptr_t)base > UINTPTR_MAX - *count) {
+        LIBNDT_EMIT_WARNING("ws_recv: avoiding pointer overflow");
+        return internal::Err::value_too_large;
+      }
+      where = base + *count;
+      avail = total - *count;
     }
     uint8_t op = 0;
 		internal::Size n = 0;
-    err = ws_recv_frame(sock, &op, &fin, base + *count, total - *count, &n);
+    err = ws_recv_frame(sock, &op, &fin, where, avail, &n, discarding);
     if (err != internal::Err::none) {
       LIBNDT_EMIT_WARNING("ws_recv: ws_recv_frame() failed for continuation frame");
       return err;
@@ -24386,8 +30647,342 @@ internal::Err Client::ws_recvmsg(  //
     }
     LIBNDT_EMIT_DEBUG("ws_recv: this is not the last frame");
   }
-  LIBNDT_EMIT_WARNING("ws_recv: buffer smaller than incoming message");
-  return internal::Err::message_size;
+  LIBNDT_EMIT_WARNING("ws_recv: buffer smaller than incoming message");
+  return internal::Err::message_size;
+}
+
+internal::Err Client::ws_close(internal::Socket sock, uint8_t *base,
+                               internal::Size total) const noexcept {
+  // Setting the FIN flag because control messages MUST NOT be fragmented
+  // as specified in Section 5.5 of RFC6455.
+  auto err = ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+  if (err != internal::Err::none) {
+    LIBNDT_EMIT_WARNING("ws_close: cannot send CLOSE frame");
+    return err;
+  }
+  // The peer may have sent more frames before receiving our CLOSE. We use
+  // ws_recv_any_frame() rather than ws_recv_frame(), since the latter would
+  // reply to the peer's CLOSE with another CLOSE. (We MUST NOT send any other
+  // frame after CLOSE, hence we also don't reply to PING.)
+  for (;;) {
+    uint8_t opcode = 0;
+    bool fin = false;
+    internal::Size count = 0;
+    err = ws_recv_any_frame(sock, &opcode, &fin, base, total, &count, true);
+    if (err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING("ws_close: ws_recv_any_frame() failed");
+      return err;
+    }
+    if (opcode == ws_opcode_close) {
+      LIBNDT_EMIT_DEBUG("ws_close: received CLOSE frame");
+      return internal::Err::none;
+    }
+  }
+}
+
+internal::Err Client::ws_recvn(internal::Socket sock, void *base,
+                               internal::Size count) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    return netx_recvn(sock, base, count);
+  }
+  uint8_t *dest = (uint8_t *)base;
+  while (count > 0) {
+    if (rbuf->begin >= rbuf->end) {
+      internal::Size n = 0;
+      if (count >= rbuf->capacity) {
+        // Bypass the buffer, since it would not save us any recv call.
+        auto err = netx_recv(sock, dest, count, &n);
+        rbuf->stats.recv_calls += 1;
+        if (err != internal::Err::none) {
+          return err;
+        }
+        assert(n <= count);
+        dest += n;
+        count -= n;
+        continue;
+      }
+      rbuf->begin = rbuf->end = 0;
+      auto err = netx_recv(sock, rbuf->data.get(), rbuf->capacity, &n);
+      rbuf->stats.recv_calls += 1;
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= rbuf->capacity);
+      rbuf->end = n;
+    }
+    internal::Size avail = rbuf->end - rbuf->begin;
+    internal::Size amount = (count < avail) ? count : avail;
+    memcpy(dest, rbuf->data.get() + rbuf->begin, (size_t)amount);
+    rbuf->begin += amount;
+    dest += amount;
+    count -= amount;
+  }
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_discardn(internal::Socket sock,
+                                  internal::Size count) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    uint8_t scratch[8192];
+    while (count > 0) {
+      internal::Size amount = (count < sizeof(scratch)) ? count : sizeof(scratch);
+      auto err = netx_recvn(sock, scratch, amount);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      count -= amount;
+    }
+    return internal::Err::none;
+  }
+  while (count > 0) {
+    if (rbuf->begin >= rbuf->end) {
+      internal::Size n = 0;
+      rbuf->begin = rbuf->end = 0;
+      auto err = netx_recv(sock, rbuf->data.get(), rbuf->capacity, &n);
+      rbuf->stats.recv_calls += 1;
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= rbuf->capacity);
+      rbuf->end = n;
+    }
+    internal::Size avail = rbuf->end - rbuf->begin;
+    internal::Size amount = (count < avail) ? count : avail;
+    rbuf->begin += amount;
+    count -= amount;
+  }
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_recv_nonblocking(
+    internal::Socket sock, void *base, internal::Size count,
+    internal::Size *actual) const noexcept {
+  assert(actual != nullptr && count > 0);
+  *actual = 0;
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr) {
+    if (base != nullptr) {
+      return netx_recv_nonblocking(sock, base, count, actual);
+    }
+    uint8_t scratch[8192];
+    internal::Size amount = (count < sizeof(scratch)) ? count : sizeof(scratch);
+    return netx_recv_nonblocking(sock, scratch, amount, actual);
+  }
+  if (rbuf->begin >= rbuf->end) {
+    if (base != nullptr && count >= rbuf->capacity) {
+      // Bypass the buffer, since it would not save us any recv call.
+      auto err = netx_recv_nonblocking(sock, base, count, actual);
+      rbuf->stats.recv_calls += 1;
+      return err;
+    }
+    internal::Size n = 0;
+    rbuf->begin = rbuf->end = 0;
+    auto err = netx_recv_nonblocking(sock, rbuf->data.get(), rbuf->capacity, &n);
+    rbuf->stats.recv_calls += 1;
+    if (err != internal::Err::none) {
+      return err;
+    }
+    assert(n <= rbuf->capacity);
+    rbuf->end = n;
+  }
+  internal::Size avail = rbuf->end - rbuf->begin;
+  internal::Size amount = (count < avail) ? count : avail;
+  if (base != nullptr) {
+    memcpy(base, rbuf->data.get() + rbuf->begin, (size_t)amount);
+  }
+  rbuf->begin += amount;
+  *actual = amount;
+  return internal::Err::none;
+}
+
+internal::Err Client::ws_recvmsg_nonblocking(
+    internal::Socket sock, WsReader *reader, uint8_t *opcode, uint8_t *base,
+    internal::Size total, internal::Size *count) const noexcept {
+  if (reader == nullptr || opcode == nullptr || count == nullptr) {
+    LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: passed invalid return arguments");
+    return internal::Err::invalid_argument;
+  }
+  if (base == nullptr || total <= 0) {
+    LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: passed invalid buffer arguments");
+    return internal::Err::invalid_argument;
+  }
+  *opcode = 0;
+  *count = 0;
+  for (;;) {
+    // Frame header, including the extended length, if any.
+    while (!reader->in_body) {
+      internal::Size n = 0;
+      auto err = ws_recv_nonblocking(sock, reader->header + reader->header_size,
+                                     reader->header_need - reader->header_size,
+                                     &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      reader->received += n;
+      reader->header_size += n;
+      if (reader->header_size < reader->header_need) {
+        continue;
+      }
+      internal::Size length = 0;
+      err = ws_parse_header(reader->header, &reader->opcode, &reader->fin,
+                            &length);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      if (length == 126 || length == 127) {
+        internal::Size len_size = (length == 126) ? 2 : 8;
+        if (reader->header_need < 2 + len_size) {
+          reader->header_need = 2 + len_size;
+          continue;
+        }
+        err = ws_parse_length(reader->header + 2, len_size, &length);
+        if (err != internal::Err::none) {
+          return err;
+        }
+      }
+      LIBNDT_EMIT_DEBUG("ws_recvmsg_nonblocking: FIN: " << std::boolalpha
+                        << reader->fin << "; opcode: "
+                        << (unsigned int)reader->opcode
+                        << "; length: " << length);
+      {
+        auto rbuf = ws_recv_buffer(sock);
+        if (rbuf != nullptr) {
+          rbuf->stats.frames += 1;
+        }
+      }
+      count_frame(counter_recv_frame_sizes, length);
+      LIBNDT_TRACE(recv_frame, sock, length);
+      switch (reader->opcode) {
+        case ws_opcode_text:
+        case ws_opcode_binary:
+          if (reader->message != 0) {
+            LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: expected continuation");
+            return internal::Err::ws_proto;
+          }
+          reader->message = reader->opcode;
+          reader->count = 0;
+          break;
+        case ws_opcode_continue:
+          if (reader->message == 0) {
+            LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: unexpected continuation");
+            return internal::Err::ws_proto;
+          }
+          break;
+      }
+      bool data = (reader->opcode == ws_opcode_text ||
+                   reader->opcode == ws_opcode_binary ||
+                   reader->opcode == ws_opcode_continue);
+      // Like ws_recvmsg_discard(), we only store text messages.
+      if (data && reader->message != ws_opcode_binary &&
+          length > total - reader->count) {
+        LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: buffer smaller than "
+                            "incoming message");
+        return internal::Err::message_size;
+      }
+      if (data && reader->count > internal::SizeMax - length) {
+        LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: avoiding integer overflow");
+        return internal::Err::value_too_large;
+      }
+      reader->in_body = true;
+      reader->remaining = length;
+      reader->control_size = 0;
+    }
+    // Frame body.
+    bool control = (reader->opcode == ws_opcode_close ||
+                    reader->opcode == ws_opcode_ping ||
+                    reader->opcode == ws_opcode_pong);
+    while (reader->remaining > 0) {
+      uint8_t *where = nullptr;  // discard
+      if (control) {
+        where = reader->control + reader->control_size;
+      } else if (reader->message != ws_opcode_binary) {
+        where = base + reader->count;
+      }
+      internal::Size n = 0;
+      auto err = ws_recv_nonblocking(sock, where, reader->remaining, &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      assert(n <= reader->remaining);
+      reader->received += n;
+      reader->remaining -= n;
+      if (control) {
+        reader->control_size += n;
+      } else {
+        reader->count += n;
+      }
+    }
+    reader->in_body = false;
+    reader->header_size = 0;
+    reader->header_need = 2;
+    // See ws_recv_frame() and ws_close() for how we handle control frames.
+    if (reader->opcode == ws_opcode_close) {
+      reader->closed = true;
+      if (!reader->closing) {
+        LIBNDT_EMIT_DEBUG("ws_recvmsg_nonblocking: received CLOSE frame; "
+                          "sending CLOSE back");
+        (void)ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+      }
+      return internal::Err::eof;
+    }
+    if (reader->opcode == ws_opcode_pong) {
+      if (ndt7_latency_.OnPong(
+              reader->control, reader->control_size,
+              usec_since(std::chrono::steady_clock::time_point{}))) {
+        reader->pongs += 1;
+      }
+      continue;
+    }
+    if (reader->opcode == ws_opcode_ping) {
+      if (!reader->closing) {
+        auto err = ws_send_frame(sock, ws_opcode_pong | ws_fin_flag,
+                                 reader->control, reader->control_size);
+        if (err != internal::Err::none) {
+          LIBNDT_EMIT_WARNING("ws_recvmsg_nonblocking: ws_send_frame() failed "
+                              "for PONG frame");
+          return err;
+        }
+      }
+      continue;
+    }
+    if (reader->fin) {
+      *opcode = reader->message;
+      *count = reader->count;
+      reader->message = 0;
+      reader->count = 0;
+      return internal::Err::none;
+    }
+  }
+}
+
+bool Client::ws_recv_stats(internal::Socket sock,
+                           WsRecvStats *stats) const noexcept {
+  auto rbuf = ws_recv_buffer(sock);
+  if (rbuf == nullptr || stats == nullptr) {
+    return false;
+  }
+  *stats = rbuf->stats;
+  return true;
+}
+
+Client::WsRecvBuffer *Client::ws_recv_buffer(
+    internal::Socket sock) const noexcept {
+  auto conn = connection(sock);
+  return (conn != nullptr && conn->ws.data) ? &conn->ws : nullptr;
+}
+
+Client::Connection *Client::connection(internal::Socket sock) const noexcept {
+  return connections_.Find(sock);
+}
+
+Client::Connection *Client::connection_create(internal::Socket sock) noexcept {
+  auto conn = connections_.Find(sock);
+  if (conn == nullptr) {
+    conn = connections_.Insert(sock, std::unique_ptr<Connection>{new Connection{}});
+  }
+  return conn;
 }
 
 // } - - - END WEBSOCKET IMPLEMENTATION - - -
@@ -24490,7 +31085,10 @@ static int libndt_bio_write(BIO *bio, const char *base, int count) noexcept {
   return libndt_bio_operation(
       bio, (char *)base, count,
       [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Send(sock, (const char *)base, count);
+        clnt->atomic_counters.Add(Client::counter_send_calls);
+        auto rv = clnt->sys->Send(sock, (const char *)base, count);
+        LIBNDT_TRACE_EX(clnt, send, sock, rv);
+        return rv;
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_write(bio); });
   // clang-format on
@@ -24502,7 +31100,10 @@ static int libndt_bio_read(BIO *bio, char *base, int count) noexcept {
   return libndt_bio_operation(
       bio, base, count,
       [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Recv(sock, base, count);
+        clnt->atomic_counters.Add(Client::counter_recv_calls);
+        auto rv = clnt->sys->Recv(sock, base, count);
+        LIBNDT_TRACE_EX(clnt, recv, sock, rv);
+        return rv;
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_read(bio); });
   // clang-format on
@@ -24559,8 +31160,12 @@ static internal::Err map_ssl_error(const Client *client, SSL *ssl, int ret) noex
       // TODO(bassosimone): consider the issue of dirty shutdown.
       return internal::Err::eof;
     case SSL_ERROR_WANT_READ:
+      client->atomic_counters.Add(Client::counter_ssl_want_read);
+      LIBNDT_TRACE_EX(client, ssl_want_read, (internal::Socket)::SSL_get_fd(ssl), 0);
       return internal::Err::ssl_want_read;
     case SSL_ERROR_WANT_WRITE:
+      client->atomic_counters.Add(Client::counter_ssl_want_write);
+      LIBNDT_TRACE_EX(client, ssl_want_write, (internal::Socket)::SSL_get_fd(ssl), 0);
       return internal::Err::ssl_want_write;
     case SSL_ERROR_SYSCALL:
       auto ecode = client->sys->GetLastError();
@@ -24615,12 +31220,27 @@ internal::Err Client::netx_maybews_dial(const std::string &hostname,
     return internal::Err::none;
   }
   LIBNDT_EMIT_DEBUG("netx_maybews_dial: about to start websocket handhsake");
+  {
+    // Note that we setup the receive buffer before the handshake, because
+    // the server may send frames right after the handshake response and we
+    // may thus read them along with the response.
+    constexpr internal::Size ws_recv_buffer_size = 1 << 16;
+    auto &rbuf = connection_create(*sock)->ws;
+    rbuf.data.reset(new uint8_t[ws_recv_buffer_size]);
+    rbuf.capacity = ws_recv_buffer_size;
+    rbuf.begin = rbuf.end = 0;
+  }
+  auto begin = std::chrono::steady_clock::now();
   err = ws_handshake(*sock, port, ws_flags, ws_protocol, url_path);
   if (err != internal::Err::none) {
     (void)netx_closesocket(*sock);
     *sock = (internal::Socket)-1;
     return err;
   }
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_ws_handshakes);
+  atomic_counters.Add(counter_ws_handshake_usec, usec);
+  LIBNDT_TRACE(ws_handshake, *sock, usec);
   LIBNDT_EMIT_DEBUG("netx_maybews_dial: established websocket channel");
   return internal::Err::none;
 }
@@ -24671,49 +31291,59 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
   }
   SSL *ssl = nullptr;
   {
-    // TODO(bassosimone): understand whether we can remove old SSL versions
-    // taking into account that the NDT server runs on very old code.
-    SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+    // The cache creates the context and loads the CA bundle only once.
+    SSL_CTX *ctx = ssl_cache->Context(settings_.ca_bundle_path,
+                                      settings_.tls_verify_peer);
     if (ctx == nullptr) {
-      LIBNDT_EMIT_WARNING("SSL_CTX_new() failed");
+      LIBNDT_EMIT_WARNING("Cannot create SSL_CTX or load the CA bundle path");
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
-    LIBNDT_EMIT_DEBUG("SSL_CTX created");
-    if (settings_.tls_verify_peer) {
-      if (!::SSL_CTX_load_verify_locations(  //
-              ctx, settings_.ca_bundle_path.c_str(), nullptr)) {
-        LIBNDT_EMIT_WARNING("Cannot load the CA bundle path from the file system");
-        ::SSL_CTX_free(ctx);
-        netx_closesocket(*sock);
-        return internal::Err::ssl_generic;
-      }
-      LIBNDT_EMIT_DEBUG("Loaded the CA bundle path");
-    }
+    LIBNDT_EMIT_DEBUG("SSL_CTX ready");
     ssl = ::SSL_new(ctx);
     if (ssl == nullptr) {
       LIBNDT_EMIT_WARNING("SSL_new() failed");
-      ::SSL_CTX_free(ctx);
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
     LIBNDT_EMIT_DEBUG("SSL created");
-    ::SSL_CTX_free(ctx);  // Referenced by `ssl` so safe to free here
-    assert(fd_to_ssl_.count(*sock) == 0);
+    auto conn = connection_create(*sock);
+    assert(conn->ssl == nullptr);
     // Implementation note: after this point `netx_closesocket(*sock)` will
     // imply that `::SSL_free(ssl)` is also called.
-    fd_to_ssl_[*sock] = ssl;
+    conn->ssl = ssl;
+  }
+  // We key sessions by hostname and port, such that, e.g., the ndt7 upload
+  // resumes the session of the download, and an ndt5 data connection resumes
+  // the session of a previous data connection to the same port, but not the
+  // session of the control connection, which uses another port. The cache
+  // also keys sessions by context, i.e., by CA bundle path and by whether we
+  // verify the peer.
+  if (!ssl_cache->Prepare(ssl, hostname + ":" + port)) {
+    LIBNDT_EMIT_WARNING("Cannot prepare SSL for session resumption");
+    netx_closesocket(*sock);
+    return internal::Err::ssl_generic;
+  }
+  // With kTLS, OpenSSL must drive the socket directly, because it uses
+  // socket options and control messages our BIO knows nothing about. So, we
+  // use a socket BIO, which bypasses `sys`, and we use our BIO otherwise.
+  bool ktls = false;
+#ifdef LIBNDT_HAVE_KTLS
+  ktls = settings_.tls_ktls;
+  if (ktls) {
+    ::SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
   }
-  BIO *bio = ::BIO_new(libndt_bio_method());
+#endif
+  BIO *bio = ::BIO_new(ktls ? ::BIO_s_socket() : libndt_bio_method());
   if (bio == nullptr) {
     LIBNDT_EMIT_WARNING("BIO_new() failed");
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because of connections_
     return internal::Err::ssl_generic;
   }
-  LIBNDT_EMIT_DEBUG("libndt BIO created");
+  LIBNDT_EMIT_DEBUG("BIO created");
   // We use BIO_NOCLOSE because it's the socket that owns the BIO and the SSL
-  // via fd_to_ssl rather than the other way around. Note that sockets are
+  // via connections_ rather than the other way around. Note that sockets are
   // always `int` in OpenSSL notwithstanding their definition on Windows, so
   // here we're casting unconditionally to silence compiler warnings.
   //
@@ -24724,7 +31354,9 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
   // For historical reasons, if the two BIOs are equal, the SSL object will
   // increase the refcount of bio just once rather than twice.
   ::SSL_set_bio(ssl, bio, bio);
-  ::BIO_set_data(bio, this);
+  if (!ktls) {
+    ::BIO_set_data(bio, this);  // The socket BIO uses its data with kTLS
+  }
   ::SSL_set_connect_state(ssl);
   LIBNDT_EMIT_DEBUG("Socket added to SSL context");
   if (settings_.tls_verify_peer) {
@@ -24737,12 +31369,13 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
     if (!::X509_VERIFY_PARAM_set1_host(p, hostname.data(), hostname.size())) {
       LIBNDT_EMIT_WARNING("Cannot set the hostname for hostname validation");
       netx_closesocket(*sock);
-      //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+      //::SSL_free(ssl); // MUST NOT be called because of connections_
       return internal::Err::ssl_generic;
     }
     SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
     LIBNDT_EMIT_DEBUG("SSL_VERIFY_PEER configured");
   }
+  auto begin = std::chrono::steady_clock::now();
   err = ssl_retry_unary_op("SSL_do_handshake", this, ssl, *sock,
                            settings_.timeout, [](SSL *ssl) -> int {
                              ERR_clear_error();
@@ -24750,10 +31383,36 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
                            });
   if (err != internal::Err::none) {
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because of connections_
     return internal::Err::ssl_generic;
   }
-  LIBNDT_EMIT_DEBUG("SSL handshake complete");
+  {
+    auto usec = usec_since(begin);
+    atomic_counters.Add(counter_tls_handshakes);
+    atomic_counters.Add(counter_tls_handshake_usec, usec);
+    LIBNDT_TRACE(tls_handshake, *sock, usec);
+  }
+  LIBNDT_EMIT_DEBUG("SSL handshake complete; session reused: "
+                    << std::boolalpha << (::SSL_session_reused(ssl) != 0));
+#ifdef LIBNDT_HAVE_KTLS
+  if (ktls) {
+    bool ktls_send = BIO_get_ktls_send(::SSL_get_wbio(ssl)) != 0;
+    bool ktls_recv = BIO_get_ktls_recv(::SSL_get_rbio(ssl)) != 0;
+    LIBNDT_EMIT_DEBUG("kTLS enabled for sending: " << std::boolalpha
+                      << ktls_send << "; for receiving: " << ktls_recv);
+    if (!ktls_send && !ktls_recv) {
+      // Switch back to our BIO, such that I/O goes through `sys` like when
+      // kTLS is disabled. This is safe because the socket BIO does not
+      // buffer and SSL_set_bio() frees the socket BIO.
+      BIO *ours = ::BIO_new(libndt_bio_method());
+      if (ours != nullptr) {
+        ::BIO_set_fd(ours, (int)*sock, BIO_NOCLOSE);
+        ::SSL_set_bio(ssl, ours, ours);
+        ::BIO_set_data(ours, this);
+      }
+    }
+  }
+#endif
   return internal::Err::none;
 }
 
@@ -25046,6 +31705,7 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
     LIBNDT_EMIT_WARNING("netx_dial: socket already connected");
     return internal::Err::invalid_argument;
   }
+  auto begin = std::chrono::steady_clock::now();
   // Implementation note: we could perform getaddrinfo() in one pass but having
   // a virtual API that resolves a hostname to a vector of IP addresses makes
   // life easier when you want to override hostname resolution, because you have
@@ -25055,6 +31715,14 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
   if ((err = netx_resolve(hostname, &addresses)) != internal::Err::none) {
     return err;
   }
+  // Collect the addresses to try, keeping track of the address string they
+  // come from for logging purposes. We free them before returning.
+  struct Candidate {
+    const addrinfo *aip;
+    const std::string *addr;
+  };
+  std::vector<addrinfo *> results;
+  std::vector<Candidate> candidates;
   for (auto &addr : addresses) {
     addrinfo hints{};
     hints.ai_socktype = SOCK_STREAM;
@@ -25063,81 +31731,245 @@ internal::Err Client::netx_dial(const std::string &hostname, const std::string &
     int rv = sys->Getaddrinfo(addr.data(), port.data(), &hints, &rp);
     if (rv != 0) {
       LIBNDT_EMIT_WARNING("netx_dial: unexpected getaddrinfo() failure");
+      for (auto result : results) {
+        sys->Freeaddrinfo(result);
+      }
       return netx_map_eai(rv);
     }
     assert(rp);
+    results.push_back(rp);
     for (auto aip = rp; (aip); aip = aip->ai_next) {
-      sys->SetLastError(0);
-      *sock = sys->NewSocket(aip->ai_family, aip->ai_socktype, 0);
-      if (!internal::IsSocketValid(*sock)) {
-        LIBNDT_EMIT_WARNING("netx_dial: socket() failed");
-        continue;
+      candidates.push_back(Candidate{aip, &addr});
+    }
+  }
+  // As recommended by RFC8305 Sect. 4, we interleave the address families
+  // starting with the family of the first address, so that, e.g., a broken
+  // IPv6 path doesn't prevent us from quickly trying IPv4 addresses.
+  {
+    std::vector<Candidate> first, second;
+    for (auto &c : candidates) {
+      auto &v = (c.aip->ai_family == candidates[0].aip->ai_family) ? first : second;
+      v.push_back(c);
+    }
+    candidates.clear();
+    for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+      if (i < first.size()) {
+        candidates.push_back(first[i]);
       }
-#ifdef SO_NOSIGPIPE
-      // Implementation note: SO_NOSIGPIPE is the nonportable BSD solution to
-      // avoid SIGPIPE when writing on a connection closed by the peer.
-      {
-        auto on = 1;
-        if (::setsockopt(  //
-                *sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
-          LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_NOSIGPIPE) failed");
-          sys->Closesocket(*sock);
-          *sock = -1;
-          continue;
-        }
+      if (i < second.size()) {
+        candidates.push_back(second[i]);
       }
-#endif  // SO_NOSIGPIPE
-      if (netx_setnonblocking(*sock, true) != internal::Err::none) {
-        LIBNDT_EMIT_WARNING("netx_dial: netx_setnonblocking() failed");
-        sys->Closesocket(*sock);
-        *sock = (libndt::internal::Socket)-1;
-        continue;
+    }
+  }
+  // We start a new connect attempt every netx_dial_attempt_delay_msec or as
+  // soon as an attempt fails, without waiting for the pending ones, and we
+  // use the first attempt that succeeds (RFC8305 Sect. 5).
+  struct Attempt {
+    internal::Socket sock;
+    Candidate candidate;
+    std::chrono::steady_clock::time_point begin;
+  };
+  auto since = [](const Attempt &attempt) -> double {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - attempt.begin;
+    return elapsed.count();
+  };
+  std::vector<Attempt> attempts;
+  size_t next = 0;
+  auto start_next = true;
+  std::chrono::steady_clock::time_point deadline;
+  std::vector<pollfd> pfds;
+  err = internal::Err::io_error;
+  while (!internal::IsSocketValid(*sock)) {
+    if (is_cancelled()) {
+      err = internal::Err::cancelled;
+      break;
+    }
+    while (start_next && next < candidates.size()) {
+      Attempt attempt{(internal::Socket)-1, candidates[next++],
+                      std::chrono::steady_clock::now()};
+      auto start_err = netx_dial_start(attempt.candidate.aip, &attempt.sock);
+      if (start_err == internal::Err::none) {
+        LIBNDT_EMIT_DEBUG("netx_dial: connect() to " << *attempt.candidate.addr
+                          << ": okay immediately after " << since(attempt)
+                          << " ms");
+        *sock = attempt.sock;
+        break;
       }
-      // While on Unix ai_addrlen is socklen_t, it's size_t on Windows. Just
-      // for the sake of correctness, add a check that ensures that the size has
-      // a reasonable value before casting to socklen_t. My understanding is
-      // that size_t is `ULONG_PTR` while socklen_t is most likely `int`.
-#ifdef _WIN32
-      if (aip->ai_addrlen > sizeof(sockaddr_in6)) {
-        LIBNDT_EMIT_WARNING("netx_dial: unexpected size of aip->ai_addrlen");
-        sys->Closesocket(*sock);
-        *sock = (libndt::internal::Socket)-1;
-        continue;
+      if (start_err == internal::Err::operation_in_progress) {
+        attempts.push_back(attempt);
+        deadline = attempt.begin + std::chrono::seconds(settings_.timeout);
+        start_next = false;
+        break;
       }
-#endif
-      if (sys->Connect(*sock, aip->ai_addr, (socklen_t)aip->ai_addrlen) == 0) {
-        LIBNDT_EMIT_DEBUG("netx_dial: connect(): okay immediately");
+      LIBNDT_EMIT_WARNING("netx_dial: connect() to " << *attempt.candidate.addr
+                          << " failed: " << internal::libndt_perror(start_err));
+    }
+    start_next = false;
+    if (internal::IsSocketValid(*sock) || attempts.empty()) {
+      break;
+    }
+    pfds.clear();
+    for (auto &attempt : attempts) {
+      pollfd pfd{};
+      pfd.fd = attempt.sock;
+      pfd.events = POLLOUT;
+      pfds.push_back(pfd);
+    }
+    // When there are no more addresses to try, we wait until the deadline
+    // of the most recent attempt, which is the latest deadline.
+    auto more = next < candidates.size();
+    int timeout_msec = netx_dial_attempt_delay_msec;
+    if (!more) {
+      std::chrono::duration<double, std::milli> remaining =
+          deadline - std::chrono::steady_clock::now();
+      timeout_msec = (remaining.count() > 0.0) ? (int)remaining.count() : 0;
+    }
+    auto poll_err = netx_poll(&pfds, timeout_msec);
+    if (poll_err == internal::Err::timed_out) {
+      if (!more) {
+        LIBNDT_EMIT_WARNING("netx_dial: connect() timed out");
         break;
       }
-      auto connect_err = netx_map_errno(sys->GetLastError());
-      if (CONNECT_IN_PROGRESS(connect_err)) {
-        connect_err = netx_wait_writeable(*sock, settings_.timeout);
-        if (connect_err == internal::Err::none) {
-          int soerr = 0;
-          socklen_t soerrlen = sizeof(soerr);
-          if (sys->Getsockopt(*sock, SOL_SOCKET, SO_ERROR, (void *)&soerr,
-                             &soerrlen) == 0) {
-            assert(soerrlen == sizeof(soerr));
-            if (soerr == 0) {
-              LIBNDT_EMIT_DEBUG("netx_dial: connect(): okay");
-              break;
-            }
-            sys->SetLastError(soerr);
-          }
-        }
+      start_next = true;
+      continue;
+    }
+    if (poll_err != internal::Err::none) {
+      LIBNDT_EMIT_WARNING(
+          "netx_dial: netx_poll() failed: " << internal::libndt_perror(poll_err));
+      err = poll_err;
+      break;
+    }
+    for (size_t i = pfds.size(); i > 0; --i) {
+      if (pfds[i - 1].revents == 0) {
+        continue;
+      }
+      auto attempt = attempts[i - 1];
+      attempts.erase(attempts.begin() + (ptrdiff_t)(i - 1));
+      int soerr = 0;
+      socklen_t soerrlen = sizeof(soerr);
+      if (sys->Getsockopt(attempt.sock, SOL_SOCKET, SO_ERROR, (void *)&soerr,
+                          &soerrlen) == 0) {
+        assert(soerrlen == sizeof(soerr));
+        if (soerr == 0) {
+          LIBNDT_EMIT_DEBUG("netx_dial: connect() to " << *attempt.candidate.addr
+                            << ": okay after " << since(attempt) << " ms");
+          *sock = attempt.sock;
+          break;  // the other attempts are abandoned below
+        }
+        sys->SetLastError(soerr);
       }
-      LIBNDT_EMIT_WARNING("netx_dial: connect() failed: "
-                   << internal::libndt_perror(netx_map_errno(sys->GetLastError())));
+      LIBNDT_EMIT_WARNING("netx_dial: connect() to " << *attempt.candidate.addr
+                          << " failed after " << since(attempt) << " ms: "
+                          << internal::libndt_perror(
+                                 netx_map_errno(sys->GetLastError())));
+      sys->Closesocket(attempt.sock);
+      start_next = true;
+    }
+  }
+  for (auto &attempt : attempts) {
+    LIBNDT_EMIT_DEBUG("netx_dial: abandoning connect() to "
+                      << *attempt.candidate.addr << " after " << since(attempt)
+                      << " ms");
+    sys->Closesocket(attempt.sock);
+  }
+  for (auto result : results) {
+    sys->Freeaddrinfo(result);
+  }
+  if (!internal::IsSocketValid(*sock)) {
+    return err;
+  }
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_connects);
+  atomic_counters.Add(counter_connect_usec, usec);
+  LIBNDT_TRACE(connect, *sock, usec);
+  return internal::Err::none;
+}
+
+internal::Err Client::netx_dial_start(const addrinfo *aip,
+                                      internal::Socket *sock) noexcept {
+  assert(aip != nullptr && sock != nullptr);
+  sys->SetLastError(0);
+  *sock = sys->NewSocket(aip->ai_family, aip->ai_socktype, 0);
+  if (!internal::IsSocketValid(*sock)) {
+    LIBNDT_EMIT_WARNING("netx_dial: socket() failed");
+    return netx_map_errno(sys->GetLastError());
+  }
+  auto err = internal::Err::none;
+#ifdef SO_NOSIGPIPE
+  // Implementation note: SO_NOSIGPIPE is the nonportable BSD solution to
+  // avoid SIGPIPE when writing on a connection closed by the peer.
+  {
+    auto on = 1;
+    if (::setsockopt(  //
+            *sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_NOSIGPIPE) failed");
+      err = netx_map_errno(sys->GetLastError());
       sys->Closesocket(*sock);
-      *sock = (libndt::internal::Socket)-1;
+      *sock = (internal::Socket)-1;
+      return err;
+    }
+  }
+#endif  // SO_NOSIGPIPE
+  if ((err = netx_setnonblocking(*sock, true)) != internal::Err::none) {
+    LIBNDT_EMIT_WARNING("netx_dial: netx_setnonblocking() failed");
+    sys->Closesocket(*sock);
+    *sock = (internal::Socket)-1;
+    return err;
+  }
+  netx_tune_socket(*sock);
+  // While on Unix ai_addrlen is socklen_t, it's size_t on Windows. Just
+  // for the sake of correctness, add a check that ensures that the size has
+  // a reasonable value before casting to socklen_t. My understanding is
+  // that size_t is `ULONG_PTR` while socklen_t is most likely `int`.
+#ifdef _WIN32
+  if (aip->ai_addrlen > sizeof(sockaddr_in6)) {
+    LIBNDT_EMIT_WARNING("netx_dial: unexpected size of aip->ai_addrlen");
+    sys->Closesocket(*sock);
+    *sock = (internal::Socket)-1;
+    return internal::Err::invalid_argument;
+  }
+#endif
+  atomic_counters.Add(counter_connect_calls);
+  if (sys->Connect(*sock, aip->ai_addr, (socklen_t)aip->ai_addrlen) == 0) {
+    return internal::Err::none;
+  }
+  err = netx_map_errno(sys->GetLastError());
+  if (CONNECT_IN_PROGRESS(err)) {
+    return internal::Err::operation_in_progress;
+  }
+  sys->Closesocket(*sock);
+  *sock = (internal::Socket)-1;
+  return (err != internal::Err::none) ? err : internal::Err::io_error;
+}
+
+void Client::netx_tune_socket(internal::Socket sock) noexcept {
+  if (settings_.socket_send_buffer > 0) {
+    int value = settings_.socket_send_buffer;
+    if (sys->Setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_SNDBUF) failed");
+    }
+  }
+  if (settings_.socket_recv_buffer > 0) {
+    int value = settings_.socket_recv_buffer;
+    if (sys->Setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING("netx_dial: setsockopt(..., SO_RCVBUF) failed");
     }
-    sys->Freeaddrinfo(rp);
-    if (*sock != -1) {
-      break;  // we have a connection!
+  }
+  if (settings_.tcp_notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+    int value = settings_.tcp_notsent_lowat;
+    if (sys->Setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value,
+                        sizeof(value)) != 0) {
+      LIBNDT_EMIT_WARNING(
+          "netx_dial: setsockopt(..., TCP_NOTSENT_LOWAT) failed");
     }
+#else
+    LIBNDT_EMIT_WARNING("netx_dial: TCP_NOTSENT_LOWAT is not available");
+#endif
   }
-  // TODO(bassosimone): it's possible to write a better algorithm here
-  return *sock != -1 ? internal::Err::none : internal::Err::io_error;
 }
 
 #undef CONNECT_IN_PROGRESS  // Tidy
@@ -25178,20 +32010,28 @@ internal::Err Client::netx_recv_nonblocking(internal::Socket fd, void *base, int
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
     ERR_clear_error();
     int ret = ::SSL_read(ssl, base, (int)count);
+    atomic_counters.Add(counter_ssl_read_calls);
+    if (settings_.tls_ktls && netx_ktls(fd)) {
+      atomic_counters.Add(counter_recv_calls);  // our BIO cannot count it
+    }
+    LIBNDT_TRACE(ssl_read, fd, ret);
     if (ret <= 0) {
       return map_ssl_error(this, ssl, ret);
     }
     *actual = (internal::Size)ret;
     return internal::Err::none;
   }
+  atomic_counters.Add(counter_recv_calls);
   auto rv = sys->Recv(fd, base, count);
+  LIBNDT_TRACE(recv, fd, rv);
   if (rv < 0) {
     assert(rv == -1);
     return netx_map_errno(sys->GetLastError());
@@ -25255,24 +32095,36 @@ internal::Err Client::netx_send_nonblocking(internal::Socket fd, const void *bas
     return internal::Err::invalid_argument;
   }
   sys->SetLastError(0);
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+  // With kTLS the kernel encrypts what we write, so we skip OpenSSL. We never
+  // mix the two approaches on a socket: once kTLS is enabled we only use
+  // SSL_write() indirectly, e.g., when SSL_shutdown() sends close_notify.
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0 &&
+      !(settings_.tls_ktls && netx_ktls_send(fd))) {
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     ERR_clear_error();
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
     int ret = ::SSL_write(ssl, base, (int)count);
+    atomic_counters.Add(counter_ssl_write_calls);
+    if (settings_.tls_ktls && netx_ktls(fd)) {
+      atomic_counters.Add(counter_send_calls);  // our BIO cannot count it
+    }
+    LIBNDT_TRACE(ssl_write, fd, ret);
     if (ret <= 0) {
       return map_ssl_error(this, ssl, ret);
     }
     *actual = (internal::Size)ret;
     return internal::Err::none;
   }
+  atomic_counters.Add(counter_send_calls);
   auto rv = sys->Send(fd, base, count);
+  LIBNDT_TRACE(send, fd, rv);
   if (rv < 0) {
     assert(rv == -1);
     return netx_map_errno(sys->GetLastError());
@@ -25287,6 +32139,31 @@ internal::Err Client::netx_send_nonblocking(internal::Socket fd, const void *bas
   return internal::Err::none;
 }
 
+bool Client::netx_ktls_send(internal::Socket fd) const noexcept {
+#ifdef LIBNDT_HAVE_KTLS
+  auto conn = connection(fd);
+  return conn != nullptr && conn->ssl != nullptr &&
+         BIO_get_ktls_send(::SSL_get_wbio(conn->ssl)) != 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
+bool Client::netx_ktls(internal::Socket fd) const noexcept {
+#ifdef LIBNDT_HAVE_KTLS
+  // We switch back to our BIO when kTLS is enabled neither for sending nor
+  // for receiving, so in all other cases we are using the socket BIO.
+  auto conn = connection(fd);
+  return conn != nullptr && conn->ssl != nullptr &&
+         (BIO_get_ktls_send(::SSL_get_wbio(conn->ssl)) != 0 ||
+          BIO_get_ktls_recv(::SSL_get_rbio(conn->ssl)) != 0);
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
 internal::Err Client::netx_sendn(internal::Socket fd, const void *base, internal::Size count) const noexcept {
 	internal::Size off = 0;
   while (off < count) {
@@ -25399,7 +32276,19 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd, Timeou
   if (timeout > INT_MAX / 1000) {
     timeout = INT_MAX / 1000;
   }
-  auto err = client->netx_poll(&pfds, (int)timeout * 1000);
+  // We poll in slices, so that we notice within a slice if the test has been
+  // cancelled by another thread (see Client::cancel()).
+  constexpr int slice_msec = 250;
+  auto err = internal::Err::none;
+  for (int remaining = (int)timeout * 1000;; remaining -= slice_msec) {
+    if (client->is_cancelled()) {
+      return internal::Err::cancelled;
+    }
+    err = client->netx_poll(&pfds, (remaining < slice_msec) ? remaining : slice_msec);
+    if (err != internal::Err::timed_out || remaining <= slice_msec) {
+      break;
+    }
+  }
   // Either it's success and something happened or we failed and nothing
   // must have happened on the socket. We previously checked whether we had
   // `expected_events` set however the flags actually set by poll are
@@ -25416,11 +32305,51 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd, Timeou
 }
 
 internal::Err Client::netx_wait_readable(internal::Socket fd, Timeout timeout) const noexcept {
-  return netx_wait(this, fd, timeout, POLLIN);
+  auto begin = std::chrono::steady_clock::now();
+  auto err = netx_wait(this, fd, timeout, POLLIN);
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_wait_readable_usec, usec);
+  LIBNDT_TRACE(wait_readable, fd, usec);
+  return err;
 }
 
 internal::Err Client::netx_wait_writeable(internal::Socket fd, Timeout timeout) const noexcept {
-  return netx_wait(this, fd, timeout, POLLOUT);
+  auto begin = std::chrono::steady_clock::now();
+  auto err = netx_wait(this, fd, timeout, POLLOUT);
+  auto usec = usec_since(begin);
+  atomic_counters.Add(counter_wait_writeable_usec, usec);
+  LIBNDT_TRACE(wait_writeable, fd, usec);
+  return err;
+}
+
+bool Client::netx_has_pending_data(internal::Socket fd) const noexcept {
+  auto conn = connection(fd);
+  if (conn == nullptr) {
+    return false;
+  }
+  if (conn->ws.begin < conn->ws.end) {
+    return true;
+  }
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0 &&
+      conn->ssl != nullptr) {
+    return ::SSL_pending(conn->ssl) > 0;
+  }
+  return false;
+}
+
+void Client::netx_start_bulk_recv(internal::Socket fd) const noexcept {
+  if (!settings_.io_uring) {
+    return;
+  }
+  // With kTLS, OpenSSL reads from the socket directly, so the data received
+  // by io_uring would never reach it and the download would stall.
+  if (settings_.tls_ktls && netx_ktls(fd)) {
+    LIBNDT_EMIT_DEBUG("netx_start_bulk_recv: cannot use io_uring with kTLS");
+    return;
+  }
+  if (!sys->StartBulkRecv(fd)) {
+    LIBNDT_EMIT_DEBUG("netx_start_bulk_recv: cannot use io_uring; using recv");
+  }
 }
 
 internal::Err Client::netx_poll(
@@ -25437,14 +32366,18 @@ internal::Err Client::netx_poll(
 again:
 #endif
   // Different operating systems have different representations of size_t
-  // and of nfds_t. Overcome these differences by choosing a smaller
-  // representation of the fdset size and letting the compiler promote
-  // it to the correct integer. We don't need many fds in any case.
-  if (pfds->size() > UINT8_MAX) {
+  // and of the fdset size, hence make sure that the conversion is safe.
+#ifdef _WIN32
+  using Nfds = ULONG;
+#else
+  using Nfds = nfds_t;
+#endif
+  if (pfds->size() > (std::numeric_limits<Nfds>::max)()) {
     LIBNDT_EMIT_WARNING("netx_poll: avoiding overflow");
     return internal::Err::value_too_large;
   }
-  rv = sys->Poll(pfds->data(), (uint8_t)pfds->size(), timeout_msec);
+  atomic_counters.Add(counter_poll_calls);
+  rv = sys->Poll(pfds->data(), (Nfds)pfds->size(), timeout_msec);
   // TODO(bassosimone): handle the case where POLLNVAL is returned.
 #ifdef _WIN32
   if (rv == SOCKET_ERROR) {
@@ -25460,15 +32393,20 @@ again:
     return err;
   }
 #endif
-  return (rv == 0) ? internal::Err::timed_out : internal::Err::none;
+  if (rv == 0) {
+    return internal::Err::timed_out;
+  }
+  atomic_counters.Add(counter_poll_wakeups);
+  return internal::Err::none;
 }
 
 internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
   if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
+    auto conn = connection(fd);
+    if (conn == nullptr || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    auto ssl = conn->ssl;
     auto err = ssl_retry_unary_op(  //
         "SSL_shutdown", this, ssl, fd, settings_.timeout,
         [](SSL *ssl) -> int {
@@ -25486,12 +32424,28 @@ internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
 }
 
 internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
+  auto conn = connections_.Remove(fd);
+  if (conn && conn->ws.data) {
+    auto &stats = conn->ws.stats;
+    LIBNDT_EMIT_DEBUG("netx_closesocket: ws: received " << stats.frames
+                      << " frames using " << stats.recv_calls
+                      << " recv calls");
+  }
   if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
+    if (!conn || conn->ssl == nullptr) {
       return internal::Err::invalid_argument;
     }
-    ::SSL_free(fd_to_ssl_.at(fd));
-    fd_to_ssl_.erase(fd);
+    auto ssl = conn->ssl;
+    // We send close_notify without waiting for the peer's one. Besides being
+    // polite, this is what tells OpenSSL that the session is still good for
+    // resumption: SSL_free() marks sessions of connections that haven't been
+    // shut down as not resumable (see SSL_shutdown(3) and SslCache).
+    if (::SSL_is_init_finished(ssl)) {
+      ERR_clear_error();
+      (void)::SSL_shutdown(ssl);
+      ERR_clear_error();
+    }
+    ::SSL_free(ssl);
   }
   if (sys->Closesocket(fd) != 0) {
     return netx_map_errno(sys->GetLastError());
@@ -25502,45 +32456,178 @@ internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
 // Curl helpers
 // ````````````
 
-class CurlxLoggerAdapter : public internal::Logger {
- public:
-  explicit CurlxLoggerAdapter(Client *client) noexcept : client_{client} {}
-
-  bool is_warning_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_warning;
+bool Client::query_mlabns_curl(const std::string &url, long timeout,
+                               std::string *body) noexcept {
+  CurlxLoggerAdapter adapter{this};
+  internal::Curlx curlx{adapter};
+  curlx.SetCancelled([this]() { return is_cancelled(); });
+  // Only use the handles of the cache when caching, such that lookups with
+  // the cache disabled are independent of the other clients.
+  if (settings_.mlabns_cache_ttl > 0 && mlabns_cache) {
+    return mlabns_cache->Fetch(curlx, settings_.socks5h_port, url, timeout, body);
   }
+  return curlx.GetMaybeSOCKS5(settings_.socks5h_port, url, timeout, body);
+}
 
-  bool is_info_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_info;
+// Counters helpers
+// ````````````````
+
+Counters Client::counters() const noexcept {
+  Counters counters;
+  counters.recv_calls = atomic_counters.Get(counter_recv_calls);
+  counters.send_calls = atomic_counters.Get(counter_send_calls);
+  counters.poll_calls = atomic_counters.Get(counter_poll_calls);
+  counters.connect_calls = atomic_counters.Get(counter_connect_calls);
+  counters.syscalls = counters.recv_calls + counters.send_calls +
+                      counters.poll_calls + counters.connect_calls;
+  counters.poll_wakeups = atomic_counters.Get(counter_poll_wakeups);
+  counters.ssl_read_calls = atomic_counters.Get(counter_ssl_read_calls);
+  counters.ssl_write_calls = atomic_counters.Get(counter_ssl_write_calls);
+  counters.ssl_want_read = atomic_counters.Get(counter_ssl_want_read);
+  counters.ssl_want_write = atomic_counters.Get(counter_ssl_want_write);
+  counters.wait_readable_usec = atomic_counters.Get(counter_wait_readable_usec);
+  counters.wait_writeable_usec =
+      atomic_counters.Get(counter_wait_writeable_usec);
+  counters.connects = atomic_counters.Get(counter_connects);
+  counters.connect_usec = atomic_counters.Get(counter_connect_usec);
+  counters.tls_handshakes = atomic_counters.Get(counter_tls_handshakes);
+  counters.tls_handshake_usec = atomic_counters.Get(counter_tls_handshake_usec);
+  counters.ws_handshakes = atomic_counters.Get(counter_ws_handshakes);
+  counters.ws_handshake_usec = atomic_counters.Get(counter_ws_handshake_usec);
+  for (size_t i = 0; i < Counters::frame_size_buckets; ++i) {
+    counters.recv_frame_sizes[i] =
+        atomic_counters.Get(counter_recv_frame_sizes + i);
+    counters.send_frame_sizes[i] =
+        atomic_counters.Get(counter_send_frame_sizes + i);
   }
+  return counters;
+}
 
-  bool is_debug_enabled() const noexcept override {
-		return client_->get_verbosity() >= verbosity_debug;
+void Client::count_frame(CounterIndex base,
+                         internal::Size size) const noexcept {
+  atomic_counters.Add(
+      base + internal::Log2Bucket(size, Counters::frame_size_buckets));
+}
+
+void Client::trace(TraceEventType type, internal::Socket sock,
+                   int64_t value) const noexcept {
+  TraceEvent event;
+  event.type = type;
+  event.sock = sock;
+  event.value = value;
+  on_trace(event);
+}
+
+// Sampling helpers
+// ````````````````
+
+const SampleBuffer &Client::samples() const noexcept { return samples_; }
+
+void Client::sample_begin(NettestFlags tid, size_t nflows) noexcept {
+  sample_.tid = tid;
+  sample_.elapsed = 0.0;
+  sample_.bytes = 0;
+  sample_.bytes_delta = 0;
+  sample_.flows.assign(nflows, SampleFlow{});
+  sample_next_ = settings_.sample_interval;
+  if (samples_.capacity() != settings_.sample_buffer_size) {
+    samples_ = SampleBuffer{settings_.sample_buffer_size};
   }
+}
 
-  void emit_warning(const std::string &s) const noexcept override {
-		client_->on_warning(s);
+bool Client::sample_due(double elapsed) const noexcept {
+  return settings_.sample_interval > 0.0 && elapsed >= sample_next_;
+}
+
+void Client::sample_flow(size_t index, internal::Socket sock,
+                         uint64_t bytes) noexcept {
+  if (index >= sample_.flows.size()) {
+    return;
+  }
+  SampleFlow &flow = sample_.flows[index];
+  flow.bytes = bytes;
+  flow.tcp_info = SampleTcpInfo{};
+#ifdef __linux__
+  struct tcp_info tcpinfo{};
+  socklen_t tcpinfolen = sizeof(tcpinfo);
+  if (sys->Getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
+                      &tcpinfolen) == 0) {
+    flow.tcp_info.valid = true;
+    flow.tcp_info.rtt = tcpinfo.tcpi_rtt;
+    flow.tcp_info.rttvar = tcpinfo.tcpi_rttvar;
+    flow.tcp_info.min_rtt = tcpinfo.tcpi_min_rtt;
+    flow.tcp_info.snd_cwnd = tcpinfo.tcpi_snd_cwnd;
+    flow.tcp_info.total_retrans = tcpinfo.tcpi_total_retrans;
+    flow.tcp_info.bytes_acked = tcpinfo.tcpi_bytes_acked;
+    flow.tcp_info.bytes_received = tcpinfo.tcpi_bytes_received;
+    flow.tcp_info.bytes_retrans = tcpinfo.tcpi_bytes_retrans;
+    flow.tcp_info.notsent_bytes = tcpinfo.tcpi_notsent_bytes;
+    flow.tcp_info.delivery_rate = tcpinfo.tcpi_delivery_rate;
   }
+#else
+  (void)sock;
+#endif  // __linux__
+}
 
-  void emit_info(const std::string &s) const noexcept override {
-		client_->on_info(s);
+void Client::sample_complete(double elapsed) noexcept {
+  uint64_t total = 0;
+  for (auto &flow : sample_.flows) {
+    total += flow.bytes;
   }
+  sample_.bytes_delta = (total >= sample_.bytes) ? total - sample_.bytes : 0;
+  sample_.bytes = total;
+  sample_.elapsed = elapsed;
+  // If we're late, e.g. because we were blocked reading a message, skip the
+  // samples we've missed rather than taking them all at once.
+  sample_next_ += settings_.sample_interval;
+  if (sample_next_ <= elapsed) {
+    sample_next_ = elapsed + settings_.sample_interval;
+  }
+  samples_.push(sample_);
+  on_sample(sample_);
+}
 
-  void emit_debug(const std::string &s) const noexcept override {
-		client_->on_debug(s);
+double Client::sample_wait(double elapsed) const noexcept {
+  if (settings_.sample_interval <= 0.0) {
+    return std::numeric_limits<double>::max();
   }
+  return std::max(sample_next_ - elapsed, 0.0);
+}
 
-  ~CurlxLoggerAdapter() noexcept override {}
+double Client::get_measurement_interval() const noexcept {
+  constexpr double default_measurement_interval = 0.25;
+  return (settings_.measurement_interval > 0.0) ? settings_.measurement_interval
+                                                : default_measurement_interval;
+}
 
- private:
-  Client *client_;
-};
+std::shared_ptr<const internal::Payload> Client::upload_payload() const noexcept {
+  internal::Size size = settings_.upload_payload_size;
+  if (size < ndt7_upload_bufsiz) {
+    size = ndt7_upload_bufsiz;
+  }
+  if (size < settings_.ndt7_upload_message_size) {
+    size = settings_.ndt7_upload_message_size;
+  }
+  return internal::Payload::Get(size, settings_.upload_payload_huge_pages);
+}
 
-bool Client::query_mlabns_curl(const std::string &url, long timeout,
-                               std::string *body) noexcept {
-  CurlxLoggerAdapter adapter{this};
-  internal::Curlx curlx{adapter};
-  return curlx.GetMaybeSOCKS5(settings_.socks5h_port, url, timeout, body);
+internal::Size Client::ndt7_upload_message_size(
+    const internal::Payload &payload, internal::Size current,
+    internal::Size total) const noexcept {
+  internal::Size max = payload.Length();
+  if (max > ndt7_max_message_size) {
+    max = ndt7_max_message_size;
+  }
+  if (current <= 0) {
+    current = settings_.ndt7_upload_message_size;
+    if (current <= 0) {
+      current = ndt7_upload_bufsiz;
+    }
+  } else if (settings_.ndt7_adaptive_message_size && current < max &&
+             total / 16 >= current) {
+    current *= 2;
+  }
+  return (current < max) ? current : max;
 }
 
 // Other helpers
@@ -25550,6 +32637,139 @@ Verbosity Client::get_verbosity() const noexcept {
   return settings_.verbosity;
 }
 
+bool Client::is_cancelled() const noexcept {
+  return cancelled_ || (parent_cancelled_ != nullptr && *parent_cancelled_);
+}
+
+internal::Size Client::subtest_memory(NettestFlags tid) const noexcept {
+  // For each flow we have a WebSocket receive buffer, a receive buffer or a
+  // send buffer, into which we copy the message we upload, and the socket
+  // buffers. Instead, the upload payload is shared (see upload_payload()).
+  internal::Size flows = 1;
+  if ((settings_.protocol_flags & protocol_flag_ndt7) != 0) {
+    flows = (settings_.ndt7_nflows > 1) ? settings_.ndt7_nflows : 1;
+  } else if ((tid & nettest_flag_download_ext) != 0) {
+    flows = 3;
+  }
+  internal::Size per_flow = (1 << 16) + (1 << 17);
+  if ((tid & nettest_flag_upload) != 0) {
+    internal::Size message_size = settings_.ndt7_upload_message_size;
+    if (settings_.ndt7_adaptive_message_size) {
+      message_size = settings_.upload_payload_size;
+      if (message_size > ndt7_max_message_size) {
+        message_size = ndt7_max_message_size;
+      }
+    }
+    per_flow += ws_max_header_size + message_size;
+  }
+  if (settings_.socket_send_buffer > 0) {
+    per_flow += (internal::Size)settings_.socket_send_buffer;
+  }
+  if (settings_.socket_recv_buffer > 0) {
+    per_flow += (internal::Size)settings_.socket_recv_buffer;
+  }
+  return flows * per_flow;
+}
+
+bool Client::subtest_acquire(NettestFlags tid) noexcept {
+  if (!admission) {
+    return true;
+  }
+  auto memory = subtest_memory(tid);
+  LIBNDT_EMIT_DEBUG("waiting to run a subtest using " << memory << " bytes");
+  if (!admission->Acquire(memory, cancelled_)) {
+    LIBNDT_EMIT_WARNING("cancelled while waiting to run a subtest");
+    return false;
+  }
+  subtest_memory_ = memory;
+  return true;
+}
+
+void Client::subtest_release() noexcept {
+  if (admission) {
+    admission->Release(subtest_memory_);
+  }
+  subtest_memory_ = 0;
+}
+
+// Runner
+// ``````
+
+Runner::Runner() noexcept : Runner{RunnerSettings{}} {}
+
+Runner::Runner(RunnerSettings settings) noexcept : settings_{settings} {
+  admission_.reset(new internal::Admission{settings_.max_parallel_subtests,
+                                           settings_.max_buffer_memory});
+}
+
+Runner::~Runner() noexcept {}
+
+void Runner::add(std::unique_ptr<Client> client) noexcept {
+  if (!client) {
+    return;
+  }
+  client->ssl_cache = ssl_cache_;
+  client->mlabns_cache = mlabns_cache_;
+  client->admission = admission_;
+  clients_.push_back(std::move(client));
+}
+
+bool Runner::run() noexcept {
+  cancelled_ = false;
+  next_client_ = 0;
+  // We use char rather than bool because each thread writes its own
+  // element and std::vector<bool> packs elements together.
+  std::vector<char> results(clients_.size(), 0);
+  auto main = [this, &results]() noexcept {
+    for (;;) {
+      size_t i = next_client_++;
+      if (i >= clients_.size() || cancelled_) {
+        return;
+      }
+      Client *client = clients_[i].get();
+      if (!client->start()) {
+        continue;
+      }
+      // start() clears the cancellation, so check again: either we see
+      // cancelled_ here or cancel() cancels the client after start().
+      if (cancelled_) {
+        client->cancel();
+      }
+      (void)client->drive();
+      results[i] = client->succeeded();
+    }
+  };
+  size_t nthreads = settings_.max_parallel_clients;
+  if (nthreads <= 0) {
+    nthreads = 1;
+  }
+  if (nthreads > clients_.size()) {
+    nthreads = clients_.size();
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < nthreads; ++i) {
+    threads.emplace_back(main);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return std::all_of(results.begin(), results.end(),
+                     [](char result) { return result != 0; });
+}
+
+void Runner::cancel() noexcept {
+  cancelled_ = true;
+  for (auto &client : clients_) {
+    client->cancel();
+  }
+}
+
+const std::vector<std::unique_ptr<Client>> &Runner::clients() const noexcept {
+  return clients_;
+}
+
+#endif  // !LIBNDT_DECLARATIONS_ONLY
+
 }  // namespace libndt
 }  // namespace measurement_kit
 #endif
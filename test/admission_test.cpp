@@ -0,0 +1,91 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/admission.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("Admission does not limit with zero limits") {
+  Admission admission{0, 0};
+  std::atomic<bool> cancelled{false};
+  for (int i = 0; i < 100; ++i) {
+    REQUIRE(admission.Acquire(1 << 20, cancelled));
+  }
+  REQUIRE(admission.Subtests() == 100);
+  REQUIRE(admission.Memory() == 100 << 20);
+  for (int i = 0; i < 100; ++i) {
+    admission.Release(1 << 20);
+  }
+  REQUIRE(admission.Subtests() == 0);
+  REQUIRE(admission.Memory() == 0);
+}
+
+TEST_CASE("Admission limits the number of subtests") {
+  Admission admission{2, 0};
+  std::atomic<bool> cancelled{false};
+  REQUIRE(admission.Acquire(0, cancelled));
+  REQUIRE(admission.Acquire(0, cancelled));
+  std::atomic<bool> admitted{false};
+  std::thread thread{[&]() {
+    admitted = admission.Acquire(0, cancelled);
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(!admitted);
+  admission.Release(0);
+  thread.join();
+  REQUIRE(admitted);
+  REQUIRE(admission.Subtests() == 2);
+}
+
+TEST_CASE("Admission limits the memory") {
+  Admission admission{0, 1000};
+  std::atomic<bool> cancelled{false};
+  REQUIRE(admission.Acquire(600, cancelled));
+  REQUIRE(admission.Acquire(400, cancelled));
+  std::atomic<bool> admitted{false};
+  std::thread thread{[&]() {
+    admitted = admission.Acquire(500, cancelled);
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(!admitted);
+  admission.Release(400);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(!admitted);  // 600 + 500 is still too much
+  admission.Release(600);
+  thread.join();
+  REQUIRE(admitted);
+  REQUIRE(admission.Memory() == 500);
+}
+
+TEST_CASE("Admission admits a large subtest when nothing else runs") {
+  Admission admission{0, 1000};
+  std::atomic<bool> cancelled{false};
+  REQUIRE(admission.Acquire(5000, cancelled));
+  REQUIRE(admission.Memory() == 5000);
+  std::atomic<bool> admitted{false};
+  std::thread thread{[&]() {
+    admitted = admission.Acquire(1, cancelled);
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(!admitted);
+  admission.Release(5000);
+  thread.join();
+  REQUIRE(admitted);
+}
+
+TEST_CASE("Admission stops waiting when cancelled") {
+  Admission admission{1, 0};
+  std::atomic<bool> cancelled{false};
+  REQUIRE(admission.Acquire(0, cancelled));
+  cancelled = true;
+  REQUIRE(!admission.Acquire(0, cancelled));
+  REQUIRE(admission.Subtests() == 1);
+}
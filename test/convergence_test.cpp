@@ -0,0 +1,80 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/convergence.hpp"
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("Convergence is disabled with zero tolerance") {
+  Convergence convergence{0.0, 1.0, 0.0};
+  REQUIRE(!convergence.Enabled());
+  for (int i = 1; i <= 100; ++i) {
+    REQUIRE(!convergence.Update(i * 0.25, i * 1000.0));
+  }
+  REQUIRE(convergence.Speed() == 0.0);
+}
+
+TEST_CASE("Convergence waits for the window to be full") {
+  Convergence convergence{0.05, 2.0, 0.0};
+  REQUIRE(convergence.Enabled());
+  for (int i = 1; i < 8; ++i) {
+    REQUIRE(!convergence.Update(i * 0.25, i * 1000.0));
+    REQUIRE(convergence.Speed() == 0.0);
+  }
+  REQUIRE(convergence.Update(2.0, 8000.0));
+  REQUIRE(convergence.Speed() == 4000.0);
+}
+
+TEST_CASE("Convergence honours the minimum runtime") {
+  Convergence convergence{0.05, 1.0, 3.0};
+  for (int i = 1; i < 12; ++i) {
+    REQUIRE(!convergence.Update(i * 0.25, i * 1000.0));
+  }
+  REQUIRE(convergence.Speed() == 4000.0);
+  REQUIRE(convergence.Update(3.0, 12000.0));
+}
+
+TEST_CASE("Convergence waits for the throughput to stabilize") {
+  Convergence convergence{0.05, 1.0, 0.0};
+  // Slow start: the speed doubles at every interval.
+  double bytes = 0.0;
+  double rate = 100.0;
+  int i = 1;
+  for (; i <= 12; ++i) {
+    bytes += rate;
+    rate *= 2.0;
+    REQUIRE(!convergence.Update(i * 0.25, bytes));
+  }
+  // Steady state: we converge once the window only covers it, and the
+  // speed does not account for the slow start.
+  for (int j = 0; j < 3; ++j, ++i) {
+    bytes += rate;
+    REQUIRE(!convergence.Update(i * 0.25, bytes));
+  }
+  bytes += rate;
+  REQUIRE(convergence.Update(i * 0.25, bytes));
+  REQUIRE(convergence.Speed() == Approx(rate * 4.0));
+}
+
+TEST_CASE("Convergence deals with a noisy throughput") {
+  Convergence convergence{0.05, 1.0, 0.0};
+  double bytes = 0.0;
+  for (int i = 1; i <= 40; ++i) {
+    bytes += (i % 2 == 0) ? 1500.0 : 500.0;
+    // Within each half of the window, the noise averages out.
+    REQUIRE(convergence.Update(i * 0.25, bytes) == (i >= 4));
+  }
+}
+
+TEST_CASE("Convergence ignores times that do not move forward") {
+  Convergence convergence{0.05, 0.5, 0.0};
+  REQUIRE(!convergence.Update(0.0, 1000.0));
+  REQUIRE(!convergence.Update(0.25, 1000.0));
+  REQUIRE(!convergence.Update(0.25, 2000.0));
+  REQUIRE(convergence.Update(0.5, 2000.0));
+  REQUIRE(convergence.Speed() == 4000.0);
+}
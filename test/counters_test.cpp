@@ -0,0 +1,87 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/counters.hpp"
+
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("ShardedCounters starts from zero") {
+  ShardedCounters<4> counters;
+  for (size_t i = 0; i < 4; ++i) {
+    REQUIRE(counters.Get(i) == 0);
+  }
+}
+
+TEST_CASE("ShardedCounters::Add() only updates the selected counter") {
+  ShardedCounters<4> counters;
+  counters.Add(1);
+  counters.Add(2, 17);
+  counters.Add(2, 3);
+  REQUIRE(counters.Get(0) == 0);
+  REQUIRE(counters.Get(1) == 1);
+  REQUIRE(counters.Get(2) == 20);
+  REQUIRE(counters.Get(3) == 0);
+  counters.Reset();
+  REQUIRE(counters.Get(1) == 0);
+  REQUIRE(counters.Get(2) == 0);
+}
+
+TEST_CASE("ShardedCounters does not lose updates made by many threads") {
+  ShardedCounters<2> counters;
+  constexpr int nthreads = 4;
+  constexpr int increments = 100000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; ++i) {
+    threads.emplace_back([&counters]() {
+      for (int j = 0; j < increments; ++j) {
+        counters.Add(1);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(counters.Get(0) == 0);
+  REQUIRE(counters.Get(1) == (uint64_t)nthreads * increments);
+}
+
+TEST_CASE("CounterShard() assigns a different shard to each thread") {
+  size_t shard = CounterShard();
+  REQUIRE(CounterShard() == shard);
+  size_t other = shard;
+  std::thread thread{[&other]() { other = CounterShard(); }};
+  thread.join();
+  REQUIRE(other != shard);
+}
+
+TEST_CASE("ShardedCounters sums the updates made in different shards") {
+  ShardedCounters<2, 2> counters;
+  counters.Add(1, 3);
+  std::thread thread{[&counters]() { counters.Add(1, 4); }};
+  thread.join();
+  REQUIRE(counters.Get(0) == 0);
+  REQUIRE(counters.Get(1) == 7);
+  counters.Reset();
+  REQUIRE(counters.Get(1) == 0);
+}
+
+TEST_CASE("Log2Bucket() works as expected") {
+  REQUIRE(Log2Bucket(0, 8) == 0);
+  REQUIRE(Log2Bucket(1, 8) == 1);
+  REQUIRE(Log2Bucket(2, 8) == 2);
+  REQUIRE(Log2Bucket(3, 8) == 2);
+  REQUIRE(Log2Bucket(4, 8) == 3);
+  REQUIRE(Log2Bucket(127, 8) == 7);
+  // The last bucket also counts the larger values.
+  REQUIRE(Log2Bucket(128, 8) == 7);
+  REQUIRE(Log2Bucket(UINT64_MAX, 8) == 7);
+  REQUIRE(Log2Bucket(UINT64_MAX, 1) == 0);
+  REQUIRE(Log2Bucket(1 << 13, 26) == 14);
+}
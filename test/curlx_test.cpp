@@ -43,6 +43,35 @@ TEST_CASE("Curlx::GetMaybeSOCKS5() deals with Curlx::SetoptProxy() failure") {
   REQUIRE(!curlx.GetMaybeSOCKS5("9050", "http://x.org", 1, &body));
 }
 
+class CountingCurlx : public Curlx {
+ public:
+  using Curlx::Curlx;
+  int news = 0;
+  int resets = 0;
+  UniqueCurl NewUniqueCurl() noexcept override {
+    ++news;
+    return Curlx::NewUniqueCurl();
+  }
+  void Reset(UniqueCurl &handle) noexcept override {
+    ++resets;
+    Curlx::Reset(handle);
+  }
+  CURLcode Perform(UniqueCurl &) noexcept override { return CURLE_AGAIN; }
+};
+
+TEST_CASE("Curlx::GetMaybeSOCKS5() reuses the handle it is passed") {
+  CountingCurlx curlx{NoLoggerInstance()};
+  UniqueCurl handle;
+  std::string body;
+  REQUIRE(!curlx.GetMaybeSOCKS5(handle, "", "http://x.org", 1, &body));
+  REQUIRE(handle);
+  CURL *first = handle.get();
+  REQUIRE(!curlx.GetMaybeSOCKS5(handle, "9050", "http://x.org", 1, &body));
+  REQUIRE(handle.get() == first);
+  REQUIRE(curlx.news == 1);
+  REQUIRE(curlx.resets == 1);
+}
+
 // Curlx::Get() tests
 // ------------------
 
@@ -132,6 +161,53 @@ TEST_CASE("Curlx::Get() deals with Curlx::Perform() failure") {
   REQUIRE(curlx.Get(handle, "http://x.org", 1, &body) == false);
 }
 
+class FailCurlxSetoptProgress : public Curlx {
+ public:
+  using Curlx::Curlx;
+  CURLcode SetoptProgress(UniqueCurl &, CurlProgressCb, void *) noexcept override {
+    return CURLE_AGAIN;
+  }
+};
+
+TEST_CASE("Curlx::Get() deals with Curlx::SetoptProgress() failure") {
+  FailCurlxSetoptProgress curlx{NoLoggerInstance()};
+  curlx.SetCancelled([]() { return false; });
+  UniqueCurl handle{curlx.NewUniqueCurl()};
+  std::string body;
+  REQUIRE(curlx.Get(handle, "http://x.org", 1, &body) == false);
+}
+
+// CancelCurlx calls the progress callback, like curl would, when performing.
+class CancelCurlx : public Curlx {
+ public:
+  using Curlx::Curlx;
+  CurlProgressCb callback = nullptr;
+  void *pointer = nullptr;
+  CURLcode SetoptProgress(UniqueCurl &handle, CurlProgressCb cb,
+                          void *ptr) noexcept override {
+    callback = cb;
+    pointer = ptr;
+    return Curlx::SetoptProgress(handle, cb, ptr);
+  }
+  CURLcode Perform(UniqueCurl &) noexcept override {
+    REQUIRE(callback != nullptr);
+    return (callback(pointer, 0, 0, 0, 0) != 0) ? CURLE_ABORTED_BY_CALLBACK
+                                                : CURLE_OK;
+  }
+};
+
+TEST_CASE("Curlx::Get() aborts the request when it is cancelled") {
+  CancelCurlx curlx{NoLoggerInstance()};
+  bool cancelled = false;
+  curlx.SetCancelled([&cancelled]() { return cancelled; });
+  REQUIRE(!curlx.Cancelled());
+  cancelled = true;
+  REQUIRE(curlx.Cancelled());
+  UniqueCurl handle{curlx.NewUniqueCurl()};
+  std::string body;
+  REQUIRE(curlx.Get(handle, "http://x.org", 1, &body) == false);
+}
+
 // Curlx::SetoptProxy() tests
 // --------------------------
 
@@ -0,0 +1,103 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/jsonscan.hpp"
+
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+// Scanner scans for the fields we use for ndt7 download measurements.
+class Scanner {
+ public:
+  JsonScanField fields[3];
+  bool has_connection_info = false;
+
+  Scanner() noexcept {
+    fields[0].name = "BytesRetrans";
+    fields[1].name = "BytesSent";
+    fields[2].name = "MinRTT";
+  }
+
+  bool Scan(const std::string &s) noexcept {
+    return JsonScan(s.data(), s.size(), "TCPInfo", fields, 3, "ConnectionInfo",
+                    &has_connection_info);
+  }
+};
+
+TEST_CASE("JsonScan() extracts the fields of a ndt7 measurement") {
+  Scanner scanner;
+  REQUIRE(scanner.Scan(R"({
+    "ConnectionInfo": {"Client": "[::1]:5432", "Server": "[::1]:443",
+                       "UUID": "x\"y\\z"},
+    "BBRInfo": {"BW": 123456, "MinRTT": 99, "Gain": 2.885},
+    "TCPInfo": {"State": 1, "Options": [1, 2, {"x": null}], "Flag": true,
+                "BytesRetrans": 17, "Ratio": -1.5e-3, "BytesSent": 9223372036854775807,
+                "MinRTT": 3000, "Note": "MinRTT"}
+  })"));
+  REQUIRE(scanner.has_connection_info);
+  REQUIRE(scanner.fields[0].found);
+  REQUIRE(scanner.fields[0].value == 17);
+  REQUIRE(scanner.fields[1].found);
+  REQUIRE(scanner.fields[1].value == INT64_MAX);
+  REQUIRE(scanner.fields[2].found);
+  REQUIRE(scanner.fields[2].value == 3000);
+}
+
+TEST_CASE("JsonScan() deals with missing and non integer fields") {
+  Scanner scanner;
+  REQUIRE(scanner.Scan(R"({"TCPInfo": {"BytesRetrans": 1.5, "BytesSent": "7",
+                           "MinRTT": 99999999999999999999}})"));
+  REQUIRE(!scanner.has_connection_info);
+  REQUIRE(!scanner.fields[0].found);
+  REQUIRE(!scanner.fields[1].found);
+  REQUIRE(!scanner.fields[2].found);
+  REQUIRE(scanner.Scan("{}"));
+  REQUIRE(!scanner.fields[0].found);
+  REQUIRE(scanner.Scan(R"({"TCPInfo": null, "MinRTT": 1})"));
+  REQUIRE(!scanner.fields[2].found);
+}
+
+TEST_CASE("JsonScan() extracts negative numbers") {
+  Scanner scanner;
+  REQUIRE(scanner.Scan(R"({"TCPInfo":{"BytesRetrans":-9223372036854775808}})"));
+  REQUIRE(scanner.fields[0].found);
+  REQUIRE(scanner.fields[0].value == INT64_MIN);
+}
+
+TEST_CASE("JsonScan() rejects invalid JSON") {
+  const char *inputs[] = {
+      "",
+      "[]",
+      "{",
+      "{{{{",
+      R"({"TCPInfo": {"MinRTT": 1})",
+      R"({"TCPInfo": {"MinRTT": 1}} trailing)",
+      R"({"a": 1,})",
+      R"({"a" 1})",
+      R"({"a": tru})",
+      R"({"a": "unterminated})",
+      R"({"a": 1.})",
+      R"({"a": 1e})",
+      R"({"a": -})",
+      "{\"a\": \"control\x01char\"}",
+  };
+  for (auto input : inputs) {
+    Scanner scanner;
+    INFO(input);
+    REQUIRE(!scanner.Scan(input));
+  }
+}
+
+TEST_CASE("JsonScan() limits the nesting depth") {
+  std::string s = R"({"a": )";
+  s += std::string(64, '[');
+  s += std::string(64, ']');
+  s += "}";
+  Scanner scanner;
+  REQUIRE(!scanner.Scan(s));
+}
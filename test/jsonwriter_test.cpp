@@ -0,0 +1,41 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/jsonwriter.hpp"
+
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("JsonWriter writes numbers and raw strings") {
+  char buffer[128];
+  JsonWriter writer{buffer, sizeof(buffer)};
+  writer.Raw("{\"a\":");
+  writer.Uint64(0);
+  writer.Raw(",\"b\":");
+  writer.Uint64(1234567890);
+  writer.Raw(",\"c\":");
+  writer.Uint64(UINT64_MAX);
+  writer.Raw("}", 1);
+  REQUIRE(writer.Good());
+  REQUIRE(std::string(buffer, (size_t)writer.Length()) ==
+          "{\"a\":0,\"b\":1234567890,\"c\":18446744073709551615}");
+}
+
+TEST_CASE("JsonWriter deals with a too small buffer") {
+  char buffer[8];
+  JsonWriter writer{buffer, sizeof(buffer)};
+  writer.Raw("{\"a\":");
+  writer.Uint64(123);
+  REQUIRE(writer.Good());
+  REQUIRE(writer.Length() == 8);
+  writer.Raw("}");
+  REQUIRE(!writer.Good());
+  writer.Uint64(1);  // must not write past the end
+  REQUIRE(!writer.Good());
+  REQUIRE(writer.Length() == 8);
+}
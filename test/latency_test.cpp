@@ -0,0 +1,95 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/latency.hpp"
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("Latency measures the round trip time of an echoed payload") {
+  Latency latency;
+  uint8_t payload[Latency::payload_size] = {};
+  Latency::Encode(payload, 1000);
+  REQUIRE(latency.OnPong(payload, sizeof(payload), 1250));
+  LatencySummary summary = latency.Summarize();
+  REQUIRE(summary.count == 1);
+  REQUIRE(summary.min == 250);
+  REQUIRE(summary.p50 == 250);
+  REQUIRE(summary.max == 250);
+}
+
+TEST_CASE("Latency ignores payloads that are not ours") {
+  Latency latency;
+  uint8_t payload[Latency::payload_size] = {};
+  Latency::Encode(payload, 1000);
+
+  SECTION("With a null payload") {
+    REQUIRE(!latency.OnPong(nullptr, sizeof(payload), 1250));
+  }
+
+  SECTION("With a payload of the wrong size") {
+    REQUIRE(!latency.OnPong(payload, sizeof(payload) - 1, 1250));
+    REQUIRE(!latency.OnPong(payload, 0, 1250));
+  }
+
+  SECTION("With the wrong magic") {
+    payload[0] ^= 0xff;
+    REQUIRE(!latency.OnPong(payload, sizeof(payload), 1250));
+  }
+
+  SECTION("With a timestamp in the future") {
+    REQUIRE(!latency.OnPong(payload, sizeof(payload), 999));
+  }
+
+  REQUIRE(latency.Summarize().count == 0);
+}
+
+TEST_CASE("Latency computes the percentiles using the nearest rank method") {
+  Latency latency;
+  for (uint64_t rtt = 100; rtt >= 1; --rtt) {
+    latency.Add(rtt);
+  }
+  LatencySummary summary = latency.Summarize();
+  REQUIRE(summary.count == 100);
+  REQUIRE(summary.min == 1);
+  REQUIRE(summary.p50 == 50);
+  REQUIRE(summary.p90 == 90);
+  REQUIRE(summary.p99 == 99);
+  REQUIRE(summary.max == 100);
+}
+
+TEST_CASE("Latency returns a zero summary without round trip times") {
+  Latency latency;
+  LatencySummary summary = latency.Summarize();
+  REQUIRE(summary.count == 0);
+  REQUIRE(summary.min == 0);
+  REQUIRE(summary.p50 == 0);
+  REQUIRE(summary.p90 == 0);
+  REQUIRE(summary.p99 == 0);
+  REQUIRE(summary.max == 0);
+}
+
+TEST_CASE("Latency::Reset() forgets the round trip times") {
+  Latency latency;
+  latency.Add(10);
+  latency.Add(20);
+  latency.Reset();
+  REQUIRE(latency.Summarize().count == 0);
+  latency.Add(30);
+  REQUIRE(latency.Summarize().count == 1);
+  REQUIRE(latency.Summarize().min == 30);
+}
+
+TEST_CASE("Latency keeps at most max_samples round trip times") {
+  Latency latency;
+  for (size_t i = 0; i < Latency::max_samples; ++i) {
+    latency.Add(10);
+  }
+  latency.Add(1);
+  LatencySummary summary = latency.Summarize();
+  REQUIRE(summary.count == Latency::max_samples);
+  REQUIRE(summary.min == 10);
+}
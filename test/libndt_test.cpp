@@ -20,7 +20,14 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #define CATCH_CONFIG_MAIN
@@ -221,6 +228,237 @@ TEST_CASE("Client::run() deals with Client::wait_close() failure") {
   REQUIRE(client.run() == false);
 }
 
+// Client::start() and Client::step() tests
+// ----------------------------------------
+
+class StepByStepClient : public Client {
+ public:
+  using Client::Client;
+  std::vector<bool> completions;
+  bool query_mlabns(std::vector<std::string> *fqdns) noexcept override {
+    fqdns->push_back("ndt.example.com");
+    return true;
+  }
+  bool connect() noexcept override { return true; }
+  bool send_login() noexcept override { return true; }
+  bool recv_kickoff() noexcept override { return true; }
+  bool wait_in_queue() noexcept override { return true; }
+  bool recv_version() noexcept override { return true; }
+  bool recv_tests_ids() noexcept override { return true; }
+  bool run_tests() noexcept override {
+    REQUIRE(start() == false);  // cannot start while running
+    return true;
+  }
+  bool recv_results_and_logout() noexcept override { return true; }
+  bool wait_close() noexcept override { return true; }
+  void on_complete(bool success) noexcept override {
+    completions.push_back(success);
+  }
+};
+
+TEST_CASE("Client::step() runs the same phases as Client::run()") {
+  StepByStepClient client;
+  REQUIRE(client.step() == false);  // not started yet
+  REQUIRE(client.start() == true);
+  REQUIRE(client.poll_fd() == (internal::Socket)-1);
+  auto steps = 0;
+  std::vector<pollfd> pfds;
+  while (client.step()) {
+    steps += 1;
+    // The phases run in the worker thread, which we wait for.
+    int timeout = client.poll_fds(&pfds);
+    REQUIRE(pfds.empty());
+    REQUIRE(timeout >= 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+  }
+  REQUIRE(steps >= 10);
+  REQUIRE(client.completions == std::vector<bool>{true});
+  REQUIRE(client.step() == false);
+  REQUIRE(client.completions.size() == 1);
+  REQUIRE(client.run() == true);  // can run again after completion
+  REQUIRE(client.completions == (std::vector<bool>{true, true}));
+}
+
+TEST_CASE("Client::cancel() causes the next step to fail the test") {
+  StepByStepClient client;
+  REQUIRE(client.start() == true);
+  REQUIRE(client.step() == true);
+  client.cancel();
+  // Wait for the mlab-ns query, which runs in the worker thread.
+  std::vector<pollfd> pfds;
+  while (client.poll_fds(&pfds) != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(client.step() == false);
+  REQUIRE(client.completions == std::vector<bool>{false});
+}
+
+TEST_CASE("Client::succeeded() tells whether the latest test succeeded") {
+  StepByStepClient client;
+  REQUIRE(client.succeeded() == false);
+  REQUIRE(client.run() == true);
+  REQUIRE(client.succeeded() == true);
+  REQUIRE(client.start() == true);
+  REQUIRE(client.succeeded() == false);  // running
+}
+
+// Runner tests
+// ------------
+
+// RunnerCounters counts the subtests run by many RunnerClients.
+struct RunnerCounters {
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  std::atomic<int> runs{0};
+};
+
+class RunnerClient : public StepByStepClient {
+ public:
+  using StepByStepClient::StepByStepClient;
+  std::shared_ptr<RunnerCounters> counters;
+  bool fail = false;
+  bool wait_for_cancel = false;
+  bool run_tests() noexcept override {
+    int running = ++counters->running;
+    int max = counters->max_running;
+    while (running > max && !counters->max_running.compare_exchange_weak(
+                                max, running)) {
+      // NOTHING
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    while (wait_for_cancel && !is_cancelled()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    --counters->running;
+    ++counters->runs;
+    return !fail;
+  }
+};
+
+static std::unique_ptr<Client> runner_client(
+    std::shared_ptr<RunnerCounters> counters, bool fail = false) {
+  std::unique_ptr<RunnerClient> client{new RunnerClient};
+  client->counters = counters;
+  client->fail = fail;
+  return std::unique_ptr<Client>{client.release()};
+}
+
+TEST_CASE("Runner::run() runs all the clients") {
+  auto counters = std::make_shared<RunnerCounters>();
+  Runner runner;
+  for (int i = 0; i < 10; ++i) {
+    runner.add(runner_client(counters));
+  }
+  REQUIRE(runner.run() == true);
+  REQUIRE(counters->runs == 10);
+  REQUIRE(counters->max_running <= 4);
+  for (auto &client : runner.clients()) {
+    REQUIRE(client->succeeded());
+    REQUIRE(client->admission != nullptr);
+    REQUIRE(client->admission == runner.clients()[0]->admission);
+  }
+}
+
+TEST_CASE("Runner::run() fails if any client fails") {
+  auto counters = std::make_shared<RunnerCounters>();
+  Runner runner;
+  runner.add(runner_client(counters));
+  runner.add(runner_client(counters, true));
+  runner.add(runner_client(counters));
+  REQUIRE(runner.run() == false);
+  REQUIRE(counters->runs == 3);
+}
+
+TEST_CASE("Runner::run() limits the subtests running at the same time") {
+  auto counters = std::make_shared<RunnerCounters>();
+  RunnerSettings settings;
+  settings.max_parallel_clients = 8;
+  settings.max_parallel_subtests = 2;
+  Runner runner{settings};
+  for (int i = 0; i < 8; ++i) {
+    runner.add(runner_client(counters));
+  }
+  REQUIRE(runner.run() == true);
+  REQUIRE(counters->runs == 8);
+  REQUIRE(counters->max_running == 2);
+}
+
+TEST_CASE("Runner::run() limits the memory of the running subtests") {
+  auto counters = std::make_shared<RunnerCounters>();
+  RunnerSettings settings;
+  settings.max_parallel_clients = 8;
+  Client client;
+  // Enough memory for three subtests at a time.
+  settings.max_buffer_memory = 3 * client.subtest_memory(nettest_flag_download);
+  Runner runner{settings};
+  for (int i = 0; i < 8; ++i) {
+    runner.add(runner_client(counters));
+  }
+  REQUIRE(runner.run() == true);
+  REQUIRE(counters->runs == 8);
+  REQUIRE(counters->max_running == 3);
+}
+
+TEST_CASE("Runner::cancel() stops the running and pending clients") {
+  auto counters = std::make_shared<RunnerCounters>();
+  RunnerSettings settings;
+  settings.max_parallel_clients = 2;
+  Runner runner{settings};
+  for (int i = 0; i < 6; ++i) {
+    auto client = runner_client(counters);
+    static_cast<RunnerClient *>(client.get())->wait_for_cancel = true;
+    runner.add(std::move(client));
+  }
+  std::thread thread{[&runner]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    runner.cancel();
+  }};
+  REQUIRE(runner.run() == false);
+  thread.join();
+  REQUIRE(counters->runs == 2);
+}
+
+TEST_CASE("Client::subtest_memory() accounts for the flows") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_ndt7;
+  Client single{settings};
+  settings.ndt7_nflows = 4;
+  Client multi{settings};
+  REQUIRE(multi.subtest_memory(nettest_flag_download) ==
+          4 * single.subtest_memory(nettest_flag_download));
+  REQUIRE(single.subtest_memory(nettest_flag_upload) >
+          single.subtest_memory(nettest_flag_download));
+  settings.socket_recv_buffer = 1 << 20;
+  Client buffered{settings};
+  REQUIRE(buffered.subtest_memory(nettest_flag_download) ==
+          multi.subtest_memory(nettest_flag_download) + 4 * (1 << 20));
+}
+
+class TimeoutPollingClient : public Client {
+ public:
+  using Client::Client;
+  mutable unsigned int polls = 0;
+  internal::Err netx_poll(std::vector<pollfd> *, int) const noexcept override {
+    if (++polls == 2) {
+      const_cast<TimeoutPollingClient *>(this)->cancel();
+    }
+    return internal::Err::timed_out;
+  }
+};
+
+TEST_CASE("Client::netx_wait_readable() notices cancellation") {
+  TimeoutPollingClient client;
+  REQUIRE(client.netx_wait_readable(17, 60) == internal::Err::cancelled);
+  REQUIRE(client.polls == 2);
+}
+
+TEST_CASE("Client::netx_wait_readable() polls in slices up to the timeout") {
+  TimeoutPollingClient client;
+  client.polls = 2;  // so it does not cancel
+  REQUIRE(client.netx_wait_readable(17, 1) == internal::Err::timed_out);
+  REQUIRE(client.polls == 6);
+}
+
 // Client::on_warning() tests
 // --------------------------
 
@@ -304,6 +542,99 @@ TEST_CASE("Client::query_mlabns() deals with incomplete JSON") {
   REQUIRE(client.query_mlabns(&v) == false);
 }
 
+class FakeClockMlabnsCache : public internal::MlabnsCache {
+ public:
+  Clock::time_point now = Clock::now();
+
+ protected:
+  Clock::time_point Now() const noexcept override { return now; }
+};
+
+class CachedMlabnsClient : public Client {
+ public:
+  using Client::Client;
+  std::vector<std::string> urls;
+  int prefetches = 0;
+  bool query_mlabns_curl(const std::string &url, long,
+                         std::string *body) noexcept override {
+    urls.push_back(url);
+    *body = R"([{"fqdn": "ndt.mlab1.trn01.example.org"}])";
+    return true;
+  }
+  void query_mlabns_prefetch(const std::string &) noexcept override {
+    prefetches += 1;
+  }
+};
+
+TEST_CASE("Client::query_mlabns() uses the cache when so configured") {
+  Settings settings;
+  settings.mlabns_cache_ttl = 60;
+  CachedMlabnsClient client{settings};
+  auto cache = std::make_shared<FakeClockMlabnsCache>();
+  client.mlabns_cache = cache;
+  for (int i = 0; i < 2; ++i) {
+    std::vector<std::string> v;
+    REQUIRE(client.query_mlabns(&v) == true);
+    REQUIRE(v == std::vector<std::string>{"ndt.mlab1.trn01.example.org"});
+  }
+  REQUIRE(client.urls.size() == 1);
+  REQUIRE(client.prefetches == 0);
+
+  // When the entry is about to expire we use it and refresh it.
+  cache->now += std::chrono::seconds{50};
+  std::vector<std::string> v;
+  REQUIRE(client.query_mlabns(&v) == true);
+  REQUIRE(client.urls.size() == 1);
+  REQUIRE(client.prefetches == 1);
+
+  // When the entry has expired we query again.
+  cache->now += std::chrono::seconds{10};
+  REQUIRE(client.query_mlabns(&v) == true);
+  REQUIRE(client.urls.size() == 2);
+}
+
+TEST_CASE("Client::query_mlabns() does not use the cache by default") {
+  CachedMlabnsClient client;
+  client.mlabns_cache = std::make_shared<internal::MlabnsCache>();
+  for (int i = 0; i < 2; ++i) {
+    std::vector<std::string> v;
+    REQUIRE(client.query_mlabns(&v) == true);
+  }
+  REQUIRE(client.urls.size() == 2);
+}
+
+class CountingFetchesMlabnsCache : public internal::MlabnsCache {
+ public:
+  std::atomic<int> fetches{0};
+  bool Fetch(internal::Curlx &, const std::string &, const std::string &,
+             long, std::string *) noexcept override {
+    fetches += 1;
+    return false;
+  }
+};
+
+TEST_CASE("Client::query_mlabns_curl() uses the cache only when caching") {
+  Settings settings;
+  auto cache = std::make_shared<CountingFetchesMlabnsCache>();
+  std::string body;
+
+  SECTION("When the cache is disabled") {
+    Client client{settings};
+    client.mlabns_cache = cache;
+    // Use a closed port on the loopback, such that we never hit the network.
+    REQUIRE(!client.query_mlabns_curl("http://127.0.0.1:1/", 1, &body));
+    REQUIRE(cache->fetches == 0);
+  }
+
+  SECTION("When the cache is enabled") {
+    settings.mlabns_cache_ttl = 60;
+    Client client{settings};
+    client.mlabns_cache = cache;
+    REQUIRE(!client.query_mlabns_curl("http://127.0.0.1:1/", 1, &body));
+    REQUIRE(cache->fetches == 1);
+  }
+}
+
 // Client::recv_kickoff() tests
 // ----------------------------
 
@@ -895,6 +1226,46 @@ TEST_CASE("Client::run_download() deals with too many results messages") {
   REQUIRE(client.run_download() == false);
 }
 
+class Web100DuringDownload : public TooManyTestMsgsDuringDownload {
+ public:
+  using TooManyTestMsgsDuringDownload::TooManyTestMsgsDuringDownload;
+  std::deque<std::string> messages{
+      "TCPInfo.BytesRetrans: 10\n\nTCPInfo.BytesSent:1000\n",
+      "  TCPInfo.MinRTT\t:  42 \nNoColon\nNoValue:\nTCPInfo.Empty: ",
+  };
+  std::string web100;
+  bool msg_read(MsgType *code, std::string *s) noexcept override {
+    if (messages.empty()) {
+      *code = msg_test_finalize;
+      return true;
+    }
+    *code = msg_test_msg;
+    *s = messages.front();
+    messages.pop_front();
+    return true;
+  }
+  void on_result(std::string, std::string,
+                 std::string value) noexcept override {
+    web100 = value;
+  }
+  const SummaryData &summary_data() const noexcept { return summary_; }
+};
+
+TEST_CASE("Client::run_download() parses web100 variables") {
+  Settings settings;
+  settings.verbosity = verbosity_debug;
+  Web100DuringDownload client{settings};
+  REQUIRE(client.run_download() == true);
+  auto web100 = nlohmann::json::parse(client.web100);
+  REQUIRE(web100.size() == 4);
+  REQUIRE(web100["TCPInfo.BytesRetrans"] == "10");
+  REQUIRE(web100["TCPInfo.BytesSent"] == "1000");
+  REQUIRE(web100["TCPInfo.MinRTT"] == "42");
+  REQUIRE(web100["TCPInfo.Empty"] == " ");
+  REQUIRE(client.summary_data().download_retrans == 0.01);
+  REQUIRE(client.summary_data().min_rtt == 42);
+}
+
 // Client::run_meta() tests
 // ------------------------
 
@@ -1107,6 +1478,206 @@ TEST_CASE(
   REQUIRE(client.run_upload() == false);
 }
 
+// Client::run_flows() tests
+// -------------------------
+
+class ScriptedFlowsClient : public Client {
+ public:
+  using Client::Client;
+  // Results of the I/O calls for each socket, where a positive value is the
+  // number of bytes transferred, -1 is EWOULDBLOCK and zero is EOF.
+  mutable std::map<internal::Socket, std::deque<int64_t>> script;
+  mutable std::vector<internal::Size> counts;
+  mutable std::vector<const void *> bases;
+  mutable unsigned int polls = 0;
+  unsigned int performances = 0;
+  internal::Err netx_recv_nonblocking(internal::Socket fd, void *, internal::Size,
+                                      internal::Size *actual) const noexcept override {
+    return next(fd, actual, internal::Err::eof);
+  }
+  internal::Err netx_send_nonblocking(internal::Socket fd, const void *base,
+                                      internal::Size count,
+                                      internal::Size *actual) const noexcept override {
+    counts.push_back(count);
+    bases.push_back(base);
+    return next(fd, actual, internal::Err::broken_pipe);
+  }
+  internal::Err netx_poll(std::vector<pollfd> *pfds, int) const noexcept override {
+    polls += 1;
+    for (auto &pfd : *pfds) {
+      pfd.revents = pfd.events;
+    }
+    return internal::Err::none;
+  }
+  internal::Err netx_closesocket(internal::Socket) noexcept override {
+    return internal::Err::none;  // the sockets are not real
+  }
+  void on_performance(NettestFlags, uint8_t, double, double,
+                      double) noexcept override {
+    performances += 1;
+  }
+
+ private:
+  internal::Err next(internal::Socket fd, internal::Size *actual,
+                     internal::Err final_err) const noexcept {
+    *actual = 0;
+    auto &results = script[fd];
+    if (results.empty()) {
+      return internal::Err::io_error;
+    }
+    auto result = results.front();
+    results.pop_front();
+    if (result < 0) {
+      return internal::Err::operation_would_block;
+    }
+    if (result == 0) {
+      return final_err;
+    }
+    *actual = (internal::Size)result;
+    return internal::Err::none;
+  }
+};
+
+TEST_CASE("Client::run_flows() drives many download flows from one thread") {
+  ScriptedFlowsClient client;
+  client.script[100] = {1000, -1, 2000, -1, 0};
+  client.script[101] = {-1, 3000, 4000, 0};
+  client.script[102] = {0};
+  SocketVector socks{&client};
+  socks.sockets = {100, 101, 102};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_download, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 10000.0);
+  REQUIRE(client.polls == 2);
+  for (auto &kv : client.script) {
+    REQUIRE(kv.second.empty());
+  }
+}
+
+TEST_CASE("Client::run_flows() resumes partially sent WebSocket frames") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_websocket;
+  ScriptedFlowsClient client{settings};
+  client.script[100] = {10, -1, 1, 0};
+  SocketVector socks{&client};
+  socks.sockets = {100};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_upload, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 11.0);
+  REQUIRE(client.polls == 1);
+  REQUIRE(client.counts.size() == 4);
+  REQUIRE(client.counts[1] == client.counts[0] - 10);
+  REQUIRE(client.counts[2] == client.counts[1]);
+  REQUIRE(client.counts[3] == client.counts[2] - 1);
+}
+
+TEST_CASE("Client::run_flows() uploads the shared payload") {
+  Settings settings;
+  settings.upload_payload_size = 50000;
+  ScriptedFlowsClient client{settings};
+  client.script[100] = {50000, 0};
+  client.script[101] = {50000, 0};
+  SocketVector socks{&client};
+  socks.sockets = {100, 101};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_upload, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 100000.0);
+  auto payload = internal::Payload::Get(50000, false);
+  REQUIRE(client.counts.size() == 4);
+  for (size_t i = 0; i < client.counts.size(); ++i) {
+    REQUIRE(client.counts[i] == 50000);
+    REQUIRE(client.bases[i] == payload->Data());
+  }
+}
+
+TEST_CASE("Client::run_flows() rejects more flows than it can report") {
+  ScriptedFlowsClient client;
+  SocketVector socks{&client};
+  for (internal::Socket sock = 0; sock <= UINT8_MAX; ++sock) {
+    socks.sockets.push_back(sock);
+  }
+  double total_data = 1.0;
+  double elapsed = 1.0;
+  client.run_flows(nettest_flag_download, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 0.0);
+  REQUIRE(elapsed == 0.0);
+  REQUIRE(client.polls == 0);
+}
+
+class SamplingFlowsClient : public ScriptedFlowsClient {
+ public:
+  using ScriptedFlowsClient::ScriptedFlowsClient;
+  std::vector<Sample> seen;
+  internal::Err netx_poll(std::vector<pollfd> *pfds,
+                          int timeout) const noexcept override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return ScriptedFlowsClient::netx_poll(pfds, timeout);
+  }
+  void on_sample(const Sample &sample) noexcept override {
+    seen.push_back(sample);
+  }
+};
+
+TEST_CASE("Client::run_flows() takes samples when so configured") {
+  Settings settings;
+  settings.sample_interval = 0.001;
+  settings.sample_buffer_size = 2;
+  SamplingFlowsClient client{settings};
+  client.script[100] = {1000, -1, 2000, -1, 3000, -1, 0};
+  client.script[101] = {-1, 500, -1, 500, -1, 0};
+  SocketVector socks{&client};
+  socks.sockets = {100, 101};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_download, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 7000.0);
+  REQUIRE(client.seen.size() >= 2);
+  uint64_t previous = 0;
+  for (auto &sample : client.seen) {
+    REQUIRE(sample.tid == nettest_flag_download);
+    REQUIRE(sample.flows.size() == 2);
+    REQUIRE(sample.bytes == sample.flows[0].bytes + sample.flows[1].bytes);
+    REQUIRE(sample.bytes_delta == sample.bytes - previous);
+    previous = sample.bytes;
+  }
+  REQUIRE(client.samples().size() == 2);
+  REQUIRE(client.samples().at(1).elapsed == client.seen.back().elapsed);
+}
+
+TEST_CASE("Client::run_flows() does not take samples by default") {
+  SamplingFlowsClient client;
+  client.script[100] = {1000, -1, 0};
+  SocketVector socks{&client};
+  socks.sockets = {100};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_download, socks, &total_data, &elapsed);
+  REQUIRE(client.seen.empty());
+  REQUIRE(client.samples().size() == 0);
+}
+
+TEST_CASE("Client::run_flows() stops all flows when netx_poll() fails") {
+  class FailPollFlowsClient : public ScriptedFlowsClient {
+   public:
+    using ScriptedFlowsClient::ScriptedFlowsClient;
+    internal::Err netx_poll(std::vector<pollfd> *, int) const noexcept override {
+      return internal::Err::io_error;
+    }
+  };
+  FailPollFlowsClient client;
+  client.script[100] = {1000, -1};
+  client.script[101] = {-1};
+  SocketVector socks{&client};
+  socks.sockets = {100, 101};
+  double total_data = 0.0;
+  double elapsed = 0.0;
+  client.run_flows(nettest_flag_download, socks, &total_data, &elapsed);
+  REQUIRE(total_data == 1000.0);
+}
+
 // Client::msg_write_login() tests
 // -------------------------------
 
@@ -1461,6 +2032,1315 @@ TEST_CASE(
   REQUIRE(client.msg_read_legacy(&code, &s) == false);
 }
 
+class StreamNetxRecvn : public Client {
+ public:
+  using Client::Client;
+  mutable std::string stream;
+  internal::Err netx_recvn(internal::Socket, void *p,
+                           internal::Size siz) const noexcept override {
+    if (siz > stream.size()) {
+      return internal::Err::eof;
+    }
+    memcpy(p, stream.data(), (size_t)siz);
+    stream = stream.substr((size_t)siz);
+    return internal::Err::none;
+  }
+};
+
+static std::string legacy_msg(MsgType code, const std::string &body) {
+  std::string msg;
+  msg += (char)code;
+  msg += (char)((body.size() >> 8) & 0xff);
+  msg += (char)(body.size() & 0xff);
+  return msg + body;
+}
+
+TEST_CASE("Client::msg_read_legacy() reads consecutive messages") {
+  StreamNetxRecvn client;
+  std::string large(UINT16_MAX, 'x');
+  client.stream = legacy_msg(msg_test_msg, large) +
+                  legacy_msg(msg_login, "abc") + legacy_msg(msg_logout, "");
+  MsgType code = MsgType{0};
+  std::string s;
+  REQUIRE(client.msg_read_legacy(&code, &s) == true);
+  REQUIRE(code == msg_test_msg);
+  REQUIRE(s == large);
+  REQUIRE(client.msg_read_legacy(&code, &s) == true);
+  REQUIRE(code == msg_login);
+  REQUIRE(s == "abc");
+  REQUIRE(client.msg_read_legacy(&code, &s) == true);
+  REQUIRE(code == msg_logout);
+  REQUIRE(s == "");
+  REQUIRE(client.msg_read_legacy(&code, &s) == false);
+}
+
+TEST_CASE("Client::msg_read() reuses its buffer across messages") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_json;
+  StreamNetxRecvn client{settings};
+  client.stream = legacy_msg(msg_test_msg, "{\"msg\": \"first message\"}") +
+                  legacy_msg(msg_test_msg, "{\"msg\": \"2nd\"}");
+  MsgType code = MsgType{0};
+  std::string s;
+  REQUIRE(client.msg_read(&code, &s) == true);
+  REQUIRE(s == "first message");
+  REQUIRE(client.msg_read(&code, &s) == true);
+  REQUIRE(s == "2nd");
+}
+
+// Client::ws_prepare_frame_inplace() tests
+// ----------------------------------------
+
+// Parses the header of the frame at @p frame and unmasks its payload in place.
+// Returns the size of the header or zero on failure.
+static internal::Size parse_masked_frame(uint8_t *frame, internal::Size framelen,
+                                         internal::Size *length) {
+  if (framelen < 2 || (frame[1] & ws_mask_flag) == 0) {
+    return 0;
+  }
+  internal::Size off = 2;
+  *length = (frame[1] & ws_len_mask);
+  if (*length == 126) {
+    *length = ((internal::Size)frame[2] << 8) | frame[3];
+    off += 2;
+  } else if (*length == 127) {
+    *length = 0;
+    for (internal::Size i = 0; i < 8; ++i) {
+      *length = (*length << 8) | frame[2 + i];
+    }
+    off += 8;
+  }
+  const uint8_t *mask = &frame[off];
+  off += ws_mask_size;
+  if (framelen != off + *length) {
+    return 0;
+  }
+  for (internal::Size i = 0; i < *length; ++i) {
+    frame[off + i] = (uint8_t)(frame[off + i] ^ mask[i % ws_mask_size]);
+  }
+  return off;
+}
+
+TEST_CASE("Client::ws_prepare_frame_inplace() deals with invalid arguments") {
+  Client client;
+  uint8_t buf[ws_max_header_size] = {};
+  uint8_t *frame = nullptr;
+  internal::Size framelen = 0;
+  REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary, nullptr, 0, &frame,
+                                          &framelen) ==
+          internal::Err::invalid_argument);
+  REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary, buf, 0, nullptr,
+                                          &framelen) ==
+          internal::Err::invalid_argument);
+  REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary, buf, 0, &frame,
+                                          nullptr) ==
+          internal::Err::invalid_argument);
+}
+
+TEST_CASE("Client::ws_prepare_frame_inplace() encodes all length formats") {
+  Client client;
+  for (internal::Size count : {(internal::Size)0, (internal::Size)125,
+                               (internal::Size)126, (internal::Size)65535,
+                               (internal::Size)65536}) {
+    std::vector<uint8_t> buf(ws_max_header_size + count);
+    for (internal::Size i = 0; i < count; ++i) {
+      buf[ws_max_header_size + i] = (uint8_t)('A' + i % 26);
+    }
+    uint8_t *frame = nullptr;
+    internal::Size framelen = 0;
+    REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary | ws_fin_flag,
+                                            buf.data(), count, &frame,
+                                            &framelen) == internal::Err::none);
+    // The frame must end exactly where the payload ends.
+    REQUIRE(frame + framelen == buf.data() + buf.size());
+    REQUIRE(frame[0] == (ws_opcode_binary | ws_fin_flag));
+    internal::Size length = 0;
+    internal::Size header_size = parse_masked_frame(frame, framelen, &length);
+    REQUIRE(header_size > 0);
+    REQUIRE(length == count);
+    bool unmasked = true;
+    for (internal::Size i = 0; i < count; ++i) {
+      unmasked = unmasked && frame[header_size + i] == (uint8_t)('A' + i % 26);
+    }
+    REQUIRE(unmasked);
+  }
+}
+
+TEST_CASE("Client::ws_prepare_frame_inplace() uses a fresh mask every time") {
+  Client client;
+  constexpr internal::Size count = 16;
+  uint8_t buf[ws_max_header_size + count] = {};
+  std::set<std::string> masks;
+  for (int i = 0; i < 64; ++i) {
+    uint8_t *frame = nullptr;
+    internal::Size framelen = 0;
+    REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary | ws_fin_flag,
+                                            buf, count, &frame,
+                                            &framelen) == internal::Err::none);
+    REQUIRE(framelen == 2 + ws_mask_size + count);
+    masks.insert(std::string((const char *)&frame[2], ws_mask_size));
+  }
+  // We tolerate a single collision, whose odds are already about 2^-21.
+  REQUIRE(masks.size() >= 63);
+}
+
+// Client::ws_send_frame() tests
+// -----------------------------
+
+class CaptureNetxSendn : public Client {
+ public:
+  using Client::Client;
+  mutable std::vector<uint8_t> data;
+  mutable int calls = 0;
+  internal::Err netx_sendn(internal::Socket, const void *base,
+                           internal::Size count) const noexcept override {
+    data.insert(data.end(), (const uint8_t *)base, (const uint8_t *)base + count);
+    calls += 1;
+    return internal::Err::none;
+  }
+};
+
+TEST_CASE("Client::ws_send_frame() uses a single write for small frames") {
+  CaptureNetxSendn client;
+  std::string payload = "{\"AppInfo\":{}}";
+  REQUIRE(client.ws_send_frame(0, ws_opcode_text | ws_fin_flag,
+                               (uint8_t *)&payload[0],
+                               payload.size()) == internal::Err::none);
+  REQUIRE(client.calls == 1);
+  internal::Size length = 0;
+  internal::Size header_size =
+      parse_masked_frame(client.data.data(), client.data.size(), &length);
+  REQUIRE(header_size == 6);
+  REQUIRE(std::string{(char *)&client.data[header_size], (size_t)length} ==
+          "{\"AppInfo\":{}}");
+}
+
+TEST_CASE("Client::ws_send_frame() deals with frames without body") {
+  CaptureNetxSendn client;
+  REQUIRE(client.ws_send_frame(0, ws_opcode_close | ws_fin_flag, nullptr, 0) ==
+          internal::Err::none);
+  REQUIRE(client.calls == 1);
+  REQUIRE(client.data.size() == 6);
+  REQUIRE(client.data[1] == ws_mask_flag);
+}
+
+TEST_CASE("Client::ws_send_frame() does not copy the payload of large frames") {
+  CaptureNetxSendn client;
+  std::vector<uint8_t> payload(70000, 'x');
+  REQUIRE(client.ws_send_frame(0, ws_opcode_binary | ws_fin_flag, payload.data(),
+                               payload.size()) == internal::Err::none);
+  REQUIRE(client.calls == 2);
+  internal::Size length = 0;
+  REQUIRE(parse_masked_frame(client.data.data(), client.data.size(), &length) ==
+          ws_max_header_size);
+  REQUIRE(length == payload.size());
+}
+
+TEST_CASE("Client::counters() counts the WebSocket frames we send") {
+  CaptureNetxSendn client;
+  std::vector<uint8_t> payload(ws_max_header_size + 70000, 'x');
+  REQUIRE(client.ws_send_frame(0, ws_opcode_close | ws_fin_flag, nullptr, 0) ==
+          internal::Err::none);
+  uint8_t *frame = nullptr;
+  internal::Size framelen = 0;
+  REQUIRE(client.ws_prepare_frame_inplace(ws_opcode_binary | ws_fin_flag,
+                                          payload.data(), 70000, &frame,
+                                          &framelen) == internal::Err::none);
+  Counters counters = client.counters();
+  REQUIRE(counters.send_frame_sizes[0] == 1);
+  REQUIRE(counters.send_frame_sizes[17] == 1);  // [65536, 131072) bytes
+  REQUIRE(counters.recv_frame_sizes[0] == 0);
+}
+
+// Client::ws_recvn() tests
+// ------------------------
+
+// server_frame returns an unmasked frame, like the ones sent by a server.
+static std::string server_frame(uint8_t first_byte, const std::string &body) {
+  std::string frame;
+  frame += (char)first_byte;
+  if (body.size() < 126) {
+    frame += (char)body.size();
+  } else if (body.size() <= 65535) {
+    frame += (char)126;
+    frame += (char)((body.size() >> 8) & 0xff);
+    frame += (char)(body.size() & 0xff);
+  } else {
+    frame += (char)127;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      frame += (char)(((uint64_t)body.size() >> shift) & 0xff);
+    }
+  }
+  return frame + body;
+}
+
+class BufferedWsClient : public Client {
+ public:
+  using Client::Client;
+  std::shared_ptr<std::deque<std::string>> chunks = std::make_shared<
+      std::deque<std::string>>();
+  mutable int recv_calls = 0;
+  internal::Err netx_maybessl_dial(const std::string &, const std::string &,
+                                   internal::Socket *sock) noexcept override {
+    *sock = 17 /* Something "valid" */;
+    return internal::Err::none;
+  }
+  internal::Err netx_sendn(internal::Socket, const void *,
+                           internal::Size) const noexcept override {
+    return internal::Err::none;
+  }
+  internal::Err netx_recv(internal::Socket, void *base, internal::Size count,
+                          internal::Size *actual) const noexcept override {
+    recv_calls += 1;
+    if (chunks->empty()) {
+      return internal::Err::eof;
+    }
+    std::string &chunk = chunks->front();
+    *actual = std::min((internal::Size)chunk.size(), count);
+    memcpy(base, chunk.data(), (size_t)*actual);
+    chunk = chunk.substr((size_t)*actual);
+    if (chunk.empty()) {
+      chunks->pop_front();
+    }
+    return internal::Err::none;
+  }
+};
+
+static Settings buffered_ws_settings() {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_websocket;
+  return settings;
+}
+
+TEST_CASE("Client::ws_recvn() parses many small frames from a single read") {
+  BufferedWsClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_text | ws_fin_flag, "{}") +
+      server_frame(ws_opcode_binary | ws_fin_flag, std::string(1000, 'x')) +
+      server_frame(ws_opcode_text | ws_fin_flag, "{\"AppInfo\":{}}"));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(4096);
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_text);
+  REQUIRE(std::string((char *)buf.data(), count) == "{}");
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_binary);
+  REQUIRE(std::string((char *)buf.data(), count) == std::string(1000, 'x'));
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_text);
+  REQUIRE(std::string((char *)buf.data(), count) == "{\"AppInfo\":{}}");
+  REQUIRE(client.recv_calls == 1);
+  Client::WsRecvStats stats;
+  REQUIRE(client.ws_recv_stats(sock, &stats));
+  REQUIRE(stats.frames == 3);
+  REQUIRE(stats.recv_calls == 1);
+}
+
+TEST_CASE("Client::counters() counts the WebSocket handshakes and frames") {
+  BufferedWsClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_text | ws_fin_flag, "{}") +
+      server_frame(ws_opcode_binary | ws_fin_flag, std::string(1000, 'x')) +
+      server_frame(ws_opcode_binary | ws_fin_flag, std::string(1023, 'x')));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(4096);
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                              &count) == internal::Err::none);
+  }
+  Counters counters = client.counters();
+  REQUIRE(counters.ws_handshakes == 1);
+  REQUIRE(counters.tls_handshakes == 0);
+  uint64_t frames = 0;
+  for (size_t i = 0; i < Counters::frame_size_buckets; ++i) {
+    frames += counters.recv_frame_sizes[i];
+    REQUIRE(counters.send_frame_sizes[i] == 0);
+  }
+  REQUIRE(frames == 3);
+  REQUIRE(counters.recv_frame_sizes[2] == 1);   // 2 bytes
+  REQUIRE(counters.recv_frame_sizes[10] == 2);  // [512, 1024) bytes
+}
+
+class DebugBufferedWsClient : public BufferedWsClient {
+ public:
+  using BufferedWsClient::BufferedWsClient;
+  mutable std::vector<std::string> debug;
+  void on_debug(const std::string &s) const noexcept override {
+    debug.push_back(s);
+  }
+};
+
+TEST_CASE("Client::ws_recv_any_frame() emits a single debug message") {
+  Settings settings = buffered_ws_settings();
+  settings.verbosity = verbosity_debug;
+  DebugBufferedWsClient client{settings};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_binary | ws_fin_flag, std::string(70000, 'x')));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  client.debug.clear();
+  std::vector<uint8_t> buf(70000);
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(count == 70000);
+  std::vector<std::string> frame_debug;
+  for (auto &s : client.debug) {
+    if (s.find("ws_recv_any_frame:") == 0) {
+      frame_debug.push_back(s);
+    }
+  }
+  REQUIRE(frame_debug.size() == 1);
+  REQUIRE(frame_debug[0] ==
+          "ws_recv_any_frame: FIN: true; opcode: 2; length: 70000");
+}
+
+TEST_CASE("Client::ws_recvn() reads large bodies directly") {
+  BufferedWsClient client{buffered_ws_settings()};
+  std::string body;
+  for (int i = 0; i < 300000; ++i) {
+    body += (char)('A' + i % 26);
+  }
+  std::string frame = server_frame(ws_opcode_binary | ws_fin_flag, body);
+  client.chunks->push_back("HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+                           frame.substr(0, 1000));
+  client.chunks->push_back(frame.substr(1000));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(body.size());
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_binary);
+  REQUIRE(std::string((char *)buf.data(), count) == body);
+  // One read for the handshake and the beginning of the frame and one
+  // read for the rest of the body, which bypasses the buffer.
+  REQUIRE(client.recv_calls == 2);
+}
+
+// Client::ws_recvmsg_discard() tests
+// ----------------------------------
+
+TEST_CASE("Client::ws_recvmsg_discard() counts binary and keeps text") {
+  BufferedWsClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_binary, std::string(100000, 'x')) +
+      server_frame(ws_opcode_ping | ws_fin_flag, "ping") +
+      server_frame(ws_opcode_continue | ws_fin_flag, std::string(70000, 'y')) +
+      server_frame(ws_opcode_text, "{\"AppInfo\":") +
+      server_frame(ws_opcode_continue | ws_fin_flag, "{}}"));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  uint8_t buf[128] = {};
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg_discard(sock, &opcode, buf, sizeof(buf),
+                                    &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_binary);
+  REQUIRE(count == 170000);
+  REQUIRE(client.ws_recvmsg_discard(sock, &opcode, buf, sizeof(buf),
+                                    &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_text);
+  REQUIRE(std::string((char *)buf, count) == "{\"AppInfo\":{}}");
+}
+
+TEST_CASE("Client::ws_recvmsg_discard() deals with too large text messages") {
+  BufferedWsClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_text | ws_fin_flag, std::string(1000, 'x')));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  uint8_t buf[128] = {};
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg_discard(sock, &opcode, buf, sizeof(buf),
+                                    &count) == internal::Err::message_size);
+}
+
+TEST_CASE("Client::ws_recv_stats() deals with sockets without buffer") {
+  Client client;
+  Client::WsRecvStats stats;
+  REQUIRE(client.ws_recv_stats(17, &stats) == false);
+}
+
+// Client::ndt7_download() tests
+// -----------------------------
+
+class MultiFlowNdt7Download : public Client {
+ public:
+  using Client::Client;
+  // Each flow only reads from its own stream, so we don't need locking.
+  mutable std::map<internal::Socket, std::string> streams;
+  internal::Socket next_sock = 100;
+  internal::Err netx_maybews_dial(const std::string &, const std::string &,
+                                  uint64_t, std::string, std::string,
+                                  internal::Socket *sock) noexcept override {
+    *sock = next_sock++;
+    std::string measurement = "{\"TCPInfo\":{\"BytesRetrans\":1,"
+        "\"BytesSent\":100,\"MinRTT\":" + std::to_string(*sock) + "}}";
+    streams[*sock] = server_frame(ws_opcode_text | ws_fin_flag, measurement) +
+                     server_frame(ws_opcode_binary | ws_fin_flag,
+                                  std::string(1000, 'x'));
+    return internal::Err::none;
+  }
+  internal::Err netx_recvn(internal::Socket sock, void *base,
+                           internal::Size count) const noexcept override {
+    std::string &stream = streams.at(sock);
+    if (stream.size() < count) {
+      return internal::Err::eof;
+    }
+    memcpy(base, stream.data(), (size_t)count);
+    stream = stream.substr((size_t)count);
+    return internal::Err::none;
+  }
+  internal::Err netx_closesocket(internal::Socket) noexcept override {
+    return internal::Err::none;
+  }
+  const SummaryData &summary_data() const noexcept { return summary_; }
+  const nlohmann::json &flows() const noexcept { return download_flows_; }
+};
+
+TEST_CASE("Client::ndt7_download() aggregates multiple flows") {
+  Settings settings;
+  settings.ndt7_nflows = 3;
+  MultiFlowNdt7Download client{settings};
+  REQUIRE(client.ndt7_download() == true);
+  REQUIRE(client.flows().size() == 3);
+  for (auto &flow : client.flows()) {
+    REQUIRE(flow.contains("TCPInfo"));
+  }
+  REQUIRE(client.summary_data().download_speed > 0.0);
+  REQUIRE(client.summary_data().download_retrans == Approx(0.01));
+  REQUIRE(client.summary_data().min_rtt == 100);
+}
+
+// EndlessNdt7Download is a download server that keeps sending binary frames
+// until the client sends CLOSE, then replies with CLOSE.
+class EndlessNdt7Download : public Client {
+ public:
+  using Client::Client;
+  mutable std::mutex mutex;
+  mutable std::map<internal::Socket, std::string> streams;
+  mutable std::map<internal::Socket, int> closes;
+  internal::Socket next_sock = 100;
+  internal::Err netx_maybews_dial(const std::string &, const std::string &,
+                                  uint64_t, std::string, std::string,
+                                  internal::Socket *sock) noexcept override {
+    std::lock_guard<std::mutex> _{mutex};
+    *sock = next_sock++;
+    streams[*sock] = "";
+    closes[*sock] = 0;
+    return internal::Err::none;
+  }
+  internal::Err netx_recvn(internal::Socket sock, void *base,
+                           internal::Size count) const noexcept override {
+    std::lock_guard<std::mutex> _{mutex};
+    std::string &stream = streams.at(sock);
+    while (stream.size() < count) {
+      if (closes.at(sock) > 0) {
+        return internal::Err::eof;
+      }
+      stream += server_frame(ws_opcode_binary | ws_fin_flag,
+                             std::string(1000, 'x'));
+    }
+    memcpy(base, stream.data(), (size_t)count);
+    stream = stream.substr((size_t)count);
+    return internal::Err::none;
+  }
+  internal::Err netx_recv_nonblocking(
+      internal::Socket sock, void *base, internal::Size count,
+      internal::Size *actual) const noexcept override {
+    std::lock_guard<std::mutex> _{mutex};
+    std::string &stream = streams.at(sock);
+    if (stream.empty()) {
+      if (closes.at(sock) > 0) {
+        return internal::Err::eof;
+      }
+      stream += server_frame(ws_opcode_binary | ws_fin_flag,
+                             std::string(1000, 'x'));
+    }
+    size_t n = std::min((size_t)count, stream.size());
+    memcpy(base, stream.data(), n);
+    stream = stream.substr(n);
+    *actual = n;
+    return internal::Err::none;
+  }
+  internal::Err netx_sendn(internal::Socket sock, const void *base,
+                           internal::Size count) const noexcept override {
+    std::lock_guard<std::mutex> _{mutex};
+    if (count > 0 && *(const uint8_t *)base == (ws_opcode_close | ws_fin_flag)) {
+      closes.at(sock) += 1;
+      streams.at(sock) += server_frame(ws_opcode_close | ws_fin_flag, "");
+    }
+    return internal::Err::none;
+  }
+  internal::Err netx_send_nonblocking(
+      internal::Socket sock, const void *base, internal::Size count,
+      internal::Size *actual) const noexcept override {
+    *actual = count;
+    return netx_sendn(sock, base, count);
+  }
+  internal::Err netx_closesocket(internal::Socket) noexcept override {
+    return internal::Err::none;
+  }
+  const SummaryData &summary_data() const noexcept { return summary_; }
+};
+
+static Settings convergence_settings(uint8_t nflows) {
+  Settings settings;
+  settings.ndt7_nflows = nflows;
+  settings.measurement_interval = 0.005;
+  // Any positive speed is within a 100% tolerance of itself.
+  settings.convergence_tolerance = 1.0;
+  settings.convergence_window = 0.05;
+  settings.convergence_min_runtime = 0.1;
+  return settings;
+}
+
+TEST_CASE("Client::ndt7_download() stops when the speed converges") {
+  EndlessNdt7Download client{convergence_settings(1)};
+  auto begin = std::chrono::steady_clock::now();
+  REQUIRE(client.ndt7_download() == true);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  REQUIRE(elapsed.count() < Settings{}.max_runtime);
+  REQUIRE(client.closes.at(100) == 1);
+  REQUIRE(client.summary_data().download_speed > 0.0);
+}
+
+#ifndef _WIN32
+// PolledNdt7Download receives the ndt7 download from a socketpair, whose
+// other end the test writes to, to check that we can poll() the client.
+class PolledNdt7Download : public Client {
+ public:
+  using Client::Client;
+  internal::Socket sock = (internal::Socket)-1;
+  mutable std::atomic<bool> closed{false};
+  std::vector<bool> completions;
+  bool query_mlabns(std::vector<std::string> *fqdns) noexcept override {
+    fqdns->push_back("ndt.example.com");
+    return true;
+  }
+  internal::Err netx_maybews_dial(const std::string &, const std::string &,
+                                  uint64_t, std::string, std::string,
+                                  internal::Socket *s) noexcept override {
+    *s = sock;
+    return internal::Err::none;
+  }
+  internal::Err netx_recv_nonblocking(
+      internal::Socket s, void *base, internal::Size count,
+      internal::Size *actual) const noexcept override {
+    // We skip TLS, which ndt7 uses, so we directly read from the socket.
+    auto n = ::recv(s, base, (size_t)count, 0);
+    if (n < 0) {
+      return netx_map_errno(errno);
+    }
+    if (n == 0) {
+      return internal::Err::eof;
+    }
+    *actual = (internal::Size)n;
+    return internal::Err::none;
+  }
+  internal::Err netx_sendn(internal::Socket, const void *base,
+                           internal::Size count) const noexcept override {
+    if (count > 0 && *(const uint8_t *)base == (ws_opcode_close | ws_fin_flag)) {
+      closed = true;
+    }
+    return internal::Err::none;
+  }
+  internal::Err netx_closesocket(internal::Socket) noexcept override {
+    return internal::Err::none;  // the test owns the socket
+  }
+  void on_complete(bool success) noexcept override {
+    completions.push_back(success);
+  }
+  const SummaryData &summary_data() const noexcept { return summary_; }
+};
+
+TEST_CASE("Client::step() runs the ndt7 download without blocking") {
+  int fds[2] = {-1, -1};
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  REQUIRE(::fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  Settings settings = convergence_settings(1);
+  settings.protocol_flags = protocol_flag_ndt7;
+  PolledNdt7Download client{settings};
+  client.sock = fds[0];
+  REQUIRE(client.start() == true);
+  std::string out;
+  bool sent_close = false;
+  std::chrono::duration<double> longest{0.0};
+  bool infinite = false, other_fds = false, polled = false;
+  std::vector<pollfd> pfds;
+  for (;;) {
+    auto begin = std::chrono::steady_clock::now();
+    bool more = client.step();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    longest = std::max(longest, elapsed);
+    if (!more) {
+      break;
+    }
+    // Play the server: send data until the client sends CLOSE.
+    if (!client.closed) {
+      if (out.size() < 8192) {
+        out += server_frame(ws_opcode_binary | ws_fin_flag,
+                            std::string(1000, 'x'));
+      }
+    } else if (!sent_close) {
+      out += server_frame(ws_opcode_close | ws_fin_flag, "");
+      sent_close = true;
+    }
+    if (!out.empty()) {
+      auto n = ::send(fds[1], out.data(), out.size(), MSG_DONTWAIT);
+      if (n > 0) {
+        out = out.substr((size_t)n);
+      }
+    }
+    int timeout = client.poll_fds(&pfds);
+    for (auto &pfd : pfds) {
+      other_fds = other_fds || pfd.fd != fds[0];
+    }
+    polled = polled || !pfds.empty();
+    // A negative timeout would mean waiting forever, while the client needs
+    // to wake up in time for its deadlines.
+    infinite = infinite || timeout < 0;
+    (void)::poll(pfds.data(), (nfds_t)pfds.size(), timeout);
+  }
+  REQUIRE(!infinite);
+  REQUIRE(!other_fds);
+  REQUIRE(polled);
+  REQUIRE(client.completions == std::vector<bool>{true});
+  REQUIRE(client.closed);
+  REQUIRE(client.summary_data().download_speed > 0.0);
+  // Each step runs for at most a slice of time, plus some slack.
+  REQUIRE(longest.count() < 0.5);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+#endif  // !_WIN32
+
+TEST_CASE("Client::ndt7_download() stops all flows when the speed converges") {
+  EndlessNdt7Download client{convergence_settings(3)};
+  REQUIRE(client.ndt7_download() == true);
+  for (internal::Socket sock = 100; sock < 103; ++sock) {
+    REQUIRE(client.closes.at(sock) == 1);
+  }
+  REQUIRE(client.summary_data().download_speed > 0.0);
+}
+
+TEST_CASE("Client::ws_close() waits for the peer's CLOSE") {
+  EndlessNdt7Download client;
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "443", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  client.streams[sock] =
+      server_frame(ws_opcode_text | ws_fin_flag, "{}") +
+      server_frame(ws_opcode_ping | ws_fin_flag, "ping");
+  uint8_t buf[128] = {};
+  REQUIRE(client.ws_close(sock, buf, sizeof(buf)) == internal::Err::none);
+  REQUIRE(client.closes.at(sock) == 1);
+  // Make sure we consumed the whole stream, including the CLOSE frame.
+  REQUIRE(client.streams.at(sock).empty());
+}
+
+// FailoverHosts is the state shared by a FailoverNdt7Client and the clients
+// it creates to speculatively connect.
+struct FailoverHosts {
+  std::mutex mutex;
+  std::set<std::string> dead;  // hostname + url_path
+  std::vector<std::string> dials;
+  std::map<std::string, internal::Socket> socks;
+  std::set<internal::Socket> closed;
+  internal::Socket next_sock = 100;
+};
+
+class FailoverNdt7Client : public EndlessNdt7Download {
+ public:
+  using EndlessNdt7Download::EndlessNdt7Download;
+  std::shared_ptr<FailoverHosts> hosts = std::make_shared<FailoverHosts>();
+  FailoverNdt7Client *parent = this;
+  bool query_mlabns(std::vector<std::string> *fqdns) noexcept override {
+    *fqdns = {"a.example.com", "b.example.com", "c.example.com"};
+    return true;
+  }
+  internal::Err netx_maybews_dial(const std::string &hostname,
+                                  const std::string &, uint64_t, std::string,
+                                  std::string url_path,
+                                  internal::Socket *sock) noexcept override {
+    {
+      std::lock_guard<std::mutex> _{hosts->mutex};
+      hosts->dials.push_back(hostname + url_path);
+      if (hosts->dead.count(hostname + url_path) > 0) {
+        return internal::Err::io_error;
+      }
+      *sock = hosts->next_sock++;
+      hosts->socks[hostname + url_path] = *sock;
+    }
+    // The parent runs the subtest, also using speculative connections.
+    std::lock_guard<std::mutex> _{parent->mutex};
+    parent->streams[*sock] = "";
+    parent->closes[*sock] = 0;
+    return internal::Err::none;
+  }
+  internal::Err netx_closesocket(internal::Socket sock) noexcept override {
+    std::lock_guard<std::mutex> _{hosts->mutex};
+    hosts->closed.insert(sock);
+    return internal::Err::none;
+  }
+  std::unique_ptr<Client> ndt7_preconnect_client(
+      Settings settings) noexcept override {
+    auto client = new FailoverNdt7Client{std::move(settings)};
+    client->hosts = hosts;
+    client->parent = this;
+    return std::unique_ptr<Client>{client};
+  }
+};
+
+static Settings failover_settings(bool preconnect) {
+  Settings settings = convergence_settings(1);
+  settings.protocol_flags = protocol_flag_ndt7;
+  settings.ndt7_preconnect = preconnect;
+  return settings;
+}
+
+TEST_CASE("Client::run() tries another ndt7 host when it cannot connect") {
+  FailoverNdt7Client client{failover_settings(false)};
+  client.hosts->dead = {"a.example.com/ndt/v7/download",
+                        "b.example.com/ndt/v7/download"};
+  REQUIRE(client.run() == true);
+  REQUIRE(client.hosts->dials == (std::vector<std::string>{
+                                     "a.example.com/ndt/v7/download",
+                                     "b.example.com/ndt/v7/download",
+                                     "c.example.com/ndt/v7/download",
+                                 }));
+  REQUIRE(client.closes.at(100) == 1);
+}
+
+TEST_CASE("Client::run() fails when it cannot connect to any ndt7 host") {
+  FailoverNdt7Client client{failover_settings(false)};
+  client.hosts->dead = {"a.example.com/ndt/v7/download",
+                        "b.example.com/ndt/v7/download",
+                        "c.example.com/ndt/v7/download"};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.hosts->dials.size() == 3);
+}
+
+TEST_CASE("Client::run() does not try another ndt7 host after a subtest") {
+  Settings settings = failover_settings(false);
+  settings.nettest_flags = nettest_flag_download | nettest_flag_upload;
+  FailoverNdt7Client client{settings};
+  client.hosts->dead = {"a.example.com/ndt/v7/upload"};
+  REQUIRE(client.run() == true);
+  REQUIRE(client.hosts->dials == (std::vector<std::string>{
+                                     "a.example.com/ndt/v7/download",
+                                     "a.example.com/ndt/v7/upload",
+                                 }));
+}
+
+TEST_CASE("Client::run() tries another ndt7 host for the upload") {
+  Settings settings = failover_settings(false);
+  settings.nettest_flags = nettest_flag_upload;
+  FailoverNdt7Client client{settings};
+  client.hosts->dead = {"a.example.com/ndt/v7/upload",
+                        "b.example.com/ndt/v7/upload",
+                        "c.example.com/ndt/v7/upload"};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.hosts->dials.size() == 3);
+}
+
+TEST_CASE("Client::run() uses the speculative ndt7 connection") {
+  FailoverNdt7Client client{failover_settings(true)};
+  client.hosts->dead = {"a.example.com/ndt/v7/download"};
+  REQUIRE(client.run() == true);
+  // We dial a, and speculatively b and c. After a fails, we use b, and we
+  // eventually close c, once we have also connected to it.
+  REQUIRE(client.hosts->dials.size() == 3);
+  auto b = client.hosts->socks.at("b.example.com/ndt/v7/download");
+  auto c = client.hosts->socks.at("c.example.com/ndt/v7/download");
+  REQUIRE(client.closes.at(b) == 1);
+  REQUIRE(client.closes.at(c) == 0);
+  REQUIRE(client.hosts->closed.count(c) == 1);
+}
+
+TEST_CASE("Client::run() closes the speculative ndt7 connection") {
+  FailoverNdt7Client client{failover_settings(true)};
+  REQUIRE(client.run() == true);
+  REQUIRE(client.hosts->dials.size() == 2);
+  auto a = client.hosts->socks.at("a.example.com/ndt/v7/download");
+  auto b = client.hosts->socks.at("b.example.com/ndt/v7/download");
+  REQUIRE(client.closes.at(a) == 1);
+  REQUIRE(client.closes.at(b) == 0);
+  REQUIRE(client.hosts->closed.count(b) == 1);
+}
+
+// SlowPreconnect is the state shared by a SlowPreconnectClient and the
+// clients it creates to speculatively connect.
+struct SlowPreconnect {
+  std::mutex mutex;
+  bool dialed = false;
+  bool cancelled = false;
+  const void *ssl_cache = nullptr;
+  const void *mlabns_cache = nullptr;
+  const void *admission = nullptr;
+};
+
+class SlowPreconnectClient : public FailoverNdt7Client {
+ public:
+  using FailoverNdt7Client::FailoverNdt7Client;
+  std::shared_ptr<SlowPreconnect> state = std::make_shared<SlowPreconnect>();
+  bool speculative = false;
+  // The speculative connects take a whole timeout unless cancelled.
+  internal::Err netx_maybews_dial(const std::string &hostname,
+                                  const std::string &port, uint64_t flags,
+                                  std::string protocol, std::string url_path,
+                                  internal::Socket *sock) noexcept override {
+    if (!speculative) {
+      return FailoverNdt7Client::netx_maybews_dial(
+          hostname, port, flags, std::move(protocol), std::move(url_path),
+          sock);
+    }
+    auto begin = std::chrono::steady_clock::now();
+    while (!is_cancelled() && std::chrono::steady_clock::now() - begin <
+                                  std::chrono::seconds(10)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    std::lock_guard<std::mutex> _{state->mutex};
+    state->dialed = true;
+    state->cancelled = is_cancelled();
+    state->ssl_cache = ssl_cache.get();
+    state->mlabns_cache = mlabns_cache.get();
+    state->admission = admission.get();
+    return internal::Err::cancelled;
+  }
+  std::unique_ptr<Client> ndt7_preconnect_client(
+      Settings settings) noexcept override {
+    auto client = new SlowPreconnectClient{std::move(settings)};
+    client->hosts = hosts;
+    client->parent = this;
+    client->state = state;
+    client->speculative = true;
+    return std::unique_ptr<Client>{client};
+  }
+};
+
+TEST_CASE("Client::run() cancels the speculative ndt7 connect") {
+  SlowPreconnectClient client{failover_settings(true)};
+  client.ssl_cache = std::make_shared<internal::SslCache>();
+  client.mlabns_cache = std::make_shared<internal::MlabnsCache>();
+  client.admission = std::make_shared<internal::Admission>(1, 0);
+  auto begin = std::chrono::steady_clock::now();
+  REQUIRE(client.run() == true);
+  REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+  // The speculative client shared our state and saw that we abandoned it.
+  REQUIRE(client.state->dialed);
+  REQUIRE(client.state->cancelled);
+  REQUIRE(client.state->ssl_cache == client.ssl_cache.get());
+  REQUIRE(client.state->mlabns_cache == client.mlabns_cache.get());
+  REQUIRE(client.state->admission == client.admission.get());
+}
+
+class Ndt7MeasurementsClient : public Client {
+ public:
+  using Client::Client;
+  const SummaryData &summary_data() const noexcept { return summary_; }
+  const nlohmann::json &measurement() const noexcept { return measurement_; }
+  const nlohmann::json &connection_info() const noexcept {
+    return connection_info_;
+  }
+  const nlohmann::json &materialize() noexcept {
+    ndt7_materialize_flows(&download_flows_);
+    return download_flows_;
+  }
+};
+
+TEST_CASE("Client::ndt7_materialize_flows() parses the latest measurements") {
+  Ndt7MeasurementsClient client;
+  std::string first = R"({"ConnectionInfo": {"UUID": "abc"}})";
+  std::string second = R"({"TCPInfo": {"BytesRetrans": 1, "BytesSent": 50,)"
+                       R"( "MinRTT": 700}})";
+  client.ndt7_on_download_measurement(0, first.data(), first.size());
+  client.ndt7_on_download_measurement(0, second.data(), second.size());
+  std::string broken = "{{{{";
+  client.ndt7_on_download_measurement(0, broken.data(), broken.size());
+  REQUIRE(client.summary_data().download_retrans == Approx(0.02));
+  REQUIRE(client.summary_data().min_rtt == 700);
+  const nlohmann::json &flows = client.materialize();
+  REQUIRE(flows.size() == 1);
+  REQUIRE(flows[0] == nlohmann::json::parse(second));
+  REQUIRE(client.measurement() == nlohmann::json::parse(second));
+  REQUIRE(client.connection_info()["UUID"] == "abc");
+}
+
+class CollectingResultsSink : public ResultsSink {
+ public:
+  std::vector<std::string> records;
+  void on_record(const ResultRecord &record) noexcept override {
+    records.push_back(std::string{record.scope} + " " + record.name + " " +
+                      std::to_string((unsigned)record.flow) + " " +
+                      std::string{record.value, record.value_size});
+  }
+};
+
+TEST_CASE("Client passes the ndt7 measurements to the results sink") {
+  Settings settings;
+  settings.ndt7_nflows = 2;
+  auto sink = std::make_shared<CollectingResultsSink>();
+  settings.results_sink = sink;
+  Ndt7MeasurementsClient client{settings};
+  std::string download = R"({"TCPInfo": {"MinRTT": 700}})";
+  client.ndt7_on_download_measurement(1, download.data(), download.size());
+  std::string broken = "{{{{";
+  client.ndt7_on_download_measurement(1, broken.data(), broken.size());
+  std::string upload = R"({"AppInfo": {"NumBytes": 17}})";
+  client.ndt7_on_upload_measurement(0, upload.data(), upload.size(),
+                                    Client::Ndt7UploadSample{});
+  REQUIRE(sink->records.size() == 2);
+  REQUIRE(sink->records[0] == "ndt7 download 1 " + download);
+  REQUIRE(sink->records[1] == "ndt7 upload 0 " + upload);
+}
+
+// Client::ndt7_maybe_ping() tests
+// --------------------------------
+
+class LatencyClient : public BufferedWsClient {
+ public:
+  using BufferedWsClient::BufferedWsClient;
+  mutable std::vector<std::pair<uint8_t, std::string>> frames;
+  std::vector<std::string> results;
+  internal::Err ws_send_frame(internal::Socket, uint8_t first_byte,
+                              uint8_t *base, internal::Size count) const
+      noexcept override {
+    frames.emplace_back(first_byte, std::string((char *)base, (size_t)count));
+    return internal::Err::none;
+  }
+  internal::Err netx_wait_readable(internal::Socket, Timeout) const
+      noexcept override {
+    return chunks->empty() ? internal::Err::timed_out : internal::Err::none;
+  }
+  void on_result(std::string scope, std::string name,
+                 std::string value) noexcept override {
+    results.push_back(scope + " " + name + " " + value);
+  }
+};
+
+// Returns the payload of the PONG replying to a PING sent now.
+static std::string latency_pong_payload() {
+  uint8_t payload[internal::Latency::payload_size];
+  internal::Latency::Encode(
+      payload, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count());
+  return std::string((char *)payload, sizeof(payload));
+}
+
+TEST_CASE("Client::ndt7_maybe_ping() honours the latency interval") {
+  Settings settings = buffered_ws_settings();
+
+  SECTION("When the latency interval is zero") {
+    LatencyClient client{settings};
+    auto latest = std::chrono::steady_clock::time_point{};
+    bool pinging = false;
+    REQUIRE(client.ndt7_maybe_ping(0, std::chrono::steady_clock::now(),
+                                   &latest, &pinging) == internal::Err::none);
+    REQUIRE(client.frames.empty());
+    REQUIRE(!pinging);
+  }
+
+  SECTION("When the latency interval is positive") {
+    settings.ndt7_latency_interval = 0.25;
+    LatencyClient client{settings};
+    auto latest = std::chrono::steady_clock::now();
+    auto now = latest + std::chrono::milliseconds(100);
+    bool pinging = false;
+    REQUIRE(client.ndt7_maybe_ping(0, now, &latest, &pinging) ==
+            internal::Err::none);
+    REQUIRE(client.frames.empty());
+    REQUIRE(!pinging);
+    now = latest + std::chrono::milliseconds(250);
+    REQUIRE(client.ndt7_maybe_ping(0, now, &latest, &pinging) ==
+            internal::Err::none);
+    REQUIRE(latest == now);
+    REQUIRE(pinging);
+    REQUIRE(client.frames.size() == 1);
+    REQUIRE(client.frames[0].first == (ws_opcode_ping | ws_fin_flag));
+    REQUIRE(client.frames[0].second.size() == internal::Latency::payload_size);
+  }
+}
+
+TEST_CASE("Client::ws_recv_frame() measures the latency using PONG frames") {
+  LatencyClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_pong | ws_fin_flag, latency_pong_payload()) +
+      server_frame(ws_opcode_pong | ws_fin_flag, "unsolicited") +
+      server_frame(ws_opcode_binary | ws_fin_flag, std::string(1000, 'x')));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(4096);
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg(sock, &opcode, buf.data(), buf.size(),
+                            &count) == internal::Err::none);
+  REQUIRE(opcode == ws_opcode_binary);
+  internal::LatencySummary summary;
+  client.ndt7_report_latency("download_latency", &summary);
+  REQUIRE(summary.count == 1);
+  REQUIRE(summary.min == summary.max);
+  REQUIRE(client.results.size() == 1);
+  auto result = client.results[0];
+  REQUIRE(result.find("ndt7 download_latency ") == 0);
+  auto latency = nlohmann::json::parse(
+      result.substr(strlen("ndt7 download_latency ")));
+  REQUIRE(latency["Count"] == 1);
+  REQUIRE(latency["P50"] == summary.p50);
+}
+
+TEST_CASE("Client::ndt7_recv_pongs() reads the frames until our PONG") {
+  LatencyClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_text | ws_fin_flag, "{}") +
+      server_frame(ws_opcode_ping | ws_fin_flag, "abc") +
+      server_frame(ws_opcode_pong | ws_fin_flag, "unsolicited") +
+      server_frame(ws_opcode_pong | ws_fin_flag, latency_pong_payload()) +
+      server_frame(ws_opcode_text | ws_fin_flag, "{}"));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(4096);
+  internal::LatencySummary summary;
+
+  SECTION("When we are not waiting for a PONG") {
+    bool pinging = false;
+    REQUIRE(client.ndt7_recv_pongs(sock, buf.data(), buf.size(), &pinging) ==
+            internal::Err::none);
+    REQUIRE(client.frames.empty());
+    client.ndt7_report_latency("upload_latency", &summary);
+    REQUIRE(summary.count == 0);
+  }
+
+  SECTION("When we are waiting for a PONG") {
+    bool pinging = true;
+    REQUIRE(client.ndt7_recv_pongs(sock, buf.data(), buf.size(), &pinging) ==
+            internal::Err::none);
+    REQUIRE(!pinging);
+    REQUIRE(client.frames.size() == 1);
+    REQUIRE(client.frames[0].first == (ws_opcode_pong | ws_fin_flag));
+    REQUIRE(client.frames[0].second == "abc");
+    client.ndt7_report_latency("upload_latency", &summary);
+    REQUIRE(summary.count == 1);
+    // We stop reading after our PONG.
+    REQUIRE(client.netx_has_pending_data(sock));
+  }
+}
+
+TEST_CASE("Client::ndt7_recv_pongs() deals with the server closing") {
+  LatencyClient client{buffered_ws_settings()};
+  client.chunks->push_back(
+      "HTTP/1.1 101 Switching Protocols\r\n\r\n" +
+      server_frame(ws_opcode_text | ws_fin_flag, "{}") +
+      server_frame(ws_opcode_close | ws_fin_flag, ""));
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_maybews_dial("127.0.0.1", "80", 0, "", "/",
+                                   &sock) == internal::Err::none);
+  std::vector<uint8_t> buf(4096);
+  bool pinging = true;
+  REQUIRE(client.ndt7_recv_pongs(sock, buf.data(), buf.size(), &pinging) ==
+          internal::Err::eof);
+  REQUIRE(client.frames.size() == 1);
+  REQUIRE(client.frames[0].first == (ws_opcode_close | ws_fin_flag));
+}
+
+TEST_CASE("Client::ndt7_report_latency() does not report without samples") {
+  LatencyClient client{buffered_ws_settings()};
+  internal::LatencySummary summary;
+  summary.count = 17;
+  client.ndt7_report_latency("upload_latency", &summary);
+  REQUIRE(summary.count == 0);
+  REQUIRE(client.results.empty());
+}
+
+TEST_CASE("JsonLinesSink writes a JSON object per line") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  {
+    JsonLinesSink sink{fds[1], true};
+    std::string value = R"({"AppInfo":{"NumBytes":17}})";
+    ResultRecord record;
+    record.scope = "ndt7";
+    record.name = "upload";
+    record.flow = 3;
+    record.timestamp_usec = 1234;
+    record.value = value.data();
+    record.value_size = value.size();
+    sink.on_record(record);
+    record.value = nullptr;  // ignored
+    sink.on_record(record);
+    REQUIRE(sink.flush() == true);
+    REQUIRE(sink.dropped() == 0);
+  }
+  std::string data;
+  char buf[1024];
+  ssize_t n = 0;
+  while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) {
+    data.append(buf, (size_t)n);
+  }
+  ::close(fds[0]);
+  REQUIRE(data == R"({"Scope":"ndt7","Name":"upload","Flow":3,"Time":1234,)"
+                  R"("Value":{"AppInfo":{"NumBytes":17}}})"
+                  "\n");
+  REQUIRE(nlohmann::json::parse(data)["Value"]["AppInfo"]["NumBytes"] == 17);
+}
+
+TEST_CASE("JsonLinesSink drops values spanning many lines") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  {
+    JsonLinesSink sink{fds[1], true};
+    std::string pretty = "{\n  \"TCPInfo\": {\n    \"MinRTT\": 700\n  }\n}";
+    std::string compact = R"({"TCPInfo":{"MinRTT":700}})";
+    ResultRecord record;
+    record.scope = "ndt7";
+    record.name = "download";
+    record.value = pretty.data();
+    record.value_size = pretty.size();
+    sink.on_record(record);
+    record.value = compact.data();
+    record.value_size = compact.size();
+    sink.on_record(record);
+    REQUIRE(sink.flush() == true);
+    REQUIRE(sink.dropped() == 1);
+  }
+  std::string data;
+  char buf[1024];
+  ssize_t n = 0;
+  while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) {
+    data.append(buf, (size_t)n);
+  }
+  ::close(fds[0]);
+  REQUIRE(std::count(data.begin(), data.end(), '\n') == 1);
+  REQUIRE(data.back() == '\n');
+  REQUIRE(nlohmann::json::parse(data)["Value"]["TCPInfo"]["MinRTT"] == 700);
+}
+
+TEST_CASE("Client::ndt7_upload_message_size() honours the settings") {
+  Settings settings;
+  settings.ndt7_upload_message_size = 20000;
+  Client client{settings};
+  auto payload = internal::Payload::Get(65536, false);
+  REQUIRE(client.ndt7_upload_message_size(*payload, 0, 0) == 20000);
+  // Without adaptive mode, the size does not change.
+  REQUIRE(client.ndt7_upload_message_size(*payload, 20000, 1 << 30) == 20000);
+  // The size cannot exceed the payload.
+  settings.ndt7_upload_message_size = 100000;
+  Client large{settings};
+  REQUIRE(large.ndt7_upload_message_size(*payload, 0, 0) == 65536);
+}
+
+TEST_CASE("Client::ndt7_upload_message_size() grows messages when adaptive") {
+  Settings settings;
+  settings.ndt7_adaptive_message_size = true;
+  Client client{settings};
+  auto payload = internal::Payload::Get(65536, false);
+  internal::Size size = client.ndt7_upload_message_size(*payload, 0, 0);
+  REQUIRE(size == 8192);
+  internal::Size total = 0;
+  std::vector<internal::Size> sizes;
+  while (total < (1 << 22)) {
+    total += size;
+    internal::Size next = client.ndt7_upload_message_size(*payload, size, total);
+    if (next != size) {
+      // We only double after sending sixteen times the current size.
+      REQUIRE(total >= 16 * size);
+      REQUIRE(next == 2 * size);
+      sizes.push_back(next);
+    }
+    size = next;
+  }
+  REQUIRE(sizes == std::vector<internal::Size>{16384, 32768, 65536});
+}
+
+#ifdef __linux__
+class MaxTcpInfoSys : public internal::Sys {
+ public:
+  using Sys::Sys;
+  int Getsockopt(internal::Socket, int, int, void *value,
+                 socklen_t *len) const noexcept override {
+    memset(value, 0xff, (size_t)*len);
+    return 0;
+  }
+};
+
+TEST_CASE("Client::ndt7_upload_measurement() writes the TCPInfo fields") {
+  Client client;
+  client.sys.reset(new MaxTcpInfoSys{});
+  std::vector<char> buffer((size_t)ndt7_measurement_bufsiz);
+  Client::Ndt7UploadSample sample;
+  internal::Size size = client.ndt7_upload_measurement(
+      17, 1.5, 1000, buffer.data(), ndt7_measurement_bufsiz, &sample);
+  REQUIRE(size > 0);
+  auto json = nlohmann::json::parse(std::string(buffer.data(), (size_t)size));
+  REQUIRE(json["AppInfo"]["ElapsedTime"] == 1500000);
+  REQUIRE(json["AppInfo"]["NumBytes"] == 1000);
+  REQUIRE(json["TCPInfo"]["ElapsedTime"] == 1500000);
+  REQUIRE(json["TCPInfo"]["TcpiBytesRetrans"] == UINT64_MAX);
+  REQUIRE(json["TCPInfo"]["TcpiState"] == 255);
+  REQUIRE(json["TCPInfo"]["TcpiSndWscale"] == 15);
+  REQUIRE(json["TCPInfo"].size() ==
+          1 + sizeof(ndt7_tcp_info_fields) / sizeof(ndt7_tcp_info_fields[0]));
+  REQUIRE(sample.has_tcpinfo);
+  REQUIRE(sample.bytes_retrans == UINT64_MAX);
+  REQUIRE(sample.bytes_sent == UINT64_MAX);
+
+  REQUIRE(client.ndt7_upload_measurement(17, 1.5, 1000, buffer.data(),
+                                         size - 1, &sample) == 0);
+}
+#endif  // __linux__
+
+TEST_CASE("Client::ndt7_send_measurement() skips what did not fit") {
+  FailNetxSendn client;
+  std::vector<uint8_t> buffer((size_t)(ws_max_header_size + 1));
+  REQUIRE(client.ndt7_send_measurement(17, buffer.data(), 0) ==
+          internal::Err::none);
+  REQUIRE(client.ndt7_send_measurement(17, buffer.data(), 1) ==
+          internal::Err::io_error);
+}
+
+TEST_CASE("Client::ndt7_sum_flows() sums the per-flow counters") {
+  static_assert(sizeof(FlowCounter) >= 2 * cache_line_size,
+                "FlowCounter is not padded");
+  std::vector<std::unique_ptr<Ndt7Flow>> flows;
+  for (uint64_t i = 1; i <= 3; ++i) {
+    flows.emplace_back(new Ndt7Flow);
+    flows.back()->counter.add(i * 1000);
+    flows.back()->counter.add(i);
+  }
+  REQUIRE(Client::ndt7_sum_flows(flows) == 6006);
+}
+
 // Client::netx_maybesocks5h_dial() tests
 // --------------------------------------
 
@@ -2268,6 +4148,139 @@ TEST_CASE("Client::netx_dial() deals with Client::connect() socket error") {
   REQUIRE(client.netx_dial("1.2.3.4", "33", &sock) == internal::Err::io_error);
 }
 
+class SetsockoptSys : public internal::Sys {
+ public:
+  using Sys::Sys;
+  struct Option {
+    int level;
+    int name;
+    int value;
+  };
+  mutable std::vector<Option> options;
+  int result = 0;
+  int Setsockopt(internal::Socket, int level, int name, const void *value,
+                 socklen_t len) const noexcept override {
+    REQUIRE(len == sizeof(int));
+    options.push_back(Option{level, name, *static_cast<const int *>(value)});
+    return result;
+  }
+};
+
+TEST_CASE("Client::netx_tune_socket() does nothing by default") {
+  Client client;
+  auto sys = new SetsockoptSys{};
+  client.sys.reset(sys);
+  client.netx_tune_socket(17);
+  REQUIRE(sys->options.empty());
+}
+
+TEST_CASE("Client::netx_tune_socket() applies the settings") {
+  Settings settings;
+  settings.socket_send_buffer = 1 << 20;
+  settings.socket_recv_buffer = 1 << 21;
+  settings.tcp_notsent_lowat = 1 << 14;
+  Client client{settings};
+  auto sys = new SetsockoptSys{};
+  sys->result = -1;  // failures are not fatal
+  client.sys.reset(sys);
+  client.netx_tune_socket(17);
+#ifdef TCP_NOTSENT_LOWAT
+  REQUIRE(sys->options.size() == 3);
+  REQUIRE(sys->options[2].level == IPPROTO_TCP);
+  REQUIRE(sys->options[2].name == TCP_NOTSENT_LOWAT);
+  REQUIRE(sys->options[2].value == 1 << 14);
+#else
+  REQUIRE(sys->options.size() == 2);
+#endif
+  REQUIRE(sys->options[0].level == SOL_SOCKET);
+  REQUIRE(sys->options[0].name == SO_SNDBUF);
+  REQUIRE(sys->options[0].value == 1 << 20);
+  REQUIRE(sys->options[1].level == SOL_SOCKET);
+  REQUIRE(sys->options[1].name == SO_RCVBUF);
+  REQUIRE(sys->options[1].value == 1 << 21);
+}
+
+class HappyEyeballsSys : public internal::Sys {
+ public:
+  using Sys::Sys;
+  mutable internal::Socket next_sock = 100;
+  mutable std::vector<int> families;
+  mutable std::vector<internal::Socket> closed;
+  int connect_error = OS_EINPROGRESS;
+  internal::Socket NewSocket(int, int, int) const noexcept override {
+    return next_sock++;
+  }
+  int Connect(internal::Socket, const sockaddr *sa,
+              socklen_t) const noexcept override {
+    families.push_back(sa->sa_family);
+    this->SetLastError(connect_error);
+    return -1;
+  }
+  int Getsockopt(internal::Socket, int, int, void *value,
+                 socklen_t *) const noexcept override {
+    *static_cast<int *>(value) = 0;
+    return 0;
+  }
+  int Closesocket(internal::Socket sock) const noexcept override {
+    closed.push_back(sock);
+    return 0;
+  }
+};
+
+class HappyEyeballsClient : public Client {
+ public:
+  using Client::Client;
+  std::vector<std::string> addrs;
+  internal::Socket winner = (internal::Socket)-1;
+  mutable std::vector<size_t> polled;
+  internal::Err netx_resolve(const std::string &,
+                             std::vector<std::string> *v) noexcept override {
+    *v = addrs;
+    return internal::Err::none;
+  }
+  internal::Err netx_setnonblocking(internal::Socket, bool) noexcept override {
+    return internal::Err::none;
+  }
+  internal::Err netx_poll(std::vector<pollfd> *pfds,
+                          int) const noexcept override {
+    polled.push_back(pfds->size());
+    for (auto &pfd : *pfds) {
+      if (pfd.fd == winner) {
+        pfd.revents = POLLOUT;
+        return internal::Err::none;
+      }
+    }
+    return internal::Err::timed_out;
+  }
+};
+
+TEST_CASE("Client::netx_dial() interleaves address families") {
+  HappyEyeballsClient client;
+  client.addrs = {"2001:db8::1", "2001:db8::2", "192.0.2.1"};
+  auto sys = new HappyEyeballsSys{};  // managed by client
+  sys->connect_error = OS_EINVAL;
+  client.sys.reset(sys);
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_dial("ndt.example.com", "33", &sock) ==
+          internal::Err::io_error);
+  REQUIRE(sys->families == (std::vector<int>{AF_INET6, AF_INET, AF_INET6}));
+}
+
+TEST_CASE("Client::netx_dial() starts staggered connect attempts") {
+  HappyEyeballsClient client;
+  client.addrs = {"2001:db8::1", "192.0.2.1", "192.0.2.2"};
+  client.winner = 101;  // i.e., the second attempt, which uses IPv4
+  auto sys = new HappyEyeballsSys{};  // managed by client
+  client.sys.reset(sys);
+  internal::Socket sock = (internal::Socket)-1;
+  REQUIRE(client.netx_dial("ndt.example.com", "33", &sock) ==
+          internal::Err::none);
+  REQUIRE(sock == 101);
+  REQUIRE(client.polled == (std::vector<size_t>{1, 2}));
+  REQUIRE(sys->families == (std::vector<int>{AF_INET6, AF_INET}));
+  REQUIRE(sys->closed == std::vector<internal::Socket>{100});
+}
+
 // Client::netx_recv_nonblocking() tests
 // -------------------------------------
 
@@ -2411,6 +4424,114 @@ TEST_CASE("Client::netx_send() deals with zero send correctly") {
           internal::Err::invalid_argument);
 }
 
+class CountingSend : public internal::Sys {
+ public:
+  using Sys::Sys;
+  std::shared_ptr<internal::Size> sent = std::make_shared<internal::Size>(0);
+  internal::Ssize Send(internal::Socket, const void *,
+                       internal::Size size) const noexcept override {
+    *sent += size;
+    return (internal::Ssize)size;
+  }
+};
+
+class KtlsClient : public Client {
+ public:
+  using Client::Client;
+  bool netx_ktls_send(internal::Socket) const noexcept override {
+    return true;
+  }
+  bool netx_ktls(internal::Socket) const noexcept override { return true; }
+};
+
+static Settings ktls_settings(bool enable) {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.tls_ktls = enable;
+  return settings;
+}
+
+TEST_CASE("Client::netx_send_nonblocking() uses plain sends with kTLS") {
+  KtlsClient client{ktls_settings(true)};
+  auto sys = new CountingSend{};
+  auto sent = sys->sent;
+  client.sys.reset(sys);
+  char buf[1024] = {};
+  internal::Size n = 0;
+  REQUIRE(client.netx_send_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(n == sizeof(buf));
+  REQUIRE(*sent == sizeof(buf));
+}
+
+TEST_CASE("Client::counters() counts the send calls") {
+  Client client;
+  auto sys = new CountingSend{};
+  client.sys.reset(sys);
+  char buf[1024] = {};
+  internal::Size n = 0;
+  REQUIRE(client.netx_send_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(client.netx_send_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  Counters counters = client.counters();
+  REQUIRE(counters.send_calls == 2);
+  REQUIRE(counters.recv_calls == 0);
+  REQUIRE(counters.ssl_write_calls == 0);
+  REQUIRE(counters.syscalls == 2);
+}
+
+TEST_CASE("Client::netx_send_nonblocking() ignores kTLS unless enabled") {
+  KtlsClient client{ktls_settings(false)};
+  auto sys = new CountingSend{};
+  auto sent = sys->sent;
+  client.sys.reset(sys);
+  char buf[1024] = {};
+  internal::Size n = 0;
+  // This fails because there's no SSL for the socket.
+  REQUIRE(client.netx_send_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::invalid_argument);
+  REQUIRE(*sent == 0);
+}
+
+TEST_CASE("Client::netx_ktls_send() deals with sockets without SSL") {
+  Client client{ktls_settings(true)};
+  REQUIRE(client.netx_ktls_send(17) == false);
+}
+
+TEST_CASE("Client::netx_ktls() deals with sockets without SSL") {
+  Client client{ktls_settings(true)};
+  REQUIRE(client.netx_ktls(17) == false);
+}
+
+class BulkRecvSys : public internal::Sys {
+ public:
+  std::shared_ptr<unsigned int> started = std::make_shared<unsigned int>(0);
+  bool StartBulkRecv(internal::Socket) const noexcept override {
+    *started += 1;
+    return true;
+  }
+};
+
+TEST_CASE("Client::netx_start_bulk_recv() does not start bulk recv with kTLS") {
+  Settings settings = ktls_settings(true);
+  settings.io_uring = true;
+  auto sys = new BulkRecvSys{};
+  auto started = sys->started;
+  SECTION("When kTLS is active") {
+    KtlsClient client{settings};
+    client.sys.reset(sys);
+    client.netx_start_bulk_recv(17);
+    REQUIRE(*started == 0);
+  }
+  SECTION("When kTLS is not active") {
+    Client client{settings};
+    client.sys.reset(sys);
+    client.netx_start_bulk_recv(17);
+    REQUIRE(*started == 1);
+  }
+}
+
 // Client::netx_sendn() tests
 // --------------------------
 
@@ -2697,6 +4818,33 @@ class TimeoutPoll : public internal::Sys {
   }
 };
 
+#ifndef _WIN32
+
+class CountingPoll : public internal::Sys {
+ public:
+  using Sys::Sys;
+  std::shared_ptr<nfds_t> nfds = std::make_shared<nfds_t>();
+  int Poll(pollfd *, nfds_t n, int) const noexcept override {
+    *nfds = n;
+    return 1;
+  }
+};
+
+TEST_CASE("Client::netx_poll() deals with many descriptors") {
+  std::vector<pollfd> pfds(1024);
+  Client client;
+  auto sys = new CountingPoll{};  // managed by client
+  client.sys.reset(sys);
+  constexpr int timeout = 100;
+  REQUIRE(client.netx_poll(&pfds, timeout) == internal::Err::none);
+  REQUIRE(*sys->nfds == 1024);
+  Counters counters = client.counters();
+  REQUIRE(counters.poll_calls == 1);
+  REQUIRE(counters.poll_wakeups == 1);
+}
+
+#endif  // !_WIN32
+
 TEST_CASE("Client::netx_poll() deals with timeout") {
   pollfd pfd{};
   constexpr internal::Socket sock = 17;
@@ -2708,6 +4856,9 @@ TEST_CASE("Client::netx_poll() deals with timeout") {
   client.sys.reset(new TimeoutPoll{});
   constexpr int timeout = 100;
   REQUIRE(client.netx_poll(&pfds, timeout) == internal::Err::timed_out);
+  Counters counters = client.counters();
+  REQUIRE(counters.poll_calls == 1);
+  REQUIRE(counters.poll_wakeups == 0);
 }
 
 // Client::query_mlabns_curl() tests
@@ -2756,3 +4907,87 @@ TEST_CASE("Sys::send() deals with too-large buffer") {
   REQUIRE(client.sys->Send(
         0, nullptr, (unsigned long long)OS_SSIZE_MAX + 1) == -1);
 }
+
+// SampleBuffer tests
+// ------------------
+
+static Sample make_sample(double elapsed, uint64_t bytes) {
+  Sample sample;
+  sample.tid = nettest_flag_upload;
+  sample.elapsed = elapsed;
+  sample.bytes = bytes;
+  sample.bytes_delta = bytes / 2;
+  sample.flows.resize(1);
+  sample.flows[0].bytes = bytes;
+  sample.flows[0].tcp_info.valid = true;
+  sample.flows[0].tcp_info.rtt = 1234;
+  return sample;
+}
+
+TEST_CASE("SampleBuffer keeps the latest samples") {
+  SampleBuffer buffer{3};
+  for (uint64_t i = 1; i <= 5; ++i) {
+    buffer.push(make_sample((double)i, i * 100));
+  }
+  REQUIRE(buffer.size() == 3);
+  REQUIRE(buffer.at(0).bytes == 300);
+  REQUIRE(buffer.at(1).bytes == 400);
+  REQUIRE(buffer.at(2).bytes == 500);
+  buffer.clear();
+  REQUIRE(buffer.size() == 0);
+  buffer.push(make_sample(1.0, 7));
+  REQUIRE(buffer.at(0).bytes == 7);
+}
+
+TEST_CASE("SampleBuffer with zero capacity keeps nothing") {
+  SampleBuffer buffer;
+  buffer.push(make_sample(1.0, 1));
+  REQUIRE(buffer.size() == 0);
+}
+
+TEST_CASE("SampleBuffer::write_csv() works") {
+  SampleBuffer buffer{2};
+  buffer.push(make_sample(0.5, 100));
+  std::stringstream ss;
+  REQUIRE(buffer.write_csv(ss));
+  std::string line;
+  REQUIRE(std::getline(ss, line));
+  REQUIRE(line.substr(0, 22) == "tid,elapsed,bytes,byte");
+  REQUIRE(std::getline(ss, line));
+  REQUIRE(line == "2,0.500000,100,50,0,100,1,1234,0,0,0,0,0,0,0,0,0");
+  REQUIRE(!std::getline(ss, line));
+}
+
+TEST_CASE("SampleBuffer::write_jsonl() works") {
+  SampleBuffer buffer{2};
+  buffer.push(make_sample(0.5, 100));
+  buffer.push(make_sample(0.75, 200));
+  std::stringstream ss;
+  REQUIRE(buffer.write_jsonl(ss));
+  std::string line;
+  REQUIRE(std::getline(ss, line));
+  auto json = nlohmann::json::parse(line);
+  REQUIRE(json["TestId"] == nettest_flag_upload);
+  REQUIRE(json["ElapsedTime"] == 0.5);
+  REQUIRE(json["NumBytes"] == 100);
+  REQUIRE(json["Flows"][0]["TCPInfo"]["RTT"] == 1234);
+  REQUIRE(std::getline(ss, line));
+  REQUIRE(nlohmann::json::parse(line)["NumBytes"] == 200);
+  REQUIRE(!std::getline(ss, line));
+}
+
+TEST_CASE("SampleBuffer restores the formatting of the stream") {
+  SampleBuffer buffer{1};
+  buffer.push(make_sample(0.5, 100));
+  std::stringstream ss;
+  ss << std::setprecision(3);
+  auto flags = ss.flags();
+  REQUIRE(buffer.write_csv(ss));
+  REQUIRE(buffer.write_jsonl(ss));
+  REQUIRE(ss.flags() == flags);
+  REQUIRE(ss.precision() == 3);
+  std::stringstream out;
+  out.copyfmt(ss);
+  out << 0.25;
+  REQUIRE(out.str() == "0.25");
+}
@@ -0,0 +1,74 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// This test links with the libndt library, hence it only compiles the
+// declarations, while the definitions come from the library.
+
+#include "libndt/fwd.hpp"
+
+#ifndef LIBNDT_DECLARATIONS_ONLY
+#error "This test must be compiled with LIBNDT_DECLARATIONS_ONLY"
+#endif
+
+#include "third_party/github.com/nlohmann/json/json.hpp"
+
+#include "libndt/libndt.hpp"  // not standalone
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt;
+
+class OfflineClient : public Client {
+ public:
+  using Client::Client;
+  bool query_mlabns(std::vector<std::string> *) noexcept override {
+    queried = true;
+    return false;
+  }
+  void on_complete(bool success) noexcept override {
+    completed = true;
+    succeeded = success;
+  }
+  bool queried = false;
+  bool completed = false;
+  bool succeeded = true;
+};
+
+TEST_CASE("Client works when linking with the library") {
+  OfflineClient client{Settings{}};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.queried);
+  REQUIRE(client.completed);
+  REQUIRE(client.succeeded == false);
+}
+
+// TracingClient overrides on_trace(), which exists whether or not we compiled
+// the library with LIBNDT_TRACING, such that the layout doesn't depend on it.
+class TracingClient : public OfflineClient {
+ public:
+  using OfflineClient::OfflineClient;
+  void on_trace(const TraceEvent &) const noexcept override {}
+};
+
+TEST_CASE("EventHandler::on_trace() does not depend on LIBNDT_TRACING") {
+  TracingClient client{Settings{}};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.completed);
+}
+
+TEST_CASE("SampleBuffer works when linking with the library") {
+  SampleBuffer buffer{1};
+  Sample sample;
+  buffer.push(sample);
+  buffer.push(sample);
+  REQUIRE(buffer.size() == 1);
+  std::stringstream ss;
+  REQUIRE(buffer.write_jsonl(ss));
+  REQUIRE(!ss.str().empty());
+}
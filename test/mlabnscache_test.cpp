@@ -0,0 +1,184 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/mlabnscache.hpp"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+// FakeClockCache is a MlabnsCache where time only moves when we tell it to.
+class FakeClockCache : public MlabnsCache {
+ public:
+  Clock::time_point now = Clock::now();
+
+ protected:
+  Clock::time_point Now() const noexcept override { return now; }
+};
+
+const std::vector<std::string> servers{"ndt.mlab1.trn01.example.org",
+                                       "ndt.mlab1.mil01.example.org"};
+
+// MlabnsCache::Get() and MlabnsCache::Put() tests
+// -----------------------------------------------
+
+TEST_CASE("MlabnsCache::Get() deals with missing entries") {
+  MlabnsCache cache;
+  std::vector<std::string> fqdns;
+  bool refresh = false;
+  REQUIRE(!cache.Get("https://x.org/ndt7", &fqdns, &refresh));
+}
+
+TEST_CASE("MlabnsCache::Get() honours the TTL") {
+  FakeClockCache cache;
+  cache.Put("https://x.org/ndt7", servers, 100);
+  std::vector<std::string> fqdns;
+  bool refresh = true;
+  REQUIRE(cache.Get("https://x.org/ndt7", &fqdns, &refresh));
+  REQUIRE(fqdns == servers);
+  REQUIRE(!refresh);
+  REQUIRE(!cache.Get("https://x.org/ndt_ssl", &fqdns, &refresh));
+
+  cache.now += std::chrono::seconds{80};
+  fqdns.clear();
+  REQUIRE(cache.Get("https://x.org/ndt7", &fqdns, &refresh));
+  REQUIRE(fqdns == servers);
+  REQUIRE(refresh);
+
+  cache.now += std::chrono::seconds{20};
+  REQUIRE(!cache.Get("https://x.org/ndt7", &fqdns, &refresh));
+}
+
+// MlabnsCache::Load() and MlabnsCache::Save() tests
+// -------------------------------------------------
+
+TEST_CASE("MlabnsCache::Load() deals with a missing file") {
+  MlabnsCache cache;
+  REQUIRE(!cache.Load("/nonexistent/mlabns.cache"));
+}
+
+TEST_CASE("MlabnsCache::Save() deals with an unwritable path") {
+  MlabnsCache cache;
+  REQUIRE(!cache.Save("/nonexistent/mlabns.cache"));
+}
+
+TEST_CASE("MlabnsCache::Load() reads what MlabnsCache::Save() wrote") {
+  const char *path = "mlabnscache_test.cache";
+  {
+    FakeClockCache cache;
+    cache.Put("https://x.org/ndt7?policy=geo_options", servers, 100);
+    cache.Put("https://x.org/ndt_ssl", {"ndt.example.org"}, 10);
+    cache.now += std::chrono::seconds{50};
+    REQUIRE(cache.Save(path));
+  }
+  {
+    std::ofstream file{path, std::ios::app};
+    file << "corrupt line\n";
+  }
+  MlabnsCache cache;
+  REQUIRE(cache.Load(path));
+  std::vector<std::string> fqdns;
+  bool refresh = true;
+  REQUIRE(cache.Get("https://x.org/ndt7?policy=geo_options", &fqdns, &refresh));
+  REQUIRE(fqdns == servers);
+  REQUIRE(!refresh);
+  REQUIRE(!cache.Get("https://x.org/ndt_ssl", &fqdns, &refresh));
+  REQUIRE(::remove(path) == 0);
+}
+
+// MlabnsCache::Prefetch() tests
+// -----------------------------
+
+TEST_CASE("MlabnsCache::Prefetch() runs one prefetch at a time") {
+  std::atomic<bool> release{false};
+  std::atomic<int> runs{0};
+  MlabnsCache cache;
+  REQUIRE(cache.Prefetch([&]() {
+    while (!release) {
+      std::this_thread::yield();
+    }
+    runs += 1;
+  }));
+  REQUIRE(!cache.Prefetch([&]() { runs += 100; }));
+  release = true;
+  // Eventually the first prefetch completes and we can start another one.
+  while (!cache.Prefetch([&]() { runs += 10; })) {
+    std::this_thread::yield();
+  }
+  while (runs != 11) {
+    std::this_thread::yield();
+  }
+}
+
+// MlabnsCache::Fetch() tests
+// --------------------------
+
+// RendezvousCurlx is a Curlx where each request waits, for a bounded amount
+// of time, until @p expected requests are running at the same time.
+class RendezvousCurlx : public Curlx {
+ public:
+  using Curlx::Curlx;
+  using Curlx::GetMaybeSOCKS5;
+  std::atomic<int> running{0};
+  int expected = 1;
+  std::mutex mutex;
+  std::set<CURL *> handles;
+  bool GetMaybeSOCKS5(UniqueCurl &handle, const std::string &,
+                      const std::string &, long,
+                      std::string *body) noexcept override {
+    if (!handle) {
+      handle = NewUniqueCurl();
+    }
+    {
+      std::unique_lock<std::mutex> _{mutex};
+      handles.insert(handle.get());
+    }
+    running += 1;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (running < expected && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::yield();
+    }
+    *body = "{}";
+    return running >= expected;
+  }
+};
+
+TEST_CASE("MlabnsCache::Fetch() runs concurrent fetches in parallel") {
+  NoLogger logger;
+  RendezvousCurlx curlx{logger};
+  curlx.expected = 2;
+  MlabnsCache cache;
+  std::atomic<int> successes{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; ++i) {
+    threads.emplace_back([&]() {
+      std::string body;
+      if (cache.Fetch(curlx, "", "https://x.org/ndt7", 1, &body)) {
+        successes += 1;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(successes == 2);
+  REQUIRE(curlx.handles.size() == 2);
+  // The next fetch reuses one of the idle handles.
+  std::string body;
+  REQUIRE(cache.Fetch(curlx, "", "https://x.org/ndt7", 1, &body));
+  REQUIRE(curlx.handles.size() == 2);
+}
+
+TEST_CASE("MlabnsCache::Global() always returns the same cache") {
+  REQUIRE(MlabnsCache::Global() == MlabnsCache::Global());
+}
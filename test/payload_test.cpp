@@ -0,0 +1,57 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/payload.hpp"
+
+#include <stdint.h>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+static bool is_printable(const uint8_t *base, Size count) {
+  for (Size i = 0; i < count; ++i) {
+    if (base[i] < 0x20 || base[i] > 0x7e) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST_CASE("Payload::Get() creates an aligned printable payload") {
+  auto payload = Payload::Get(10000, false);
+  REQUIRE(payload != nullptr);
+  REQUIRE(payload->Length() == 10000);
+  REQUIRE((uintptr_t)payload->Data() % 64 == 0);
+  REQUIRE(is_printable(payload->Data(), payload->Length()));
+  REQUIRE(!payload->HugePages());
+}
+
+TEST_CASE("Payload::Get() shares the payload") {
+  auto first = Payload::Get(4096, false);
+  auto second = Payload::Get(4096, false);
+  REQUIRE(first != nullptr);
+  REQUIRE(first == second);
+  REQUIRE(Payload::Get(8192, false) != first);
+}
+
+TEST_CASE("Payload::Get() falls back to normal pages") {
+  // Whether we get huge pages depends on the system configuration, but
+  // we should always get a usable payload anyway.
+  auto payload = Payload::Get(3 << 20, true);
+  REQUIRE(payload != nullptr);
+  REQUIRE(payload->Length() == 3 << 20);
+  REQUIRE(is_printable(payload->Data(), payload->Length()));
+}
+
+TEST_CASE("Payload::Get() deals with a zero size") {
+  REQUIRE(Payload::Get(0, false) == nullptr);
+}
+
+TEST_CASE("RandomPrintableFill() only writes printable characters") {
+  uint8_t buffer[1024] = {};
+  RandomPrintableFill((char *)buffer, sizeof(buffer));
+  REQUIRE(is_printable(buffer, sizeof(buffer)));
+}
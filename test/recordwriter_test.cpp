@@ -0,0 +1,180 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/recordwriter.hpp"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+static RecordPiece piece(const std::string &s) {
+  RecordPiece p;
+  p.base = s.data();
+  p.count = s.size();
+  return p;
+}
+
+// Reads what is available from @p fd, which must be non blocking.
+static std::string read_available(int fd) {
+  std::string data;
+  char buf[4096];
+  ssize_t n = 0;
+  while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+    data.append(buf, (size_t)n);
+  }
+  return data;
+}
+
+TEST_CASE("FdRecordWriter writes the records in order") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  REQUIRE(::fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  {
+    FdRecordWriter writer{fds[1], true, 1024};
+    std::string a = "{\"a\":", b = "1}\n", c = "{\"b\":2}\n";
+    RecordPiece first[] = {piece(a), piece(b)};
+    REQUIRE(writer.Append(first, 2));
+    RecordPiece second[] = {piece(c)};
+    REQUIRE(writer.Append(second, 1));
+    REQUIRE(writer.Flush());
+    REQUIRE(read_available(fds[0]) == "{\"a\":1}\n{\"b\":2}\n");
+    REQUIRE(writer.Dropped() == 0);
+  }
+  // The writer closed the write end of the pipe.
+  char c = 0;
+  REQUIRE(::read(fds[0], &c, 1) == 0);
+  ::close(fds[0]);
+}
+
+TEST_CASE("FdRecordWriter drops records when the buffer is full") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  REQUIRE(::fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  {
+    FdRecordWriter writer{fds[1], false, 8};
+    std::string large = "0123456789";
+    RecordPiece pieces[] = {piece(large)};
+    REQUIRE(writer.Append(pieces, 1) == false);
+    REQUIRE(writer.Dropped() == 1);
+    std::string small = "01234567";
+    pieces[0] = piece(small);
+    REQUIRE(writer.Append(pieces, 1));
+    REQUIRE(writer.Flush());
+    REQUIRE(read_available(fds[0]) == small);
+  }
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST_CASE("FdRecordWriter writes the records of many threads when destroyed") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  REQUIRE(::fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  std::string expect;
+  std::atomic<int> appended{0};
+  {
+    FdRecordWriter writer{fds[1], true, 4096};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&writer, &appended]() {
+        std::string record = "xxxxxxxxxxxxxxx\n";
+        RecordPiece pieces[] = {piece(record)};
+        for (int j = 0; j < 16; ++j) {
+          appended += writer.Append(pieces, 1) ? 1 : 0;
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  REQUIRE(appended == 64);
+  for (int i = 0; i < 64; ++i) {
+    expect += "xxxxxxxxxxxxxxx\n";
+  }
+  REQUIRE(read_available(fds[0]) == expect);
+  ::close(fds[0]);
+}
+
+TEST_CASE("FdRecordWriter::Flush() deals with write errors") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  ::close(fds[1]);
+  FdRecordWriter writer{fds[1], false, 1024};
+  std::string record = "abc\n";
+  RecordPiece pieces[] = {piece(record)};
+  REQUIRE(writer.Append(pieces, 1));
+  REQUIRE(writer.Flush() == false);
+  ::close(fds[0]);
+}
+
+// Reads the @p count bytes at @p offset of the file at @p path.
+static std::string read_file(const std::string &path, size_t offset,
+                             size_t count) {
+  std::string data(count, '\0');
+  int fd = ::open(path.c_str(), O_RDONLY);
+  REQUIRE(fd != -1);
+  REQUIRE(::pread(fd, &data[0], count, (off_t)offset) == (ssize_t)count);
+  ::close(fd);
+  return data;
+}
+
+static uint64_t read_uint64(const std::string &path, size_t offset) {
+  uint64_t value = 0;
+  std::string data = read_file(path, offset, sizeof(value));
+  memcpy(&value, data.data(), sizeof(value));
+  return value;
+}
+
+TEST_CASE("RingRecordWriter drops records until it is open") {
+  RingRecordWriter writer;
+  std::string record = "abc\n";
+  RecordPiece pieces[] = {piece(record)};
+  REQUIRE(writer.Append(pieces, 1) == false);
+  REQUIRE(writer.Dropped() == 1);
+  REQUIRE(writer.Open("/nonexistent/ring", 16) == false);
+  REQUIRE(writer.Append(pieces, 1) == false);
+  REQUIRE(writer.Dropped() == 2);
+  writer.Drop();
+  REQUIRE(writer.Dropped() == 3);
+}
+
+TEST_CASE("RingRecordWriter wraps around") {
+  char path[] = "/tmp/libndt-ring-XXXXXX";
+  int fd = ::mkstemp(path);
+  REQUIRE(fd != -1);
+  ::close(fd);
+  {
+    RingRecordWriter writer;
+    REQUIRE(writer.Open(path, 16));
+    std::string first = "0123456789", second = "abc", third = "defghij";
+    RecordPiece pieces[] = {piece(first)};
+    REQUIRE(writer.Append(pieces, 1));
+    RecordPiece more[] = {piece(second), piece(third)};
+    REQUIRE(writer.Append(more, 2));
+    std::string large(17, 'x');
+    pieces[0] = piece(large);
+    REQUIRE(writer.Append(pieces, 1) == false);
+    REQUIRE(writer.Dropped() == 1);
+    REQUIRE(writer.Appended() == 20);
+    const size_t header = RingRecordWriter::header_size;
+    REQUIRE(read_uint64(path, 0) == RingRecordWriter::magic);
+    REQUIRE(read_file(path, 0, 8) == "NDTRING1");
+    REQUIRE(read_uint64(path, 8) == 16);
+    REQUIRE(read_uint64(path, 16) == 20);
+    // The oldest byte is at offset 20 % 16 == 4.
+    REQUIRE(read_file(path, header, 16) == "ghij456789abcdef");
+  }
+  ::unlink(path);
+}
@@ -0,0 +1,90 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/sockettable.hpp"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+TEST_CASE("SocketTable::Find() returns nullptr for unknown sockets") {
+  SocketTable<int> table;
+  REQUIRE(table.Find(0) == nullptr);
+  REQUIRE(table.Find(17) == nullptr);
+  REQUIRE(table.Find((Socket)-1) == nullptr);
+  REQUIRE(table.Find((Socket)SocketTable<int>::array_size) == nullptr);
+}
+
+TEST_CASE("SocketTable::Insert() stores the state of a socket") {
+  SocketTable<int> table;
+  int *state = table.Insert(17, std::unique_ptr<int>{new int{42}});
+  REQUIRE(state != nullptr);
+  REQUIRE(table.Find(17) == state);
+  REQUIRE(*table.Find(17) == 42);
+  REQUIRE(table.Find(16) == nullptr);
+  // Inserting again replaces the state.
+  table.Insert(17, std::unique_ptr<int>{new int{43}});
+  REQUIRE(*table.Find(17) == 43);
+}
+
+TEST_CASE("SocketTable deals with sockets that do not fit the array") {
+  SocketTable<int> table;
+  auto large = (Socket)(SocketTable<int>::array_size + 100);
+  int *state = table.Insert(large, std::unique_ptr<int>{new int{42}});
+  REQUIRE(table.Find(large) == state);
+  REQUIRE(table.Find(large + 1) == nullptr);
+  auto removed = table.Remove(large);
+  REQUIRE(removed.get() == state);
+  REQUIRE(table.Find(large) == nullptr);
+  REQUIRE(table.Remove(large) == nullptr);
+}
+
+TEST_CASE("SocketTable::Remove() returns the state of a socket") {
+  SocketTable<int> table;
+  int *state = table.Insert(3, std::unique_ptr<int>{new int{42}});
+  int *other = table.Insert(4, std::unique_ptr<int>{new int{43}});
+  auto removed = table.Remove(3);
+  REQUIRE(removed.get() == state);
+  REQUIRE(table.Find(3) == nullptr);
+  REQUIRE(table.Remove(3) == nullptr);
+  // Removing a socket does not move the state of other sockets.
+  REQUIRE(table.Find(4) == other);
+}
+
+TEST_CASE("SocketTable ignores invalid sockets") {
+  SocketTable<int> table;
+  REQUIRE(table.Remove((Socket)-1) == nullptr);
+}
+
+TEST_CASE("SocketTable deals with many threads using large sockets") {
+  SocketTable<int> table;
+  auto large = (Socket)(SocketTable<int>::array_size * 4 + 100);
+  int *state = table.Insert(large, std::unique_ptr<int>{new int{42}});
+  std::atomic<bool> done{false};
+  std::vector<std::thread> threads;
+  for (int i = 1; i <= 4; ++i) {
+    threads.emplace_back([&table, &done, large, i]() {
+      while (!done) {
+        auto other = (Socket)(large + i * 4);
+        table.Insert(other, std::unique_ptr<int>{new int{i}});
+        (void)table.Remove(other);
+      }
+    });
+  }
+  bool found = true;
+  for (int i = 0; i < 100000; ++i) {
+    found = found && table.Find(large) == state;
+  }
+  done = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(found);
+}
@@ -0,0 +1,180 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/sslcache.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+// Server is a TLS server using a self signed certificate that we generate
+// on the fly, to which we connect using an in memory BIO pair.
+class Server {
+ public:
+  Server() noexcept {
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    REQUIRE(kctx != nullptr);
+    REQUIRE(EVP_PKEY_keygen_init(kctx) == 1);
+    REQUIRE(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+                kctx, NID_X9_62_prime256v1) == 1);
+    REQUIRE(EVP_PKEY_keygen(kctx, &pkey) == 1);
+    EVP_PKEY_CTX_free(kctx);
+    cert = X509_new();
+    REQUIRE(cert != nullptr);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    REQUIRE(X509_set_pubkey(cert, pkey) == 1);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"localhost", -1, -1, 0);
+    REQUIRE(X509_set_issuer_name(cert, name) == 1);
+    REQUIRE(X509_sign(cert, pkey, EVP_sha256()) > 0);
+    ctx = SSL_CTX_new(TLS_server_method());
+    REQUIRE(ctx != nullptr);
+    REQUIRE(SSL_CTX_use_certificate(ctx, cert) == 1);
+    REQUIRE(SSL_CTX_use_PrivateKey(ctx, pkey) == 1);
+  }
+
+  ~Server() noexcept {
+    SSL_CTX_free(ctx);
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+  }
+
+  // Connect performs a handshake with @p client and exchanges a message,
+  // such that @p client processes the session tickets. Returns whether the
+  // client resumed a previous session.
+  bool Connect(SSL *client) noexcept {
+    SSL *server = SSL_new(ctx);
+    REQUIRE(server != nullptr);
+    BIO *cbio = nullptr;
+    BIO *sbio = nullptr;
+    REQUIRE(BIO_new_bio_pair(&cbio, 0, &sbio, 0) == 1);
+    SSL_set_bio(client, cbio, cbio);
+    SSL_set_bio(server, sbio, sbio);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+    bool client_done = false;
+    bool server_done = false;
+    for (int i = 0; i < 100 && (!client_done || !server_done); ++i) {
+      client_done = client_done || SSL_do_handshake(client) == 1;
+      server_done = server_done || SSL_do_handshake(server) == 1;
+    }
+    REQUIRE(client_done);
+    REQUIRE(server_done);
+    REQUIRE(SSL_write(server, "x", 1) == 1);
+    char c = 0;
+    REQUIRE(SSL_read(client, &c, 1) == 1);
+    REQUIRE(c == 'x');
+    bool reused = SSL_session_reused(client) != 0;
+    // Like Client::netx_closesocket(), send close_notify, otherwise OpenSSL
+    // would mark the session as not resumable when we free the client.
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    SSL_free(server);
+    return reused;
+  }
+
+  EVP_PKEY *pkey = nullptr;
+  X509 *cert = nullptr;
+  SSL_CTX *ctx = nullptr;
+};
+
+TEST_CASE("SslCache::Context() caches contexts") {
+  SslCache cache;
+  SSL_CTX *ctx = cache.Context("", false);
+  REQUIRE(ctx != nullptr);
+  REQUIRE(cache.Context("", false) == ctx);
+  REQUIRE(cache.Context("/nonexistent/ca.pem", false) == ctx);
+}
+
+TEST_CASE("SslCache::Context() deals with a nonexistent CA bundle") {
+  SslCache cache;
+  REQUIRE(cache.Context("/nonexistent/ca.pem", true) == nullptr);
+}
+
+TEST_CASE("SslCache::Global() always returns the same cache") {
+  REQUIRE(SslCache::Global() == SslCache::Global());
+}
+
+TEST_CASE("SslCache resumes sessions for the same key") {
+  Server server;
+  SslCache cache;
+  SSL_CTX *ctx = cache.Context("", false);
+  REQUIRE(ctx != nullptr);
+  {
+    SSL *ssl = SSL_new(ctx);
+    REQUIRE(cache.Prepare(ssl, "ndt.example.com"));
+    REQUIRE(server.Connect(ssl) == false);
+    SSL_free(ssl);
+  }
+  REQUIRE(cache.HasSession(ctx, "ndt.example.com"));
+  REQUIRE(!cache.HasSession(ctx, "ndt.example.org"));
+  {
+    SSL *ssl = SSL_new(ctx);
+    REQUIRE(cache.Prepare(ssl, "ndt.example.com"));
+    REQUIRE(server.Connect(ssl) == true);
+    SSL_free(ssl);
+  }
+  {
+    SSL *ssl = SSL_new(ctx);
+    REQUIRE(cache.Prepare(ssl, "ndt.example.org"));
+    REQUIRE(server.Connect(ssl) == false);
+    SSL_free(ssl);
+  }
+}
+
+TEST_CASE("SslCache does not resume sessions across contexts") {
+  Server server;
+  // Write the certificate of the server as CA bundle, such that we can
+  // create a context that verifies the peer.
+  char path[] = "/tmp/sslcache_test_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE(fd >= 0);
+  FILE *fp = fdopen(fd, "w");
+  REQUIRE(fp != nullptr);
+  REQUIRE(PEM_write_X509(fp, server.cert) == 1);
+  REQUIRE(fclose(fp) == 0);
+  SslCache cache;
+  SSL_CTX *insecure = cache.Context("", false);
+  REQUIRE(insecure != nullptr);
+  SSL_CTX *secure = cache.Context(path, true);
+  REQUIRE(secure != nullptr);
+  REQUIRE(secure != insecure);
+  REQUIRE(unlink(path) == 0);
+  {
+    SSL *ssl = SSL_new(insecure);
+    REQUIRE(cache.Prepare(ssl, "localhost:443"));
+    REQUIRE(server.Connect(ssl) == false);
+    SSL_free(ssl);
+  }
+  REQUIRE(cache.HasSession(insecure, "localhost:443"));
+  REQUIRE(!cache.HasSession(secure, "localhost:443"));
+  {
+    SSL *ssl = SSL_new(secure);
+    REQUIRE(cache.Prepare(ssl, "localhost:443"));
+    REQUIRE(server.Connect(ssl) == false);
+    SSL_free(ssl);
+  }
+  REQUIRE(cache.HasSession(secure, "localhost:443"));
+  {
+    SSL *ssl = SSL_new(secure);
+    REQUIRE(cache.Prepare(ssl, "localhost:443"));
+    REQUIRE(server.Connect(ssl) == true);
+    SSL_free(ssl);
+  }
+}
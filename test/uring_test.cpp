@@ -0,0 +1,184 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/uring.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+// Returns the @p count bytes we send in the tests.
+static std::string pattern(size_t count) {
+  std::string data;
+  for (size_t i = 0; i < count; ++i) {
+    data += (char)('A' + i % 26);
+  }
+  return data;
+}
+
+// Receives from @p fd until EOF, polling when there is no data.
+static bool recv_all(const UringSys &sys, Socket fd, std::string *data) {
+  char buf[10000];  // not a multiple of UringSys::bufsize
+  for (;;) {
+    Ssize n = sys.Recv(fd, buf, sizeof(buf));
+    if (n == 0) {
+      return true;
+    }
+    if (n > 0) {
+      data->append(buf, (size_t)n);
+      continue;
+    }
+    if (errno != EAGAIN) {
+      return false;
+    }
+    pollfd pfd{};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (sys.Poll(&pfd, 1, 5000) != 1 || pfd.revents != POLLIN) {
+      return false;
+    }
+  }
+}
+
+TEST_CASE("Sys does not start bulk recv") {
+  Sys sys;
+  REQUIRE(sys.StartBulkRecv(0) == false);
+}
+
+TEST_CASE("UringSys receives more data than its buffers") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  UringSys sys;
+  if (!sys.StartBulkRecv(fds[0])) {
+    WARN("io_uring not available; skipping");
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return;
+  }
+  REQUIRE(sys.StartBulkRecv(fds[0]) == true);  // idempotent
+  // Send more than nbufs * bufsize, such that the kernel runs out of buffers
+  // and we need to submit the recv again.
+  std::string expect = pattern(4 * UringSys::nbufs * UringSys::bufsize + 17);
+  std::thread writer{[&expect, &fds]() {
+    size_t off = 0;
+    while (off < expect.size()) {
+      ssize_t n = ::send(fds[1], expect.data() + off, expect.size() - off, 0);
+      if (n <= 0) {
+        break;
+      }
+      off += (size_t)n;
+    }
+    ::close(fds[1]);
+  }};
+  std::string data;
+  bool ok = recv_all(sys, fds[0], &data);
+  writer.join();
+  REQUIRE(ok);
+  REQUIRE(data.size() == expect.size());
+  REQUIRE(data == expect);
+  REQUIRE(sys.Closesocket(fds[0]) == 0);
+}
+
+TEST_CASE("UringSys::Poll() times out when there is no data") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  UringSys sys;
+  if (!sys.StartBulkRecv(fds[0])) {
+    WARN("io_uring not available; skipping");
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return;
+  }
+  char c = 0;
+  REQUIRE(sys.Recv(fds[0], &c, 1) == -1);
+  REQUIRE(errno == EAGAIN);
+  pollfd pfd{};
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  REQUIRE(sys.Poll(&pfd, 1, 10) == 0);
+  REQUIRE(pfd.revents == 0);
+  // Closing with the recv still active cancels it.
+  REQUIRE(sys.Closesocket(fds[0]) == 0);
+  ::close(fds[1]);
+}
+
+TEST_CASE("UringSys::Poll() deals with bulk recv and other sockets") {
+  int bulk[2], other[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, bulk) == 0);
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, other) == 0);
+  UringSys sys;
+  if (!sys.StartBulkRecv(bulk[0])) {
+    WARN("io_uring not available; skipping");
+    for (int fd : {bulk[0], bulk[1], other[0], other[1]}) {
+      ::close(fd);
+    }
+    return;
+  }
+  REQUIRE(::send(bulk[1], "x", 1, 0) == 1);
+  pollfd pfds[2] = {};
+  pfds[0].fd = bulk[0];
+  pfds[0].events = POLLIN | POLLOUT;
+  pfds[1].fd = other[0];
+  pfds[1].events = POLLIN;
+  REQUIRE(sys.Poll(pfds, 2, 5000) == 1);
+  REQUIRE(pfds[0].revents == (POLLIN | POLLOUT));
+  REQUIRE(pfds[1].revents == 0);
+  char c = 0;
+  REQUIRE(sys.Recv(bulk[0], &c, 1) == 1);
+  REQUIRE(c == 'x');
+  // Sockets without bulk recv use recv(2).
+  REQUIRE(::send(other[1], "y", 1, 0) == 1);
+  pfds[0].events = POLLIN;
+  REQUIRE(sys.Poll(pfds, 2, 5000) == 1);
+  REQUIRE(pfds[0].revents == 0);
+  REQUIRE(pfds[1].revents == POLLIN);
+  REQUIRE(sys.Recv(other[0], &c, 1) == 1);
+  REQUIRE(c == 'y');
+  REQUIRE(sys.Closesocket(bulk[0]) == 0);
+  REQUIRE(sys.Closesocket(other[0]) == 0);
+  ::close(bulk[1]);
+  ::close(other[1]);
+}
+
+TEST_CASE("UringSys::Poll() deals with many sockets") {
+  constexpr nfds_t count = 10;  // more than we keep on the stack
+  int pairs[count][2];
+  for (auto &pair : pairs) {
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  }
+  UringSys sys;
+  if (!sys.StartBulkRecv(pairs[0][0])) {
+    WARN("io_uring not available; skipping");
+    for (auto &pair : pairs) {
+      ::close(pair[0]);
+      ::close(pair[1]);
+    }
+    return;
+  }
+  REQUIRE(::send(pairs[0][1], "x", 1, 0) == 1);
+  REQUIRE(::send(pairs[count - 1][1], "y", 1, 0) == 1);
+  pollfd pfds[count] = {};
+  for (nfds_t i = 0; i < count; ++i) {
+    pfds[i].fd = pairs[i][0];
+    pfds[i].events = POLLIN;
+  }
+  REQUIRE(sys.Poll(pfds, count, 5000) == 2);
+  REQUIRE(pfds[0].revents == POLLIN);
+  for (nfds_t i = 1; i < count - 1; ++i) {
+    REQUIRE(pfds[i].revents == 0);
+  }
+  REQUIRE(pfds[count - 1].revents == POLLIN);
+  for (auto &pair : pairs) {
+    REQUIRE(sys.Closesocket(pair[0]) == 0);
+    ::close(pair[1]);
+  }
+}
@@ -0,0 +1,73 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libndt/internal/wsmask.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+
+using namespace measurement_kit::libndt::internal;
+
+static std::vector<uint8_t> make_pattern(Size count) {
+  std::vector<uint8_t> v;
+  for (Size i = 0; i < count; ++i) {
+    v.push_back((uint8_t)((i * 31 + 7) & 0xff));
+  }
+  return v;
+}
+
+TEST_CASE("WsMaskImpls() always starts with the reference implementation") {
+  auto impls = WsMaskImpls();
+  REQUIRE(impls.size() >= 2);
+  REQUIRE(impls[0].func == WsMaskBytewise);
+}
+
+TEST_CASE("WsMaskBytewise() works as specified by RFC6455") {
+  const uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+  // Example taken from RFC6455 Sect. 5.7 ("Hello").
+  uint8_t data[] = {'H', 'e', 'l', 'l', 'o'};
+  const uint8_t expect[] = {0x7f, 0x9f, 0x4d, 0x51, 0x58};
+  WsMaskBytewise(data, sizeof(data), mask);
+  REQUIRE(memcmp(data, expect, sizeof(data)) == 0);
+}
+
+TEST_CASE("All WsMask kernels agree with the reference implementation") {
+  const uint8_t mask[] = {0xde, 0xad, 0xbe, 0xef};
+  for (auto &impl : WsMaskImpls()) {
+    // Use all sizes up to a few SIMD blocks and misaligned bases, so that we
+    // exercise the vector loop, the word loop and the bytewise tail.
+    bool equal = true;
+    for (Size offset = 0; offset < 8; ++offset) {
+      for (Size count = 0; count < 200; ++count) {
+        auto expect = make_pattern(offset + count);
+        auto data = expect;
+        WsMaskBytewise(expect.data() + offset, count, mask);
+        impl.func(data.data() + offset, count, mask);
+        equal = equal && expect == data;
+      }
+    }
+    INFO(impl.name);
+    REQUIRE(equal);
+  }
+}
+
+TEST_CASE("WsMask() is an involution") {
+  const uint8_t mask[] = {0x01, 0x02, 0x03, 0x04};
+  auto expect = make_pattern(65537);
+  auto data = expect;
+  WsMask(data.data(), data.size(), mask);
+  REQUIRE(data != expect);
+  WsMask(data.data(), data.size(), mask);
+  REQUIRE(data == expect);
+}
+
+TEST_CASE("WsMask() deals with zero bytes and a null base") {
+  const uint8_t mask[] = {0x01, 0x02, 0x03, 0x04};
+  WsMask(nullptr, 0, mask);
+}